@@ -0,0 +1,176 @@
+/* bmp.c - read indexed BMP splash images into a struct xpm */
+
+#include <grub/efi/api.h>
+#include <grub/efi/efi.h>
+#include <grub/misc.h>
+#include <grub/types.h>
+
+#include "xpm.h"
+
+/* the file header and the BITMAPINFOHEADER which follows it; later
+ * versions of the latter only add fields at the end
+ */
+struct bmp_header {
+    grub_uint8_t magic[2];
+    grub_uint32_t file_size;
+    grub_uint32_t reserved;
+    grub_uint32_t offset;
+
+    grub_uint32_t info_size;
+    grub_int32_t width;
+    grub_int32_t height;
+    grub_uint16_t planes;
+    grub_uint16_t bits;
+    grub_uint32_t compression;
+    grub_uint32_t image_size;
+    grub_int32_t xres;
+    grub_int32_t yres;
+    grub_uint32_t colors;
+    grub_uint32_t important;
+} __attribute__ ((packed));
+
+#define BMP_FILE_HEADER_SIZE 14
+
+#define BI_RGB 0
+#define BI_RLE8 1
+
+static grub_uint8_t bmp_row[XPM_MAX_WIDTH];
+
+/* rows are stored bottom up, unless the height is negative */
+static int
+bmp_row_y(struct xpm *xpm, int row, int top_down)
+{
+    return top_down ? row : xpm->height - 1 - row;
+}
+
+static int
+bmp_read_rgb(struct xpm *xpm, int bits, int top_down)
+{
+    const int stride = ((xpm->width * bits + 31) / 32) * 4;
+    const int mask = (1 << bits) - 1;
+    int row, x;
+
+    for (row = 0; row < xpm->height; row++) {
+        int y = bmp_row_y(xpm, row, top_down);
+
+        if (grub_read((char *)bmp_row, stride) != stride)
+            return 0;
+
+        for (x = 0; x < xpm->width; x++) {
+            int bit = x * bits;
+            int idx = (bmp_row[bit / 8] >> (8 - bits - bit % 8)) & mask;
+
+            xpm_set_pixel_idx(xpm, x, y, idx);
+        }
+    }
+    return 1;
+}
+
+/* runs of one index, and escapes for the end of a row, the end of the
+ * image, a jump, or a run of indices given one by one
+ */
+static int
+bmp_read_rle8(struct xpm *xpm, int top_down)
+{
+    char count, idx;
+    int row = 0, x = 0, n, i;
+
+    while (row < xpm->height) {
+        if (!grub_read_byte(&count) || !grub_read_byte(&idx))
+            return 0;
+
+        n = (unsigned char)count;
+        if (n) {
+            while (n-- && x < xpm->width)
+                xpm_set_pixel_idx(xpm, x++, bmp_row_y(xpm, row, top_down),
+                                  (unsigned char)idx);
+            continue;
+        }
+
+        switch ((unsigned char)idx) {
+        case 0:
+            x = 0;
+            row++;
+            break;
+        case 1:
+            return 1;
+        case 2:
+            if (!grub_read_byte(&count) || !grub_read_byte(&idx))
+                return 0;
+            x += (unsigned char)count;
+            row += (unsigned char)idx;
+            break;
+        default:
+            /* padded to 16 bits */
+            n = ((unsigned char)idx + 1) & ~1;
+            for (i = 0; i < n; i++) {
+                if (!grub_read_byte(&count))
+                    return 0;
+                if (i < (unsigned char)idx && x < xpm->width)
+                    xpm_set_pixel_idx(xpm, x++, bmp_row_y(xpm, row, top_down),
+                                      (unsigned char)count);
+            }
+            break;
+        }
+    }
+    return 1;
+}
+
+/* Decode the BMP file which has been opened, at any position, into XPM.
+ * Only 4 and 8 bit images with up to 32 colors, as many as a struct xpm
+ * holds, are taken, either as they are or with RLE8.
+ */
+int
+bmp_read(struct xpm *xpm)
+{
+    struct bmp_header hdr;
+    grub_uint8_t quad[4];
+    int top_down;
+    unsigned int i;
+
+    grub_seek(0);
+    if (grub_read((char *)&hdr, sizeof (hdr)) != sizeof (hdr))
+        return 0;
+    if (hdr.magic[0] != 'B' || hdr.magic[1] != 'M'
+            || hdr.info_size < sizeof (hdr) - BMP_FILE_HEADER_SIZE
+            || hdr.planes != 1)
+        return 0;
+
+    if (hdr.bits != 4 && hdr.bits != 8)
+        return 0;
+    if (hdr.compression != BI_RGB
+            && (hdr.compression != BI_RLE8 || hdr.bits != 8))
+        return 0;
+
+    top_down = hdr.height < 0;
+    xpm->width = hdr.width;
+    xpm->height = top_down ? -hdr.height : hdr.height;
+    if (xpm->width <= 0 || xpm->width > XPM_MAX_WIDTH
+            || xpm->height <= 0 || xpm->height > XPM_MAX_HEIGHT) {
+        grub_printf("BMP size %dx%d is larger than %dx%d\n",
+                xpm->width, xpm->height, XPM_MAX_WIDTH, XPM_MAX_HEIGHT);
+        return 0;
+    }
+
+    xpm->colors = hdr.colors ? hdr.colors : 1U << hdr.bits;
+    if (xpm->colors > (int)(sizeof (xpm->palette) / sizeof (xpm->palette[0]))) {
+        grub_printf("BMP has %d colors, more than %d\n", xpm->colors,
+                (int)(sizeof (xpm->palette) / sizeof (xpm->palette[0])));
+        return 0;
+    }
+
+    grub_seek(BMP_FILE_HEADER_SIZE + hdr.info_size);
+    for (i = 0; i < (unsigned int)xpm->colors; i++) {
+        if (grub_read((char *)quad, 4) != 4)
+            return 0;
+        xpm->palette[i].blue = quad[0];
+        xpm->palette[i].green = quad[1];
+        xpm->palette[i].red = quad[2];
+    }
+
+    if (grub_seek(hdr.offset) < 0)
+        return 0;
+    if (hdr.compression == BI_RLE8)
+        return bmp_read_rle8(xpm, top_down);
+    return bmp_read_rgb(xpm, hdr.bits, top_down);
+}
@@ -16,15 +16,15 @@ static grub_efi_guid_t DHCP4SbProtocol = EFI_DHCP4_SERVICE_BINDING_PROTOCOL_GUID
 static grub_efi_guid_t PxeDHCP4Protocol = EFI_PXE_DHCP4_PROTOCOL_GUID;
 
 
-typedef EFI_STATUS (*EFI_DHCP4_GET_MODE_DATA)();
-typedef EFI_STATUS (*EFI_DHCP4_CONFIGURE)();
-typedef EFI_STATUS (*EFI_DHCP4_START)();
-typedef EFI_STATUS (*EFI_DHCP4_RENEW_REBIND)();
-typedef EFI_STATUS (*EFI_DHCP4_RELEASE)();
-typedef EFI_STATUS (*EFI_DHCP4_STOP)();
-typedef EFI_STATUS (*EFI_DHCP4_BUILD)();
-typedef EFI_STATUS (*EFI_DHCP4_TRANSMIT_RECIEVE)();
-typedef EFI_STATUS (*EFI_DHCP4_PARSE)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_GET_MODE_DATA)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_CONFIGURE)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_START)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_RENEW_REBIND)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_RELEASE)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_STOP)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_BUILD)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_TRANSMIT_RECIEVE)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_PARSE)();
 
 typedef struct _EFI_DHCP4_PROTOCOL {
 	EFI_DHCP4_GET_MODE_DATA GetModeData;
@@ -98,7 +98,7 @@ typedef struct {
 	grub_efi_uint8_t Data[1];
 } EFI_DHCP4_PACKET_OPTION;
 
-typedef EFI_STATUS (*EFI_DHCP4_CALLBACK) (
+typedef EFI_STATUS (GRUB_EFI_API *EFI_DHCP4_CALLBACK) (
 	EFI_DHCP4_PROTOCOL *This,
 	void *Context,
 	EFI_DHCP4_STATE CurrentState,
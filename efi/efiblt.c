@@ -0,0 +1,541 @@
+/* efiblt.c - drawing shared by the UGA and graphics output backends */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright 2007 Red Hat, Inc.
+ *  Copyright (C) 2007 Intel Corp.
+ *  Copyright (C) 2001,2002  Red Hat, Inc.
+ *  Portions copyright (C) 2000  Conectiva, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef SUPPORT_GRAPHICS
+
+#include <grub/misc.h>
+#include <grub/types.h>
+#include <grub/cpu/linux.h>
+#include <grub/efi/api.h>
+#include <grub/efi/efi.h>
+
+#include <term.h>
+#include <shared.h>
+#include <graphics.h>
+
+#include "graphics.h"
+#include "efiblt.h"
+#include "xpm.h"
+
+#ifndef MIN
+#define MIN(x,y) ( ((x) < (y)) ? (x) : (y))
+#endif
+#ifndef MAX
+#define MAX(x,y) ( ((x) < (y)) ? (y) : (x))
+#endif
+
+static const unsigned char cga_colors[BLT_PALETTE + 1][3] = {
+    { 0x00, 0x00, 0x00 }, //  0 Black
+    { 0x7f, 0x00, 0x00 }, //  1 Dark Red
+    { 0x00, 0x7f, 0x00 }, //  2 Dark Green
+    { 0x7f, 0x7f, 0x00 }, //  3 Dark Yellow
+    { 0x00, 0x00, 0x7f }, //  4 Dark Blue
+    { 0x7f, 0x00, 0x7f }, //  5 Dark Magenta
+    { 0x00, 0x7f, 0x7f }, //  6 Dark Cyan
+    { 0xc0, 0xc0, 0xc0 }, //  7 Light Grey
+    { 0x7f, 0x7f, 0x7f }, //  8 Dark Grey
+    { 0xff, 0x00, 0x00 }, //  9 Red
+    { 0x00, 0xff, 0x00 }, // 10 Green
+    { 0xff, 0xff, 0x00 }, // 11 Yellow
+    { 0x00, 0x00, 0xff }, // 12 Blue
+    { 0xff, 0x00, 0xff }, // 13 Magenta
+    { 0x00, 0xff, 0xff }, // 14 Cyan
+    { 0xff, 0xff, 0xff }, // 15 White
+    { 0xff, 0xff, 0xff }, // 16 Also white ;)
+};
+
+static void
+rgb_to_pixel(int red, int green, int blue, blt_pixel_t *pixel)
+{
+    pixel->red = red;
+    pixel->green = green;
+    pixel->blue = blue;
+}
+
+struct bltbuf *
+alloc_bltbuf(grub_efi_uintn_t width, grub_efi_uintn_t height)
+{
+	struct bltbuf *buf = NULL;
+	grub_efi_uintn_t pixbuf_size = width * height * sizeof (blt_pixel_t);
+
+	if (!(buf = grub_malloc(sizeof(buf->width) + sizeof(buf->height) +
+				pixbuf_size)))
+		return NULL;
+
+	buf->width = width;
+	buf->height = height;
+	grub_memset(buf->pixbuf, '\0', pixbuf_size);
+	return buf;
+}
+
+void
+blt_init(struct blt *blt, const struct blt_ops *ops)
+{
+    int i;
+
+    blt->ops = ops;
+    for (i = 0; i <= BLT_PALETTE; i++)
+        rgb_to_pixel(cga_colors[i][0], cga_colors[i][1], cga_colors[i][2],
+                     &blt->palette[i]);
+    blt->glyph_rows_valid = 0;
+}
+
+void
+blt_position_to_phys(struct blt *blt, position_t *virt, position_t *phys)
+{
+    phys->x = virt->x + blt->screen_pos.x;
+    phys->y = virt->y + blt->screen_pos.y;
+}
+
+static void
+bltbuf_set_pixel(struct bltbuf *bltbuf, position_t *pos, blt_pixel_t *pixel)
+{
+    if (pos->x < 0 || pos->x >= bltbuf->width)
+        return;
+    if (pos->y < 0 || pos->y >= bltbuf->height)
+        return;
+    bltbuf->pixbuf[pos->x + pos->y * bltbuf->width] = *pixel;
+}
+
+static void
+bltbuf_set_pixel_rgb(struct bltbuf *bltbuf, position_t *pos,
+                     int red, int green, int blue)
+{
+    blt_pixel_t pixel;
+
+    grub_memset(&pixel, '\0', sizeof (pixel));
+    rgb_to_pixel(red, green, blue, &pixel);
+    bltbuf_set_pixel(bltbuf, pos, &pixel);
+}
+
+/* Make the splash image SCALE times as large, in the pixels the
+ * backends take.  Its palette is converted once, and each row is built
+ * once and then copied for the rows it is repeated in.
+ */
+static struct bltbuf *
+xpm_to_bltbuf(struct xpm *xpm, int scale)
+{
+    struct bltbuf *bltbuf = NULL;
+    blt_pixel_t palette[256];
+    blt_pixel_t *row;
+    int i, x, y;
+
+    if (!(bltbuf = alloc_bltbuf(xpm->width * scale, xpm->height * scale)))
+        return NULL;
+
+    for (i = 0; i < 256; i++) {
+        xpm_pixel_t xpl;
+
+        xpm_get_idx(xpm, i, &xpl);
+        rgb_to_pixel(xpl.red, xpl.green, xpl.blue, &palette[i]);
+        palette[i].reserved = 0;
+    }
+
+    for (y = 0; y < xpm->height; y++) {
+        const unsigned char *idx = &xpm->image[y * xpm->width];
+
+        row = &bltbuf->pixbuf[y * scale * bltbuf->width];
+        for (x = 0; x < bltbuf->width; x++)
+            row[x] = palette[idx[x / scale]];
+        for (i = 1; i < scale; i++)
+            grub_memmove(row + i * bltbuf->width, row,
+                         bltbuf->width * sizeof (*row));
+    }
+
+    return bltbuf;
+}
+
+/* Convert the splash image, if there is one, for the current mode: as
+ * many times as large as fits on the screen, and centered on it.  The
+ * text area is where it is in the image.
+ */
+static void
+blt_set_background(struct graphics_backend *backend)
+{
+    struct blt *blt = backend->priv;
+    struct xpm *xpm = graphics_get_splash_xpm();
+    position_t size;
+    int scale;
+
+    if (blt->background) {
+        grub_free(blt->background);
+        blt->background = NULL;
+    }
+    if (!xpm || xpm->width <= 0 || xpm->height <= 0)
+        return;
+
+    backend->get_screen_size(backend, &size);
+    scale = MAX(1, MIN(size.x / xpm->width, size.y / xpm->height));
+
+    blt->background = xpm_to_bltbuf(xpm, scale);
+    if (!blt->background)
+        return;
+
+    blt->background_pos.x = (size.x - (int)blt->background->width) / 2;
+    blt->background_pos.y = (size.y - (int)blt->background->height) / 2;
+    blt->text_in_background.x =
+        MAX(0, blt->screen_pos.x - blt->background_pos.x);
+    blt->text_in_background.y =
+        MAX(0, blt->screen_pos.y - blt->background_pos.y);
+}
+
+/* Cover the screen with a checkerboard of 16 pixel squares, so that
+ * what is drawn over it afterwards shows where it went.
+ */
+static void
+blt_debug_pattern(struct blt *blt, position_t size)
+{
+    struct bltbuf *bltbuf;
+    position_t pos = {0, 0};
+    unsigned char r = 0 ,g = 0;
+
+    bltbuf = alloc_bltbuf(size.x, size.y);
+    if (!bltbuf)
+        return;
+
+    for (pos.y = 0; pos.y < size.y; pos.y++) {
+        if (pos.y % 16 == 0) {
+            g = g == 0 ? 7 : 0;
+            r = g == 0 ? 7 : 0;
+        }
+        for (pos.x = 0; pos.x < size.x; pos.x++) {
+            if (pos.x % 16 == 0) {
+                g = g == 0 ? 7 : 0;
+                r = g == 0 ? 7 : 0;
+            }
+            bltbuf_set_pixel_rgb(bltbuf, &pos, r * 16, g * 16, 0x0);
+        }
+    }
+    pos.x = pos.y = 0;
+
+    blt->ops->to_screen(blt, bltbuf, &pos, &size, &pos);
+
+    grub_free(bltbuf);
+}
+
+/* Clear the whole screen, not just the text area, and put the splash
+ * image on it.  Black is filled in by the backend, without a buffer of
+ * the size of the screen.
+ */
+void
+blt_blank(struct graphics_backend *backend)
+{
+    struct blt *blt = backend->priv;
+    position_t size, pos = {0, 0}, bgpos, bgsz, phys;
+
+    backend->get_screen_size(backend, &size);
+    if (size.x <= 0 || size.y <= 0)
+        return;
+
+    if (debug_graphics) {
+        blt_debug_pattern(blt, size);
+        return;
+    }
+
+    if (!blt->background || blt->background_pos.x > 0
+            || blt->background_pos.y > 0)
+        blt->ops->fill(blt, &blt->palette[0], &pos, &size);
+
+    if (blt->background) {
+        /* an image larger than the screen is cut down to its middle */
+        bgpos.x = MAX(0, -blt->background_pos.x);
+        bgpos.y = MAX(0, -blt->background_pos.y);
+        phys.x = MAX(0, blt->background_pos.x);
+        phys.y = MAX(0, blt->background_pos.y);
+        bgsz.x = MIN((int)blt->background->width - bgpos.x, size.x);
+        bgsz.y = MIN((int)blt->background->height - bgpos.y, size.y);
+        blt->ops->to_screen(blt, blt->background, &bgpos, &bgsz, &phys);
+    }
+}
+
+/* Draw everything again, after the mode or screen_pos has changed.  */
+void
+blt_reset_screen(struct graphics_backend *backend)
+{
+    struct blt *blt = backend->priv;
+    position_t screensz;
+
+    if (blt->backbuf) {
+        grub_free(blt->backbuf);
+        blt->backbuf = NULL;
+    }
+
+    blt_set_background(backend);
+    blt_blank(backend);
+    graphics_get_screen_rowscols(&screensz);
+    graphics_clbl(0, 0, screensz.x, screensz.y, 0);
+    graphics_clbl(0, 0, screensz.x, screensz.y, 1);
+}
+
+static void
+bltbuf_cp_bl(struct bltbuf *d, position_t dpos,
+             struct bltbuf *s, position_t spos, position_t size)
+{
+    blt_pixel_t *dp, *sp;
+
+    const int xavail = MAX(0, s ? s->width - spos.x : 0);
+    const int xtotal = MAX(0, MIN(size.x, d->width - dpos.x));
+    const int xcp = MAX(0, MIN(xtotal, xavail));
+    const int xcl = MAX(0, xtotal - xcp);
+
+    const int yavail = MAX(0, s ? s->height - spos.y : 0);
+    const int ytotal = MAX(0, MIN(size.y, d->height - dpos.y));
+
+    int y;
+
+    for (y = 0; y < ytotal; y++) {
+        dp = &d->pixbuf[(dpos.y + y) * d->width + dpos.x];
+
+        if (y < yavail) {
+            sp = &s->pixbuf[(spos.y + y) * s->width + spos.x];
+            memmove(dp, sp, xcp * sizeof (*dp));
+            dp = &d->pixbuf[(dpos.y + y) * d->width + dpos.x + xcp];
+            memset(dp, '\0', xcl * sizeof (*dp));
+        } else {
+            memset(dp, '\0', xtotal * sizeof (*dp));
+        }
+    }
+}
+
+/* Return the bits of pixel row Y of the glyph in text cell COL, ROW;
+ * a Y of -1 is the bottom row of the cell above.  Off the screen there
+ * is nothing.
+ */
+static int
+glyph_bits(position_t screensz, int col, int row, int y)
+{
+    unsigned short *text = graphics_get_text_buf();
+
+    if (y < 0) {
+        y += 16;
+        row--;
+    }
+    if (col < 0 || row < 0)
+        return 0;
+
+    return font8x16[((text[row * screensz.x + col] & 0xff) << 4) + y];
+}
+
+static void
+glyph_rows_setup(struct blt *blt)
+{
+    int invert, bits, x;
+
+    for (invert = 0; invert < 2; invert++)
+        for (bits = 0; bits < 256; bits++)
+            for (x = 0; x < 8; x++) {
+                int set = (bits & (0x80 >> x)) != 0;
+
+                blt->glyph_rows[invert][bits][x] =
+                    blt->palette[set != invert ? 15 : 0];
+            }
+    blt->glyph_rows_valid = 1;
+}
+
+/* Each pixel row of a character is copied from glyph_rows.  Only over a
+ * background do some pixels stay as they are: those which are neither
+ * set in the glyph nor in its shadow, one pixel down and right of it.
+ */
+static void
+bltbuf_draw_character(struct blt *blt,
+        struct bltbuf *bltbuf,  /* the bltbuf to draw into */
+        position_t target,      /* the position in the bltbuf to draw to */
+        position_t fontsz,      /* the size of the font, in pixels */
+        position_t charpos,     /* the position of the character in the text
+                                   screen buffer */
+        position_t screensz,    /* the size of the screen in characters */
+        unsigned short ch       /* the character to draw, plus flags */
+    )
+{
+    const unsigned char *glyph = font8x16 + ((ch & 0xff) << 4);
+    int invert = (ch & 0x0300) != 0;
+    int y, x;
+
+    if (!blt->glyph_rows_valid)
+        glyph_rows_setup(blt);
+
+    for (y = 0; y < fontsz.y; y++) {
+        blt_pixel_t *dp =
+            &bltbuf->pixbuf[(target.y + y) * bltbuf->width + target.x];
+        blt_pixel_t *row = blt->glyph_rows[invert][glyph[y]];
+        int shadow;
+
+        if (invert || !blt->background) {
+            grub_memmove(dp, row, sizeof (blt->glyph_rows[0][0]));
+            continue;
+        }
+
+        shadow = (glyph_bits(screensz, charpos.x, charpos.y, y - 1) >> 1)
+            | ((glyph_bits(screensz, charpos.x - 1, charpos.y, y - 1) & 1)
+               << 7);
+        for (x = 0; x < 8; x++)
+            if ((glyph[y] | shadow) & (0x80 >> x))
+                dp[x] = row[x];
+    }
+}
+
+static void
+bltbuf_draw_text(struct blt *blt,
+        struct bltbuf *bltbuf,  /* the buffer to draw into */
+        position_t screensz,    /* the size of the screen in characters */
+        position_t fontsz,      /* the size of the font in pixels */
+        position_t txtpos,      /* the position of the text on the screen
+                                   (in characters) */
+        position_t txtsz        /* the size of the block to fill in
+                                   (in characters) */
+    )
+{
+    unsigned short *text = graphics_get_text_buf();
+    position_t charpos;
+
+    for (charpos.y = txtpos.y; charpos.y < txtpos.y + txtsz.y; charpos.y++) {
+        for (charpos.x = txtpos.x; charpos.x < txtpos.x + txtsz.x; charpos.x++){
+            int offset = charpos.y * screensz.x + charpos.x;
+            position_t blpos = { charpos.x * fontsz.x,
+                                 charpos.y * fontsz.y };
+
+            bltbuf_draw_character(blt, bltbuf, blpos, fontsz, charpos,
+                    screensz, text[offset]);
+        }
+    }
+}
+
+/* The whole text area is kept composed in backbuf, so that a change
+ * only has to be drawn there and blitted out by itself.
+ */
+static struct bltbuf *
+get_backbuf(struct blt *blt)
+{
+    position_t fontsz, screensz;
+
+    if (!blt->backbuf) {
+        graphics_get_screen_rowscols(&screensz);
+        graphics_get_font_size(&fontsz);
+        blt->backbuf = alloc_bltbuf(screensz.x * fontsz.x,
+                                    screensz.y * fontsz.y);
+    }
+    return blt->backbuf;
+}
+
+void
+blt_clbl(struct graphics_backend *backend, int col, int row, int width,
+         int height, int draw_text)
+{
+    struct blt *blt = backend->priv;
+    struct bltbuf *bltbuf;
+    position_t fontsz, blpos, blsz, bgpos, screensz, txtpos, txtsz, phys;
+
+    graphics_get_screen_rowscols(&screensz);
+    width = MIN(width, screensz.x - col);
+    height = MIN(height, screensz.y - row);
+    graphics_get_font_size(&fontsz);
+
+    bltbuf = get_backbuf(blt);
+    if (!bltbuf)
+        return;
+
+    blpos.x = col * fontsz.x;
+    blpos.y = row * fontsz.y;
+    blsz.x = width * fontsz.x;
+    blsz.y = height * fontsz.y;
+
+    /* the background under the text is where the text is */
+    bgpos.x = blpos.x + blt->text_in_background.x;
+    bgpos.y = blpos.y + blt->text_in_background.y;
+    bltbuf_cp_bl(bltbuf, blpos, blt->background, bgpos, blsz);
+
+    if (draw_text) {
+        txtpos.x = col;
+        txtpos.y = row;
+        txtsz.x = width;
+        txtsz.y = height;
+
+        bltbuf_draw_text(blt, bltbuf, screensz, fontsz, txtpos, txtsz);
+    }
+
+    blt_position_to_phys(blt, &blpos, &phys);
+    blt->ops->to_screen(blt, bltbuf, &blpos, &blsz, &phys);
+}
+
+void
+blt_set_palette(struct graphics_backend *backend, int idx,
+                int red, int green, int blue)
+{
+    struct blt *blt = backend->priv;
+
+    if (idx < 0 || idx > BLT_PALETTE)
+        return;
+    rgb_to_pixel(red, green, blue, &blt->palette[idx]);
+    blt->glyph_rows_valid = 0;
+}
+
+pixel_t *
+blt_get_pixel_idx(struct graphics_backend *backend, int idx)
+{
+    static blt_pixel_t pixel;
+    struct blt *blt = backend->priv;
+
+    if (idx < 0 || idx > BLT_PALETTE)
+        return NULL;
+    pixel = blt->palette[idx];
+    return (pixel_t *)&pixel;
+}
+
+pixel_t *
+blt_get_pixel_rgb(struct graphics_backend *backend, int red, int green,
+                  int blue)
+{
+    static blt_pixel_t pixel;
+
+    rgb_to_pixel(red, green, blue, &pixel);
+    return (pixel_t *)&pixel;
+}
+
+void
+blt_draw_pixel(struct graphics_backend *backend, position_t *pos,
+               pixel_t *pixel)
+{
+    struct blt *blt = backend->priv;
+    position_t size = {1, 1}, phys;
+
+    blt_position_to_phys(blt, pos, &phys);
+    blt->ops->fill(blt, (blt_pixel_t *)pixel, &phys, &size);
+}
+
+void
+blt_setxy(struct graphics_backend *backend, position_t *pos)
+{
+    position_t fpos;
+
+    fpos.x = pos->x;
+    fpos.y = pos->y;
+    graphics_set_font_position(&fpos);
+}
+
+void
+blt_getxy(struct graphics_backend *backend, position_t *pos)
+{
+    graphics_get_font_position(pos);
+}
+
+#endif /* SUPPORT_GRAPHICS */
@@ -0,0 +1,79 @@
+#ifndef GRUB_EFI_BLT_H
+#define GRUB_EFI_BLT_H
+
+#ifdef SUPPORT_GRAPHICS
+
+/* The UGA and the graphics output backends draw alike: the text is
+ * composed over the splash image in a buffer of pixels, and only the
+ * last step, putting the buffer on the screen, is their own.  Both
+ * protocols take the same blue, green, red, reserved pixels.
+ */
+typedef grub_efi_graphics_output_blt_pixel_t blt_pixel_t;
+
+struct bltbuf {
+    grub_efi_uintn_t width;
+    grub_efi_uintn_t height;
+    blt_pixel_t pixbuf[];
+};
+
+struct blt;
+
+struct blt_ops {
+    /* Put the BLTSZ pixels at BLTPOS in BLTBUF on the screen at PHYS.  */
+    void (*to_screen)(struct blt *blt, struct bltbuf *bltbuf,
+                      position_t *bltpos, position_t *bltsz,
+                      position_t *phys);
+    /* Fill SIZE pixels at PHYS on the screen with PIXEL.  */
+    void (*fill)(struct blt *blt, blt_pixel_t *pixel, position_t *phys,
+                 position_t *size);
+};
+
+#define BLT_PALETTE 16
+
+/* This has to come first in the private data of the backend, which
+ * the functions below are given as backend->priv.
+ */
+struct blt {
+    const struct blt_ops *ops;
+
+    /* where the text area starts on the screen */
+    position_t screen_pos;
+
+    /* the splash image, scaled for the mode, where it is on the screen,
+       and where the text area is in it */
+    struct bltbuf *background;
+    position_t background_pos;
+    position_t text_in_background;
+
+    struct bltbuf *backbuf;
+
+    blt_pixel_t palette[BLT_PALETTE + 1];
+
+    /* Every row a glyph can have, drawn with the palette: by whether the
+       cell is inverted, then by the bits of the row.  */
+    blt_pixel_t glyph_rows[2][256][8];
+    int glyph_rows_valid;
+};
+
+extern struct bltbuf *alloc_bltbuf(grub_efi_uintn_t width,
+                                   grub_efi_uintn_t height);
+extern void blt_init(struct blt *blt, const struct blt_ops *ops);
+extern void blt_position_to_phys(struct blt *blt, position_t *virt,
+                                 position_t *phys);
+extern void blt_blank(struct graphics_backend *backend);
+extern void blt_reset_screen(struct graphics_backend *backend);
+
+extern void blt_clbl(struct graphics_backend *backend, int col, int row,
+                     int width, int height, int draw_text);
+extern void blt_set_palette(struct graphics_backend *backend, int idx,
+                            int red, int green, int blue);
+extern pixel_t *blt_get_pixel_idx(struct graphics_backend *backend, int idx);
+extern pixel_t *blt_get_pixel_rgb(struct graphics_backend *backend,
+                                  int red, int green, int blue);
+extern void blt_draw_pixel(struct graphics_backend *backend, position_t *pos,
+                           pixel_t *pixel);
+extern void blt_getxy(struct graphics_backend *backend, position_t *pos);
+extern void blt_setxy(struct graphics_backend *backend, position_t *pos);
+
+#endif /* SUPPORT_GRAPHICS */
+#endif /* GRUB_EFI_BLT_H */
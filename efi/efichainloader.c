@@ -25,6 +25,7 @@
 #include <grub/efi/misc.h>
 
 #include <shared.h>
+#include <filesys.h>
 
 #define grub_file_size()    filemax
 
@@ -40,7 +41,9 @@ grub_chainloader_unload (void)
 
   b = grub_efi_system_table->boot_services;
   Call_Service_1 (b->unload_image, image_handle);
-  Call_Service_2 (b->free_pages, address, pages);
+  if (address)
+    Call_Service_2 (b->free_pages, address, pages);
+  address = 0;
   grub_free (file_path);
 
   return 0;
@@ -54,6 +57,9 @@ grub_chainloader_boot (void)
   grub_efi_uintn_t exit_data_size = 0;
   grub_efi_char16_t *exit_data = NULL;
 
+  grub_flush_saved_default ();
+  grub_save_boot_profile ();
+
   b = grub_efi_system_table->boot_services;
   status = Call_Service_3 (b->start_image, image_handle,
 			   &exit_data_size, &exit_data);
@@ -162,6 +168,64 @@ make_file_path (const char *filename)
   return file_path;
 }
 
+/* Return the device path of DEV_HANDLE followed by FILE, which the
+   caller must free, or 0.  */
+static grub_efi_device_path_t *
+make_full_path (grub_efi_handle_t dev_handle, grub_efi_device_path_t *file)
+{
+  grub_efi_device_path_t *dev, *p, *full;
+  grub_size_t dev_size = 0, file_size = 0;
+
+  dev = grub_efi_get_device_path (dev_handle);
+  if (! dev)
+    return 0;
+
+  for (p = dev; ! GRUB_EFI_END_ENTIRE_DEVICE_PATH (p);
+       p = GRUB_EFI_NEXT_DEVICE_PATH (p))
+    dev_size += GRUB_EFI_DEVICE_PATH_LENGTH (p);
+  for (p = file; ; p = GRUB_EFI_NEXT_DEVICE_PATH (p))
+    {
+      file_size += GRUB_EFI_DEVICE_PATH_LENGTH (p);
+      if (GRUB_EFI_END_ENTIRE_DEVICE_PATH (p))
+	break;
+    }
+
+  full = grub_malloc (dev_size + file_size);
+  if (! full)
+    return 0;
+
+  grub_memcpy (full, dev, dev_size);
+  grub_memcpy ((char *) full + dev_size, file, file_size);
+  return full;
+}
+
+/* Have the firmware load FILE_PATH on DEV_HANDLE itself, which it can
+   if the file is on a filesystem it reads, and return 1, or 0 if it
+   couldn't.  This saves reading the whole image into pages of our own
+   only for LoadImage to copy it again.  */
+static int
+load_image_direct (grub_efi_handle_t dev_handle)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_device_path_t *full;
+  grub_efi_status_t status;
+
+  full = make_full_path (dev_handle, file_path);
+  if (! full)
+    return 0;
+
+  status = Call_Service_6 (b->load_image, 0, grub_efi_image_handle, full,
+			   0, 0, &image_handle);
+  grub_free (full);
+  if (status != GRUB_EFI_SUCCESS)
+    {
+      image_handle = 0;
+      return 0;
+    }
+
+  return 1;
+}
+
 int
 grub_chainloader (char *filename)
 {
@@ -172,8 +236,9 @@ grub_chainloader (char *filename)
   grub_efi_loaded_image_t *loaded_image;
 
   /* Initialize some global variables.  */
-  address = 0xffffffff;
+  address = 0;
   image_handle = 0;
+  file_path = 0;
 
   b = grub_efi_system_table->boot_services;
 
@@ -195,6 +260,15 @@ grub_chainloader (char *filename)
   grub_printf ("file path: ");
   grub_efi_print_device_path (file_path);
 
+  /* The file is read as it is by the firmware's own filesystem, so let
+     the firmware load it.  */
+  if (! compressed_file && fsys_table[fsys_type].read_func == uefi_read
+      && load_image_direct (dev_handle))
+    {
+      grub_close ();
+      return KERNEL_TYPE_CHAINLOADER;
+    }
+
   size = grub_file_size ();
   pages = (((grub_efi_uintn_t) size + ((1 << 12) - 1)) >> 12);
 
@@ -231,6 +305,10 @@ grub_chainloader (char *filename)
       goto fail;
     }
 
+  /* LoadImage has made its own copy of the image.  */
+  Call_Service_2 (b->free_pages, address, pages);
+  address = 0;
+
   /* LoadImage does not set a device handler when the image is
      loaded from memory, so it is necessary to set it explicitly here.
      This is a mess.  */
@@ -249,8 +327,14 @@ grub_chainloader (char *filename)
  fail:
   grub_close ();
  fail1:
+  if (image_handle)
+    Call_Service_1 (b->unload_image, image_handle);
+  image_handle = 0;
   if (address)
-    b->free_pages (address, pages);
+    Call_Service_2 (b->free_pages, address, pages);
+  address = 0;
+  grub_free (file_path);
+  file_path = 0;
 
   return KERNEL_TYPE_NONE;
 }
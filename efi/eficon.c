@@ -38,14 +38,84 @@ grub_console_highlight_color = GRUB_EFI_TEXT_ATTR (GRUB_EFI_BLACK,
 
 static int read_key = -1;
 
+/* Characters not written out yet.  OutputString is expensive, very much
+   so on serial consoles, so a whole line goes with one call, or as much
+   of one as there is before the cursor moves or a key is read.  */
+#define CONSOLE_BUFLEN	128
+static grub_efi_char16_t console_buf[CONSOLE_BUFLEN + 1];
+static int console_buflen;
+
+/* Where the characters in the buffer go and how they look, if that is
+   still to be told to the firmware: the cursor position, or -1 for
+   where it is, and the attribute, or -1 for the one it has.  Moving the
+   cursor and changing the colour wait for the next output, which is
+   when grub_console_flush asks for them, and only if the firmware's
+   mode says they differ; the menu sets both for every line it draws,
+   mostly to what they already are, and each call is as slow as
+   OutputString over serial redirection.  */
+static int console_want_x = -1, console_want_y;
+static int console_want_attr = -1;
+
+/* What TestString said about each character above 0x7f, once asked.  */
+static unsigned char console_tested[0x10000 / 8];
+static unsigned char console_printable[0x10000 / 8];
+
 void
-console_putchar (int c)
+grub_console_flush (void)
 {
-  grub_efi_char16_t str[2];
   grub_efi_simple_text_output_interface_t *o;
 
   o = grub_efi_system_table->con_out;
 
+  if (console_want_x >= 0)
+    {
+      if (console_want_x != o->mode->cursor_column
+	  || console_want_y != o->mode->cursor_row)
+	Call_Service_3 (o->set_cursor_position, o, console_want_x,
+			console_want_y);
+      console_want_x = -1;
+    }
+
+  if (console_want_attr >= 0)
+    {
+      if (console_want_attr != o->mode->attribute)
+	Call_Service_2 (o->set_attributes, o, console_want_attr);
+      console_want_attr = -1;
+    }
+
+  if (! console_buflen)
+    return;
+
+  console_buf[console_buflen] = 0;
+  console_buflen = 0;
+  Call_Service_2 (o->output_string, o, console_buf);
+}
+
+static int
+console_printable_char (int c)
+{
+  grub_efi_simple_text_output_interface_t *o;
+  grub_efi_char16_t str[2];
+
+  if (c <= 0x7f)
+    return 1;
+
+  if (! (console_tested[c >> 3] & (1 << (c & 7))))
+    {
+      o = grub_efi_system_table->con_out;
+      str[0] = (grub_efi_char16_t) c;
+      str[1] = 0;
+      if (Call_Service_2 (o->test_string, o, str) == GRUB_EFI_SUCCESS)
+	console_printable[c >> 3] |= 1 << (c & 7);
+      console_tested[c >> 3] |= 1 << (c & 7);
+    }
+
+  return (console_printable[c >> 3] & (1 << (c & 7))) != 0;
+}
+
+void
+console_putchar (int c)
+{
   switch (c)
     {
     case DISP_LEFT:
@@ -84,14 +154,32 @@ console_putchar (int c)
   if (c > 0xffff)
     c = '?';
 
-  str[0] = (grub_efi_char16_t)  (c & 0xffff);
-  str[1] = 0;
-
-  /* Should this test be cached?  */
-  if (c > 0x7f && Call_Service_2 (o->test_string, o, str) != GRUB_EFI_SUCCESS)
+  if (! console_printable_char (c))
     return;
 
-  Call_Service_2 (o->output_string, o, str);
+  console_buf[console_buflen++] = (grub_efi_char16_t) c;
+  if (c == '\n' || console_buflen == CONSOLE_BUFLEN)
+    grub_console_flush ();
+}
+
+/* Put LEN characters, none of them a newline or a tab.  Plain ASCII
+   goes straight into the buffer.  */
+void
+console_putstr (const char *str, int len)
+{
+  while (len--)
+    {
+      int c = *str++;
+
+      if (c < ' ' || c > '~')
+	console_putchar (c);
+      else
+	{
+	  console_buf[console_buflen++] = (grub_efi_char16_t) c;
+	  if (console_buflen == CONSOLE_BUFLEN)
+	    grub_console_flush ();
+	}
+    }
 }
 
 int
@@ -104,6 +192,7 @@ console_checkkey (void)
   if (read_key >= 0)
     return 1;
 
+  grub_console_flush ();
   i = grub_efi_system_table->con_in;
   status = Call_Service_2 (i->read_key_stroke ,i, &key);
 #if 0
@@ -193,6 +282,7 @@ console_getkey (void)
       return key;
     }
 
+  grub_console_flush ();
   i = grub_efi_system_table->con_in;
   b = grub_efi_system_table->boot_services;
 
@@ -211,6 +301,41 @@ console_getkey (void)
   return key;
 }
 
+/* Wait for a key or for 10ms to pass, whichever comes first.  The
+   serial terminal has no event to wait for, so it is polled that
+   often.  */
+void
+idle_wait (void)
+{
+  static grub_efi_event_t timer;
+  grub_efi_boot_services_t *b;
+  grub_efi_event_t events[2];
+  grub_efi_uintn_t index;
+
+  if (read_key >= 0)
+    return;
+
+  grub_console_flush ();
+  b = grub_efi_system_table->boot_services;
+
+  if (! timer
+      && Call_Service_5 (b->create_event, GRUB_EFI_EVT_TIMER, 0, 0, 0,
+			 &timer) != GRUB_EFI_SUCCESS)
+    {
+      timer = 0;
+      return;
+    }
+
+  /* In units of 100ns.  */
+  if (Call_Service_3 (b->set_timer, timer, GRUB_EFI_TIMER_RELATIVE,
+		      100000) != GRUB_EFI_SUCCESS)
+    return;
+
+  events[0] = grub_efi_system_table->con_in->wait_for_key;
+  events[1] = timer;
+  Call_Service_3 (b->wait_for_event, 2, events, &index);
+}
+
 int
 console_keystatus (void)
 {
@@ -223,6 +348,11 @@ console_getxy (void)
 {
   grub_efi_simple_text_output_interface_t *o;
 
+  if (console_buflen)
+    grub_console_flush ();
+  if (console_want_x >= 0)
+    return (console_want_x << 8) | console_want_y;
+
   o = grub_efi_system_table->con_out;
   return ((o->mode->cursor_column << 8) | o->mode->cursor_row);
 }
@@ -230,10 +360,10 @@ console_getxy (void)
 void
 console_gotoxy (int x, int y)
 {
-  grub_efi_simple_text_output_interface_t *o;
-
-  o = grub_efi_system_table->con_out;
-  Call_Service_3 (o->set_cursor_position , o, x, y);
+  if (console_buflen)
+    grub_console_flush ();
+  console_want_x = x;
+  console_want_y = y;
 }
 
 void
@@ -242,6 +372,7 @@ console_cls (void)
   grub_efi_simple_text_output_interface_t *o;
   grub_efi_int32_t orig_attr;
 
+  grub_console_flush ();
   o = grub_efi_system_table->con_out;
   orig_attr = o->mode->attribute;
   Call_Service_2 (o->set_attributes, o, GRUB_EFI_BACKGROUND_BLACK);
@@ -252,19 +383,18 @@ console_cls (void)
 void
 console_setcolorstate (color_state state)
 {
-  grub_efi_simple_text_output_interface_t *o;
-
-  o = grub_efi_system_table->con_out;
+  if (console_buflen)
+    grub_console_flush ();
 
   switch (state) {
     case COLOR_STATE_STANDARD:
-      Call_Service_2 (o->set_attributes, o, grub_console_standard_color);
+      console_want_attr = grub_console_standard_color;
       break;
     case COLOR_STATE_NORMAL:
-      Call_Service_2 (o->set_attributes, o, grub_console_normal_color);
+      console_want_attr = grub_console_normal_color;
       break;
     case COLOR_STATE_HIGHLIGHT:
-      Call_Service_2 (o->set_attributes, o, grub_console_highlight_color);
+      console_want_attr = grub_console_highlight_color;
       break;
     default:
       break;
@@ -284,7 +414,11 @@ console_setcursor (int on)
   grub_efi_simple_text_output_interface_t *o;
 
   o = grub_efi_system_table->con_out;
-  Call_Service_2 (o->enable_cursor, o, on);
+  if (! on != ! o->mode->cursor_visible)
+    {
+      grub_console_flush ();
+      Call_Service_2 (o->enable_cursor, o, on);
+    }
   return on;
 }
 
@@ -303,4 +437,5 @@ grub_console_init (void)
 void
 grub_console_fini (void)
 {
+  grub_console_flush ();
 }
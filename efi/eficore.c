@@ -25,6 +25,7 @@
 #include <grub/efi/eficall.h>
 #include <grub/efi/console_control.h>
 #include <grub/efi/time.h>
+#include <grub/efi/misc.h>
 
 #include <shared.h>
 
@@ -209,6 +210,9 @@ grub_efi_exit_boot_services (grub_efi_uintn_t map_key)
   grub_efi_boot_services_t *b;
   grub_efi_status_t status;
 
+  /* Nothing may be left to write into memory after this.  */
+  grub_efidisk_readahead_wait ();
+
   b = grub_efi_system_table->boot_services;
   status = Call_Service_2 (b->exit_boot_services ,
 				grub_efi_image_handle,
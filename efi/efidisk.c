@@ -24,6 +24,7 @@
 #include <grub/efi/misc.h>
 
 #include <shared.h>
+#include <bootprof.h>
 
 struct grub_efidisk_data
 {
@@ -32,21 +33,56 @@ struct grub_efidisk_data
   grub_efi_device_path_t *last_device_path;
   grub_efi_block_io_t *block_io;
   grub_efi_disk_io_t *disk_io;
+  /* The asynchronous block io, if the firmware has one for it.  */
+  grub_efi_block_io2_t *block_io2;
+  /* Whether reads go to the block io: 0 until the first read that may,
+     then 1 if the block io did it, or -1 if only the disk io could.  */
+  int use_block_io;
+  /* Whether disk_tune has been to it, and the most sectors it found
+     worth reading ahead in the background at a time, or 0 for any.  */
+  int tuned;
+  int readahead_max;
   struct grub_efidisk_data *next;
+  /* Set by index_devices: the length of the device path up to its end
+     node, and its hash; the next device in the same bucket; and the
+     first child, the device whose path is this one and one node more,
+     and the next child of the same parent.  */
+  grub_efi_uintn_t path_len;
+  unsigned long hash;
+  struct grub_efidisk_data *hash_next;
+  struct grub_efidisk_data *children;
+  struct grub_efidisk_data *sibling;
+};
+
+/* The devices made by make_devices, hashed by their device paths.  */
+struct device_index
+{
+  struct grub_efidisk_data **buckets;
+  unsigned int size;
 };
 
 /* GUIDs.  */
 static grub_efi_guid_t disk_io_guid = GRUB_EFI_DISK_IO_GUID;
 static grub_efi_guid_t block_io_guid = GRUB_EFI_BLOCK_IO_GUID;
+static grub_efi_guid_t block_io2_guid = GRUB_EFI_BLOCK_IO2_GUID;
 static grub_efi_guid_t device_path_from_text_guid = GRUB_EFI_DEVICE_PATH_FROM_TEXT_GUID;
 
 static struct grub_efidisk_data *fd_devices;
 static struct grub_efidisk_data *hd_devices;
 static struct grub_efidisk_data *cd_devices;
 
+/* The floppies and the hard disks by their drive numbers, so that a
+   read doesn't walk the lists to find its disk.  */
+static struct grub_efidisk_data *drive_devices[0x100];
+/* Whether the lists above have been made yet.  */
+static int disks_enumerated;
+
 static int get_device_sector_bits(struct grub_efidisk_data *device);
 static int get_device_sector_size(struct grub_efidisk_data *device);
 static struct grub_efidisk_data *get_device_from_drive (int drive);
+static int grub_efidisk_read (struct grub_efidisk_data *d,
+			      grub_disk_addr_t sector, grub_size_t size,
+			      char *buf);
 
 static struct grub_efidisk_data *
 make_devices (void)
@@ -101,6 +137,11 @@ make_devices (void)
       d->last_device_path = ldp;
       d->block_io = bio;
       d->disk_io = dio;
+      d->block_io2 = grub_efi_open_protocol (*handle, &block_io2_guid,
+					     GRUB_EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+      d->use_block_io = 0;
+      d->tuned = 0;
+      d->readahead_max = 0;
       d->next = devices;
       devices = d;
     }
@@ -110,69 +151,198 @@ make_devices (void)
   return devices;
 }
 
+/* Hash the first LEN bytes of the device path DP, with FNV-1a.  */
+static unsigned long
+hash_device_path (const grub_efi_device_path_t *dp, grub_efi_uintn_t len)
+{
+  const grub_efi_uint8_t *p = (const grub_efi_uint8_t *) dp;
+  unsigned long hash = 2166136261UL;
+
+  while (len--)
+    hash = (hash ^ *p++) * 16777619UL;
+
+  return hash;
+}
+
+/* Return the device in INDEX whose path is the first LEN bytes of DP
+   and an end node, or 0.  */
+static struct grub_efidisk_data *
+lookup_device (struct device_index *index, const grub_efi_device_path_t *dp,
+	       grub_efi_uintn_t len)
+{
+  unsigned long hash = hash_device_path (dp, len);
+  struct grub_efidisk_data *d;
+
+  for (d = index->buckets[hash % index->size]; d; d = d->hash_next)
+    if (d->hash == hash && d->path_len == len
+	&& ! grub_memcmp ((char *) d->device_path, (char *) dp, len))
+      return d;
+
+  return 0;
+}
+
+/* Hash DEVICES by their device paths into INDEX, and link each device
+   to its parent, so that the children of a device can be found without
+   going through all of them, as there may be hundreds.  */
 static int
-iterate_child_devices (struct grub_efidisk_data *devices,
+index_devices (struct grub_efidisk_data *devices, struct device_index *index)
+{
+  struct grub_efidisk_data *d, *parent;
+  unsigned int count = 0;
+
+  for (d = devices; d; d = d->next)
+    count++;
+
+  index->size = count * 2 + 1;
+  index->buckets = grub_malloc (index->size * sizeof (*index->buckets));
+  if (! index->buckets)
+    return 0;
+  grub_memset (index->buckets, 0, index->size * sizeof (*index->buckets));
+
+  for (d = devices; d; d = d->next)
+    {
+      struct grub_efidisk_data **bucket;
+
+      d->path_len = ((char *) GRUB_EFI_NEXT_DEVICE_PATH (d->last_device_path)
+		     - (char *) d->device_path);
+      d->hash = hash_device_path (d->device_path, d->path_len);
+      d->children = d->sibling = 0;
+
+      bucket = &index->buckets[d->hash % index->size];
+      d->hash_next = *bucket;
+      *bucket = d;
+    }
+
+  for (d = devices; d; d = d->next)
+    {
+      parent = lookup_device (index, d->device_path,
+			      ((char *) d->last_device_path
+			       - (char *) d->device_path));
+      if (parent)
+	{
+	  d->sibling = parent->children;
+	  parent->children = d;
+	}
+    }
+
+  return 1;
+}
+
+/* Call HOOK on each device in INDEX whose path is that of D and one
+   node more, until it returns 1.  D need not be in INDEX itself.  */
+static int
+iterate_child_devices (struct device_index *index,
 		       struct grub_efidisk_data *d,
 		       int (*hook) (struct grub_efidisk_data *child))
 {
   struct grub_efidisk_data *p;
 
-  for (p = devices; p; p = p->next)
-    {
-      grub_efi_device_path_t *dp, *ldp;
+  p = lookup_device (index, d->device_path,
+		     ((char *) GRUB_EFI_NEXT_DEVICE_PATH (d->last_device_path)
+		      - (char *) d->device_path));
+  if (! p)
+    return 0;
 
-      dp = duplicate_device_path (p->device_path);
-      if (! dp)
-	return 0;
+  for (p = p->children; p; p = p->sibling)
+    if (hook (p))
+      return 1;
 
-      ldp = find_last_device_path (dp);
-      ldp->type = GRUB_EFI_END_DEVICE_PATH_TYPE;
-      ldp->subtype = GRUB_EFI_END_ENTIRE_DEVICE_PATH_SUBTYPE;
-      ldp->length[0] = sizeof (*ldp);
-      ldp->length[1] = 0;
+  return 0;
+}
 
-      if (compare_device_paths (dp, d->device_path) == 0)
-	if (hook (p))
-	  {
-	    grub_free (dp);
-	    return 1;
-	  }
+static int
+compare_devices (struct grub_efidisk_data *d0, struct grub_efidisk_data *d1)
+{
+  int ret;
 
-      grub_free (dp);
-    }
+  ret = compare_device_paths (d0->last_device_path, d1->last_device_path);
+  if (ret == 0)
+    ret = compare_device_paths (d0->device_path, d1->device_path);
 
-  return 0;
+  return ret;
 }
 
-/* Add a device into a list of devices in an ascending order.  */
-static void
-add_device (struct grub_efidisk_data **devices, struct grub_efidisk_data *d)
+/* Sort a list of devices in an ascending order, keeping the first of
+   those with the same device path and freeing the others.  This is a
+   merge sort, which keeps the devices in the order they came in when
+   they are otherwise equal.  */
+static struct grub_efidisk_data *
+sort_devices (struct grub_efidisk_data *devices)
 {
-  struct grub_efidisk_data **p;
-  struct grub_efidisk_data *n;
+  struct grub_efidisk_data *a, *b, *slow, *fast, *head, **tail;
+
+  if (! devices || ! devices->next)
+    return devices;
+
+  for (slow = devices, fast = devices->next; fast && fast->next;
+       fast = fast->next->next)
+    slow = slow->next;
+  b = slow->next;
+  slow->next = 0;
 
-  for (p = devices; *p; p = &((*p)->next))
+  a = sort_devices (devices);
+  b = sort_devices (b);
+
+  tail = &head;
+  while (a && b)
     {
-      int ret;
+      int ret = compare_devices (a, b);
 
-      ret = compare_device_paths (find_last_device_path ((*p)->device_path),
-				  find_last_device_path (d->device_path));
-      if (ret == 0)
-	ret = compare_device_paths ((*p)->device_path,
-				    d->device_path);
       if (ret == 0)
-	return;
-      else if (ret > 0)
-	break;
+	{
+	  struct grub_efidisk_data *dup = b;
+
+	  b = b->next;
+	  grub_free (dup);
+	}
+      else if (ret < 0)
+	{
+	  *tail = a;
+	  tail = &a->next;
+	  a = a->next;
+	}
+      else
+	{
+	  *tail = b;
+	  tail = &b->next;
+	  b = b->next;
+	}
     }
+  *tail = a ? a : b;
+
+  return head;
+}
+
+/* Add a copy of a device to the end of a list of devices.  */
+static void
+add_device (struct grub_efidisk_data ***tail, struct grub_efidisk_data *d)
+{
+  struct grub_efidisk_data *n;
 
   n = grub_malloc (sizeof (*n));
   if (! n)
     return;
 
   grub_memcpy (n, d, sizeof (*n));
-  n->next = (*p);
-  (*p) = n;
+  n->next = 0;
+  **tail = n;
+  *tail = &n->next;
+}
+
+/* Number the floppies from 0 and the hard disks from 0x80 in
+   DRIVE_DEVICES, in the order they have been sorted in.  */
+static void
+index_drives (void)
+{
+  struct grub_efidisk_data *d;
+  int drive;
+
+  grub_memset (drive_devices, 0, sizeof (drive_devices));
+
+  for (d = fd_devices, drive = 0; d && drive < 0x80; d = d->next, drive++)
+    drive_devices[drive] = d;
+  for (d = hd_devices, drive = 0x80; d && drive < 0x100; d = d->next, drive++)
+    drive_devices[drive] = d;
 }
 
 /* Name the devices.  */
@@ -180,6 +350,9 @@ static void
 name_devices (struct grub_efidisk_data *devices)
 {
   struct grub_efidisk_data *d;
+  struct grub_efidisk_data **cd_tail = &cd_devices;
+  struct grub_efidisk_data **hd_tail = &hd_devices;
+  struct grub_efidisk_data **fd_tail = &fd_devices;
 
   /* Let's see what can be added more.  */
   for (d = devices; d; d = d->next)
@@ -198,17 +371,23 @@ name_devices (struct grub_efidisk_data *devices)
 	   * 4k sectors */
 	  if (m->read_only && m->block_size > 0x200)
 	    {
-	      add_device (&cd_devices, d);
+	      add_device (&cd_tail, d);
 	    } else
 	    {
-	      add_device (&hd_devices, d);
+	      add_device (&hd_tail, d);
 	    }
 	}
       if (GRUB_EFI_DEVICE_PATH_TYPE(dp) == GRUB_EFI_ACPI_DEVICE_PATH_TYPE)
 	{
-	  add_device (&fd_devices, d);
+	  add_device (&fd_tail, d);
 	}
     }
+
+  cd_devices = sort_devices (cd_devices);
+  hd_devices = sort_devices (hd_devices);
+  fd_devices = sort_devices (fd_devices);
+
+  index_drives ();
 }
 
 static void
@@ -223,12 +402,19 @@ free_devices (struct grub_efidisk_data *devices)
     }
 }
 
-/* Enumerate all disks to name devices.  */
+/* Enumerate all disks to name devices, the first time a disk is asked
+   for.  A drive number is the place of the disk among all the others,
+   so they have to be enumerated all at once, but a boot from the
+   network that never looks at a disk doesn't open any.  */
 static void
 enumerate_disks (void)
 {
   struct grub_efidisk_data *devices;
 
+  if (disks_enumerated)
+    return;
+  disks_enumerated = 1;
+
   devices = make_devices ();
   if (! devices)
     return;
@@ -237,25 +423,784 @@ enumerate_disks (void)
   free_devices (devices);
 }
 
-static struct grub_efidisk_data *
-get_device (struct grub_efidisk_data *devices, int num)
+/* Whether BUF may be handed to the block io of D as it is.  The block
+   io wants it aligned as the media says; the disk io copies it into an
+   aligned buffer of its own, often piece by piece.  */
+static int
+block_io_aligned (struct grub_efidisk_data *d, char *buf)
+{
+  grub_efi_uint32_t align = d->block_io->media->io_align;
+
+  if (align <= 1)
+    return 1;
+
+  /* Not a power of two, or more than a page: do not trust it.  */
+  if ((align & (align - 1)) || align > 4096)
+    return 0;
+
+  return ((unsigned long) buf & (align - 1)) == 0;
+}
+
+/*
+ *  The block io 2 takes requests without waiting for them to complete,
+ *  and signals an event when each one has.  Disks such as NVMe need
+ *  several requests outstanding at once to reach their full speed.
+ *
+ *  Large reads are split into READ_CHUNK_LEN pieces, and QUEUE_DEPTH of
+ *  them are outstanding at a time.  Reads ahead of what a file system
+ *  has asked for go to buffers of their own, one per queue entry, and
+ *  a later read that lies wholly in one of them is copied from there.
+ */
+
+#define QUEUE_DEPTH		4
+#define READ_CHUNK_PAGES	64
+#define READ_CHUNK_LEN		(READ_CHUNK_PAGES << 12)
+
+struct readahead
+{
+  /* The block io 2 which has read, or is reading, into BUF, or 0 if
+     nothing valid is in there.  */
+  grub_efi_block_io2_t *bio2;
+  grub_efi_uint32_t media_id;
+  grub_disk_addr_t sector;
+  grub_size_t size;
+  grub_efi_block_io2_token_t token;
+  /* Whether the firmware may still be writing into BUF.  */
+  int pending;
+  unsigned long stamp;
+  char *buf;
+};
+
+static struct readahead readaheads[QUEUE_DEPTH];
+static unsigned long readahead_clock;
+
+static grub_efi_block_io2_token_t queue_tokens[QUEUE_DEPTH];
+
+/* Make sure that TOKEN has an event to signal.  */
+static int
+token_event (grub_efi_block_io2_token_t *token)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+
+  if (token->event)
+    return 1;
+
+  if (Call_Service_5 (b->create_event, 0, 0, 0, 0, &token->event)
+      != GRUB_EFI_SUCCESS)
+    {
+      token->event = 0;
+      return 0;
+    }
+
+  return 1;
+}
+
+static void
+readahead_complete (struct readahead *r)
+{
+  r->pending = 0;
+  if (r->token.transaction_status != GRUB_EFI_SUCCESS)
+    r->bio2 = 0;
+}
+
+/* Return non-zero if R is not pending, or no longer.  */
+static int
+readahead_poll (struct readahead *r)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+
+  /* Checking the event clears it, so it must not be waited for after.  */
+  if (r->pending
+      && Call_Service_1 (b->check_event, r->token.event) == GRUB_EFI_SUCCESS)
+    readahead_complete (r);
+
+  return ! r->pending;
+}
+
+static void
+readahead_wait (struct readahead *r)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_uintn_t index;
+
+  if (! r->pending)
+    return;
+
+  Call_Service_3 (b->wait_for_event, 1, &r->token.event, &index);
+  readahead_complete (r);
+}
+
+/* Find the read ahead of D which holds SIZE sectors from SECTOR, or the
+   first one overlapping them if ANY is non-zero.  */
+static struct readahead *
+readahead_find (struct grub_efidisk_data *d, grub_disk_addr_t sector,
+		grub_size_t size, int any)
+{
+  struct readahead *r;
+
+  for (r = readaheads; r < readaheads + QUEUE_DEPTH; r++)
+    {
+      if (! r->bio2 || r->bio2 != d->block_io2
+	  || r->media_id != d->block_io2->media->media_id)
+	continue;
+
+      if (any ? (sector < r->sector + r->size && r->sector < sector + size)
+	  : (r->sector <= sector && sector + size <= r->sector + r->size))
+	return r;
+    }
+
+  return 0;
+}
+
+/* Start reading NSEC sectors from SECTOR of D into a read ahead buffer,
+   if there is a free one.  Return non-zero if it was started.  */
+static int
+readahead_start (struct grub_efidisk_data *d, grub_disk_addr_t sector,
+		 grub_size_t nsec)
+{
+  grub_efi_block_io2_t *bio2 = d->block_io2;
+  struct readahead *r, *victim = 0;
+  grub_efi_status_t status;
+
+  for (r = readaheads; r < readaheads + QUEUE_DEPTH; r++)
+    if (readahead_poll (r) && (! victim || r->stamp < victim->stamp))
+      victim = r;
+
+  if (! victim)
+    return 0;
+
+  if (! victim->buf)
+    victim->buf = grub_efi_allocate_anypages (READ_CHUNK_PAGES);
+  if (! victim->buf || ! block_io_aligned (d, victim->buf)
+      || ! token_event (&victim->token))
+    return 0;
+
+  victim->bio2 = 0;
+  status = Call_Service_6 (bio2->read_blocks_ex,
+			   bio2, bio2->media->media_id, sector,
+			   &victim->token, nsec * get_device_sector_size (d),
+			   victim->buf);
+  if (status != GRUB_EFI_SUCCESS)
+    return 0;
+
+  victim->bio2 = bio2;
+  victim->media_id = bio2->media->media_id;
+  victim->sector = sector;
+  victim->size = nsec;
+  victim->pending = 1;
+  victim->stamp = ++readahead_clock;
+
+  return 1;
+}
+
+/* Read SIZE sectors from SECTOR of D into BUF through the block io 2,
+   several pieces at a time.  Return zero if all of them were read.  */
+static int
+read_queued (struct grub_efidisk_data *d, grub_disk_addr_t sector,
+	     grub_size_t size, char *buf)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_block_io2_t *bio2 = d->block_io2;
+  grub_efi_uint64_t sector_size = get_device_sector_size (d);
+  grub_size_t chunk = READ_CHUNK_LEN / sector_size;
+  grub_disk_addr_t next = sector, end = sector + size;
+  grub_efi_event_t events[QUEUE_DEPTH];
+  int slots[QUEUE_DEPTH];
+  int pending[QUEUE_DEPTH];
+  int i, busy = 0, failed = 0;
+
+  for (i = 0; i < QUEUE_DEPTH; i++)
+    pending[i] = 0;
+
+  while (busy || (next < end && ! failed))
+    {
+      grub_efi_uintn_t index;
+      int n = 0;
+
+      /* Keep the queue full.  */
+      for (i = 0; i < QUEUE_DEPTH && next < end && ! failed; i++)
+	{
+	  grub_size_t nsec = end - next < chunk ? end - next : chunk;
+
+	  if (pending[i])
+	    continue;
+
+	  if (! token_event (&queue_tokens[i])
+	      || (Call_Service_6 (bio2->read_blocks_ex,
+				  bio2, bio2->media->media_id, next,
+				  &queue_tokens[i], nsec * sector_size,
+				  buf + (next - sector) * sector_size)
+		  != GRUB_EFI_SUCCESS))
+	    {
+	      failed = 1;
+	      break;
+	    }
+
+	  pending[i] = 1;
+	  busy++;
+	  next += nsec;
+	}
+
+      if (! busy)
+	break;
+
+      /* Wait for any one of them to complete.  */
+      for (i = 0; i < QUEUE_DEPTH; i++)
+	if (pending[i])
+	  {
+	    events[n] = queue_tokens[i].event;
+	    slots[n++] = i;
+	  }
+
+      if (Call_Service_3 (b->wait_for_event, n, events, &index)
+	  != GRUB_EFI_SUCCESS || index >= (grub_efi_uintn_t) n)
+	{
+	  /* Nothing can be done but wait for each in turn.  */
+	  for (i = 0; i < n; i++)
+	    Call_Service_3 (b->wait_for_event, 1, &events[i], &index);
+	  return -1;
+	}
+
+      i = slots[index];
+      pending[i] = 0;
+      busy--;
+      if (queue_tokens[i].transaction_status != GRUB_EFI_SUCCESS)
+	failed = 1;
+    }
+
+  return failed ? -1 : 0;
+}
+
+static void disk_tune (struct grub_efidisk_data *d);
+
+/* Start reading NSEC sectors from SECTOR in DRIVE in the background, if
+   the disk can, so that a read of them later finds them in memory.
+   Return non-zero if the disk can.  */
+int
+biosdisk_readahead (int drive, sector_t sector, int nsec)
+{
+  struct grub_efidisk_data *d;
+  grub_efi_block_io_media_t *m;
+  int chunk;
+
+  /* There is nothing to wait for, or nothing to ask the firmware.  */
+  if (drive == memdisk_drive || drive == loop_drive)
+    return 0;
+
+  d = get_device_from_drive (drive);
+  if (d && ! d->tuned)
+    disk_tune (d);
+  if (! d || ! d->block_io2 || d->use_block_io < 0)
+    return 0;
+
+  m = d->block_io2->media;
+  if (! m->media_present)
+    return 0;
+
+  if (sector > m->last_block)
+    return 1;
+  if (sector + nsec > m->last_block + 1)
+    nsec = m->last_block + 1 - sector;
+  if (d->readahead_max && nsec > d->readahead_max)
+    nsec = d->readahead_max;
+
+  chunk = READ_CHUNK_LEN / get_device_sector_size (d);
+  while (nsec > 0)
+    {
+      struct readahead *r = readahead_find (d, sector, 1, 1);
+      int n;
+
+      /* Already on its way, so carry on after it.  */
+      if (r)
+	n = r->sector + r->size - sector;
+      else
+	{
+	  n = nsec < chunk ? nsec : chunk;
+	  if (! readahead_start (d, sector, n))
+	    break;
+	}
+
+      sector += n;
+      nsec -= n;
+    }
+
+  return 1;
+}
+
+/* Wait for the reads in the background, so that nothing is written to
+   memory after the firmware is gone.  */
+void
+grub_efidisk_readahead_wait (void)
+{
+  struct readahead *r;
+
+  for (r = readaheads; r < readaheads + QUEUE_DEPTH; r++)
+    readahead_wait (r);
+}
+
+static void
+readahead_fini (void)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  int i;
+
+  grub_efidisk_readahead_wait ();
+
+  for (i = 0; i < QUEUE_DEPTH; i++)
+    {
+      struct readahead *r = readaheads + i;
+
+      if (r->buf)
+	grub_efi_free_pages ((grub_efi_physical_address_t)
+			     (unsigned long) r->buf, READ_CHUNK_PAGES);
+      if (r->token.event)
+	Call_Service_1 (b->close_event, r->token.event);
+      if (queue_tokens[i].event)
+	Call_Service_1 (b->close_event, queue_tokens[i].event);
+      r->buf = 0;
+      r->bio2 = 0;
+      r->token.event = 0;
+      queue_tokens[i].event = 0;
+    }
+}
+
+/*
+ *  The boot profile: the runs of sectors read while booting, kept in a
+ *  file from one boot to the next.  At the start of the next boot, they
+ *  are sorted, the runs close to each other are joined, and each is
+ *  read with one request into pages of its own, so that what the boot
+ *  reads afterwards comes from memory rather than from many seeks.
+ *
+ *  The profile only says where to read; the data always comes from the
+ *  disk in this boot, so a profile that no longer fits the files costs
+ *  some time and nothing else.
+ */
+
+#define PROFILE_RUNS		512
+/* The most sectors between two runs that still get read as one.  */
+#define PROFILE_GAP		128
+/* The most bytes a run is read into, and all of them together.  */
+#define PROFILE_RUN_LEN		(8 << 20)
+#define PROFILE_BUDGET		(64 << 20)
+#define PROFILE_MAGIC		0x46504247	/* "GBPF" */
+
+struct profile_run
+{
+  grub_uint64_t sector;
+  grub_uint32_t nsec;
+  grub_uint32_t drive;
+};
+
+struct profile_header
+{
+  grub_uint32_t magic;
+  grub_uint32_t count;
+};
+
+static struct profile_run profile_runs[PROFILE_RUNS];
+static int profile_count;
+static int profile_recording;
+
+/* The runs read at the start of this boot.  */
+struct prefetch
 {
   struct grub_efidisk_data *d;
+  grub_efi_uint32_t media_id;
+  grub_disk_addr_t sector;
+  grub_size_t size;
+  grub_efi_uintn_t pages;
+  char *buf;
+};
+
+static struct prefetch prefetches[PROFILE_RUNS];
+static int prefetch_count;
+
+/* Sort the runs in R, of COUNT, by drive and sector, and join the ones
+   which are no more than GAP sectors apart, as long as the result is
+   not longer than MAX sectors.  Return how many runs are left.  */
+static int
+profile_sort (struct profile_run *r, int count, grub_uint64_t gap,
+	      grub_uint64_t max)
+{
+  int i, j, n;
+
+  for (i = 1; i < count; i++)
+    {
+      struct profile_run t = r[i];
+
+      for (j = i; j > 0 && (r[j - 1].drive > t.drive
+			    || (r[j - 1].drive == t.drive
+				&& r[j - 1].sector > t.sector)); j--)
+	r[j] = r[j - 1];
+      r[j] = t;
+    }
+
+  for (i = 0, n = 0; i < count; i++)
+    {
+      struct profile_run *last = n ? &r[n - 1] : 0;
+
+      if (last && last->drive == r[i].drive
+	  && r[i].sector <= last->sector + last->nsec + gap
+	  && r[i].sector + r[i].nsec - last->sector <= max)
+	{
+	  if (r[i].sector + r[i].nsec > last->sector + last->nsec)
+	    last->nsec = r[i].sector + r[i].nsec - last->sector;
+	}
+      else
+	r[n++] = r[i];
+    }
+
+  return n;
+}
+
+/* Note that NSEC sectors from SECTOR of DRIVE are read.  */
+static void
+profile_note (int drive, sector_t sector, int nsec)
+{
+  struct profile_run *last;
+
+  if (! profile_recording || nsec <= 0)
+    return;
+
+  last = profile_count ? &profile_runs[profile_count - 1] : 0;
+  if (last && last->drive == (grub_uint32_t) drive
+      && sector >= last->sector && sector <= last->sector + last->nsec)
+    {
+      if (sector + nsec > last->sector + last->nsec)
+	last->nsec = sector + nsec - last->sector;
+      return;
+    }
+
+  /* Make room by joining the runs which touch.  */
+  if (profile_count == PROFILE_RUNS)
+    profile_count = profile_sort (profile_runs, profile_count, 0, ~0ULL);
+  if (profile_count == PROFILE_RUNS)
+    return;
+
+  last = &profile_runs[profile_count++];
+  last->drive = drive;
+  last->sector = sector;
+  last->nsec = nsec;
+}
+
+/* Start recording the reads, forgetting what was recorded before.  */
+void
+grub_efidisk_profile_start (void)
+{
+  profile_count = 0;
+  profile_recording = 1;
+}
+
+/* Stop recording, and put the profile in BUF, of LEN bytes.  Return
+   its length, or 0 if nothing was recorded.  */
+int
+grub_efidisk_profile_get (char *buf, int len)
+{
+  struct profile_header *h = (struct profile_header *) buf;
+  int count;
+
+  profile_recording = 0;
+  count = profile_sort (profile_runs, profile_count, 0, ~0ULL);
+  if (! count || len < (int) sizeof (*h) + (int) sizeof (profile_runs[0]))
+    return 0;
+
+  if (count > (int) ((len - sizeof (*h)) / sizeof (profile_runs[0])))
+    count = (len - sizeof (*h)) / sizeof (profile_runs[0]);
+
+  h->magic = PROFILE_MAGIC;
+  h->count = count;
+  grub_memcpy (h + 1, profile_runs, count * sizeof (profile_runs[0]));
+  return sizeof (*h) + count * sizeof (profile_runs[0]);
+}
+
+/* Read what the profile in BUF, of LEN bytes, says the boot will.  */
+void
+grub_efidisk_profile_replay (const char *buf, int len)
+{
+  const struct profile_header *h = (const struct profile_header *) buf;
+  struct profile_run *runs = profile_runs;
+  unsigned long budget = PROFILE_BUDGET;
+  int count, i;
+
+  if (len < (int) sizeof (*h) || h->magic != PROFILE_MAGIC
+      || h->count > PROFILE_RUNS
+      || len < (int) (sizeof (*h) + h->count * sizeof (runs[0])))
+    return;
+
+  /* The runs are only needed here until the recording starts.  */
+  grub_memcpy (runs, h + 1, h->count * sizeof (runs[0]));
+  count = profile_sort (runs, h->count, PROFILE_GAP, ~0ULL);
+
+  for (i = 0; i < count && prefetch_count < PROFILE_RUNS; i++)
+    {
+      struct grub_efidisk_data *d = get_device_from_drive (runs[i].drive);
+      grub_efi_block_io_media_t *m;
+      struct prefetch *p;
+      grub_disk_addr_t sector = runs[i].sector;
+      grub_size_t nsec = runs[i].nsec, max;
+
+      if (! d || runs[i].drive == (grub_uint32_t) memdisk_drive
+	  || runs[i].drive == (grub_uint32_t) loop_drive)
+	continue;
+
+      m = d->block_io->media;
+      if (! m->media_present || sector > m->last_block)
+	continue;
+      if (sector + nsec > m->last_block + 1)
+	nsec = m->last_block + 1 - sector;
 
-  for (d = devices; d && num; d = d->next, num--)
-    ;
+      /* A run too long for one read goes on in the next one.  */
+      max = PROFILE_RUN_LEN / get_device_sector_size (d);
+      if (nsec > max)
+	{
+	  runs[i].sector += max;
+	  runs[i].nsec = nsec - max;
+	  nsec = max;
+	  i--;
+	}
+
+      if (nsec * get_device_sector_size (d) > budget)
+	break;
+
+      p = &prefetches[prefetch_count];
+      p->pages = (nsec * get_device_sector_size (d) + 4095) >> 12;
+      p->buf = grub_efi_allocate_anypages (p->pages);
+      if (! p->buf)
+	break;
+
+      if (grub_efidisk_read (d, sector, nsec, p->buf))
+	{
+	  grub_efi_free_pages ((grub_efi_physical_address_t)
+			       (unsigned long) p->buf, p->pages);
+	  continue;
+	}
+
+      p->d = d;
+      p->media_id = m->media_id;
+      p->sector = sector;
+      p->size = nsec;
+      budget -= nsec * get_device_sector_size (d);
+      prefetch_count++;
+    }
 
-  if (num == 0)
-    return d;
+  grub_dprintf ("efidisk", "read %d runs of the boot profile, %lu bytes\n",
+		prefetch_count, PROFILE_BUDGET - budget);
+}
+
+/* Find what was read at the start which holds SIZE sectors from SECTOR
+   of D, or the first one which overlaps them if ANY is non-zero.  */
+static struct prefetch *
+prefetch_find (struct grub_efidisk_data *d, grub_disk_addr_t sector,
+	       grub_size_t size, int any)
+{
+  struct prefetch *p;
+
+  for (p = prefetches; p < prefetches + prefetch_count; p++)
+    {
+      if (p->d != d || ! p->buf
+	  || p->media_id != d->block_io->media->media_id)
+	continue;
+
+      if (any ? (sector < p->sector + p->size && p->sector < sector + size)
+	  : (p->sector <= sector && sector + size <= p->sector + p->size))
+	return p;
+    }
 
   return 0;
 }
 
+static void
+prefetch_free (struct prefetch *p)
+{
+  grub_efi_free_pages ((grub_efi_physical_address_t) (unsigned long) p->buf,
+		       p->pages);
+  p->buf = 0;
+}
+
+static void
+prefetch_fini (void)
+{
+  int i;
+
+  for (i = 0; i < prefetch_count; i++)
+    if (prefetches[i].buf)
+      prefetch_free (&prefetches[i]);
+  prefetch_count = 0;
+  profile_recording = 0;
+}
+
+/*
+ *  Whether the block io or the disk io reads a disk faster, and how much
+ *  it pays to read at once, differ from one machine to the next.  The
+ *  first time a disk is read, both are timed on its first sectors, and
+ *  so are reads of a few sizes; what was found is kept in an EFI
+ *  variable, by the hash of the device path and the size of the media,
+ *  so that later boots take it as it is until the disk, or where it is
+ *  attached, changes.
+ */
+#define TUNE_MAX	16
+/* The largest read timed, and the buffer for it: 256K.  */
+#define TUNE_PAGES	64
+
+struct disk_tune
+{
+  grub_efi_uint32_t hash;
+  grub_efi_uint32_t block_size;
+  grub_efi_uint64_t last_block;
+  grub_efi_int32_t use_block_io;
+  grub_efi_uint32_t readahead_max;
+};
+
+static grub_efi_char16_t disk_tune_name[] = {
+  'G', 'r', 'u', 'b', 'I', 'O', 'T', 'u', 'n', 'e', 0
+};
+static grub_efi_guid_t grub_variable_guid = GRUB_EFI_GRUB_VARIABLE_GUID;
+
+/* What the variable holds, the latest first, or a count of -1 until it
+   is read.  */
+static struct disk_tune disk_tunes[TUNE_MAX];
+static int disk_tune_count = -1;
+
+/* Return how many TSC cycles reading LEN bytes from BYTE of D into BUF
+   took, with the block io if BLOCK_IO is set and the disk io otherwise,
+   or 0 if the read failed.  */
+static unsigned long long
+disk_tune_time (struct grub_efidisk_data *d, int block_io,
+		grub_efi_uint64_t byte, grub_efi_uintn_t len, char *buf)
+{
+  grub_efi_block_io_t *bio = d->block_io;
+  unsigned long long start = bootprof_now ();
+  grub_efi_status_t status;
+
+  if (block_io)
+    status = Call_Service_5 (bio->read_blocks, bio, bio->media->media_id,
+			     byte / bio->media->block_size, len, buf);
+  else
+    status = Call_Service_5 (d->disk_io->read, d->disk_io,
+			     bio->media->media_id, byte, len, buf);
+  if (status != GRUB_EFI_SUCCESS)
+    return 0;
+  return (bootprof_now () - start) | 1;
+}
+
+/* Measure D into T: which io is faster on a read of TUNE_PAGES, and the
+   least of 16K, 64K and 256K whose reads go at nearly the speed of the
+   largest, which is as far as reading ahead in the background goes, or
+   no limit if even the largest reads are still well short of it.
+   Return zero if it can not be told.  */
+static int
+disk_tune_measure (struct grub_efidisk_data *d, struct disk_tune *t)
+{
+  grub_efi_block_io_media_t *m = d->block_io->media;
+  grub_efi_uintn_t len = TUNE_PAGES << 12;
+  unsigned long long bio, dio, t16, t64, t256;
+  char *buf;
+
+  if (! bootprof_now () || ! m->media_present || ! m->block_size
+      || (len & (m->block_size - 1))
+      || (m->last_block + 1) * m->block_size < 8 * len)
+    return 0;
+
+  buf = grub_efi_allocate_anypages (TUNE_PAGES);
+  if (! buf)
+    return 0;
+
+  /* Each read is of sectors not read before, so that no cache on the
+     way favours one over another.  */
+  t->use_block_io = -1;
+  if (block_io_aligned (d, buf)
+      && disk_tune_time (d, 1, 0, len, buf)
+      && (bio = disk_tune_time (d, 1, len, len, buf)))
+    {
+      dio = disk_tune_time (d, 0, 2 * len, len, buf);
+      if (! dio || bio <= dio)
+	t->use_block_io = 1;
+    }
+
+  t16 = disk_tune_time (d, t->use_block_io > 0, 3 * len, 16 << 10, buf);
+  t64 = disk_tune_time (d, t->use_block_io > 0, 4 * len, 64 << 10, buf);
+  t256 = disk_tune_time (d, t->use_block_io > 0, 5 * len, len, buf);
+
+  grub_efi_free_pages ((grub_efi_physical_address_t) (unsigned long) buf,
+		       TUNE_PAGES);
+
+  if (! t16 || ! t64 || ! t256)
+    return 0;
+
+  /* Within an eighth of the speed of the largest read.  */
+  t->readahead_max = 0;
+  if (t16 * 16 * 8 <= t256 * 9)
+    t->readahead_max = (16 << 10) / m->block_size;
+  else if (t64 * 4 * 8 <= t256 * 9)
+    t->readahead_max = (64 << 10) / m->block_size;
+
+  grub_dprintf ("efidisk", "tuned: %s io, read ahead %u sectors\n",
+		t->use_block_io > 0 ? "block" : "disk",
+		(unsigned) t->readahead_max);
+  return 1;
+}
+
+/* Set how D is read, from the variable if it has been measured before,
+   and by measuring it, and keeping that, if not.  */
+static void
+disk_tune (struct grub_efidisk_data *d)
+{
+  grub_efi_runtime_services_t *rt = grub_efi_system_table->runtime_services;
+  grub_efi_block_io_media_t *m = d->block_io->media;
+  grub_efi_uintn_t size;
+  struct disk_tune t;
+  int i;
+
+  d->tuned = 1;
+
+  if (disk_tune_count < 0)
+    {
+      size = sizeof (disk_tunes);
+      if (Call_Service_5 (rt->get_variable, disk_tune_name,
+			  &grub_variable_guid, 0, &size, disk_tunes)
+	  == GRUB_EFI_SUCCESS)
+	disk_tune_count = size / sizeof (disk_tunes[0]);
+      else
+	disk_tune_count = 0;
+    }
+
+  grub_memset (&t, 0, sizeof (t));
+  t.hash = d->hash;
+  t.block_size = m->block_size;
+  t.last_block = m->last_block;
+
+  for (i = 0; i < disk_tune_count; i++)
+    if (disk_tunes[i].hash == t.hash
+	&& disk_tunes[i].block_size == t.block_size
+	&& disk_tunes[i].last_block == t.last_block)
+      {
+	d->use_block_io = disk_tunes[i].use_block_io;
+	d->readahead_max = disk_tunes[i].readahead_max;
+	return;
+      }
+
+  if (! disk_tune_measure (d, &t))
+    return;
+
+  d->use_block_io = t.use_block_io;
+  d->readahead_max = t.readahead_max;
+
+  /* The latest first, and the oldest out if there is no room.  */
+  if (disk_tune_count < TUNE_MAX)
+    disk_tune_count++;
+  grub_memmove ((char *) &disk_tunes[1], (char *) &disk_tunes[0],
+		(disk_tune_count - 1) * sizeof (disk_tunes[0]));
+  disk_tunes[0] = t;
+  Call_Service_5 (rt->set_variable, disk_tune_name, &grub_variable_guid,
+		  GRUB_EFI_VARIABLE_NON_VOLATILE
+		  | GRUB_EFI_VARIABLE_BOOTSERVICE_ACCESS,
+		  disk_tune_count * sizeof (disk_tunes[0]), disk_tunes);
+}
+
 static int
 grub_efidisk_read (struct grub_efidisk_data *d, grub_disk_addr_t sector,
 		   grub_size_t size, char *buf)
 {
-  /* For now, use the disk io interface rather than the block io's.  */
   grub_efi_disk_io_t *dio;
   grub_efi_block_io_t *bio;
   grub_efi_status_t status;
@@ -264,6 +1209,61 @@ grub_efidisk_read (struct grub_efidisk_data *d, grub_disk_addr_t sector,
   dio = d->disk_io;
   bio = d->block_io;
 
+  if (! d->tuned)
+    disk_tune (d);
+
+  {
+    struct prefetch *p = prefetch_find (d, sector, size, 0);
+
+    if (p)
+      {
+	grub_memcpy (buf, p->buf + (sector - p->sector) * sector_size,
+		     size * sector_size);
+	return 0;
+      }
+  }
+
+  if (d->block_io2)
+    {
+      struct readahead *r = readahead_find (d, sector, size, 0);
+
+      if (r)
+	{
+	  readahead_wait (r);
+	  if (r->bio2)
+	    {
+	      grub_memcpy (buf, r->buf + (sector - r->sector) * sector_size,
+			   size * sector_size);
+	      r->stamp = ++readahead_clock;
+	      return 0;
+	    }
+	}
+
+      if (size * sector_size >= 2 * READ_CHUNK_LEN
+	  && d->use_block_io >= 0 && block_io_aligned (d, buf)
+	  && ! read_queued (d, sector, size, buf))
+	return 0;
+    }
+
+  /* The request is in whole sectors already, so if the buffer suits
+     the block io too, read it all with one call.  */
+  if (d->use_block_io >= 0 && block_io_aligned (d, buf))
+    {
+      status = Call_Service_5 (bio->read_blocks,
+			       bio, bio->media->media_id,
+			       sector, size * sector_size, buf);
+      if (status == GRUB_EFI_SUCCESS)
+	{
+	  d->use_block_io = 1;
+	  return 0;
+	}
+
+      grub_dprintf ("efidisk",
+		    "block io read of 0x%x sectors at 0x%x failed: 0x%lx\n",
+		    (unsigned) size, (unsigned) sector,
+		    (unsigned long) status);
+    }
+
   status = Call_Service_5 (dio->read,
 			   dio, bio->media->media_id,
 			   sector * sector_size,
@@ -272,6 +1272,12 @@ grub_efidisk_read (struct grub_efidisk_data *d, grub_disk_addr_t sector,
   if (status != GRUB_EFI_SUCCESS)
     return -1;
 
+  /* The disk io could and the block io could not, so this device is
+     better off without it.  A block io that has worked once is kept,
+     since the failure was more likely the media than the driver.  */
+  if (d->use_block_io == 0 && block_io_aligned (d, buf))
+    d->use_block_io = -1;
+
   return 0;
 }
 
@@ -288,6 +1294,25 @@ grub_efidisk_write (struct grub_efidisk_data *d, grub_disk_addr_t sector,
   dio = d->disk_io;
   bio = d->block_io;
 
+  /* Whatever was read ahead there is not what is on the disk now.  */
+  {
+    struct prefetch *p;
+
+    while ((p = prefetch_find (d, sector, size, 1)))
+      prefetch_free (p);
+  }
+
+  if (d->block_io2)
+    {
+      struct readahead *r;
+
+      while ((r = readahead_find (d, sector, size, 1)))
+	{
+	  readahead_wait (r);
+	  r->bio2 = 0;
+	}
+    }
+
   grub_dprintf ("efidisk",
 		"writing 0x%x sectors at the sector 0x%x to ??\n",
 		(unsigned) size, (unsigned int) sector);
@@ -303,18 +1328,25 @@ grub_efidisk_write (struct grub_efidisk_data *d, grub_disk_addr_t sector,
   return 0;
 }
 
+/* The disks are enumerated by enumerate_disks when they are first
+   needed.  */
 void
 grub_efidisk_init (void)
 {
-  enumerate_disks ();
+  disks_enumerated = 0;
 }
 
 void
 grub_efidisk_fini (void)
 {
+  readahead_fini ();
+  prefetch_fini ();
   free_devices (fd_devices);
   free_devices (hd_devices);
   free_devices (cd_devices);
+  fd_devices = hd_devices = cd_devices = 0;
+  grub_memset (drive_devices, 0, sizeof (drive_devices));
+  disks_enumerated = 0;
 }
 
 static int
@@ -326,7 +1358,15 @@ get_device_sector_size(struct grub_efidisk_data *device)
 int
 get_sector_size(int drive)
 {
-	struct grub_efidisk_data *device = get_device_from_drive(drive);
+	struct grub_efidisk_data *device;
+
+	if (drive == memdisk_drive || drive == loop_drive) {
+		struct geometry geom;
+
+		get_diskinfo(drive, &geom);
+		return geom.sector_size;
+	}
+	device = get_device_from_drive(drive);
 	return get_device_sector_size(device);
 }
 
@@ -368,14 +1408,12 @@ get_device_from_drive (int drive)
 #endif
   if (drive == GRUB_INVALID_DRIVE)
     return NULL;
+  enumerate_disks ();
   if (drive == cdrom_drive)
-    return get_device (cd_devices, 0);
-  /* Hard disk */
-  if (drive & 0x80)
-    return get_device (hd_devices, drive - 0x80);
-  /* Floppy disk */
-  else
-    return get_device (fd_devices, drive);
+    return cd_devices;
+  if (drive < 0 || drive >= 0x100)
+    return NULL;
+  return drive_devices[drive];
 }
 
 /* Low-level disk I/O.  Our stubbed version just returns a file
@@ -385,6 +1423,11 @@ get_diskinfo (int drive, struct geometry *geometry)
 {
   struct grub_efidisk_data *d;
 
+  if (drive == memdisk_drive)
+    return memdisk_get_diskinfo (geometry);
+  if (drive == loop_drive)
+    return loop_get_diskinfo (geometry);
+
   d = get_device_from_drive (drive);
   if (!d)
     return -1;
@@ -402,19 +1445,25 @@ get_diskinfo (int drive, struct geometry *geometry)
 
 int
 biosdisk (int subfunc, int drive, struct geometry *geometry,
-	  int sector, int nsec, int segment)
+	  sector_t sector, int nsec, int segment)
 {
   char *buf;
   struct grub_efidisk_data *d;
   int ret;
 
+  buf = (char *) ((unsigned long) segment << 4);
+  if (drive == memdisk_drive)
+    return memdisk_rw (subfunc, sector, nsec, buf);
+  if (drive == loop_drive)
+    return loop_rw (subfunc, sector, nsec, buf);
+
   d = get_device_from_drive (drive);
   if (!d)
     return -1;
-  buf = (char *) ((unsigned long) segment << 4);
   switch (subfunc)
     {
     case BIOSDISK_READ:
+      profile_note (drive, sector, nsec);
       ret = grub_efidisk_read (d, sector, nsec, buf);
       break;
     case BIOSDISK_WRITE:
@@ -427,6 +1476,48 @@ biosdisk (int subfunc, int drive, struct geometry *geometry,
   return 0;
 }
 
+/* Read NSEC sectors starting from SECTOR in DRIVE into BUF. The
+   firmware transfers the data to BUF directly, so this doesn't need
+   any bounce buffer.  */
+int
+biosdisk_read (int drive, struct geometry *geometry,
+	       sector_t sector, int nsec, char *buf)
+{
+  struct grub_efidisk_data *d;
+
+  if (drive == memdisk_drive)
+    return memdisk_rw (BIOSDISK_READ, sector, nsec, buf);
+  if (drive == loop_drive)
+    return loop_rw (BIOSDISK_READ, sector, nsec, buf);
+
+  d = get_device_from_drive (drive);
+  if (!d)
+    return -1;
+
+  profile_note (drive, sector, nsec);
+  return grub_efidisk_read (d, sector, nsec, buf);
+}
+
+/* Write NSEC sectors from BUF to SECTOR in DRIVE, directly as
+   biosdisk_read reads.  */
+int
+biosdisk_write (int drive, struct geometry *geometry,
+		sector_t sector, int nsec, char *buf)
+{
+  struct grub_efidisk_data *d;
+
+  if (drive == memdisk_drive)
+    return memdisk_rw (BIOSDISK_WRITE, sector, nsec, buf);
+  if (drive == loop_drive)
+    return loop_rw (BIOSDISK_WRITE, sector, nsec, buf);
+
+  d = get_device_from_drive (drive);
+  if (!d)
+    return -1;
+
+  return grub_efidisk_write (d, sector, nsec, buf);
+}
+
 /* Some utility functions to map GRUB devices with EFI devices.  */
 grub_efi_handle_t
 grub_efidisk_get_current_bdev_handle (void)
@@ -452,6 +1543,7 @@ grub_efidisk_get_current_bdev_handle (void)
   else
     {
       struct grub_efidisk_data *devices;
+      struct device_index index;
       grub_efi_handle_t handle = 0;
       auto int find_partition (struct grub_efidisk_data *c);
 
@@ -475,7 +1567,11 @@ grub_efidisk_get_current_bdev_handle (void)
 	}
 
       devices = make_devices ();
-      iterate_child_devices (devices, d, find_partition);
+      if (index_devices (devices, &index))
+	{
+	  iterate_child_devices (&index, d, find_partition);
+	  grub_free (index.buckets);
+	}
       free_devices (devices);
 
       if (handle != 0)
@@ -492,12 +1588,14 @@ grub_get_drive_partition_from_bdev_handle (grub_efi_handle_t handle,
 {
   grub_efi_device_path_t *dp, *dp1;
   struct grub_efidisk_data *d, *devices;
+  struct device_index index;
   int drv;
   unsigned long part;
   grub_efi_hard_drive_device_path_t hd;
   int found;
   int part_type, part_entry;
-  unsigned long partition_start, partition_len, part_offset, part_extoffset;
+  sector_t partition_start, partition_len;
+  unsigned long part_offset, part_extoffset;
   unsigned long gpt_offset;
   int gpt_count, gpt_size;
   auto int find_bdev (struct grub_efidisk_data *c);
@@ -556,6 +1654,8 @@ grub_get_drive_partition_from_bdev_handle (grub_efi_handle_t handle,
       dp1 = GRUB_EFI_NEXT_DEVICE_PATH(dp1);
     }
 
+  enumerate_disks ();
+
   drv = 0;
   for (d = fd_devices; d; d = d->next, drv++)
     {
@@ -590,11 +1690,15 @@ grub_get_drive_partition_from_bdev_handle (grub_efi_handle_t handle,
 
   drv = 0x80;
   found = 0;
-  for (d = hd_devices; d; d = d->next, drv++)
+  if (index_devices (devices, &index))
     {
-      iterate_child_devices (devices, d, find_bdev);
-      if (found)
-	break;
+      for (d = hd_devices; d; d = d->next, drv++)
+	{
+	  iterate_child_devices (&index, d, find_bdev);
+	  if (found)
+	    break;
+	}
+      grub_free (index.buckets);
     }
 
   free_devices (devices);
@@ -762,6 +1866,8 @@ assign_device_name (int drive, const char *device)
   if (!dp1)
     return;
 
+  enumerate_disks ();
+
   if (drive & 0x80)
     {
       drive -= 0x80;
@@ -979,21 +979,64 @@ broken_hd:
   return ret;
 }
 
+/* The strings parsed last by device_path_from_utf8, and what they gave,
+   because the device command parses the same one in check_device and
+   again in assign_device_name, and scripts name the same few devices
+   over and over.  */
+#define DP_CACHE_SIZE		4
+#define DP_CACHE_STR_LEN	128
+
+struct dp_cache_entry
+{
+  char str[DP_CACHE_STR_LEN];
+  grub_efi_uint8_t dp[sizeof (struct hd_media_device_path)
+		      + sizeof (struct generic_device_path)];
+  grub_size_t len;
+  unsigned long used;
+};
+
+static struct dp_cache_entry dp_cache[DP_CACHE_SIZE];
+static unsigned long dp_cache_clock;
+
 grub_efi_device_path_t *
 device_path_from_utf8 (const char *device)
 {
+  struct dp_cache_entry *e, *victim = dp_cache;
+  grub_efi_uint8_t buf[sizeof (e->dp)];
   grub_size_t device_len;
-  grub_efi_device_path_t *dp = NULL;
+  grub_efi_device_path_t *dp;
+
+  for (e = dp_cache; e < dp_cache + DP_CACHE_SIZE; e++)
+    {
+      if (e->len && ! grub_strcmp (e->str, device))
+	{
+	  e->used = ++dp_cache_clock;
+	  dp = grub_malloc (e->len);
+	  if (dp)
+	    grub_memcpy (dp, e->dp, e->len);
+	  return dp;
+	}
+      if (e->used < victim->used)
+	victim = e;
+    }
+
+  /* Parse it once, into BUF, which holds the largest node known and
+     the end node, rather than once to size it and once to fill it.  */
+  device_len = parse_device_path_component(device, buf);
+  device_len += parse_device_path_component("EndEntire", buf + device_len);
+
+  if (grub_strlen (device) < DP_CACHE_STR_LEN)
+    {
+      grub_strcpy (victim->str, device);
+      grub_memcpy (victim->dp, buf, device_len);
+      victim->len = device_len;
+      victim->used = ++dp_cache_clock;
+    }
 
-  device_len = parse_device_path_component(device, dp);
-  device_len += parse_device_path_component("EndEntire", dp);
   dp = grub_malloc(device_len);
   if (!dp)
     return NULL;
-  device_len = parse_device_path_component(device, dp);
-  device_len += parse_device_path_component("EndEntire",
-				     (void *)((unsigned long)dp + device_len));
-
+  grub_memcpy (dp, buf, device_len);
 
   return dp;
 }
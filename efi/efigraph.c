@@ -33,8 +33,10 @@
 #include <term.h>
 #include <shared.h>
 #include <graphics.h>
+#include <bootprof.h>
 
 #include "graphics.h"
+#include "efiblt.h"
 #include "xpm.h"
 
 #define dbgdelay(_f, _l) ({\
@@ -74,6 +76,7 @@ typedef struct grub_pixel_info grub_pixel_info_t;
 
 static grub_efi_guid_t graphics_output_guid = GRUB_EFI_GRAPHICS_OUTPUT_GUID;
 static grub_efi_guid_t pci_io_guid = GRUB_EFI_PCI_IO_GUID;
+static grub_efi_guid_t grub_variable_guid = GRUB_EFI_GRUB_VARIABLE_GUID;
 
 #ifndef MIN
 #define MIN(x,y) ( ((x) < (y)) ? (x) : (y))
@@ -82,20 +85,16 @@ static grub_efi_guid_t pci_io_guid = GRUB_EFI_PCI_IO_GUID;
 #define MAX(x,y) ( ((x) < (y)) ? (y) : (x))
 #endif
 
-#define pixel_equal(x,y) ((x).bgrr.red == (y).bgrr.red && \
-                          (x).bgrr.green == (y).bgrr.green && \
-                          (x).bgrr.blue == (y).bgrr.blue && \
-                          (x).bgrr.reserved == (y).bgrr.reserved)
-
 struct video_mode {
     grub_efi_uint32_t number;
     grub_efi_uintn_t size;
     grub_efi_graphics_output_mode_information_t *info;
 };
 
-#define MAX_PALETTE 16
 struct eg {
+    struct blt blt;
     struct graphics_backend *backend;
+    grub_efi_handle_t handle;
     grub_efi_graphics_output_t *output_intf;
     struct video_mode **modes;
     int max_mode;
@@ -103,39 +102,11 @@ struct eg {
     grub_efi_uint32_t graphics_mode;
     grub_pixel_info_t pixel_info;
     enum { TEXT, GRAPHICS } current_mode;
-
-    position_t screen_size;
-    position_t screen_pos;
-
-    struct bltbuf *background;
-
-    grub_efi_graphics_output_pixel_t palette[MAX_PALETTE + 1];
-};
-
-#define RGB(r,g,b) { .bgrr.red = r, .bgrr.green = g, .bgrr.blue = b }
-
-static grub_efi_graphics_output_pixel_t cga_colors[] = {
-    RGB(0x00,0x00,0x00), //  0 Black
-    RGB(0x7f,0x00,0x00), //  1 Dark Red
-    RGB(0x00,0x7f,0x00), //  2 Dark Green
-    RGB(0x7f,0x7f,0x00), //  3 Dark Yellow
-    RGB(0x00,0x00,0x7f), //  4 Dark Blue
-    RGB(0x7f,0x00,0x7f), //  5 Dark Magenta
-    RGB(0x00,0x7f,0x7f), //  6 Dark Cyan
-    RGB(0xc0,0xc0,0xc0), //  7 Light Grey
-    RGB(0x7f,0x7f,0x7f), //  8 Dark Grey
-    RGB(0xff,0x00,0x00), //  9 Red
-    RGB(0x00,0xff,0x00), // 10 Green
-    RGB(0xff,0xff,0x00), // 11 Yellow
-    RGB(0x00,0x00,0xff), // 12 Blue
-    RGB(0xff,0x00,0xff), // 13 Magenta
-    RGB(0x00,0xff,0xff), // 14 Cyan
-    RGB(0xff,0xff,0xff), // 15 White
-    RGB(0xff,0xff,0xff), // 16 Also white ;)
+    /* Whether the firmware's Blt was found faster than storing into
+       the framebuffer, as it is on some machines.  */
+    int use_blt;
 };
 
-static const int n_cga_colors = sizeof (cga_colors) / sizeof (cga_colors[0]);
-
 static void
 find_bits (unsigned long mask, unsigned char *first,
 	   unsigned char* len)
@@ -321,238 +292,129 @@ set_kernel_params(struct graphics_backend *backend,
 }
 
 static void
-pixel_to_rgb(grub_efi_graphics_output_pixel_t *pixel,
-             int *red, int *green, int *blue)
-{
-    *red = pixel->bgrr.red;
-    *green = pixel->bgrr.green;
-    *blue = pixel->bgrr.blue;
-}
-
-static void
-rgb_to_pixel(int red, int green, int blue,
-             grub_efi_graphics_output_pixel_t *pixel)
-{
-    pixel->bgrr.red = red;
-    pixel->bgrr.green = green;
-    pixel->bgrr.blue = blue;
-}
-
-static void
-position_to_phys(struct eg *eg, position_t *virt, position_t *phys)
-{
-    phys->x = virt->x + eg->screen_pos.x;
-    phys->y = virt->y + eg->screen_pos.y;
-}
-
-static int
-abs_paddr(struct eg *eg, position_t *virt)
-{
-    position_t phys;
-    position_to_phys(eg, virt, &phys);
-    return phys.x + phys.y * eg->screen_size.x;
-}
-
-struct bltbuf {
-    grub_efi_uintn_t width;
-    grub_efi_uintn_t height;
-    grub_efi_graphics_output_pixel_t pixbuf[];
-};
-
-static struct bltbuf *alloc_bltbuf(grub_efi_uintn_t width,
-					   grub_efi_uintn_t height)
-{
-	struct bltbuf *buf = NULL;
-	grub_efi_uintn_t pixbuf_size = width * height *
-		sizeof (grub_efi_graphics_output_pixel_t);
-
-	if (!(buf = grub_malloc(sizeof(buf->width) + sizeof(buf->height) +
-				pixbuf_size)))
-		return NULL;
-
-	buf->width = width;
-	buf->height = height;
-	grub_memset(buf->pixbuf, '\0', pixbuf_size);
-	return buf;
-}
-
-
-static void
-hw_blt_pos_to_screen_pos(struct eg *eg, struct bltbuf *bltbuf,
-                      position_t *bltpos, position_t *bltsz, position_t *pos)
+hw_blt_to_screen(struct eg *eg, struct bltbuf *bltbuf,
+                 position_t *bltpos, position_t *bltsz, position_t *phys)
 {
-    position_t phys;
-
-    position_to_phys(eg, pos, &phys);
-
     Call_Service_10(eg->output_intf->blt, eg->output_intf, (void *)bltbuf->pixbuf,
                     GRUB_EFI_BLT_BUFFER_TO_VIDEO,
                     bltpos->x, bltpos->y,
-                    phys.x, phys.y,
+                    phys->x, phys->y,
                     bltsz->x, bltsz->y,
-                    0);
+                    bltbuf->width * sizeof (bltbuf->pixbuf[0]));
 }
 
-static void
-blt_pos_to_screen_pos(struct eg *eg, struct bltbuf *bltbuf,
-        position_t *bltpos, position_t *bltsz, position_t *pos)
+/* Return the framebuffer, if pixels can simply be stored into it: the
+ * 32 bit formats, at an address this processor can reach.  That is much
+ * faster than the firmware's Blt on some machines.
+ */
+static grub_efi_graphics_output_pixel_t *
+get_framebuffer(struct eg *eg)
 {
     grub_efi_graphics_output_mode_information_t *info = get_graphics_mode_info(eg);
-    grub_efi_graphics_output_pixel_t *pixel;
-    position_t phys;
-    const int pxlstride = info->pixels_per_scan_line;
-    const int bytestride = pxlstride * sizeof (*pixel);
-
-    position_to_phys(eg, pos, &phys);
-
-    if (info->pixel_format == GRUB_EFI_PIXEL_BLT_ONLY || 1) {
-        hw_blt_pos_to_screen_pos(eg, bltbuf, bltpos, bltsz, pos);
-#if 0
-    } else if (info->pixel_format == GRUB_EFI_PIXEL_BIT_MASK) {
-        int y;
-        grub_pixel_info_t *pinfo = &eg->pixel_info;
-        const int maxpixels =
-            MIN(info->horizontal_resolution - pos->x, bltsz->x);
+    grub_efi_physical_address_t base = eg->output_intf->mode->frame_buffer_base;
 
-        for (y = bltpos->y; y < bltpos->y + bltsz->y; y++, phys.y++) {
-            char raw_pixels[maxpixels * pinfo->depth_bytes];
-            char *fb = (char *)(unsigned long)eg->output_intf->mode->frame_buffer_base;
-            int x;
-
-            pixel = (void *)&bltbuf->pixbuf[y * bltbuf->width + bltpos->x];
-            fb += phys.y * pinfo->line_length + phys.x * pinfo->depth_bytes;
-
-            for (x = 0; x < maxpixels; x++) {
-                char depth_bytes = pinfo->depth_bytes;
-                char *raw_pixel = raw_pixels + x * depth_bytes;
+    if (eg->use_blt)
+        return NULL;
+    if (info->pixel_format != GRUB_EFI_PIXEL_RGBR_8BIT_PER_COLOR &&
+            info->pixel_format != GRUB_EFI_PIXEL_BGRR_8BIT_PER_COLOR)
+        return NULL;
+    if (!base || (unsigned long)base != base)
+        return NULL;
+    return (void *)(unsigned long)base;
+}
 
-                int red, green, blue, color;
-                char *colorp;
+static void
+fb_blt_to_screen(struct eg *eg, grub_efi_graphics_output_pixel_t *fb,
+        struct bltbuf *bltbuf, position_t *bltpos, position_t *bltsz,
+        position_t *phys)
+{
+    grub_efi_graphics_output_mode_information_t *info = get_graphics_mode_info(eg);
+    grub_efi_graphics_output_pixel_t *dp;
+    grub_efi_uint32_t *sp;
+    int width, height, x, y;
 
-#if 0
-                red = pixel[x].bgrr.red & 0x3f;
-                green = pixel[x].bgrr.green & 0x3f;
-                blue = pixel[x].bgrr.blue & 0x3f;
-                red = red * ((1 << pinfo->red_size) - 1) / 0x3f;
-                green = green * ((1 << pinfo->green_size) - 1) / 0x3f;
-                blue = blue * ((1 << pinfo->blue_size) - 1) / 0x3f;
-#else
-                red = pixel[x].bgrr.red;
-                green = pixel[x].bgrr.green;
-                blue = pixel[x].bgrr.blue;
+    width = MIN(bltsz->x, (int)info->horizontal_resolution - phys->x);
+    height = MIN(bltsz->y, (int)info->vertical_resolution - phys->y);
 
-                red >>= 8 - pinfo->red_size;
-                green >>= 8 - pinfo->green_size;
-                blue >>= 8 - pinfo->blue_size;
-#endif
+    for (y = 0; y < height; y++) {
+        dp = &fb[(phys->y + y) * info->pixels_per_scan_line + phys->x];
+        sp = (grub_efi_uint32_t *)
+            &bltbuf->pixbuf[(bltpos->y + y) * bltbuf->width + bltpos->x];
 
-                color = (red << pinfo->red_pos) |
-                        (green << pinfo->green_pos) |
-                        (blue << pinfo->blue_pos);
-                colorp = (void *)&color;
-                while (depth_bytes--)
-                    *raw_pixel++ = *colorp++;
-            }
-            memmove(fb, raw_pixels, maxpixels * pinfo->depth_bytes);
+        if (info->pixel_format == GRUB_EFI_PIXEL_BGRR_8BIT_PER_COLOR) {
+            memmove(dp, sp, width * sizeof (*dp));
+            continue;
         }
-#endif
-    } else {
-        int y;
-        grub_pixel_info_t *pinfo = &eg->pixel_info;
-        const int maxpixels =
-            MIN(info->horizontal_resolution - pos->x, bltsz->x);
-
-	//char *line = &fb[phys.y * bytestride + phys.x * sizeof(*pixel)];
-        for (y = bltpos->y; y < bltpos->y + bltsz->y; y++, phys.y++) {
-	    char raw_pixels[maxpixels * sizeof(*pixel)];
-            char *fb = (char *)(unsigned long)eg->output_intf->mode->frame_buffer_base;
-            int x;
-
-            pixel = (void *)&bltbuf->pixbuf[y * bltbuf->width + bltpos->x];
-            fb += phys.y * pinfo->line_length + phys.x * pinfo->depth_bytes;
-
-            if (info->pixel_format == GRUB_EFI_PIXEL_BGRR_8BIT_PER_COLOR) {
-                memmove(raw_pixels, pixel, maxpixels * sizeof (*pixel));
-                continue;
-            } else if (info->pixel_format==GRUB_EFI_PIXEL_RGBR_8BIT_PER_COLOR) {
-                grub_efi_graphics_output_pixel_t shadow[maxpixels];
-                for (x = 0; x < maxpixels; x++) {
-                    shadow[x].rgbr.red = pixel[x].bgrr.red;
-                    shadow[x].rgbr.green = pixel[x].bgrr.green;
-                    shadow[x].rgbr.blue = pixel[x].bgrr.blue;
-                }
-
-                memmove(raw_pixels, shadow, maxpixels * sizeof (*pixel));
-            } else if (info->pixel_format == GRUB_EFI_PIXEL_BIT_MASK) {
-                for (x = 0; x < maxpixels; x++) {
-                    char depth_bytes = pinfo->depth_bytes;
-                    char *raw_pixel = raw_pixels + x * depth_bytes;
 
-                    int red, green, blue, color;
-                    char *colorp;
+        /* swap red and blue, a whole pixel at a time, since the
+         * framebuffer may well be slow to take single bytes */
+        for (x = 0; x < width; x++) {
+            grub_efi_uint32_t raw = sp[x];
 
-#if 0
-                    red = pixel[x].bgrr.red & 0x3f;
-                    green = pixel[x].bgrr.green & 0x3f;
-                    blue = pixel[x].bgrr.blue & 0x3f;
-                    red = red * ((1 << pinfo->red_size) - 1) / 0x3f;
-                    green = green * ((1 << pinfo->green_size) - 1) / 0x3f;
-                    blue = blue * ((1 << pinfo->blue_size) - 1) / 0x3f;
-#else
-                    red = pixel[x].bgrr.red;
-                    green = pixel[x].bgrr.green;
-                    blue = pixel[x].bgrr.blue;
-
-                    red >>= 8 - pinfo->red_size;
-                    green >>= 8 - pinfo->green_size;
-                    blue >>= 8 - pinfo->blue_size;
-#endif
-
-                    color = (red << pinfo->red_pos) |
-                            (green << pinfo->green_pos) |
-                            (blue << pinfo->blue_pos);
-                    colorp = (void *)&color;
-                    while (depth_bytes--)
-                        *raw_pixel++ = *colorp++;
-                }
-	    }
-	    memmove(fb, raw_pixels, maxpixels * pinfo->depth_bytes);
+            dp[x].raw = (raw & 0xff00ff00)
+                        | ((raw & 0xff) << 16) | ((raw >> 16) & 0xff);
         }
     }
 }
 
+/* Fill SIZE pixels at PHYS with PIXEL, stored a row at a time into the
+ * framebuffer if there is one, and else by the firmware's VideoFill.
+ */
 static void
-blt_to_screen(struct eg *eg, struct bltbuf *bltbuf)
+eg_fill(struct blt *blt, blt_pixel_t *pixel, position_t *phys,
+        position_t *size)
 {
-#if 0
-    position_t addr = {0, 0};
-
-    position_to_phys(eg, &addr, &addr);
-
-    Call_Service_10(eg->output_intf->blt, eg->output_intf, bltbuf->pixbuf,
-                    GRUB_EFI_BLT_BUFFER_TO_VIDEO,
-                    0, 0,
-                    addr.x, addr.y,
-                    bltbuf->width, bltbuf->height,
-                    0);
-#else
-    const int pxlstride = eg->output_intf->mode->info->pixels_per_scan_line;
-    position_t bltsz, bltpos = { 0, 0 }, pos = { 0, 0 };
-    bltsz.x = MIN(bltbuf->width, pxlstride);
-    bltsz.y = MIN(bltbuf->height, eg->output_intf->mode->info->vertical_resolution);
+    struct eg *eg = (struct eg *)blt;
+    grub_efi_graphics_output_mode_information_t *info;
+    grub_efi_graphics_output_pixel_t *fb = get_framebuffer(eg);
+    grub_efi_graphics_output_pixel_t *dp;
+    grub_efi_uint32_t raw;
+    int width, height, x, y;
+
+    if (!fb) {
+        Call_Service_10(eg->output_intf->blt, eg->output_intf, pixel,
+                        GRUB_EFI_BLT_VIDEO_FILL,
+                        0, 0,
+                        phys->x, phys->y,
+                        size->x, size->y,
+                        0);
+        return;
+    }
 
-    blt_pos_to_screen_pos(eg, bltbuf, &bltpos, &bltsz, &pos);
-#endif
+    info = get_graphics_mode_info(eg);
+    width = MIN(size->x, (int)info->horizontal_resolution - phys->x);
+    height = MIN(size->y, (int)info->vertical_resolution - phys->y);
+
+    if (info->pixel_format == GRUB_EFI_PIXEL_BGRR_8BIT_PER_COLOR)
+        raw = pixel->blue | (pixel->green << 8) | (pixel->red << 16);
+    else
+        raw = pixel->red | (pixel->green << 8) | (pixel->blue << 16);
+
+    for (y = 0; y < height; y++) {
+        dp = &fb[(phys->y + y) * info->pixels_per_scan_line + phys->x];
+        for (x = 0; x < width; x++)
+            dp[x].raw = raw;
+    }
 }
 
 static void
-blt_to_screen_pos(struct eg *eg, struct bltbuf *bltbuf, position_t *pos)
+eg_to_screen(struct blt *blt, struct bltbuf *bltbuf,
+             position_t *bltpos, position_t *bltsz, position_t *phys)
 {
-    position_t bltpos = {0, 0};
-    position_t bltsz = { bltbuf->width, bltbuf->height };
-    blt_pos_to_screen_pos(eg, bltbuf, &bltpos, &bltsz, pos);
+    struct eg *eg = (struct eg *)blt;
+    grub_efi_graphics_output_pixel_t *fb = get_framebuffer(eg);
+
+    if (fb)
+        fb_blt_to_screen(eg, fb, bltbuf, bltpos, bltsz, phys);
+    else
+        hw_blt_to_screen(eg, bltbuf, bltpos, bltsz, phys);
 }
 
+static const struct blt_ops eg_blt_ops = {
+    .to_screen = eg_to_screen,
+    .fill = eg_fill,
+};
+
 static int
 save_video_mode(struct eg *eg, struct video_mode *mode)
 {
@@ -577,502 +439,62 @@ get_screen_size(struct graphics_backend *backend, position_t *size)
     size->y = info->vertical_resolution;
 }
 
-static void
-bltbuf_set_pixel(struct bltbuf *bltbuf, position_t *pos,
-                             grub_efi_graphics_output_pixel_t *pixel)
-{
-    if (pos->x < 0 || pos->x >= bltbuf->width)
-        return;
-    if (pos->x < 0 || pos->y >= bltbuf->height)
-        return;
-    grub_memmove(&bltbuf->pixbuf[pos->x + pos->y * bltbuf->width], pixel,
-            sizeof *pixel);
-}
-
-static void
-bltbuf_get_pixel(struct bltbuf *bltbuf, position_t *pos,
-                 grub_efi_graphics_output_pixel_t *pixel)
-{
-    if (bltbuf && pos->x < bltbuf->width && pos->y < bltbuf->height) {
-    	grub_memmove(pixel, &bltbuf->pixbuf[pos->x + pos->y * bltbuf->width],
-            sizeof *pixel);
-    } else {
-	pixel->bgrr.red = 0x00;
-	pixel->bgrr.green = 0x00;
-	pixel->bgrr.blue = 0x00;
-    }
-}
-
-static void
-bltbuf_set_pixel_rgb(struct bltbuf *bltbuf, position_t *pos,
-                     int red, int green, int blue)
-{
-    grub_efi_graphics_output_pixel_t pixel;
-    rgb_to_pixel(red, green, blue, &pixel);
-    bltbuf_set_pixel(bltbuf, pos, &pixel);
-}
-
-static void
-bltbuf_set_pixel_idx(struct eg *eg, struct bltbuf *bltbuf,
-                     position_t *pos, int idx)
-{
-    bltbuf_set_pixel(bltbuf, pos, &eg->palette[idx]);
-}
-
-static void
-bltbuf_get_pixel_idx(struct bltbuf *bltbuf, position_t *pos, int *idx)
-{
-    grub_efi_graphics_output_pixel_t pixel;
-
-    rgb_to_pixel(0, 0, 0, &pixel);
-    bltbuf_get_pixel(bltbuf, pos, &pixel);
-    for (*idx = 0; *idx < 16; (*idx)++) {
-        if (pixel_equal(cga_colors[*idx], pixel))
-            break;
-    }
-}
-
-static struct bltbuf *
-xpm_to_bltbuf(struct xpm *xpm)
-{
-    struct bltbuf *bltbuf = NULL;
-    position_t pos;
-
-    if (!(bltbuf = alloc_bltbuf(xpm->width, xpm->height)))
-        return NULL;
-
-    for (pos.y = 0; pos.y < xpm->height; pos.y++) {
-        for (pos.x = 0; pos.x < xpm->width; pos.x++) {
-            xpm_pixel_t xpl;
-            unsigned char idx;
-
-            idx = xpm_get_pixel_idx(xpm, pos.x, pos.y);
-            xpm_get_idx(xpm, idx, &xpl);
-
-            bltbuf_set_pixel_rgb(bltbuf, &pos, xpl.red, xpl.green, xpl.blue);
-        }
-    }
-
-    return bltbuf;
-}
-
-static void
-cursor(struct graphics_backend *backend, int set)
-{
-    struct eg *eg;
-    int ch, invert;
-    unsigned short *text;
-    position_t fpos, screensz;
-    int offset;
-
-    eg = backend->priv;
-
-    if (set && !graphics_get_scroll())
-        return;
-
-    text = graphics_get_text_buf();
-    graphics_get_font_position(&fpos);
-    graphics_get_screen_rowscols(&screensz);
-
-    offset = fpos.y * screensz.x + fpos.x;
-
-    if (set)
-        text[offset] |= 0x0200;
-
-    graphics_clbl(fpos.x, fpos.y, 1, 1, 1);
-
-    if (set)
-        text[offset] &= 0xfdff;
-}
-
-static void blank(struct graphics_backend *backend);
-
 static void
 reset_screen_geometry(struct graphics_backend *backend)
 {
     struct eg *eg = backend->priv;
     struct xpm *xpm = graphics_get_splash_xpm();
     grub_efi_graphics_output_mode_information_t *info;
-    position_t screensz;
 
     info = get_graphics_mode_info(eg);
 
     if (xpm) {
-        eg->screen_pos.x =
+        eg->blt.screen_pos.x =
             (info->horizontal_resolution - xpm->width) / 2;
-        eg->screen_pos.y =
+        eg->blt.screen_pos.y =
             (info->vertical_resolution - xpm->height) / 2;
     } else {
-        eg->screen_pos.x = 0;
-        eg->screen_pos.y = 0;
+        eg->blt.screen_pos.x = 0;
+        eg->blt.screen_pos.y = 0;
     }
 
-    blank(backend);
-    graphics_get_screen_rowscols(&screensz);
-    graphics_clbl(0, 0, screensz.x, screensz.y, 0);
-    graphics_clbl(0, 0, screensz.x, screensz.y, 1);
-}
-
-static void
-setxy(struct graphics_backend *backend, position_t *pos)
-{
-    position_t fpos;
-
-    fpos.x = pos->x;
-    fpos.y = pos->y;
-    graphics_set_font_position(&fpos);
-}
-
-static void
-eg_getxy(struct graphics_backend *backend, position_t *pos)
-{
-    graphics_get_font_position(pos);
-}
-
-static void
-draw_pixel(struct graphics_backend *backend, position_t *pos, pixel_t *pixel)
-{
-    struct bltbuf *bltbuf = NULL;
-    grub_efi_graphics_output_pixel_t *eup = (grub_efi_graphics_output_pixel_t *)pixel;
-
-    bltbuf = alloc_bltbuf(1,1);
-    if (!bltbuf)
-        return;
-
-    grub_memmove(&bltbuf->pixbuf[0], eup, sizeof (*eup));
-
-    blt_to_screen_pos(backend->priv, bltbuf, pos);
-
-    grub_free(bltbuf);
-}
-
-static pixel_t *
-get_pixel_idx(struct graphics_backend *backend, int idx)
-{
-    static grub_efi_graphics_output_pixel_t pixel;
-    struct eg *eg = backend->priv;
-    if (idx < 0 || idx > MAX_PALETTE)
-        return NULL;
-    pixel.bgrr.red = eg->palette[idx].bgrr.red;
-    pixel.bgrr.green = eg->palette[idx].bgrr.green;
-    pixel.bgrr.blue = eg->palette[idx].bgrr.blue;
-    return (pixel_t *)&pixel;
-}
-
-static pixel_t *
-get_pixel_rgb(struct graphics_backend *backend, int red, int green, int blue)
-{
-    static grub_efi_graphics_output_pixel_t pixel;
-    rgb_to_pixel(red, green, blue, &pixel);
-    return &pixel;
-}
-
-static void
-set_palette(struct graphics_backend *backend, int idx,
-            int red, int green, int blue)
-{
-    grub_efi_graphics_output_pixel_t pixel;
-    struct eg *eg = backend->priv;
-
-    if (idx > MAX_PALETTE)
-        return;
-    rgb_to_pixel(red, green, blue, &pixel);
-    grub_memmove(&eg->palette[idx], &pixel, sizeof pixel);
-}
-
-static void
-blank(struct graphics_backend *backend)
-{
-    struct eg *eg = backend->priv;
-    struct bltbuf *bltbuf;
-    position_t pos = {0, 0};
-    grub_efi_graphics_output_mode_information_t *info;
-    grub_efi_uintn_t x, y, i, j;
-    unsigned char r = 0 ,g = 0;
-
-    info = get_graphics_mode_info(eg);
-    x = info->horizontal_resolution;
-    y = info->vertical_resolution;
-
-    if (x == 0 || y == 0)
-        return;
-
-    bltbuf = alloc_bltbuf(x, y);
-    for (j = 0; j < y; j++) {
-        if (debug_graphics && j % 16 == 0) {
-            g = g == 0 ? 7 : 0;
-            r = g == 0 ? 7 : 0;
-        }
-        for (i = 0; i < x; i++) {
-            if (debug_graphics && i % 16 == 0) {
-                g = g == 0 ? 7 : 0;
-                r = g == 0 ? 7 : 0;
-            }
-            pos.x = i;
-            pos.y = j;
-            bltbuf_set_pixel_rgb(bltbuf, &pos, r * 16, g * 16, 0x0);
-        }
-    }
-
-    blt_to_screen(eg, bltbuf);
-
-    grub_free(bltbuf);
-}
-
-
-static void
-draw_white_box(struct graphics_backend *backend)
-{
-    struct eg *eg = backend->priv;
-    struct bltbuf *bltbuf;
-    position_t pos = {0, 0}, bltpos = {0, 0}, bltsz = {100,100};
-
-    bltbuf = alloc_bltbuf(bltsz.x, bltsz.y);
-    for (pos.y = 0; pos.y < bltsz.y; pos.y++) {
-        for (pos.x = 0; pos.x < bltsz.x; pos.x++) {
-            bltbuf_set_pixel_rgb(bltbuf, &pos, 0xff, 0xff, 0xff);
-        }
-    }
-
-    blt_pos_to_screen_pos(eg, bltbuf, &bltpos, &bltsz, &pos);
-
-#if 0
-    Call_Service_10(eg->output_intf->blt, eg->output_intf, bltbuf->pixbuf,
-        GRUB_EFI_BLT_BUFFER_TO_VIDEO, 0, 0, 100, 100, x, y, 0);
-#endif
-
-    grub_free(bltbuf);
-}
-
-static void
-bltbuf_cp_bl(struct bltbuf *d, position_t dpos,
-             struct bltbuf *s, position_t spos)
-{
-    grub_efi_graphics_output_pixel_t *dp, *sp;
-
-    const int xavail = MAX(0, s ? s->width - spos.x : 0);
-    const int xtotal = MAX(0, d->width - dpos.x);
-    const int xcp = MAX(0, MIN(xtotal, xavail));
-    const int xcl = MAX(0, xtotal - xcp);
-
-    const int yavail = MAX(0, s ? s->height - spos.y : 0);
-    const int ytotal = MAX(0, d->height - dpos.y);
-    const int ycp = MAX(0, MIN(ytotal, yavail));
-    const int ycl = MAX(0, ytotal - ycp);
-
-    int y, x;
-
-    for (y = 0; y < ytotal; y++) {
-        dp = &d->pixbuf[(dpos.y + y) * d->width + dpos.x];
-
-        if (y < yavail) {
-            sp = &s->pixbuf[(spos.y + y) * s->width + spos.x];
-            memmove(dp, sp, xcp * sizeof (*dp));
-            dp = &d->pixbuf[(dpos.y + y) * d->width + dpos.x + xcp];
-            memset(dp, '\0', xcl * sizeof (*dp));
-        } else {
-            memset(dp, '\0', xtotal * sizeof (*dp));
-        }
-    }
-}
-
-/* copy a region the size of bltbuf from the background into bltbuf,
- * starting at offset bgpos
- */
-static void
-bltbuf_draw_bg(struct graphics_backend *backend, struct bltbuf *bltbuf,
-        position_t bgpos)
-{
-    struct eg *eg = backend->priv;
-    position_t blpos = { 0, 0 };
-
-    bltbuf_cp_bl(bltbuf, blpos, eg->background, bgpos);
-}
-
-static void
-dbg_dump_palette(struct graphics_backend *backend)
-{
-    struct eg *eg;
-    int i;
-    if (!backend || !backend->priv)
-        return;
-    eg = backend->priv;
-    if (!eg->palette)
-        return;
+    blt_reset_screen(backend);
 }
 
+/* The splash image has to stay put, so with one the text is redrawn
+   over it instead.  */
 static int
-is_shadow_pixel(position_t screensz, position_t textpos, position_t bitpos,
-                position_t fontsz)
-{
-    unsigned short *text = graphics_get_text_buf();
-    const unsigned char *glyph;
-    position_t glyphpos = { textpos.x, textpos.y };
-    position_t glyphbit = { bitpos.x, bitpos.y };
-    unsigned short ch;
-
-    if (glyphbit.x == 0) {
-        glyphbit.x = fontsz.x;
-        glyphpos.x--;
-    }
-    if (glyphbit.y == 0) {
-        glyphbit.y = fontsz.y;
-        glyphpos.y--;
-    }
-    glyphbit.x--;
-    glyphbit.y--;
-
-    if (glyphpos.x < 0 || glyphpos.y < 0)
-        return 0;
-
-    ch = text[glyphpos.y * screensz.x + glyphpos.x] & 0xff;
-    glyph = font8x16 + (ch << 4);
-    return glyph[glyphbit.y] & (1 << ((fontsz.x-1) - glyphbit.x));
-}
-
-static void
-bltbuf_draw_character(struct graphics_backend *backend,
-        struct bltbuf *bltbuf,  /* the bltbuf to draw into */
-        position_t target,      /* the position in the bltbuf to draw to */
-        position_t fontsz,      /* the size of the font, in pixels */
-        position_t charpos,     /* the position of the character in the text
-                                   screen buffer */
-        position_t screensz,    /* the size of the screen in characters */
-        unsigned short ch       /* the character to draw, plus flags */
-    )
+scroll(struct graphics_backend *backend)
 {
     struct eg *eg = backend->priv;
-    position_t blpos;
-    position_t glyphpos;
-
-    blpos.y = target.y;
-    for (glyphpos.y = 0; glyphpos.y < fontsz.y; glyphpos.y++, blpos.y++) {
-        blpos.x = target.x;
-        for (glyphpos.x = 0; glyphpos.x < fontsz.x; glyphpos.x++, blpos.x++) {
-            int invert = (ch & 0x0100) != 0;
-            int set = (ch & 0x0200) != 0;
-            const unsigned char *glyph = font8x16 + ((ch & 0xff) << 4);
-            int bit = glyph[glyphpos.y] & (1 << ((fontsz.x-1) - glyphpos.x));
-            int idx = -1;
-
-            if (!set) {
-                if (invert)
-                    idx = bit ? 0 : 15;
-                else if (bit)
-                    idx = 15;
-
-                if (idx == -1) {
-                    if (is_shadow_pixel(screensz, charpos, glyphpos, fontsz) ||
-                            !eg->background)
-                        idx = invert ? 15 : 0;
-                }
-            } else {
-                idx = bit ? 0 : 15;
-            }
-
-            if (idx != -1)
-                bltbuf_set_pixel_idx(eg, bltbuf, &blpos, idx);
-        }
-    }
-}
+    grub_efi_status_t status;
+    position_t fontsz, screensz, pos, src, dest;
 
-static void
-bltbuf_draw_text(struct graphics_backend *backend,
-        struct bltbuf *bltbuf,  /* the buffer to draw into */
-        position_t screensz,    /* the size of the screen in characters */
-        position_t fontsz,      /* the size of the font in pixels */
-        position_t txtpos,      /* the position of the text on the screen
-                                   (in characters) */
-        position_t txtsz        /* the size of the block to fill in
-                                   (in characters) */
-    )
-{
-    struct eg *eg = backend->priv;
-    unsigned short *text = graphics_get_text_buf();
-    position_t charpos;
-
-    for (charpos.y = txtpos.y; charpos.y < txtpos.y + txtsz.y; charpos.y++) {
-        for (charpos.x = txtpos.x; charpos.x < txtpos.x + txtsz.x; charpos.x++){
-            int offset = charpos.y * screensz.x + charpos.x;
-            position_t blpos = { (charpos.x-txtpos.x)*fontsz.x,
-                                 (charpos.y-txtpos.y)*fontsz.y };
-
-            bltbuf_draw_character(backend, bltbuf, blpos, fontsz, charpos,
-                    screensz, text[offset]);
-        }
-    }
-}
-
-static void
-clbl(struct graphics_backend *backend, int col, int row, int width, int height,
-        int draw_text)
-{
-    struct eg *eg = backend->priv;
-    struct xpm *xpm;
-
-    struct bltbuf *bltbuf;
-    position_t fontsz, blpos, blsz, screensz;
-    unsigned short *text;
+    if (graphics_get_splash_xpm())
+        return 0;
 
-//    blank(backend);
-//
-    xpm = graphics_get_splash_xpm();
-    if (xpm && !eg->background)
-        eg->background = xpm_to_bltbuf(xpm);
+    /* Reading the framebuffer back is slow, and redrawing the text
+     * straight into it is not.  */
+    if (get_framebuffer(eg))
+        return 0;
 
     graphics_get_screen_rowscols(&screensz);
-    width = MIN(width, screensz.x - col);
-    height = MIN(height, screensz.y - row);
     graphics_get_font_size(&fontsz);
 
-    blsz.x = width * fontsz.x;
-    blsz.y = height * fontsz.y;
-
-    bltbuf = alloc_bltbuf(blsz.x, blsz.y);
-    if (!bltbuf)
-        return;
-
-    blsz.x = col * fontsz.x;
-    blsz.y = row * fontsz.y;
-
-    text = graphics_get_text_buf();
-    bltbuf_draw_bg(backend, bltbuf, blsz);
-
-    if (draw_text) {
-        blsz.x = width;
-        blsz.y = height;
-        blpos.x = col;
-        blpos.y = row;
-
-        bltbuf_draw_text(backend, bltbuf, screensz, fontsz, blpos, blsz);
-    }
-
-    blpos.x = col * fontsz.x;
-    blpos.y = row * fontsz.y;
-
-    blt_to_screen_pos(eg, bltbuf, &blpos);
-}
-
-static void
-setup_cga_palette(struct eg *eg)
-{
-    rgb_to_pixel(0x00,0x00,0x00, &eg->palette[0]); //  0 Black
-    rgb_to_pixel(0x7f,0x00,0x00, &eg->palette[1]); //  1 Dark Red
-    rgb_to_pixel(0x00,0x7f,0x00, &eg->palette[2]); //  2 Dark Green
-    rgb_to_pixel(0x7f,0x7f,0x00, &eg->palette[3]); //  3 Dark Yellow
-    rgb_to_pixel(0x00,0x00,0x7f, &eg->palette[4]); //  4 Dark Blue
-    rgb_to_pixel(0x7f,0x00,0x7f, &eg->palette[5]); //  5 Dark Magenta
-    rgb_to_pixel(0x00,0x7f,0x7f, &eg->palette[6]); //  6 Dark Cyan
-    rgb_to_pixel(0xc0,0xc0,0xc0, &eg->palette[7]); //  7 Light Grey
-    rgb_to_pixel(0x7f,0x7f,0x7f, &eg->palette[8]); //  8 Dark Grey
-    rgb_to_pixel(0xff,0x00,0x00, &eg->palette[9]); //  9 Red
-    rgb_to_pixel(0x00,0xff,0x00, &eg->palette[10]); // 10 Green
-    rgb_to_pixel(0xff,0xff,0x00, &eg->palette[11]); // 11 Yellow
-    rgb_to_pixel(0x00,0x00,0xff, &eg->palette[12]); // 12 Blue
-    rgb_to_pixel(0xff,0x00,0xff, &eg->palette[13]); // 13 Magenta
-    rgb_to_pixel(0x00,0xff,0xff, &eg->palette[14]); // 14 Cyan
-    rgb_to_pixel(0xff,0xff,0xff, &eg->palette[15]); // 15 White
-    rgb_to_pixel(0xff,0xff,0xff, &eg->palette[16]); // 16 Also white ;)
+    pos.x = 0;
+    pos.y = fontsz.y;
+    blt_position_to_phys(&eg->blt, &pos, &src);
+    pos.y = 0;
+    blt_position_to_phys(&eg->blt, &pos, &dest);
+
+    status = Call_Service_10(eg->output_intf->blt, eg->output_intf, 0,
+                             GRUB_EFI_BLT_VIDEO_TO_VIDEO,
+                             src.x, src.y,
+                             dest.x, dest.y,
+                             screensz.x * fontsz.x,
+                             (screensz.y - 1) * fontsz.y,
+                             0);
+    return status == GRUB_EFI_SUCCESS;
 }
 
 static grub_efi_status_t
@@ -1095,7 +517,7 @@ static void disable(struct graphics_backend *backend)
         return;
 
 #if 0
-    blank(backend);
+    blt_blank(backend);
 
     set_video_mode(eg, eg->text_mode);
     grub_efi_set_text_mode(1);
@@ -1156,6 +578,19 @@ fill_pixel_info (grub_pixel_info_t *pixel_info,
   return 1;
 }
 
+/* How the mode is chosen, as the graphicsmode command sets it.  With
+ * GRAPHICS_MODE_FAST the modes are tried from the largest down, and the
+ * first that can redraw the whole screen within mode_budget ms is
+ * taken; the highest resolution is often far the slowest on emulated
+ * and low-end server graphics.  With GRAPHICS_MODE_SIZE the modes of
+ * mode_width by mode_height are tried first.
+ */
+#define MODE_BUDGET_DEFAULT 50
+
+static int mode_policy = GRAPHICS_MODE_NATIVE;
+static int mode_width, mode_height;
+static int mode_budget = MODE_BUDGET_DEFAULT;
+
 /* 1 = prefer a
  * 0 = prefer neither
  * -1 = prefer b
@@ -1191,6 +626,26 @@ modecmp_helper(struct eg *eg, struct video_mode *amode, struct video_mode *bmode
                         a->pixel_format == GRUB_EFI_PIXEL_BLT_ONLY)
                 return -1;
 
+	if (mode_policy == GRAPHICS_MODE_SIZE) {
+		int asize = a->horizontal_resolution == mode_width &&
+			a->vertical_resolution == mode_height;
+		int bsize = b->horizontal_resolution == mode_width &&
+			b->vertical_resolution == mode_height;
+
+		if (asize != bsize)
+			return asize - bsize;
+	}
+
+	if (mode_policy == GRAPHICS_MODE_FAST) {
+		unsigned long aarea = (unsigned long)a->horizontal_resolution *
+			a->vertical_resolution;
+		unsigned long barea = (unsigned long)b->horizontal_resolution *
+			b->vertical_resolution;
+
+		if (aarea != barea)
+			return aarea > barea ? 1 : -1;
+	}
+
 	/* XXX PJFIX there's something wrong with what we're passing to the
 	 * kernel for stride in the bgrr/rgbr modes, and I haven't figured out
 	 * just what yet, so for now, prefer bitmask modes.
@@ -1274,12 +729,223 @@ sort_modes(struct eg *eg, int p, int r)
 	}
 }
 
+/* Ask the firmware about every mode.  */
+static void
+query_modes(struct eg *eg)
+{
+    grub_efi_status_t efi_status;
+    int i;
+
+    for (i = 0; i < eg->max_mode; i++) {
+        if (eg->modes[i])
+            continue;
+        eg->modes[i] = grub_malloc(sizeof *(eg->modes[0]));
+        if (!eg->modes[i])
+            break;
+        memset(eg->modes[i], '\0', sizeof *(eg->modes[0]));
+        eg->modes[i]->number = i;
+
+        efi_status = Call_Service_4(eg->output_intf->query_mode,
+                eg->output_intf, i, &eg->modes[i]->size,
+                &eg->modes[i]->info);
+        if (efi_status == GRUB_EFI_NOT_STARTED) {
+            /* The firmware didn't turn on GRAPHICS_OUTPUT_PROTOCOL, so
+             * try to do so ourselves. Thanks, Intel. */
+            set_video_mode(eg, eg->output_intf->mode->mode);
+            efi_status = Call_Service_4(eg->output_intf->query_mode,
+                eg->output_intf, i, &eg->modes[i]->size,
+                &eg->modes[i]->info);
+        }
+        if (efi_status != GRUB_EFI_SUCCESS) {
+            grub_free(eg->modes[i]);
+            eg->modes[i] = NULL;
+            //eg->max_mode = i;
+            break;
+        }
+    }
+}
+
+/* The mode chosen the last time is kept in an EFI variable, so that it
+ * can be set again straight away, without asking the firmware about
+ * every mode and sorting them first; some take long to answer.  It is
+ * only good for the same device, and while the firmware still says the
+ * same of the mode.
+ */
+#define MODE_CACHE_PATH_MAX 256
+
+struct mode_cache {
+    grub_efi_uint32_t max_mode;
+    grub_efi_uint32_t number;
+    grub_efi_uint32_t horizontal_resolution;
+    grub_efi_uint32_t vertical_resolution;
+    grub_efi_uint32_t pixel_format;
+    /* the policy it was chosen by, which it is only good for */
+    grub_efi_uint32_t policy;
+    grub_efi_uint32_t policy_arg[2];
+    /* whether the screen is drawn with Blt rather than directly */
+    grub_efi_uint32_t use_blt;
+    /* the device path of the graphics output, to its end node */
+    grub_efi_uint8_t path[MODE_CACHE_PATH_MAX];
+};
+
+static grub_efi_char16_t mode_cache_name[] = {
+    'G', 'r', 'u', 'b', 'G', 'O', 'P', 'M', 'o', 'd', 'e', 0
+};
+
+/* Fill in CACHE for MODE, and return how much of it to keep, or 0 if
+ * the device path of the graphics output isn't known.
+ */
+static grub_efi_uintn_t
+make_mode_cache(struct eg *eg, struct video_mode *mode,
+                struct mode_cache *cache)
+{
+    grub_efi_device_path_t *dp, *end;
+    grub_efi_uintn_t len;
+
+    if (!eg->handle || !(dp = grub_efi_get_device_path(eg->handle)))
+        return 0;
+
+    for (end = dp; !GRUB_EFI_END_ENTIRE_DEVICE_PATH(end);
+         end = GRUB_EFI_NEXT_DEVICE_PATH(end))
+        if (!GRUB_EFI_DEVICE_PATH_LENGTH(end))
+            return 0;
+    len = (char *)end - (char *)dp + GRUB_EFI_DEVICE_PATH_LENGTH(end);
+    if (len > MODE_CACHE_PATH_MAX)
+        return 0;
+
+    grub_memset(cache, '\0', sizeof (*cache));
+    cache->max_mode = eg->max_mode;
+    cache->number = mode->number;
+    cache->horizontal_resolution = mode->info->horizontal_resolution;
+    cache->vertical_resolution = mode->info->vertical_resolution;
+    cache->pixel_format = mode->info->pixel_format;
+    cache->policy = mode_policy;
+    if (mode_policy == GRAPHICS_MODE_SIZE) {
+        cache->policy_arg[0] = mode_width;
+        cache->policy_arg[1] = mode_height;
+    } else if (mode_policy == GRAPHICS_MODE_FAST) {
+        cache->policy_arg[0] = mode_budget;
+    }
+    cache->use_blt = eg->use_blt;
+    grub_memmove(cache->path, dp, len);
+    return sizeof (*cache) - MODE_CACHE_PATH_MAX + len;
+}
+
+/* Set the mode kept in the variable, if it is still good.  */
+static int
+set_cached_mode(struct eg *eg)
+{
+    grub_efi_runtime_services_t *rt = grub_efi_system_table->runtime_services;
+    struct mode_cache cache, now;
+    grub_efi_uintn_t size = sizeof (cache);
+    struct video_mode *mode;
+    grub_efi_status_t efi_status;
+
+    efi_status = Call_Service_5(rt->get_variable, mode_cache_name,
+                                &grub_variable_guid, NULL, &size, &cache);
+    if (efi_status != GRUB_EFI_SUCCESS || cache.number >= eg->max_mode)
+        return 0;
+
+    if (!(mode = grub_malloc(sizeof (*mode))))
+        return 0;
+    grub_memset(mode, '\0', sizeof (*mode));
+    mode->number = cache.number;
+
+    eg->use_blt = cache.use_blt;
+    if (!save_video_mode(eg, mode) || make_mode_cache(eg, mode, &now) != size
+            || grub_memcmp((char *)&now, (char *)&cache, size)) {
+        eg->use_blt = 0;
+        grub_free(mode);
+        return 0;
+    }
+
+    grub_efi_set_text_mode(0);
+    if (set_video_mode(eg, mode->number) != GRUB_EFI_SUCCESS) {
+        grub_efi_set_text_mode(1);
+        grub_free(mode);
+        return 0;
+    }
+
+    eg->modes[mode->number] = mode;
+    eg->graphics_mode = mode->number;
+    fill_pixel_info(&eg->pixel_info, mode->info);
+    return 1;
+}
+
+static void
+save_cached_mode(struct eg *eg, struct video_mode *mode)
+{
+    grub_efi_runtime_services_t *rt = grub_efi_system_table->runtime_services;
+    struct mode_cache cache;
+    grub_efi_uintn_t size = make_mode_cache(eg, mode, &cache);
+
+    if (size)
+        Call_Service_5(rt->set_variable, mode_cache_name, &grub_variable_guid,
+                       GRUB_EFI_VARIABLE_NON_VOLATILE
+                       | GRUB_EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                       size, &cache);
+}
+
+/* Return how many TSC cycles it takes to put a whole screen of pixels
+ * on the screen in the mode just set, the least of a few tries, or 0 if
+ * it can not be told.
+ */
+static unsigned long long
+time_redraw(struct eg *eg)
+{
+    grub_efi_graphics_output_mode_information_t *info = get_graphics_mode_info(eg);
+    struct bltbuf *bltbuf;
+    position_t pos = { 0, 0 }, size;
+    unsigned long long start, cycles, best = 0;
+    int i;
+
+    if (!bootprof_now())
+        return 0;
+
+    size.x = info->horizontal_resolution;
+    size.y = info->vertical_resolution;
+    if (!(bltbuf = alloc_bltbuf(size.x, size.y)))
+        return 0;
+
+    for (i = 0; i < 3; i++) {
+        start = bootprof_now();
+        eg_to_screen(&eg->blt, bltbuf, &pos, &size, &pos);
+        cycles = bootprof_now() - start;
+        if (!best || cycles < best)
+            best = cycles;
+    }
+
+    grub_free(bltbuf);
+    return best;
+}
+
+/* Time drawing the whole screen in the mode just set both ways, if the
+ * framebuffer can be used at all, and keep to the faster.
+ */
+static void
+choose_blt(struct eg *eg)
+{
+    unsigned long long fb_cycles, blt_cycles;
+
+    eg->use_blt = 0;
+    if (!get_framebuffer(eg))
+        return;
+
+    fb_cycles = time_redraw(eg);
+    eg->use_blt = 1;
+    blt_cycles = time_redraw(eg);
+    eg->use_blt = blt_cycles && blt_cycles < fb_cycles;
+    dprintf("mode %d is drawn with %s\n", eg->graphics_mode,
+            eg->use_blt ? "blt" : "the framebuffer");
+}
+
 static int
 try_enable(struct graphics_backend *backend)
 {
     struct eg *eg = backend->priv;
     grub_efi_status_t efi_status = GRUB_EFI_UNSUPPORTED;
-    int i;
+    unsigned long long budget = 0, cycles, fastest_cycles = 0;
+    int i, fastest = -1;
 
     if (eg->text_mode == 0xffffffff) {
         grub_efi_set_text_mode(1);
@@ -1295,6 +961,11 @@ try_enable(struct graphics_backend *backend)
         grub_efi_set_text_mode(0);
         eg->graphics_mode = eg->output_intf->mode->mode;
         grub_efi_set_text_mode(1);
+
+        if (set_cached_mode(eg))
+            goto done;
+
+        query_modes(eg);
 #if 0
 	dprintf("graphics mode is %d\n", eg->graphics_mode);
 	/* this is okay here because we haven't sorted yet.*/
@@ -1313,6 +984,9 @@ try_enable(struct graphics_backend *backend)
 
 	efi_status = GRUB_EFI_UNSUPPORTED;
 
+        if (mode_policy == GRAPHICS_MODE_FAST)
+            budget = bootprof_cycles_per_ms() * mode_budget;
+
         for (i = eg->max_mode - 1; i >= 0; i--) {
             if (!eg->modes[i])
                 continue;
@@ -1339,6 +1013,23 @@ try_enable(struct graphics_backend *backend)
 #endif
                 eg->graphics_mode = eg->modes[i]->number;
 	        fill_pixel_info(&eg->pixel_info, info);
+                choose_blt(eg);
+
+                /* Too slow: go on to the smaller ones, keeping the
+                 * fastest yet in case none is fast enough.  */
+                if (budget && (cycles = time_redraw(eg)) > budget) {
+                    dprintf("mode %d redraws in %d ms\n",
+                            eg->graphics_mode,
+                            (int)(cycles * mode_budget / budget));
+                    if (fastest < 0 || cycles < fastest_cycles) {
+                        fastest = i;
+                        fastest_cycles = cycles;
+                    }
+                    efi_status = GRUB_EFI_UNSUPPORTED;
+                    continue;
+                }
+
+                save_cached_mode(eg, eg->modes[i]);
                 break;
             } else {
 #if 0
@@ -1348,6 +1039,16 @@ try_enable(struct graphics_backend *backend)
 #endif
             }
         }
+        if (efi_status != GRUB_EFI_SUCCESS && fastest >= 0) {
+            grub_efi_set_text_mode(0);
+            efi_status = set_video_mode(eg, eg->modes[fastest]->number);
+            if (efi_status == GRUB_EFI_SUCCESS) {
+                eg->graphics_mode = eg->modes[fastest]->number;
+                fill_pixel_info(&eg->pixel_info, eg->modes[fastest]->info);
+                choose_blt(eg);
+                save_cached_mode(eg, eg->modes[fastest]);
+            }
+        }
         if (efi_status != GRUB_EFI_SUCCESS) {
 #if 1
             grub_efi_set_text_mode(1);
@@ -1358,6 +1059,7 @@ try_enable(struct graphics_backend *backend)
 
     }
 
+done:
     eg->current_mode = GRAPHICS;
     return 1;
 }
@@ -1373,7 +1075,6 @@ enable(struct graphics_backend *backend)
             return 1;
         }
     } else {
-        grub_efi_status_t efi_status;
 	grub_efi_handle_t *handle, *handles;
 	grub_efi_uintn_t num_handles;
 	grub_efi_pci_io_t *pci_proto;
@@ -1406,6 +1107,7 @@ enable(struct graphics_backend *backend)
 
 	    if (eg->output_intf)
 	      {
+		eg->handle = *handle;
 		grub_efi_setup_gfx_pci(*handle);
 		break;
 	      }
@@ -1427,39 +1129,8 @@ enable(struct graphics_backend *backend)
             goto fail;
         memset(eg->modes, '\0', eg->max_mode * sizeof (void *));
 
-        for (i = 0; i < eg->max_mode; i++) {
-            eg->modes[i] = grub_malloc(sizeof *(eg->modes[0]));
-            if (!eg->modes[i])
-                goto fail;
-            memset(eg->modes[i], '\0', sizeof *(eg->modes[0]));
-            eg->modes[i]->number = i;
-
-            efi_status = Call_Service_4(eg->output_intf->query_mode,
-                    eg->output_intf, i, &eg->modes[i]->size,
-                    &eg->modes[i]->info);
-	    if (efi_status == GRUB_EFI_NOT_STARTED) {
-		/* The firmware didn't turn on GRAPHICS_OUTPUT_PROTOCOL, so
-		 * try to do so ourselves. Thanks, Intel. */
-		set_video_mode(eg, eg->output_intf->mode->mode);
-            	efi_status = Call_Service_4(eg->output_intf->query_mode,
-                    eg->output_intf, i, &eg->modes[i]->size,
-                    &eg->modes[i]->info);
-	    }
-            if (efi_status != GRUB_EFI_SUCCESS) {
-                grub_free(eg->modes[i]);
-                eg->modes[i] = NULL;
-                //eg->max_mode = i;
-                break;
-            }
-        }
-
+        blt_init(&eg->blt, &eg_blt_ops);
         backend->priv = eg;
-        setup_cga_palette(eg);
-        for (i = 0; i < n_cga_colors; i++) {
-            eg->palette[i].bgrr.red = cga_colors[i].bgrr.red;
-            eg->palette[i].bgrr.green = cga_colors[i].bgrr.green;
-            eg->palette[i].bgrr.blue = cga_colors[i].bgrr.blue;
-        }
     }
 
     if (try_enable(backend)) {
@@ -1485,17 +1156,44 @@ struct graphics_backend eg_backend = {
     .enable = enable,
     .disable = disable,
     .set_kernel_params = set_kernel_params,
-    .clbl = clbl,
-    .set_palette = set_palette,
-    .get_pixel_idx = get_pixel_idx,
-    .get_pixel_rgb = get_pixel_rgb,
-    .draw_pixel = draw_pixel,
+    .clbl = blt_clbl,
+    .scroll = scroll,
+    .set_palette = blt_set_palette,
+    .get_pixel_idx = blt_get_pixel_idx,
+    .get_pixel_rgb = blt_get_pixel_rgb,
+    .draw_pixel = blt_draw_pixel,
     .reset_screen_geometry = reset_screen_geometry,
     .get_screen_size = get_screen_size,
-    .getxy = eg_getxy,
-    .setxy = setxy,
+    .getxy = blt_getxy,
+    .setxy = blt_setxy,
     .gotoxy = NULL,
-    .cursor = cursor,
 };
 
+/* Choose the mode by POLICY from the next time the graphics are turned
+ * on.  WIDTH and HEIGHT are for GRAPHICS_MODE_SIZE, and BUDGET, in ms,
+ * is for GRAPHICS_MODE_FAST, or 0 for the default.  The modes already
+ * asked about are forgotten, since they have been sorted.
+ */
+void
+graphics_set_mode_policy(int policy, int width, int height, int budget)
+{
+    struct eg *eg = eg_backend.priv;
+    int i;
+
+    mode_policy = policy;
+    mode_width = width;
+    mode_height = height;
+    mode_budget = budget ? budget : MODE_BUDGET_DEFAULT;
+
+    if (!eg || eg->current_mode == GRAPHICS)
+        return;
+
+    for (i = 0; i < eg->max_mode; i++) {
+        if (eg->modes[i])
+            grub_free(eg->modes[i]);
+        eg->modes[i] = NULL;
+    }
+    eg->graphics_mode = 0xffffffff;
+}
+
 #endif /* SUPPORT_GRAPHICS */
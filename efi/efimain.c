@@ -24,6 +24,7 @@
 #include <grub/misc.h>
 
 #include <shared.h>
+#include <bootprof.h>
 #include <efistubs.h>
 
 #include "pxe.h"
@@ -33,6 +34,15 @@
 /* Emulation requirements. */
 void *grub_scratch_mem = NULL;
 
+/* FSYS_BUF and the raw device buffer, in pages of their own if they
+   could be had.  */
+unsigned long grub_fsys_buf;
+int grub_fsys_buflen;
+unsigned long grub_buffer_addr;
+int grub_bufferlen;
+static void *grub_buffers;
+static grub_efi_uintn_t grub_buffers_pages;
+
 #define LOW_STACK_SIZE  0x100000
 #define LOW_STACK_PAGES (LOW_STACK_SIZE >> 12)
 static void *low_stack, *real_stack;
@@ -67,6 +77,7 @@ real_main (void)
       }
 
     grub_load_saved_default (loaded_image->device_handle);
+    grub_load_boot_profile (loaded_image->device_handle);
   }
 
   init_bios_info ();
@@ -74,11 +85,42 @@ real_main (void)
     grub_efi_stall(1000);
 }
 
+/* Allocate FSYS_BUF and the raw device buffer together, halving their
+   sizes until the pages are there, down to the sizes of the fixed map;
+   below that, use the fixed map in the scratch memory.  The pages are
+   below 4GB, so that the buffer has a segment, as biosdisk wants.  */
+static void
+init_buffers (void)
+{
+  int fsys_len = FSYS_BUFLEN_MAX;
+  int buf_len = BUFFERLEN_MAX;
+
+  for (; fsys_len >= FSYS_BUFLEN_FIXED; fsys_len >>= 1, buf_len >>= 1)
+    {
+      grub_buffers_pages = (fsys_len + buf_len) >> 12;
+      grub_buffers = grub_efi_allocate_pages (0, grub_buffers_pages);
+      if (grub_buffers)
+	{
+	  grub_fsys_buf = (unsigned long) grub_buffers;
+	  grub_fsys_buflen = fsys_len;
+	  grub_buffer_addr = grub_fsys_buf + fsys_len;
+	  grub_bufferlen = buf_len;
+	  return;
+	}
+    }
+
+  grub_fsys_buf = FSYS_BUF_FIXED;
+  grub_fsys_buflen = FSYS_BUFLEN_FIXED;
+  grub_buffer_addr = BUFFERADDR_FIXED;
+  grub_bufferlen = BUFFERLEN_FIXED;
+}
+
 grub_efi_status_t
 efi_main (grub_efi_handle_t image_handle, grub_efi_system_table_t *sys_tab)
 {
   grub_efi_image_handle = image_handle;
   grub_efi_system_table = sys_tab;
+  bootprof_mark ("efi_main");
   grub_efi_init ();
 
   grub_scratch_mem = grub_efi_allocate_pages (0, GRUB_SCRATCH_MEM_PAGES);
@@ -87,6 +129,7 @@ efi_main (grub_efi_handle_t image_handle, grub_efi_system_table_t *sys_tab)
       grub_printf ("Failed to allocate scratch mem!\n");
       return GRUB_EFI_OUT_OF_RESOURCES;
     }
+  init_buffers ();
 
   /* If current stack reside in memory region > 2G, switch stack to a
      memory region < 2G */
@@ -121,6 +164,9 @@ efi_main (grub_efi_handle_t image_handle, grub_efi_system_table_t *sys_tab)
 			 LOW_STACK_PAGES);
   }
 
+  if (grub_buffers)
+    grub_efi_free_pages ((grub_efi_physical_address_t)(unsigned long) grub_buffers,
+			 grub_buffers_pages);
   grub_efi_free_pages ((grub_efi_physical_address_t)(unsigned long)grub_scratch_mem,
 		       GRUB_SCRATCH_MEM_PAGES);
   grub_efi_fini ();
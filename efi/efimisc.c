@@ -25,6 +25,8 @@
 #include <grub/misc.h>
 
 #include <shared.h>
+#include <bootprof.h>
+#include <bootlog.h>
 
 unsigned long install_partition = 0x20000;
 unsigned long boot_drive = 0x80;
@@ -48,9 +50,52 @@ grub_efi_init (void)
   grub_efidisk_init ();
 }
 
+/* Hand the boot trace to the OS as a configuration table, in pages
+   which stay when the boot services are gone.  The events up to the
+   handoff still go into it.  This has to come before the memory map is
+   taken, since it allocates.  */
+void
+grub_efi_bootprof_export (void)
+{
+  static grub_efi_guid_t guid = GRUB_EFI_BOOTPROF_TABLE_GUID;
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_uintn_t pages;
+  void *table;
+
+  pages = (sizeof (struct bootprof_table) + 4095) >> 12;
+  table = grub_efi_allocate_runtime_pages (0, pages);
+  if (! table)
+    return;
+
+  if (Call_Service_2 (b->install_configuration_table, &guid,
+		      bootprof_move (table)) != GRUB_EFI_SUCCESS)
+    grub_dprintf ("bootprof", "cannot install the boot trace\n");
+}
+
+/* Hand the messages of verbose and debug mode to the OS the same way;
+   those up to the handoff still go into them.  */
+void
+grub_efi_bootlog_export (void)
+{
+  static grub_efi_guid_t guid = GRUB_EFI_BOOTLOG_TABLE_GUID;
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_uintn_t pages;
+  void *table;
+
+  pages = (sizeof (struct bootlog_table) + 4095) >> 12;
+  table = grub_efi_allocate_runtime_pages (0, pages);
+  if (! table)
+    return;
+
+  if (Call_Service_2 (b->install_configuration_table, &guid,
+		      bootlog_move (table)) != GRUB_EFI_SUCCESS)
+    grub_dprintf ("bootlog", "cannot install the boot log\n");
+}
+
 void
 grub_efi_fini (void)
 {
+  grub_flush_saved_default ();
   grub_efidisk_fini ();
   grub_efi_mm_fini ();
   grub_console_fini ();
@@ -59,13 +104,13 @@ grub_efi_fini (void)
 void *
 grub_malloc (grub_size_t size)
 {
-  return grub_efi_allocate_pool (size);
+  return grub_efi_heap_alloc (size);
 }
 
 void
 grub_free (void *p)
 {
-  grub_efi_free_pool (p);
+  grub_efi_heap_free (p);
 }
 
 char *
@@ -102,9 +147,9 @@ grub_real_dprintf (const char *file, const int line, const char *condition,
   if (! debug)
     return;
 
-  grub_printf ("%s:%d: ", file, line);
+  bootlog_printf ("%s:%d: ", file, line);
   va_start (args, fmt);
-  grub_vsprintf (0, fmt, args);
+  bootlog_vprintf (fmt, args);
   va_end (args);
 }
 
@@ -247,7 +292,7 @@ grub_utf16_to_utf8 (grub_uint8_t *dest, grub_uint16_t *src,
 int
 getrtsecs (void)
 {
-  return grub_get_rtc() / GRUB_TICKS_PER_SECOND;
+  return currticks () / GRUB_TICKS_PER_SECOND;
 }
 
 void
@@ -255,6 +300,7 @@ grub_reboot (void)
 {
   grub_efi_runtime_services_t *r;
 
+  grub_flush_saved_default ();
   r = grub_efi_system_table->runtime_services;
   Call_Service_4 (r->reset_system, GRUB_EFI_RESET_COLD,
 		  GRUB_EFI_SUCCESS, 0, NULL);
@@ -266,6 +312,7 @@ grub_halt (int no_apm)
 {
   grub_efi_runtime_services_t *r;
 
+  grub_flush_saved_default ();
   r = grub_efi_system_table->runtime_services;
   Call_Service_4 (r->reset_system, GRUB_EFI_RESET_SHUTDOWN,
 		  GRUB_EFI_SUCCESS, 0, NULL);
@@ -304,9 +351,10 @@ unset_int15_handler (void)
 }
 
 /* Copy MAP to the drive map and set up the int13 handler.  */
-void
-set_int13_handler (unsigned short *map)
+unsigned long
+set_int13_handler (unsigned short *map, int cache_kb)
 {
+  return 0;
 }
 
 /* Get the ROM configuration table.  */
@@ -396,10 +444,33 @@ safe_parse_maxulong (char **str_ptr, unsigned long *myulong_ptr)
   return 1;
 }
 
+/* The ticks are counted with the TSC, from the time of the RTC when
+   they were first asked for, since GetTime reads the CMOS clock on
+   most machines, which takes tens of microseconds, and the ticks are
+   asked for on every turn of the loops that wait for the network or
+   the keyboard.  CYCLES_PER_TICK is 0 until then, and -1 if there is
+   no TSC and the RTC has to do.  */
+static unsigned long long tick_base;
+static unsigned long long cycles_per_tick;
+
 int
 currticks (void)
 {
-  return grub_get_rtc ();
+  if (! cycles_per_tick)
+    {
+      unsigned long long per_ms = bootprof_cycles_per_ms ();
+
+      cycles_per_tick = per_ms * 1000 / GRUB_TICKS_PER_SECOND;
+      if (! cycles_per_tick)
+	cycles_per_tick = -1ULL;
+      else
+	tick_base = bootprof_now () - grub_get_rtc () * cycles_per_tick;
+    }
+
+  if (cycles_per_tick == -1ULL)
+    return grub_get_rtc ();
+
+  return (bootprof_now () - tick_base) / cycles_per_tick;
 }
 
 static char *
@@ -607,6 +678,14 @@ simple_open_file(grub_efi_handle_t dev_handle,
   return file;
 }
 
+/* The saved default as it is in the file, or -1 if that isn't known,
+   and the one to write there before GRUB hands over, or -1.  Some FAT
+   drivers write the whole FAT back on every write, so savedefault only
+   notes the new default, and grub_flush_saved_default writes the last
+   one noted, if it differs.  */
+static int saved_default_on_disk = -1;
+static int saved_default_pending = -1;
+
 void
 grub_load_saved_default (grub_efi_handle_t dev_handle)
 {
@@ -627,39 +706,128 @@ grub_load_saved_default (grub_efi_handle_t dev_handle)
     buf_size = sizeof(buf) - 1;
   buf[buf_size] = '\0';
   if (safe_parse_maxint (&ptr, &val))
-    saved_entryno = val;
+    saved_entryno = saved_default_on_disk = val;
  done:
   Call_Service_1 (file->close, file);
 }
 
 int
 grub_save_saved_default (int new_default)
+{
+  saved_default_pending = (new_default == saved_default_on_disk
+			   ? -1 : new_default);
+  return 0;
+}
+
+/* Write the default noted by grub_save_saved_default, if there is one.
+   It is padded with blanks, since the file isn't truncated, and a
+   shorter number would leave the end of the old one behind.  */
+void
+grub_flush_saved_default (void)
 {
   grub_efi_loaded_image_t *loaded_image;
   grub_efi_file_t *file;
   char buf[16];
-  grub_efi_status_t status;
   grub_efi_uintn_t buf_size;
-  int ret = 0;
+  int len;
+
+  if (saved_default_pending < 0)
+    return;
 
   loaded_image = grub_efi_get_loaded_image (grub_efi_image_handle);
   file = simple_open_file (loaded_image->device_handle,
 			   saved_default_file, 1);
   if (! file)
+    return;
+
+  sprintf (buf, "%d", saved_default_pending);
+  for (len = strlen (buf); len < (int) sizeof (buf) - 2; len++)
+    buf[len] = ' ';
+  buf[len++] = '\n';
+  buf_size = len;
+  if (Call_Service_3 (file->write, file, &buf_size, buf) == GRUB_EFI_SUCCESS)
+    saved_default_on_disk = saved_default_pending;
+  saved_default_pending = -1;
+
+  Call_Service_1 (file->close, file);
+}
+
+/* The boot profile is kept next to the saved default, in the file of
+   the same name with ".profile" for its extension.  What was in it is
+   kept as well, so that it is only written when the boot read other
+   sectors.  */
+#define BOOT_PROFILE_LEN	8192
+
+static char boot_profile[BOOT_PROFILE_LEN];
+static int boot_profile_len;
+static grub_efi_handle_t boot_profile_handle;
+
+static void
+boot_profile_file (char *name)
+{
+  char *dot = grub_strrchr (saved_default_file, '.');
+  char *slash = grub_strrchr (saved_default_file, '/');
+  int len = (dot && dot > slash ? dot - saved_default_file
+	     : (int) strlen (saved_default_file));
+
+  grub_memmove (name, saved_default_file, len);
+  grub_strcpy (name + len, ".profile");
+}
+
+/* Read the sectors the last boot of the default entry read, and record
+   what this boot reads.  */
+void
+grub_load_boot_profile (grub_efi_handle_t dev_handle)
+{
+  grub_efi_file_t *file;
+  grub_efi_uintn_t buf_size = sizeof (boot_profile);
+  char name[sizeof (saved_default_file) + 8];
+
+  boot_profile_handle = dev_handle;
+  boot_profile_file (name);
+
+  file = simple_open_file (dev_handle, name, 0);
+  if (file)
     {
-      errnum = ERR_FILE_NOT_FOUND;
-      return 1;
+      if (Call_Service_3 (file->read, file, &buf_size, boot_profile)
+	  == GRUB_EFI_SUCCESS)
+	{
+	  boot_profile_len = buf_size;
+	  grub_efidisk_profile_replay (boot_profile, boot_profile_len);
+	}
+      Call_Service_1 (file->close, file);
     }
-  sprintf (buf, "%d", new_default);
-  buf_size = strlen (buf);
-  status = Call_Service_3 (file->write, file, &buf_size, buf);
-  if (status != GRUB_EFI_SUCCESS)
+
+  grub_efidisk_profile_start ();
+}
+
+/* Write what this boot read for the next one, if it is booting the
+   default entry and read other sectors than the last time.  */
+void
+grub_save_boot_profile (void)
+{
+  static char buf[BOOT_PROFILE_LEN];
+  grub_efi_file_t *file;
+  grub_efi_uintn_t buf_size;
+  char name[sizeof (saved_default_file) + 8];
+  int len;
+
+  len = grub_efidisk_profile_get (buf, sizeof (buf));
+  if (! boot_profile_handle || ! len || current_entryno != default_entry
+      || (len == boot_profile_len && ! grub_memcmp (buf, boot_profile, len)))
+    return;
+
+  boot_profile_file (name);
+  file = simple_open_file (boot_profile_handle, name, 1);
+  if (! file)
+    return;
+
+  buf_size = len;
+  if (Call_Service_3 (file->write, file, &buf_size, buf) == GRUB_EFI_SUCCESS)
     {
-      errnum = ERR_WRITE;
-      ret = 1;
-      goto done;
+      grub_memmove (boot_profile, buf, len);
+      boot_profile_len = len;
     }
- done:
+
   Call_Service_1 (file->close, file);
-  return ret;
 }
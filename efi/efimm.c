@@ -38,7 +38,8 @@ void *mmap_buf;
 grub_efi_uintn_t mmap_size;
 grub_efi_uintn_t mmap_pages;
 
-/* Maintain the list of allocated pages.  */
+/* Maintain the list of allocated pages, sorted by address so that an
+   allocation is found by bisection.  The list grows as needed.  */
 struct allocated_page
 {
   grub_efi_physical_address_t addr;
@@ -46,16 +47,121 @@ struct allocated_page
 };
 
 #define ALLOCATED_PAGES_SIZE	0x1000
-#define MAX_ALLOCATED_PAGES	\
-  (ALLOCATED_PAGES_SIZE / sizeof (struct allocated_page))
 
 static struct allocated_page *allocated_pages = 0;
+static unsigned num_allocated_pages;
+static unsigned max_allocated_pages;
+static grub_efi_uintn_t allocated_pages_pages;
+static int allocated_pages_growing;
+
+/* Bumped whenever GRUB allocates or frees pages, so that a snapshot of
+   the memory map can tell whether it is still current.  */
+static grub_efi_uintn_t mmap_generation;
+
+/* The conventional memory of the last memory map snapshot, sorted by
+   size and then by address.  */
+struct free_region
+{
+  grub_efi_physical_address_t start;
+  grub_efi_uint64_t num_pages;
+};
+
+static struct free_region *free_regions;
+static unsigned num_free_regions;
+static unsigned max_free_regions;
+static grub_efi_uintn_t snapshot_desc_size;
+static grub_efi_uintn_t snapshot_generation;
+static int snapshot_valid;
+
+/* GRUB itself keeps addresses in ints, so by default nothing is
+   allocated above 2GB.  */
+#define DEFAULT_MAX_ADDRESS	0x7fffffff
 
 /* The minimum and maximum heap size for GRUB itself.  */
 #define MIN_HEAP_SIZE	0x100000
 #define MAX_HEAP_SIZE	(16 * 0x100000)
 
 
+/* Return the index of the first allocation at or above ADDRESS.  */
+static unsigned
+find_allocated_page (grub_efi_physical_address_t address)
+{
+  unsigned lo = 0, hi = num_allocated_pages;
+
+  while (lo < hi)
+    {
+      unsigned mid = (lo + hi) / 2;
+
+      if (allocated_pages[mid].addr < address)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+/* Record that PAGES pages have been allocated at ADDRESS.  Return 1 if
+   successful, or 0 if the list cannot grow to hold them.  */
+static int
+track_pages (grub_efi_physical_address_t address, grub_efi_uint64_t pages)
+{
+  unsigned i, j;
+
+  /* The pages of the list itself are not in it.  */
+  if (! allocated_pages || allocated_pages_growing)
+    return 1;
+
+  if (num_allocated_pages == max_allocated_pages)
+    {
+      struct allocated_page *old = allocated_pages;
+      grub_efi_uintn_t old_pages = allocated_pages_pages;
+      struct allocated_page *new;
+
+      allocated_pages_growing = 1;
+      new = grub_efi_allocate_pages (0, old_pages * 2);
+      allocated_pages_growing = 0;
+      if (! new)
+	return 0;
+
+      for (i = 0; i < num_allocated_pages; i++)
+	new[i] = old[i];
+
+      allocated_pages = new;
+      allocated_pages_pages = old_pages * 2;
+      max_allocated_pages = (PAGES_TO_BYTES (allocated_pages_pages)
+			     / sizeof (struct allocated_page));
+      grub_efi_free_pages ((grub_addr_t) old, old_pages);
+    }
+
+  /* Not grub_memmove, which does nothing while errnum is set.  */
+  i = find_allocated_page (address);
+  for (j = num_allocated_pages; j > i; j--)
+    allocated_pages[j] = allocated_pages[j - 1];
+  allocated_pages[i].addr = address;
+  allocated_pages[i].num_pages = pages;
+  num_allocated_pages++;
+  return 1;
+}
+
+/* Forget the allocation at ADDRESS, if there is one.  */
+static void
+untrack_pages (grub_efi_physical_address_t address)
+{
+  unsigned i;
+
+  if (! allocated_pages)
+    return;
+
+  i = find_allocated_page (address);
+  if (i == num_allocated_pages || allocated_pages[i].addr != address)
+    return;
+
+  num_allocated_pages--;
+  for (; i < num_allocated_pages; i++)
+    allocated_pages[i] = allocated_pages[i + 1];
+}
+
 void *
 grub_efi_allocate_pool (grub_efi_uintn_t size)
 {
@@ -96,48 +202,43 @@ grub_efi_allocate_anypages(grub_efi_uintn_t pages)
   if (status != GRUB_EFI_SUCCESS)
   	return 0;
 
-  if (allocated_pages)
-     {
-       unsigned i;
- 
-       for (i = 0; i < MAX_ALLOCATED_PAGES; i++)
- 	if (allocated_pages[i].addr == 0)
-        {
-              allocated_pages[i].addr = address;
-              allocated_pages[i].num_pages = pages;
-              break;
-        }
- 
-       if (i == MAX_ALLOCATED_PAGES)
-        {
-           grub_printf ("too many page allocations");
-           return NULL;
-        }
-     }
- 
-  return (void *) ((grub_addr_t) address);
+  mmap_generation++;
+
+  if (! track_pages (address, pages))
+    {
+      Call_Service_2 (b->free_pages, address, pages);
+      grub_printf ("too many page allocations");
+      return NULL;
+    }
 
+  return (void *) ((grub_addr_t) address);
 }
 
-/* Allocate pages. Return the pointer to the first of allocated pages.  */
+/* Allocate pages, all of them below MAX_ADDRESS. Return the pointer to
+   the first of allocated pages.  */
 static void *
 grub_efi_allocate_pages_real (grub_efi_physical_address_t address,
 			      grub_efi_uintn_t pages,
-			      grub_efi_memory_type_t memtype)
+			      grub_efi_memory_type_t memtype,
+			      grub_efi_physical_address_t max_address)
 {
   grub_efi_allocate_type_t type;
   grub_efi_status_t status;
   grub_efi_boot_services_t *b;
 
-  /* Limit the memory access to less than 2GB to avoid 64bit
-   * compatible problem of grub  */
-  if (address > 0x7fffffff)
+  /* Nothing can be reached above what a pointer holds.  */
+  if (max_address > (grub_addr_t) -1)
+    max_address = (grub_addr_t) -1;
+
+  if (address > max_address
+      || PAGES_TO_BYTES ((grub_efi_physical_address_t) pages) - 1
+	 > max_address - address)
     return 0;
 
   if (address == 0)
     {
       type = GRUB_EFI_ALLOCATE_MAX_ADDRESS;
-      address = 0x7fffffff;
+      address = max_address;
     }
   else
     type = GRUB_EFI_ALLOCATE_ADDRESS;
@@ -161,7 +262,7 @@ grub_efi_allocate_pages_real (grub_efi_physical_address_t address,
     {
       /* Uggh, the address 0 was allocated... This is too annoying,
 	 so reallocate another one.  */
-      address = 0x7fffffff;
+      address = max_address;
       status = Call_Service_4 (b->allocate_pages,
 				type, GRUB_EFI_LOADER_DATA, pages, &address);
       grub_efi_free_pages (0, pages);
@@ -169,24 +270,15 @@ grub_efi_allocate_pages_real (grub_efi_physical_address_t address,
 	return 0;
     }
 
+  mmap_generation++;
+
   /* We don't want to free anything we've allocated for runtime */
-  if (allocated_pages && memtype != GRUB_EFI_RUNTIME_SERVICES_DATA)
+  if (memtype != GRUB_EFI_RUNTIME_SERVICES_DATA
+      && ! track_pages (address, pages))
     {
-      unsigned i;
-
-      for (i = 0; i < MAX_ALLOCATED_PAGES; i++)
-	if (allocated_pages[i].addr == 0)
-	  {
-	    allocated_pages[i].addr = address;
-	    allocated_pages[i].num_pages = pages;
-	    break;
-	  }
-
-      if (i == MAX_ALLOCATED_PAGES)
-	{
-	  grub_printf ("too many page allocations");
-	  return NULL;
-	}
+      Call_Service_2 (b->free_pages, address, pages);
+      grub_printf ("too many page allocations");
+      return NULL;
     }
 
   return (void *) ((grub_addr_t) address);
@@ -197,7 +289,19 @@ grub_efi_allocate_pages (grub_efi_physical_address_t address,
 			 grub_efi_uintn_t pages)
 
 {
-  return grub_efi_allocate_pages_real(address, pages, GRUB_EFI_LOADER_DATA);
+  return grub_efi_allocate_pages_real(address, pages, GRUB_EFI_LOADER_DATA,
+				      DEFAULT_MAX_ADDRESS);
+}
+
+/* Like grub_efi_allocate_pages, but the pages may be anywhere below
+   MAX_ADDRESS, for images that only the kernel ever touches.  */
+void *
+grub_efi_allocate_high_pages (grub_efi_physical_address_t address,
+			      grub_efi_uintn_t pages,
+			      grub_efi_physical_address_t max_address)
+{
+  return grub_efi_allocate_pages_real(address, pages, GRUB_EFI_LOADER_DATA,
+				      max_address);
 }
 
 void *
@@ -206,7 +310,8 @@ grub_efi_allocate_runtime_pages (grub_efi_physical_address_t address,
 
 {
   return grub_efi_allocate_pages_real(address, pages,
-				      GRUB_EFI_RUNTIME_SERVICES_DATA);
+				      GRUB_EFI_RUNTIME_SERVICES_DATA,
+				      DEFAULT_MAX_ADDRESS);
 }
 /* Free pages starting from ADDRESS.  */
 void
@@ -215,22 +320,149 @@ grub_efi_free_pages (grub_efi_physical_address_t address,
 {
   grub_efi_boot_services_t *b;
 
-  if (allocated_pages
-      && ((grub_efi_physical_address_t) ((grub_addr_t) allocated_pages)
-	  != address))
+  untrack_pages (address);
+
+  b = grub_efi_system_table->boot_services;
+  Call_Service_2 (b->free_pages ,address, pages);
+  mmap_generation++;
+}
+
+/* GRUB's own heap.  Firmware pool calls are slow on some machines and
+   leave the firmware memory in pieces, so small blocks are kept on
+   free lists, one for each power of two from 16 bytes to 2KB, and new
+   ones are cut from HEAP_CHUNK_PAGES pages at a time.  Bigger blocks
+   still come from the pool.  A header before every block tells which.  */
+#define HEAP_MIN_SHIFT		4
+#define HEAP_MAX_SHIFT		11
+#define HEAP_CLASSES		(HEAP_MAX_SHIFT - HEAP_MIN_SHIFT + 1)
+#define HEAP_CHUNK_PAGES	16
+#define HEAP_POOL		0xff
+
+struct heap_header
+{
+  grub_uint32_t class;
+  grub_uint32_t pad;
+};
+
+struct heap_free
+{
+  struct heap_free *next;
+};
+
+static struct heap_free *heap_free_lists[HEAP_CLASSES];
+static char *heap_chunk;
+static grub_efi_uintn_t heap_chunk_left;
+
+void *
+grub_efi_heap_alloc (grub_efi_uintn_t size)
+{
+  struct heap_header *h;
+  grub_efi_uintn_t total = size + sizeof (*h);
+  grub_efi_uintn_t block;
+  unsigned class;
+
+  if (total > (1 << HEAP_MAX_SHIFT))
     {
-      unsigned i;
+      h = grub_efi_allocate_pool (total);
+      if (! h)
+	return 0;
+      h->class = HEAP_POOL;
+      return h + 1;
+    }
 
-      for (i = 0; i < MAX_ALLOCATED_PAGES; i++)
-	if (allocated_pages[i].addr == address)
-	  {
-	    allocated_pages[i].addr = 0;
-	    break;
-	  }
+  for (class = 0; total > (1U << (class + HEAP_MIN_SHIFT)); class++)
+    ;
+  block = 1 << (class + HEAP_MIN_SHIFT);
+
+  if (heap_free_lists[class])
+    {
+      h = (struct heap_header *) heap_free_lists[class];
+      heap_free_lists[class] = heap_free_lists[class]->next;
     }
+  else
+    {
+      /* What is left of the old chunk is too little to bother with.  */
+      if (heap_chunk_left < block)
+	{
+	  heap_chunk = grub_efi_allocate_pages (0, HEAP_CHUNK_PAGES);
+	  if (! heap_chunk)
+	    {
+	      heap_chunk_left = 0;
+	      return 0;
+	    }
+	  heap_chunk_left = PAGES_TO_BYTES (HEAP_CHUNK_PAGES);
+	}
 
-  b = grub_efi_system_table->boot_services;
-  Call_Service_2 (b->free_pages ,address, pages);
+      h = (struct heap_header *) heap_chunk;
+      heap_chunk += block;
+      heap_chunk_left -= block;
+    }
+
+  h->class = class;
+  return h + 1;
+}
+
+void
+grub_efi_heap_free (void *ptr)
+{
+  struct heap_header *h;
+  struct heap_free *f;
+
+  if (! ptr)
+    return;
+
+  h = (struct heap_header *) ptr - 1;
+  if (h->class == HEAP_POOL)
+    {
+      grub_efi_free_pool (h);
+      return;
+    }
+
+  f = (struct heap_free *) h;
+  f->next = heap_free_lists[h->class];
+  heap_free_lists[h->class] = f;
+}
+
+/* The scratch arena, for buffers which live only as long as one
+   operation.  Take a mark before, allocate from the arena as much as
+   needed, and release everything at once by going back to the mark.
+   Marks nest, as calls do.  */
+#define ARENA_PAGES	16
+
+static char *arena;
+static grub_efi_uintn_t arena_used;
+
+grub_efi_uintn_t
+grub_efi_arena_mark (void)
+{
+  return arena_used;
+}
+
+void *
+grub_efi_arena_alloc (grub_efi_uintn_t size)
+{
+  void *p;
+
+  if (! arena)
+    {
+      arena = grub_efi_allocate_pages (0, ARENA_PAGES);
+      if (! arena)
+	return 0;
+    }
+
+  size = (size + 7) & ~7;
+  if (size > PAGES_TO_BYTES (ARENA_PAGES) - arena_used)
+    return 0;
+
+  p = arena + arena_used;
+  arena_used += size;
+  return p;
+}
+
+void
+grub_efi_arena_release (grub_efi_uintn_t mark)
+{
+  arena_used = mark;
 }
 
 /* Get the memory map as defined in the EFI spec. Return 1 if successful,
@@ -288,73 +520,376 @@ grub_efi_get_memory_map (grub_efi_uintn_t *map_key,
     }
 }
 
+/* The room left in mmap_buf for the descriptors which appear between
+   loading a kernel and booting it, as the firmware and GRUB allocate
+   more pages.  */
+#define MMAP_SPARE_DESCS		64
+
+/* How many times to take the memory map and try ExitBootServices, if
+   the map keeps changing in between.  */
+#define EXIT_BOOT_SERVICES_TRIES	8
+
+/* Make mmap_buf big enough for the memory map and MMAP_SPARE_DESCS
+   descriptors more, so that it needn't grow when the map is taken for
+   the last time.  Return 1 if successful, or 0.  */
+int
+grub_efi_reserve_memory_map (void)
+{
+  grub_efi_uintn_t desc_size;
+  grub_efi_uintn_t need;
+
+  if (grub_efi_get_memory_map (0, &desc_size, 0) <= 0)
+    return 0;
+
+  need = mmap_size + MMAP_SPARE_DESCS * desc_size;
+  if (PAGES_TO_BYTES (mmap_pages) >= need)
+    return 1;
+
+  grub_efi_free_pages ((grub_addr_t) mmap_buf, mmap_pages);
+  mmap_pages = BYTES_TO_PAGES (need + 4095);
+  mmap_buf = grub_efi_allocate_pages (0, mmap_pages);
+  if (! mmap_buf)
+    {
+      mmap_pages = 0;
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Take the memory map for the last time, into mmap_buf and as an e820
+   map into E820_MAP and EXT_MAP, as e820_map_from_efi_map does, and
+   exit the boot services with it.  The firmware
+   may change the map in between, as its events run, and then the map
+   is taken and the exit tried again.  Nothing is allocated along the
+   way as long as mmap_buf has room, which grub_efi_reserve_memory_map
+   makes sure of.  Return 1 if successful, or 0.  */
+int
+grub_efi_exit_boot_services_with_map (struct e820_entry *e820_map,
+				      int *e820_nr_map,
+				      struct e820_entry *ext_map,
+				      int *ext_nr_map,
+				      int ext_max,
+				      grub_efi_uintn_t *desc_size,
+				      grub_efi_uint32_t *desc_version)
+{
+  grub_efi_uintn_t map_key;
+  int i;
+
+  for (i = 0; i < EXIT_BOOT_SERVICES_TRIES; i++)
+    {
+      if (grub_efi_get_memory_map (&map_key, desc_size, desc_version) <= 0)
+	return 0;
+
+      e820_map_from_efi_map (e820_map, e820_nr_map,
+			     ext_map, ext_nr_map, ext_max,
+			     mmap_buf, *desc_size, mmap_size);
+
+      if (grub_efi_exit_boot_services (map_key))
+	return 1;
+    }
+
+  return 0;
+}
+
+/* Make sure the memory map snapshot is current, taking a new one if
+   GRUB has allocated or freed pages since.  Return 1 if successful, or
+   0 if the memory map cannot be had.  */
+static int
+take_mmap_snapshot (void)
+{
+  grub_efi_memory_descriptor_t *desc, *mmap_end;
+  grub_efi_uintn_t desc_size;
+  unsigned n, i;
+
+  if (snapshot_valid && snapshot_generation == mmap_generation)
+    return 1;
+
+  snapshot_valid = 0;
+  while (1)
+    {
+      if (grub_efi_get_memory_map (0, &desc_size, 0) <= 0)
+	return 0;
+
+      mmap_end = NEXT_MEMORY_DESCRIPTOR (mmap_buf, mmap_size);
+      for (n = 0, desc = mmap_buf;
+	   desc < mmap_end;
+	   desc = NEXT_MEMORY_DESCRIPTOR (desc, desc_size))
+	if (desc->type == GRUB_EFI_CONVENTIONAL_MEMORY)
+	  n++;
+
+      if (n <= max_free_regions)
+	break;
+
+      /* Growing the array changes the map, so take it again; leave some
+	 room for the regions that this splits off.  */
+      if (free_regions)
+	grub_efi_free_pool (free_regions);
+      max_free_regions = n + 16;
+      free_regions = grub_efi_allocate_pool (max_free_regions
+					     * sizeof (*free_regions));
+      if (! free_regions)
+	{
+	  max_free_regions = 0;
+	  return 0;
+	}
+    }
+
+  /* The map is at most a few hundred descriptors long and mostly in
+     order already, so a plain insertion sort does.  */
+  num_free_regions = 0;
+  for (desc = mmap_buf;
+       desc < mmap_end;
+       desc = NEXT_MEMORY_DESCRIPTOR (desc, desc_size))
+    {
+      if (desc->type != GRUB_EFI_CONVENTIONAL_MEMORY)
+	continue;
+
+      for (i = num_free_regions; i > 0; i--)
+	{
+	  struct free_region *r = &free_regions[i - 1];
+
+	  if (r->num_pages < desc->num_pages
+	      || (r->num_pages == desc->num_pages
+		  && r->start < desc->physical_start))
+	    break;
+	  free_regions[i] = *r;
+	}
+      free_regions[i].start = desc->physical_start;
+      free_regions[i].num_pages = desc->num_pages;
+      num_free_regions++;
+    }
+
+  snapshot_desc_size = desc_size;
+  snapshot_generation = mmap_generation;
+  snapshot_valid = 1;
+  return 1;
+}
+
+/* Allocate PAGES pages of conventional memory between MIN_ADDRESS and
+   MAX_ADDRESS, starting on a multiple of ALIGN, from the smallest free
+   region they fit in.  If TOP, the pages are put as high as possible in
+   that region, else as low as possible.  Return the pointer to the
+   first of them, or NULL if nothing fits.  */
+void *
+grub_efi_allocate_best_fit (grub_efi_physical_address_t min_address,
+			    grub_efi_physical_address_t max_address,
+			    grub_efi_uintn_t pages,
+			    grub_efi_uint64_t align,
+			    int top)
+{
+  grub_efi_uint64_t size;
+  unsigned lo, hi, i;
+  int tries;
+
+  if (max_address > (grub_addr_t) -1)
+    max_address = (grub_addr_t) -1;
+
+  size = PAGES_TO_BYTES ((grub_efi_uint64_t) pages);
+  if (align < PAGES_TO_BYTES (1))
+    align = PAGES_TO_BYTES (1);
+
+  for (tries = 0; tries < 2; tries++)
+    {
+      if (! take_mmap_snapshot ())
+	return 0;
+
+      /* Find the first region that is large enough.  */
+      lo = 0;
+      hi = num_free_regions;
+      while (lo < hi)
+	{
+	  unsigned mid = (lo + hi) / 2;
+
+	  if (free_regions[mid].num_pages < pages)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+
+      for (i = lo; i < num_free_regions; i++)
+	{
+	  grub_efi_physical_address_t start, end, addr;
+	  void *p;
+
+	  start = free_regions[i].start;
+	  end = start + PAGES_TO_BYTES (free_regions[i].num_pages);
+	  if (start < min_address)
+	    start = min_address;
+	  if (end - 1 > max_address)
+	    end = max_address + 1;
+	  if (end <= start || end - start < size)
+	    continue;
+
+	  if (top)
+	    {
+	      addr = (end - size) & ~(align - 1);
+	      if (addr < start)
+		continue;
+	    }
+	  else
+	    {
+	      addr = (start + align - 1) & ~(align - 1);
+	      if (addr < start || addr > end - size)
+		continue;
+	    }
+
+	  /* Address 0 would mean any address to the firmware.  */
+	  if (addr == 0)
+	    continue;
+
+	  p = grub_efi_allocate_high_pages (addr, pages, max_address);
+	  if (p)
+	    return p;
+
+	  /* Someone else took the memory, so the snapshot was stale.  */
+	  break;
+	}
+
+      if (i == num_free_regions)
+	return 0;
+
+      snapshot_valid = 0;
+    }
+
+  return 0;
+}
+
 #define MMAR_DESC_LENGTH	20
 
+/* Where e820_map_from_efi_map puts the regions: the first E820_MAX in
+   MAP, and those that don't fit there in EXT, up to EXT_MAX of them.  */
+struct e820_sink
+{
+  struct e820_entry *map;
+  int nr;
+  struct e820_entry *ext;
+  int ext_nr;
+  int ext_max;
+};
+
 /*
  * Add a memory region to the kernel e820 map.
  *
  * Convert EFI memory map to E820 map for the operating system
  * This code is based on a Linux kernel patch submitted by Edgar Hucek 
+ *
+ * The regions come in the order of their addresses, so a region merges
+ * only with the last one added.  Those that fit nowhere are dropped.
  */
 static void
-add_memory_region (struct e820_entry *e820_map,
-		   int *e820_nr_map,
+add_memory_region (struct e820_sink *sink,
 		   unsigned long long start,
 		   unsigned long long size,
 		   unsigned int type)
 {
-  int x = *e820_nr_map;
-  static unsigned long long estart = 0ULL;
-  static unsigned long esize = 0L;
-  static unsigned int etype = -1;
-  static int merge = 0;
+  struct e820_entry *e = 0;
+
+  if (sink->ext_nr)
+    e = &sink->ext[sink->ext_nr - 1];
+  else if (sink->nr)
+    e = &sink->map[sink->nr - 1];
 
   /* merge adjacent regions of same type */
-  if ((x > 0) && e820_map[x-1].addr + e820_map[x-1].size == start
-      && e820_map[x-1].type == type)
+  if (e && e->addr + e->size == start && e->type == type)
     {
-      e820_map[x-1].size += size;
-      estart = e820_map[x-1].addr;
-      esize  = e820_map[x-1].size;
-      etype  = e820_map[x-1].type;
-      merge++;
+      e->size += size;
       return;
     }
 
-    /* fill up to E820_MAX */
-    if ( x < E820_MAX )
+  if (sink->nr < E820_MAX)
+    e = &sink->map[sink->nr++];
+  else if (sink->ext_nr < sink->ext_max)
+    e = &sink->ext[sink->ext_nr++];
+  else
+    return;
+
+  e->addr = start;
+  e->size = size;
+  e->type = type;
+}
+
+#define MEMORY_DESCRIPTOR(map, i, size)		\
+  NEXT_MEMORY_DESCRIPTOR (map, (i) * (size))
+
+static void
+swap_memory_descriptors (grub_efi_memory_descriptor_t *d0,
+			 grub_efi_memory_descriptor_t *d1,
+			 grub_efi_uintn_t size)
+{
+  char *p0 = (char *) d0, *p1 = (char *) d1;
+
+  while (size--)
     {
-      e820_map[x].addr = start;
-      e820_map[x].size = size;
-      e820_map[x].type = type;
-      (*e820_nr_map)++;
-      merge=0;
-      return;
+      char c = *p0;
+
+      *p0++ = *p1;
+      *p1++ = c;
     }
+}
 
-    /* different type means another region didn't fit */
-    /* or same type, but there's a hole */
-    if (etype != type || (estart + esize) != start)
+static void
+sift_memory_descriptor (grub_efi_memory_descriptor_t *map,
+			grub_efi_uintn_t root, grub_efi_uintn_t n,
+			grub_efi_uintn_t size)
+{
+  grub_efi_uintn_t child;
+
+  while ((child = 2 * root + 1) < n)
     {
-      merge = 0;
-      estart = start;
-      esize = size;
-      etype = type;
-      return;
+      if (child + 1 < n
+	  && (MEMORY_DESCRIPTOR (map, child, size)->physical_start
+	      < MEMORY_DESCRIPTOR (map, child + 1, size)->physical_start))
+	child++;
+      if (MEMORY_DESCRIPTOR (map, root, size)->physical_start
+	  >= MEMORY_DESCRIPTOR (map, child, size)->physical_start)
+	return;
+      swap_memory_descriptors (MEMORY_DESCRIPTOR (map, root, size),
+			       MEMORY_DESCRIPTOR (map, child, size), size);
+      root = child;
     }
+}
+
+/* Sort the N descriptors of SIZE bytes each in MAP by their addresses.
+   This may run between GetMemoryMap and ExitBootServices, so it sorts
+   in place, with a heap sort, and allocates nothing.  Most firmware
+   gives the map in order already, which is checked for first.  */
+static void
+sort_memory_map (grub_efi_memory_descriptor_t *map, grub_efi_uintn_t n,
+		 grub_efi_uintn_t size)
+{
+  grub_efi_uintn_t i;
+
+  for (i = 1; i < n; i++)
+    if (MEMORY_DESCRIPTOR (map, i - 1, size)->physical_start
+	> MEMORY_DESCRIPTOR (map, i, size)->physical_start)
+      break;
+  if (i >= n)
+    return;
 
-    /* same type and no hole, merge it */
-    estart += esize;
-    esize += size;
-    merge++;
+  for (i = n / 2; i-- > 0; )
+    sift_memory_descriptor (map, i, n, size);
+
+  for (i = n; i-- > 1; )
+    {
+      swap_memory_descriptors (map, MEMORY_DESCRIPTOR (map, i, size), size);
+      sift_memory_descriptor (map, 0, i, size);
+    }
 }
 
 /*
  * Make a e820 memory map
+ *
+ * MEMORY_MAP is sorted in place first.  The regions which don't fit in
+ * the E820_MAX entries of E820_MAP go into EXT_MAP, up to EXT_MAX of
+ * them, for kernels which take more; EXT_MAP may be 0.
  */
 void
 e820_map_from_efi_map (struct e820_entry *e820_map,
 		       int *e820_nr_map,
+		       struct e820_entry *ext_map,
+		       int *ext_nr_map,
+		       int ext_max,
 		       grub_efi_memory_descriptor_t *memory_map,
 		       grub_efi_uintn_t desc_size,
 		       grub_efi_uintn_t memory_map_size)
@@ -364,9 +899,17 @@ e820_map_from_efi_map (struct e820_entry *e820_map,
   unsigned long long end = 0;
   unsigned long long size = 0;
   grub_efi_memory_descriptor_t *memory_map_end;
+  struct e820_sink sink;
+
+  sort_memory_map (memory_map, memory_map_size / desc_size, desc_size);
+
+  sink.map = e820_map;
+  sink.nr = 0;
+  sink.ext = ext_map;
+  sink.ext_nr = 0;
+  sink.ext_max = ext_map ? ext_max : 0;
 
   memory_map_end = NEXT_MEMORY_DESCRIPTOR (memory_map, memory_map_size);
-  *e820_nr_map = 0;
   for (desc = memory_map;
        desc < memory_map_end;
        desc = NEXT_MEMORY_DESCRIPTOR (desc, desc_size))
@@ -374,7 +917,7 @@ e820_map_from_efi_map (struct e820_entry *e820_map,
       switch (desc->type)
 	{
 	case GRUB_EFI_ACPI_RECLAIM_MEMORY:
-	  add_memory_region (e820_map, e820_nr_map,
+	  add_memory_region (&sink,
 			     desc->physical_start, desc->num_pages << 12,
 			     E820_ACPI);
 	  break;
@@ -385,7 +928,7 @@ e820_map_from_efi_map (struct e820_entry *e820_map,
 	case GRUB_EFI_MEMORY_MAPPED_IO_PORT_SPACE:
 	case GRUB_EFI_UNUSABLE_MEMORY:
 	case GRUB_EFI_PAL_CODE:
-	  add_memory_region (e820_map, e820_nr_map,
+	  add_memory_region (&sink,
 			     desc->physical_start, desc->num_pages << 12,
 			     E820_RESERVED);
 	  break;
@@ -400,7 +943,7 @@ e820_map_from_efi_map (struct e820_entry *e820_map,
 	  if (start < 0x100000ULL && end > 0xA0000ULL)
 	    {
 	      if (start < 0xA0000ULL)
-		add_memory_region (e820_map, e820_nr_map,
+		add_memory_region (&sink,
 				   start, 0xA0000ULL-start,
 				   E820_RAM);
 	      if (end <= 0x100000ULL)
@@ -408,32 +951,34 @@ e820_map_from_efi_map (struct e820_entry *e820_map,
 	      start = 0x100000ULL;
 	      size = end - start;
 	    }
-	  add_memory_region (e820_map, e820_nr_map,
+	  add_memory_region (&sink,
 			     start, size, E820_RAM);
 	  break;
 	case GRUB_EFI_ACPI_MEMORY_NVS:
-	  add_memory_region (e820_map, e820_nr_map,
+	  add_memory_region (&sink,
 			     desc->physical_start, desc->num_pages << 12,
 			     E820_NVS);
 	  break;
 	}
     }
+
+  *e820_nr_map = sink.nr;
+  if (ext_nr_map)
+    *ext_nr_map = sink.ext_nr;
 }
 
 static void
 update_e820_map (struct e820_entry *e820_map,
 		 int *e820_nr_map)
 {
-  grub_efi_uintn_t desc_size;
-
-  if (grub_efi_get_memory_map (0, &desc_size, 0) < 0)
+  if (! take_mmap_snapshot ())
     {
       grub_printf ("cannot get memory map");
       return;
     }
 
-  e820_map_from_efi_map (e820_map, e820_nr_map,
-			 mmap_buf, desc_size, mmap_size);
+  e820_map_from_efi_map (e820_map, e820_nr_map, 0, 0, 0,
+			 mmap_buf, snapshot_desc_size, mmap_size);
 }
 
 /* Simulated memory sizes. */
@@ -469,6 +1014,7 @@ get_eisamemsize (void)
 
 static int grub_e820_nr_map;
 static struct e820_entry grub_e820_map[E820_MAX];
+static grub_efi_uintn_t grub_e820_generation;
 
 /* Fetch the next entry in the memory map and return the continuation
    value.  DESC is a pointer to the descriptor buffer, and CONT is the
@@ -477,6 +1023,13 @@ static struct e820_entry grub_e820_map[E820_MAX];
 int
 get_mmap_entry (struct mmar_desc *desc, int cont)
 {
+  /* Rebuild the map for a new walk if pages have come and gone.  */
+  if (cont == 0 && grub_e820_generation != mmap_generation)
+    {
+      update_e820_map (grub_e820_map, &grub_e820_nr_map);
+      grub_e820_generation = mmap_generation;
+    }
+
   if (cont < 0 || cont >= grub_e820_nr_map)
     {
       /* Should not happen.  */
@@ -512,28 +1065,41 @@ grub_efi_mm_init (void)
       return;
     }
 
-  grub_memset (allocated_pages, 0, ALLOCATED_PAGES_SIZE);
+  allocated_pages_pages = BYTES_TO_PAGES (ALLOCATED_PAGES_SIZE);
+  max_allocated_pages = ALLOCATED_PAGES_SIZE / sizeof (struct allocated_page);
+  num_allocated_pages = 0;
 
   update_e820_map (grub_e820_map, &grub_e820_nr_map);
+  grub_e820_generation = mmap_generation;
 }
 
 void
 grub_efi_mm_fini (void)
 {
+  unsigned i;
+
   if (allocated_pages)
     {
-      unsigned i;
+      struct allocated_page *table = allocated_pages;
 
-      for (i = 0; i < MAX_ALLOCATED_PAGES; i++)
+      /* Free from the end, so that nothing moves in the list.  */
+      while (num_allocated_pages > 0)
 	{
 	  struct allocated_page *p;
 
-	  p = allocated_pages + i;
-	  if (p->addr != 0)
-	    grub_efi_free_pages ((grub_addr_t) p->addr, p->num_pages);
+	  p = allocated_pages + num_allocated_pages - 1;
+	  grub_efi_free_pages ((grub_addr_t) p->addr, p->num_pages);
 	}
 
-      grub_efi_free_pages ((grub_addr_t) allocated_pages,
-			   BYTES_TO_PAGES (ALLOCATED_PAGES_SIZE));
+      allocated_pages = 0;
+      grub_efi_free_pages ((grub_addr_t) table, allocated_pages_pages);
     }
+
+  /* The heap chunks and the arena went with the pages.  */
+  for (i = 0; i < HEAP_CLASSES; i++)
+    heap_free_lists[i] = 0;
+  heap_chunk = 0;
+  heap_chunk_left = 0;
+  arena = 0;
+  arena_used = 0;
 }
@@ -0,0 +1,115 @@
+/* efimp.c - run work on the other processors through EFI MP services */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <config.h>
+#include <grub/misc.h>
+#include <grub/efi/api.h>
+#include <grub/efi/efi.h>
+#include <grub/efi/eficall.h>
+
+#include <shared.h>
+
+static grub_efi_guid_t mp_services_guid = GRUB_EFI_MP_SERVICES_GUID;
+
+static grub_efi_mp_services_t *mp;
+static int mp_probed;
+static int mp_aps;
+
+static grub_efi_event_t mp_event;
+static void (*mp_func) (void *);
+static void *mp_arg;
+
+/* The firmware calls the procedure with its own calling convention.  */
+static void GRUB_EFI_API
+mp_procedure (void *argument)
+{
+  mp_func (mp_arg);
+}
+
+/* Return how many application processors there are to run work on.  */
+int
+grub_mp_count (void)
+{
+  grub_efi_uintn_t total, enabled;
+  grub_efi_status_t status;
+
+  if (mp_probed)
+    return mp_aps;
+
+  mp_probed = 1;
+  mp = grub_efi_locate_protocol (&mp_services_guid, 0);
+  if (! mp)
+    return 0;
+
+  status = Call_Service_3 (mp->get_number_of_processors, mp,
+			   &total, &enabled);
+  if (status == GRUB_EFI_SUCCESS && enabled > 1)
+    mp_aps = enabled - 1;
+
+  return mp_aps;
+}
+
+/* Start FUNC (ARG) on every enabled application processor, and return
+   at once, so that this one may go on with something else.  Return
+   zero if it could not be started anywhere.  */
+int
+grub_mp_start (void (*func) (void *), void *arg)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_status_t status;
+
+  if (! grub_mp_count () || mp_event)
+    return 0;
+
+  status = Call_Service_5 (b->create_event, 0, 0, 0, 0, &mp_event);
+  if (status != GRUB_EFI_SUCCESS)
+    {
+      mp_event = 0;
+      return 0;
+    }
+
+  mp_func = func;
+  mp_arg = arg;
+  status = Call_Service_7 (mp->startup_all_aps, mp, mp_procedure, 0,
+			   mp_event, 0, 0, 0);
+  if (status != GRUB_EFI_SUCCESS)
+    {
+      Call_Service_1 (b->close_event, mp_event);
+      mp_event = 0;
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Wait until the processors started by grub_mp_start are all done.  */
+void
+grub_mp_wait (void)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_uintn_t index;
+
+  if (! mp_event)
+    return;
+
+  Call_Service_3 (b->wait_for_event, 1, &mp_event, &index);
+  Call_Service_1 (b->close_event, mp_event);
+  mp_event = 0;
+}
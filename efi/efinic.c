@@ -0,0 +1,496 @@
+/* efinic.c - the netboot NIC on top of the simple network protocol */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* The firmware only moves whole frames here; ARP, IP, UDP, BOOTP and
+   TFTP are all done by the netboot code, as with the other NICs.  The
+   frames go through the managed network protocol if the interface has
+   it, which shares it with the firmware's own PXE code and keeps frames
+   for GRUB while it is busy elsewhere, and straight through the simple
+   network protocol if not.  */
+
+#ifdef SUPPORT_NETBOOT
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/efi/api.h>
+#include <grub/efi/efi.h>
+#include <grub/efi/eficall.h>
+
+#define GRUB	1
+#include <etherboot.h>
+#include <nic.h>
+#include <cards.h>
+
+static grub_efi_guid_t simple_network_guid = GRUB_EFI_SIMPLE_NETWORK_GUID;
+static grub_efi_guid_t mnp_binding_guid =
+  GRUB_EFI_MANAGED_NETWORK_SERVICE_BINDING_GUID;
+static grub_efi_guid_t mnp_guid = GRUB_EFI_MANAGED_NETWORK_GUID;
+
+/* Whether the netboot code has an interface up here.  */
+static int nic_up;
+
+/* The frame being sent, which the firmware may read from until it
+   hands it back.  */
+static char nic_txbuf[ETH_MAX_FRAME_LEN + VLAN_HLEN]
+  __attribute__ ((aligned (8)));
+
+/* How long to wait for a frame to be sent, in units of 10us.  */
+#define NIC_TX_TIMEOUT	10000
+
+static grub_efi_simple_network_t *snp;
+
+/* Whether the interface was brought up here, and so is to be shut down
+   when the NIC is disabled.  */
+static int snp_started;
+static int snp_initialized;
+
+static int
+snp_poll (struct nic *nic)
+{
+  grub_efi_uintn_t len = ETH_MAX_FRAME_LEN + VLAN_HLEN;
+  grub_efi_status_t status;
+
+  status = Call_Service_7 (snp->receive, snp, 0, &len, nic->packet, 0, 0, 0);
+  if (status != GRUB_EFI_SUCCESS)
+    return 0;
+
+  nic->packetlen = len;
+  return 1;
+}
+
+static void
+snp_transmit (struct nic *nic, const char *d, unsigned int t,
+	      unsigned int s, const char *p)
+{
+  grub_efi_uint32_t interrupt_status;
+  grub_efi_status_t status;
+  void *txbuf;
+  unsigned int len = ETH_HLEN + s;
+  int i;
+
+  if (len > sizeof (nic_txbuf))
+    return;
+
+  grub_memmove (nic_txbuf, d, ETH_ALEN);
+  grub_memmove (nic_txbuf + ETH_ALEN, nic->node_addr, ETH_ALEN);
+  nic_txbuf[12] = (t >> 8) & 0xff;
+  nic_txbuf[13] = t & 0xff;
+  grub_memmove (nic_txbuf + ETH_HLEN, p, s);
+  while (len < ETH_ZLEN)
+    nic_txbuf[len++] = 0;
+
+  status = Call_Service_7 (snp->transmit, snp, 0, len, nic_txbuf, 0, 0, 0);
+  if (status != GRUB_EFI_SUCCESS)
+    return;
+
+  /* The buffer is in use until it comes back, and there is only one.  */
+  for (i = 0; i < NIC_TX_TIMEOUT; i++)
+    {
+      txbuf = 0;
+      status = Call_Service_3 (snp->get_status, snp,
+			       &interrupt_status, &txbuf);
+      if (status != GRUB_EFI_SUCCESS || txbuf)
+	break;
+      grub_efi_stall (10);
+    }
+}
+
+static void
+snp_reset (struct nic *nic)
+{
+  Call_Service_2 (snp->reset, snp, 0);
+  Call_Service_6 (snp->receive_filters, snp,
+		  GRUB_EFI_SIMPLE_NETWORK_RECEIVE_UNICAST
+		  | GRUB_EFI_SIMPLE_NETWORK_RECEIVE_BROADCAST,
+		  0, 0, 0, 0);
+}
+
+static void
+snp_disable (struct nic *nic)
+{
+  if (snp_initialized)
+    Call_Service_1 (snp->shutdown, snp);
+  if (snp_started)
+    Call_Service_1 (snp->stop, snp);
+  snp_initialized = snp_started = 0;
+  nic_up = 0;
+}
+
+/* Bring up the interface on HANDLE, and set SNP to it.  */
+static int
+snp_open (grub_efi_handle_t handle)
+{
+  grub_efi_simple_network_t *net;
+
+  net = grub_efi_open_protocol (handle, &simple_network_guid,
+				GRUB_EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+  if (! net || ! net->mode)
+    return 0;
+
+  snp_started = snp_initialized = 0;
+  if (net->mode->state == GRUB_EFI_NETWORK_STOPPED)
+    {
+      if (Call_Service_1 (net->start, net) != GRUB_EFI_SUCCESS)
+	return 0;
+      snp_started = 1;
+    }
+  if (net->mode->state == GRUB_EFI_NETWORK_STARTED)
+    {
+      if (Call_Service_3 (net->initialize, net, 0, 0) != GRUB_EFI_SUCCESS)
+	{
+	  if (snp_started)
+	    Call_Service_1 (net->stop, net);
+	  snp_started = 0;
+	  return 0;
+	}
+      snp_initialized = 1;
+    }
+
+  snp = net;
+  if (net->mode->hw_address_size != ETH_ALEN
+      || net->mode->media_header_size != ETH_HLEN)
+    {
+      snp_disable (0);
+      snp = 0;
+      return 0;
+    }
+
+  return 1;
+}
+
+static grub_efi_service_binding_t *mnp_binding;
+static grub_efi_handle_t mnp_child;
+static grub_efi_managed_network_t *mnp;
+static grub_efi_simple_network_mode_t mnp_mode;
+
+/* The receive tokens, all queued with the firmware at once, so that
+   the frames which come in while GRUB decompresses or checks what came
+   before are kept for it instead of being dropped.  The firmware fills
+   them in the order they were queued, from MNP_RX_NEXT on.  */
+#define MNP_RX_TOKENS	16
+static grub_efi_managed_network_completion_token_t mnp_rx[MNP_RX_TOKENS];
+static int mnp_rx_next;
+
+static grub_efi_managed_network_completion_token_t mnp_tx;
+static grub_efi_managed_network_transmit_data_t mnp_tx_data;
+static grub_efi_mac_address_t mnp_tx_dest;
+/* Whether NIC_TXBUF is still being sent.  */
+static int mnp_tx_pending;
+
+static int
+mnp_poll (struct nic *nic)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_managed_network_completion_token_t *token;
+  grub_efi_managed_network_receive_data_t *rx;
+  int i, ret = 0;
+
+  Call_Service_1 (mnp->poll, mnp);
+
+  /* The first token that is done, after the last one taken; a token
+     which could not be queued again is never done, and is passed by.  */
+  for (i = 0; i < MNP_RX_TOKENS; i++)
+    {
+      token = &mnp_rx[(mnp_rx_next + i) % MNP_RX_TOKENS];
+      if (token->event
+	  && Call_Service_1 (b->check_event, token->event) == GRUB_EFI_SUCCESS)
+	break;
+    }
+  if (i == MNP_RX_TOKENS)
+    return 0;
+  mnp_rx_next = (mnp_rx_next + i + 1) % MNP_RX_TOKENS;
+
+  rx = token->packet.rx_data;
+  if (token->status == GRUB_EFI_SUCCESS && rx
+      && rx->header_length + rx->data_length <= ETH_MAX_FRAME_LEN + VLAN_HLEN)
+    {
+      grub_memmove (nic->packet, rx->media_header, rx->header_length);
+      grub_memmove (nic->packet + rx->header_length, rx->packet_data,
+		    rx->data_length);
+      nic->packetlen = rx->header_length + rx->data_length;
+      ret = 1;
+    }
+  if (rx)
+    Call_Service_1 (b->signal_event, rx->recycle_event);
+
+  /* Queue it again, behind the others.  */
+  token->status = GRUB_EFI_NOT_READY;
+  token->packet.rx_data = 0;
+  Call_Service_2 (mnp->receive, mnp, token);
+  return ret;
+}
+
+/* Wait for the last frame to be sent, or give up on it.  */
+static void
+mnp_tx_wait (void)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  int i;
+
+  for (i = 0; mnp_tx_pending && i < NIC_TX_TIMEOUT; i++)
+    {
+      Call_Service_1 (mnp->poll, mnp);
+      if (Call_Service_1 (b->check_event, mnp_tx.event) == GRUB_EFI_SUCCESS)
+	mnp_tx_pending = 0;
+      else
+	grub_efi_stall (10);
+    }
+
+  if (mnp_tx_pending)
+    {
+      /* That signals the event, which is then cleared.  */
+      Call_Service_2 (mnp->cancel, mnp, &mnp_tx);
+      Call_Service_1 (b->check_event, mnp_tx.event);
+      mnp_tx_pending = 0;
+    }
+}
+
+/* Hand the frame to the firmware and return: it is sent while the
+   netboot code goes on to wait for the answer.  */
+static void
+mnp_transmit (struct nic *nic, const char *d, unsigned int t,
+	      unsigned int s, const char *p)
+{
+  if (s > sizeof (nic_txbuf))
+    return;
+
+  /* There is only one buffer.  */
+  mnp_tx_wait ();
+
+  grub_memmove (mnp_tx_dest, d, ETH_ALEN);
+  grub_memmove (nic_txbuf, p, s);
+  mnp_tx_data.destination_address = &mnp_tx_dest;
+  mnp_tx_data.source_address = 0;
+  mnp_tx_data.protocol_type = t;
+  mnp_tx_data.data_length = s;
+  mnp_tx_data.header_length = 0;
+  mnp_tx_data.fragment_count = 1;
+  mnp_tx_data.fragment_table[0].fragment_length = s;
+  mnp_tx_data.fragment_table[0].fragment_buffer = nic_txbuf;
+
+  mnp_tx.status = GRUB_EFI_NOT_READY;
+  mnp_tx.packet.tx_data = &mnp_tx_data;
+  if (Call_Service_2 (mnp->transmit, mnp, &mnp_tx) == GRUB_EFI_SUCCESS)
+    mnp_tx_pending = 1;
+}
+
+/* There is nothing to reset which the other users of the interface
+   would not notice.  */
+static void
+mnp_reset (struct nic *nic)
+{
+}
+
+static void
+mnp_disable (struct nic *nic)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  int i;
+
+  if (mnp)
+    {
+      /* Cancelling a token which is done does nothing, so hand back
+	 the frames of those first.  */
+      for (i = 0; i < MNP_RX_TOKENS; i++)
+	if (mnp_rx[i].event
+	    && (Call_Service_1 (b->check_event, mnp_rx[i].event)
+		== GRUB_EFI_SUCCESS)
+	    && mnp_rx[i].packet.rx_data)
+	  Call_Service_1 (b->signal_event,
+			  mnp_rx[i].packet.rx_data->recycle_event);
+
+      Call_Service_2 (mnp->cancel, mnp, 0);
+      Call_Service_2 (mnp->configure, mnp, 0);
+    }
+
+  for (i = 0; i < MNP_RX_TOKENS; i++)
+    if (mnp_rx[i].event)
+      {
+	Call_Service_1 (b->close_event, mnp_rx[i].event);
+	mnp_rx[i].event = 0;
+      }
+  if (mnp_tx.event)
+    {
+      Call_Service_1 (b->close_event, mnp_tx.event);
+      mnp_tx.event = 0;
+    }
+  mnp_tx_pending = 0;
+
+  if (mnp_child)
+    Call_Service_2 (mnp_binding->destroy_child, mnp_binding, mnp_child);
+  mnp_child = 0;
+  mnp = 0;
+  nic_up = 0;
+}
+
+/* Make a managed network instance on HANDLE, set MNP to it, and queue
+   the receive tokens.  */
+static int
+mnp_open (grub_efi_handle_t handle)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+  grub_efi_managed_network_config_data_t config;
+  grub_efi_managed_network_t *net;
+  int i, queued = 0;
+
+  mnp_binding = grub_efi_open_protocol (handle, &mnp_binding_guid,
+					GRUB_EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+  if (! mnp_binding)
+    return 0;
+
+  mnp_child = 0;
+  if (Call_Service_2 (mnp_binding->create_child, mnp_binding, &mnp_child)
+      != GRUB_EFI_SUCCESS)
+    {
+      mnp_child = 0;
+      return 0;
+    }
+
+  net = grub_efi_open_protocol (mnp_child, &mnp_guid,
+				GRUB_EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+  if (! net)
+    {
+      mnp_disable (0);
+      return 0;
+    }
+
+  /* Every frame type, for ARP as well as IP, and the firmware polls the
+     card in the background too.  */
+  grub_memset (&config, 0, sizeof (config));
+  config.enable_unicast_receive = 1;
+  config.enable_broadcast_receive = 1;
+  config.flush_queues_on_reset = 1;
+  if (Call_Service_2 (net->configure, net, &config) != GRUB_EFI_SUCCESS)
+    {
+      mnp_disable (0);
+      return 0;
+    }
+
+  mnp = net;
+  if (Call_Service_3 (net->get_mode_data, net, 0, &mnp_mode)
+      != GRUB_EFI_SUCCESS
+      || mnp_mode.hw_address_size != ETH_ALEN
+      || mnp_mode.media_header_size != ETH_HLEN
+      || Call_Service_5 (b->create_event, 0, 0, 0, 0, &mnp_tx.event)
+	 != GRUB_EFI_SUCCESS)
+    {
+      mnp_tx.event = 0;
+      mnp_disable (0);
+      return 0;
+    }
+
+  for (i = 0; i < MNP_RX_TOKENS; i++)
+    {
+      grub_efi_managed_network_completion_token_t *token = &mnp_rx[i];
+
+      if (Call_Service_5 (b->create_event, 0, 0, 0, 0, &token->event)
+	  != GRUB_EFI_SUCCESS)
+	{
+	  token->event = 0;
+	  continue;
+	}
+      token->status = GRUB_EFI_NOT_READY;
+      token->packet.rx_data = 0;
+      if (Call_Service_2 (net->receive, net, token) == GRUB_EFI_SUCCESS)
+	queued++;
+    }
+  mnp_rx_next = 0;
+
+  if (! queued)
+    {
+      mnp_disable (0);
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Call OPEN on the interface which GRUB was loaded from, if it has one,
+   or else on the first of the handles with the protocol GUID for which
+   it works.  */
+static int
+nic_open (grub_efi_guid_t *guid, int (*open) (grub_efi_handle_t handle))
+{
+  grub_efi_loaded_image_t *image;
+  grub_efi_handle_t *handles;
+  grub_efi_uintn_t num_handles, i;
+  int ret = 0;
+
+  image = grub_efi_get_loaded_image (grub_efi_image_handle);
+  if (image && image->device_handle && (*open) (image->device_handle))
+    return 1;
+
+  handles = grub_efi_locate_handle (GRUB_EFI_BY_PROTOCOL, guid, 0,
+				    &num_handles);
+  if (! handles)
+    return 0;
+  for (i = 0; i < num_handles && ! ret; i++)
+    ret = (*open) (handles[i]);
+  grub_free (handles);
+  return ret;
+}
+
+struct nic *
+efi_nic_probe (struct nic *nic)
+{
+  grub_efi_simple_network_mode_t *mode;
+
+  snp = 0;
+  mnp = 0;
+  if (nic_open (&mnp_binding_guid, mnp_open))
+    {
+      mode = &mnp_mode;
+      nic->reset = mnp_reset;
+      nic->poll = mnp_poll;
+      nic->transmit = mnp_transmit;
+      nic->disable = mnp_disable;
+    }
+  else if (nic_open (&simple_network_guid, snp_open))
+    {
+      mode = snp->mode;
+      nic->reset = snp_reset;
+      nic->poll = snp_poll;
+      nic->transmit = snp_transmit;
+      nic->disable = snp_disable;
+    }
+  else
+    return 0;
+
+  grub_memmove (nic->node_addr, mode->current_address, ETH_ALEN);
+  /* Jumbo frames, if the card does them and DHCP says the link does.  */
+  nic->mtu = mode->max_packet_size;
+  if (nic->mtu > ETH_MAX_FRAME_LEN - ETH_HLEN)
+    nic->mtu = ETH_MAX_FRAME_LEN - ETH_HLEN;
+  etherboot_printf ("EFI %s, addr %! ", mnp ? "MNP" : "SNP", nic->node_addr);
+
+  nic_up = 1;
+  (*nic->reset) (nic);
+  return nic;
+}
+
+/* Whether the netboot code is set up to fetch the files of the network
+   drive itself, with its own TFTP, instead of the firmware's Mtftp.  */
+int
+efi_nic_ready (void)
+{
+  return nic_up && network_ready;
+}
+
+#endif /* SUPPORT_NETBOOT */
@@ -136,18 +136,29 @@ serial_hw_fetch (void)
   return buf[0];
 }
 
-/* Put a character to a serial device.  */
+/* Write LEN characters to a serial device, with as few calls as it
+   takes.  On a timeout, BUF_SIZE says how much did get out.  */
 void
-serial_hw_put (int c)
+serial_hw_write (const char *buf, int len)
 {
   grub_efi_status_t status;
-  char ch = c;
-  grub_efi_uintn_t buf_size = sizeof (ch);
+  grub_efi_uintn_t buf_size;
 
   if (! serial_device)
     return;
 
-  status = Call_Service_3 (serial_device->write, serial_device, &buf_size, &ch);
+  while (len > 0)
+    {
+      buf_size = len;
+      status = Call_Service_3 (serial_device->write, serial_device,
+			       &buf_size, (void *) buf);
+      if (status != GRUB_EFI_SUCCESS
+	  && (status != GRUB_EFI_TIMEOUT || buf_size == 0))
+	return;
+
+      buf += buf_size;
+      len -= buf_size;
+    }
 }
 
 void
@@ -5,6 +5,7 @@
 
 #include <shared.h>
 #include <filesys.h>
+#include <bootprof.h>
 #include "pxe.h"
 
 struct tftp_info tftp_info = {
@@ -29,9 +30,85 @@ struct tftp_info tftp_info = {
  * BootpBootFile: X86PC/UNDI/pxelinux/bootx64.efi
  */
 
+/*
+ * The path is only wanted for the length of one request, so it comes
+ * from the scratch arena; the caller releases it to its own mark.
+ */
+static char *tftp_full_path(char *Filename)
+{
+	char *FullPath;
+
+	if (tftp_info.BasePath) {
+		int PathSize = 0;
+		PathSize = strlen(tftp_info.BasePath) + 2 + strlen(Filename);
+		FullPath = grub_efi_arena_alloc(PathSize);
+		if (FullPath)
+			grub_sprintf(FullPath, "%s/%s", tftp_info.BasePath,
+				     Filename);
+	} else {
+		FullPath = grub_efi_arena_alloc(strlen(Filename) + 1);
+		if (FullPath)
+			strcpy(FullPath, Filename);
+	}
+	return FullPath;
+}
+
+/*
+ * What the server said about each file asked for so far, so that every
+ * file is probed only once per boot: its size, or the TFTP error for a
+ * file that doesn't exist.  Data holds the file itself when the size
+ * had to be found by downloading it.
+ */
+struct tftp_size_cache {
+	struct tftp_size_cache *Next;
+	char *Name;
+	grub_efi_status_t Status;
+	grub_efi_uintn_t Size;
+	char *Data;
+};
+
+static struct tftp_size_cache *tftp_size_cache;
+
+static struct tftp_size_cache *tftp_size_lookup(char *Filename)
+{
+	struct tftp_size_cache *Entry;
+
+	for (Entry = tftp_size_cache; Entry; Entry = Entry->Next)
+		if (!strcmp(Entry->Name, Filename))
+			return Entry;
+	return NULL;
+}
+
+static void tftp_size_remember(char *Filename, grub_efi_status_t Status,
+			       grub_efi_uintn_t Size, char *Data)
+{
+	struct tftp_size_cache *Entry = grub_malloc(sizeof (*Entry));
+
+	if (Entry)
+		Entry->Name = grub_malloc(strlen(Filename) + 1);
+	if (!Entry || !Entry->Name) {
+		grub_free(Entry);
+		grub_free(Data);
+		return;
+	}
+	strcpy(Entry->Name, Filename);
+	Entry->Status = Status;
+	Entry->Size = Size;
+	Entry->Data = Data;
+	Entry->Next = tftp_size_cache;
+	tftp_size_cache = Entry;
+}
+
+/*
+ * Some firmware can't tell the size of a file and asks for more buffer
+ * space instead, so download the file into bigger and bigger buffers
+ * until it fits.  The last buffer is handed back in *Data, so that the
+ * file needn't be downloaded once more when it is read.
+ */
 static grub_efi_status_t tftp_get_file_size_defective_buffer_fallback(
 	char *Filename,
-	grub_efi_uintn_t *Size)
+	grub_efi_uintn_t *Size,
+	char **Data)
 {
 	EFI_PXE_BASE_CODE_TFTP_OPCODE OpCode = EFI_PXE_BASE_CODE_TFTP_READ_FILE;
 	char *Buffer = NULL;
@@ -40,7 +117,11 @@ static grub_efi_status_t tftp_get_file_size_defective_buffer_fallback(
 	grub_efi_uint64_t BufferSize = 4096;
 	grub_efi_uintn_t BlockSize = 512;
 	grub_efi_status_t rc = GRUB_EFI_BUFFER_TOO_SMALL;
-	char *FullPath = NULL;
+	grub_efi_uintn_t Mark = grub_efi_arena_mark();
+	char *FullPath = tftp_full_path(Filename);
+
+	if (!FullPath)
+		return GRUB_EFI_OUT_OF_RESOURCES;
 
 	while (rc == GRUB_EFI_BUFFER_TOO_SMALL) {
 		char *NewBuffer;
@@ -51,30 +132,24 @@ static grub_efi_status_t tftp_get_file_size_defective_buffer_fallback(
 		}
 		BufferSize *= 2;
 		NewBuffer = grub_malloc(BufferSize);
-		if (!NewBuffer)
-			return GRUB_EFI_OUT_OF_RESOURCES;
-		Buffer = NewBuffer;
-
-		if (tftp_info.BasePath) {
-			int PathSize = 0;
-			PathSize = strlen(tftp_info.BasePath) + 2 +
-				   strlen(Filename);
-			FullPath = grub_malloc(PathSize);
-			grub_sprintf(FullPath, "%s/%s", tftp_info.BasePath,
-				     Filename);
-		} else {
-			FullPath = grub_malloc(strlen(Filename));
-			strcpy(FullPath, Filename);
+		if (!NewBuffer) {
+			rc = GRUB_EFI_OUT_OF_RESOURCES;
+			break;
 		}
+		Buffer = NewBuffer;
 
 		rc = Call_Service_10(tftp_info.Pxe->Mtftp, tftp_info.Pxe,
 			OpCode, Buffer, Overwrite, &BufferSize, &BlockSize,
-			tftp_info.ServerIp, FullPath, NULL, DontUseBuffer);
+			tftp_info.ServerIp, (grub_efi_uint8_t *) FullPath,
+			NULL, DontUseBuffer);
 		if (rc == GRUB_EFI_SUCCESS || rc == GRUB_EFI_BUFFER_TOO_SMALL)
 			*Size = BufferSize;
 	}
-	grub_free(FullPath);
-	grub_free(Buffer);
+	grub_efi_arena_release(Mark);
+	if (rc == GRUB_EFI_SUCCESS)
+		*Data = Buffer;
+	else
+		grub_free(Buffer);
 	return rc;
 }
 
@@ -90,28 +165,173 @@ grub_efi_status_t tftp_get_file_size(
 	grub_efi_uintn_t BlockSize = 512;
 	grub_efi_status_t rc;
 	char *FullPath = NULL;
+	char *Data = NULL;
+	struct tftp_size_cache *Entry;
+	grub_efi_uintn_t Mark;
 
-	if (tftp_info.BasePath) {
-		int PathSize = 0;
-		PathSize = strlen(tftp_info.BasePath) + 2 + strlen(Filename);
-		FullPath = grub_malloc(PathSize);
-		grub_sprintf(FullPath, "%s/%s", tftp_info.BasePath, Filename);
-	} else {
-		FullPath = grub_malloc(strlen(Filename));
-		strcpy(FullPath, Filename);
+	Entry = tftp_size_lookup(Filename);
+	if (Entry) {
+		if (Entry->Status == GRUB_EFI_SUCCESS)
+			*Size = Entry->Size;
+		return Entry->Status;
 	}
 
+	Mark = grub_efi_arena_mark();
+	FullPath = tftp_full_path(Filename);
+	if (!FullPath)
+		return GRUB_EFI_OUT_OF_RESOURCES;
+
 	rc = Call_Service_10(tftp_info.Pxe->Mtftp, tftp_info.Pxe, OpCode,
 		Buffer, Overwrite, &BufferSize, &BlockSize, tftp_info.ServerIp,
-		FullPath, NULL, DontUseBuffer);
-	if (rc == GRUB_EFI_BUFFER_TOO_SMALL)
-		rc = tftp_get_file_size_defective_buffer_fallback(Filename, Size);
-	if (rc == GRUB_EFI_SUCCESS)
+		(grub_efi_uint8_t *) FullPath, NULL, DontUseBuffer);
+	grub_efi_arena_release(Mark);
+	if (rc == GRUB_EFI_BUFFER_TOO_SMALL) {
+		rc = tftp_get_file_size_defective_buffer_fallback(Filename,
+								  Size, &Data);
+	} else if (rc == GRUB_EFI_SUCCESS) {
 		*Size = BufferSize;
-	grub_free(FullPath);
+	}
+
+	/*
+	 * Timeouts and the like may go away, but an error from the server
+	 * means that the file isn't there.
+	 */
+	if (rc == GRUB_EFI_SUCCESS || rc == GRUB_EFI_TFTP_ERROR)
+		tftp_size_remember(Filename, rc,
+				   rc == GRUB_EFI_SUCCESS ? *Size : 0, Data);
 	return rc;
 }
 
+/*
+ * Files that are fetched over multicast TFTP, each through its own group,
+ * so that the machines which boot at the same time share one transfer.
+ */
+struct tftp_mcast {
+	struct tftp_mcast *Next;
+	char *Name;
+	EFI_PXE_BASE_CODE_MTFTP_INFO Info;
+};
+
+static struct tftp_mcast *tftp_mcast_list;
+
+/* How long to listen for a transfer that is already running, and how
+ * long to wait for a packet before asking again, in seconds. */
+#define TFTP_MCAST_LISTEN	2
+#define TFTP_MCAST_TRANSMIT	4
+
+static struct tftp_mcast *tftp_mcast_lookup(char *Filename)
+{
+	struct tftp_mcast *Entry;
+
+	for (Entry = tftp_mcast_list; Entry; Entry = Entry->Next)
+		if (!strcmp(Entry->Name, Filename))
+			return Entry;
+	return NULL;
+}
+
+static int tftp_mcast_parse_ip(char **Arg, EFI_IP_ADDRESS *Ip)
+{
+	char *Ptr = *Arg;
+	int Value;
+	int i;
+
+	memset(Ip, '\0', sizeof (*Ip));
+	for (i = 0; i < 4; i++) {
+		if (i > 0 && *Ptr++ != '.')
+			return 0;
+		if (!safe_parse_maxint(&Ptr, &Value) || Value > 255)
+			return 0;
+		Ip->v4.Addr[i] = Value;
+	}
+	/* Only 224.0.0.0/4 is multicast. */
+	if ((Ip->v4.Addr[0] & 0xf0) != 0xe0)
+		return 0;
+	*Arg = Ptr;
+	return 1;
+}
+
+static int tftp_mcast_parse_port(char **Arg, EFI_PXE_BASE_CODE_UDP_PORT *Port)
+{
+	int Value;
+
+	if (!safe_parse_maxint(Arg, &Value) || Value <= 0 || Value > 0xffff)
+		return 0;
+	*Port = Value;
+	return 1;
+}
+
+/*
+ * The mtftp command: "[--listen=SECS] FILE ADDR CPORT SPORT" sets up FILE
+ * to be fetched through the group ADDR, and no arguments list the files
+ * that are.
+ */
+int
+efi_tftp_mcast (char *arg)
+{
+	struct tftp_mcast *Entry;
+	EFI_PXE_BASE_CODE_MTFTP_INFO Info;
+	int Listen = TFTP_MCAST_LISTEN;
+	char *Name;
+	int len;
+
+	if (!*arg) {
+		for (Entry = tftp_mcast_list; Entry; Entry = Entry->Next)
+			grub_printf("%s: %d.%d.%d.%d, ports %d and %d\n",
+				    Entry->Name,
+				    Entry->Info.MCastIp.v4.Addr[0],
+				    Entry->Info.MCastIp.v4.Addr[1],
+				    Entry->Info.MCastIp.v4.Addr[2],
+				    Entry->Info.MCastIp.v4.Addr[3],
+				    Entry->Info.CPort, Entry->Info.SPort);
+		return 1;
+	}
+
+	if (!grub_memcmp(arg, "--listen=", sizeof ("--listen=") - 1)) {
+		char *Ptr = arg + sizeof ("--listen=") - 1;
+
+		if (!safe_parse_maxint(&Ptr, &Listen) || Listen > 0xffff)
+			return 0;
+		arg = skip_to(0, arg);
+	}
+
+	/* The files of the network drive are named without the drive. */
+	Name = arg;
+	if (!grub_memcmp(Name, "(nd)", 4))
+		Name += 4;
+	for (len = 0; Name[len] && Name[len] != ' ' && Name[len] != '\t';
+	     len++)
+		;
+	if (!len)
+		return 0;
+
+	arg = skip_to(0, arg);
+	if (!tftp_mcast_parse_ip(&arg, &Info.MCastIp))
+		return 0;
+	arg = skip_to(0, arg);
+	if (!tftp_mcast_parse_port(&arg, &Info.CPort))
+		return 0;
+	arg = skip_to(0, arg);
+	if (!tftp_mcast_parse_port(&arg, &Info.SPort))
+		return 0;
+	Info.ListenTimeout = Listen;
+	Info.TransmitTimeout = TFTP_MCAST_TRANSMIT;
+
+	Entry = grub_malloc(sizeof (*Entry));
+	if (Entry)
+		Entry->Name = grub_malloc(len + 1);
+	if (!Entry || !Entry->Name) {
+		grub_free(Entry);
+		errnum = ERR_WONT_FIT;
+		return 0;
+	}
+	grub_memmove(Entry->Name, Name, len);
+	Entry->Name[len] = '\0';
+	Entry->Info = Info;
+	Entry->Next = tftp_mcast_list;
+	tftp_mcast_list = Entry;
+	return 1;
+}
+
 static grub_efi_status_t tftp_read_file(
 	char *Filename,
 	char *Buffer,
@@ -123,21 +343,68 @@ static grub_efi_status_t tftp_read_file(
 	grub_efi_uintn_t BlockSize = 512;
 	grub_efi_status_t rc;
 	char *FullPath = NULL;
+	struct tftp_size_cache *Entry;
+	struct tftp_mcast *Mcast;
+	grub_efi_uintn_t Mark;
 
-	if (tftp_info.BasePath) {
-		int PathSize = 0;
-		PathSize = strlen(tftp_info.BasePath) + 2 + strlen(Filename);
-		FullPath = grub_malloc(PathSize);
-		grub_sprintf(FullPath, "%s/%s", tftp_info.BasePath, Filename);
-	} else {
-		FullPath = grub_malloc(strlen(Filename));
-		strcpy(FullPath, Filename);
+	/* The size probe may have left the whole file behind. */
+	Entry = tftp_size_lookup(Filename);
+	if (Entry && Entry->Data && BufferSize <= Entry->Size) {
+		grub_memmove(Buffer, Entry->Data, BufferSize);
+		return GRUB_EFI_SUCCESS;
+	}
+
+	Mark = grub_efi_arena_mark();
+	FullPath = tftp_full_path(Filename);
+	if (!FullPath)
+		return GRUB_EFI_OUT_OF_RESOURCES;
+
+	/*
+	 * The firmware tells neither the packets nor the retransmits, nor
+	 * the window size, only the block size it settled on.
+	 */
+	tftp_stat_begin(Filename);
+
+	/*
+	 * A multicast transfer can only deliver the whole file, so the head
+	 * of one is still read over unicast.  If the multicast transfer
+	 * doesn't complete, the file is fetched over unicast too.
+	 */
+	Mcast = tftp_mcast_lookup(Filename);
+	if (Mcast && Entry && BufferSize == Entry->Size) {
+		grub_efi_uint64_t Size = BufferSize;
+
+		rc = Call_Service_10(tftp_info.Pxe->Mtftp, tftp_info.Pxe,
+			EFI_PXE_BASE_CODE_MTFTP_READ_FILE, Buffer, Overwrite,
+			&Size, &BlockSize, tftp_info.ServerIp,
+			(grub_efi_uint8_t *) FullPath, &Mcast->Info,
+			DontUseBuffer);
+		if (rc == GRUB_EFI_SUCCESS && Size == BufferSize) {
+			grub_efi_arena_release(Mark);
+			tftp_stat.blksize = BlockSize;
+			tftp_stat.bytes = Size;
+			tftp_stat_end();
+			return rc;
+		}
+		grub_printf("Multicast TFTP of %s failed, using unicast\n",
+			    Filename);
+		if (rc == GRUB_EFI_TIMEOUT)
+			tftp_stat.timeouts++;
+		tftp_stat.retransmits++;
+		BlockSize = 512;
 	}
 
 	rc = Call_Service_10(tftp_info.Pxe->Mtftp, tftp_info.Pxe, OpCode,
 		Buffer, Overwrite, &BufferSize, &BlockSize, tftp_info.ServerIp,
-		FullPath, NULL, DontUseBuffer);
-	grub_free(FullPath);
+		(grub_efi_uint8_t *) FullPath, NULL, DontUseBuffer);
+	grub_efi_arena_release(Mark);
+	if (rc == GRUB_EFI_TIMEOUT)
+		tftp_stat.timeouts++;
+	if (rc == GRUB_EFI_SUCCESS) {
+		tftp_stat.blksize = BlockSize;
+		tftp_stat.bytes = BufferSize;
+		tftp_stat_end();
+	}
 	return rc;
 }
 
@@ -147,6 +414,47 @@ efi_tftp_mount (void)
 	if (current_drive != NETWORK_DRIVE) {
 		return 0;
 	}
+#ifdef SUPPORT_NETBOOT
+	/*
+	 * Once dhcp, bootp or ifconfig has set up GRUB's own network code,
+	 * the files come through it, with its TFTP and HTTP.
+	 */
+	if (efi_nic_ready())
+		return 0;
+#endif
+	return 1;
+}
+
+/*
+ * Reads of the start of a file are served from this buffer, so that
+ * peeking at a header (as grub_open does to look for gzip magic) doesn't
+ * need the whole file.
+ */
+#define TFTP_HEAD_MAX	8192
+static char tftp_head[TFTP_HEAD_MAX];
+static int tftp_head_len;
+
+static int
+tftp_read_head (int len)
+{
+	grub_efi_status_t rc;
+
+	/* MTFTP only stores blocks that fit in the buffer as a whole. */
+	len = (len + 511) & ~511;
+	if (len > TFTP_HEAD_MAX)
+		len = TFTP_HEAD_MAX;
+	if (len > filemax)
+		len = filemax;
+
+	/*
+	 * The firmware fills the buffer with the blocks that fit and then
+	 * gives up on the rest of the file with BUFFER_TOO_SMALL.
+	 */
+	rc = tftp_read_file(tftp_info.LastPath, tftp_head, len);
+	if (rc != GRUB_EFI_SUCCESS && rc != GRUB_EFI_BUFFER_TOO_SMALL)
+		return 0;
+
+	tftp_head_len = len;
 	return 1;
 }
 
@@ -159,17 +467,53 @@ efi_tftp_read (char *addr, int size)
 		grub_printf(" = 0 (no path known)\n");
 		return 0;
 	}
-	if (tftp_info.Buffer == NULL) {
-		grub_printf(" = 0 (no file open)\n");
-		return 0;
-	}
 	if (filemax == -1) {
 		grub_printf(" = 0 (file not found)\n");
 		return 0;
 	}
-	if (filepos == 0) {
+
+	if (tftp_info.Buffer == NULL) {
+		/*
+		 * Nothing but the head of the file has been fetched yet.  A
+		 * read of the whole file goes straight into the caller's
+		 * buffer, so that a kernel or initrd is downloaded once, into
+		 * the place where it is loaded.
+		 */
+		if (filepos == 0 && size == filemax) {
+			rc = tftp_read_file(tftp_info.LastPath, addr, filemax);
+			if (rc != GRUB_EFI_SUCCESS) {
+				errnum = ERR_READ;
+				return 0;
+			}
+			filepos += size;
+			return size;
+		}
+
+		if (filepos + size <= TFTP_HEAD_MAX) {
+			if (filepos + size > tftp_head_len
+			    && !tftp_read_head(filepos + size)) {
+				errnum = ERR_READ;
+				return 0;
+			}
+			grub_memmove(addr, tftp_head + filepos, size);
+			filepos += size;
+			return size;
+		}
+
+		/* Anything else needs the whole file in a buffer. */
+		tftp_info.Buffer = grub_malloc(filemax);
+		if (tftp_info.Buffer == NULL) {
+			errnum = ERR_WONT_FIT;
+			return 0;
+		}
 		rc = tftp_read_file(tftp_info.LastPath, tftp_info.Buffer,
 				    filemax);
+		if (rc != GRUB_EFI_SUCCESS) {
+			grub_free(tftp_info.Buffer);
+			tftp_info.Buffer = NULL;
+			errnum = ERR_READ;
+			return 0;
+		}
 	}
 
 	grub_memmove(addr, tftp_info.Buffer+filepos, size);
@@ -191,6 +535,11 @@ efi_tftp_dir (char *dirname)
 	len = strlen(dirname);
 
 	name = grub_malloc(len + 1);
+	if (!name) {
+		dirname[len] = ch;
+		errnum = ERR_WONT_FIT;
+		return 0;
+	}
 	grub_memmove(name, dirname, len);
 	name[len] = '\0';
 	dirname[len] = ch;
@@ -202,17 +551,22 @@ efi_tftp_dir (char *dirname)
 
 	filemax = -1;
 
+	/* What the last file left behind, if it wasn't closed. */
+	grub_free(tftp_info.LastPath);
+	tftp_info.LastPath = NULL;
+	grub_free(tftp_info.Buffer);
+	tftp_info.Buffer = NULL;
+	tftp_head_len = 0;
+
 	rc = tftp_get_file_size(name, &size);
 	if (rc == GRUB_EFI_SUCCESS) {
-		tftp_info.LastPath = grub_malloc(strlen(name) + 1);
-		sprintf(tftp_info.LastPath, "%s", name);
+		/* The file is fetched when it is read. */
+		tftp_info.LastPath = name;
 		filemax = size;
 		filepos = 0;
-
-		tftp_info.Buffer = grub_malloc(filemax);
-
 		return 1;
 	}
+	grub_free(name);
 	return 0;
 }
 
@@ -226,3 +580,15 @@ efi_tftp_close (void)
 	grub_free(tftp_info.Buffer);
 	tftp_info.Buffer = NULL;
 }
+
+/* The server which the files come from, for the cache of them. */
+unsigned long long
+efi_tftp_server_id (void)
+{
+	if (!tftp_info.ServerIp)
+		return 0;
+	return ((unsigned long) tftp_info.ServerIp->v4.Addr[0] << 24
+		| tftp_info.ServerIp->v4.Addr[1] << 16
+		| tftp_info.ServerIp->v4.Addr[2] << 8
+		| tftp_info.ServerIp->v4.Addr[3]);
+}
@@ -0,0 +1,147 @@
+/* efitrace.c - count and time the calls of the firmware services */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <config.h>
+#include <grub/misc.h>
+#include <grub/efi/api.h>
+#include <grub/efi/efi.h>
+#include <grub/efi/eficall.h>
+
+#include <shared.h>
+#include <bootprof.h>
+
+#ifdef EFI_CALL_TRACE
+
+/* The services are told apart by the address of the function, and
+   named after the expression of the first call.  */
+#define TRACE_SERVICES	64
+
+/* The time of a call falls in the bucket of the highest bit set in the
+   number of cycles, from TRACE_MIN_BIT on.  */
+#define TRACE_MIN_BIT	10
+#define TRACE_BUCKETS	24
+
+struct trace_service
+{
+  void *func;
+  const char *name;
+  unsigned long calls;
+  unsigned long long cycles;
+  unsigned long long max;
+  unsigned long hist[TRACE_BUCKETS];
+};
+
+static struct trace_service trace_services[TRACE_SERVICES];
+static int trace_count;
+static unsigned long trace_dropped;
+
+unsigned long long
+grub_efi_trace_begin (void)
+{
+  return bootprof_now ();
+}
+
+void
+grub_efi_trace_end (void *func, const char *name, unsigned long long start)
+{
+  unsigned long long time = bootprof_now () - start;
+  struct trace_service *s;
+  int i, bit;
+
+  for (i = 0; i < trace_count; i++)
+    if (trace_services[i].func == func)
+      break;
+
+  if (i == trace_count)
+    {
+      if (trace_count == TRACE_SERVICES)
+	{
+	  trace_dropped++;
+	  return;
+	}
+      trace_count++;
+      trace_services[i].func = func;
+      trace_services[i].name = name;
+    }
+
+  s = &trace_services[i];
+  s->calls++;
+  s->cycles += time;
+  if (time > s->max)
+    s->max = time;
+
+  for (bit = TRACE_MIN_BIT; bit < TRACE_MIN_BIT + TRACE_BUCKETS - 1; bit++)
+    if (time < (2ULL << bit))
+      break;
+  s->hist[bit - TRACE_MIN_BIT]++;
+}
+
+void
+grub_efi_trace_reset (void)
+{
+  grub_memset (trace_services, 0, sizeof (trace_services));
+  trace_count = 0;
+  trace_dropped = 0;
+}
+
+/* Print the services which took the longest in all first, each with
+   the number of calls in every bucket of time.  */
+void
+grub_efi_trace_print (void)
+{
+  unsigned long long per_us = bootprof_cycles_per_ms () / 1000;
+  /* Printing calls the firmware too, so keep to what there was.  */
+  int count = trace_count;
+  char done[TRACE_SERVICES];
+  int i, j;
+
+  if (! count || ! per_us)
+    {
+      grub_printf ("No firmware call has been recorded.\n");
+      return;
+    }
+
+  grub_memset (done, 0, sizeof (done));
+  for (i = 0; i < count; i++)
+    {
+      struct trace_service *s = 0;
+
+      for (j = 0; j < count; j++)
+	if (! done[j] && (! s || trace_services[j].cycles > s->cycles))
+	  s = &trace_services[j];
+      done[s - trace_services] = 1;
+
+      grub_printf ("%s: %lu calls, %llu us, %llu us at most\n",
+		   s->name, s->calls, s->cycles / per_us, s->max / per_us);
+      for (j = 0; j < TRACE_BUCKETS - 1; j++)
+	if (s->hist[j])
+	  grub_printf ("  < %llu us: %lu\n",
+		       ((2ULL << (j + TRACE_MIN_BIT)) + per_us - 1) / per_us,
+		       s->hist[j]);
+      if (s->hist[j])
+	grub_printf ("  longer: %lu\n", s->hist[j]);
+    }
+
+  if (trace_dropped)
+    grub_printf ("%lu calls of more services were not counted.\n",
+		 trace_dropped);
+}
+
+#endif /* EFI_CALL_TRACE */
@@ -0,0 +1,498 @@
+/* efiunzip.c - the stub of grubz.efi, which inflates grub.efi */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301, USA.
+ */
+
+/* grubz.efi is this stub with grub.efi after it, compressed with gzip
+   (see grubz.S).  The firmware, from a disk or over TFTP, only has to
+   read the compressed bytes; the stub inflates them in memory and has
+   the firmware load grub.efi from there, on the device and with the
+   path of grubz.efi, so that it finds its config file as if it had been
+   loaded itself.
+
+   Nothing of GRUB is linked in but the calls into the firmware, so the
+   inflater is a small one of its own, which decodes the Huffman codes
+   a bit at a time.  That is slow next to stage2/gunzip.c, but takes
+   no time next to reading the bytes it saves.  */
+
+#include <grub/efi/api.h>
+
+/* The compressed grub.efi, from grubz.S.  */
+extern unsigned char grubz_start[], grubz_end[];
+
+#define MAXBITS		15	/* The longest code.  */
+#define MAXLCODES	286	/* Literal/length codes.  */
+#define MAXDCODES	30	/* Distance codes.  */
+#define MAXCODES	(MAXLCODES + MAXDCODES)
+#define FIXLCODES	288	/* Literal/length codes of the fixed table.  */
+
+struct inflate
+{
+  const unsigned char *in;
+  unsigned long inlen;
+  unsigned long incnt;
+  unsigned char *out;
+  unsigned long outlen;
+  unsigned long outcnt;
+  unsigned long bitbuf;
+  int bitcnt;
+  /* Set when the input ran out.  */
+  int err;
+};
+
+/* A canonical Huffman code: how many codes there are of each length,
+   and the symbols in the order of their codes.  */
+struct huffman
+{
+  short *count;
+  short *symbol;
+};
+
+static int
+bits (struct inflate *s, int need)
+{
+  unsigned long val = s->bitbuf;
+
+  while (s->bitcnt < need)
+    {
+      if (s->incnt == s->inlen)
+	{
+	  s->err = 1;
+	  return 0;
+	}
+      val |= (unsigned long) s->in[s->incnt++] << s->bitcnt;
+      s->bitcnt += 8;
+    }
+
+  s->bitbuf = val >> need;
+  s->bitcnt -= need;
+  return val & ((1UL << need) - 1);
+}
+
+static int
+stored (struct inflate *s)
+{
+  unsigned int len;
+
+  /* The length starts at the next byte.  */
+  s->bitbuf = 0;
+  s->bitcnt = 0;
+
+  if (s->incnt + 4 > s->inlen)
+    return -1;
+  len = s->in[s->incnt] | (s->in[s->incnt + 1] << 8);
+  if (s->in[s->incnt + 2] != (~len & 0xff)
+      || s->in[s->incnt + 3] != ((~len >> 8) & 0xff))
+    return -1;
+  s->incnt += 4;
+
+  if (s->incnt + len > s->inlen || s->outcnt + len > s->outlen)
+    return -1;
+  while (len--)
+    s->out[s->outcnt++] = s->in[s->incnt++];
+
+  return 0;
+}
+
+static int
+decode (struct inflate *s, struct huffman *h)
+{
+  int code = 0, first = 0, index = 0;
+  int len;
+
+  for (len = 1; len <= MAXBITS; len++)
+    {
+      code |= bits (s, 1);
+      if (s->err)
+	return -1;
+      if (code - h->count[len] < first)
+	return h->symbol[index + (code - first)];
+      index += h->count[len];
+      first = (first + h->count[len]) << 1;
+      code <<= 1;
+    }
+
+  return -1;
+}
+
+/* Build H from the code lengths LENGTH of N symbols.  Return 0 for a
+   complete code, more than zero for an incomplete one, and less than
+   zero for one with too many codes of a length.  */
+static int
+construct (struct huffman *h, short *length, int n)
+{
+  short offs[MAXBITS + 1];
+  int symbol, len, left;
+
+  for (len = 0; len <= MAXBITS; len++)
+    h->count[len] = 0;
+  for (symbol = 0; symbol < n; symbol++)
+    h->count[length[symbol]]++;
+  if (h->count[0] == n)
+    return 0;
+
+  left = 1;
+  for (len = 1; len <= MAXBITS; len++)
+    {
+      left <<= 1;
+      left -= h->count[len];
+      if (left < 0)
+	return left;
+    }
+
+  offs[1] = 0;
+  for (len = 1; len < MAXBITS; len++)
+    offs[len + 1] = offs[len] + h->count[len];
+  for (symbol = 0; symbol < n; symbol++)
+    if (length[symbol])
+      h->symbol[offs[length[symbol]]++] = symbol;
+
+  return left;
+}
+
+static int
+codes (struct inflate *s, struct huffman *lencode, struct huffman *distcode)
+{
+  static const short lbase[29] =
+    {
+      3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+  static const short lext[29] =
+    {
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+      3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+  static const short dbase[30] =
+    {
+      1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+      257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+      8193, 12289, 16385, 24577
+    };
+  static const short dext[30] =
+    {
+      0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+      7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+  int symbol;
+  unsigned long len, dist;
+
+  for (;;)
+    {
+      symbol = decode (s, lencode);
+      if (symbol < 0)
+	return -1;
+      if (symbol == 256)
+	return 0;
+
+      if (symbol < 256)
+	{
+	  if (s->outcnt == s->outlen)
+	    return -1;
+	  s->out[s->outcnt++] = symbol;
+	  continue;
+	}
+
+      symbol -= 257;
+      if (symbol >= 29)
+	return -1;
+      len = lbase[symbol] + bits (s, lext[symbol]);
+
+      symbol = decode (s, distcode);
+      if (symbol < 0 || symbol >= 30)
+	return -1;
+      dist = dbase[symbol] + bits (s, dext[symbol]);
+      if (s->err || dist > s->outcnt || s->outcnt + len > s->outlen)
+	return -1;
+
+      while (len--)
+	{
+	  s->out[s->outcnt] = s->out[s->outcnt - dist];
+	  s->outcnt++;
+	}
+    }
+}
+
+static int
+fixed (struct inflate *s)
+{
+  static short lencnt[MAXBITS + 1], lensym[FIXLCODES];
+  static short distcnt[MAXBITS + 1], distsym[MAXDCODES];
+  struct huffman lencode = { lencnt, lensym };
+  struct huffman distcode = { distcnt, distsym };
+  short lengths[FIXLCODES];
+  int symbol;
+
+  for (symbol = 0; symbol < 144; symbol++)
+    lengths[symbol] = 8;
+  for (; symbol < 256; symbol++)
+    lengths[symbol] = 9;
+  for (; symbol < 280; symbol++)
+    lengths[symbol] = 7;
+  for (; symbol < FIXLCODES; symbol++)
+    lengths[symbol] = 8;
+  construct (&lencode, lengths, FIXLCODES);
+
+  for (symbol = 0; symbol < MAXDCODES; symbol++)
+    lengths[symbol] = 5;
+  construct (&distcode, lengths, MAXDCODES);
+
+  return codes (s, &lencode, &distcode);
+}
+
+static int
+dynamic (struct inflate *s)
+{
+  static const short order[19] =
+    { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  short lengths[MAXCODES];
+  short lencnt[MAXBITS + 1], lensym[MAXLCODES];
+  short distcnt[MAXBITS + 1], distsym[MAXDCODES];
+  struct huffman lencode = { lencnt, lensym };
+  struct huffman distcode = { distcnt, distsym };
+  int nlen, ndist, ncode, index, err;
+
+  nlen = bits (s, 5) + 257;
+  ndist = bits (s, 5) + 1;
+  ncode = bits (s, 4) + 4;
+  if (s->err || nlen > MAXLCODES || ndist > MAXDCODES)
+    return -1;
+
+  for (index = 0; index < ncode; index++)
+    lengths[order[index]] = bits (s, 3);
+  for (; index < 19; index++)
+    lengths[order[index]] = 0;
+  if (s->err || construct (&lencode, lengths, 19) != 0)
+    return -1;
+
+  index = 0;
+  while (index < nlen + ndist)
+    {
+      int symbol, len = 0, repeat;
+
+      symbol = decode (s, &lencode);
+      if (symbol < 0)
+	return -1;
+      if (symbol < 16)
+	{
+	  lengths[index++] = symbol;
+	  continue;
+	}
+
+      if (symbol == 16)
+	{
+	  if (index == 0)
+	    return -1;
+	  len = lengths[index - 1];
+	  repeat = 3 + bits (s, 2);
+	}
+      else if (symbol == 17)
+	repeat = 3 + bits (s, 3);
+      else
+	repeat = 11 + bits (s, 7);
+
+      if (s->err || index + repeat > nlen + ndist)
+	return -1;
+      while (repeat--)
+	lengths[index++] = len;
+    }
+
+  /* There must be a code for the end of the block.  */
+  if (lengths[256] == 0)
+    return -1;
+
+  /* Only a code of a single symbol may be incomplete.  */
+  err = construct (&lencode, lengths, nlen);
+  if (err < 0 || (err > 0 && nlen - lencode.count[0] != 1))
+    return -1;
+  err = construct (&distcode, lengths + nlen, ndist);
+  if (err < 0 || (err > 0 && ndist - distcode.count[0] != 1))
+    return -1;
+
+  return codes (s, &lencode, &distcode);
+}
+
+/* Inflate the deflate stream of S.  Return 0, or -1 if it is
+   corrupt.  */
+static int
+inflate (struct inflate *s)
+{
+  int last, type, err;
+
+  do
+    {
+      last = bits (s, 1);
+      type = bits (s, 2);
+      if (s->err)
+	return -1;
+
+      if (type == 0)
+	err = stored (s);
+      else if (type == 1)
+	err = fixed (s);
+      else if (type == 2)
+	err = dynamic (s);
+      else
+	err = -1;
+      if (err)
+	return -1;
+    }
+  while (! last);
+
+  return 0;
+}
+
+static grub_efi_uint32_t
+crc32 (const unsigned char *buf, unsigned long len)
+{
+  grub_efi_uint32_t crc = 0xffffffff;
+  int k;
+
+  while (len--)
+    {
+      crc ^= *buf++;
+      for (k = 0; k < 8; k++)
+	crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+
+  return ~crc;
+}
+
+static grub_efi_uint32_t
+get_le32 (const unsigned char *p)
+{
+  return (p[0] | (p[1] << 8) | (p[2] << 16)
+	  | ((grub_efi_uint32_t) p[3] << 24));
+}
+
+/* Inflate the gzip file of LEN bytes at GZ into OUT, which has room for
+   OUTLEN bytes, as many as the file says it has.  Return 0, or -1 if it
+   is corrupt.  */
+static int
+gunzip (const unsigned char *gz, unsigned long len, unsigned char *out,
+	unsigned long outlen)
+{
+  struct inflate s;
+  int flags;
+
+  if (len < 18 || gz[0] != 0x1f || gz[1] != 0x8b || gz[2] != 8)
+    return -1;
+
+  flags = gz[3];
+  s.in = gz;
+  s.inlen = len - 8;
+  s.incnt = 10;
+
+  /* Skip the extra field, the name, the comment and the header CRC.  */
+  if (flags & 4)
+    s.incnt += 2 + (gz[10] | (gz[11] << 8));
+  if (flags & 8)
+    while (s.incnt < s.inlen && gz[s.incnt++])
+      ;
+  if (flags & 16)
+    while (s.incnt < s.inlen && gz[s.incnt++])
+      ;
+  if (flags & 2)
+    s.incnt += 2;
+  if (s.incnt >= s.inlen)
+    return -1;
+
+  s.out = out;
+  s.outlen = outlen;
+  s.outcnt = 0;
+  s.bitbuf = 0;
+  s.bitcnt = 0;
+  s.err = 0;
+
+  if (inflate (&s) || s.outcnt != outlen
+      || crc32 (out, outlen) != get_le32 (gz + len - 8))
+    return -1;
+
+  return 0;
+}
+
+static void
+fail (grub_efi_system_table_t *sys_tab, grub_efi_char16_t *msg)
+{
+  grub_efi_simple_text_output_interface_t *o = sys_tab->con_out;
+
+  Call_Service_2 (o->output_string, o, msg);
+}
+
+grub_efi_status_t
+efi_main (grub_efi_handle_t image_handle, grub_efi_system_table_t *sys_tab)
+{
+  grub_efi_boot_services_t *b = sys_tab->boot_services;
+  grub_efi_guid_t loaded_image_guid = GRUB_EFI_LOADED_IMAGE_GUID;
+  grub_efi_loaded_image_t *self, *image;
+  grub_efi_handle_t grub_handle;
+  grub_efi_status_t status;
+  unsigned long len = grubz_end - grubz_start;
+  unsigned long size;
+  void *buf;
+
+  if (len < 18)
+    {
+      fail (sys_tab, (grub_efi_char16_t *) L"grubz.efi: no image\r\n");
+      return GRUB_EFI_LOAD_ERROR;
+    }
+
+  size = get_le32 (grubz_end - 4);
+  status = Call_Service_3 (b->allocate_pool, GRUB_EFI_LOADER_DATA, size,
+			   &buf);
+  if (status != GRUB_EFI_SUCCESS)
+    {
+      fail (sys_tab, (grub_efi_char16_t *) L"grubz.efi: out of memory\r\n");
+      return status;
+    }
+
+  if (gunzip (grubz_start, len, buf, size))
+    {
+      Call_Service_1 (b->free_pool, buf);
+      fail (sys_tab, (grub_efi_char16_t *) L"grubz.efi: corrupt image\r\n");
+      return GRUB_EFI_LOAD_ERROR;
+    }
+
+  status = Call_Service_3 (b->handle_protocol, image_handle,
+			   &loaded_image_guid, (void **) &self);
+  if (status == GRUB_EFI_SUCCESS)
+    status = Call_Service_6 (b->load_image, 0, image_handle,
+			     self->file_path, buf, size, &grub_handle);
+
+  /* LoadImage has made its own copy of the image.  */
+  Call_Service_1 (b->free_pool, buf);
+  if (status != GRUB_EFI_SUCCESS)
+    {
+      fail (sys_tab, (grub_efi_char16_t *) L"grubz.efi: cannot load image\r\n");
+      return status;
+    }
+
+  /* As in grub_chainloader, LoadImage does not set the device handle of
+     an image loaded from memory.  GRUB looks for its config file on
+     it, next to the file it was loaded from, and takes the options.  */
+  if (Call_Service_3 (b->handle_protocol, grub_handle, &loaded_image_guid,
+		      (void **) &image) == GRUB_EFI_SUCCESS)
+    {
+      image->device_handle = self->device_handle;
+      image->load_options_size = self->load_options_size;
+      image->load_options = self->load_options;
+    }
+
+  return Call_Service_3 (b->start_image, grub_handle, 0, 0);
+}
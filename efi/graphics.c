@@ -74,6 +74,17 @@ struct graphics {
     struct xpm *splashimage;
 
     unsigned short *text;
+
+    /* Row Y has changed from column dirty[2*Y] up to dirty[2*Y+1]
+       since it was last drawn.  Nothing is drawn until graphics_flush,
+       so that every blit, which may cross a slow remote console, covers
+       as much as it can.  */
+    short *dirty;
+    int pending;
+
+    /* whether the cursor is to be shown, and where it is, if x >= 0 */
+    int cursor;
+    position_t cursorpos;
 };
 
 static grub_efi_guid_t device_path_guid = GRUB_EFI_DEVICE_PATH_GUID;
@@ -221,15 +232,26 @@ graphics_alloc_text_buf(void)
             grub_free(graphics->text);
             graphics->text = NULL;
         }
+        if (graphics->dirty) {
+            grub_free(graphics->dirty);
+            graphics->dirty = NULL;
+        }
         graphics_get_screen_rowscols(&screen_size);
         graphics->text = grub_malloc(screen_size.x
                                      * screen_size.y
                                      * sizeof (graphics->text[0]));
-        if (graphics->text) {
+        graphics->dirty = grub_malloc(screen_size.y * 2
+                                      * sizeof (graphics->dirty[0]));
+        if (graphics->text && graphics->dirty) {
             int x, y;
-            for (y = 0; y < screen_size.y; y++)
+            for (y = 0; y < screen_size.y; y++) {
                 for (x = 0; x < screen_size.x; x++)
                     graphics->text[y * screen_size.x + x] = ' ';
+                graphics->dirty[2 * y] = 0;
+                graphics->dirty[2 * y + 1] = screen_size.x;
+            }
+            graphics->pending = 0;
+            graphics->cursorpos.x = -1;
             return 1;
         }
     }
@@ -333,12 +355,41 @@ graphics_get_splash_xpm(void)
     return NULL;
 }
 
+static void
+graphics_dirty(int col, int row, int width, int height)
+{
+    short *dirty;
+    position_t screensz;
+    int y;
+
+    if (!backend || !backend->graphics || !backend->graphics->dirty)
+        return;
+
+    dirty = backend->graphics->dirty;
+    graphics_get_screen_rowscols(&screensz);
+    if (col < 0 || row < 0)
+        return;
+    if (width > screensz.x - col)
+        width = screensz.x - col;
+    if (height > screensz.y - row)
+        height = screensz.y - row;
+
+    for (y = row; y < row + height; y++) {
+        if (dirty[2 * y] > col)
+            dirty[2 * y] = col;
+        if (dirty[2 * y + 1] < col + width)
+            dirty[2 * y + 1] = col + width;
+    }
+}
+
 void
 graphics_putchar(int ch)
 {
     struct graphics *graphics;
     position_t screensz;
     int offset;
+    unsigned short cell;
+    int changed;
 
     void *old_term = current_term;
 
@@ -358,6 +409,7 @@ graphics_putchar(int ch)
         } else
             graphics_scroll();
         graphics_cursor(1);
+        graphics_flush();
         return;
     } else if (ch == '\r') {
         graphics_setxy(0, graphics->fonty);
@@ -368,10 +420,14 @@ graphics_putchar(int ch)
     graphics_cursor(0);
 
     offset = graphics->fontx + graphics->fonty * screensz.x;
-    graphics->text[offset] = ch;
-    graphics->text[offset] &= 0x00ff;
+    cell = ch;
     if (graphics->current_color & 0xf0)
-        graphics->text[offset] |= 0x100;
+        cell |= 0x100;
+
+    /* Redrawing the menu on top of itself mostly puts back what is
+     * there already, which needn't be drawn again. */
+    changed = graphics->text[offset] != cell;
+    graphics->text[offset] = cell;
 
     graphics_cursor(0);
 
@@ -386,6 +442,21 @@ graphics_putchar(int ch)
     }
 
     graphics_cursor(1);
+
+    if (!changed)
+        return;
+
+    graphics_dirty(offset % screensz.x, offset / screensz.x, 1, 1);
+
+    if (++graphics->pending >= screensz.x)
+        graphics_flush();
+}
+
+void
+graphics_putstr(const char *str, int len)
+{
+    while (len--)
+        graphics_putchar(*str++);
 }
 
 void
@@ -475,13 +546,27 @@ graphics_scroll (void)
         prev = this;
         this += screensz.x;
     }
-    graphics_setxy(0, screensz.y - 1);
+    text += (screensz.y - 1) * screensz.x;
     for (i = 0; i < screensz.x; i++) {
-        graphics_putchar(' ');
-        //text[(screensz.y-1) + i] = ' ';
+        text[i] = ' ';
+        if (graphics->current_color & 0xf0)
+            text[i] |= 0x100;
     }
 
-    graphics_clbl(0, 0, screensz.x, screensz.y, 1);
+    /* Moving the picture along with the text only leaves the new row to
+       be drawn, where redrawing everything takes a visible while.  What
+       was waiting to be drawn moves up with the rest.  */
+    if (backend->scroll && backend->scroll(backend)) {
+        memmove(graphics->dirty, graphics->dirty + 2,
+                (screensz.y - 1) * 2 * sizeof (graphics->dirty[0]));
+        graphics->dirty[2 * (screensz.y - 1)] = screensz.x;
+        graphics->dirty[2 * (screensz.y - 1) + 1] = 0;
+        if (graphics->cursorpos.x >= 0 && --graphics->cursorpos.y < 0)
+            graphics->cursorpos.x = -1;
+        graphics_clbl(0, screensz.y - 1, screensz.x, 1, 1);
+    } else {
+        graphics_clbl(0, 0, screensz.x, screensz.y, 1);
+    }
     graphics_setxy(0, screensz.y - 1);
     graphics->scroll = 1;
 }
@@ -489,8 +574,15 @@ graphics_scroll (void)
 void
 graphics_cursor(int set)
 {
-    if (backend && backend->cursor)
-        backend->cursor(backend, set);
+    struct graphics *graphics;
+
+    if (!backend)
+        return;
+
+    graphics = backend->graphics;
+    if (set && !graphics->scroll)
+        return;
+    graphics->cursor = set;
 }
 
 void
@@ -530,33 +622,84 @@ graphics_cls(void)
     }
 }
 
+/* The cells are only marked here, and drawn along with their text by
+   the next graphics_flush, so DRAW_TEXT makes no difference.  */
 void
 graphics_clbl(int col, int row, int width, int height, int draw_text)
 {
-    if (backend) {
-        int x = 0, y = 0, xy;
-        unsigned short *text;
-        position_t screensz;
+    graphics_dirty(col, row, width, height);
+}
 
-        graphics_get_screen_rowscols(&screensz);
+/* Draw every cell which has changed, as few rectangles as there are
+   runs of rows which have changed in the same columns.  */
+void
+graphics_flush(void)
+{
+    struct graphics *graphics;
+    position_t screensz, pos;
+    short *dirty;
+    int y, top, offset = -1;
 
-#if 0
-        xy = graphics_getxy();
-#endif
-        if (backend->clbl) {
-            backend->clbl(backend, col, row, width, height, draw_text);
-        } else {
-            for (y = 0; y < screensz.y; y++) {
-                for (x = 0; x < screensz.x; x++) {
-                    graphics_setxy(x, y);
-                    graphics_cursor(0);
-                }
-            }
-        }
-#if 0
-        graphics_gotoxy(xy >> 8, xy & 0xf);
-#endif
+    if (!backend || !graphics_inited || !backend->graphics->dirty)
+        return;
+
+    graphics = backend->graphics;
+    dirty = graphics->dirty;
+    graphics_get_screen_rowscols(&screensz);
+
+    pos.x = -1;
+    pos.y = 0;
+    if (graphics->cursor) {
+        pos.x = graphics->fontx;
+        pos.y = graphics->fonty;
     }
+    if (pos.x != graphics->cursorpos.x || pos.y != graphics->cursorpos.y) {
+        if (graphics->cursorpos.x >= 0)
+            graphics_dirty(graphics->cursorpos.x, graphics->cursorpos.y, 1, 1);
+        if (pos.x >= 0)
+            graphics_dirty(pos.x, pos.y, 1, 1);
+        graphics->cursorpos = pos;
+    }
+    if (pos.x >= 0) {
+        offset = pos.y * screensz.x + pos.x;
+        graphics->text[offset] |= 0x0200;
+    }
+
+    for (y = 0; y < screensz.y; y = top) {
+        for (top = y + 1; top < screensz.y; top++)
+            if (dirty[2 * top] != dirty[2 * y]
+                || dirty[2 * top + 1] != dirty[2 * y + 1])
+                break;
+
+        if (dirty[2 * y] < dirty[2 * y + 1] && backend->clbl)
+            backend->clbl(backend, dirty[2 * y], y,
+                          dirty[2 * y + 1] - dirty[2 * y], top - y, 1);
+    }
+
+    for (y = 0; y < screensz.y; y++) {
+        dirty[2 * y] = screensz.x;
+        dirty[2 * y + 1] = 0;
+    }
+    graphics->pending = 0;
+
+    if (offset >= 0)
+        graphics->text[offset] &= 0xfdff;
+}
+
+/* The console reads the keys; the screen just has to be up to date
+   before anyone looks at it.  */
+int
+graphics_checkkey(void)
+{
+    graphics_flush();
+    return console_checkkey();
+}
+
+int
+graphics_getkey(void)
+{
+    graphics_flush();
+    return console_getkey();
 }
 
 void
@@ -611,6 +754,9 @@ graphics_init(void)
     if (graphics_inited)
         return 1;
 
+    /* whatever the text console still holds belongs on it */
+    grub_console_flush();
+
     if (backend) {
         if (backend->enable(backend)) {
             graphics_inited = 1;
@@ -650,6 +796,7 @@ graphics_init(void)
     }
     current_term = term_table;
     grub_free(graphics->text);
+    grub_free(graphics->dirty);
     grub_free(graphics);
     return 0;
 }
@@ -658,6 +805,7 @@ void
 graphics_end(void)
 {
     if (backend && graphics_inited) {
+        graphics_flush();
         graphics_inited = 0;
         backend->disable(backend);
     }
@@ -42,6 +42,7 @@ extern void graphics_end(void);
 extern struct xpm *graphics_get_splash_xpm(void);
 extern void graphics_cursor(int set);
 extern void graphics_scroll(void);
+extern void graphics_flush(void);
 
 struct graphics_backend {
     char *name;
@@ -57,6 +58,9 @@ struct graphics_backend {
     void (*clbl)(struct graphics_backend *backend, int col, int row,
     						   int width, int height,
                                                    int draw_text);
+    /* Move what is on the screen up one text row, leaving the bottom
+       row for clbl to draw; return zero if it can not be done.  */
+    int (*scroll)(struct graphics_backend *backend);
 
     void (*set_palette)(struct graphics_backend *backend,
                         int idx, int red, int green, int blue);
@@ -71,7 +75,6 @@ struct graphics_backend {
     void (*getxy)(struct graphics_backend *backend, position_t *pos);
     void (*setxy)(struct graphics_backend *backend, position_t *pos);
     void (*gotoxy)(struct graphics_backend *backend, position_t *pos);
-    void (*cursor)(struct graphics_backend *backend, int set);
 //    void (*putchar)(struct graphics_backend *backend, int ch);
 };
 
@@ -80,6 +80,24 @@
       { 0x9A, 0x38, 0x00, 0x90,	0x27, 0x3F, 0xC1, 0x4D } \
   }
 
+/* GRUB's own boot trace, a struct bootprof_table.  */
+#define GRUB_EFI_BOOTPROF_TABLE_GUID	\
+  { 0x6f1d4c2a, 0x8e3b, 0x4b7d, \
+    { 0x9a, 0x51, 0x2c, 0x7e, 0x0d, 0x3f, 0x64, 0xb8 } \
+  }
+
+/* The messages of GRUB's verbose and debug mode, a struct bootlog_table.  */
+#define GRUB_EFI_BOOTLOG_TABLE_GUID	\
+  { 0x3b8e6a51, 0x2c4d, 0x4f19, \
+    { 0x8d, 0x07, 0x5e, 0xa2, 0x91, 0x6c, 0x3f, 0xd4 } \
+  }
+
+/* The variables GRUB keeps for itself.  */
+#define GRUB_EFI_GRUB_VARIABLE_GUID	\
+  { 0x3c1f9e62, 0x5a4d, 0x4e8b, \
+    { 0xa2, 0x17, 0x6b, 0x90, 0xd4, 0x2e, 0x81, 0xc5 } \
+  }
+
 #define GRUB_EFI_LOADED_IMAGE_GUID	\
   { 0x5b1b31a1, 0x9562, 0x11d2, \
     { 0x8e, 0x3f, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } \
@@ -95,6 +113,11 @@
     { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } \
   }
 
+#define GRUB_EFI_BLOCK_IO2_GUID	\
+  { 0xa77b2472, 0xe282, 0x4e9f, \
+    { 0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1 } \
+  }
+
 #define GRUB_EFI_DEVICE_PATH_GUID	\
   { 0x09576e91, 0x6d3f, 0x11d2, \
     { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } \
@@ -125,11 +148,41 @@
     { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } \
   }
 
+#define GRUB_EFI_FILE_INFO_GUID	\
+  { 0x09576e92, 0x6d3f, 0x11d2, \
+    { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } \
+  }
+
 #define GRUB_EFI_SERIAL_IO_GUID		\
   { 0xbb25cf6f, 0xf1d4, 0x11d2, \
     { 0x9a, 0x0c, 0x00, 0x90, 0x27, 0x3F, 0xc1, 0xfd } \
   }
 
+#define GRUB_EFI_SIMPLE_NETWORK_GUID	\
+  { 0xa19832b9, 0xac25, 0x11d3, \
+    { 0x9a, 0x2d, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d } \
+  }
+
+#define GRUB_EFI_MANAGED_NETWORK_SERVICE_BINDING_GUID	\
+  { 0xf36ff770, 0xa7e1, 0x42cf, \
+    { 0x9e, 0xd2, 0x56, 0xf0, 0xf2, 0x71, 0xf4, 0x4c } \
+  }
+
+#define GRUB_EFI_MANAGED_NETWORK_GUID	\
+  { 0x7ab33a91, 0xace5, 0x4326, \
+    { 0xb5, 0x72, 0xe7, 0xee, 0x33, 0xd3, 0x9f, 0x16 } \
+  }
+
+#define GRUB_EFI_MP_SERVICES_GUID	\
+  { 0x3fdda605, 0xa76e, 0x4f46, \
+    { 0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08 } \
+  }
+
+#define GRUB_EFI_LOAD_FILE2_GUID	\
+  { 0x4006c0c1, 0xfcb3, 0x403e, \
+    { 0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d } \
+  }
+
 /* Enumerations.  */
 enum grub_efi_timer_delay
 {
@@ -632,8 +685,8 @@ typedef struct grub_efi_bios_device_path grub_efi_bios_device_path_t;
 
 struct grub_efi_device_path_from_text
 {
-  grub_efi_device_path_t * (*convert_text_to_device_node) (const grub_efi_char16_t *text_device_node);
-  grub_efi_device_path_t * (*convert_text_to_device_path) (const grub_efi_char16_t *text_device_path);
+  grub_efi_device_path_t * (GRUB_EFI_API *convert_text_to_device_node) (const grub_efi_char16_t *text_device_node);
+  grub_efi_device_path_t * (GRUB_EFI_API *convert_text_to_device_path) (const grub_efi_char16_t *text_device_path);
 };
 typedef struct grub_efi_device_path_from_text grub_efi_device_path_from_text_t;
 
@@ -705,98 +758,98 @@ struct grub_efi_boot_services
 {
   grub_efi_table_header_t hdr;
 
-    grub_efi_tpl_t (*raise_tpl) (grub_efi_tpl_t new_tpl);
+    grub_efi_tpl_t (GRUB_EFI_API *raise_tpl) (grub_efi_tpl_t new_tpl);
 
-  void (*restore_tpl) (grub_efi_tpl_t old_tpl);
+  void (GRUB_EFI_API *restore_tpl) (grub_efi_tpl_t old_tpl);
 
     grub_efi_status_t
-    (*allocate_pages) (grub_efi_allocate_type_t type,
+    (GRUB_EFI_API *allocate_pages) (grub_efi_allocate_type_t type,
 		       grub_efi_memory_type_t memory_type,
 		       grub_efi_uintn_t pages,
 		       grub_efi_physical_address_t * memory);
 
     grub_efi_status_t
-    (*free_pages) (grub_efi_physical_address_t memory,
+    (GRUB_EFI_API *free_pages) (grub_efi_physical_address_t memory,
 		   grub_efi_uintn_t pages);
 
     grub_efi_status_t
-    (*get_memory_map) (grub_efi_uintn_t * memory_map_size,
+    (GRUB_EFI_API *get_memory_map) (grub_efi_uintn_t * memory_map_size,
 		       grub_efi_memory_descriptor_t * memory_map,
 		       grub_efi_uintn_t * map_key,
 		       grub_efi_uintn_t * descriptor_size,
 		       grub_efi_uint32_t * descriptor_version);
 
     grub_efi_status_t
-    (*allocate_pool) (grub_efi_memory_type_t pool_type,
+    (GRUB_EFI_API *allocate_pool) (grub_efi_memory_type_t pool_type,
 		      grub_efi_uintn_t size, void **buffer);
 
-    grub_efi_status_t (*free_pool) (void *buffer);
+    grub_efi_status_t (GRUB_EFI_API *free_pool) (void *buffer);
 
     grub_efi_status_t
-    (*create_event) (grub_efi_uint32_t type,
+    (GRUB_EFI_API *create_event) (grub_efi_uint32_t type,
 		     grub_efi_tpl_t notify_tpl,
-		     void (*notify_function) (grub_efi_event_t event,
+		     void (GRUB_EFI_API *notify_function) (grub_efi_event_t event,
 					      void *context),
 		     void *notify_context, grub_efi_event_t * event);
 
     grub_efi_status_t
-    (*set_timer) (grub_efi_event_t event,
+    (GRUB_EFI_API *set_timer) (grub_efi_event_t event,
 		  grub_efi_timer_delay_t type,
 		  grub_efi_uint64_t trigger_time);
 
     grub_efi_status_t
-    (*wait_for_event) (grub_efi_uintn_t num_events,
+    (GRUB_EFI_API *wait_for_event) (grub_efi_uintn_t num_events,
 		       grub_efi_event_t * event, grub_efi_uintn_t * index);
 
-    grub_efi_status_t (*signal_event) (grub_efi_event_t event);
+    grub_efi_status_t (GRUB_EFI_API *signal_event) (grub_efi_event_t event);
 
-    grub_efi_status_t (*close_event) (grub_efi_event_t event);
+    grub_efi_status_t (GRUB_EFI_API *close_event) (grub_efi_event_t event);
 
-    grub_efi_status_t (*check_event) (grub_efi_event_t event);
+    grub_efi_status_t (GRUB_EFI_API *check_event) (grub_efi_event_t event);
 
     grub_efi_status_t
-    (*install_protocol_interface) (grub_efi_handle_t * handle,
+    (GRUB_EFI_API *install_protocol_interface) (grub_efi_handle_t * handle,
 				   grub_efi_guid_t * protocol,
 				   grub_efi_interface_type_t interface_type,
 				   void *interface);
 
     grub_efi_status_t
-    (*reinstall_protocol_interface) (grub_efi_handle_t handle,
+    (GRUB_EFI_API *reinstall_protocol_interface) (grub_efi_handle_t handle,
 				     grub_efi_guid_t * protocol,
 				     void *old_interface, void *new_inteface);
 
     grub_efi_status_t
-    (*uninstall_protocol_interface) (grub_efi_handle_t handle,
+    (GRUB_EFI_API *uninstall_protocol_interface) (grub_efi_handle_t handle,
 				     grub_efi_guid_t * protocol,
 				     void *interface);
 
     grub_efi_status_t
-    (*handle_protocol) (grub_efi_handle_t handle,
+    (GRUB_EFI_API *handle_protocol) (grub_efi_handle_t handle,
 			grub_efi_guid_t * protocol, void **interface);
 
   void *reserved;
 
     grub_efi_status_t
-    (*register_protocol_notify) (grub_efi_guid_t * protocol,
+    (GRUB_EFI_API *register_protocol_notify) (grub_efi_guid_t * protocol,
 				 grub_efi_event_t event, void **registration);
 
     grub_efi_status_t
-    (*locate_handle) (grub_efi_locate_search_type_t search_type,
+    (GRUB_EFI_API *locate_handle) (grub_efi_locate_search_type_t search_type,
 		      grub_efi_guid_t * protocol,
 		      void *search_key,
 		      grub_efi_uintn_t * buffer_size,
 		      grub_efi_handle_t * buffer);
 
     grub_efi_status_t
-    (*locate_device_path) (grub_efi_guid_t * protocol,
+    (GRUB_EFI_API *locate_device_path) (grub_efi_guid_t * protocol,
 			   grub_efi_device_path_t ** device_path,
 			   grub_efi_handle_t * device);
 
     grub_efi_status_t
-    (*install_configuration_table) (grub_efi_guid_t * guid, void *table);
+    (GRUB_EFI_API *install_configuration_table) (grub_efi_guid_t * guid, void *table);
 
     grub_efi_status_t
-    (*load_image) (grub_efi_boolean_t boot_policy,
+    (GRUB_EFI_API *load_image) (grub_efi_boolean_t boot_policy,
 		   grub_efi_handle_t parent_image_handle,
 		   grub_efi_device_path_t * file_path,
 		   void *source_buffer,
@@ -804,46 +857,46 @@ struct grub_efi_boot_services
 		   grub_efi_handle_t * image_handle);
 
     grub_efi_status_t
-    (*start_image) (grub_efi_handle_t image_handle,
+    (GRUB_EFI_API *start_image) (grub_efi_handle_t image_handle,
 		    grub_efi_uintn_t * exit_data_size,
 		    grub_efi_char16_t ** exit_data);
 
     grub_efi_status_t
-    (*exit) (grub_efi_handle_t image_handle,
+    (GRUB_EFI_API *exit) (grub_efi_handle_t image_handle,
 	     grub_efi_status_t exit_status,
 	     grub_efi_uintn_t exit_data_size,
 	     grub_efi_char16_t * exit_data) __attribute__ ((noreturn));
 
-    grub_efi_status_t (*unload_image) (grub_efi_handle_t image_handle);
+    grub_efi_status_t (GRUB_EFI_API *unload_image) (grub_efi_handle_t image_handle);
 
     grub_efi_status_t
-    (*exit_boot_services) (grub_efi_handle_t image_handle,
+    (GRUB_EFI_API *exit_boot_services) (grub_efi_handle_t image_handle,
 			   grub_efi_uintn_t map_key);
 
-    grub_efi_status_t (*get_next_monotonic_count) (grub_efi_uint64_t * count);
+    grub_efi_status_t (GRUB_EFI_API *get_next_monotonic_count) (grub_efi_uint64_t * count);
 
-    grub_efi_status_t (*stall) (grub_efi_uintn_t microseconds);
+    grub_efi_status_t (GRUB_EFI_API *stall) (grub_efi_uintn_t microseconds);
 
     grub_efi_status_t
-    (*set_watchdog_timer) (grub_efi_uintn_t timeout,
+    (GRUB_EFI_API *set_watchdog_timer) (grub_efi_uintn_t timeout,
 			   grub_efi_uint64_t watchdog_code,
 			   grub_efi_uintn_t data_size,
 			   grub_efi_char16_t * watchdog_data);
 
     grub_efi_status_t
-    (*connect_controller) (grub_efi_handle_t controller_handle,
+    (GRUB_EFI_API *connect_controller) (grub_efi_handle_t controller_handle,
 			   grub_efi_handle_t * driver_image_handle,
 			   grub_efi_device_path_protocol_t *
 			   remaining_device_path,
 			   grub_efi_boolean_t recursive);
 
     grub_efi_status_t
-    (*disconnect_controller) (grub_efi_handle_t controller_handle,
+    (GRUB_EFI_API *disconnect_controller) (grub_efi_handle_t controller_handle,
 			      grub_efi_handle_t driver_image_handle,
 			      grub_efi_handle_t child_handle);
 
     grub_efi_status_t
-    (*open_protocol) (grub_efi_handle_t handle,
+    (GRUB_EFI_API *open_protocol) (grub_efi_handle_t handle,
 		      grub_efi_guid_t * protocol,
 		      void **interface,
 		      grub_efi_handle_t agent_handle,
@@ -851,49 +904,49 @@ struct grub_efi_boot_services
 		      grub_efi_uint32_t attributes);
 
     grub_efi_status_t
-    (*close_protocol) (grub_efi_handle_t handle,
+    (GRUB_EFI_API *close_protocol) (grub_efi_handle_t handle,
 		       grub_efi_guid_t * protocol,
 		       grub_efi_handle_t agent_handle,
 		       grub_efi_handle_t controller_handle);
 
     grub_efi_status_t
-    (*open_protocol_information) (grub_efi_handle_t handle,
+    (GRUB_EFI_API *open_protocol_information) (grub_efi_handle_t handle,
 				  grub_efi_guid_t * protocol,
 				  grub_efi_open_protocol_information_entry_t
 				  ** entry_buffer,
 				  grub_efi_uintn_t * entry_count);
 
     grub_efi_status_t
-    (*protocols_per_handle) (grub_efi_handle_t handle,
+    (GRUB_EFI_API *protocols_per_handle) (grub_efi_handle_t handle,
 			     grub_efi_guid_t *** protocol_buffer,
 			     grub_efi_uintn_t * protocol_buffer_count);
 
     grub_efi_status_t
-    (*locate_handle_buffer) (grub_efi_locate_search_type_t search_type,
+    (GRUB_EFI_API *locate_handle_buffer) (grub_efi_locate_search_type_t search_type,
 			     grub_efi_guid_t * protocol,
 			     void *search_key,
 			     grub_efi_uintn_t * no_handles,
 			     grub_efi_handle_t ** buffer);
 
     grub_efi_status_t
-    (*locate_protocol) (grub_efi_guid_t * protocol,
+    (GRUB_EFI_API *locate_protocol) (grub_efi_guid_t * protocol,
 			void *registration, void **interface);
 
     grub_efi_status_t
-    (*install_multiple_protocol_interfaces) (grub_efi_handle_t * handle, ...);
+    (GRUB_EFI_API *install_multiple_protocol_interfaces) (grub_efi_handle_t * handle, ...);
 
     grub_efi_status_t
-    (*uninstall_multiple_protocol_interfaces) (grub_efi_handle_t handle, ...);
+    (GRUB_EFI_API *uninstall_multiple_protocol_interfaces) (grub_efi_handle_t handle, ...);
 
     grub_efi_status_t
-    (*calculate_crc32) (void *data,
+    (GRUB_EFI_API *calculate_crc32) (void *data,
 			grub_efi_uintn_t data_size,
 			grub_efi_uint32_t * crc32);
 
-  void (*copy_mem) (void *destination, void *source, grub_efi_uintn_t length);
+  void (GRUB_EFI_API *copy_mem) (void *destination, void *source, grub_efi_uintn_t length);
 
   void
-    (*set_mem) (void *buffer, grub_efi_uintn_t size, grub_efi_uint8_t value);
+    (GRUB_EFI_API *set_mem) (void *buffer, grub_efi_uintn_t size, grub_efi_uint8_t value);
 };
 typedef struct grub_efi_boot_services grub_efi_boot_services_t;
 
@@ -902,49 +955,49 @@ struct grub_efi_runtime_services
   grub_efi_table_header_t hdr;
 
     grub_efi_status_t
-    (*get_time) (grub_efi_time_t * time,
+    (GRUB_EFI_API *get_time) (grub_efi_time_t * time,
 		 grub_efi_time_capabilities_t * capabilities);
 
-    grub_efi_status_t (*set_time) (grub_efi_time_t * time);
+    grub_efi_status_t (GRUB_EFI_API *set_time) (grub_efi_time_t * time);
 
     grub_efi_status_t
-    (*get_wakeup_time) (grub_efi_boolean_t * enabled,
+    (GRUB_EFI_API *get_wakeup_time) (grub_efi_boolean_t * enabled,
 			grub_efi_boolean_t * pending, grub_efi_time_t * time);
 
     grub_efi_status_t
-    (*set_wakeup_time) (grub_efi_boolean_t enabled, grub_efi_time_t * time);
+    (GRUB_EFI_API *set_wakeup_time) (grub_efi_boolean_t enabled, grub_efi_time_t * time);
 
     grub_efi_status_t
-    (*set_virtual_address_map) (grub_efi_uintn_t memory_map_size,
+    (GRUB_EFI_API *set_virtual_address_map) (grub_efi_uintn_t memory_map_size,
 				grub_efi_uintn_t descriptor_size,
 				grub_efi_uint32_t descriptor_version,
 				grub_efi_memory_descriptor_t * virtual_map);
 
     grub_efi_status_t
-    (*convert_pointer) (grub_efi_uintn_t debug_disposition, void **address);
+    (GRUB_EFI_API *convert_pointer) (grub_efi_uintn_t debug_disposition, void **address);
 
     grub_efi_status_t
-    (*get_variable) (grub_efi_char16_t * variable_name,
+    (GRUB_EFI_API *get_variable) (grub_efi_char16_t * variable_name,
 		     grub_efi_guid_t * vendor_guid,
 		     grub_efi_uint32_t * attributes,
 		     grub_efi_uintn_t * data_size, void *data);
 
     grub_efi_status_t
-    (*get_next_variable_name) (grub_efi_uintn_t * variable_name_size,
+    (GRUB_EFI_API *get_next_variable_name) (grub_efi_uintn_t * variable_name_size,
 			       grub_efi_char16_t * variable_name,
 			       grub_efi_guid_t * vendor_guid);
 
     grub_efi_status_t
-    (*set_variable) (grub_efi_char16_t * variable_name,
+    (GRUB_EFI_API *set_variable) (grub_efi_char16_t * variable_name,
 		     grub_efi_guid_t * vendor_guid,
 		     grub_efi_uint32_t attributes,
 		     grub_efi_uintn_t data_size, void *data);
 
     grub_efi_status_t
-    (*get_next_high_monotonic_count) (grub_efi_uint32_t * high_count);
+    (GRUB_EFI_API *get_next_high_monotonic_count) (grub_efi_uint32_t * high_count);
 
   void
-    (*reset_system) (grub_efi_reset_type_t reset_type,
+    (GRUB_EFI_API *reset_system) (grub_efi_reset_type_t reset_type,
 		     grub_efi_status_t reset_status,
 		     grub_efi_uintn_t data_size,
 		     grub_efi_char16_t * reset_data);
@@ -961,11 +1014,11 @@ typedef struct grub_efi_configuration_table grub_efi_configuration_table_t;
 struct grub_efi_simple_input_interface
 {
   grub_efi_status_t
-    (*reset) (struct grub_efi_simple_input_interface * this,
+    (GRUB_EFI_API *reset) (struct grub_efi_simple_input_interface * this,
 	      grub_efi_boolean_t extended_verification);
 
   grub_efi_status_t
-    (*read_key_stroke) (struct grub_efi_simple_input_interface * this,
+    (GRUB_EFI_API *read_key_stroke) (struct grub_efi_simple_input_interface * this,
 			grub_efi_input_key_t * key);
 
   grub_efi_event_t wait_for_key;
@@ -976,40 +1029,40 @@ typedef struct grub_efi_simple_input_interface
 struct grub_efi_simple_text_output_interface
 {
   grub_efi_status_t
-    (*reset) (struct grub_efi_simple_text_output_interface * this,
+    (GRUB_EFI_API *reset) (struct grub_efi_simple_text_output_interface * this,
 	      grub_efi_boolean_t extended_verification);
 
   grub_efi_status_t
-    (*output_string) (struct grub_efi_simple_text_output_interface * this,
+    (GRUB_EFI_API *output_string) (struct grub_efi_simple_text_output_interface * this,
 		      grub_efi_char16_t * string);
 
   grub_efi_status_t
-    (*test_string) (struct grub_efi_simple_text_output_interface * this,
+    (GRUB_EFI_API *test_string) (struct grub_efi_simple_text_output_interface * this,
 		    grub_efi_char16_t * string);
 
   grub_efi_status_t
-    (*query_mode) (struct grub_efi_simple_text_output_interface * this,
+    (GRUB_EFI_API *query_mode) (struct grub_efi_simple_text_output_interface * this,
 		   grub_efi_uintn_t mode_number,
 		   grub_efi_uintn_t * columns, grub_efi_uintn_t * rows);
 
   grub_efi_status_t
-    (*set_mode) (struct grub_efi_simple_text_output_interface * this,
+    (GRUB_EFI_API *set_mode) (struct grub_efi_simple_text_output_interface * this,
 		 grub_efi_uintn_t mode_number);
 
   grub_efi_status_t
-    (*set_attributes) (struct grub_efi_simple_text_output_interface * this,
+    (GRUB_EFI_API *set_attributes) (struct grub_efi_simple_text_output_interface * this,
 		       grub_efi_uintn_t attribute);
 
   grub_efi_status_t
-    (*clear_screen) (struct grub_efi_simple_text_output_interface * this);
+    (GRUB_EFI_API *clear_screen) (struct grub_efi_simple_text_output_interface * this);
 
   grub_efi_status_t
-    (*set_cursor_position) (struct grub_efi_simple_text_output_interface *
+    (GRUB_EFI_API *set_cursor_position) (struct grub_efi_simple_text_output_interface *
 			    this, grub_efi_uintn_t column,
 			    grub_efi_uintn_t row);
 
   grub_efi_status_t
-    (*enable_cursor) (struct grub_efi_simple_text_output_interface * this,
+    (GRUB_EFI_API *enable_cursor) (struct grub_efi_simple_text_output_interface * this,
 		      grub_efi_boolean_t visible);
 
   grub_efi_simple_text_output_mode_t *mode;
@@ -1082,18 +1135,18 @@ struct grub_efi_loaded_image
   grub_efi_memory_type_t image_code_type;
   grub_efi_memory_type_t image_data_type;
 
-    grub_efi_status_t (*unload) (grub_efi_handle_t image_handle);
+    grub_efi_status_t (GRUB_EFI_API *unload) (grub_efi_handle_t image_handle);
 };
 typedef struct grub_efi_loaded_image grub_efi_loaded_image_t;
 
 struct grub_efi_disk_io
 {
   grub_efi_uint64_t revision;
-    grub_efi_status_t (*read) (struct grub_efi_disk_io * this,
+    grub_efi_status_t (GRUB_EFI_API *read) (struct grub_efi_disk_io * this,
 			       grub_efi_uint32_t media_id,
 			       grub_efi_uint64_t offset,
 			       grub_efi_uintn_t buffer_size, void *buffer);
-    grub_efi_status_t (*write) (struct grub_efi_disk_io * this,
+    grub_efi_status_t (GRUB_EFI_API *write) (struct grub_efi_disk_io * this,
 				grub_efi_uint32_t media_id,
 				grub_efi_uint64_t offset,
 				grub_efi_uintn_t buffer_size, void *buffer);
@@ -1120,22 +1173,51 @@ struct grub_efi_block_io
 {
   grub_efi_uint64_t revision;
   grub_efi_block_io_media_t *media;
-    grub_efi_status_t (*reset) (struct grub_efi_block_io * this,
+    grub_efi_status_t (GRUB_EFI_API *reset) (struct grub_efi_block_io * this,
 				grub_efi_boolean_t extended_verification);
-    grub_efi_status_t (*read_blocks) (struct grub_efi_block_io * this,
+    grub_efi_status_t (GRUB_EFI_API *read_blocks) (struct grub_efi_block_io * this,
 				      grub_efi_uint32_t media_id,
 				      grub_efi_lba_t lba,
 				      grub_efi_uintn_t buffer_size,
 				      void *buffer);
-    grub_efi_status_t (*write_blocks) (struct grub_efi_block_io * this,
+    grub_efi_status_t (GRUB_EFI_API *write_blocks) (struct grub_efi_block_io * this,
 				       grub_efi_uint32_t media_id,
 				       grub_efi_lba_t lba,
 				       grub_efi_uintn_t buffer_size,
 				       void *buffer);
-    grub_efi_status_t (*flush_blocks) (struct grub_efi_block_io * this);
+    grub_efi_status_t (GRUB_EFI_API *flush_blocks) (struct grub_efi_block_io * this);
 };
 typedef struct grub_efi_block_io grub_efi_block_io_t;
 
+struct grub_efi_block_io2_token
+{
+  grub_efi_event_t event;
+  grub_efi_status_t transaction_status;
+};
+typedef struct grub_efi_block_io2_token grub_efi_block_io2_token_t;
+
+struct grub_efi_block_io2
+{
+  grub_efi_block_io_media_t *media;
+    grub_efi_status_t (GRUB_EFI_API *reset) (struct grub_efi_block_io2 * this,
+				grub_efi_boolean_t extended_verification);
+    grub_efi_status_t (GRUB_EFI_API *read_blocks_ex) (struct grub_efi_block_io2 * this,
+					 grub_efi_uint32_t media_id,
+					 grub_efi_lba_t lba,
+					 grub_efi_block_io2_token_t * token,
+					 grub_efi_uintn_t buffer_size,
+					 void *buffer);
+    grub_efi_status_t (GRUB_EFI_API *write_blocks_ex) (struct grub_efi_block_io2 * this,
+					  grub_efi_uint32_t media_id,
+					  grub_efi_lba_t lba,
+					  grub_efi_block_io2_token_t * token,
+					  grub_efi_uintn_t buffer_size,
+					  void *buffer);
+    grub_efi_status_t (GRUB_EFI_API *flush_blocks_ex) (struct grub_efi_block_io2 * this,
+					  grub_efi_block_io2_token_t * token);
+};
+typedef struct grub_efi_block_io2 grub_efi_block_io2_t;
+
 struct grub_efi_pixel_bitmask
 {
   grub_efi_uint32_t red_mask;
@@ -1222,15 +1304,15 @@ typedef struct grub_efi_graphics_output_mode grub_efi_graphics_output_mode_t;
 
 struct grub_efi_graphics_output
 {
-  grub_efi_status_t (*query_mode) (struct grub_efi_graphics_output * this,
+  grub_efi_status_t (GRUB_EFI_API *query_mode) (struct grub_efi_graphics_output * this,
 				   grub_efi_uint32_t mode_number,
 				   grub_efi_uintn_t * size_of_info,
 				   grub_efi_graphics_output_mode_information_t
 				   ** info);
-  grub_efi_status_t (*set_mode) (struct grub_efi_graphics_output * this,
+  grub_efi_status_t (GRUB_EFI_API *set_mode) (struct grub_efi_graphics_output * this,
 				 grub_efi_uint32_t mode_number);
 
-  grub_efi_status_t (*blt) (struct grub_efi_graphics_output * this,
+  grub_efi_status_t (GRUB_EFI_API *blt) (struct grub_efi_graphics_output * this,
 			    grub_efi_graphics_output_blt_pixel_t * blt_buffer,
 			    grub_efi_graphics_output_blt_operation_t
 			    blt_operation, grub_efi_uintn_t src_x,
@@ -1269,13 +1351,13 @@ struct grub_efi_pci_io;
 
 typedef struct
 {
-  grub_efi_status_t(*read) (struct grub_efi_pci_io *this,
+  grub_efi_status_t(GRUB_EFI_API *read) (struct grub_efi_pci_io *this,
 			    grub_efi_pci_io_width width,
 			    grub_efi_uint8_t bar_index,
 			    grub_efi_uint64_t offset,
 			    grub_efi_uintn_t count,
 			    void *buffer);
-  grub_efi_status_t(*write) (struct grub_efi_pci_io *this,
+  grub_efi_status_t(GRUB_EFI_API *write) (struct grub_efi_pci_io *this,
 			    grub_efi_pci_io_width width,
 			    grub_efi_uint8_t bar_index,
 			    grub_efi_uint64_t offset,
@@ -1333,7 +1415,7 @@ typedef enum {
 } grub_efi_pci_io_attribute_operation_t;
 
 struct grub_efi_pci_io {
-  grub_efi_status_t (*poll_mem) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *poll_mem) (struct grub_efi_pci_io *this,
 				 grub_efi_pci_io_width  width,
 				 grub_efi_uint8_t bar_ndex,
 				 grub_efi_uint64_t offset,
@@ -1341,7 +1423,7 @@ struct grub_efi_pci_io {
 				 grub_efi_uint64_t value,
 				 grub_efi_uint64_t delay,
 				 grub_efi_uint64_t *result);
-  grub_efi_status_t (*poll_io) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *poll_io) (struct grub_efi_pci_io *this,
 				grub_efi_pci_io_width  Width,
 				grub_efi_uint8_t bar_index,
 				grub_efi_uint64_t offset,
@@ -1352,48 +1434,48 @@ struct grub_efi_pci_io {
   grub_efi_pci_io_access_t mem;
   grub_efi_pci_io_access_t io;
   grub_efi_pci_io_config_access_t pci;
-  grub_efi_status_t (*copy_mem) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *copy_mem) (struct grub_efi_pci_io *this,
 				 grub_efi_pci_io_width width,
 				 grub_efi_uint8_t dest_bar_index,
 				 grub_efi_uint64_t dest_offset,
 				 grub_efi_uint8_t src_bar_index,
 				 grub_efi_uint64_t src_offset,
 				 grub_efi_uintn_t count);
-  grub_efi_status_t (*map) ( struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *map) ( struct grub_efi_pci_io *this,
 			     grub_efi_pci_io_operation_t operation,
 			     void *host_address,
 			     grub_efi_uintn_t *number_of_bytes,
 			     grub_efi_uint64_t *device_address,
 			     void **mapping);
-  grub_efi_status_t (*unmap) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *unmap) (struct grub_efi_pci_io *this,
 			      void *mapping);
-  grub_efi_status_t (*allocate_buffer) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *allocate_buffer) (struct grub_efi_pci_io *this,
 					grub_efi_allocate_type_t type,
 					grub_efi_memory_type_t memory_type,
 					grub_efi_uintn_t pages,
 					void **host_address,
 					grub_efi_uint64_t attributes);
-  grub_efi_status_t (*free_buffer) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *free_buffer) (struct grub_efi_pci_io *this,
 					grub_efi_allocate_type_t type,
 					grub_efi_memory_type_t memory_type,
 					grub_efi_uintn_t pages,
 					void **host_address,
 					grub_efi_uint64_t attributes);
-  grub_efi_status_t (*flush) (struct grub_efi_pci_io *this);
-  grub_efi_status_t (*get_location) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *flush) (struct grub_efi_pci_io *this);
+  grub_efi_status_t (GRUB_EFI_API *get_location) (struct grub_efi_pci_io *this,
 				     grub_efi_uintn_t *segment_number,
 				     grub_efi_uintn_t *bus_number,
 				     grub_efi_uintn_t *device_number,
 				     grub_efi_uintn_t *function_number);
-  grub_efi_status_t (*attributes) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *attributes) (struct grub_efi_pci_io *this,
 				   grub_efi_pci_io_attribute_operation_t operation,
 				   grub_efi_uint64_t attributes,
 				   grub_efi_uint64_t *result);
-  grub_efi_status_t (*get_bar_attributes) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *get_bar_attributes) (struct grub_efi_pci_io *this,
 					   grub_efi_uint8_t bar_index,
 					   grub_efi_uint64_t *supports,
 					   void **resources);
-  grub_efi_status_t (*set_bar_attributes) (struct grub_efi_pci_io *this,
+  grub_efi_status_t (GRUB_EFI_API *set_bar_attributes) (struct grub_efi_pci_io *this,
 					   grub_efi_uint64_t attributes,
 					   grub_efi_uint8_t bar_index,
 					   grub_efi_uint64_t *offset,
@@ -1407,12 +1489,12 @@ struct grub_efi_pci_root_io;
 
 typedef struct
 {
-  grub_efi_status_t(*read) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t(GRUB_EFI_API *read) (struct grub_efi_pci_root_io *this,
 			    grub_efi_pci_io_width width,
 			    grub_efi_uint64_t address,
 			    grub_efi_uintn_t count,
 			    void *buffer);
-  grub_efi_status_t(*write) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t(GRUB_EFI_API *write) (struct grub_efi_pci_root_io *this,
 			    grub_efi_pci_io_width width,
 			    grub_efi_uint64_t address,
 			    grub_efi_uintn_t count,
@@ -1431,14 +1513,14 @@ typedef enum {
 
 struct grub_efi_pci_root_io {
   grub_efi_handle_t parent;
-  grub_efi_status_t (*poll_mem) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *poll_mem) (struct grub_efi_pci_root_io *this,
 				 grub_efi_pci_io_width  width,
 				 grub_efi_uint64_t address,
 				 grub_efi_uint64_t mask,
 				 grub_efi_uint64_t value,
 				 grub_efi_uint64_t delay,
 				 grub_efi_uint64_t *result);
-  grub_efi_status_t (*poll_io) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *poll_io) (struct grub_efi_pci_root_io *this,
 				grub_efi_pci_io_width  Width,
 				grub_efi_uint64_t address,
 				grub_efi_uint64_t mask,
@@ -1448,37 +1530,37 @@ struct grub_efi_pci_root_io {
   grub_efi_pci_root_io_access_t mem;
   grub_efi_pci_root_io_access_t io;
   grub_efi_pci_root_io_access_t pci;
-  grub_efi_status_t (*copy_mem) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *copy_mem) (struct grub_efi_pci_root_io *this,
 				 grub_efi_pci_io_width width,
 				 grub_efi_uint64_t dest_offset,
 				 grub_efi_uint64_t src_offset,
 				 grub_efi_uintn_t count);
-  grub_efi_status_t (*map) ( struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *map) ( struct grub_efi_pci_root_io *this,
 			     grub_efi_pci_root_io_operation_t operation,
 			     void *host_address,
 			     grub_efi_uintn_t *number_of_bytes,
 			     grub_efi_uint64_t *device_address,
 			     void **mapping);
-  grub_efi_status_t (*unmap) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *unmap) (struct grub_efi_pci_root_io *this,
 			      void *mapping);
-  grub_efi_status_t (*allocate_buffer) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *allocate_buffer) (struct grub_efi_pci_root_io *this,
 					grub_efi_allocate_type_t type,
 					grub_efi_memory_type_t memory_type,
 					grub_efi_uintn_t pages,
 					void **host_address,
 					grub_efi_uint64_t attributes);
-  grub_efi_status_t (*free_buffer) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *free_buffer) (struct grub_efi_pci_root_io *this,
 				    grub_efi_uintn_t pages,
 				    void **host_address);
-  grub_efi_status_t (*flush) (struct grub_efi_pci_root_io *this);
-  grub_efi_status_t (*get_attributes) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *flush) (struct grub_efi_pci_root_io *this);
+  grub_efi_status_t (GRUB_EFI_API *get_attributes) (struct grub_efi_pci_root_io *this,
 				       grub_efi_uint64_t *supports,
 				       void **resources);
-  grub_efi_status_t (*set_attributes) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *set_attributes) (struct grub_efi_pci_root_io *this,
 				       grub_efi_uint64_t attributes,
 				       grub_efi_uint64_t *offset,
 				       grub_efi_uint64_t *length);
-  grub_efi_status_t (*configuration) (struct grub_efi_pci_root_io *this,
+  grub_efi_status_t (GRUB_EFI_API *configuration) (struct grub_efi_pci_root_io *this,
 				      void **resources);
 };
 
@@ -1486,17 +1568,17 @@ typedef struct grub_efi_pci_root_io grub_efi_pci_root_io_t;
 
 struct grub_efi_uga_draw
 {
-  grub_efi_status_t (*get_mode) (struct grub_efi_uga_draw * this,
+  grub_efi_status_t (GRUB_EFI_API *get_mode) (struct grub_efi_uga_draw * this,
                                  grub_efi_uint32_t *horizontal_resolution,
                                  grub_efi_uint32_t *vertical_resolution,
                                  grub_efi_uint32_t *color_depth,
                                  grub_efi_uint32_t *refresh_rate);
-  grub_efi_status_t (*set_mode) (struct grub_efi_uga_draw * this,
+  grub_efi_status_t (GRUB_EFI_API *set_mode) (struct grub_efi_uga_draw * this,
                                  grub_efi_uint32_t horizontal_resolution,
                                  grub_efi_uint32_t vertical_resolution,
                                  grub_efi_uint32_t color_depth,
                                  grub_efi_uint32_t refresh_rate);
-  grub_efi_status_t (*blt) (struct grub_efi_uga_draw * this,
+  grub_efi_status_t (GRUB_EFI_API *blt) (struct grub_efi_uga_draw * this,
                             grub_efi_uga_pixel_t *blt_buffer,
                             grub_efi_uga_blt_operation_t blt_operation,
                             grub_efi_uintn_t source_x,
@@ -1576,14 +1658,14 @@ typedef struct grub_uga_io_request grub_uga_io_request_t;
 
 struct grub_efi_uga_io
 {
-  grub_efi_status_t (*create_device) (struct grub_efi_uga_io * this,
+  grub_efi_status_t (GRUB_EFI_API *create_device) (struct grub_efi_uga_io * this,
                                       grub_uga_device_t *parent_device,
                                       grub_uga_device_data_t *device_data,
                                       void *runtime_context,
                                       grub_uga_device_t **device);
-  grub_efi_status_t (*delete_device) (struct grub_efi_uga_io * this,
+  grub_efi_status_t (GRUB_EFI_API *delete_device) (struct grub_efi_uga_io * this,
                                       grub_uga_device_t *device);
-  grub_uga_status_t (*dispatch_service) (grub_uga_device_t *device,
+  grub_uga_status_t (GRUB_EFI_API *dispatch_service) (grub_uga_device_t *device,
                                          grub_uga_io_request_t *io_request);
 };
 typedef struct grub_efi_uga_io grub_efi_uga_io_t;
@@ -1607,39 +1689,39 @@ typedef struct grub_efi_uga_io grub_efi_uga_io_t;
 struct grub_efi_file
 {
   grub_efi_uint64_t revision;
-  grub_efi_status_t (*open) (struct grub_efi_file * this,
+  grub_efi_status_t (GRUB_EFI_API *open) (struct grub_efi_file * this,
 			     struct grub_efi_file ** new_handle,
 			     grub_efi_char16_t * file_name,
 			     grub_efi_uint64_t open_mode,
 			     grub_efi_uint64_t attributes);
-  grub_efi_status_t (*close) (struct grub_efi_file * this);
-  grub_efi_status_t (*delete) (struct grub_efi_file * this);
-  grub_efi_status_t (*read) (struct grub_efi_file * this,
+  grub_efi_status_t (GRUB_EFI_API *close) (struct grub_efi_file * this);
+  grub_efi_status_t (GRUB_EFI_API *delete) (struct grub_efi_file * this);
+  grub_efi_status_t (GRUB_EFI_API *read) (struct grub_efi_file * this,
 			     grub_efi_uintn_t * buffer_size,
 			     void * buffer);
-  grub_efi_status_t (*write) (struct grub_efi_file * this,
+  grub_efi_status_t (GRUB_EFI_API *write) (struct grub_efi_file * this,
 			      grub_efi_uintn_t * buffer_size,
 			      void * buffer);
-  grub_efi_status_t (*get_position) (struct grub_efi_file * this,
+  grub_efi_status_t (GRUB_EFI_API *get_position) (struct grub_efi_file * this,
 				     grub_efi_uint64_t * position);
-  grub_efi_status_t (*set_position) (struct grub_efi_file * this,
+  grub_efi_status_t (GRUB_EFI_API *set_position) (struct grub_efi_file * this,
 				     grub_efi_uint64_t position);
-  grub_efi_status_t (*get_info) (struct grub_efi_file * this,
+  grub_efi_status_t (GRUB_EFI_API *get_info) (struct grub_efi_file * this,
 				 grub_efi_guid_t * information_type,
 				 grub_efi_uintn_t * buffer_size,
 				 void * buffer);
-  grub_efi_status_t (*set_info) (struct grub_efi_file * this,
+  grub_efi_status_t (GRUB_EFI_API *set_info) (struct grub_efi_file * this,
 				 grub_efi_guid_t * information_type,
 				 grub_efi_uintn_t buffer_size,
 				 void * buffer);
-  grub_efi_status_t (*flush) (struct grub_efi_file * this);
+  grub_efi_status_t (GRUB_EFI_API *flush) (struct grub_efi_file * this);
 };
 typedef struct grub_efi_file grub_efi_file_t;
 
 struct grub_efi_simple_file_system
 {
   grub_efi_uint64_t revision;
-  grub_efi_status_t (*open_volume) (struct grub_efi_simple_file_system * this,
+  grub_efi_status_t (GRUB_EFI_API *open_volume) (struct grub_efi_simple_file_system * this,
 				    grub_efi_file_t ** root);
 };
 typedef struct grub_efi_simple_file_system grub_efi_simple_file_system_t;
@@ -1691,26 +1773,292 @@ typedef enum grub_efi_stop_bits grub_efi_stop_bits_t;
 struct grub_efi_serial_io
 {
   grub_efi_uint32_t revision;
-  grub_efi_status_t (*reset) (struct grub_efi_serial_io * this);
-  grub_efi_status_t (*set_attributes) (struct grub_efi_serial_io * this,
+  grub_efi_status_t (GRUB_EFI_API *reset) (struct grub_efi_serial_io * this);
+  grub_efi_status_t (GRUB_EFI_API *set_attributes) (struct grub_efi_serial_io * this,
 				       grub_efi_uint64_t baud_rate,
 				       grub_efi_uint32_t receive_fifo_depth,
 				       grub_efi_uint32_t timeout,
 				       grub_efi_parity_t parity,
 				       grub_efi_uint8_t data_bits,
 				       grub_efi_stop_bits_t stop_bits);
-  grub_efi_status_t (*set_control_bits) (struct grub_efi_serial_io * this,
+  grub_efi_status_t (GRUB_EFI_API *set_control_bits) (struct grub_efi_serial_io * this,
 					 grub_efi_uint32_t control);
-  grub_efi_status_t (*get_control_bits) (struct grub_efi_serial_io * this,
+  grub_efi_status_t (GRUB_EFI_API *get_control_bits) (struct grub_efi_serial_io * this,
 					 grub_efi_uint32_t * control);
-  grub_efi_status_t (*write) (struct grub_efi_serial_io * this,
+  grub_efi_status_t (GRUB_EFI_API *write) (struct grub_efi_serial_io * this,
 			      grub_efi_uintn_t * buffer_size,
 			      void * buffer);
-  grub_efi_status_t (*read) (struct grub_efi_serial_io * this,
+  grub_efi_status_t (GRUB_EFI_API *read) (struct grub_efi_serial_io * this,
 			     grub_efi_uintn_t * buffer_size,
 			     void * buffer);
   grub_efi_serial_io_mode_t *mode;
 };
 typedef struct grub_efi_serial_io grub_efi_serial_io_t;
 
+/* The simple network protocol, which sends and receives whole frames.  */
+enum grub_efi_simple_network_state
+{
+  GRUB_EFI_NETWORK_STOPPED,
+  GRUB_EFI_NETWORK_STARTED,
+  GRUB_EFI_NETWORK_INITIALIZED
+};
+typedef enum grub_efi_simple_network_state grub_efi_simple_network_state_t;
+
+#define GRUB_EFI_SIMPLE_NETWORK_RECEIVE_UNICAST			0x01
+#define GRUB_EFI_SIMPLE_NETWORK_RECEIVE_MULTICAST		0x02
+#define GRUB_EFI_SIMPLE_NETWORK_RECEIVE_BROADCAST		0x04
+#define GRUB_EFI_SIMPLE_NETWORK_RECEIVE_PROMISCUOUS		0x08
+#define GRUB_EFI_SIMPLE_NETWORK_RECEIVE_PROMISCUOUS_MULTICAST	0x10
+
+#define GRUB_EFI_SIMPLE_NETWORK_MAX_MCAST_FILTER_CNT	16
+
+struct grub_efi_simple_network_mode
+{
+  grub_efi_uint32_t state;
+  grub_efi_uint32_t hw_address_size;
+  grub_efi_uint32_t media_header_size;
+  grub_efi_uint32_t max_packet_size;
+  grub_efi_uint32_t nvram_size;
+  grub_efi_uint32_t nvram_access_size;
+  grub_efi_uint32_t receive_filter_mask;
+  grub_efi_uint32_t receive_filter_setting;
+  grub_efi_uint32_t max_mcast_filter_count;
+  grub_efi_uint32_t mcast_filter_count;
+  grub_efi_mac_address_t mcast_filter[GRUB_EFI_SIMPLE_NETWORK_MAX_MCAST_FILTER_CNT];
+  grub_efi_mac_address_t current_address;
+  grub_efi_mac_address_t broadcast_address;
+  grub_efi_mac_address_t permanent_address;
+  grub_efi_uint8_t if_type;
+  grub_efi_boolean_t mac_address_changeable;
+  grub_efi_boolean_t multiple_tx_supported;
+  grub_efi_boolean_t media_present_supported;
+  grub_efi_boolean_t media_present;
+};
+typedef struct grub_efi_simple_network_mode grub_efi_simple_network_mode_t;
+
+struct grub_efi_simple_network
+{
+  grub_efi_uint64_t revision;
+  grub_efi_status_t (GRUB_EFI_API *start) (struct grub_efi_simple_network *this);
+  grub_efi_status_t (GRUB_EFI_API *stop) (struct grub_efi_simple_network *this);
+  grub_efi_status_t (GRUB_EFI_API *initialize) (struct grub_efi_simple_network *this,
+				   grub_efi_uintn_t extra_rx_buffer_size,
+				   grub_efi_uintn_t extra_tx_buffer_size);
+  grub_efi_status_t (GRUB_EFI_API *reset) (struct grub_efi_simple_network *this,
+			      grub_efi_boolean_t extended_verification);
+  grub_efi_status_t (GRUB_EFI_API *shutdown) (struct grub_efi_simple_network *this);
+  grub_efi_status_t (GRUB_EFI_API *receive_filters) (struct grub_efi_simple_network *this,
+					grub_efi_uint32_t enable,
+					grub_efi_uint32_t disable,
+					grub_efi_boolean_t reset_mcast_filter,
+					grub_efi_uintn_t mcast_filter_count,
+					grub_efi_mac_address_t *mcast_filter);
+  void (GRUB_EFI_API *station_address) (void);
+  void (GRUB_EFI_API *statistics) (void);
+  void (GRUB_EFI_API *mcast_ip_to_mac) (void);
+  void (GRUB_EFI_API *nvdata) (void);
+  grub_efi_status_t (GRUB_EFI_API *get_status) (struct grub_efi_simple_network *this,
+				   grub_efi_uint32_t *interrupt_status,
+				   void **tx_buf);
+  grub_efi_status_t (GRUB_EFI_API *transmit) (struct grub_efi_simple_network *this,
+				 grub_efi_uintn_t header_size,
+				 grub_efi_uintn_t buffer_size,
+				 void *buffer,
+				 grub_efi_mac_address_t *src_addr,
+				 grub_efi_mac_address_t *dest_addr,
+				 grub_efi_uint16_t *protocol);
+  grub_efi_status_t (GRUB_EFI_API *receive) (struct grub_efi_simple_network *this,
+				grub_efi_uintn_t *header_size,
+				grub_efi_uintn_t *buffer_size,
+				void *buffer,
+				grub_efi_mac_address_t *src_addr,
+				grub_efi_mac_address_t *dest_addr,
+				grub_efi_uint16_t *protocol);
+  grub_efi_event_t wait_for_packet;
+  grub_efi_simple_network_mode_t *mode;
+};
+typedef struct grub_efi_simple_network grub_efi_simple_network_t;
+
+struct grub_efi_service_binding
+{
+  grub_efi_status_t (GRUB_EFI_API *create_child) (struct grub_efi_service_binding *this,
+				     grub_efi_handle_t *child_handle);
+  grub_efi_status_t (GRUB_EFI_API *destroy_child) (struct grub_efi_service_binding *this,
+				      grub_efi_handle_t child_handle);
+};
+typedef struct grub_efi_service_binding grub_efi_service_binding_t;
+
+/* The managed network protocol, which shares the interface with the
+   other users of the simple network protocol, such as the firmware's
+   own PXE code.  */
+struct grub_efi_managed_network_config_data
+{
+  grub_efi_uint32_t received_queue_timeout_value;
+  grub_efi_uint32_t transmit_queue_timeout_value;
+  grub_efi_uint16_t protocol_type_filter;
+  grub_efi_boolean_t enable_unicast_receive;
+  grub_efi_boolean_t enable_multicast_receive;
+  grub_efi_boolean_t enable_broadcast_receive;
+  grub_efi_boolean_t enable_promiscuous_receive;
+  grub_efi_boolean_t flush_queues_on_reset;
+  grub_efi_boolean_t enable_receive_timestamps;
+  grub_efi_boolean_t disable_background_polling;
+};
+typedef struct grub_efi_managed_network_config_data
+  grub_efi_managed_network_config_data_t;
+
+struct grub_efi_managed_network_receive_data
+{
+  grub_efi_time_t timestamp;
+  grub_efi_event_t recycle_event;
+  grub_efi_uint32_t packet_length;
+  grub_efi_uint32_t header_length;
+  grub_efi_uint32_t address_length;
+  grub_efi_uint32_t data_length;
+  grub_efi_boolean_t broadcast_flag;
+  grub_efi_boolean_t multicast_flag;
+  grub_efi_boolean_t promiscuous_flag;
+  grub_efi_uint16_t protocol_type;
+  void *destination_address;
+  void *source_address;
+  void *media_header;
+  void *packet_data;
+};
+typedef struct grub_efi_managed_network_receive_data
+  grub_efi_managed_network_receive_data_t;
+
+struct grub_efi_managed_network_fragment_data
+{
+  grub_efi_uint32_t fragment_length;
+  void *fragment_buffer;
+};
+typedef struct grub_efi_managed_network_fragment_data
+  grub_efi_managed_network_fragment_data_t;
+
+struct grub_efi_managed_network_transmit_data
+{
+  grub_efi_mac_address_t *destination_address;
+  grub_efi_mac_address_t *source_address;
+  grub_efi_uint16_t protocol_type;
+  grub_efi_uint32_t data_length;
+  grub_efi_uint16_t header_length;
+  grub_efi_uint16_t fragment_count;
+  grub_efi_managed_network_fragment_data_t fragment_table[1];
+};
+typedef struct grub_efi_managed_network_transmit_data
+  grub_efi_managed_network_transmit_data_t;
+
+struct grub_efi_managed_network_completion_token
+{
+  grub_efi_event_t event;
+  grub_efi_status_t status;
+  union
+  {
+    grub_efi_managed_network_receive_data_t *rx_data;
+    grub_efi_managed_network_transmit_data_t *tx_data;
+  } packet;
+};
+typedef struct grub_efi_managed_network_completion_token
+  grub_efi_managed_network_completion_token_t;
+
+struct grub_efi_managed_network
+{
+  grub_efi_status_t
+    (GRUB_EFI_API *get_mode_data) (struct grub_efi_managed_network *this,
+		      grub_efi_managed_network_config_data_t *mnp_config_data,
+		      grub_efi_simple_network_mode_t *snp_mode_data);
+  grub_efi_status_t
+    (GRUB_EFI_API *configure) (struct grub_efi_managed_network *this,
+		  grub_efi_managed_network_config_data_t *mnp_config_data);
+  void (GRUB_EFI_API *mcast_ip_to_mac) (void);
+  void (GRUB_EFI_API *groups) (void);
+  grub_efi_status_t
+    (GRUB_EFI_API *transmit) (struct grub_efi_managed_network *this,
+		 grub_efi_managed_network_completion_token_t *token);
+  grub_efi_status_t
+    (GRUB_EFI_API *receive) (struct grub_efi_managed_network *this,
+		grub_efi_managed_network_completion_token_t *token);
+  grub_efi_status_t
+    (GRUB_EFI_API *cancel) (struct grub_efi_managed_network *this,
+	       grub_efi_managed_network_completion_token_t *token);
+  grub_efi_status_t (GRUB_EFI_API *poll) (struct grub_efi_managed_network *this);
+};
+typedef struct grub_efi_managed_network grub_efi_managed_network_t;
+
+/* The MP services protocol, from the PI specification.  A procedure
+   run on the application processors may not call any EFI service.  */
+#define GRUB_EFI_PROCESSOR_AS_BSP_BIT		0x00000001
+#define GRUB_EFI_PROCESSOR_ENABLED_BIT		0x00000002
+#define GRUB_EFI_PROCESSOR_HEALTH_STATUS_BIT	0x00000004
+
+struct grub_efi_cpu_physical_location
+{
+  grub_efi_uint32_t package;
+  grub_efi_uint32_t core;
+  grub_efi_uint32_t thread;
+};
+typedef struct grub_efi_cpu_physical_location grub_efi_cpu_physical_location_t;
+
+struct grub_efi_processor_information
+{
+  grub_efi_uint64_t processor_id;
+  grub_efi_uint32_t status_flag;
+  grub_efi_cpu_physical_location_t location;
+};
+typedef struct grub_efi_processor_information grub_efi_processor_information_t;
+
+typedef void (GRUB_EFI_API *grub_efi_ap_procedure_t) (void *argument);
+
+struct grub_efi_mp_services
+{
+  grub_efi_status_t
+    (GRUB_EFI_API *get_number_of_processors) (struct grub_efi_mp_services *this,
+				 grub_efi_uintn_t *number_of_processors,
+				 grub_efi_uintn_t *number_of_enabled);
+  grub_efi_status_t
+    (GRUB_EFI_API *get_processor_info) (struct grub_efi_mp_services *this,
+			   grub_efi_uintn_t processor_number,
+			   grub_efi_processor_information_t *buffer);
+  grub_efi_status_t
+    (GRUB_EFI_API *startup_all_aps) (struct grub_efi_mp_services *this,
+			grub_efi_ap_procedure_t procedure,
+			grub_efi_boolean_t single_thread,
+			grub_efi_event_t wait_event,
+			grub_efi_uintn_t timeout_in_microseconds,
+			void *procedure_argument,
+			grub_efi_uintn_t **failed_cpu_list);
+  grub_efi_status_t
+    (GRUB_EFI_API *startup_this_ap) (struct grub_efi_mp_services *this,
+			grub_efi_ap_procedure_t procedure,
+			grub_efi_uintn_t processor_number,
+			grub_efi_event_t wait_event,
+			grub_efi_uintn_t timeout_in_microseconds,
+			void *procedure_argument,
+			grub_efi_boolean_t *finished);
+  grub_efi_status_t
+    (GRUB_EFI_API *switch_bsp) (struct grub_efi_mp_services *this,
+		   grub_efi_uintn_t processor_number,
+		   grub_efi_boolean_t enable_old_bsp);
+  grub_efi_status_t
+    (GRUB_EFI_API *enable_disable_ap) (struct grub_efi_mp_services *this,
+			  grub_efi_uintn_t processor_number,
+			  grub_efi_boolean_t enable_ap,
+			  grub_efi_uint32_t *health_flag);
+  grub_efi_status_t
+    (GRUB_EFI_API *who_am_i) (struct grub_efi_mp_services *this,
+		 grub_efi_uintn_t *processor_number);
+};
+typedef struct grub_efi_mp_services grub_efi_mp_services_t;
+
+struct grub_efi_load_file2
+{
+  grub_efi_status_t
+    (GRUB_EFI_API *load_file) (struct grub_efi_load_file2 *this,
+			       grub_efi_device_path_t *file_path,
+			       grub_efi_boolean_t boot_policy,
+			       grub_efi_uintn_t *buffer_size,
+			       void *buffer);
+};
+typedef struct grub_efi_load_file2 grub_efi_load_file2_t;
+
 #endif /* ! GRUB_EFI_API_HEADER */
@@ -40,17 +40,17 @@ typedef enum grub_efi_screen_mode grub_efi_screen_mode_t;
 struct grub_efi_console_control_protocol
 {
   grub_efi_status_t
-    (*get_mode) (struct grub_efi_console_control_protocol * this,
+    (GRUB_EFI_API *get_mode) (struct grub_efi_console_control_protocol * this,
 		 grub_efi_screen_mode_t * mode,
 		 grub_efi_boolean_t * uga_exists,
 		 grub_efi_boolean_t * std_in_locked);
 
   grub_efi_status_t
-    (*set_mode) (struct grub_efi_console_control_protocol * this,
+    (GRUB_EFI_API *set_mode) (struct grub_efi_console_control_protocol * this,
 		 grub_efi_screen_mode_t mode);
 
   grub_efi_status_t
-    (*lock_std_in) (struct grub_efi_console_control_protocol * this,
+    (GRUB_EFI_API *lock_std_in) (struct grub_efi_console_control_protocol * this,
 		    grub_efi_char16_t * password);
 };
 typedef struct grub_efi_console_control_protocol
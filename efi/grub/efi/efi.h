@@ -54,9 +54,22 @@ void *grub_efi_allocate_pages (grub_efi_physical_address_t address,
 			       grub_efi_uintn_t pages);
 void *grub_efi_allocate_runtime_pages (grub_efi_physical_address_t address,
 				       grub_efi_uintn_t pages);
+void *grub_efi_allocate_high_pages (grub_efi_physical_address_t address,
+				    grub_efi_uintn_t pages,
+				    grub_efi_physical_address_t max_address);
+void *grub_efi_allocate_best_fit (grub_efi_physical_address_t min_address,
+				  grub_efi_physical_address_t max_address,
+				  grub_efi_uintn_t pages,
+				  grub_efi_uint64_t align,
+				  int top);
 void
 grub_efi_free_pages (grub_efi_physical_address_t address,
 		     grub_efi_uintn_t pages);
+void *grub_efi_heap_alloc (grub_efi_uintn_t size);
+void grub_efi_heap_free (void *ptr);
+grub_efi_uintn_t grub_efi_arena_mark (void);
+void *grub_efi_arena_alloc (grub_efi_uintn_t size);
+void grub_efi_arena_release (grub_efi_uintn_t mark);
 int
 grub_efi_get_memory_map (grub_efi_uintn_t * map_key,
 			 grub_efi_uintn_t * descriptor_size,
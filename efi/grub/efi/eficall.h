@@ -28,7 +28,21 @@
 #endif
 #endif
 
-#ifdef  EFI_FUNCTION_WRAPPER
+/* On x86_64 the firmware has the Microsoft calling convention.  A
+   compiler which knows it calls the services straight through the
+   pointers in the protocols, all of which are declared GRUB_EFI_API,
+   and so do the functions the firmware calls back.  An older one goes
+   through the wrappers in callwrap.S, which move the arguments over
+   on every call.  */
+#if defined(EFI_FUNCTION_WRAPPER) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 5))
+#define GRUB_EFI_MS_ABI	1
+#define GRUB_EFI_API	__attribute__ ((ms_abi))
+#else
+#define GRUB_EFI_API
+#endif
+
+#if defined(EFI_FUNCTION_WRAPPER) && ! defined(GRUB_EFI_MS_ABI)
 typedef long EFI_STATUS;
 
 EFI_STATUS x64_call0 (unsigned long func);
@@ -65,34 +79,34 @@ EFI_STATUS x64_call10(unsigned long func, unsigned long a,
 		      unsigned long h, unsigned long i,
 		      unsigned long j);
 
-#define Call_Service(func)                      x64_call0((unsigned long)func)
+#define Raw_Service(func)                       x64_call0((unsigned long)func)
 
-#define Call_Service_1(func,a)                  x64_call1((unsigned long)func, \
+#define Raw_Service_1(func,a)                   x64_call1((unsigned long)func, \
 							  (unsigned long)a)
 
-#define Call_Service_2(func,a,b)                x64_call2((unsigned long)func, \
+#define Raw_Service_2(func,a,b)                 x64_call2((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b)
 
-#define Call_Service_3(func,a,b,c)              x64_call3((unsigned long)func, \
+#define Raw_Service_3(func,a,b,c)               x64_call3((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b,    \
 							  (unsigned long)c)
 
-#define Call_Service_4(func,a,b,c,d)            x64_call4((unsigned long)func, \
+#define Raw_Service_4(func,a,b,c,d)             x64_call4((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b,    \
 							  (unsigned long)c,    \
 							  (unsigned long)d)
 
-#define Call_Service_5(func,a,b,c,d,e)          x64_call5((unsigned long)func, \
+#define Raw_Service_5(func,a,b,c,d,e)           x64_call5((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b,    \
 							  (unsigned long)c,    \
 							  (unsigned long)d,    \
 							  (unsigned long)e)
 
-#define Call_Service_6(func,a,b,c,d,e,f)        x64_call6((unsigned long)func, \
+#define Raw_Service_6(func,a,b,c,d,e,f)         x64_call6((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b,    \
 							  (unsigned long)c,    \
@@ -100,7 +114,7 @@ EFI_STATUS x64_call10(unsigned long func, unsigned long a,
 							  (unsigned long)e,    \
 							  (unsigned long)f)
 
-#define Call_Service_7(func,a,b,c,d,e,f,g)      x64_call7((unsigned long)func, \
+#define Raw_Service_7(func,a,b,c,d,e,f,g)       x64_call7((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b,    \
 							  (unsigned long)c,    \
@@ -109,7 +123,7 @@ EFI_STATUS x64_call10(unsigned long func, unsigned long a,
 							  (unsigned long)f,    \
 							  (unsigned long)g)
 
-#define Call_Service_8(func,a,b,c,d,e,f,g,h)    x64_call8((unsigned long)func, \
+#define Raw_Service_8(func,a,b,c,d,e,f,g,h)     x64_call8((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b,    \
 							  (unsigned long)c,    \
@@ -119,7 +133,7 @@ EFI_STATUS x64_call10(unsigned long func, unsigned long a,
 							  (unsigned long)g,    \
 							  (unsigned long)h)
 
-#define Call_Service_9(func,a,b,c,d,e,f,g,h,i)  x64_call9((unsigned long)func, \
+#define Raw_Service_9(func,a,b,c,d,e,f,g,h,i)   x64_call9((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b,    \
 							  (unsigned long)c,    \
@@ -130,7 +144,7 @@ EFI_STATUS x64_call10(unsigned long func, unsigned long a,
 							  (unsigned long)h,    \
 							  (unsigned long)i)
 
-#define Call_Service_10(func,a,b,c,d,e,f,g,h,i,j) \
+#define Raw_Service_10(func,a,b,c,d,e,f,g,h,i,j)  \
 					       x64_call10((unsigned long)func, \
 							  (unsigned long)a,    \
 							  (unsigned long)b,    \
@@ -146,17 +160,61 @@ EFI_STATUS x64_call10(unsigned long func, unsigned long a,
 #else
 
 typedef long EFI_STATUS;
-#define Call_Service(func)                      func()
-#define Call_Service_1(func,a)                  func(a)
-#define Call_Service_2(func,a,b)                func(a,b)
-#define Call_Service_3(func,a,b,c)              func(a,b,c)
-#define Call_Service_4(func,a,b,c,d)            func(a,b,c,d)
-#define Call_Service_5(func,a,b,c,d,e)          func(a,b,c,d,e)
-#define Call_Service_6(func,a,b,c,d,e,f)        func(a,b,c,d,e,f)
-#define Call_Service_7(func,a,b,c,d,e,f,g)      func(a,b,c,d,e,f,g)
-#define Call_Service_8(func,a,b,c,d,e,f,g,h)    func(a,b,c,d,e,f,g,h)
-#define Call_Service_9(func,a,b,c,d,e,f,g,h,i)  func(a,b,c,d,e,f,g,h,i)
-#define Call_Service_10(func,a,b,c,d,e,f,g,h,i,j)  func(a,b,c,d,e,f,g,h,i,j)
+#define Raw_Service(func)                       func()
+#define Raw_Service_1(func,a)                   func(a)
+#define Raw_Service_2(func,a,b)                 func(a,b)
+#define Raw_Service_3(func,a,b,c)               func(a,b,c)
+#define Raw_Service_4(func,a,b,c,d)             func(a,b,c,d)
+#define Raw_Service_5(func,a,b,c,d,e)           func(a,b,c,d,e)
+#define Raw_Service_6(func,a,b,c,d,e,f)         func(a,b,c,d,e,f)
+#define Raw_Service_7(func,a,b,c,d,e,f,g)       func(a,b,c,d,e,f,g)
+#define Raw_Service_8(func,a,b,c,d,e,f,g,h)     func(a,b,c,d,e,f,g,h)
+#define Raw_Service_9(func,a,b,c,d,e,f,g,h,i)   func(a,b,c,d,e,f,g,h,i)
+#define Raw_Service_10(func,a,b,c,d,e,f,g,h,i,j)   func(a,b,c,d,e,f,g,h,i,j)
 #endif
 
+/* With EFI_CALL_TRACE, every call is counted for the service FUNC and
+   timed; see efitrace.c.  The services returning nothing give 0.  */
+#ifdef EFI_CALL_TRACE
+unsigned long long grub_efi_trace_begin (void);
+void grub_efi_trace_end (void *func, const char *name,
+			 unsigned long long start);
+
+#define EFI_TRACE_CALL(func, call)					\
+  ({									\
+    unsigned long long __trace_start = grub_efi_trace_begin ();	\
+    EFI_STATUS __trace_status = (EFI_STATUS)				\
+      __builtin_choose_expr (__builtin_types_compatible_p		\
+			     (__typeof__ (call), void),			\
+			     ({ call; 0; }), (call));			\
+    grub_efi_trace_end ((void *) (func), #func, __trace_start);	\
+    __trace_status;							\
+  })
+#else
+#define EFI_TRACE_CALL(func, call)	(call)
+#endif
+
+#define Call_Service(func)						\
+  EFI_TRACE_CALL (func, Raw_Service (func))
+#define Call_Service_1(func,a)						\
+  EFI_TRACE_CALL (func, Raw_Service_1 (func,a))
+#define Call_Service_2(func,a,b)					\
+  EFI_TRACE_CALL (func, Raw_Service_2 (func,a,b))
+#define Call_Service_3(func,a,b,c)					\
+  EFI_TRACE_CALL (func, Raw_Service_3 (func,a,b,c))
+#define Call_Service_4(func,a,b,c,d)					\
+  EFI_TRACE_CALL (func, Raw_Service_4 (func,a,b,c,d))
+#define Call_Service_5(func,a,b,c,d,e)					\
+  EFI_TRACE_CALL (func, Raw_Service_5 (func,a,b,c,d,e))
+#define Call_Service_6(func,a,b,c,d,e,f)				\
+  EFI_TRACE_CALL (func, Raw_Service_6 (func,a,b,c,d,e,f))
+#define Call_Service_7(func,a,b,c,d,e,f,g)				\
+  EFI_TRACE_CALL (func, Raw_Service_7 (func,a,b,c,d,e,f,g))
+#define Call_Service_8(func,a,b,c,d,e,f,g,h)				\
+  EFI_TRACE_CALL (func, Raw_Service_8 (func,a,b,c,d,e,f,g,h))
+#define Call_Service_9(func,a,b,c,d,e,f,g,h,i)				\
+  EFI_TRACE_CALL (func, Raw_Service_9 (func,a,b,c,d,e,f,g,h,i))
+#define Call_Service_10(func,a,b,c,d,e,f,g,h,i,j)			\
+  EFI_TRACE_CALL (func, Raw_Service_10 (func,a,b,c,d,e,f,g,h,i,j))
+
 #endif
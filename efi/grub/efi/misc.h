@@ -24,24 +24,46 @@
 struct e820_entry;
 void e820_map_from_efi_map (struct e820_entry *e820_map,
 			    int *e820_nr_map,
+			    struct e820_entry *ext_map,
+			    int *ext_nr_map,
+			    int ext_max,
 			    grub_efi_memory_descriptor_t *memory_map,
 			    grub_efi_uintn_t desc_size,
 			    grub_efi_uintn_t memory_map_size);
+int grub_efi_reserve_memory_map (void);
+int grub_efi_exit_boot_services_with_map (struct e820_entry *e820_map,
+					  int *e820_nr_map,
+					  struct e820_entry *ext_map,
+					  int *ext_nr_map,
+					  int ext_max,
+					  grub_efi_uintn_t *desc_size,
+					  grub_efi_uint32_t *desc_version);
 
 /* Initialize the console system.  */
 void grub_console_init (void);
 /* Finish the console system.  */
 void grub_console_fini (void);
+/* Write out what the console has buffered.  */
+void grub_console_flush (void);
 
 void grub_efidisk_init (void);
 void grub_efidisk_fini (void);
+void grub_efidisk_readahead_wait (void);
+void grub_efidisk_profile_start (void);
+int grub_efidisk_profile_get (char *buf, int len);
+void grub_efidisk_profile_replay (const char *buf, int len);
 grub_efi_handle_t grub_efidisk_get_current_bdev_handle (void);
 int grub_get_drive_partition_from_bdev_handle (grub_efi_handle_t handle,
 					       unsigned long *drive,
 					       unsigned long *partition);
 
 char *grub_efi_file_path_to_path_name (grub_efi_device_path_t *file_path);
+void grub_efi_bootprof_export (void);
+void grub_efi_bootlog_export (void);
 void grub_load_saved_default (grub_efi_handle_t dev_handle);
+void grub_flush_saved_default (void);
+void grub_load_boot_profile (grub_efi_handle_t dev_handle);
+void grub_save_boot_profile (void);
 
 grub_efi_device_path_t *
 find_last_device_path (const grub_efi_device_path_t *dp);
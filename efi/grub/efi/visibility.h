@@ -0,0 +1,31 @@
+/* visibility.h - keep the symbols of GRUB/EFI inside the image */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* This is included before anything else in every file of the EFI
+   image, by configure.  GRUB is linked as a shared object only to be
+   made into a PE image, and nothing outside it uses its symbols, so
+   they are all hidden.  The compiler then reaches them relative to the
+   instruction pointer rather than through the GOT and the PLT, and the
+   image needs a relocation at startup only for each pointer kept in its
+   data, not for every GOT entry as well.  */
+
+#ifndef __ASSEMBLER__
+#pragma GCC visibility push(hidden)
+#endif
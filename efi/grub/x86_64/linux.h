@@ -35,6 +35,16 @@
 
 #define GRUB_LINUX_FLAG_BIG_KERNEL	0x1
 
+/* Flags in xloadflags, from boot protocol 2.12 on.  */
+#define GRUB_LINUX_XLF_KERNEL_64		0x1
+#define GRUB_LINUX_XLF_CAN_BE_LOADED_ABOVE_4G	0x2
+#define GRUB_LINUX_XLF_EFI_HANDOVER_64		0x8
+
+/* The setup_data which has the e820 entries that don't fit in the boot
+   parameters, from boot protocol 2.09 on, and how many GRUB puts in.  */
+#define GRUB_LINUX_SETUP_E820_EXT	1
+#define GRUB_LINUX_E820_EXT_MAX		384
+
 /* Linux's video mode selection support. Actually I hate it!  */
 #define GRUB_LINUX_VID_MODE_NORMAL	0xFFFF
 #define GRUB_LINUX_VID_MODE_EXTENDED	0xFFFE
@@ -86,7 +96,7 @@ struct grub_linux_kernel_header
   grub_uint32_t kernel_alignment;
   grub_uint8_t relocatable_kernel;
   grub_uint8_t min_alignment;
-  grub_uint8_t pad2[2];
+  grub_uint16_t xloadflags;
   grub_uint32_t cmdline_size;
   grub_uint32_t hardware_subarch;
   grub_uint64_t hardware_subarch_data;
@@ -95,6 +105,7 @@ struct grub_linux_kernel_header
   grub_uint64_t setup_data;
   grub_uint64_t pref_address;
   grub_uint32_t init_size;
+  grub_uint32_t handover_offset;	/* from 2.11 on */
 } __attribute__ ((packed));
 
 /* Boot parameters for Linux based on 2.6.12. This is used by the setup
@@ -169,7 +180,13 @@ struct linux_kernel_params
   grub_uint8_t hd1_drive_info[0x10];	/* 90 */
   grub_uint16_t rom_config_len;	/* a0 */
 
-  grub_uint8_t padding6[0x1b8 - 0xa2];
+  grub_uint8_t padding6[0xc0 - 0xa2];
+
+  grub_uint32_t ext_ramdisk_image;	/* c0 */
+  grub_uint32_t ext_ramdisk_size;	/* c4 */
+  grub_uint32_t ext_cmd_line_ptr;	/* c8 */
+
+  grub_uint8_t padding6_1[0x1b8 - 0xcc];
 
   union {
     struct {
@@ -229,6 +246,15 @@ struct linux_kernel_params
 
   grub_uint8_t padding11[0x1000 - 0xcd0];
 } __attribute__ ((packed));
+
+/* An entry in the list that setup_data in the header points to.  */
+struct linux_setup_data
+{
+  grub_uint64_t next;
+  grub_uint32_t type;
+  grub_uint32_t len;
+  grub_uint8_t data[0];
+} __attribute__ ((packed));
 #endif /* ! ASM_FILE */
 
 #endif /* ! GRUB_LINUX_MACHINE_HEADER */
@@ -27,6 +27,7 @@
 #include "switch.h"
 
 #include <shared.h>
+#include <bootprof.h>
 
 #include "graphics.h"
 
@@ -93,11 +94,6 @@ free_pages (void)
 static int
 allocate_pages (grub_size_t real_size, grub_size_t prot_size)
 {
-  grub_efi_uintn_t desc_size;
-  grub_efi_memory_descriptor_t *mmap_end;
-  grub_efi_memory_descriptor_t *desc;
-  grub_efi_physical_address_t addr;
-
   /* Make sure that each size is aligned to a page boundary.  */
   real_size = page_align (real_size + SECTOR_SIZE);
   prot_size = page_align (prot_size);
@@ -115,41 +111,10 @@ allocate_pages (grub_size_t real_size, grub_size_t prot_size)
   real_mode_mem = 0;
   prot_mode_mem = 0;
 
-  if (grub_efi_get_memory_map (0, &desc_size, 0) <= 0)
-    grub_fatal ("cannot get memory map");
-
-  addr = 0;
-  mmap_end = NEXT_MEMORY_DESCRIPTOR (mmap_buf, mmap_size);
   /* First, find free pages for the real mode code
      and the memory map buffer.  */
-  for (desc = mmap_buf;
-       desc < mmap_end;
-       desc = NEXT_MEMORY_DESCRIPTOR (desc, desc_size))
-    {
-      if (desc->type == GRUB_EFI_CONVENTIONAL_MEMORY
-	  && desc->num_pages >= real_mode_pages)
-	{
-	  grub_efi_physical_address_t physical_end;
-
-          physical_end = desc->physical_start + (desc->num_pages << 12);
-
-          grub_dprintf ("linux", "physical_start = %x, physical_end = %x\n",
-                        (unsigned) desc->physical_start,
-                        (unsigned) physical_end);
-          addr = physical_end - real_size;
-          if (addr < 0x10000)
-            continue;
-
-          grub_dprintf ("linux", "trying to allocate %u pages at %x\n",
-                        (unsigned) real_mode_pages, (unsigned) addr);
-          real_mode_mem = grub_efi_allocate_pages (addr, real_mode_pages);
-          if (! real_mode_mem)
-            grub_fatal ("cannot allocate pages");
-
-          desc->num_pages -= real_mode_pages;
-          break;
-	}
-    }
+  real_mode_mem = grub_efi_allocate_best_fit (0x10000, 0x7fffffff,
+					      real_mode_pages, 0, 1);
 
   if (! real_mode_mem)
     {
@@ -164,6 +129,15 @@ allocate_pages (grub_size_t real_size, grub_size_t prot_size)
   if (! prot_mode_mem)
 	grub_fatal("Cannot allocate pages for VMLINUZ");
 
+  /* Have the memory map buffer ready now, with room to spare, so that
+     nothing is allocated when the map is taken to boot.  */
+  if (! grub_efi_reserve_memory_map ())
+    {
+      grub_printf ("cannot allocate memory for memory map");
+      errnum = ERR_WONT_FIT;
+      goto fail;
+    }
+
   return 1;
 
  fail:
@@ -213,7 +187,6 @@ big_linux_boot (void)
 {
   struct linux_kernel_params *params;
   struct grub_linux_kernel_header *lh;
-  grub_efi_uintn_t map_key;
   grub_efi_uintn_t desc_size;
   grub_efi_uint32_t desc_version;
   int e820_nr_map;
@@ -223,17 +196,23 @@ big_linux_boot (void)
 
   graphics_set_kernel_params (params);
 
-  if (grub_efi_get_memory_map (&map_key, &desc_size, &desc_version) <= 0)
-    grub_fatal ("cannot get memory map");
+  grub_flush_saved_default ();
+  grub_save_boot_profile ();
 
-  /* Pass e820 memmap. */
-  e820_map_from_efi_map ((struct e820_entry *) params->e820_map, &e820_nr_map,
-			 mmap_buf, desc_size, mmap_size);
-  params->e820_nr_map = e820_nr_map;
+  grub_efi_bootprof_export ();
+  grub_efi_bootlog_export ();
 
   grub_dprintf(__func__,"got to ExitBootServices...\n");
-  if (! grub_efi_exit_boot_services (map_key))
+  bootprof_mark ("ExitBootServices");
+
+  /* Pass e820 memmap. */
+  if (! grub_efi_exit_boot_services_with_map ((struct e820_entry *)
+					      params->e820_map,
+					      &e820_nr_map, 0, 0, 0,
+					      &desc_size,
+					      &desc_version))
     grub_fatal ("cannot exit boot services");
+  params->e820_nr_map = e820_nr_map;
   /* Note that no boot services are available from here.  */
 
   lh = &params->hdr;
@@ -529,38 +508,116 @@ grub_load_linux (char *kernel, char *arg)
   return errnum ? KERNEL_TYPE_NONE : KERNEL_TYPE_BIG_LINUX;
 }
 
+/* Cpio archives that follow one another must start on a 4-byte
+   boundary.  */
+#define INITRD_ALIGN(size)	(((size) + 3) & ~3)
+
+/* Return the size of the initrd made of the files in INITRD, each but
+   the last padded to a 4-byte boundary, and of the archive its options
+   make after them, or -1 if a file can't be opened.  */
+static grub_ssize_t
+initrd_size (char *initrd)
+{
+  grub_ssize_t size = 0;
+  char *name;
+  int cpio;
+
+  for (name = initrd; *name; name = skip_to (0, name))
+    {
+      if (initrd_cpio_option (name))
+	continue;
+
+      if (! grub_open (name))
+	return -1;
+
+      size = INITRD_ALIGN (size) + grub_file_size ();
+      grub_close ();
+    }
+
+  cpio = initrd_cpio_size (initrd);
+  if (cpio < 0)
+    return -1;
+  if (cpio)
+    size = INITRD_ALIGN (size) + cpio;
+
+  return size;
+}
+
+/* Read the files in INITRD one after another straight into ADDR, which
+   has room for SIZE bytes, then make the archive of its options, and
+   zero the padding between them.  */
+static int
+initrd_read (char *initrd, char *addr, grub_ssize_t size)
+{
+  grub_ssize_t len = 0, file_size;
+  char *name;
+
+  for (name = initrd; *name; name = skip_to (0, name))
+    {
+      if (initrd_cpio_option (name))
+	continue;
+
+      grub_memset (addr + len, 0, INITRD_ALIGN (len) - len);
+      len = INITRD_ALIGN (len);
+
+      if (! grub_open (name))
+	return 0;
+
+      file_size = grub_file_size ();
+      if (len + file_size > size
+	  || grub_read (addr + len, file_size) != file_size)
+	{
+	  grub_close ();
+	  return 0;
+	}
+
+      grub_close ();
+      len += file_size;
+    }
+
+  if (len < size)
+    {
+      int cpio;
+
+      grub_memset (addr + len, 0, INITRD_ALIGN (len) - len);
+      len = INITRD_ALIGN (len);
+      cpio = initrd_cpio_build (initrd, addr + len);
+      if (cpio < 0 || len + cpio > size)
+	return 0;
+      len += cpio;
+    }
+
+  return len == size;
+}
+
 int
 grub_load_initrd (char *initrd)
 {
   grub_ssize_t size;
   grub_addr_t addr_min, addr_max;
   grub_addr_t addr;
-  grub_efi_uintn_t map_key;
-  grub_efi_memory_descriptor_t *mmap_end;
-  grub_efi_memory_descriptor_t *desc;
-  grub_efi_memory_descriptor_t tdesc;
-  grub_efi_uintn_t desc_size;
-  grub_efi_uint32_t desc_version;
   struct linux_kernel_params *params;
 
-  if (initrd == NULL)
+  if (initrd == NULL || ! *initrd)
     {
       errnum = ERR_BAD_FILENAME;
       grub_printf ("No module specified");
-      goto fail1;
+      goto fail;
     }
 
   if (! loaded)
     {
       errnum = ERR_UNRECOGNIZED;
       grub_printf ("You need to load the kernel first.");
-      goto fail1;
+      goto fail;
     }
 
-  if (! grub_open (initrd))
-    goto fail1;
-
-  size = grub_file_size ();
+  /* Several files make up one initrd, the way the kernel takes
+     concatenated cpio archives.  Their sizes are found first, so that
+     they can all be read into one place with no copies.  */
+  size = initrd_size (initrd);
+  if (size < 0)
+    goto fail;
   initrd_pages = (page_align (size) >> 12);
 
   params = (struct linux_kernel_params *) real_mode_mem;
@@ -581,56 +638,24 @@ grub_load_initrd (char *initrd)
   addr_min = (grub_addr_t) prot_mode_mem + ((prot_mode_pages * 3) << 12);
   grub_dprintf(__func__, "prot_mode_mem=%p prot_mode_pages=%lu\n", prot_mode_mem, prot_mode_pages);
 
-  /* Find the highest address to put the initrd.  */
-  if (grub_efi_get_memory_map (&map_key, &desc_size, &desc_version) <= 0)
-    grub_fatal ("cannot get memory map");
-
-  mmap_end = NEXT_MEMORY_DESCRIPTOR (mmap_buf, mmap_size);
-  addr = 0;
-  for (desc = mmap_buf;
-       desc < mmap_end;
-       desc = NEXT_MEMORY_DESCRIPTOR (desc, desc_size))
-    {
-      if (desc->type != GRUB_EFI_CONVENTIONAL_MEMORY)
-        continue;
-      memcpy(&tdesc, desc, sizeof (tdesc));
-      if (tdesc.physical_start < addr_min
-              && tdesc.num_pages > ((addr_min - tdesc.physical_start) >> 12))
-        {
-          tdesc.num_pages -= ((addr_min - tdesc.physical_start) >> 12);
-          tdesc.physical_start = addr_min;
-        }
-
-      grub_dprintf(__func__, "desc = {type=%d,ps=0x%llx,vs=0x%llx,sz=%llu,attr=%llu}\n", desc->type, (unsigned long long)desc->physical_start, (unsigned long long)desc->virtual_start, (unsigned long long)desc->num_pages, (unsigned long long)desc->attribute);
-      if (tdesc.physical_start >= addr_min
-	  && tdesc.physical_start + page_align (size) <= addr_max
-	  && tdesc.num_pages >= initrd_pages)
-	{
-	  grub_efi_physical_address_t physical_end;
-
-	  physical_end = tdesc.physical_start + (tdesc.num_pages << 12);
-	  if (physical_end > addr_max)
-	    physical_end = addr_max;
-
-	  if (physical_end <= 0x7fffffffUL && physical_end > addr)
-	    addr = physical_end - page_align (size);
-	}
-    }
-
-  if (addr == 0)
+  /* Put the initrd at the top of the smallest free region below 2GB
+     that it fits in.  */
+  if (addr_max > 0x80000000UL)
+    addr_max = 0x80000000UL;
+  initrd_mem = grub_efi_allocate_best_fit (addr_min, addr_max - 1,
+					   initrd_pages, 0, 1);
+  if (! initrd_mem)
     {
       errnum = ERR_UNRECOGNIZED;
       grub_printf ("no free pages available");
       goto fail;
     }
+  addr = (grub_addr_t) initrd_mem;
 
-  initrd_mem = grub_efi_allocate_pages (addr, initrd_pages);
-  if (! initrd_mem)
-    grub_fatal ("cannot allocate pages: %x@%x", (unsigned)initrd_pages,
-		(unsigned)addr);
-
-  if (grub_read (initrd_mem, size) != size)
+  if (! initrd_read (initrd, initrd_mem, size))
     {
+      if (errnum == ERR_NONE)
+	errnum = ERR_READ;
       grub_printf ("Couldn't read file");
       goto fail;
     }
@@ -642,7 +667,5 @@ grub_load_initrd (char *initrd)
   params->hdr.ramdisk_size = size;
 
  fail:
-  grub_close ();
- fail1:
   return !errnum;
 }
@@ -160,6 +160,26 @@ static void grub_dump_dhcp_options(EFI_PXE_BASE_CODE_PACKET *packet)
 
 }
 
+/* Copy the DHCP ACK the firmware got when it loaded us to BUF, which
+ * holds SIZE bytes, and return how much was copied, or 0 if there is
+ * no lease. */
+int grub_efi_pxe_dhcp_ack(void *buf, int size)
+{
+	EFI_PXE_BASE_CODE *pxe = NULL;
+
+	pxe = grub_efi_locate_protocol(&PxeBaseCodeProtocol, NULL);
+	if (pxe == NULL || pxe->Mode == NULL)
+		return 0;
+	if (!pxe->Mode->Started || !pxe->Mode->DhcpAckReceived
+			|| pxe->Mode->UsingIpv6)
+		return 0;
+
+	if (size > (int)sizeof(pxe->Mode->DhcpAck))
+		size = sizeof(pxe->Mode->DhcpAck);
+	memcpy(buf, &pxe->Mode->DhcpAck, size);
+	return size;
+}
+
 void grub_print_dhcp_info(grub_efi_loaded_image_t *loaded_image)
 {
 	EFI_PXE_BASE_CODE *pxe = NULL;
@@ -335,16 +355,17 @@ static void set_pxe_info(grub_efi_loaded_image_t *LoadedImage,
 char *grub_efi_pxe_get_config_path(grub_efi_loaded_image_t *LoadedImage)
 {
 	EFI_PXE_BASE_CODE *pxe = NULL;
-	EFI_IP_ADDRESS ServerIp;
-	char *FileName = NULL;
 	EFI_PXE_BASE_CODE_DHCPV4_PACKET *packet;
 	uuid_t uuid;
 	grub_efi_uintn_t FileSize = 0;
 	grub_efi_status_t rc = GRUB_EFI_SUCCESS;
-	char *ConfigPath = NULL;
 	char hex[] = "0123456789ABCDEF";
 	char hexip[9];
 	int hexiplen;
+	/* uuid, 01-mac, 8 prefixes of the hex ip and efidefault */
+	char Names[11][37];
+	int NumNames = 0;
+	int i;
 
 	grub_efi_handle_t *handle, *handles;
 	grub_efi_uintn_t num_handles;
@@ -371,29 +392,23 @@ char *grub_efi_pxe_get_config_path(grub_efi_loaded_image_t *LoadedImage)
 
 	set_pxe_info(LoadedImage, pxe);
 
-	FileName = grub_malloc(strlen("1902dcf5-7190-d811-bbd6-6ef21c690030"));
-
+	/*
+	 * Collect the names pxelinux would look for, most specific first,
+	 * and use the first one the server has.  tftp_get_file_size
+	 * remembers the answers, so the server isn't asked about the
+	 * chosen file again when it is opened.
+	 */
 	packet = &pxe->Mode->DhcpDiscover.Dhcpv4;
 
 	if (get_dhcp_client_id((EFI_PXE_BASE_CODE_PACKET *)packet, &uuid)) {
 
 		uuid.time_mid = 0x0011;
-		sprintf(FileName,
+		sprintf(Names[NumNames++],
 			"%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
 			uuid.time_low, uuid.time_mid, uuid.time_hi_ver,
 			uuid.clock_seq_hi, uuid.clock_seq_low,
 			uuid.node[0], uuid.node[1], uuid.node[2],
 			uuid.node[3], uuid.node[4], uuid.node[5]);
-
-		rc = tftp_get_file_size(FileName, &FileSize);
-		if (rc == GRUB_EFI_SUCCESS) {
-			char *ReturnFile = grub_malloc(strlen("(nd)/") +
-						strlen(FileName) + 1);
-			sprintf(ReturnFile, "(nd)/%s", FileName);
-			grub_free(FileName);
-			//sprintf(tftp_info.LastPath, FileName);
-			return ReturnFile;
-		}
 	}
 
 	packet = &pxe->Mode->DhcpAck.Dhcpv4;
@@ -402,8 +417,7 @@ char *grub_efi_pxe_get_config_path(grub_efi_loaded_image_t *LoadedImage)
 					     "\x00\x00\x00\x00\x00", 10) &&
 			memcmp(packet->BootpHwAddr, "\x00\x00\x00\x00\x00\x00",
 				6)) {
-		char mac[21];
-		sprintf(mac, "01-%c%c-%c%c-%c%c-%c%c-%c%c-%c%c",
+		sprintf(Names[NumNames++], "01-%c%c-%c%c-%c%c-%c%c-%c%c-%c%c",
 			hex[(packet->BootpHwAddr[0] & 0xf0) >> 4],
 			hex[packet->BootpHwAddr[0] & 0xf],
 			hex[(packet->BootpHwAddr[1] & 0xf0) >> 4],
@@ -416,15 +430,6 @@ char *grub_efi_pxe_get_config_path(grub_efi_loaded_image_t *LoadedImage)
 			hex[packet->BootpHwAddr[4] & 0xf],
 			hex[(packet->BootpHwAddr[5] & 0xf0) >> 4],
 			hex[packet->BootpHwAddr[5] & 0xf]);
-
-		rc = tftp_get_file_size(mac, &FileSize);
-		if (rc == GRUB_EFI_SUCCESS) {
-			char *ReturnFile = grub_malloc(strlen("(nd)/") +
-						strlen(mac) + 1);
-			sprintf(ReturnFile, "(nd)/%s", mac);
-			return ReturnFile;
-		}
-
 	}
 
 	sprintf(hexip, "%c%c%c%c%c%c%c%c",
@@ -440,21 +445,20 @@ char *grub_efi_pxe_get_config_path(grub_efi_loaded_image_t *LoadedImage)
 	for (hexiplen = strlen(hexip); hexiplen > 0; hexiplen--)
 	{
 		hexip[hexiplen] = '\0';
-		rc = tftp_get_file_size(hexip, &FileSize);
+		strcpy(Names[NumNames++], hexip);
+	}
+
+	strcpy(Names[NumNames++], "efidefault");
+
+	for (i = 0; i < NumNames; i++) {
+		rc = tftp_get_file_size(Names[i], &FileSize);
 		if (rc == GRUB_EFI_SUCCESS) {
 			char *ReturnFile = grub_malloc(strlen("(nd)/") +
-						strlen(hexip) + 1);
-			sprintf(ReturnFile, "(nd)/%s", hexip);
+						strlen(Names[i]) + 1);
+			sprintf(ReturnFile, "(nd)/%s", Names[i]);
 			return ReturnFile;
 		}
 	}
 
-	rc = tftp_get_file_size("efidefault", &FileSize);
-	if (rc == GRUB_EFI_SUCCESS) {
-		char *ReturnFile = grub_malloc(strlen("(nd)/efidefault")+1);
-		sprintf(ReturnFile, "(nd)/efidefault");
-		return ReturnFile;
-	}
-
 	return NULL;
 }
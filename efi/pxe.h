@@ -6,6 +6,10 @@
 extern char *grub_efi_pxe_get_config_path(grub_efi_loaded_image_t *LoadedImage);
 extern void grub_print_dhcp_info(grub_efi_loaded_image_t *loaded_image);
 extern char *grub_efi_pxe_path_to_path_name(void);
+extern int grub_efi_pxe_dhcp_ack(void *buf, int size);
+#ifdef SUPPORT_NETBOOT
+extern int efi_nic_ready(void);
+#endif
 
 
 #define EFI_PXE_BASE_CODE_PROTOCOL \
@@ -54,7 +58,7 @@ typedef struct {
 	grub_efi_uint16_t TransmitTimeout;
 } EFI_PXE_BASE_CODE_MTFTP_INFO;
 
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_MTFTP)(
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_MTFTP)(
 	struct _EFI_PXE_BASE_CODE *This,
 	EFI_PXE_BASE_CODE_TFTP_OPCODE Operation,
 	void *BufferPtr,
@@ -182,17 +186,17 @@ typedef struct {
     EFI_PXE_BASE_CODE_TFTP_ERROR    TftpError;
 } EFI_PXE_BASE_CODE_MODE;
 
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_START)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_STOP)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_DHCP)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_DISCOVER)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_UDP_WRITE)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_UDP_READ)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_SET_IP_FILTER)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_ARP)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_SET_PARAMETERS)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_SET_STATION_IP)();
-typedef EFI_STATUS (*EFI_PXE_BASE_CODE_SET_PACKETS)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_START)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_STOP)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_DHCP)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_DISCOVER)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_UDP_WRITE)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_UDP_READ)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_SET_IP_FILTER)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_ARP)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_SET_PARAMETERS)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_SET_STATION_IP)();
+typedef EFI_STATUS (GRUB_EFI_API *EFI_PXE_BASE_CODE_SET_PACKETS)();
 
 typedef struct _EFI_PXE_BASE_CODE{
 	grub_efi_uint64_t Revision;
@@ -27,6 +27,7 @@
 #include "switch.h"
 
 #include <shared.h>
+#include <bootprof.h>
 
 #include "graphics.h"
 
@@ -37,6 +38,10 @@
 
 #define PTR_HI(x) ((grub_uint32_t) ((unsigned long long)((unsigned long)(x)) >> 32))
 
+/* The kernel is entered through code32_start, so it must sit below 4GB
+   even when GRUB could reach memory above that.  */
+#define KERNEL_MAX_ADDRESS	0xffffffffUL
+
 #ifndef SECTOR_SIZE
 #define SECTOR_SIZE 0x200
 #endif /* defined(SECTOR_SIZE) */
@@ -47,14 +52,30 @@
 static unsigned long linux_mem_size;
 static int loaded;
 static void *real_mode_mem;
-static void *prot_mode_mem;
-static grub_size_t prot_kernel_size;
+static void *kernel_mem;
 static void *initrd_mem;
 static grub_efi_uintn_t real_mode_pages;
-static grub_efi_uintn_t prot_mode_pages;
+static grub_efi_uintn_t kernel_pages;
 static grub_efi_uintn_t initrd_pages;
+/* Where the e820 entries go which don't fit in the boot parameters,
+   after the command line, or 0 if the kernel can't take them.  */
+static struct linux_setup_data *e820_ext;
 static grub_efi_guid_t graphics_output_guid = GRUB_EFI_GRAPHICS_OUTPUT_GUID;
 
+/* Whether the kernel loaded is entered at its EFI handover entry, with
+   the boot services still up, rather than through the switch image.  */
+static int linux_handover;
+
+/* Whether the kernel loaded can load its initrd itself, through the
+   LoadFile2 protocol on the LINUX_EFI_INITRD_MEDIA device path, and
+   the files that make it up, with their size, when it is to.  */
+static int initrd_media_ok;
+static char *initrd_media;
+static grub_ssize_t initrd_media_size;
+static grub_efi_handle_t initrd_media_handle;
+
+static void initrd_media_forget (void);
+
 static inline grub_size_t
 page_align (grub_size_t size)
 {
@@ -68,6 +89,13 @@ free_pages (void)
     {
       grub_efi_free_pages ((grub_addr_t) real_mode_mem, real_mode_pages);
       real_mode_mem = 0;
+      e820_ext = 0;
+    }
+
+  if (kernel_mem)
+    {
+      grub_efi_free_pages ((grub_addr_t) kernel_mem, kernel_pages);
+      kernel_mem = 0;
     }
 
   if (initrd_mem)
@@ -83,75 +111,26 @@ free_pages (void)
     }
 }
 
-/* Allocate pages for the real mode code and the protected mode code
-   for linux as well as a memory map buffer.  */
+/* Allocate pages for the real mode code for linux as well as, if
+   WANT_MMAP, a memory map buffer.  The protected mode code is read
+   straight into the pages that allocate_kernel_pages finds for it.  */
 static int
-allocate_pages (grub_size_t real_size, grub_size_t prot_size)
+allocate_pages (grub_size_t real_size, int want_mmap)
 {
-  grub_efi_uintn_t desc_size;
-  grub_efi_memory_descriptor_t *mmap_end;
-  grub_efi_memory_descriptor_t *desc;
-  grub_efi_physical_address_t addr;
-
-  /* Make sure that each size is aligned to a page boundary.  */
+  /* Make sure that the size is aligned to a page boundary.  */
   real_size = page_align (real_size + SECTOR_SIZE);
-  prot_size = page_align (prot_size);
 
-  grub_dprintf ("linux", "real_size = %x, prot_size = %x, mmap_size = %x\n",
-		(unsigned int) real_size, (unsigned int) prot_size,
-		(unsigned int) mmap_size);
+  grub_dprintf ("linux", "real_size = %x, mmap_size = %x\n",
+		(unsigned int) real_size, (unsigned int) mmap_size);
 
   /* Calculate the number of pages; Combine the real mode code with
      the memory map buffer for simplicity.  */
   real_mode_pages = (real_size >> 12);
-  prot_mode_pages = (prot_size >> 12);
-
-  /* Initialize the memory pointers with NULL for convenience.  */
-  real_mode_mem = 0;
-  prot_mode_mem = 0;
-
-  if (grub_efi_get_memory_map (0, &desc_size, 0) <= 0)
-    grub_fatal ("cannot get memory map");
-
-  addr = 0;
-  mmap_end = NEXT_MEMORY_DESCRIPTOR (mmap_buf, mmap_size);
-  /* First, find free pages for the real mode code
-     and the memory map buffer.  */
-  for (desc = mmap_buf;
-       desc < mmap_end;
-       desc = NEXT_MEMORY_DESCRIPTOR (desc, desc_size))
-    {
-      if (desc->type == GRUB_EFI_CONVENTIONAL_MEMORY
-	  && desc->num_pages >= real_mode_pages)
-	{
-	  grub_efi_physical_address_t physical_end;
 
-          physical_end = desc->physical_start + (desc->num_pages << 12);
-
-          grub_dprintf ("linux", "physical_start = %x, physical_end = %x\n",
-                        (unsigned) desc->physical_start,
-                        (unsigned) physical_end);
-          addr = physical_end - real_size;
-          if (addr < 0x100000)
-            continue;
-
-          /* the kernel wants this address to be under 1 gig.*/
-          if (desc->physical_start > 0x40000000 - real_size)
-            continue;
-
-          if (addr > 0x40000000 - real_size)
-            addr = 0x40000000 - real_size;
-
-          grub_dprintf ("linux", "trying to allocate %u pages at %x\n",
-                        (unsigned) real_mode_pages, (unsigned) addr);
-          real_mode_mem = grub_efi_allocate_pages (addr, real_mode_pages);
-          if (! real_mode_mem)
-            grub_fatal ("cannot allocate pages");
-
-          desc->num_pages -= real_mode_pages;
-          break;
-	}
-    }
+  /* First, find free pages for the real mode code and the memory map
+     buffer, above 1MB; the kernel wants this address to be under 1 gig.  */
+  real_mode_mem = grub_efi_allocate_best_fit (0x100000, 0x40000000 - 1,
+					      real_mode_pages, 0, 1);
 
   if (! real_mode_mem)
     {
@@ -160,14 +139,15 @@ allocate_pages (grub_size_t real_size, grub_size_t prot_size)
       goto fail;
     }
 
-  grub_printf("Trying to allocate %u pages for VMLINUZ\n",
-		(unsigned) prot_mode_pages);
-  prot_mode_mem = grub_efi_allocate_anypages(prot_mode_pages);
+  /* Have the memory map buffer ready now, with room to spare, so that
+     nothing is allocated when the map is taken to boot.  */
+  if (want_mmap && ! grub_efi_reserve_memory_map ())
+    {
+      grub_printf ("cannot allocate memory for memory map");
+      errnum = ERR_WONT_FIT;
+      goto fail;
+    }
 
-  if (!prot_mode_mem)
-	grub_fatal("Cannot allocate pages for VMLINUZ");
-  grub_printf("Got pages at %p\n", prot_mode_mem);
- 
   return 1;
 
  fail:
@@ -175,6 +155,74 @@ allocate_pages (grub_size_t real_size, grub_size_t prot_size)
   return 0;
 }
 
+/* Allocate the pages where the kernel described by LH runs, at its
+   preferred address or, if it is relocatable, wherever it fits with
+   the largest alignment it accepts, and point LH at them.  The kernel
+   needs at least PROT_SIZE bytes there.  */
+static int
+allocate_kernel_pages (struct grub_linux_kernel_header *lh,
+		       grub_size_t prot_size)
+{
+  grub_uint64_t kernel_base, kernel_length;
+  int align = 0, min_alignment;
+  int relocatable = 0;
+
+  if (lh->version >= 0x205) {
+    for (align = lh->min_alignment; align < 32; align++) {
+      if (lh->kernel_alignment & (1 << align)) {
+	break;
+      }
+    }
+    relocatable = lh->relocatable_kernel;
+  }
+
+  if (lh->version >= 0x20a) {
+    kernel_base = lh->pref_address;
+    kernel_length = lh->init_size;
+    min_alignment = lh->min_alignment;
+  } else {
+    kernel_base = lh->code32_start;
+    kernel_length = prot_size;
+    min_alignment = 0;
+  }
+
+  if (kernel_length < prot_size)
+    kernel_length = prot_size;
+
+  kernel_pages = (kernel_length + 4095) >> 12;
+
+  /* Attempt to allocate address space for the kernel */
+  kernel_base = (grub_addr_t) grub_efi_allocate_high_pages (kernel_base,
+							    kernel_pages,
+							    KERNEL_MAX_ADDRESS);
+
+  /* Otherwise take the largest alignment that some free region can
+     still give it.  */
+  if (!kernel_base && relocatable) {
+    while (align >= min_alignment) {
+      kernel_base = (grub_addr_t)
+	grub_efi_allocate_best_fit (0x100000, KERNEL_MAX_ADDRESS,
+				    kernel_pages,
+				    (grub_efi_uint64_t) 1 << align, 0);
+      if (kernel_base) {
+	lh->kernel_alignment = 1 << align;
+	break;
+      }
+      align--;
+    }
+  }
+
+  if (!kernel_base) {
+    grub_printf("Failed to allocate kernel memory");
+    errnum = ERR_UNRECOGNIZED;
+    return 0;
+  }
+
+  kernel_mem = (void *) (unsigned long) kernel_base;
+  lh->code32_start = kernel_base;
+  return 1;
+}
+
 /* do some funky stuff, then boot linux */
 void
 linux_boot (void)
@@ -278,38 +326,116 @@ grub_efi_disable_network (void)
     }
 }
 
+/* Whether the kernel whose setup header is LH has a 64-bit EFI
+   handover entry.  */
+static int
+linux_has_handover (struct grub_linux_kernel_header *lh)
+{
+  return (grub_le_to_cpu16 (lh->version) >= 0x20c
+	  && lh->handover_offset
+	  && (lh->xloadflags & GRUB_LINUX_XLF_EFI_HANDOVER_64));
+}
+
+/* Whether the kernel whose first bytes are in PARAMS loads its initrd
+   through LoadFile2 when entered at its EFI handover entry, which the
+   image version of 1 or more in its PE header says.  */
+static int
+linux_takes_initrd_media (struct linux_kernel_params *params)
+{
+  char *image = (char *) params;
+  grub_uint32_t pe;
+
+  if (image[0] != 'M' || image[1] != 'Z')
+    return 0;
+  pe = grub_le_to_cpu32 (*(grub_uint32_t *) (image + 0x3c));
+  /* The signature, the COFF header, and the optional header up to the
+     major image version.  */
+  if (pe > sizeof (*params) - (4 + 20 + 46)
+      || grub_memcmp (image + pe, "PE\0\0", 4))
+    return 0;
+
+  return grub_le_to_cpu16 (*(grub_uint16_t *) (image + pe + 4 + 20 + 44)) >= 1;
+}
+
+#ifdef __x86_64__
+typedef void (*linux_handover_t) (grub_efi_handle_t image_handle,
+				  grub_efi_system_table_t *system_table,
+				  struct linux_kernel_params *params);
+
+/* Enter the kernel at its 64-bit EFI handover entry with PARAMS.  Its
+   EFI stub moves the kernel if it has to, pulls the initrd through the
+   protocol installed for it if there is one, and takes the memory map
+   as it leaves the boot services itself.  */
+static void
+linux_efi_handover (struct linux_kernel_params *params)
+{
+  linux_handover_t handover;
+
+  handover = (linux_handover_t) ((char *) kernel_mem
+				 + params->hdr.handover_offset + 512);
+  handover (grub_efi_image_handle, grub_efi_system_table, params);
+}
+#endif
+
 void
 big_linux_boot (void)
 {
   struct linux_kernel_params *params;
   struct grub_linux_kernel_header *lh;
-  grub_efi_uintn_t map_key;
   grub_efi_uintn_t desc_size;
   grub_efi_uint32_t desc_version;
   int e820_nr_map;
+  int ext_nr_map = 0;
 
   params = real_mode_mem;
 
   graphics_set_kernel_params (params);
 
-  grub_efi_disable_network();
+  grub_flush_saved_default ();
+  grub_save_boot_profile ();
 
-  if (grub_efi_get_memory_map (&map_key, &desc_size, &desc_version) <= 0)
-    grub_fatal ("cannot get memory map");
+  grub_efi_bootprof_export ();
+  grub_efi_bootlog_export ();
 
-  /* Pass e820 memmap. */
-  e820_map_from_efi_map ((struct e820_entry *) params->e820_map, &e820_nr_map,
-			 mmap_buf, desc_size, mmap_size);
-  params->e820_nr_map = e820_nr_map;
+  /* An initrd served through LoadFile2 may come over the network, which
+     then goes down once it is read.  */
+  if (! initrd_media_handle)
+    grub_efi_disable_network();
+
+#ifdef __x86_64__
+  if (linux_handover)
+    {
+      bootprof_mark ("EFI handover");
+      linux_efi_handover (real_mode_mem);
+      grub_fatal ("cannot enter the kernel");
+    }
+#endif
 
-  if (! grub_efi_exit_boot_services (map_key))
+  bootprof_mark ("ExitBootServices");
+
+  /* Pass e820 memmap. */
+  if (! grub_efi_exit_boot_services_with_map ((struct e820_entry *)
+					      params->e820_map,
+					      &e820_nr_map,
+					      (e820_ext
+					       ? ((struct e820_entry *)
+						  e820_ext->data)
+					       : 0),
+					      &ext_nr_map,
+					      GRUB_LINUX_E820_EXT_MAX,
+					      &desc_size, &desc_version))
     grub_fatal ("cannot exit boot services");
+  params->e820_nr_map = e820_nr_map;
+  if (ext_nr_map)
+    {
+      e820_ext->next = 0;
+      e820_ext->type = GRUB_LINUX_SETUP_E820_EXT;
+      e820_ext->len = ext_nr_map * sizeof (struct e820_entry);
+      params->hdr.setup_data = (grub_uint64_t) (unsigned long) e820_ext;
+    }
 
   /* Note that no boot services are available from here.  */
 
-  /* copy vmlinuz image to hdr.code32_start */
-  memcpy ((char *)(unsigned long)(params->hdr.code32_start), (char *)prot_mode_mem,
-	  prot_kernel_size);
   /* copy switch image */
   memcpy ((void *) 0x700, switch_image, switch_size);
 
@@ -371,11 +497,13 @@ grub_load_linux (char *kernel, char *arg)
   static struct linux_kernel_params params_buf;
   grub_uint8_t setup_sects;
   grub_size_t real_size, prot_size;
-  grub_uint64_t kernel_base, kernel_length, kernel_pages;
+  grub_size_t ext_offset;
   grub_ssize_t len;
   char *dest;
-  int align, min_alignment;
-  int relocatable = 0;
+
+  initrd_media_forget ();
+  linux_handover = 0;
+  initrd_media_ok = 0;
 
   if (kernel == NULL)
     {
@@ -421,14 +549,42 @@ grub_load_linux (char *kernel, char *arg)
       goto fail;
     }
 
+#ifdef __x86_64__
+  linux_handover = linux_has_handover (lh);
+  initrd_media_ok = (linux_handover
+		     && linux_takes_initrd_media (&params_buf));
+#endif
+
   setup_sects = lh->setup_sects;
 
   real_size = 0x1000 + grub_strlen(arg);
   prot_size = grub_file_size () - (setup_sects << SECTOR_BITS) - SECTOR_SIZE;
-  prot_kernel_size = prot_size;
 
-  if (! allocate_pages (real_size, prot_size))
+  /* Leave room for the e820 entries which don't fit in the boot
+     parameters after the command line, if the kernel takes them.  The
+     EFI stub of one entered at its handover entry makes them itself,
+     from the memory map it takes.  */
+  ext_offset = 0;
+  if (! linux_handover && grub_le_to_cpu16 (lh->version) >= 0x0209)
+    {
+      ext_offset = (real_size + 1 + 7) & ~7;
+      real_size = (ext_offset + sizeof (struct linux_setup_data)
+		   + GRUB_LINUX_E820_EXT_MAX * sizeof (struct e820_entry));
+    }
+
+  if (! allocate_pages (real_size, ! linux_handover))
     goto fail;
+  if (ext_offset)
+    e820_ext = (struct linux_setup_data *) ((char *) real_mode_mem
+					    + ext_offset);
+
+  /* Before the header is copied into the real mode code, since this
+     sets code32_start.  */
+  if (! allocate_kernel_pages (lh, prot_size))
+    {
+      free_pages ();
+      goto fail;
+    }
 
   /* XXX Linux assumes that only elilo can boot Linux on EFI!!!  */
   lh->type_of_loader = 0x50;
@@ -555,99 +711,222 @@ grub_load_linux (char *kernel, char *arg)
 
   dest = grub_stpcpy ((char *) real_mode_mem + 0x1000, skip_to(0, arg));
 
+  /* Straight to where the kernel runs.  */
   grub_seek ((setup_sects << SECTOR_BITS) + SECTOR_SIZE);
   len = prot_size;
-  if (grub_read ((char *)prot_mode_mem, len) != len)
+  if (grub_read ((char *) kernel_mem, len) != len)
     grub_printf ("Couldn't read file");
 
-  if (lh->version >= 0x205) {
-    for (align = lh->min_alignment; align < 32; align++) {
-      if (lh->kernel_alignment & (1 << align)) {
-	break;
-      }
+  if (errnum == ERR_NONE)
+    {
+      loaded = 1;
     }
-    relocatable = lh->relocatable_kernel;
-  }
 
-  if (lh->version >= 0x20a) {
-    kernel_base = lh->pref_address;
-    kernel_length = lh->init_size;
-    min_alignment = lh->min_alignment;
-  } else {
-    kernel_base = lh->code32_start;
-    kernel_length = prot_kernel_size;
-    min_alignment = 0;
-  }
+ fail:
 
-  kernel_pages = (kernel_length + 4095) >> 12;
+  grub_close ();
 
-  /* Attempt to allocate address space for the kernel */
-  kernel_base = grub_efi_allocate_pages(kernel_base, kernel_pages);
+ fail1:
 
-  if (!kernel_base && relocatable) {
-    grub_efi_memory_descriptor_t *desc;
-    grub_efi_memory_descriptor_t tdesc;
-    grub_efi_uintn_t desc_size;
+  if (errnum != ERR_NONE)
+    {
+      loaded = 0;
+    }
+  return errnum ? KERNEL_TYPE_NONE : KERNEL_TYPE_BIG_LINUX;
+}
 
-    if (grub_efi_get_memory_map (0, &desc_size, 0) <= 0)
-      grub_fatal ("cannot get memory map");
+/* Cpio archives that follow one another must start on a 4-byte
+   boundary.  */
+#define INITRD_ALIGN(size)	(((size) + 3) & ~3)
 
-    while (align >= min_alignment) {
-      for (desc = mmap_buf;
-	   desc < NEXT_MEMORY_DESCRIPTOR (mmap_buf, mmap_size);
-	   desc = NEXT_MEMORY_DESCRIPTOR (desc, desc_size))
-	{
-	  grub_uint64_t addr;
-	  grub_uint64_t alignval = (1 << align) - 1;
+/* Return the size of the initrd made of the files in INITRD, each but
+   the last padded to a 4-byte boundary, and of the archive its options
+   make after them, or -1 if a file can't be opened.  */
+static grub_ssize_t
+initrd_size (char *initrd)
+{
+  grub_ssize_t size = 0;
+  char *name;
+  int cpio;
 
-	  if (desc->type != GRUB_EFI_CONVENTIONAL_MEMORY)
-	    continue;
+  for (name = initrd; *name; name = skip_to (0, name))
+    {
+      if (initrd_cpio_option (name))
+	continue;
 
-	  memcpy(&tdesc, desc, sizeof(tdesc));
+      if (! grub_open (name))
+	return -1;
 
-	  addr = (tdesc.physical_start + alignval) & ~(alignval);
+      size = INITRD_ALIGN (size) + grub_file_size ();
+      grub_close ();
+    }
 
-	  if ((addr + kernel_length) >
-	      (tdesc.physical_start + (tdesc.num_pages << 12)))
-	    continue;
+  cpio = initrd_cpio_size (initrd);
+  if (cpio < 0)
+    return -1;
+  if (cpio)
+    size = INITRD_ALIGN (size) + cpio;
 
-	  kernel_base = grub_efi_allocate_pages(addr, kernel_pages);
+  return size;
+}
 
-	  if (kernel_base) {
-	    lh->kernel_alignment = 1 << align;
-	    break;
-	  }
+/* Read the files in INITRD one after another straight into ADDR, which
+   has room for SIZE bytes, then make the archive of its options, and
+   zero the padding between them.  */
+static int
+initrd_read (char *initrd, char *addr, grub_ssize_t size)
+{
+  grub_ssize_t len = 0, file_size;
+  char *name;
+
+  for (name = initrd; *name; name = skip_to (0, name))
+    {
+      if (initrd_cpio_option (name))
+	continue;
+
+      grub_memset (addr + len, 0, INITRD_ALIGN (len) - len);
+      len = INITRD_ALIGN (len);
+
+      if (! grub_open (name))
+	return 0;
+
+      file_size = grub_file_size ();
+      if (len + file_size > size
+	  || grub_read (addr + len, file_size) != file_size)
+	{
+	  grub_close ();
+	  return 0;
 	}
-      align--;
-      if (kernel_base)
-	break;
+
+      grub_close ();
+      len += file_size;
     }
-  }
 
-  if (!kernel_base) {
-    grub_printf("Failed to allocate kernel memory");
-    errnum = ERR_UNRECOGNIZED;
-    goto fail;
-  }
+  if (len < size)
+    {
+      int cpio;
+
+      grub_memset (addr + len, 0, INITRD_ALIGN (len) - len);
+      len = INITRD_ALIGN (len);
+      cpio = initrd_cpio_build (initrd, addr + len);
+      if (cpio < 0 || len + cpio > size)
+	return 0;
+      len += cpio;
+    }
 
-  lh->code32_start = kernel_base;
+  return len == size;
+}
 
-  if (errnum == ERR_NONE)
+static grub_efi_guid_t device_path_guid = GRUB_EFI_DEVICE_PATH_GUID;
+static grub_efi_guid_t load_file2_guid = GRUB_EFI_LOAD_FILE2_GUID;
+
+/* The device path the kernel's EFI stub looks for its initrd on.  */
+static struct
+{
+  grub_efi_vendor_media_device_path_t vendor;
+  grub_efi_device_path_t end;
+} __attribute__ ((packed)) initrd_media_path =
+  {
     {
-      loaded = 1;
+      { GRUB_EFI_MEDIA_DEVICE_PATH_TYPE,
+	GRUB_EFI_VENDOR_MEDIA_DEVICE_PATH_SUBTYPE,
+	{ sizeof (grub_efi_vendor_media_device_path_t), 0 } },
+      /* LINUX_EFI_INITRD_MEDIA_GUID */
+      { 0x5568e427, 0x68fc, 0x4f3d,
+	{ 0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68 } }
+    },
+    { GRUB_EFI_END_DEVICE_PATH_TYPE, GRUB_EFI_END_ENTIRE_DEVICE_PATH_SUBTYPE,
+      { sizeof (grub_efi_device_path_t), 0 } }
+  };
+
+/* Read the initrd into BUFFER, which has room for *BUFFER_SIZE bytes,
+   or tell in *BUFFER_SIZE how much room it needs.  The kernel calls
+   this once to know the size, and again when it has put the buffer
+   where it wants it.  */
+static grub_efi_status_t GRUB_EFI_API
+initrd_media_load (grub_efi_load_file2_t *this,
+		   grub_efi_device_path_t *file_path,
+		   grub_efi_boolean_t boot_policy,
+		   grub_efi_uintn_t *buffer_size, void *buffer)
+{
+  if (boot_policy)
+    return GRUB_EFI_UNSUPPORTED;
+  if (! buffer_size)
+    return GRUB_EFI_INVALID_PARAMETER;
+  if (! buffer || *buffer_size < (grub_efi_uintn_t) initrd_media_size)
+    {
+      *buffer_size = initrd_media_size;
+      return GRUB_EFI_BUFFER_TOO_SMALL;
     }
 
- fail:
+  errnum = ERR_NONE;
+  if (! initrd_read (initrd_media, buffer, initrd_media_size))
+    return GRUB_EFI_DEVICE_ERROR;
+  *buffer_size = initrd_media_size;
 
-  grub_close ();
+  /* Nothing else is read before the kernel takes over.  */
+  grub_efi_disable_network ();
+  return GRUB_EFI_SUCCESS;
+}
 
- fail1:
+static grub_efi_load_file2_t initrd_media_load_file2 = { initrd_media_load };
 
-  if (errnum != ERR_NONE)
+/* Serve the initrd made of the files in INITRD, SIZE bytes in all, to
+   the kernel through LoadFile2.  Return nonzero if it can be.  */
+static int
+initrd_media_install (char *initrd, grub_ssize_t size)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+
+  initrd_media = grub_strndup (initrd, grub_strlen (initrd));
+  if (! initrd_media)
+    return 0;
+  initrd_media_size = size;
+
+  if (Call_Service_4 (b->install_protocol_interface, &initrd_media_handle,
+		      &device_path_guid, GRUB_EFI_NATIVE_INTERFACE,
+		      &initrd_media_path) != GRUB_EFI_SUCCESS)
     {
-      loaded = 0;
+      initrd_media_handle = 0;
+      initrd_media_forget ();
+      return 0;
     }
-  return errnum ? KERNEL_TYPE_NONE : KERNEL_TYPE_BIG_LINUX;
+
+  if (Call_Service_4 (b->install_protocol_interface, &initrd_media_handle,
+		      &load_file2_guid, GRUB_EFI_NATIVE_INTERFACE,
+		      &initrd_media_load_file2) != GRUB_EFI_SUCCESS)
+    {
+      Call_Service_3 (b->uninstall_protocol_interface, initrd_media_handle,
+		      &device_path_guid, &initrd_media_path);
+      initrd_media_handle = 0;
+      initrd_media_forget ();
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Take back an initrd served through LoadFile2, if there is one.  */
+static void
+initrd_media_forget (void)
+{
+  grub_efi_boot_services_t *b = grub_efi_system_table->boot_services;
+
+  if (initrd_media_handle)
+    {
+      Call_Service_3 (b->uninstall_protocol_interface, initrd_media_handle,
+		      &load_file2_guid, &initrd_media_load_file2);
+      Call_Service_3 (b->uninstall_protocol_interface, initrd_media_handle,
+		      &device_path_guid, &initrd_media_path);
+      initrd_media_handle = 0;
+    }
+
+  if (initrd_media)
+    {
+      grub_free (initrd_media);
+      initrd_media = 0;
+    }
+  initrd_media_size = 0;
 }
 
 int
@@ -656,105 +935,94 @@ grub_load_initrd (char *initrd)
   grub_ssize_t size;
   grub_addr_t addr_min, addr_max;
   grub_addr_t addr;
-  grub_efi_memory_descriptor_t *desc;
-  grub_efi_memory_descriptor_t tdesc;
-  grub_efi_uintn_t desc_size;
   struct linux_kernel_params *params;
+  struct grub_linux_kernel_header *lh;
 
-  if (initrd == NULL)
+  if (initrd == NULL || ! *initrd)
     {
       errnum = ERR_BAD_FILENAME;
       grub_printf ("No module specified");
-      goto fail1;
+      goto fail;
     }
 
   if (! loaded)
     {
       errnum = ERR_UNRECOGNIZED;
       grub_printf ("You need to load the kernel first.");
-      goto fail1;
+      goto fail;
     }
 
-  if (! grub_open (initrd))
-    goto fail1;
+  /* Several files make up one initrd, the way the kernel takes
+     concatenated cpio archives.  Their sizes are found first, so that
+     they can all be read into one place with no copies.  */
+  initrd_media_forget ();
+
+  size = initrd_size (initrd);
+  if (size < 0)
+    goto fail;
+
+  /* A kernel that loads its initrd itself gets it read straight into
+     where it puts it, when it asks, rather than copied in beforehand.  */
+  if (initrd_media_ok && initrd_media_install (initrd, size))
+    {
+      grub_printf ("   [Initrd, LoadFile2, size=0x%x]\n",
+		   (unsigned int) size);
+      return 1;
+    }
 
-  size = grub_file_size ();
   initrd_pages = (page_align (size) >> 12);
 
   params = (struct linux_kernel_params *) real_mode_mem;
+  lh = &params->hdr;
   grub_dprintf(__func__, "initrd_pages: %lu\n", initrd_pages);
 
-  addr_max = grub_cpu_to_le32 (params->hdr.initrd_addr_max);
+  /* A kernel that says it can take its initrd above 4GB gets it
+     anywhere; the rest get it below the limit they give, or below the
+     one the boot protocol had before there was a field for it.  */
+  if (lh->version >= 0x20c
+      && (lh->xloadflags & GRUB_LINUX_XLF_CAN_BE_LOADED_ABOVE_4G))
+    addr_max = (grub_addr_t) -1;
+  else if (lh->version >= 0x203)
+    addr_max = grub_cpu_to_le32 (lh->initrd_addr_max);
+  else
+    addr_max = LINUX_INITRD_MAX_ADDRESS;
   if (linux_mem_size != 0 && linux_mem_size < addr_max)
     addr_max = linux_mem_size;
-  addr_max &= ~((1 << 12)-1);
-
-  /* Usually, the compression ratio is about 50%.  */
-  addr_min = 0;
-
-  /* Find the highest address to put the initrd.  */
-  grub_dprintf(__func__, "addr_min: 0x%lx addr_max: 0x%lx mmap_size: %lu\n", addr_min, addr_max, mmap_size);
-  if (grub_efi_get_memory_map (0, &desc_size, 0) <= 0)
-    grub_fatal ("cannot get memory map");
-
-  addr = 0;
-  for (desc = mmap_buf;
-       desc < NEXT_MEMORY_DESCRIPTOR (mmap_buf, mmap_size);
-       desc = NEXT_MEMORY_DESCRIPTOR (desc, desc_size))
-    {
-      if (desc->type != GRUB_EFI_CONVENTIONAL_MEMORY)
-        continue;
-      memcpy(&tdesc, desc, sizeof (tdesc));
-      if (tdesc.physical_start < addr_min
-              && tdesc.num_pages > ((addr_min - tdesc.physical_start) >> 12))
-        {
-          tdesc.num_pages -= ((addr_min - tdesc.physical_start) >> 12);
-          tdesc.physical_start = addr_min;
-        }
-
-      grub_dprintf(__func__, "desc = {type=%d,ps=0x%llx,vs=0x%llx,sz=%llu,attr=%llu}\n", desc->type, (unsigned long long)desc->physical_start, (unsigned long long)desc->virtual_start, (unsigned long long)desc->num_pages, (unsigned long long)desc->attribute);
-      if (tdesc.physical_start >= addr_min
-	  && tdesc.physical_start + page_align (size) <= addr_max
-	  && tdesc.num_pages >= initrd_pages)
-	{
-	  grub_efi_physical_address_t physical_end;
-
-	  physical_end = tdesc.physical_start + (tdesc.num_pages << 12);
-	  if (physical_end > addr_max)
-	    physical_end = addr_max;
+  addr_max &= ~((grub_addr_t) (1 << 12)-1);
 
-	  if (physical_end <= 0x7fffffffUL && physical_end > addr)
-	    addr = physical_end - page_align (size);
-	}
-    }
+  /* Keep the initrd out of the low memory the kernel needs itself.  */
+  addr_min = 0x100000;
 
-  if (addr == 0)
+  /* Take the smallest free region the initrd fits in, so that the big
+     ones stay whole, and put it at the top of that region.  */
+  grub_dprintf(__func__, "addr_min: 0x%lx addr_max: 0x%lx\n", addr_min, addr_max);
+  initrd_mem = grub_efi_allocate_best_fit (addr_min, addr_max - 1,
+					   initrd_pages, 0, 1);
+  if (! initrd_mem)
     {
       errnum = ERR_UNRECOGNIZED;
       grub_printf ("no free pages available");
       goto fail;
     }
+  addr = (grub_addr_t) initrd_mem;
 
-  initrd_mem = grub_efi_allocate_pages (addr, initrd_pages);
-  if (! initrd_mem)
-    grub_fatal ("cannot allocate pages: %x@%x", (unsigned)initrd_pages,
-		(unsigned)addr);
-
-  if (grub_read (initrd_mem, size) != size)
+  if (! initrd_read (initrd, initrd_mem, size))
     {
+      if (errnum == ERR_NONE)
+	errnum = ERR_READ;
       grub_printf ("Couldn't read file");
       goto fail;
     }
 
-  grub_printf ("   [Initrd, addr=0x%x, size=0x%x]\n", (unsigned int) addr,
+  grub_printf ("   [Initrd, addr=0x%lx, size=0x%x]\n", (unsigned long) addr,
 	       (unsigned int) size);
 
-  params->hdr.ramdisk_image = addr;
-  params->hdr.ramdisk_size = size;
+  params->hdr.ramdisk_image = (grub_uint32_t) addr;
+  params->hdr.ramdisk_size = (grub_uint32_t) size;
+  params->ext_ramdisk_image = PTR_HI (addr);
+  params->ext_ramdisk_size = PTR_HI (size);
   params->hdr.root_dev = 0x0100; /* XXX */
 
  fail:
-  grub_close ();
- fail1:
   return !errnum;
 }
@@ -59,6 +59,42 @@ hex_to_int(int v)
     return (v - '0');
 }
 
+/* The last image decoded, and which file it came from: opening it again,
+ * as every graphics_init does, only takes a copy.
+ */
+static struct xpm *xpm_cache;
+static char xpm_cache_path[64];
+static unsigned long xpm_cache_drive, xpm_cache_partition;
+static int xpm_cache_size;
+
+static int
+xpm_cache_lookup(char *path, struct xpm *xpm)
+{
+    if (!xpm_cache || xpm_cache_size != filemax
+            || xpm_cache_drive != current_drive
+            || xpm_cache_partition != current_partition
+            || grub_strcmp(xpm_cache_path, path))
+        return 0;
+
+    grub_memmove(xpm, xpm_cache, sizeof (*xpm));
+    return 1;
+}
+
+static void
+xpm_cache_add(char *path, struct xpm *xpm)
+{
+    if (grub_strlen(path) >= sizeof (xpm_cache_path))
+        return;
+    if (!xpm_cache && !(xpm_cache = grub_malloc(sizeof (*xpm))))
+        return;
+
+    grub_memmove(xpm_cache, xpm, sizeof (*xpm));
+    grub_strcpy(xpm_cache_path, path);
+    xpm_cache_drive = current_drive;
+    xpm_cache_partition = current_partition;
+    xpm_cache_size = filemax;
+}
+
 struct xpm *
 xpm_open(char *path)
 {
@@ -79,13 +115,32 @@ xpm_open(char *path)
         return NULL;
     }
 
+    if (xpm_cache_lookup(path, xpm)) {
+        grub_close();
+        return xpm;
+    }
+
     grub_memset(xpm, '\0', sizeof (*xpm));
 
+    /* a BMP is binary, and much quicker to read */
+    if (grub_read(buf, 2) == 2 && buf[0] == 'B' && buf[1] == 'M') {
+        if (!bmp_read(xpm)) {
+            grub_printf("\"%s\" is not a BMP image GRUB can read\n", path);
+            grub_free(xpm);
+            grub_close();
+            return NULL;
+        }
+        xpm_cache_add(path, xpm);
+        grub_close();
+        return xpm;
+    }
+    grub_seek(0);
+
     prev = '\n';
     c = 0;
     do {
-        if (grub_read(&c, 1) != 1) {
-            grub_printf("grub_read() failed\n");
+        if (!grub_read_byte(&c)) {
+            grub_printf("grub_read_byte() failed\n");
             grub_free(xpm);
             grub_close();
             return NULL;
@@ -100,16 +155,16 @@ xpm_open(char *path)
     } while (target[pos]);
 
     /* parse info */
-    while (grub_read(&c, 1)) {
+    while (grub_read_byte(&c)) {
         if (c == '"')
             break;
     }
-    while (grub_read(&c, 1) && (c == ' ' || c == '\t'))
+    while (grub_read_byte(&c) && (c == ' ' || c == '\t'))
         ;
 
     i = 0;
     xpm->width = c - '0';
-    while (grub_read(&c, 1)) {
+    while (grub_read_byte(&c)) {
         if (c >= '0' && c <= '9')
             xpm->width = xpm->width * 10 + c - '0';
         else
@@ -122,11 +177,11 @@ xpm_open(char *path)
         grub_close();
         return NULL;
     }
-    while (grub_read(&c, 1) && (c == ' ' || c == '\t'))
+    while (grub_read_byte(&c) && (c == ' ' || c == '\t'))
         ;
 
     xpm->height = c - '0';
-    while (grub_read(&c, 1)) {
+    while (grub_read_byte(&c)) {
         if (c >= '0' && c <= '9')
             xpm->height = xpm->height * 10 + c - '0';
         else
@@ -140,11 +195,11 @@ xpm_open(char *path)
         return NULL;
     }
 
-    while (grub_read(&c, 1) && (c == ' ' || c == '\t'))
+    while (grub_read_byte(&c) && (c == ' ' || c == '\t'))
         ;
 
     xpm->colors = c - '0';
-    while (grub_read(&c, 1)) {
+    while (grub_read_byte(&c)) {
         if (c >= '0' && c <= '9')
             xpm->colors = xpm->colors * 10 + c - '0';
         else
@@ -152,20 +207,22 @@ xpm_open(char *path)
     }
 
     base = 0;
-    while (grub_read(&c, 1) && c != '"')
+    while (grub_read_byte(&c) && c != '"')
         ;
 
     /* palette */
     for (i = 0, idx = 1; i < xpm->colors; i++) {
         len = 0;
 
-        while (grub_read(&c, 1) && c != '"')
+        while (grub_read_byte(&c) && c != '"')
             ;
-        grub_read(&c, 1);       /* char */
+        grub_read_byte(&c);       /* char */
         base = c;
-        grub_read(buf, 4);      /* \t c # */
+        for (len = 0; len < 4; len++)  /* \t c # */
+            grub_read_byte(&buf[len]);
+        len = 0;
 
-        while (grub_read(&c, 1) && c != '"') {
+        while (grub_read_byte(&c) && c != '"') {
             if (len < sizeof(buf))
                 buf[len++] = c;
         }
@@ -190,8 +247,8 @@ xpm_open(char *path)
     while (y < xpm->height) {
         xpm_pixel_t *pixel = NULL;
         while (1) {
-            if (!grub_read(&c, 1)) {
-                grub_printf("%s %s:%d grub_read() failed\n", __FILE__, __func__, __LINE__);
+            if (!grub_read_byte(&c)) {
+                grub_printf("%s %s:%d grub_read_byte() failed\n", __FILE__, __func__, __LINE__);
                 grub_free(xpm);
                 grub_close();
                 return NULL;
@@ -200,7 +257,7 @@ xpm_open(char *path)
                 break;
         }
 
-        while (grub_read(&c, 1) && c != '"') {
+        while (grub_read_byte(&c) && c != '"') {
             unsigned char *iaddr = NULL;
             for (i = 1; i < xpm->colors; i++)
                 if (pal[i] == c) {
@@ -217,6 +274,7 @@ xpm_open(char *path)
             }
         }
     }
+    xpm_cache_add(path, xpm);
     grub_close();
     return xpm;
 }
@@ -26,6 +26,7 @@ struct xpm {
 
 extern struct xpm *xpm_open(char *path);
 extern void xpm_free(struct xpm *xpm);
+extern int bmp_read(struct xpm *xpm);
 
 extern unsigned char xpm_get_pixel_idx(struct xpm *xpm, int x, int y);
 extern void xpm_set_pixel_idx(struct xpm *xpm, int x, int y, unsigned char idx);
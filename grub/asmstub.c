@@ -46,11 +46,6 @@ int grub_stage2 (void);
 
 #ifdef __linux__
 # include <sys/ioctl.h>		/* ioctl */
-# if !defined(__GLIBC__) || \
-	((__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 1)))
-/* Maybe libc doesn't have large file support.  */
-#  include <linux/unistd.h>	/* _llseek */
-# endif /* (GLIBC < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR < 1)) */
 # ifndef BLKFLSBUF
 #  define BLKFLSBUF	_IO (0x12,97)	/* flush buffer cache */
 # endif /* ! BLKFLSBUF */
@@ -85,14 +80,44 @@ struct apm_info apm_bios_info;
 /* Emulation requirements. */
 void *grub_scratch_mem = 0;
 
+/* FSYS_BUF and the raw device buffer, which are mapped together.  */
+unsigned long grub_fsys_buf;
+int grub_fsys_buflen;
+unsigned long grub_buffer_addr;
+int grub_bufferlen;
+static char *grub_buffers;
+
 struct geometry *disks = 0;
 
 /* The map between BIOS drives and UNIX device file names.  */
 char **device_map = 0;
 
+/* Drives which are disk images rather than devices are opened without
+   O_DIRECT, so that the page cache works for them, and mapped into
+   memory whole.  DISK_MAP is the mapping, and DISK_MAP_SIZE its size,
+   or zero if the drive isn't mapped.  */
+static char *disk_map[NUM_DISKS];
+static off_t disk_map_size[NUM_DISKS];
+static int disk_direct[NUM_DISKS];
+
+/* The aligned buffer which O_DIRECT transfers go through.  */
+static char *bounce_buf;
+static size_t bounce_size;
+
+static void close_disk (int drive);
+static int disk_read (int drive, char *buf, int len, off_t offset);
+
 /* The jump buffer for exiting correctly.  */
 static jmp_buf env_for_exit;
 
+/* Set when the standard input has run out, which ends the last
+   session.  */
+static int stdin_eof;
+
+/* The device map as it was before the first session, which every
+   later one starts from.  */
+static char **session_map;
+
 /* The current color for console.  */
 int console_current_color = A_NORMAL;
 
@@ -165,6 +190,30 @@ grub_mmap_alloc(size_t len)
 }
 #endif /* defined(__linux__) */
 
+/* Get ready for one more session.  Drives which the last one pointed
+   somewhere else with the command "device" go back to SESSION_MAP;
+   the others stay open, with their geometries.  */
+static void
+begin_session (void)
+{
+  int i;
+
+  for (i = 0; i < NUM_DISKS; i++)
+    {
+      char *name = device_map[i];
+      char *orig = session_map[i];
+
+      if (name == orig || (name && orig && strcmp (name, orig) == 0))
+	continue;
+
+      assign_device_name (i, orig);
+    }
+
+  /* The buffer of the last session may belong to another image.  */
+  buf_drive = -1;
+  errnum = ERR_NONE;
+}
+
 /* The main entry point into this mess. */
 int
 grub_stage2 (void)
@@ -174,6 +223,7 @@ grub_stage2 (void)
   static void *realstack;
   void *simstack_alloc_base, *simstack;
   size_t simstack_size, page_size;
+  int failed = 0;
   int i;
 
   auto void doit (void);
@@ -244,6 +294,15 @@ grub_stage2 (void)
 
   grub_scratch_mem = (void *)((unsigned long)simstack_alloc_base + page_size);
 
+  /* Like the scratch memory, the buffers are mapped in the low 2GB,
+     as biosdisk is given the segment of the raw device buffer.  */
+  grub_buffers = grub_mmap_alloc (FSYS_BUFLEN_MAX + BUFFERLEN_MAX);
+  assert (grub_buffers != MAP_FAILED);
+  grub_fsys_buf = (unsigned long) grub_buffers;
+  grub_fsys_buflen = FSYS_BUFLEN_MAX;
+  grub_buffer_addr = grub_fsys_buf + FSYS_BUFLEN_MAX;
+  grub_bufferlen = BUFFERLEN_MAX;
+
   /* FIXME: simulate the memory holes using mprot, if available. */
 
   assert (disks == 0);
@@ -255,13 +314,21 @@ grub_stage2 (void)
 
   if (! init_device_map (&device_map, device_map_file, floppy_disks))
     return 1;
+
+  /* Probing is what takes long, so do it only once for all the
+     sessions.  */
+  if (use_sessions)
+    {
+      session_map = malloc (NUM_DISKS * sizeof (char *));
+      assert (session_map);
+      for (i = 0; i < NUM_DISKS; i++)
+	session_map[i] = device_map[i] ? strdup (device_map[i]) : 0;
+    }
   
   /* Check some invariants. */
   assert ((SCRATCHSEG << 4) == SCRATCHADDR);
   assert ((BUFFERSEG << 4) == BUFFERADDR);
-  assert (BUFFERADDR + BUFFERLEN == SCRATCHADDR);
   assert (FSYS_BUF % 16 == 0);
-  assert (FSYS_BUF + FSYS_BUFLEN == BUFFERADDR);
 
 #ifdef HAVE_LIBCURSES
   /* Get into char-at-a-time mode. */
@@ -285,6 +352,18 @@ grub_stage2 (void)
   simstack = (char *) PROTSTACKINIT;
   doit ();
 
+  /* With --sessions, quit only ends one session, and the next starts
+     at once on the same device map, until the input runs out.  */
+  while (use_sessions && ! stdin_eof)
+    {
+      failed |= status;
+      sync ();
+      begin_session ();
+      simstack = (char *) PROTSTACKINIT;
+      doit ();
+    }
+  status |= failed;
+
   /* I don't know if this is necessary really.  */
   sync ();
 
@@ -304,7 +383,7 @@ grub_stage2 (void)
 #else
 # warning "In your operating system, the buffer cache will not be flushed."
 #endif
-	close (disks[i].flags);
+	close_disk (i);
       }
 
   if (serial_fd >= 0)
@@ -313,10 +392,20 @@ grub_stage2 (void)
   /* Release memory. */
   restore_device_map (device_map);
   device_map = 0;
+  if (session_map)
+    {
+      restore_device_map (session_map);
+      session_map = 0;
+    }
   free (disks);
   disks = 0;
   munmap(simstack_alloc_base, simstack_size);
   grub_scratch_mem = 0;
+  munmap (grub_buffers, FSYS_BUFLEN_MAX + BUFFERLEN_MAX);
+  grub_buffers = 0;
+  free (bounce_buf);
+  bounce_buf = 0;
+  bounce_size = 0;
 
   if (serial_device)
     free (serial_device);
@@ -326,6 +415,22 @@ grub_stage2 (void)
   return status;
 }
 
+/* Close DRIVE, if it is open.  */
+static void
+close_disk (int drive)
+{
+  if (disks[drive].flags == -1)
+    return;
+
+  if (disk_map_size[drive])
+    munmap (disk_map[drive], disk_map_size[drive]);
+  disk_map[drive] = 0;
+  disk_map_size[drive] = 0;
+
+  close (disks[drive].flags);
+  disks[drive].flags = -1;
+}
+
 /* Assign DRIVE to a device name DEVICE.  */
 void
 assign_device_name (int drive, const char *device)
@@ -335,11 +440,7 @@ assign_device_name (int drive, const char *device)
     free (device_map[drive]);
 
   /* If the old one is already opened, close it.  */
-  if (disks[drive].flags != -1)
-    {
-      close (disks[drive].flags);
-      disks[drive].flags = -1;
-    }
+  close_disk (drive);
 
   /* Assign DRIVE to DEVICE.  */
   if (! device)
@@ -437,10 +538,11 @@ unsigned short bios_key_map[KEY_MAP_SIZE + 1];
 unsigned short ascii_key_map[KEY_MAP_SIZE + 1];
 
 /* Copy MAP to the drive map and set up the int13 handler.  */
-void
-set_int13_handler (unsigned short *map)
+unsigned long
+set_int13_handler (unsigned short *map, int cache_kb)
 {
   /* Nothing to do in the simulator.  */
+  return 0;
 }
 
 int
@@ -586,6 +688,13 @@ getrtsecs (void)
   return time (0);
 }
 
+void
+idle_wait (void)
+{
+  /* A tick of the BIOS timer.  */
+  usleep (55000);
+}
+
 int
 currticks (void)
 {
@@ -792,7 +901,10 @@ console_getkey (void)
 
   /* Quit if we get EOF. */
   if (c == -1)
-    stop ();
+    {
+      stdin_eof = 1;
+      stop ();
+    }
   
   return console_translate_key (c);
 }
@@ -871,7 +983,9 @@ get_diskinfo (int drive, struct geometry *geometry)
     {
       /* The unpartitioned device name: /dev/XdX */
       char *devname = device_map[drive];
-      char * buf, * buf_unaligned;
+      char buf[512];
+      struct stat st;
+      int mode;
 
       if (! devname)
 	return -1;
@@ -880,15 +994,20 @@ get_diskinfo (int drive, struct geometry *geometry)
 	grub_printf ("Attempt to open drive 0x%x (%s)\n",
 		     drive, devname);
 
+      /* An image is read through the page cache, a device isn't.  */
+      disk_direct[drive] = (stat (devname, &st) != 0
+			    || ! S_ISREG (st.st_mode));
+      mode = disk_direct[drive] ? O_DIRECT : 0;
+
       /* Open read/write, or read-only if that failed. */
       if (! read_only)
-	disks[drive].flags = open (devname, O_RDWR | O_DIRECT);
+	disks[drive].flags = open (devname, O_RDWR | mode);
 
       if (disks[drive].flags == -1)
 	{
 	  if (read_only || errno == EACCES || errno == EROFS || errno == EPERM)
 	    {
-	      disks[drive].flags = open (devname, O_RDONLY | O_DIRECT);
+	      disks[drive].flags = open (devname, O_RDONLY | mode);
 	      if (disks[drive].flags == -1)
 		{
 		  assign_device_name (drive, 0);
@@ -902,22 +1021,28 @@ get_diskinfo (int drive, struct geometry *geometry)
 	    }
 	}
 
-      buf_unaligned = malloc((512 * sizeof(char)) + 4095);
-      buf = (char *) (((unsigned long)buf_unaligned + 4096 - 1) &
-                      (~(4096-1)));
-
       /* Attempt to read the first sector.  */
-      if (read (disks[drive].flags, buf, 512) != 512)
+      if (disk_read (drive, buf, 512, 0) != 512)
 	{
-	  close (disks[drive].flags);
-	  disks[drive].flags = -1;
 	  assign_device_name (drive, 0);
 	  return -1;
 	}
 
-      if (disks[drive].flags != -1)
-	get_drive_geometry (&disks[drive], device_map, drive);
-      free(buf_unaligned);
+      /* Writes go to the file, and a shared mapping sees them.  */
+      if (! disk_direct[drive] && st.st_size > 0
+	  && st.st_size == (off_t) (size_t) st.st_size)
+	{
+	  void *map = mmap (0, st.st_size, PROT_READ, MAP_SHARED,
+			    disks[drive].flags, 0);
+
+	  if (map != MAP_FAILED)
+	    {
+	      disk_map[drive] = map;
+	      disk_map_size[drive] = st.st_size;
+	    }
+	}
+
+      get_drive_geometry (&disks[drive], device_map, drive);
     }
 
   if (disks[drive].flags == -1)
@@ -926,7 +1051,8 @@ get_diskinfo (int drive, struct geometry *geometry)
 #ifdef __linux__
   /* In Linux, invalidate the buffer cache, so that left overs
      from other program in the cache are flushed and seen by us */
-  ioctl (disks[drive].flags, BLKFLSBUF, 0);
+  if (disk_direct[drive])
+    ioctl (disks[drive].flags, BLKFLSBUF, 0);
 #endif
 
   *geometry = disks[drive];
@@ -1052,73 +1178,167 @@ hex_dump (void *buf, size_t size)
   grub_printf ("\n");
 }
 
+/* Return an aligned buffer of at least LEN bytes for O_DIRECT.  */
+static char *
+get_bounce_buf (size_t len)
+{
+  if (len > bounce_size)
+    {
+      free (bounce_buf);
+      bounce_size = 0;
+      if (posix_memalign ((void **) &bounce_buf, 4096, len))
+	{
+	  bounce_buf = 0;
+	  return 0;
+	}
+      bounce_size = len;
+    }
+
+  return bounce_buf;
+}
+
+/* Take as long as a request of LEN bytes does on the disks chosen with
+   --disk-model.  Spin rather than sleep, so that it takes as long from
+   one run to the next.  */
+static void
+disk_delay (int len)
+{
+  struct timeval start, now;
+  long long usec = disk_latency;
+
+  if (! disk_latency && ! disk_bandwidth)
+    return;
+
+  if (disk_bandwidth)
+    usec += (long long) len * 1000000 / ((long long) disk_bandwidth * 1024);
+
+  gettimeofday (&start, 0);
+  do
+    gettimeofday (&now, 0);
+  while ((now.tv_sec - start.tv_sec) * 1000000LL
+	 + now.tv_usec - start.tv_usec < usec);
+}
+
+/* Read LEN bytes at OFFSET in DRIVE into BUF.  Return LEN if
+   successful, otherwise something else.  */
+static int
+disk_read (int drive, char *buf, int len, off_t offset)
+{
+  int fd = disks[drive].flags;
+  char *p = buf;
+  int done = 0;
+
+  disk_delay (len);
+
+  if (offset + len <= disk_map_size[drive])
+    {
+      memcpy (buf, disk_map[drive] + offset, len);
+      return len;
+    }
+
+  if (disk_direct[drive] && ! (p = get_bounce_buf (len)))
+    return -1;
+
+  while (done < len)
+    {
+      ssize_t ret = pread (fd, p + done, len - done, offset + done);
+
+      if (ret <= 0)
+	{
+	  if (ret < 0 && errno == EINTR)
+	    continue;
+	  break;
+	}
+      done += ret;
+    }
+
+  if (p != buf)
+    memcpy (buf, p, done);
+  return done;
+}
+
+/* Write LEN bytes from BUF at OFFSET in DRIVE.  Return LEN if
+   successful, otherwise something else.  */
+static int
+disk_write (int drive, char *buf, int len, off_t offset)
+{
+  int fd = disks[drive].flags;
+  char *p = buf;
+  int done = 0;
+
+  disk_delay (len);
+
+  if (disk_direct[drive])
+    {
+      if (! (p = get_bounce_buf (len)))
+	return -1;
+      memcpy (p, buf, len);
+    }
+
+  while (done < len)
+    {
+      ssize_t ret = pwrite (fd, p + done, len - done, offset + done);
+
+      if (ret <= 0)
+	{
+	  if (ret < 0 && errno == EINTR)
+	    continue;
+	  break;
+	}
+      done += ret;
+    }
+
+  return done;
+}
+
 int
 biosdisk (int subfunc, int drive, struct geometry *geometry,
-	  int sector, int nsec, int segment)
+	  sector_t sector, int nsec, int segment)
 {
   char *buf;
   int fd = geometry->flags;
+  int sector_size = get_sector_size (drive);
+  off_t offset = (off_t) sector * sector_size;
 
   /* Get the file pointer from the geometry, and make sure it matches. */
   if (fd == -1 || fd != disks[drive].flags)
     return BIOSDISK_ERROR_GEOMETRY;
 
-  /* Seek to the specified location. */
-#if defined(__linux__) && (!defined(__GLIBC__) || \
-	((__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 1))))
-  /* Maybe libc doesn't have large file support.  */
-  {
-    loff_t offset, result;
-    static int _llseek (uint filedes, ulong hi, ulong lo,
-			loff_t *res, uint wh);
-    _syscall5 (int, _llseek, uint, filedes, ulong, hi, ulong, lo,
-	       loff_t *, res, uint, wh);
-
-    offset = (loff_t) sector * (loff_t) get_sector_size(drive);
-    if (_llseek (fd, offset >> 32, offset & 0xffffffff, &result, SEEK_SET))
-      return -1;
-  }
-#else
-  {
-    off_t offset = (off_t) sector * (off_t) get_sector_size(drive);
-
-    if (lseek (fd, offset, SEEK_SET) != offset)
-      return -1;
-  }
-#endif
-
   buf = (char *) (unsigned long) (segment << 4);
 
   switch (subfunc)
     {
     case BIOSDISK_READ:
 #ifdef __linux__
-      if (sector == 0 && nsec > 1)
+      if (sector == 0 && nsec > 1 && disk_direct[drive])
 	{
 	  /* Work around a bug in linux's ez remapping.  Linux remaps all
 	     sectors that are read together with the MBR in one read.  It
 	     should only remap the MBR, so we split the read in two 
 	     parts. -jochen  */
-	  if (nread (fd, buf, get_sector_size(drive)) != get_sector_size(drive))
+	  if (disk_read (drive, buf, sector_size, offset) != sector_size)
 	    return -1;
-	  buf += get_sector_size(drive);
+	  buf += sector_size;
+	  offset += sector_size;
 	  nsec--;
 	}
 #endif
-      if (nread (fd, buf, nsec * get_sector_size(drive)) != nsec * get_sector_size(drive))
+      if (disk_read (drive, buf, nsec * sector_size, offset)
+	  != nsec * sector_size)
 	return -1;
       break;
 
     case BIOSDISK_WRITE:
       if (verbose)
 	{
-	  grub_printf ("Write %d sectors starting from %d sector"
+	  grub_printf ("Write %d sectors starting from %llu sector"
 		       " to drive 0x%x (%s)\n",
 		       nsec, sector, drive, device_map[drive]);
 	  hex_dump (buf, nsec * get_sector_size(drive));
 	}
       if (! read_only)
-	if (nwrite (fd, buf, nsec * get_sector_size(drive)) != nsec * get_sector_size(drive))
+	if (disk_write (drive, buf, nsec * sector_size, offset)
+	    != nsec * sector_size)
 	  return -1;
       break;
 
@@ -1130,6 +1350,48 @@ biosdisk (int subfunc, int drive, struct geometry *geometry,
   return 0;
 }
 
+int
+biosdisk_read (int drive, struct geometry *geometry,
+	       sector_t sector, int nsec, char *buf)
+{
+  int fd = geometry->flags;
+  int len = nsec * get_sector_size (drive);
+
+  if (fd == -1 || fd != disks[drive].flags)
+    return BIOSDISK_ERROR_GEOMETRY;
+
+  if (disk_read (drive, buf, len, (off_t) sector * get_sector_size (drive))
+      != len)
+    return -1;
+
+  return 0;
+}
+
+int
+biosdisk_write (int drive, struct geometry *geometry,
+		sector_t sector, int nsec, char *buf)
+{
+  int fd = geometry->flags;
+  int len = nsec * get_sector_size (drive);
+
+  if (fd == -1 || fd != disks[drive].flags)
+    return BIOSDISK_ERROR_GEOMETRY;
+
+  if (verbose)
+    grub_printf ("Write %d sectors starting from %llu sector"
+		 " to drive 0x%x (%s)\n",
+		 nsec, sector, drive, device_map[drive]);
+
+  if (read_only)
+    return 0;
+
+  if (disk_write (drive, buf, len, (off_t) sector * get_sector_size (drive))
+      != len)
+    return -1;
+
+  return 0;
+}
+
 
 void
 stop_floppy (void)
@@ -1163,13 +1425,11 @@ serial_hw_fetch (void)
   return -1;
 }
 
-/* Put a character to a serial device.  */
+/* Write LEN characters to a serial device.  */
 void
-serial_hw_put (int c)
+serial_hw_write (const char *buf, int len)
 {
-  char ch = (char) c;
-  
-  if (nwrite (serial_fd, &ch, 1) != 1)
+  if (nwrite (serial_fd, (char *) buf, len) != len)
     stop ();
 }
 
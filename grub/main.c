@@ -36,6 +36,10 @@ int grub_stage2 (void);
 char *program_name = 0;
 int use_config_file = 1;
 int use_preset_menu = 0;
+int use_sessions = 0;
+int verify_blocklists = 0;
+unsigned long disk_latency = 0;
+unsigned long disk_bandwidth = 0;
 #ifdef HAVE_LIBCURSES
 int use_curses = 1;
 #else
@@ -65,6 +69,9 @@ static char *default_config_file;
 #define OPT_DEVICE_MAP		-15
 #define OPT_PRESET_MENU		-16
 #define OPT_NO_PAGER		-17
+#define OPT_SESSIONS		-18
+#define OPT_DISK_MODEL		-19
+#define OPT_VERIFY_BLOCKLISTS	-20
 #define OPTSTRING ""
 
 static struct option longopts[] =
@@ -73,6 +80,7 @@ static struct option longopts[] =
   {"boot-drive", required_argument, 0, OPT_BOOT_DRIVE},
   {"config-file", required_argument, 0, OPT_CONFIG_FILE},
   {"device-map", required_argument, 0, OPT_DEVICE_MAP},
+  {"disk-model", required_argument, 0, OPT_DISK_MODEL},
   {"help", no_argument, 0, OPT_HELP},
   {"hold", optional_argument, 0, OPT_HOLD},
   {"install-partition", required_argument, 0, OPT_INSTALL_PARTITION},
@@ -83,12 +91,65 @@ static struct option longopts[] =
   {"preset-menu", no_argument, 0, OPT_PRESET_MENU},
   {"probe-second-floppy", no_argument, 0, OPT_PROBE_SECOND_FLOPPY},
   {"read-only", no_argument, 0, OPT_READ_ONLY},
+  {"sessions", no_argument, 0, OPT_SESSIONS},
   {"verbose", no_argument, 0, OPT_VERBOSE},
+  {"verify-blocklists", no_argument, 0, OPT_VERIFY_BLOCKLISTS},
   {"version", no_argument, 0, OPT_VERSION},
   {0},
 };
 
 
+/* The costs of a read or a write of the disks which --disk-model may
+   choose: the latency of a request, in microseconds, and the bandwidth,
+   in KB/s.  */
+static struct
+{
+  const char *name;
+  unsigned long latency;
+  unsigned long bandwidth;
+}
+disk_models[] =
+{
+  /* The virtual media of a management controller, over USB 1.1.  */
+  {"usb", 2000, 1000},
+  /* A RAID controller, through the INT 13h of its option ROM.  */
+  {"raid", 400, 60000},
+  {"nvme", 20, 1500000},
+  {0}
+};
+
+/* Set DISK_LATENCY and DISK_BANDWIDTH after the model MODEL.  Return
+   non-zero if successful, otherwise zero.  */
+static int
+set_disk_model (const char *model)
+{
+  char *end;
+  int i;
+
+  for (i = 0; disk_models[i].name; i++)
+    if (strcmp (model, disk_models[i].name) == 0)
+      {
+	disk_latency = disk_models[i].latency;
+	disk_bandwidth = disk_models[i].bandwidth;
+	return 1;
+      }
+
+  disk_latency = strtoul (model, &end, 0);
+  if (end == model)
+    return 0;
+
+  disk_bandwidth = 0;
+  if (*end == ',')
+    {
+      model = end + 1;
+      disk_bandwidth = strtoul (model, &end, 0);
+      if (end == model)
+	return 0;
+    }
+
+  return *end == 0;
+}
+
 static void
 usage (int status)
 {
@@ -104,6 +165,8 @@ Enter the GRand Unified Bootloader command shell.\n\
     --boot-drive=DRIVE       specify stage2 boot_drive [default=0x%x]\n\
     --config-file=FILE       specify stage2 config_file [default=%s]\n\
     --device-map=FILE        use the device map file FILE\n\
+    --disk-model=MODEL       make the disks as slow as MODEL, which is usb,\n\
+                             raid, nvme or LATENCY,BANDWIDTH in us and KB/s\n\
     --help                   display this message and exit\n\
     --hold                   wait until a debugger will attach\n\
     --install-partition=PAR  specify stage2 install_partition [default=0x%x]\n\
@@ -114,7 +177,10 @@ Enter the GRand Unified Bootloader command shell.\n\
     --preset-menu            use the preset menu\n\
     --probe-second-floppy    probe the second floppy drive\n\
     --read-only              do not write anything to devices\n\
+    --sessions               run one session after another until EOF\n\
     --verbose                print verbose messages\n\
+    --verify-blocklists      check the blocklists the host tells against\n\
+                             reading the files\n\
     --version                print version information and exit\n\
 \n\
 Report bugs to <bug-grub@gnu.org>.\n\
@@ -236,6 +302,22 @@ main (int argc, char **argv)
 	case OPT_PRESET_MENU:
 	  use_preset_menu = 1;
 	  break;
+
+	case OPT_SESSIONS:
+	  use_sessions = 1;
+	  break;
+
+	case OPT_VERIFY_BLOCKLISTS:
+	  verify_blocklists = 1;
+	  break;
+
+	case OPT_DISK_MODEL:
+	  if (! set_disk_model (optarg))
+	    {
+	      fprintf (stderr, "Unknown disk model `%s'\n", optarg);
+	      usage (1);
+	    }
+	  break;
 	  
 	default:
 	  usage (1);
@@ -75,6 +75,10 @@ struct hd_geometry
 # ifndef BLKGETSIZE
 #  define BLKGETSIZE	_IO(0x12,96)	/* return device size */
 # endif /* ! BLKGETSIZE */
+# include <linux/fs.h>		/* FIBMAP, FIGETBSZ, FS_IOC_FIEMAP */
+# ifdef FS_IOC_FIEMAP
+#  include <linux/fiemap.h>
+# endif /* FS_IOC_FIEMAP */
 #endif /* __linux__ */
 
 /* Use __FreeBSD_kernel__ instead of __FreeBSD__ for compatibility with
@@ -134,6 +138,10 @@ get_kfreebsd_version ()
 #include <shared.h>
 #include <device.h>
 
+#ifdef HAVE_LIBPTHREAD
+# include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+
 #if defined(__linux__)
 /* The 2.6 kernel has removed all of the geometry handling for IDE drives
  * that did fixups for LBA, etc.  This means that the geometry we get
@@ -650,6 +658,80 @@ check_device (const char *device)
   return 1;
 }
 
+/* A device name to try for the device map, and whether check_device
+   accepted it.  */
+struct probe
+{
+  char name[24];
+  int found;
+};
+
+/* The most names ever tried for hard disks, which is what Linux
+   offers.  */
+#define MAX_PROBES	(8 + 8 + 16 + 8 * 32 + 8 + 8 * 16 + 8 * 15)
+
+/* How many devices are probed at the same time.  */
+#define PROBE_THREADS	16
+
+static struct probe *probes;
+static int num_probes;
+static int next_probe;
+
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+probe_thread (void *arg)
+{
+  while (1)
+    {
+      int i;
+
+      pthread_mutex_lock (&probe_lock);
+      i = next_probe++;
+      pthread_mutex_unlock (&probe_lock);
+
+      if (i >= num_probes)
+	return 0;
+
+      probes[i].found = check_device (probes[i].name);
+    }
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/* Run check_device on the N names in LIST.  Every probe opens and
+   reads a device, and one which doesn't answer holds up only its own
+   thread, so they are run side by side where threads are to be had.  */
+static void
+probe_devices (struct probe *list, int n)
+{
+  int i;
+#ifdef HAVE_LIBPTHREAD
+  pthread_t threads[PROBE_THREADS];
+  int num_threads = 0;
+#endif /* HAVE_LIBPTHREAD */
+
+  probes = list;
+  num_probes = n;
+  next_probe = 0;
+
+#ifdef HAVE_LIBPTHREAD
+  for (i = 0; i < PROBE_THREADS && i < n; i++)
+    {
+      if (pthread_create (&threads[num_threads], 0, probe_thread, 0) != 0)
+	break;
+      num_threads++;
+    }
+
+  for (i = 0; i < num_threads; i++)
+    pthread_join (threads[i], 0);
+#endif /* HAVE_LIBPTHREAD */
+
+  /* Whatever no thread took, if there were none.  */
+  for (i = next_probe; i < n; i++)
+    list[i].found = check_device (list[i].name);
+}
+
 /* Read mapping information from FP, and write it to MAP.  */
 static void rdm_show_error (const char *map_file, int no, const char *msg)
 {
@@ -776,9 +858,10 @@ read_device_map (FILE *fp, char **map, const char *map_file)
 int
 init_device_map (char ***map, const char *map_file, int floppy_disks)
 {
-  int i;
+  int i, n;
   int num_hd = 0;
   FILE *fp = 0;
+  struct probe *list;
 
   assert (map);
   assert (*map == 0);
@@ -816,19 +899,23 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
     fp = fopen (map_file, "w");
   
   /* Floppies.  */
-  for (i = 0; i < floppy_disks; i++)
+  list = malloc (MAX_PROBES * sizeof (*list));
+  assert (list);
+  n = 0;
+  for (i = 0; i < floppy_disks && n < MAX_PROBES; i++)
+    get_floppy_disk_name (list[n++].name, i);
+  probe_devices (list, n);
+
+  for (i = 0; i < n; i++)
     {
-      char name[16];
-      
-      get_floppy_disk_name (name, i);
       /* In floppies, write the map, whether check_device succeeds
 	 or not, because the user just does not insert floppies.  */
       if (fp)
-	fprintf (fp, "(fd%d)\t%s\n", i, name);
+	fprintf (fp, "(fd%d)\t%s\n", i, list[i].name);
       
-      if (check_device (name))
+      if (list[i].found)
 	{
-	  (*map)[i] = strdup (name);
+	  (*map)[i] = strdup (list[i].name);
 	  assert ((*map)[i]);
 	}
     }
@@ -866,68 +953,28 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
       if (fp)
 	fclose (fp);
       
+      free (list);
       return 1;
     }
 #endif /* __linux__ */
+
+  /* Collect every name in the order of the BIOS drives, probe them
+     all at once, and number those found in that order.  */
+  n = 0;
     
   /* IDE disks.  */
   for (i = 0; i < 8; i++)
-    {
-      char name[16];
-      
-      get_ide_disk_name (name, i);
-      if (check_device (name))
-	{
-	  (*map)[num_hd + 0x80] = strdup (name);
-	  assert ((*map)[num_hd + 0x80]);
-	  
-	  /* If the device map file is opened, write the map.  */
-	  if (fp)
-	    fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-	  
-	  num_hd++;
-	}
-    }
+    get_ide_disk_name (list[n++].name, i);
   
 #ifdef __linux__
   /* ATARAID disks.  */
   for (i = 0; i < 8; i++)
-    {
-      char name[20];
-
-      get_ataraid_disk_name (name, i);
-      if (check_device (name))
-        {
-          (*map)[num_hd + 0x80] = strdup (name);
-          assert ((*map)[num_hd + 0x80]);
-
-          /* If the device map file is opened, write the map.  */
-          if (fp)
-            fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-
-          num_hd++;
-        }
-    }
+    get_ataraid_disk_name (list[n++].name, i);
 #endif /* __linux__ */
 
   /* The rest is SCSI disks.  */
   for (i = 0; i < 16; i++)
-    {
-      char name[16];
-      
-      get_scsi_disk_name (name, i);
-      if (check_device (name))
-	{
-	  (*map)[num_hd + 0x80] = strdup (name);
-	  assert ((*map)[num_hd + 0x80]);
-	  
-	  /* If the device map file is opened, write the map.  */
-	  if (fp)
-	    fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-	  
-	  num_hd++;
-	}
-    }
+    get_scsi_disk_name (list[n++].name, i);
   
 #ifdef __linux__
   /* This is for DAC960 - we have
@@ -939,49 +986,14 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
     int controller, drive;
     
     for (controller = 0; controller < 8; controller++)
-      {
-	for (drive = 0; drive < 32; drive++)
-	  {
-	    char name[24];
-	    
-	    get_dac960_disk_name (name, controller, drive);
-	    if (check_device (name))
-	      {
-		(*map)[num_hd + 0x80] = strdup (name);
-		assert ((*map)[num_hd + 0x80]);
-		
-		/* If the device map file is opened, write the map.  */
-		if (fp)
-		  fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-		
-		num_hd++;
-	      }
-	  }
-      }
+      for (drive = 0; drive < 32; drive++)
+	get_dac960_disk_name (list[n++].name, controller, drive);
   }
 
   /* I2O disks.  */
   for (i = 0; i < 8; i++)
-    {
-      char name[16];
-      
-      get_i2o_disk_name (name, i);
-      if (check_device (name))
-	{
-	  (*map)[num_hd + 0x80] = strdup (name);
-	  assert ((*map)[num_hd + 0x80]);
-	  
-	  /* If the device map file is opened, write the map.  */
-	  if (fp)
-	    fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-	  
-	  num_hd++;
-	}
-    }
-  
-#endif /* __linux__ */
+    get_i2o_disk_name (list[n++].name, i);
 
-#ifdef __linux__
   /* This is for cciss - we have
      /dev/cciss/c<controller>d<logical drive>p<partition>.
      
@@ -991,29 +1003,10 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
     int controller, drive;
     
     for (controller = 0; controller < 8; controller++)
-      {
-	for (drive = 0; drive < 16; drive++)
-	  {
-	    char name[24];
-	    
-	    get_cciss_disk_name (name, controller, drive);
-	    if (check_device (name))
-	      {
-		(*map)[num_hd + 0x80] = strdup (name);
-		assert ((*map)[num_hd + 0x80]);
-		
-		/* If the device map file is opened, write the map.  */
-		if (fp)
-		  fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-		
-		num_hd++;
-	      }
-	  }
-      }
+      for (drive = 0; drive < 16; drive++)
+	get_cciss_disk_name (list[n++].name, controller, drive);
   }
-#endif /* __linux__ */
 
-#ifdef __linux__
   /* This is for cpqarray - we have
      /dev/ida/c<controller>d<logical drive>p<partition>.
      
@@ -1023,27 +1016,27 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
     int controller, drive;
     
     for (controller = 0; controller < 8; controller++)
-      {
-	for (drive = 0; drive < 15; drive++)
-	  {
-	    char name[24];
-	    
-	    get_cpqarray_disk_name (name, controller, drive);
-	    if (check_device (name))
-	      {
-		(*map)[num_hd + 0x80] = strdup (name);
-		assert ((*map)[num_hd + 0x80]);
-		
-		/* If the device map file is opened, write the map.  */
-		if (fp)
-		  fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-		
-		num_hd++;
-	      }
-	  }
-      }
+      for (drive = 0; drive < 15; drive++)
+	get_cpqarray_disk_name (list[n++].name, controller, drive);
   }
 #endif /* __linux__ */
+
+  probe_devices (list, n);
+
+  for (i = 0; i < n; i++)
+    if (list[i].found)
+      {
+	(*map)[num_hd + 0x80] = strdup (list[i].name);
+	assert ((*map)[num_hd + 0x80]);
+	
+	/* If the device map file is opened, write the map.  */
+	if (fp)
+	  fprintf (fp, "(hd%d)\t%s\n", num_hd, list[i].name);
+	
+	num_hd++;
+      }
+
+  free (list);
   
   /* OK, close the device map file if opened.  */
   if (fp)
@@ -1080,6 +1073,29 @@ is_disk_device (char **map, int drive)
   return S_ISBLK (st.st_mode);
 }
 
+/* Put the name under Linux of the partition PARTITION of DRIVE into
+   DEV, which has PATH_MAX bytes.  */
+static void
+get_partition_name (char **map, int drive, int partition, char *dev)
+{
+  strcpy (dev, map[drive]);
+  if (have_devfs ())
+    {
+      if (strcmp (dev + strlen(dev) - 5, "/disc") == 0)
+	strcpy (dev + strlen(dev) - 5, "/part");
+    }
+
+  sprintf (dev + strlen(dev), "%s%d", 
+	   /* Compaq smart and others */
+	   (strncmp(dev, "/dev/ida/", 9) == 0 ||
+	    strncmp(dev, "/dev/ataraid/", 13) == 0 ||
+	    strncmp(dev, "/dev/mapper/", 12) == 0 || 
+	    strncmp(dev, "/dev/md", 7) == 0 ||
+	    strncmp(dev, "/dev/cciss/", 11) == 0 ||
+	    strncmp(dev, "/dev/rd/", 8) == 0) ? "p" : "",
+	   ((partition >> 16) & 0xFF) + 1);
+}
+
 int
 write_to_partition (char **map, int drive, int partition,
 		    int sector, int size, const char *buf)
@@ -1098,22 +1114,7 @@ write_to_partition (char **map, int drive, int partition,
   
   assert (map[drive] != 0);
   
-  strcpy (dev, map[drive]);
-  if (have_devfs ())
-    {
-      if (strcmp (dev + strlen(dev) - 5, "/disc") == 0)
-	strcpy (dev + strlen(dev) - 5, "/part");
-    }
-
-  sprintf (dev + strlen(dev), "%s%d", 
-	   /* Compaq smart and others */
-	   (strncmp(dev, "/dev/ida/", 9) == 0 ||
-	    strncmp(dev, "/dev/ataraid/", 13) == 0 ||
-	    strncmp(dev, "/dev/mapper/", 12) == 0 || 
-	    strncmp(dev, "/dev/md", 7) == 0 ||
-	    strncmp(dev, "/dev/cciss/", 11) == 0 ||
-	    strncmp(dev, "/dev/rd/", 8) == 0) ? "p" : "",
-	   ((partition >> 16) & 0xFF) + 1);
+  get_partition_name (map, drive, partition, dev);
   
   /* Open the partition.  */
   fd = open (dev, O_RDWR);
@@ -1146,4 +1147,190 @@ write_to_partition (char **map, int drive, int partition,
   
   return 1;
 }
+
+/* A piece of a file, in bytes, and where it is in its partition.  */
+struct file_run
+{
+  off_t offset;
+  off_t physical;
+  off_t length;
+};
+
+/* Add the piece of LENGTH bytes at OFFSET in the file, at PHYSICAL in
+   its partition, to the RUNS of the file, of which there are *COUNT
+   and room for *MAX, merging it with the last one if it follows it.
+   Return zero if there is no memory.  */
+static int
+add_file_run (struct file_run **runs, int *count, int *max,
+	      off_t offset, off_t physical, off_t length)
+{
+  struct file_run *r;
+
+  if (*count && (*runs)[*count - 1].offset + (*runs)[*count - 1].length
+		== offset
+      && (*runs)[*count - 1].physical + (*runs)[*count - 1].length
+	 == physical)
+    {
+      (*runs)[*count - 1].length += length;
+      return 1;
+    }
+
+  if (*count == *max)
+    {
+      r = realloc (*runs, (*max ? *max * 2 : 64) * sizeof (*r));
+      if (! r)
+	return 0;
+      *runs = r;
+      *max = *max ? *max * 2 : 64;
+    }
+
+  r = *runs + (*count)++;
+  r->offset = offset;
+  r->physical = physical;
+  r->length = length;
+  return 1;
+}
+
+#ifdef FS_IOC_FIEMAP
+/* Ask the file system for the extents of the file FD, of SIZE bytes.
+   Return zero if it can't tell, or if any of them isn't where it can
+   be read as it is, such as one inline or not written yet.  */
+static int
+get_fiemap_runs (int fd, off_t size, struct file_run **runs, int *count,
+		 int *max)
+{
+  char buf[sizeof (struct fiemap) + 64 * sizeof (struct fiemap_extent)];
+  struct fiemap *fm = (struct fiemap *) buf;
+  struct fiemap_extent *fe;
+  off_t start = 0;
+  unsigned int i;
+
+  while (start < size)
+    {
+      memset (buf, 0, sizeof (buf));
+      fm->fm_start = start;
+      fm->fm_length = size - start;
+      fm->fm_flags = FIEMAP_FLAG_SYNC;
+      fm->fm_extent_count = 64;
+
+      if (ioctl (fd, FS_IOC_FIEMAP, fm) < 0 || ! fm->fm_mapped_extents)
+	return 0;
+
+      for (i = 0; i < fm->fm_mapped_extents; i++)
+	{
+	  fe = &fm->fm_extents[i];
+	  if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN
+			      | FIEMAP_EXTENT_DELALLOC
+			      | FIEMAP_EXTENT_ENCODED
+			      | FIEMAP_EXTENT_DATA_ENCRYPTED
+			      | FIEMAP_EXTENT_NOT_ALIGNED
+			      | FIEMAP_EXTENT_DATA_INLINE
+			      | FIEMAP_EXTENT_DATA_TAIL
+			      | FIEMAP_EXTENT_UNWRITTEN)
+	      || (fe->fe_logical | fe->fe_physical) & (SECTOR_SIZE - 1)
+	      || (off_t) fe->fe_logical != start)
+	    return 0;
+
+	  if (! add_file_run (runs, count, max, fe->fe_logical,
+			      fe->fe_physical, fe->fe_length))
+	    return 0;
+	  start = fe->fe_logical + fe->fe_length;
+	}
+    }
+
+  return 1;
+}
+#endif /* FS_IOC_FIEMAP */
+
+/* Ask for the blocks of the file FD, of SIZE bytes, one by one, as
+   kernels before FIEMAP have to be asked.  Only root may.  Return zero
+   if it can't tell, or if the file has a hole.  */
+static int
+get_fibmap_runs (int fd, off_t size, struct file_run **runs, int *count,
+		 int *max)
+{
+  int block_size, block;
+  off_t offset;
+
+  if (ioctl (fd, FIGETBSZ, &block_size) < 0
+      || block_size < SECTOR_SIZE || block_size % SECTOR_SIZE)
+    return 0;
+
+  for (offset = 0; offset < size; offset += block_size)
+    {
+      block = offset / block_size;
+      if (ioctl (fd, FIBMAP, &block) < 0 || ! block)
+	return 0;
+
+      if (! add_file_run (runs, count, max, offset,
+			  (off_t) block * block_size, block_size))
+	return 0;
+    }
+
+  return 1;
+}
+
+/* Call HOOK for each sector of the file OS_FILE from OFFSET on, as
+   reading it through the file system would call disk_read_hook, if it
+   is in the partition PARTITION of DRIVE, which starts at the sector
+   START.  The host is asked where the file is, which saves
+   reading all of it.  Return zero, without calling HOOK, if the host
+   can't tell, or if the file is somewhere else.  */
+int
+get_file_sectors (char **map, int drive, int partition, sector_t start,
+		  const char *os_file, int offset,
+		  void (*hook) (int, int, int))
+{
+  char dev[PATH_MAX];
+  struct stat dev_st, st;
+  struct file_run *runs = 0, *r;
+  int count = 0, max = 0, fd, found = 0;
+  off_t pos;
+
+  if (! map[drive] || (partition & 0x00FF00) != 0x00FF00)
+    return 0;
+
+  if (partition == 0xFFFFFF)
+    strcpy (dev, map[drive]);
+  else
+    get_partition_name (map, drive, partition, dev);
+
+  if (stat (dev, &dev_st) || ! S_ISBLK (dev_st.st_mode))
+    return 0;
+
+  fd = open (os_file, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  /* The file must be on that very partition.  */
+  if (! fstat (fd, &st) && S_ISREG (st.st_mode)
+      && st.st_dev == dev_st.st_rdev && st.st_size > offset)
+    {
+#ifdef FS_IOC_FIEMAP
+      found = get_fiemap_runs (fd, st.st_size, &runs, &count, &max);
+#endif /* FS_IOC_FIEMAP */
+      if (! found)
+	{
+	  count = 0;
+	  found = get_fibmap_runs (fd, st.st_size, &runs, &count, &max);
+	}
+    }
+
+  close (fd);
+
+  if (found)
+    for (pos = offset & ~(SECTOR_SIZE - 1), r = runs;
+	 pos < st.st_size; pos += SECTOR_SIZE)
+      {
+	while (pos >= r->offset + r->length)
+	  r++;
+
+	(*hook) (start + (r->physical + pos - r->offset) / SECTOR_SIZE,
+		 0, (st.st_size - pos < SECTOR_SIZE
+		     ? st.st_size - pos : SECTOR_SIZE));
+      }
+
+  free (runs);
+  return found;
+}
 #endif /* __linux__ */
@@ -43,6 +43,9 @@ extern void restore_device_map (char **map);
 extern int is_disk_device (char **map, int drive);
 extern int write_to_partition (char **map, int drive, int partition,
 			       int offset, int size, const char *buf);
+extern int get_file_sectors (char **map, int drive, int partition,
+			     sector_t start, const char *os_file, int offset,
+			     void (*hook) (int, int, int));
 #endif /* __linux__ */
 			       
 #endif /* DEVICE_MAP_HEADER */
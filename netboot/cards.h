@@ -180,4 +180,10 @@ extern struct nic	*tlan_probe(struct nic *, unsigned short *
         PCI_ARG(struct pci_device *));
 #endif
 
+#ifdef	PLATFORM_EFI
+/* The managed or simple network protocol of the firmware; see
+   efi/efinic.c.  */
+extern struct nic	*efi_nic_probe(struct nic *);
+#endif
+
 #endif	/* CARDS_H */
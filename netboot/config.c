@@ -470,7 +470,11 @@ eth_dummy (struct nic *dummy)
   return 0;
 }
 
-static char	packet[ETH_FRAME_LEN];
+static char	packet[ETH_MAX_FRAME_LEN + VLAN_HLEN];
+
+/* The 802.1Q VLAN the frames are sent on and taken from, or 0 for
+   untagged frames only.  */
+unsigned short vlan_id;
 
 struct nic	nic =
 {
@@ -490,6 +494,7 @@ struct nic	nic =
   packet,				/* packet */
   0,				/* packetlen */
   0,				/* priv_data */
+  0,				/* mtu */
 };
 
 void
@@ -517,6 +522,18 @@ eth_probe (void)
   
   p = 0;
   
+#ifdef	PLATFORM_EFI
+  /* The firmware knows the NICs better than the drivers here do, and
+     the PCI probing below is for the BIOS.  */
+  etherboot_printf ("Probing...[EFI]");
+  if (efi_nic_probe (&nic))
+    {
+      probed = 1;
+      return 1;
+    }
+  return 0;
+#endif
+  
 #ifdef	INCLUDE_PCI
   /* In GRUB, the ROM info is initialized here.  */
   rom = *((struct rom_info *) ROM_INFO_LOCATION);
@@ -558,6 +575,13 @@ eth_probe (void)
 	
   for (t = NIC; t->nic_name != 0; ++t)
     {
+#ifdef	INCLUDE_PCI
+      /* With a PCI NIC found, the ISA drivers, which have no
+	 probe_ioaddrs and go poking at ports with long delays, are not
+	 going to find a better one.  */
+      if (p->vendor && ! t->probe_ioaddrs)
+	continue;
+#endif
       etherboot_printf("[%s]", t->nic_name);
 #ifdef	INCLUDE_PCI
       if ((*t->eth_probe) (&nic, t->probe_ioaddrs, p))
@@ -580,13 +604,43 @@ eth_probe (void)
 int
 eth_poll (void)
 {
-  return ((*nic.poll) (&nic));
+  unsigned char *p = (unsigned char *) nic.packet;
+
+  nic.rx_csum = 0;
+  if (! (*nic.poll) (&nic))
+    return 0;
+
+  if (nic.packetlen < ETH_HLEN + VLAN_HLEN
+      || p[12] != (VLAN >> 8) || p[13] != (VLAN & 0xff))
+    return 1;
+
+  /* Take the tag out of a frame of our VLAN, and drop the others.  */
+  if (! vlan_id || ((p[14] << 8 | p[15]) & 0xfff) != vlan_id)
+    return 0;
+
+  grub_memmove (nic.packet + 12, nic.packet + 12 + VLAN_HLEN,
+		nic.packetlen - 12 - VLAN_HLEN);
+  nic.packetlen -= VLAN_HLEN;
+  return 1;
 }
 
 void
 eth_transmit (const char *d, unsigned int t, unsigned int s, const void *p)
 {
-  (*nic.transmit) (&nic, d, t, s, p);
+  if (vlan_id && s + VLAN_HLEN <= ETH_MAX_FRAME_LEN - ETH_HLEN)
+    {
+      static char tagged[ETH_MAX_FRAME_LEN - ETH_HLEN];
+
+      /* The tag goes where the type was, and the type after it.  */
+      tagged[0] = vlan_id >> 8;
+      tagged[1] = vlan_id & 0xff;
+      tagged[2] = t >> 8;
+      tagged[3] = t & 0xff;
+      grub_memmove (tagged + VLAN_HLEN, p, s);
+      (*nic.transmit) (&nic, d, VLAN, s + VLAN_HLEN, tagged);
+    }
+  else
+    (*nic.transmit) (&nic, d, t, s, p);
   if (t == IP)
     twiddle ();
 }
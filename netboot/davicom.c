@@ -145,7 +145,7 @@ static unsigned char txb[BUFLEN] __attribute__ ((aligned(4)));
 #endif
 
 /* receive descriptor(s) and buffer(s) */
-#define NRXD 4
+#define NRXD NIC_RX_RING
 static struct rxdesc rxd[NRXD] __attribute__ ((aligned(4)));
 #ifdef	USE_LOWMEM_BUFFER
 #define rxb ((char *)0x10000 - NRXD * BUFLEN - BUFLEN)
@@ -363,7 +363,7 @@
 **
 ** total_memory = NUM_RX_DESC*(8+RX_BUFF_SZ) + NUM_TX_DESC*(8+TX_BUFF_SZ)
 */
-#define NUM_RX_DESC     2               /* Number of RX descriptors */
+#define NUM_RX_DESC     NIC_RX_RING     /* Number of RX descriptors */
 #define NUM_TX_DESC     2               /* Number of TX descriptors */
 #define RX_BUFF_SZ	1536            /* Buffer size for each Rx buffer */
 #define TX_BUFF_SZ	1536            /* Buffer size for each Tx buffer */
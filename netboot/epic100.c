@@ -12,7 +12,7 @@
 #define	virt_to_bus(x)	((unsigned long)x)
 
 #define TX_RING_SIZE	2	/* use at least 2 buffers for TX */
-#define RX_RING_SIZE	2
+#define RX_RING_SIZE	NIC_RX_RING
 
 #define PKT_BUF_SZ	1536	/* Size of each temporary Tx/Rx buffer.*/
 
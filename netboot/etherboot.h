@@ -53,6 +53,12 @@ Author: Martin Renters
 # define MAX_TFTP_RETRIES	20
 #endif
 
+/* How many times a TFTP or HTTP transfer which stops in the middle is
+   asked for again before the read fails.  */
+#ifndef	MAX_RESUMES
+# define MAX_RESUMES		3
+#endif
+
 #ifndef	MAX_BOOTP_RETRIES
 # define MAX_BOOTP_RETRIES	20
 #endif
@@ -68,6 +74,10 @@ Author: Martin Renters
 # define MAX_RPC_RETRIES	20
 #endif
 
+#ifndef	MAX_TCP_RETRIES
+# define MAX_TCP_RETRIES	8
+#endif
+
 #define	TICKS_PER_SEC		18
 
 /* Inter-packet retry in ticks */
@@ -76,8 +86,29 @@ Author: Martin Renters
 /* These settings have sense only if compiled with -DCONGESTED */
 /* total retransmission timeout in ticks */
 #define TFTP_TIMEOUT		(30 * TICKS_PER_SEC)
-/* packet retransmission timeout in ticks */
-#define TFTP_REXMT		(3 * TICKS_PER_SEC)
+
+/* The least and the most a TFTP retransmission timeout taken from the
+   round trip time can be, in ticks; the least leaves room for the clock
+   ticking over just after a packet is sent */
+#define TFTP_RTO_MIN		(TICKS_PER_SEC / 10 + 2)
+#define TFTP_RTO_MAX		TIMEOUT
+
+/* TCP retransmission timeout in ticks, before the backoff */
+#define TCP_REXMT		(1 * TICKS_PER_SEC)
+
+/* How many packets that arrive while another one is awaited are kept,
+   and for how long in ticks */
+#ifndef	RX_QUEUE_LEN
+# define RX_QUEUE_LEN		4
+#endif
+#define RX_QUEUE_AGE		(2 * TICKS_PER_SEC)
+
+/* How many receive descriptors the drivers with a ring of their own
+   give the card, so that it can take a window of TFTP blocks sent
+   back to back before it is polled */
+#ifndef	NIC_RX_RING
+# define NIC_RX_RING		8
+#endif
 
 #ifndef	NULL
 # define NULL			((void *) 0)
@@ -105,25 +136,43 @@ Author: Martin Renters
 				- sizeof (struct iphdr) \
 				- sizeof (struct udphdr))
 
+/* The largest frame, without an 802.1Q tag, that the code here takes
+   from a NIC.  Only the simple network protocol of EFI does jumbo
+   frames; the drivers for the BIOS all stop at ETH_FRAME_LEN.  */
+#ifdef PLATFORM_EFI
+# define ETH_MAX_FRAME_LEN	(ETH_HLEN + 9000)
+#else
+# define ETH_MAX_FRAME_LEN	ETH_FRAME_LEN
+#endif
+
+#define VLAN_HLEN		4	/* Size of an 802.1Q tag */
+
 #define ARP_CLIENT	0
 #define ARP_SERVER	1
 #define ARP_GATEWAY	2
 #define ARP_ROOTSERVER	3
 #define ARP_SWAPSERVER	4
-#define MAX_ARP		ARP_SWAPSERVER+1
+#define ARP_HTTPSERVER	5
+#define MAX_ARP		ARP_HTTPSERVER+1
+
+/* How many TFTP servers are kept to fall back on.  */
+#define TFTP_SERVERS	4
 
 #define	RARP_REQUEST	3
 #define	RARP_REPLY	4
 
 #define IP		0x0800
+#define VLAN		0x8100
 #define ARP		0x0806
 #define	RARP		0x8035
 
 #define BOOTP_SERVER	67
 #define BOOTP_CLIENT	68
 #define TFTP_PORT	69
+#define HTTP_PORT	80
 #define SUNRPC_PORT	111
 
+#define IP_TCP		6
 #define IP_UDP		17
 /* Same after going through htonl */
 #define IP_BROADCAST	0xFFFFFFFF
@@ -200,6 +249,8 @@ Author: Martin Renters
 #define DHCPACK			5
 #endif	/* NO_DHCP_SUPPORT */
 
+#define RFC2132_TFTP_SERVER	66
+
 #define RFC1533_VENDOR_MAJOR	0
 #define RFC1533_VENDOR_MINOR	0
 
@@ -222,7 +273,16 @@ Author: Martin Renters
 #endif	/* NO_DHCP_SUPPORT */
 
 #define	TFTP_DEFAULTSIZE_PACKET	512
-#define	TFTP_MAX_PACKET		1432 /* 512 */
+/* The largest block asked for; less is asked for if the link can't
+   carry it (see tftp_blksize).  */
+#ifdef PLATFORM_EFI
+# define TFTP_MAX_PACKET	8192
+#else
+# define TFTP_MAX_PACKET	1432 /* 512 */
+#endif
+/* The RFC 7440 window asked for.  A window must fit in half of FSYS_BUF,
+   the part that tftp_read frees at a time.  */
+#define TFTP_WINDOWSIZE		8
 
 #define TFTP_RRQ	1
 #define TFTP_WRQ	2
@@ -243,6 +303,8 @@ Author: Martin Renters
 #define AWAIT_RARP	3
 #define AWAIT_RPC	4
 #define AWAIT_QDRAIN	5	/* drain queue, process ARP requests */
+#define AWAIT_TCP	6
+#define AWAIT_TFTP_SET	7	/* TFTP to any of IVAL ports at PTR */
 
 typedef struct
 {
@@ -295,6 +357,28 @@ struct udphdr
   unsigned short chksum;
 };
 
+#define TCP_FIN		0x01
+#define TCP_SYN		0x02
+#define TCP_RST		0x04
+#define TCP_PSH		0x08
+#define TCP_ACK		0x10
+
+/* The maximum segment size we announce, for an Ethernet MTU.  */
+#define TCP_MSS		1460
+
+struct tcphdr
+{
+  unsigned short src;
+  unsigned short dest;
+  unsigned int seq;
+  unsigned int ack;
+  unsigned char hlen;		/* In 32-bit words, in the high nibble.  */
+  unsigned char flags;
+  unsigned short window;
+  unsigned short chksum;
+  unsigned short urgent;
+};
+
 /* Format of a bootp packet.  */
 struct bootp_t
 {
@@ -401,6 +485,18 @@ struct tftpreq_t
 
 #define TFTP_MIN_PACKET	(sizeof(struct iphdr) + sizeof(struct udphdr) + 4)
 
+/* The round trip time of a TFTP transfer, in ticks, as RFC 6298 keeps
+   it: only the answers to packets which were sent once are timed, as
+   Karn has it, since the answer to one sent again could be to either.  */
+struct tftp_rtt
+{
+  long srtt;			/* smoothed, times 8 */
+  long rttvar;			/* mean deviation, times 4 */
+  unsigned long sent;		/* when the packet being timed was sent */
+  int timing;			/* whether one is */
+  int measured;			/* whether SRTT and RTTVAR are set */
+};
+
 struct rpc_t
 {
   struct iphdr ip;
@@ -496,21 +592,45 @@ External prototypes
 /* main.c */
 extern void print_network_configuration (void);
 extern int ifconfig (char *ip, char *sm, char *gw, char *svr);
+extern void ip_header (struct iphdr *ip, unsigned long destip, int protocol,
+		       int len);
+extern int ip_transmit (unsigned long destip, int len, const void *buf);
 extern int udp_transmit (unsigned long destip, unsigned int srcsock,
 			 unsigned int destsock, int len, const void *buf);
+extern unsigned short tcpudpchksum (struct iphdr *packet);
+extern int udp_copy (char *dest, const char *data, int len);
+extern int udp_check (void);
 extern int await_reply (int type, int ival, void *ptr, int timeout);
 extern int decode_rfc1533 (unsigned char *, int, int, int);
 extern long rfc2131_sleep_interval (int base, int exp);
+extern void tftp_rtt_init (struct tftp_rtt *rtt);
+extern void tftp_rtt_sent (struct tftp_rtt *rtt, int again);
+extern void tftp_rtt_answered (struct tftp_rtt *rtt);
+extern long tftp_rtt_timeout (struct tftp_rtt *rtt, int retry);
 extern void cleanup (void);
 extern int rarp (void);
 extern int bootp (void);
+extern int ip_mtu (void);
+extern int tftp_blksize (void);
+extern int tftp_windowsize (int blksize);
+extern void tftp_server_add (in_addr addr);
+extern int tftp_server_next (void);
 extern void cleanup_net (void);
 
+#ifdef PLATFORM_EFI
+/* efi/pxe.c */
+extern int grub_efi_pxe_dhcp_ack (void *buf, int size);
+#endif
+
+/* fsys_http.c */
+extern int http_server (char *arg);
+
 /* config.c */
 extern void print_config (void);
 extern void eth_reset (void);
 extern int eth_probe (void);
 extern int eth_poll (void);
+extern unsigned short vlan_id;
 extern void eth_transmit (const char *d, unsigned int t,
 			  unsigned int s, const void *p);
 extern void eth_disable (void);
@@ -531,11 +651,16 @@ extern int ip_abort;
 extern int network_ready;
 extern struct rom_info rom;
 extern struct arptable_t arptable[MAX_ARP];
+extern in_addr tftp_servers[TFTP_SERVERS];
+extern int tftp_server_count;
 #define	BOOTP_DATA_ADDR	(&bootp_data)
 
 /* config.c */
 extern struct nic nic;
 
+/* fsys_http.c */
+extern unsigned short http_port;
+
 /* Local hack - define some macros to use etherboot source files "as is".  */
 #ifndef GRUB
 # undef printf
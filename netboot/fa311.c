@@ -44,7 +44,7 @@ typedef   signed int   s32;
 #define le32desc_to_virt(addr)  bus_to_virt(le32_to_cpu(addr))
 
 #define TX_RING_SIZE 1
-#define RX_RING_SIZE 4
+#define RX_RING_SIZE NIC_RX_RING
 #define TIME_OUT     1000000
 #define PKT_BUF_SZ   1536
 
@@ -0,0 +1,706 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2004  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Fetch files from an HTTP/1.1 server instead of the TFTP server.  The
+   TCP client here is as simple as it gets: one connection at a time,
+   segments are only taken in order, and the receive window is the free
+   space in FSYS_BUF, so that the server never sends more than fits.  The
+   connection is kept alive between files, and a seek that the buffer
+   can't serve asks for the rest of the file with a Range header.  */
+
+/* #define HTTP_DEBUG	1 */
+
+#include <filesys.h>
+
+#define GRUB	1
+#include <etherboot.h>
+#include <nic.h>
+
+#define TCP_CLOSED	0
+#define TCP_SYN_SENT	1
+#define TCP_ESTABLISHED	2
+
+/* The longest request that we send, and the longest path in it.  */
+#define HTTP_REQUEST_MAX	512
+#define HTTP_PATH_MAX		256
+
+/* The port of the HTTP server, whose address is in
+   ARPTABLE[ARP_HTTPSERVER], or zero if files come via TFTP.  */
+unsigned short http_port;
+
+static struct
+{
+  struct iphdr ip;
+  struct tcphdr tcp;
+  /* One more byte for the padding of the checksum.  */
+  char data[HTTP_REQUEST_MAX + 1];
+}
+tp;
+
+static int tcp_state;
+static int retry;
+static unsigned short lport = 3000;
+/* The sequence numbers: our first one, the first one that the server
+   hasn't acknowledged, our next one, and the next one of the server.  */
+static unsigned int iss, snd_una, snd_nxt, rcv_nxt;
+/* The window that went in our last segment, and whether the server has
+   closed its side.  */
+static int last_window, peer_fin;
+/* The length of the request.  */
+static int reqlen;
+
+/* Whether the server keeps the connection open after the response, and
+   how many bytes of the response body have yet to arrive.  */
+static int keep_alive, body_left;
+static char path[HTTP_PATH_MAX];
+static char *buf;
+static int buf_read, saved_filepos;
+/* How many times the rest of the file has been asked for in a row,
+   after the connection broke.  */
+static int resumes;
+
+/* Send a segment with FLAGS and LEN bytes of TP.DATA, starting at SEQ.  */
+static int
+tcp_send (int flags, unsigned int seq, int len)
+{
+  int hlen = sizeof (struct tcphdr);
+
+  if (flags & TCP_SYN)
+    {
+      /* The only option, the maximum segment size.  */
+      tp.data[0] = 2;
+      tp.data[1] = 4;
+      tp.data[2] = TCP_MSS >> 8;
+      tp.data[3] = TCP_MSS & 0xFF;
+      hlen += 4;
+      len = 0;
+    }
+
+  last_window = FSYS_BUFLEN - buf_read;
+  tp.tcp.src = htons (lport);
+  tp.tcp.dest = htons (http_port);
+  tp.tcp.seq = htonl (seq);
+  tp.tcp.ack = (flags & TCP_ACK) ? htonl (rcv_nxt) : 0;
+  tp.tcp.hlen = (hlen / 4) << 4;
+  tp.tcp.flags = flags;
+  tp.tcp.window = htons (last_window);
+  tp.tcp.chksum = 0;
+  tp.tcp.urgent = 0;
+  ip_header (&tp.ip, arptable[ARP_HTTPSERVER].ipaddr.s_addr, IP_TCP,
+	     sizeof (tp.ip) + hlen + len);
+  tp.tcp.chksum = htons (tcpudpchksum (&tp.ip));
+
+#ifdef HTTP_DEBUG
+  grub_printf ("send flags=0x%x seq=%d len=%d\n", flags, (int) seq, len);
+#endif
+  return ip_transmit (arptable[ARP_HTTPSERVER].ipaddr.s_addr,
+		      sizeof (tp.ip) + hlen + len, &tp);
+}
+
+/* Abort the connection.  */
+static void
+tcp_reset (void)
+{
+  if (tcp_state != TCP_CLOSED)
+    tcp_send (TCP_RST | TCP_ACK, snd_nxt, 0);
+
+  tcp_state = TCP_CLOSED;
+}
+
+/* Handle the segment in NIC.PACKET, and append the data that is next in
+   sequence to BUF.  Return one if the segment belongs to the connection,
+   minus one if it resets the connection, and zero otherwise.  */
+static int
+tcp_input (void)
+{
+  struct iphdr *ip = (struct iphdr *) &nic.packet[ETH_HLEN];
+  struct tcphdr *tcp = (struct tcphdr *) &nic.packet[ETH_HLEN
+						     + sizeof (struct iphdr)];
+  unsigned int seq, ack;
+  int hlen, dlen, off;
+
+  if (ip->src.s_addr != arptable[ARP_HTTPSERVER].ipaddr.s_addr
+      || ntohs (tcp->src) != http_port)
+    return 0;
+
+  hlen = (tcp->hlen >> 4) * 4;
+  dlen = ntohs (ip->len) - sizeof (struct iphdr) - hlen;
+  if (hlen < sizeof (struct tcphdr) || dlen < 0)
+    return 0;
+
+  seq = ntohl (tcp->seq);
+  ack = ntohl (tcp->ack);
+
+#ifdef HTTP_DEBUG
+  grub_printf ("recv flags=0x%x seq=%d len=%d\n", tcp->flags, (int) seq,
+	       dlen);
+#endif
+
+  if (tcp_state == TCP_SYN_SENT)
+    {
+      if (! (tcp->flags & TCP_ACK) || ack != snd_nxt)
+	return 0;
+
+      if (tcp->flags & TCP_RST)
+	{
+	  tcp_state = TCP_CLOSED;
+	  return -1;
+	}
+
+      if (! (tcp->flags & TCP_SYN))
+	return 0;
+
+      rcv_nxt = seq + 1;
+      snd_una = snd_nxt;
+      tcp_state = TCP_ESTABLISHED;
+      retry = 0;
+      tcp_send (TCP_ACK, snd_nxt, 0);
+      return 1;
+    }
+
+  if (tcp_state != TCP_ESTABLISHED)
+    return 0;
+
+  if (tcp->flags & TCP_RST)
+    {
+      tcp_state = TCP_CLOSED;
+      return -1;
+    }
+
+  if ((tcp->flags & TCP_ACK)
+      && (int) (ack - snd_una) > 0 && (int) (snd_nxt - ack) >= 0)
+    snd_una = ack;
+
+  retry = 0;
+
+  /* Take what is new of the data, as much as fits.  Beyond that, the
+     server has ignored our window, so it must send the rest again.  */
+  off = rcv_nxt - seq;
+  if (off >= 0 && off < dlen)
+    {
+      int amt = dlen - off;
+
+      if (amt > FSYS_BUFLEN - buf_read)
+	amt = FSYS_BUFLEN - buf_read;
+
+      grub_memmove (buf + buf_read, (char *) tcp + hlen + off, amt);
+      buf_read += amt;
+      rcv_nxt += amt;
+    }
+
+  if ((tcp->flags & TCP_FIN) && ! peer_fin && seq + dlen == rcv_nxt)
+    {
+      rcv_nxt++;
+      peer_fin = 1;
+    }
+
+  /* Acknowledge any data, also one out of order or sent twice, so that
+     the server knows where we are.  */
+  if (dlen > 0 || (tcp->flags & (TCP_SYN | TCP_FIN)))
+    tcp_send (TCP_ACK, snd_nxt, 0);
+
+  return 1;
+}
+
+/* Wait for a segment of the connection, and send again what has been
+   lost meanwhile.  Return zero if the connection fails.  */
+static int
+tcp_recv (void)
+{
+  for (;;)
+    {
+      long timeout = rfc2131_sleep_interval (TCP_REXMT, retry);
+
+      if (await_reply (AWAIT_TCP, lport, NULL, timeout))
+	{
+	  int ret = tcp_input ();
+
+	  if (ret)
+	    return ret > 0;
+
+	  continue;
+	}
+
+      if (ip_abort || ++retry > MAX_TCP_RETRIES)
+	return 0;
+
+#ifdef HTTP_DEBUG
+      grub_printf ("timeout %d\n", retry);
+#endif
+      if (tcp_state == TCP_SYN_SENT)
+	tcp_send (TCP_SYN, iss, 0);
+      else if (snd_una != snd_nxt)
+	tcp_send (TCP_PSH | TCP_ACK, snd_nxt - reqlen, reqlen);
+      else
+	/* Our last window update may have been lost.  */
+	tcp_send (TCP_ACK, snd_nxt, 0);
+    }
+}
+
+/* Open a new connection to the HTTP server.  */
+static int
+tcp_connect (void)
+{
+  if (++lport < 3000)
+    lport = 3000;
+
+  iss = (currticks () << 16) + lport;
+  snd_una = iss;
+  snd_nxt = iss + 1;
+  rcv_nxt = 0;
+  retry = 0;
+  peer_fin = 0;
+  buf_read = 0;
+  tcp_state = TCP_SYN_SENT;
+
+  /* As in send_rrq, the Rx queue holds nothing of interest.  */
+  await_reply (AWAIT_QDRAIN, 0, NULL, 0);
+
+  if (! tcp_send (TCP_SYN, iss, 0))
+    {
+      tcp_state = TCP_CLOSED;
+      return 0;
+    }
+
+  while (tcp_state == TCP_SYN_SENT)
+    if (! tcp_recv ())
+      {
+	tcp_state = TCP_CLOSED;
+	return 0;
+      }
+
+  return 1;
+}
+
+/* If STR begins with the lower case WORD, ignoring the case of STR,
+   return what follows WORD, otherwise zero.  */
+static char *
+match_word (char *str, const char *word)
+{
+  while (*word)
+    if (grub_tolower (*str++) != *word++)
+      return 0;
+
+  return str;
+}
+
+/* Return the value of the header field LINE if its name is NAME, or
+   zero if not.  */
+static char *
+header_value (char *line, const char *name)
+{
+  line = match_word (line, name);
+  if (! line || *line++ != ':')
+    return 0;
+
+  while (*line == ' ' || *line == '\t')
+    line++;
+
+  return line;
+}
+
+/* Read the header of the response to the request for the file from
+   OFFSET on, and leave the beginning of the body in BUF.  Return one on
+   success, zero with ERRNUM set on failure, and minus one if the server
+   has closed the connection before responding.  */
+static int
+http_response (int offset)
+{
+  char *p, *end;
+  int status, length = -1, start = 0;
+
+  buf_read = 0;
+  for (;;)
+    {
+      for (end = buf; end + 4 <= buf + buf_read; end++)
+	if (! grub_memcmp (end, "\r\n\r\n", 4))
+	  break;
+
+      if (end + 4 <= buf + buf_read)
+	break;
+
+      if (buf_read == FSYS_BUFLEN || ip_abort)
+	{
+	  errnum = ERR_READ;
+	  return 0;
+	}
+
+      if (peer_fin || ! tcp_recv ())
+	{
+	  if (! buf_read && (peer_fin || tcp_state == TCP_CLOSED))
+	    return -1;
+
+	  errnum = ERR_READ;
+	  return 0;
+	}
+    }
+
+  /* The status line.  */
+  if (grub_memcmp (buf, "HTTP/1.", 7))
+    {
+      errnum = ERR_READ;
+      return 0;
+    }
+
+  /* HTTP/1.0 closes the connection after the response.  */
+  keep_alive = (buf[7] != '0');
+  p = buf + 8;
+  while (*p == ' ')
+    p++;
+
+  status = getdec (&p);
+
+  /* The header fields, each of which ends with CR LF, up to END.  */
+  for (p = buf; p < end; p++)
+    {
+      char *value;
+
+      if (p[0] != '\r' || p[1] != '\n')
+	continue;
+
+      p += 2;
+      if ((value = header_value (p, "content-length")))
+	length = getdec (&value);
+      else if ((value = header_value (p, "connection")))
+	{
+	  if (match_word (value, "close"))
+	    keep_alive = 0;
+	}
+      else if ((value = header_value (p, "content-range")))
+	{
+	  if ((value = match_word (value, "bytes ")))
+	    start = getdec (&value);
+	}
+    }
+
+#ifdef HTTP_DEBUG
+  grub_printf ("status %d, length %d, start %d\n", status, length, start);
+#endif
+
+  if (status != 200 && status != 206)
+    {
+      /* Don't bother to read the body of the error.  */
+      keep_alive = 0;
+      errnum = ERR_FILE_NOT_FOUND;
+      return 0;
+    }
+
+  /* A 200 response to a range request carries the whole file, so BUF_FILL
+     skips the bytes before OFFSET.  Without Content-Length, the body
+     is chunked or ends when the server closes the connection, neither
+     of which we handle.  */
+  if (status == 200)
+    start = 0;
+
+  if (length < 0 || start < 0 || start > offset)
+    {
+      keep_alive = 0;
+      errnum = ERR_READ;
+      return 0;
+    }
+
+  if (! offset)
+    filemax = length;
+
+  /* Move the beginning of the body to the beginning of BUF.  */
+  end += 4;
+  buf_read -= end - buf;
+  if (buf_read > length)
+    buf_read = length;
+
+  grub_memmove (buf, end, buf_read);
+  saved_filepos = start;
+  body_left = length - buf_read;
+  return 1;
+}
+
+/* Send the request for the file from OFFSET on, and read the header of
+   the response.  */
+static int
+http_open (int offset)
+{
+  int reused, ret;
+
+#ifdef HTTP_DEBUG
+  grub_printf ("http_open (%s, %d)\n", path, offset);
+#endif
+
+  buf = (char *) FSYS_BUF;
+
+  /* A connection is only good for the next request once the body of
+     the last response has been read up to the end.  */
+  if (body_left || peer_fin || ! keep_alive)
+    tcp_reset ();
+
+  body_left = 0;
+  do
+    {
+      reused = (tcp_state == TCP_ESTABLISHED);
+      if (! reused && ! tcp_connect ())
+	{
+	  errnum = ERR_READ;
+	  return 0;
+	}
+
+      reqlen = etherboot_sprintf (tp.data, "GET %s HTTP/1.1\r\nHost: %@",
+				  path,
+				  arptable[ARP_HTTPSERVER].ipaddr.s_addr);
+      if (http_port != HTTP_PORT)
+	reqlen += etherboot_sprintf (tp.data + reqlen, ":%d", http_port);
+
+      if (offset)
+	reqlen += etherboot_sprintf (tp.data + reqlen,
+				     "\r\nRange: bytes=%d-", offset);
+
+      reqlen += etherboot_sprintf (tp.data + reqlen,
+				   "\r\nConnection: keep-alive\r\n\r\n");
+
+      snd_nxt += reqlen;
+      retry = 0;
+      if (! tcp_send (TCP_PSH | TCP_ACK, snd_nxt - reqlen, reqlen))
+	{
+	  tcp_reset ();
+	  errnum = ERR_WRITE;
+	  return 0;
+	}
+
+      ret = http_response (offset);
+      if (ret < 0)
+	/* The server has dropped the idle connection in the meantime, so
+	   try again once with a new one.  */
+	tcp_reset ();
+    }
+  while (ret < 0 && reused);
+
+  if (ret < 0)
+    errnum = ERR_READ;
+
+  if (ret <= 0)
+    tcp_reset ();
+
+  return ret > 0;
+}
+
+/* Fill the buffer with more of the response body.  */
+static int
+buf_fill (void)
+{
+#ifdef HTTP_DEBUG
+  grub_printf ("buf_fill ()\n");
+#endif
+
+  /* Tell the server if http_read has made room in the buffer.  */
+  if (body_left > 0 && FSYS_BUFLEN - buf_read >= last_window + TCP_MSS)
+    tcp_send (TCP_ACK, snd_nxt, 0);
+
+  while (body_left > 0 && buf_read < FSYS_BUFLEN)
+    {
+      int prev = buf_read;
+
+      if (peer_fin || ! tcp_recv ())
+	return 0;
+
+      body_left -= buf_read - prev;
+    }
+
+  if (body_left < 0)
+    {
+      /* More than the body.  Drop it, and the connection.  */
+      buf_read += body_left;
+      body_left = 0;
+      keep_alive = 0;
+    }
+
+  return 1;
+}
+
+/* Use the HTTP server ARG, which is IPADDR[:PORT].  If ARG is "off",
+   fetch the files via TFTP again.  Return zero if ARG is wrong.  */
+int
+http_server (char *arg)
+{
+  in_addr addr;
+  char *p;
+  int port = HTTP_PORT;
+
+  if (grub_memcmp (arg, "off", 3) == 0 && (! arg[3] || arg[3] == ' '))
+    {
+      tcp_reset ();
+      http_port = 0;
+      return 1;
+    }
+
+  if (! inet_aton (arg, &addr))
+    return 0;
+
+  p = arg;
+  while (*p && *p != ':' && *p != ' ')
+    p++;
+
+  if (*p == ':')
+    {
+      p++;
+      port = getdec (&p);
+      if (port <= 0 || port > 0xFFFF)
+	return 0;
+    }
+
+  tcp_reset ();
+  arptable[ARP_HTTPSERVER].ipaddr.s_addr = addr.s_addr;
+  grub_memset (arptable[ARP_HTTPSERVER].node, 0, ETH_ALEN);
+  http_port = port;
+  return 1;
+}
+
+/* Mount the network drive, if files come from an HTTP server.  */
+int
+http_mount (void)
+{
+  if (current_drive != NETWORK_DRIVE || ! network_ready || ! http_port)
+    return 0;
+
+  return 1;
+}
+
+/* Read up to SIZE bytes, returned in ADDR.  */
+int
+http_read (char *addr, int size)
+{
+  int ret = 0;
+
+#ifdef HTTP_DEBUG
+  grub_printf ("http_read (0x%x, %d)\n", (int) addr, size);
+#endif
+
+  if (filepos < saved_filepos
+      || filepos > saved_filepos + buf_read + FSYS_BUFLEN)
+    {
+      /* FILEPOS has moved backwards, or far ahead, as when the gzip
+	 trailer is read.  Ask for the rest of the file from there.  */
+      if (! http_open (filepos))
+	return 0;
+    }
+
+  while (size > 0)
+    {
+      int amt = buf_read + saved_filepos - filepos;
+
+      if (amt > size)
+	amt = size;
+
+      if (amt > 0)
+	{
+	  grub_memmove (addr, buf + filepos - saved_filepos, amt);
+	  size -= amt;
+	  addr += amt;
+	  filepos += amt;
+	  ret += amt;
+
+	  /* As in tftp_read, move the unused data forwards when the
+	     empty space becomes small.  */
+	  if (filepos - saved_filepos > FSYS_BUFLEN / 2)
+	    {
+	      grub_memmove (buf, buf + FSYS_BUFLEN / 2, FSYS_BUFLEN / 2);
+	      buf_read -= FSYS_BUFLEN / 2;
+	      saved_filepos += FSYS_BUFLEN / 2;
+	    }
+	}
+      else
+	{
+	  /* Skip the whole buffer.  */
+	  saved_filepos += buf_read;
+	  buf_read = 0;
+	}
+
+      if (size > 0 && ! buf_fill ())
+	{
+	  tcp_reset ();
+	  /* Ask for the rest of the file, from where the reading is, on
+	     a new connection.  */
+	  if (! ip_abort && resumes++ < MAX_RESUMES)
+	    {
+	      grub_printf ("HTTP transfer broken, resuming at %d\n", filepos);
+	      if (http_open (filepos))
+		continue;
+	    }
+	  errnum = ERR_READ;
+	  return 0;
+	}
+      resumes = 0;
+
+      /* Sanity check.  */
+      if (size > 0 && buf_read == 0)
+	{
+	  errnum = ERR_READ;
+	  return 0;
+	}
+    }
+
+  return ret;
+}
+
+/* Request the file DIRNAME, which gets its size in FILEMAX.  */
+int
+http_dir (char *dirname)
+{
+  int ch;
+
+#ifdef HTTP_DEBUG
+  grub_printf ("http_dir (%s)\n", dirname);
+#endif
+
+  /* Like TFTP, HTTP has no way to list a directory.  */
+  if (print_possibilities)
+    return 1;
+
+  ch = nul_terminate (dirname);
+  if (grub_strlen (dirname) >= HTTP_PATH_MAX)
+    {
+      dirname[grub_strlen (dirname)] = ch;
+      errnum = ERR_BAD_FILENAME;
+      return 0;
+    }
+
+  grub_strcpy (path, dirname);
+  dirname[grub_strlen (dirname)] = ch;
+
+  filemax = -1;
+  return http_open (0);
+}
+
+/* Close the file.  */
+void
+http_close (void)
+{
+#ifdef HTTP_DEBUG
+  grub_printf ("http_close ()\n");
+#endif
+
+  /* Drop the connection if the rest of the file is still coming.  */
+  if (body_left)
+    tcp_reset ();
+}
+
+/* The server which the files come from, for the cache of them.  */
+unsigned long long
+http_server_id (void)
+{
+  return ((unsigned long long) http_port << 32
+	  | arptable[ARP_HTTPSERVER].ipaddr.s_addr);
+}
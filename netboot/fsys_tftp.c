@@ -29,6 +29,7 @@ Author: Martin Renters
 /* #define TFTP_DEBUG	1 */
 
 #include <filesys.h>
+#include <bootprof.h>
 
 #define GRUB	1
 #include <etherboot.h>
@@ -44,7 +45,39 @@ static int packetsize;
 static int buf_eof, buf_read;
 static int saved_filepos;
 static unsigned short len, saved_len;
+/* Where buf_fill puts the data, and how much it may put there: the
+   file system buffer, or for a large read the memory read into.  */
 static char *buf;
+static int buf_size;
+/* RFC 7440: the number of blocks the server sends before it waits for an
+   ACK, how many of them have arrived, whether the ACK for a complete
+   window is still to be sent, and whether a gap in the current window
+   has been reported.  */
+static int windowsize, winblock, ack_pending, gap;
+/* How much of the file has been received, how much of what the server
+   in use sends is to be dropped because it was received already, and
+   how many times the file has been asked for again since it was
+   opened.  */
+static int received, skip, failovers;
+/* The round trip time to the server in use, which the timeouts follow,
+   and how long it has gone without sending a new block.  */
+static struct tftp_rtt rtt;
+static long stalled;
+
+static int send_rrq (void);
+
+/* Acknowledge the blocks up to PREVBLOCK, or abort the transfer.  */
+static void
+send_ack (int abort)
+{
+  tp.opcode = abort ? htons (TFTP_ERROR) : htons (TFTP_ACK);
+  tp.u.ack.block = htons (prevblock);
+#ifdef TFTP_DEBUG
+  grub_printf ("ACK %d\n", prevblock);
+#endif
+  udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr, iport,
+		oport, TFTP_MIN_PACKET, &tp);
+}
 
 /* Fill the buffer by receiving the data via the TFTP protocol.  */
 static int
@@ -54,13 +87,31 @@ buf_fill (int abort)
   grub_printf ("buf_fill (%d)\n", abort);
 #endif
   
-  while (! buf_eof && (buf_read + packetsize <= FSYS_BUFLEN))
+  while (! buf_eof && (buf_read + packetsize <= buf_size))
     {
       struct tftp_t *tr;
       long timeout;
+      unsigned short ahead;
+
+      if (ack_pending)
+	{
+	  /* The server sends the next window as soon as it sees the ACK,
+	     so send it only when the whole window fits in the buffer.  */
+	  if (! abort && buf_read + windowsize * packetsize > buf_size)
+	    break;
+
+	  ack_pending = 0;
+	  send_ack (abort);
+	  if (abort)
+	    {
+	      buf_eof = 1;
+	      break;
+	    }
+	  tftp_rtt_sent (&rtt, 0);
+	}
 
 #ifdef CONGESTED
-      timeout = rfc2131_sleep_interval (block ? TFTP_REXMT : TIMEOUT, retry);
+      timeout = tftp_rtt_timeout (&rtt, retry);
 #else
       timeout = rfc2131_sleep_interval (TIMEOUT, retry);
 #endif
@@ -70,37 +121,75 @@ buf_fill (int abort)
 	  if (ip_abort)
 	    return 0;
 
+	  tftp_stat.timeouts++;
 	  if (! block && retry++ < MAX_TFTP_RETRIES)
 	    {
 	      /* Maybe initial request was lost.  */
 #ifdef TFTP_DEBUG
 	      grub_printf ("Maybe initial request was lost.\n");
 #endif
+	      tftp_stat.retransmits++;
+	      /* Or the server is down or too busy; ask the next, if
+		 there is another.  */
+	      tftp_server_next ();
 	      if (! udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr,
 				  ++iport, TFTP_PORT, len, &tp))
 		return 0;
+	      tftp_rtt_sent (&rtt, 1);
 	      
 	      continue;
 	    }
 	  
 #ifdef CONGESTED
-	  if (block && ((retry += TFTP_REXMT) < TFTP_TIMEOUT))
+	  if (block && (stalled += timeout) < TFTP_TIMEOUT)
 	    {
 	      /* We resend our last ack.  */
 # ifdef TFTP_DEBUG
 	      grub_printf ("<REXMT>\n");
 # endif
+	      retry++;
+	      tftp_stat.retransmits++;
 	      udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr,
 			    iport, oport,
 			    TFTP_MIN_PACKET, &tp);
+	      tftp_rtt_sent (&rtt, 1);
 	      continue;
 	    }
 #endif
+	  /* The server has stopped sending.  Ask the next one for the
+	     file, or the same one if there is no other and the transfer
+	     had got going, and drop what of it has been received
+	     already.  TFTP can't start a file in the middle, but the
+	     read goes on from where it was.  */
+	  if (failovers < (tftp_server_count - 1
+			   + (received ? MAX_RESUMES : 0)))
+	    {
+	      int done = received;
+
+	      failovers++;
+	      if (tftp_server_next ())
+		etherboot_printf ("TFTP server not answering, trying %@\n",
+				  arptable[ARP_SERVER].ipaddr.s_addr);
+	      else
+		grub_printf ("TFTP transfer stalled, resuming at %d\n", done);
+	      grub_memmove ((char *) &tp, (char *) &saved_tp, saved_len);
+	      len = saved_len;
+	      if (! send_rrq ())
+		return 0;
+	      received = skip = done;
+	      continue;
+	    }
+	  
 	  /* Timeout.  */
 	  return 0;
 	}
 
       tr = (struct tftp_t *) &nic.packet[ETH_HLEN];
+      /* The sum of a block which goes to the buffer is checked as it
+	 is copied there.  */
+      if (tr->opcode != ntohs (TFTP_DATA) && ! udp_check ())
+	continue;
+      
       if (tr->opcode == ntohs (TFTP_ERROR))
 	{
 	  grub_printf ("TFTP error %d (%s)\n",
@@ -135,7 +224,8 @@ buf_fill (int abort)
 	      if (! grub_strcmp ("blksize", p))
 		{
 		  p += 8;
-		  if ((packetsize = getdec (&p)) < TFTP_DEFAULTSIZE_PACKET)
+		  if ((packetsize = getdec (&p)) < TFTP_DEFAULTSIZE_PACKET
+		      || packetsize > TFTP_MAX_PACKET)
 		    goto noak;
 #ifdef TFTP_DEBUG
 		  grub_printf ("blksize = %d\n", packetsize);
@@ -151,6 +241,16 @@ buf_fill (int abort)
 		    }
 #ifdef TFTP_DEBUG
 		  grub_printf ("tsize = %d\n", filemax);
+#endif
+		}
+	      else if (! grub_strcmp ("windowsize", p))
+		{
+		  p += 11;
+		  if ((windowsize = getdec (&p)) < 1
+		      || windowsize > TFTP_WINDOWSIZE)
+		    goto noak;
+#ifdef TFTP_DEBUG
+		  grub_printf ("windowsize = %d\n", windowsize);
 #endif
 		}
 	      else
@@ -181,10 +281,14 @@ buf_fill (int abort)
 	  
 	  if (p > e)
 	    goto noak;
+
+	  tftp_stat.blksize = packetsize;
+	  tftp_stat.windowsize = windowsize;
+	  tftp_rtt_answered (&rtt);
 	  
 	  /* This ensures that the packet does not get processed as
 	     data!  */
-	  block = tp.u.ack.block = 0;
+	  block = 0;
 	}
       else if (tr->opcode == ntohs (TFTP_DATA))
 	{
@@ -202,58 +306,101 @@ buf_fill (int abort)
 	      continue;
 	    }
 	  
-	  block = ntohs (tp.u.ack.block = tr->u.data.block);
+	  block = ntohs (tr->u.data.block);
+	  tftp_stat.packets++;
 	}
       else
 	/* Neither TFTP_OACK nor TFTP_DATA.  */
 	break;
 
-      if ((block || bcounter) && (block != prevblock + (unsigned short) 1))
-	/* Block order should be continuous */
-	tp.u.ack.block = htons (block = prevblock);
-      
-      /* Should be continuous.  */
-      tp.opcode = abort ? htons (TFTP_ERROR) : htons (TFTP_ACK);
       oport = ntohs (tr->udp.src);
 
-#ifdef TFTP_DEBUG
-      grub_printf ("ACK\n");
-#endif
-      /* Ack.  */
-      udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr, iport,
-		    oport, TFTP_MIN_PACKET, &tp);
-      
       if (abort)
 	{
+	  send_ack (1);
 	  buf_eof = 1;
 	  break;
 	}
 
-      /* Retransmission or OACK.  */
-      if ((unsigned short) (block - prevblock) != 1)
-	/* Don't process.  */
-	continue;
+      /* Retransmission, a block after a lost one, or OACK.  Block
+	 numbers wrap around in big files, so compare them modulo 2^16.  */
+      ahead = block - prevblock;
+      if (ahead != 1)
+	{
+	  if (! udp_check ())
+	    continue;
+	  
+	  /* Ask for everything after PREVBLOCK, which also acknowledges
+	     the OACK.  The rest of a window after a lost block would
+	     repeat the same request, so send it once per gap.  */
+	  if (! gap)
+	    {
+	      send_ack (0);
+	      /* Timed if it acknowledges the OACK, which is the first
+		 time PREVBLOCK is.  */
+	      tftp_rtt_sent (&rtt, tr->opcode == ntohs (TFTP_DATA));
+	    }
+	  if (tr->opcode == ntohs (TFTP_DATA))
+	    tftp_stat.retransmits++;
+	  gap = (bcounter && ahead > 1 && ahead <= windowsize);
+	  winblock = 0;
+	  continue;
+	}
       
+      /* Copy the downloaded data to the buffer.  */
+      {
+	char *data = tr->u.data.download;
+	int n = len;
+	int drop = skip < n ? skip : n;
+
+	if (! udp_copy (buf + buf_read, data + drop, n - drop))
+	  continue;
+	skip -= drop;
+	n -= drop;
+	buf_read += n;
+	received += n;
+	tftp_stat.bytes += n;
+      }
+
       prevblock = block;
+      gap = 0;
+      tftp_rtt_answered (&rtt);
       /* Is it the right place to zero the timer?  */
       retry = 0;
+      stalled = 0;
 
       /* In GRUB, this variable doesn't play any important role at all,
 	 but use it for consistency with Etherboot.  */
       bcounter++;
-      
-      /* Copy the downloaded data to the buffer.  */
-      grub_memmove (buf + buf_read, tr->u.data.download, len);
-      buf_read += len;
 
       /* End of data.  */
-      if (len < packetsize)		
-	buf_eof = 1;
+      if (len < packetsize)
+	{
+	  buf_eof = 1;
+	  send_ack (0);
+	  tftp_stat_end ();
+	}
+      else if (++winblock == windowsize)
+	{
+	  winblock = 0;
+	  ack_pending = 1;
+	}
     }
   
   return 1;
 }
 
+/* Empty the buffer, for the file to be read from the start.  */
+static void
+buf_reset (void)
+{
+  buf = (char *) FSYS_BUF;
+  buf_size = FSYS_BUFLEN;
+  buf_eof = 0;
+  buf_read = 0;
+  saved_filepos = 0;
+}
+
 /* Send the RRQ whose length is LEN.  */
 static int
 send_rrq (void)
@@ -264,11 +411,18 @@ send_rrq (void)
   prevblock = 0;
   packetsize = TFTP_DEFAULTSIZE_PACKET;
   bcounter = 0;
-
-  buf = (char *) FSYS_BUF;
-  buf_eof = 0;
-  buf_read = 0;
-  saved_filepos = 0;
+  windowsize = 1;
+  winblock = 0;
+  ack_pending = 0;
+  gap = 0;
+  received = 0;
+  skip = 0;
+  stalled = 0;
+  tftp_rtt_init (&rtt);
+
+  /* What the server has agreed to until it sends an OACK.  */
+  tftp_stat.blksize = packetsize;
+  tftp_stat.windowsize = windowsize;
 
   /* Clear out the Rx queue first.  It contains nothing of interest,
    * except possibly ARP requests from the DHCP/TFTP server.  We use
@@ -294,8 +448,11 @@ send_rrq (void)
   }
 #endif
   /* Send the packet.  */
-  return udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr, ++iport,
-		       TFTP_PORT, len, &tp);
+  if (! udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr, ++iport,
+		      TFTP_PORT, len, &tp))
+    return 0;
+  tftp_rtt_sent (&rtt, 0);
+  return 1;
 }
 
 /* Mount the network drive. If the drive is ready, return one, otherwise
@@ -347,6 +504,9 @@ tftp_read (char *addr, int size)
       }
 #endif
       
+      tftp_stat_begin (0);
+      buf_reset ();
+      failovers = 0;
       if (! send_rrq ())
 	{
 	  errnum = ERR_WRITE;
@@ -386,6 +546,39 @@ tftp_read (char *addr, int size)
 	  /* Skip the whole buffer.  */
 	  saved_filepos += buf_read;
 	  buf_read = 0;
+
+	  /* The buffer is empty, so if a whole block fits in ADDR, copy
+	     the blocks from the packets straight there, and not through
+	     the buffer.  */
+	  if (size >= packetsize && ! buf_eof)
+	    {
+	      int ok;
+
+	      buf = addr;
+	      buf_size = size;
+	      ok = buf_fill (0);
+	      buf = (char *) FSYS_BUF;
+	      buf_size = FSYS_BUFLEN;
+
+	      size -= buf_read;
+	      addr += buf_read;
+	      filepos += buf_read;
+	      ret += buf_read;
+	      saved_filepos += buf_read;
+	      amt = buf_read;
+	      buf_read = 0;
+
+	      if (! ok)
+		{
+		  errnum = ERR_READ;
+		  return 0;
+		}
+
+	      /* If nothing came, as when the next window wouldn't fit,
+		 go on through the buffer.  */
+	      if (amt)
+		continue;
+	    }
 	}
 
       /* Read the data.  */
@@ -429,16 +622,20 @@ tftp_dir (char *dirname)
   tp.opcode = htons (TFTP_RRQ);
   /* Terminate the filename.  */
   ch = nul_terminate (dirname);
-  /* Make the request string (octet, blksize and tsize).  */
+  /* Make the request string (octet, blksize, tsize and windowsize).  */
   len = (grub_sprintf ((char *) tp.u.rrq,
-		       "%s%coctet%cblksize%c%d%ctsize%c0",
-		       dirname, 0, 0, 0, TFTP_MAX_PACKET, 0, 0)
+		       "%s%coctet%cblksize%c%d%ctsize%c0%cwindowsize%c%d",
+		       dirname, 0, 0, 0, tftp_blksize (), 0, 0, 0, 0,
+		       tftp_windowsize (tftp_blksize ()))
 	 + sizeof (tp.ip) + sizeof (tp.udp) + sizeof (tp.opcode) + 1);
+  tftp_stat_begin (dirname);
   /* Restore the original DIRNAME.  */
   dirname[grub_strlen (dirname)] = ch;
   /* Save the TFTP packet so that we can reopen the file later.  */
   grub_memmove ((char *) &saved_tp, (char *) &tp, len);
   saved_len = len;
+  buf_reset ();
+  failovers = 0;
   if (! send_rrq ())
     {
       errnum = ERR_WRITE;
@@ -495,3 +692,269 @@ tftp_close (void)
   buf_read = 0;
   buf_fill (1);
 }
+
+/* The transfers of tftp_fetch, each from a port of its own, with the
+   state of its blocks, and the request or the ACK it sends.  */
+struct tftp_session
+{
+  struct tftp_fetch *file;
+  struct tftpreq_t tp;
+  int len;
+  unsigned short iport, oport, prevblock;
+  int packetsize, windowsize, winblock, gap;
+  int received, retry, done;
+  unsigned long deadline;
+  struct tftp_rtt rtt;
+};
+
+static struct tftp_session sessions[TFTP_FETCH_MAX];
+
+/* Send what S last sent again: the request until the server answers,
+   then the ACK.  */
+static void
+session_send (struct tftp_session *s, int abort)
+{
+  if (abort)
+    {
+      s->tp.opcode = htons (TFTP_ERROR);
+      s->tp.u.ack.block = 0;
+    }
+  else if (s->oport)
+    {
+      s->tp.opcode = htons (TFTP_ACK);
+      s->tp.u.ack.block = htons (s->prevblock);
+    }
+
+  if (s->oport)
+    udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr, s->iport, s->oport,
+		  TFTP_MIN_PACKET, &s->tp);
+  else if (! abort)
+    udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr, s->iport, TFTP_PORT,
+		  s->len, &s->tp);
+
+  tftp_rtt_sent (&s->rtt, s->retry);
+  s->deadline = currticks () + tftp_rtt_timeout (&s->rtt, s->retry);
+}
+
+/* S is done, with its file if OK.  */
+static void
+session_end (struct tftp_session *s, int ok)
+{
+  if (! ok && s->oport)
+    session_send (s, 1);
+  s->file->ok = ok && s->received == s->file->size;
+  s->done = 1;
+}
+
+/* Take the packet in NIC.PACKET, which is for S.  */
+static void
+session_receive (struct tftp_session *s)
+{
+  struct tftp_t *tr = (struct tftp_t *) &nic.packet[ETH_HLEN];
+  unsigned short ahead;
+  int len;
+
+  if (tr->opcode != ntohs (TFTP_DATA) && ! udp_check ())
+    return;
+
+  if (tr->opcode == ntohs (TFTP_OACK))
+    {
+      char *p = tr->u.oack.data, *e;
+
+      if (s->prevblock || s->oport)
+	return;
+
+      len = ntohs (tr->udp.len) - sizeof (struct udphdr) - 2;
+      e = p + (len > TFTP_MAX_PACKET ? TFTP_MAX_PACKET : len);
+      while (p < e && *p)
+	{
+	  if (! grub_strcmp ("blksize", p))
+	    {
+	      p += 8;
+	      s->packetsize = getdec (&p);
+	    }
+	  else if (! grub_strcmp ("windowsize", p))
+	    {
+	      p += 11;
+	      s->windowsize = getdec (&p);
+	    }
+	  while (p < e && *p)
+	    p++;
+	  if (p < e)
+	    p++;
+	}
+
+      s->oport = ntohs (tr->udp.src);
+      if (s->packetsize < TFTP_DEFAULTSIZE_PACKET
+	  || s->packetsize > TFTP_MAX_PACKET
+	  || s->windowsize < 1 || s->windowsize > TFTP_WINDOWSIZE)
+	{
+	  session_end (s, 0);
+	  return;
+	}
+
+      tftp_rtt_answered (&s->rtt);
+      s->retry = 0;
+      session_send (s, 0);
+      return;
+    }
+
+  if (tr->opcode != ntohs (TFTP_DATA))
+    {
+      if (tr->opcode == ntohs (TFTP_ERROR))
+	session_end (s, 0);
+      return;
+    }
+
+  len = ntohs (tr->udp.len) - sizeof (struct udphdr) - 4;
+  if (len < 0 || len > s->packetsize)
+    return;
+
+  s->oport = ntohs (tr->udp.src);
+  ahead = ntohs (tr->u.data.block) - s->prevblock;
+  if (ahead != 1)
+    {
+      /* Ask for what follows the last block, once for each gap.  */
+      if (! udp_check ())
+	return;
+      if (! s->gap)
+	session_send (s, 0);
+      s->gap = (ahead > 1 && ahead <= s->windowsize);
+      s->winblock = 0;
+      return;
+    }
+
+  if (len > s->file->size - s->received)
+    {
+      session_end (s, 0);
+      return;
+    }
+  if (! udp_copy (s->file->addr + s->received, tr->u.data.download, len))
+    return;
+
+  s->received += len;
+  s->prevblock++;
+  s->gap = 0;
+  s->retry = 0;
+  tftp_rtt_answered (&s->rtt);
+  tftp_stat.packets++;
+  tftp_stat.bytes += len;
+
+  if (len < s->packetsize)
+    {
+      session_send (s, 0);
+      session_end (s, 1);
+    }
+  else if (++s->winblock == s->windowsize)
+    {
+      s->winblock = 0;
+      session_send (s, 0);
+    }
+  else
+    s->deadline = currticks () + tftp_rtt_timeout (&s->rtt, 0);
+}
+
+/* Fetch the COUNT files in FILES, up to TFTP_FETCH_MAX, whose sizes are
+   known, each over a session of its own, all at the same time: while
+   one server waits for the ACK of a window, the others send theirs.
+   Return how many of them came whole; the others are to be read as
+   usual, from another server if need be.  */
+int
+tftp_fetch (struct tftp_fetch *files, int count)
+{
+  unsigned short ports[TFTP_FETCH_MAX];
+  int i, active, ok = 0;
+
+  if (count > TFTP_FETCH_MAX)
+    count = TFTP_FETCH_MAX;
+
+  await_reply (AWAIT_QDRAIN, 0, NULL, 0);
+  tftp_stat_begin (files[0].name);
+
+  for (i = 0; i < count; i++)
+    {
+      struct tftp_session *s = &sessions[i];
+
+      grub_memset ((char *) s, 0, sizeof (*s));
+      s->file = &files[i];
+      s->file->ok = 0;
+      s->packetsize = TFTP_DEFAULTSIZE_PACKET;
+      s->windowsize = 1;
+      s->iport = ports[i] = ++iport;
+      s->tp.opcode = htons (TFTP_RRQ);
+      s->len = (grub_sprintf ((char *) s->tp.u.rrq,
+			      "%s%coctet%cblksize%c%d%cwindowsize%c%d",
+			      files[i].name, 0, 0, 0, tftp_blksize (), 0, 0,
+			      tftp_windowsize (tftp_blksize ()))
+		+ sizeof (s->tp.ip) + sizeof (s->tp.udp)
+		+ sizeof (s->tp.opcode) + 1);
+      session_send (s, 0);
+    }
+
+  for (active = count; active > 0; )
+    {
+      unsigned long now = currticks (), first = ~0UL;
+
+      for (i = 0; i < count; i++)
+	if (! sessions[i].done && sessions[i].deadline < first)
+	  first = sessions[i].deadline;
+
+      if (await_reply (AWAIT_TFTP_SET, count, ports,
+		       first > now ? first - now : 0))
+	{
+	  struct udphdr *udp = (struct udphdr *) &nic.packet[ETH_HLEN
+							     + sizeof (struct iphdr)];
+
+	  for (i = 0; i < count; i++)
+	    if (ports[i] == ntohs (udp->dest) && ! sessions[i].done)
+	      {
+		session_receive (&sessions[i]);
+		if (sessions[i].done)
+		  {
+		    active--;
+		    ok += files[i].ok;
+		  }
+	      }
+	  continue;
+	}
+
+      if (ip_abort)
+	{
+	  for (i = 0; i < count; i++)
+	    if (! sessions[i].done)
+	      session_end (&sessions[i], 0);
+	  break;
+	}
+
+      /* Ask again where the server has gone quiet.  */
+      now = currticks ();
+      for (i = 0; i < count; i++)
+	{
+	  struct tftp_session *s = &sessions[i];
+
+	  if (s->done || s->deadline > now)
+	    continue;
+
+	  tftp_stat.timeouts++;
+	  if (++s->retry > MAX_TFTP_RETRIES)
+	    {
+	      session_end (s, 0);
+	      active--;
+	      continue;
+	    }
+
+	  tftp_stat.retransmits++;
+	  session_send (s, 0);
+	}
+    }
+
+  tftp_stat_end ();
+  return ok;
+}
+
+/* The server which the files come from, for the cache of them.  */
+unsigned long long
+tftp_server_id (void)
+{
+  return arptable[ARP_SERVER].ipaddr.s_addr;
+}
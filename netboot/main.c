@@ -40,11 +40,18 @@ Literature dealing with the network protocols:
 #define GRUB	1
 #include <etherboot.h>
 #include <nic.h>
+#include <bootprof.h>
 
 /* #define DEBUG	1 */
 
 struct arptable_t arptable[MAX_ARP];
 
+/* The TFTP servers to fall back on, the current one among them; the
+   one in use is always in arptable[ARP_SERVER].  */
+in_addr tftp_servers[TFTP_SERVERS];
+int tftp_server_count;
+static int tftp_server_cur;
+
 /* Set if the user pushes Control-C.  */
 int ip_abort = 0;
 /* Set if an ethernet card is probed and IP addresses are set.  */
@@ -54,6 +61,8 @@ struct rom_info rom;
 
 static int vendorext_isvalid;
 static unsigned int netmask;
+/* The interface MTU given by DHCP, or 0.  */
+static int if_mtu;
 static struct bootpd_t bootp_data;
 static unsigned int xid;
 static unsigned char *end_of_rfc1533 = NULL;
@@ -82,8 +91,9 @@ static const unsigned char dhcpdiscover[] =
   RFC2132_MSG_TYPE, 1, DHCPDISCOVER,	
   RFC2132_MAX_SIZE,2,	/* request as much as we can */
   ETH_MAX_MTU / 256, ETH_MAX_MTU % 256,
-  RFC2132_PARAM_LIST, 4, RFC1533_NETMASK, RFC1533_GATEWAY,
-  RFC1533_HOSTNAME, RFC1533_EXTENSIONPATH
+  RFC2132_PARAM_LIST, 6, RFC1533_NETMASK, RFC1533_GATEWAY,
+  RFC1533_HOSTNAME, RFC1533_EXTENSIONPATH, RFC2132_TFTP_SERVER,
+  RFC1533_INTMTU
 };
 
 static const unsigned char dhcprequest[] =
@@ -95,11 +105,12 @@ static const unsigned char dhcprequest[] =
   ETH_MAX_MTU / 256, ETH_MAX_MTU % 256,
   /* request parameters */
   RFC2132_PARAM_LIST,
-  /* 4 standard + 2 vendortags */
-  4 + 2,
+  /* 6 standard + 2 vendortags */
+  6 + 2,
   /* Standard parameters */
   RFC1533_NETMASK, RFC1533_GATEWAY,
-  RFC1533_HOSTNAME, RFC1533_EXTENSIONPATH,
+  RFC1533_HOSTNAME, RFC1533_EXTENSIONPATH, RFC2132_TFTP_SERVER,
+  RFC1533_INTMTU,
   /* Etherboot vendortags */
   RFC1533_VENDOR_MAGIC,
   RFC1533_VENDOR_CONFIGFILE,
@@ -108,7 +119,6 @@ static const unsigned char dhcprequest[] =
 #endif /* ! NO_DHCP_SUPPORT */
 
 static unsigned short ipchksum (unsigned short *ip, int len);
-static unsigned short udpchksum (struct iphdr *packet);
 
 void
 print_network_configuration (void)
@@ -122,7 +132,23 @@ print_network_configuration (void)
       etherboot_printf ("Address: %@\n", arptable[ARP_CLIENT].ipaddr.s_addr);
       etherboot_printf ("Netmask: %@\n", netmask);
       etherboot_printf ("Server: %@\n", arptable[ARP_SERVER].ipaddr.s_addr);
+      if (tftp_server_count > 1)
+	{
+	  int i;
+
+	  grub_printf ("TFTP servers:");
+	  for (i = 0; i < tftp_server_count; i++)
+	    etherboot_printf (" %@", tftp_servers[i].s_addr);
+	  grub_printf ("\n");
+	}
       etherboot_printf ("Gateway: %@\n", arptable[ARP_GATEWAY].ipaddr.s_addr);
+      if (vlan_id)
+	grub_printf ("VLAN: %d\n", vlan_id);
+      if (ip_mtu () != ETH_FRAME_LEN - ETH_HLEN)
+	grub_printf ("MTU: %d\n", ip_mtu ());
+      if (http_port)
+	etherboot_printf ("HTTP server: %@:%d\n",
+			  arptable[ARP_HTTPSERVER].ipaddr.s_addr, http_port);
     }
 }
 
@@ -171,8 +197,14 @@ ifconfig (char *ip, char *sm, char *gw, char *svr)
   /* Clear out the ARP entry.  */
   grub_memset (arptable[ARP_GATEWAY].node, 0, ETH_ALEN);
   
-  if (svr && ! inet_aton (svr, &arptable[ARP_SERVER].ipaddr)) 
-    return 0;
+  if (svr)
+    {
+      if (! inet_aton (svr, &arptable[ARP_SERVER].ipaddr))
+	return 0;
+
+      tftp_server_count = 0;
+      tftp_server_add (arptable[ARP_SERVER].ipaddr);
+    }
 
   /* Likewise.  */
   grub_memset (arptable[ARP_SERVER].node, 0, ETH_ALEN);
@@ -191,41 +223,135 @@ ifconfig (char *ip, char *sm, char *gw, char *svr)
 }
 
 
+/* Return the largest IP datagram to be sent or received: 1500 bytes,
+   or more if DHCP says that the link takes it and the NIC can do it,
+   or less if DHCP says so.  */
+int
+ip_mtu (void)
+{
+  int mtu = ETH_FRAME_LEN - ETH_HLEN;
+
+  if (if_mtu)
+    {
+      mtu = if_mtu;
+      if (mtu > (int) (nic.mtu ? nic.mtu : ETH_FRAME_LEN - ETH_HLEN))
+	mtu = nic.mtu ? nic.mtu : ETH_FRAME_LEN - ETH_HLEN;
+    }
+
+  return mtu;
+}
+
+/* Return the TFTP block size to ask for, the most that fits in a
+   datagram.  */
+int
+tftp_blksize (void)
+{
+  int size = (ip_mtu () - sizeof (struct iphdr) - sizeof (struct udphdr)
+	      - 4);
+
+  return size < TFTP_MAX_PACKET ? size : TFTP_MAX_PACKET;
+}
+
+/* Return the TFTP window to ask for with blocks of BLKSIZE bytes.  */
+int
+tftp_windowsize (int blksize)
+{
+  int windowsize = (FSYS_BUFLEN / 2) / blksize;
+
+  if (windowsize > TFTP_WINDOWSIZE)
+    windowsize = TFTP_WINDOWSIZE;
+  return windowsize < 1 ? 1 : windowsize;
+}
+
+/* Add ADDR to the TFTP servers, unless it is there already.  */
+void
+tftp_server_add (in_addr addr)
+{
+  int i;
+
+  if (! addr.s_addr)
+    return;
+  
+  for (i = 0; i < tftp_server_count; i++)
+    if (tftp_servers[i].s_addr == addr.s_addr)
+      return;
+
+  if (tftp_server_count == 0)
+    tftp_server_cur = 0;
+  if (tftp_server_count < TFTP_SERVERS)
+    tftp_servers[tftp_server_count++] = addr;
+}
+
+/* Make the next TFTP server the one in use, and return 1, or return 0
+   if there is no other.  */
+int
+tftp_server_next (void)
+{
+  if (tftp_server_count < 2)
+    return 0;
+
+  tftp_server_cur = (tftp_server_cur + 1) % tftp_server_count;
+  arptable[ARP_SERVER].ipaddr = tftp_servers[tftp_server_cur];
+  /* Kill arp.  */
+  grub_memset (arptable[ARP_SERVER].node, 0, ETH_ALEN);
+  return 1;
+}
+
+
 /**************************************************************************
-UDP_TRANSMIT - Send a UDP datagram
+IP_HEADER - Fill in the IP header of a datagram of LEN bytes
 **************************************************************************/
-int 
-udp_transmit (unsigned long destip, unsigned int srcsock,
-	      unsigned int destsock, int len, const void *buf)
+void
+ip_header (struct iphdr *ip, unsigned long destip, int protocol, int len)
 {
-  struct iphdr *ip;
-  struct udphdr *udp;
-  struct arprequest arpreq;
-  int arpentry, i;
-  int retry;
-
-  ip = (struct iphdr *) buf;
-  udp = (struct udphdr *) ((unsigned long) buf + sizeof (struct iphdr));
   ip->verhdrlen = 0x45;
   ip->service = 0;
   ip->len = htons (len);
   ip->ident = 0;
   ip->frags = 0;
   ip->ttl = 60;
-  ip->protocol = IP_UDP;
+  ip->protocol = protocol;
   ip->chksum = 0;
   ip->src.s_addr = arptable[ARP_CLIENT].ipaddr.s_addr;
   ip->dest.s_addr = destip;
-  ip->chksum = ipchksum ((unsigned short *) buf, sizeof (struct iphdr));
+  ip->chksum = ipchksum ((unsigned short *) ip, sizeof (struct iphdr));
+}
+
+/**************************************************************************
+UDP_TRANSMIT - Send a UDP datagram
+**************************************************************************/
+int 
+udp_transmit (unsigned long destip, unsigned int srcsock,
+	      unsigned int destsock, int len, const void *buf)
+{
+  struct iphdr *ip;
+  struct udphdr *udp;
+
+  ip = (struct iphdr *) buf;
+  udp = (struct udphdr *) ((unsigned long) buf + sizeof (struct iphdr));
+  ip_header (ip, destip, IP_UDP, len);
   udp->src = htons (srcsock);
   udp->dest = htons (destsock);
   udp->len = htons (len - sizeof (struct iphdr));
   udp->chksum = 0;
-  udp->chksum = htons (udpchksum (ip));
+  udp->chksum = htons (tcpudpchksum (ip));
 
   if (udp->chksum == 0)
     udp->chksum = 0xffff;
-  
+
+  return ip_transmit (destip, len, buf);
+}
+
+/**************************************************************************
+IP_TRANSMIT - Send an IP datagram whose header is filled in already
+**************************************************************************/
+int
+ip_transmit (unsigned long destip, int len, const void *buf)
+{
+  struct arprequest arpreq;
+  int arpentry, i;
+  int retry;
+
   if (destip == IP_BROADCAST)
     {
       eth_transmit (broadcast, IP, len, buf);
@@ -308,6 +434,8 @@ tftp (const char *name, int (*fnc) (unsigned char *, int, int, int))
   struct tftpreq_t tp;
   int rc;
   int packetsize = TFTP_DEFAULTSIZE_PACKET;
+  struct tftp_rtt rtt;
+  long stalled = 0;
   
   /* Clear out the Rx queue first.  It contains nothing of interest,
    * except possibly ARP requests from the DHCP/TFTP server.  We use
@@ -316,47 +444,59 @@ tftp (const char *name, int (*fnc) (unsigned char *, int, int, int))
    * broadcast packets.  This will cause the reply to the packets we are
    * about to send to be lost immediately.  Not very clever.  */
   await_reply (AWAIT_QDRAIN, 0, NULL, 0);
+
+  tftp_stat_begin (name);
+  tftp_stat.blksize = packetsize;
+  tftp_stat.windowsize = 1;
+  tftp_rtt_init (&rtt);
   
   tp.opcode = htons (TFTP_RRQ);
   len = (grub_sprintf ((char *) tp.u.rrq, "%s%coctet%cblksize%c%d",
-		       name, 0, 0, 0, TFTP_MAX_PACKET)
+		       name, 0, 0, 0, tftp_blksize ())
 	 + sizeof (tp.ip) + sizeof (tp.udp) + sizeof (tp.opcode) + 1);
   if (! udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr, ++iport,
 		      TFTP_PORT, len, &tp))
     return 0;
+  tftp_rtt_sent (&rtt, 0);
   
   for (;;)
     {
       long timeout;
       
 #ifdef CONGESTED
-      timeout = rfc2131_sleep_interval (block ? TFTP_REXMT : TIMEOUT, retry);
+      timeout = tftp_rtt_timeout (&rtt, retry);
 #else
       timeout = rfc2131_sleep_interval (TIMEOUT, retry);
 #endif
 
       if (! await_reply (AWAIT_TFTP, iport, NULL, timeout))
 	{
+	  tftp_stat.timeouts++;
 	  if (! block && retry++ < MAX_TFTP_RETRIES)
 	    {
 	      /* Maybe initial request was lost.  */
+	      tftp_stat.retransmits++;
 	      if (! udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr,
 				  ++iport, TFTP_PORT, len, &tp))
 		return 0;
+	      tftp_rtt_sent (&rtt, 1);
 	      
 	      continue;
 	    }
 	  
 #ifdef CONGESTED
-	  if (block && ((retry += TFTP_REXMT) < TFTP_TIMEOUT))
+	  if (block && (stalled += timeout) < TFTP_TIMEOUT)
 	    {
 	      /* We resend our last ack.  */
 #ifdef MDEBUG
 	      grub_printf ("<REXMT>\n");
 #endif
+	      retry++;
+	      tftp_stat.retransmits++;
 	      udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr,
 			    iport, oport,
 			    TFTP_MIN_PACKET, &tp);
+	      tftp_rtt_sent (&rtt, 1);
 	      continue;
 	    }
 #endif
@@ -364,6 +504,9 @@ tftp (const char *name, int (*fnc) (unsigned char *, int, int, int))
 	  break;
 	}
       
+      if (! udp_check ())
+	continue;
+      
       tr = (struct tftp_t *) &nic.packet[ETH_HLEN];
       if (tr->opcode == ntohs (TFTP_ERROR))
 	{
@@ -420,6 +563,9 @@ tftp (const char *name, int (*fnc) (unsigned char *, int, int, int))
 	  
 	  if (p > e)
 	    goto noak;
+
+	  tftp_stat.blksize = packetsize;
+	  tftp_rtt_answered (&rtt);
 	  
 	  /* This ensures that the packet does not get processed as data!  */
 	  block = tp.u.ack.block = 0; 
@@ -433,6 +579,7 @@ tftp (const char *name, int (*fnc) (unsigned char *, int, int, int))
 	    continue;
 	  
 	  block = ntohs (tp.u.ack.block = tr->u.data.block);
+	  tftp_stat.packets++;
 	}
       else
 	/* Neither TFTP_OACK nor TFTP_DATA.  */
@@ -445,18 +592,30 @@ tftp (const char *name, int (*fnc) (unsigned char *, int, int, int))
       /* Should be continuous.  */
       tp.opcode = htons (TFTP_ACK);
       oport = ntohs (tr->udp.src);
+      if ((unsigned short) (block - prevblock) == 1)
+	tftp_rtt_answered (&rtt);
+      
       /* Ack.  */
       udp_transmit (arptable[ARP_SERVER].ipaddr.s_addr, iport,
 		    oport, TFTP_MIN_PACKET, &tp);
       
       if ((unsigned short) (block - prevblock) != 1)
-	/* Retransmission or OACK, don't process via callback
-	 * and don't change the value of prevblock.  */
-	continue;
+	{
+	  /* Retransmission or OACK, don't process via callback
+	   * and don't change the value of prevblock.  */
+	  if (tr->opcode == ntohs (TFTP_DATA))
+	    tftp_stat.retransmits++;
+	  /* An ACK of the block before again, unless of the OACK.  */
+	  tftp_rtt_sent (&rtt, tr->opcode == ntohs (TFTP_DATA));
+	  continue;
+	}
       
       prevblock = block;
+      tftp_stat.bytes += len;
       /* Is it the right place to zero the timer?  */
       retry = 0;
+      stalled = 0;
+      tftp_rtt_sent (&rtt, 0);
       
       if ((rc = fnc (tr->u.data.download,
 		     ++bcounter, len, len < packetsize)) >= 0)
@@ -464,7 +623,10 @@ tftp (const char *name, int (*fnc) (unsigned char *, int, int, int))
 
       /* End of data.  */
       if (len < packetsize)           
-	return 1;
+	{
+	  tftp_stat_end ();
+	  return 1;
+	}
     }
   
   return 0;
@@ -525,6 +687,77 @@ rarp (void)
   return 0;
 }
 
+/**************************************************************************
+BOOTP_ACCEPT - Take the addresses and options of the reply at
+	       BOOTP_DATA_ADDR
+**************************************************************************/
+static void
+bootp_accept (void)
+{
+  struct bootp_t *reply = &BOOTP_DATA_ADDR->bootp_reply;
+  
+  arptable[ARP_CLIENT].ipaddr.s_addr = reply->bp_yiaddr.s_addr;
+#ifndef	NO_DHCP_SUPPORT
+  dhcp_addr.s_addr = reply->bp_yiaddr.s_addr;
+#ifdef DEBUG
+  etherboot_printf ("dhcp_addr = %@\n", dhcp_addr.s_addr);
+#endif
+#endif /* ! NO_DHCP_SUPPORT */
+  netmask = default_netmask ();
+  arptable[ARP_SERVER].ipaddr.s_addr = reply->bp_siaddr.s_addr;
+  /* Kill arp.  */
+  grub_memset (arptable[ARP_SERVER].node, 0, ETH_ALEN);
+  arptable[ARP_GATEWAY].ipaddr.s_addr = reply->bp_giaddr.s_addr;
+  /* Kill arp.  */
+  grub_memset (arptable[ARP_GATEWAY].node, 0, ETH_ALEN);
+
+  tftp_server_count = 0;
+  tftp_server_add (reply->bp_siaddr);
+  if_mtu = 0;
+
+#ifdef NO_DHCP_SUPPORT
+  decode_rfc1533 (reply->bp_vend, 0, BOOTP_VENDOR_LEN + MAX_BOOTP_EXTLEN, 1);
+#else
+  decode_rfc1533 (reply->bp_vend, 0, DHCP_OPT_LEN + MAX_BOOTP_EXTLEN, 1);
+#endif /* ! NO_DHCP_SUPPORT */
+
+  /* Without a next server, use the first from the options.  */
+  if (! arptable[ARP_SERVER].ipaddr.s_addr && tftp_server_count)
+    arptable[ARP_SERVER].ipaddr = tftp_servers[0];
+}
+
+#ifdef PLATFORM_EFI
+/**************************************************************************
+BOOTP_LEASE - Use the lease the firmware got when it loaded GRUB, if it
+	      was for this NIC, instead of asking the DHCP server again
+**************************************************************************/
+static int
+bootp_lease (void)
+{
+  struct bootp_t *reply = &BOOTP_DATA_ADDR->bootp_reply;
+  int len;
+
+  grub_memset ((char *) BOOTP_DATA_ADDR, 0, sizeof (struct bootpd_t));
+  len = grub_efi_pxe_dhcp_ack ((char *) BOOTP_DATA_ADDR,
+			       sizeof (struct bootpd_t));
+  if (len < (int) (sizeof (struct bootp_t) - sizeof (reply->bp_vend))
+      || reply->bp_op != BOOTP_REPLY
+      || ! reply->bp_yiaddr.s_addr
+      || grub_memcmp (reply->bp_hwaddr, arptable[ARP_CLIENT].node, ETH_ALEN))
+    return 0;
+
+#ifndef	NO_DHCP_SUPPORT
+  dhcp_reply = 0;
+#endif /* ! NO_DHCP_SUPPORT */
+  bootp_accept ();
+#ifndef	NO_DHCP_SUPPORT
+  if (dhcp_reply && dhcp_reply != DHCPACK)
+    return 0;
+#endif /* ! NO_DHCP_SUPPORT */
+  return 1;
+}
+#endif /* PLATFORM_EFI */
+
 /**************************************************************************
 BOOTP - Get my IP address and load information
 **************************************************************************/
@@ -548,6 +781,14 @@ bootp (void)
 #ifdef DEBUG
   grub_printf ("network is ready.\n");
 #endif
+
+#ifdef PLATFORM_EFI
+  if (bootp_lease ())
+    {
+      network_ready = 1;
+      return 1;
+    }
+#endif /* PLATFORM_EFI */
   
   grub_memset (&ip, 0, sizeof (struct bootpip_t));
   ip.bp.bp_op = BOOTP_REQUEST;
@@ -681,55 +922,238 @@ bootp (void)
 }
 
 /**************************************************************************
-UDPCHKSUM - Checksum UDP Packet (one of the rare cases when assembly is
-            actually simpler...)
- RETURNS: checksum, 0 on checksum error. This
-          allows for using the same routine for RX and TX summing:
-          RX  if (packet->udp.chksum && udpchksum(packet))
-                  error("checksum error");
-          TX  packet->udp.chksum=0;
-              if (0==(packet->udp.chksum=udpchksum(packet)))
-                  packet->upd.chksum=0xffff;
+IPSUM - The one's complement sum of the Internet checksums
 **************************************************************************/
-static inline void
-dosum (unsigned short *start, unsigned int len, unsigned short *sum)
+typedef unsigned int ipsum_word_t __attribute__ ((__may_alias__));
+typedef unsigned short ipsum_half_t __attribute__ ((__may_alias__));
+
+/* Add the LEN bytes at DATA to SUM, and copy them to DEST too unless it
+   is NULL.  The bytes are summed 32 bits at a time as they are in
+   memory, and the carries are left in the upper half of SUM until
+   ipsum_fold, which gives the 16-bit sum in network byte order, as it
+   is in memory.  An odd byte at the end is padded with a zero.  */
+static unsigned long long
+ipsum_copy (void *dest, const void *data, int len, unsigned long long sum)
 {
-  __asm__ __volatile__
-    ("clc\n"
-     "1:\tlodsw\n\t"
-     "xchg %%al,%%ah\n\t"	/* convert to host byte order */
-     "adcw %%ax,%0\n\t"		/* add carry of previous iteration */
-     "loop 1b\n\t"
-     "adcw $0,%0"		/* add carry of last iteration */
-     : "=b" (*sum), "=S"(start), "=c"(len)
-     : "0"(*sum), "1"(start), "2"(len)
-     : "ax", "cc"
-     );
+  const unsigned char *p = data;
+  unsigned char *d = dest;
+
+  if (d)
+    for (; len >= 4; len -= 4, p += 4, d += 4)
+      {
+	unsigned int w = *(const ipsum_word_t *) p;
+
+	*(ipsum_word_t *) d = w;
+	sum += w;
+      }
+  else
+    for (; len >= 4; len -= 4, p += 4)
+      sum += *(const ipsum_word_t *) p;
+
+  if (len >= 2)
+    {
+      if (d)
+	{
+	  *(ipsum_half_t *) d = *(const ipsum_half_t *) p;
+	  d += 2;
+	}
+      sum += *(const ipsum_half_t *) p;
+      p += 2;
+      len -= 2;
+    }
+
+  if (len)
+    {
+      if (d)
+	*d = *p;
+      sum += *p;
+    }
+
+  return sum;
 }
 
-/* UDP sum:
- * proto, src_ip, dst_ip, udp_dport, udp_sport, 2*udp_len, payload
- */
 static unsigned short
-udpchksum (struct iphdr *packet)
+ipsum_fold (unsigned long long sum)
+{
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+/* SUM is that of bytes which start at OFFSET in the data summed: swap
+   it if OFFSET is odd, for its bytes are then in the other halves of
+   the 16-bit words.  */
+static unsigned long long
+ipsum_at (unsigned long long sum, int offset)
+{
+  unsigned short s = ipsum_fold (sum);
+
+  if (offset & 1)
+    s = (s << 8) | (s >> 8);
+  return s;
+}
+
+/* The sum of the pseudo header of the TCP or UDP datagram in PACKET,
+   less the addresses, which are summed where they are in the IP
+   header.  */
+static unsigned long long
+ipsum_pseudo (struct iphdr *packet)
 {
-  int len = ntohs (packet->len);
+  unsigned short len = ntohs (packet->len) - sizeof (struct iphdr);
+  unsigned short protocol = packet->protocol;
+
+  return htons (len) + htons (protocol);
+}
+
+/**************************************************************************
+TCPUDPCHKSUM - Checksum a TCP or UDP datagram
+ RETURNS: checksum in host byte order, 0 on checksum error. This
+          allows for using the same routine for RX and TX summing.
+**************************************************************************/
+unsigned short
+tcpudpchksum (struct iphdr *packet)
+{
+  int len = ntohs (packet->len) - sizeof (struct iphdr);
+  unsigned long long sum;
   unsigned short rval;
-  
-  /* add udplength + protocol number */
-  rval = (len - sizeof (struct iphdr)) + IP_UDP;
-  
-  /* pad to an even number of bytes */
-  if (len % 2) {
-    ((char *) packet)[len++] = 0;
-  }
-  
-  /* sum over src/dst ipaddr + udp packet */
-  len -= (char *) &packet->src - (char *) packet;
-  dosum ((unsigned short *) &packet->src, len >> 1, &rval);
-  
-  /* take one's complement */
-  return ~rval;
+
+  /* Sum the addresses and the datagram.  */
+  sum = ipsum_copy (NULL, &packet->src, 2 * sizeof (in_addr) + len,
+		    ipsum_pseudo (packet));
+  rval = ~ipsum_fold (sum);
+  return ntohs (rval);
+}
+
+/* Whether the UDP sum of the packet which await_reply returned is still
+   to be checked, by udp_copy or udp_check.  */
+static int udp_unchecked;
+
+/* Copy the LEN bytes at DATA, which are in the UDP datagram in
+   NIC.PACKET, to DEST, checking the sum of the datagram at the same
+   time if await_reply left that to be done: so a TFTP block is read
+   only once, however big.  Return zero if the sum is wrong, after
+   which DEST holds garbage.  */
+int
+udp_copy (char *dest, const char *data, int len)
+{
+  struct iphdr *ip = (struct iphdr *) &nic.packet[ETH_HLEN];
+  char *start = (char *) &ip->src;
+  char *end = (char *) ip + ntohs (ip->len);
+  unsigned long long sum;
+
+  if (! udp_unchecked)
+    {
+      if (len)
+	grub_memmove (dest, data, len);
+      return 1;
+    }
+
+  udp_unchecked = 0;
+  if (end > nic.packet + nic.packetlen
+      || data < start || data + len > end)
+    return 0;
+
+  sum = ipsum_copy (NULL, start, data - start, ipsum_pseudo (ip));
+  sum += ipsum_at (ipsum_copy (dest, data, len, 0), data - start);
+  sum += ipsum_at (ipsum_copy (NULL, data + len, end - data - len, 0),
+		   data + len - start);
+  if (ipsum_fold (sum) != 0xffff)
+    {
+      grub_printf ("UDP checksum error\n");
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Check the sum of the UDP datagram in NIC.PACKET, if await_reply left
+   that to be done, for a packet whose data is not to be copied.  */
+/* Whether PORT is one of the COUNT ports at PORTS.  */
+static int
+udp_port_in (unsigned short port, unsigned short *ports, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (ports[i] == port)
+      return 1;
+  return 0;
+}
+
+int
+udp_check (void)
+{
+  struct iphdr *ip = (struct iphdr *) &nic.packet[ETH_HLEN];
+
+  return udp_copy (NULL, (char *) &ip->src, 0);
+}
+
+/* The receive queue.  A packet which is meant for us but is not the one
+   awaited, such as a TFTP block that arrives while an ARP reply is
+   awaited, is kept here instead of being dropped, so that the next
+   calls of await_reply can use it without waiting for a retransmit.  */
+static struct
+{
+  unsigned long time;
+  int len;
+  char packet[ETH_MAX_FRAME_LEN];
+} rx_queue[RX_QUEUE_LEN];
+static int rx_queue_head, rx_queue_count;
+/* When the packet in NIC.PACKET was received.  */
+static unsigned long rx_time;
+
+/* Keep the packet in NIC.PACKET, dropping the oldest kept one if the
+   queue is full.  */
+static void
+rx_keep (void)
+{
+  int i;
+
+  if (nic.packetlen > ETH_MAX_FRAME_LEN)
+    return;
+
+  if (rx_queue_count == RX_QUEUE_LEN)
+    {
+      rx_queue_head = (rx_queue_head + 1) % RX_QUEUE_LEN;
+      rx_queue_count--;
+    }
+
+  i = (rx_queue_head + rx_queue_count++) % RX_QUEUE_LEN;
+  rx_queue[i].time = rx_time;
+  rx_queue[i].len = nic.packetlen;
+  grub_memcpy (rx_queue[i].packet, nic.packet, nic.packetlen);
+}
+
+/* Get the next packet into NIC.PACKET: the oldest kept one while
+   *QUEUED, the number of kept packets not looked at yet, is not zero,
+   or else a new one from the card.  Return zero if there is none.  */
+static int
+rx_next (int *queued)
+{
+  while (*queued > 0)
+    {
+      int i = rx_queue_head;
+
+      (*queued)--;
+      rx_queue_head = (rx_queue_head + 1) % RX_QUEUE_LEN;
+      rx_queue_count--;
+
+      if (currticks () - rx_queue[i].time > RX_QUEUE_AGE)
+	continue;
+
+      grub_memcpy (nic.packet, rx_queue[i].packet, rx_queue[i].len);
+      nic.packetlen = rx_queue[i].len;
+      /* Its sums were checked before it was kept.  */
+      nic.rx_csum = 1;
+      rx_time = rx_queue[i].time;
+      return 1;
+    }
+
+  if (! eth_poll ())
+    return 0;
+
+  rx_time = currticks ();
+  return 1;
 }
 
 /**************************************************************************
@@ -746,9 +1170,17 @@ await_reply (int type, int ival, void *ptr, int timeout)
   unsigned short ptype;
   unsigned int protohdrlen = (ETH_HLEN + sizeof (struct iphdr)
 			      + sizeof (struct udphdr));
+  int queued;
 
   /* Clear the abort flag.  */
   ip_abort = 0;
+
+  /* Whatever was kept is stale too.  */
+  if (type == AWAIT_QDRAIN)
+    rx_queue_count = 0;
+
+  /* Look at each kept packet once, before the new ones.  */
+  queued = rx_queue_count;
   
   time = timeout + currticks ();
   /* The timeout check is done below.  The timeout is only checked if
@@ -756,7 +1188,7 @@ await_reply (int type, int ival, void *ptr, int timeout)
    * needs a negligible amount of time.  */
   for (;;)
     {
-      if (eth_poll ())
+      if (rx_next (&queued))
 	{
 	  /* We have something!  */
 	  
@@ -812,6 +1244,10 @@ await_reply (int type, int ival, void *ptr, int timeout)
 		  etherboot_printf ("Sent ARP reply to: %@\n", tmp);
 #endif	/* MDEBUG */
 		}
+	      else if (arpreply->opcode == htons (ARP_REPLY)
+		       && tmp == arptable[ARP_CLIENT].ipaddr.s_addr
+		       && type != AWAIT_QDRAIN)
+		rx_keep ();
 	      
 	      continue;
 	    }
@@ -847,8 +1283,32 @@ await_reply (int type, int ival, void *ptr, int timeout)
 	  
 	  ip = (struct iphdr *) &nic.packet[ETH_HLEN];
 	  if (ip->verhdrlen != 0x45
-	      || ipchksum ((unsigned short *) ip, sizeof (struct iphdr))
-	      || ip->protocol != IP_UDP)
+	      || (! nic.rx_csum
+		  && ipchksum ((unsigned short *) ip, sizeof (struct iphdr))))
+	    continue;
+
+	  /* TCP ?  */
+	  if (ip->protocol == IP_TCP)
+	    {
+	      struct tcphdr *tcp = (struct tcphdr *)
+		&nic.packet[ETH_HLEN + sizeof (struct iphdr)];
+
+	      if (nic.packetlen < (ETH_HLEN + sizeof (struct iphdr)
+				   + sizeof (struct tcphdr))
+		  || ip->dest.s_addr != arptable[ARP_CLIENT].ipaddr.s_addr
+		  || ntohs (ip->len) > nic.packetlen - ETH_HLEN
+		  || (ip->frags & htons (0x3FFF))
+		  || (! nic.rx_csum && tcpudpchksum (ip)))
+		continue;
+
+	      if (type == AWAIT_TCP && ntohs (tcp->dest) == ival)
+		return 1;
+
+	      rx_keep ();
+	      continue;
+	    }
+
+	  if (ip->protocol != IP_UDP)
 	    continue;
 	  
 	  /*
@@ -869,10 +1329,20 @@ await_reply (int type, int ival, void *ptr, int timeout)
 	  
 	  udp = (struct udphdr *) &nic.packet[(ETH_HLEN
 					       + sizeof (struct iphdr))];
-	  if (udp->chksum && udpchksum (ip))
+	  /* The sum of what is awaited over TFTP is left to the caller,
+	     which checks it as it copies the data.  */
+	  udp_unchecked = 0;
+	  if (udp->chksum && ! nic.rx_csum)
 	    {
-	      grub_printf ("UDP checksum error\n");
-	      continue;
+	      if ((type == AWAIT_TFTP && ntohs (udp->dest) == ival)
+		  || (type == AWAIT_TFTP_SET
+		      && udp_port_in (ntohs (udp->dest), ptr, ival)))
+		udp_unchecked = 1;
+	      else if (tcpudpchksum (ip))
+		{
+		  grub_printf ("UDP checksum error\n");
+		  continue;
+		}
 	    }
 	  
 	  /* BOOTP ?  */
@@ -897,40 +1367,23 @@ await_reply (int type, int ival, void *ptr, int timeout)
 #ifdef DEBUG
 	      grub_printf ("BOOTP packet was received.\n");
 #endif
-	      arptable[ARP_CLIENT].ipaddr.s_addr
-		= bootpreply->bp_yiaddr.s_addr;
-#ifndef	NO_DHCP_SUPPORT
-	      dhcp_addr.s_addr = bootpreply->bp_yiaddr.s_addr;
-#ifdef DEBUG
-	      etherboot_printf ("dhcp_addr = %@\n", dhcp_addr.s_addr);
-#endif
-#endif /* ! NO_DHCP_SUPPORT */
-	      netmask = default_netmask ();
-	      arptable[ARP_SERVER].ipaddr.s_addr
-		= bootpreply->bp_siaddr.s_addr;
-	      /* Kill arp.  */
-	      grub_memset (arptable[ARP_SERVER].node, 0, ETH_ALEN);
-	      arptable[ARP_GATEWAY].ipaddr.s_addr
-		= bootpreply->bp_giaddr.s_addr;
-	      /* Kill arp.  */
-	      grub_memset (arptable[ARP_GATEWAY].node, 0, ETH_ALEN);
-
 	      grub_memmove ((char *) BOOTP_DATA_ADDR, (char *) bootpreply,
 			    sizeof (struct bootpd_t));
-#ifdef NO_DHCP_SUPPORT
-	      decode_rfc1533 (BOOTP_DATA_ADDR->bootp_reply.bp_vend,
-			      0, BOOTP_VENDOR_LEN + MAX_BOOTP_EXTLEN, 1);
-#else
-	      decode_rfc1533 (BOOTP_DATA_ADDR->bootp_reply.bp_vend,
-			      0, DHCP_OPT_LEN + MAX_BOOTP_EXTLEN, 1);
-#endif /* ! NO_DHCP_SUPPORT */
-	      
+	      bootp_accept ();
 	      return 1;
 	    }
 	  
 	  /* TFTP ? */
 	  if (type == AWAIT_TFTP && ntohs (udp->dest) == ival)
 	    return 1;
+	  if (type == AWAIT_TFTP_SET
+	      && udp_port_in (ntohs (udp->dest), ptr, ival))
+	    return 1;
+
+	  /* Maybe it is awaited by the next call.  */
+	  if (arptable[ARP_CLIENT].ipaddr.s_addr
+	      && ip->dest.s_addr == arptable[ARP_CLIENT].ipaddr.s_addr)
+	    rx_keep ();
 	}
       else
 	{
@@ -1039,6 +1492,36 @@ decode_rfc1533 (unsigned char *p, int block, int len, int eof)
 	}
       else if (c == RFC1533_EXTENSIONPATH)
 	extpath = p;
+      else if (c == RFC1533_INTMTU)
+	{
+	  /* Below 576 is not allowed; take no notice of it.  */
+	  if_mtu = (p[2] << 8) | p[3];
+	  if (if_mtu < 576)
+	    if_mtu = 0;
+	}
+      else if (c == RFC2132_TFTP_SERVER)
+	{
+	  /* The name of the TFTP server, or as some servers have it, the
+	     addresses of several, which are all taken.  */
+	  char addrs[64];
+	  char *q = addrs;
+	  int l = TAG_LEN (p);
+	  in_addr addr;
+
+	  if (l > (int) sizeof (addrs) - 1)
+	    l = sizeof (addrs) - 1;
+	  grub_memmove (addrs, p + 2, l);
+	  addrs[l] = 0;
+	  while (*q)
+	    {
+	      if (inet_aton (q, &addr))
+		tftp_server_add (addr);
+	      while (*q && *q != ' ' && *q != ',' && *q != ';')
+		q++;
+	      while (*q == ' ' || *q == ',' || *q == ';')
+		q++;
+	    }
+	}
 #ifndef	NO_DHCP_SUPPORT
       else if (c == RFC2132_MSG_TYPE)
 	{
@@ -1116,15 +1599,7 @@ IPCHKSUM - Checksum IP Header
 static unsigned short 
 ipchksum (unsigned short *ip, int len)
 {
-  unsigned long sum = 0;
-  len >>= 1;
-  while (len--)
-    {
-      sum += *(ip++);
-      if (sum > 0xFFFF)
-	sum -= 0xFFFF;
-    }
-  return (~sum) & 0x0000FFFF;
+  return ~ipsum_fold (ipsum_copy (NULL, ip, len, 0)) & 0xFFFF;
 }
 
 #define TWO_SECOND_DIVISOR (2147483647l/TICKS_PER_SEC)
@@ -1156,6 +1631,79 @@ rfc2131_sleep_interval (int base, int exp)
   return tmo;
 }
 
+/**************************************************************************
+TFTP_RTT - time the round trips of a TFTP transfer
+**************************************************************************/
+/* Start the measurement over, for a new transfer.  */
+void
+tftp_rtt_init (struct tftp_rtt *rtt)
+{
+  grub_memset ((char *) rtt, 0, sizeof (*rtt));
+}
+
+/* A packet which the server answers has just been sent, AGAIN if it
+   was sent before.  Its answer is timed only if not.  */
+void
+tftp_rtt_sent (struct tftp_rtt *rtt, int again)
+{
+  rtt->timing = ! again;
+  rtt->sent = currticks ();
+}
+
+/* The answer to the packet sent last has come.  */
+void
+tftp_rtt_answered (struct tftp_rtt *rtt)
+{
+  long m, delta;
+
+  if (! rtt->timing)
+    return;
+
+  rtt->timing = 0;
+  m = currticks () - rtt->sent;
+  /* The ticks start over at midnight.  */
+  if (m < 0)
+    return;
+
+  if (! rtt->measured)
+    {
+      rtt->srtt = m << 3;
+      rtt->rttvar = m << 1;
+      rtt->measured = 1;
+      return;
+    }
+
+  delta = m - (rtt->srtt >> 3);
+  rtt->srtt += delta;
+  if (delta < 0)
+    delta = -delta;
+  rtt->rttvar += delta - (rtt->rttvar >> 2);
+}
+
+/* How long to wait for the answer to a packet sent RETRY times before:
+   the smoothed round trip time and four deviations, doubled on every
+   retry, or the fixed schedule until a round trip has been timed.  */
+long
+tftp_rtt_timeout (struct tftp_rtt *rtt, int retry)
+{
+  long rto;
+
+  if (! rtt->measured)
+    return rfc2131_sleep_interval (TIMEOUT, retry);
+
+  rto = (rtt->srtt >> 3) + (rtt->rttvar > 1 ? rtt->rttvar : 1);
+  if (rto < TFTP_RTO_MIN)
+    rto = TFTP_RTO_MIN;
+#ifdef BACKOFF_LIMIT
+  if (retry > BACKOFF_LIMIT)
+    retry = BACKOFF_LIMIT;
+#endif
+  rto <<= retry;
+  if (rto > TFTP_RTO_MAX)
+    rto = TFTP_RTO_MAX;
+  return rto;
+}
+
 /**************************************************************************
 CLEANUP - shut down networking
 **************************************************************************/
@@ -26,6 +26,9 @@ struct nic
 	char		*packet;
 	unsigned int	packetlen;
 	void		*priv_data;	/* driver can hang private data here */
+	unsigned int	mtu;	/* largest IP datagram, or 0 for 1500 */
+	int		rx_csum;	/* poll sets it if the card found the
+					   IP, TCP and UDP sums right */
 };
 
 #endif	/* NIC_H */
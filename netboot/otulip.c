@@ -40,7 +40,7 @@ static unsigned char srom[1024];
 static struct txdesc txd;
 
 /* receive descriptor(s) and buffer(s) */
-#define NRXD 4
+#define NRXD NIC_RX_RING
 static struct rxdesc rxd[NRXD];
 static int rxd_tail = 0;
 #ifdef	USE_LOWMEM_BUFFER
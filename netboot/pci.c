@@ -396,15 +396,146 @@ static void pcibios_init(void)
 }
 #endif	/* CONFIG_PCI_DIRECT not defined*/
 
+/*
+ * The memory mapped configuration space of PCI Express (ECAM), as the
+ * MCFG table of ACPI gives it for segment 0.  Reading it is a plain
+ * load, where the BIOS32 service costs a far call and ports 0xCF8 and
+ * 0xCFC two port accesses, and there are 8192 functions to look at.
+ * It is only used for the scan, and only if it is below 4GB.
+ */
+static unsigned long mmcfg_base;
+static unsigned int mmcfg_start_bus, mmcfg_end_bus;
+
+static int acpi_checksum(const unsigned char *p, unsigned int len)
+{
+	unsigned char sum = 0;
+
+	while (len--)
+		sum += *p++;
+	return sum == 0;
+}
+
+static const unsigned char *find_rsdp(unsigned long start, unsigned long len)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) start;
+	     p < (const unsigned char *) (start + len); p += 16)
+		if (memcmp((const char *) p, "RSD PTR ", 8) == 0 && acpi_checksum(p, 20))
+			return p;
+	return 0;
+}
+
+static void pci_mmcfg_init(void)
+{
+	const unsigned char *rsdp, *rsdt, *table;
+	unsigned long ebda;
+	unsigned int i, j, len, entries;
+
+	mmcfg_base = 0;
+
+	/* The RSDP is in the first KB of the EBDA, or in the BIOS area.  */
+	ebda = (unsigned long) *(unsigned short *) 0x40e << 4;
+	rsdp = ebda ? find_rsdp(ebda, 1024) : 0;
+	if (!rsdp)
+		rsdp = find_rsdp(0xe0000, 0x20000);
+	if (!rsdp)
+		return;
+
+	/* Only the RSDT: the XSDT may point above 4GB.  */
+	rsdt = (const unsigned char *) (unsigned long) *(unsigned int *) (rsdp + 16);
+	if (!rsdt || memcmp((const char *) rsdt, "RSDT", 4) != 0)
+		return;
+	len = *(unsigned int *) (rsdt + 4);
+	if (len < 36 || !acpi_checksum(rsdt, len))
+		return;
+
+	for (i = 36; i + 4 <= len; i += 4) {
+		table = (const unsigned char *) (unsigned long) *(unsigned int *) (rsdt + i);
+		if (!table || memcmp((const char *) table, "MCFG", 4) != 0)
+			continue;
+		len = *(unsigned int *) (table + 4);
+		if (len < 44 || !acpi_checksum(table, len))
+			return;
+
+		/* After the header and 8 reserved bytes, 16 bytes each:
+		   the base, the segment, the first and the last bus.  */
+		entries = (len - 44) / 16;
+		for (j = 0; j < entries; j++) {
+			const unsigned char *e = table + 44 + j * 16;
+
+			if (*(unsigned short *) (e + 8) != 0
+			    || *(unsigned int *) (e + 4) != 0)
+				continue;
+			mmcfg_base = *(unsigned int *) e;
+			mmcfg_start_bus = e[10];
+			mmcfg_end_bus = e[11];
+#if	DEBUG
+			printf("pci_mmcfg_init : ECAM at %#X, buses %d to %d\n",
+				mmcfg_base, mmcfg_start_bus, mmcfg_end_bus);
+#endif
+			return;
+		}
+		return;
+	}
+}
+
+static void scan_read_config_dword(unsigned int bus, unsigned int devfn,
+				   unsigned int where, unsigned int *value)
+{
+	if (mmcfg_base && bus >= mmcfg_start_bus && bus <= mmcfg_end_bus)
+		*value = *(volatile unsigned int *) (mmcfg_base
+			+ (((bus - mmcfg_start_bus) << 20) | (devfn << 12) | where));
+	else
+		pcibios_read_config_dword(bus, devfn, where, value);
+}
+
+/*
+ * The drivers are looked up by vendor and device in a hash of PCIDEV,
+ * rather than by going through all of it for every function found.
+ */
+#define PCI_NIC_HASH		64
+#define PCI_NIC_HASH_END	0xff
+
+static unsigned char pci_nic_hash[PCI_NIC_HASH];
+static unsigned char pci_nic_next[PCI_NIC_HASH_END];
+
+static unsigned int pci_nic_hash_key(unsigned short vendor, unsigned short device)
+{
+	return ((vendor * 31) ^ device) % PCI_NIC_HASH;
+}
+
+static void pci_nic_hash_init(struct pci_device *pcidev)
+{
+	unsigned int i, key;
+
+	for (i = 0; i < PCI_NIC_HASH; i++)
+		pci_nic_hash[i] = PCI_NIC_HASH_END;
+
+	/* Chained in reverse, so that each chain keeps the order of the
+	   list, which is the order the drivers are tried in.  */
+	for (i = 0; pcidev[i].vendor != 0; i++)
+		;
+	while (i-- > 0) {
+		if (i >= PCI_NIC_HASH_END)
+			continue;
+		key = pci_nic_hash_key(pcidev[i].vendor, pcidev[i].dev_id);
+		pci_nic_next[i] = pci_nic_hash[key];
+		pci_nic_hash[key] = i;
+	}
+}
+
 static void scan_bus(struct pci_device *pcidev)
 {
 	unsigned int devfn, l, bus, buses;
 	unsigned char hdr_type = 0;
 	unsigned short vendor, device;
-	unsigned int membase, ioaddr, romaddr;
+	unsigned int membase, ioaddr, romaddr, hdr_type_dword;
 	int i, reg;
 	unsigned int pci_ioaddr = 0;
 
+	pci_nic_hash_init(pcidev);
+
 	/* Scan all PCI buses, until we find our card.
 	 * We could be smart only scan the required busses but that
 	 * is error prone, and tricky.
@@ -413,17 +544,21 @@ static void scan_bus(struct pci_device *pcidev)
 	 */
 	buses=256;
 	for (bus = 0; bus < buses; ++bus) {
-		for (devfn = 0; devfn < 0xff; ++devfn) {
-			if (PCI_FUNC (devfn) == 0)
-				pcibios_read_config_byte(bus, devfn, PCI_HEADER_TYPE, &hdr_type);
-			else if (!(hdr_type & 0x80))	/* not a multi-function device */
+		for (devfn = 0; devfn <= 0xff; ++devfn) {
+			/* not a multi-function device */
+			if (PCI_FUNC (devfn) != 0 && !(hdr_type & 0x80))
 				continue;
-			pcibios_read_config_dword(bus, devfn, PCI_VENDOR_ID, &l);
+			scan_read_config_dword(bus, devfn, PCI_VENDOR_ID, &l);
 			/* some broken boards return 0 if a slot is empty: */
 			if (l == 0xffffffff || l == 0x00000000) {
 				hdr_type = 0;
 				continue;
 			}
+			/* an empty slot costs only the read of its ID */
+			if (PCI_FUNC (devfn) == 0) {
+				scan_read_config_dword(bus, devfn, PCI_HEADER_TYPE & ~3, &hdr_type_dword);
+				hdr_type = hdr_type_dword >> ((PCI_HEADER_TYPE & 3) * 8);
+			}
 			vendor = l & 0xffff;
 			device = (l >> 16) & 0xffff;
 
@@ -431,7 +566,8 @@ static void scan_bus(struct pci_device *pcidev)
 			printf("bus %hhX, function %hhX, vendor %hX, device %hX\n",
 				bus, devfn, vendor, device);
 #endif
-			for (i = 0; pcidev[i].vendor != 0; i++) {
+			for (i = pci_nic_hash[pci_nic_hash_key(vendor, device)];
+			     i != PCI_NIC_HASH_END; i = pci_nic_next[i]) {
 				if (vendor != pcidev[i].vendor
 				    || device != pcidev[i].dev_id)
 					continue;
@@ -473,6 +609,7 @@ void eth_pci_init(struct pci_device *pcidev)
 		return;
 	}
 #endif
+	pci_mmcfg_init();
 	scan_bus(pcidev);
 	/* return values are in pcidev structures */
 }
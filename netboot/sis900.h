@@ -344,7 +344,7 @@ enum sis630_revision_id {
 #define TX_BUF_SIZE     1536
 #define RX_BUF_SIZE     1536
 
-#define NUM_RX_DESC     4              /* Number of Rx descriptor registers. */
+#define NUM_RX_DESC     NIC_RX_RING    /* Number of Rx descriptor registers. */
 
 typedef unsigned char  u8;
 typedef   signed char  s8;
@@ -410,7 +410,7 @@ static const char *version = "rhine.c v1.0.0 2000-01-07\n";
 #define NIC_LB_PHY		0x02	/* MII or Internal-10BaseT loopback */
 
 #define TX_RING_SIZE		2
-#define RX_RING_SIZE		2
+#define RX_RING_SIZE		NIC_RX_RING
 #define PKT_BUF_SZ		1536	/* Size of each temporary Rx buffer. */
 
 /* Transmit and receive descriptors definition */
@@ -1003,15 +1003,15 @@ rhine_reset (struct nic *nic)
     int tx_bufs_tmp, tx_bufs_tmp1;
 
 #ifdef	USE_LOWMEM_BUFFER
-#define buf1 (0x10000 - (RX_RING_SIZE * PKT_BUF_SZ + 32))
+#define buf1 (0x10000 - (TX_RING_SIZE * PKT_BUF_SZ + 32))
 #define buf2 (buf1 - (RX_RING_SIZE * PKT_BUF_SZ + 32))
 #define desc1 (buf2 - (TX_RING_SIZE * sizeof (struct rhine_tx_desc) + 32))
-#define desc2 (desc1 - (TX_RING_SIZE * sizeof (struct rhine_tx_desc) + 32))
+#define desc2 (desc1 - (RX_RING_SIZE * sizeof (struct rhine_rx_desc) + 32))
 #else
-    static char buf1[RX_RING_SIZE * PKT_BUF_SZ + 32];
+    static char buf1[TX_RING_SIZE * PKT_BUF_SZ + 32];
     static char buf2[RX_RING_SIZE * PKT_BUF_SZ + 32];
     static char desc1[TX_RING_SIZE * sizeof (struct rhine_tx_desc) + 32];
-    static char desc2[TX_RING_SIZE * sizeof (struct rhine_tx_desc) + 32];
+    static char desc2[RX_RING_SIZE * sizeof (struct rhine_rx_desc) + 32];
 #endif
 
     /* printf ("rhine_reset\n"); */
@@ -110,7 +110,7 @@ typedef   signed int   s32;
    There are no ill effects from too-large receive rings. */
 #define TX_RING_SIZE    2
 
-#define RX_RING_SIZE    2
+#define RX_RING_SIZE    NIC_RX_RING
 
 /* The presumed FIFO size for working around the Tx-FIFO-overflow bug.
    To avoid overflowing we don't queue again until we have room for a
@@ -47,9 +47,16 @@ extern int get_diskinfo_floppy (int drive,
    return the error number. Otherwise, return 0.  */
 int
 biosdisk (int read, int drive, struct geometry *geometry,
-	  int sector, int nsec, int segment)
+	  sector_t sector, int nsec, int segment)
 {
   int err;
+
+#ifndef STAGE1_5
+  if (drive == memdisk_drive)
+    return memdisk_rw (read, sector, nsec, (char *) (segment << 4));
+  if (drive == loop_drive)
+    return loop_rw (read, sector, nsec, (char *) (segment << 4));
+#endif
   
   if (geometry->flags & BIOSDISK_FLAG_LBA_EXTENSION)
     {
@@ -103,10 +110,14 @@ biosdisk (int read, int drive, struct geometry *geometry,
       int cylinder_offset, head_offset, sector_offset;
       int head;
 
+      /* Past the C/H/S geometry, SECTOR may not even fit in a long.  */
+      if (sector >= geometry->total_sectors)
+	return BIOSDISK_ERROR_GEOMETRY;
+
       /* SECTOR_OFFSET is counted from one, while HEAD_OFFSET and
 	 CYLINDER_OFFSET are counted from zero.  */
-      sector_offset = sector % geometry->sectors + 1;
-      head = sector / geometry->sectors;
+      sector_offset = (unsigned long) sector % geometry->sectors + 1;
+      head = (unsigned long) sector / geometry->sectors;
       head_offset = head % geometry->heads;
       cylinder_offset = head / geometry->heads;
       
@@ -121,6 +132,187 @@ biosdisk (int read, int drive, struct geometry *geometry,
   return err;
 }
 
+#ifndef STAGE1_5
+/* The most sectors that an extended read may ask for; some BIOSes
+   take more, but the EDD specification allows no more than this.  */
+#define FLAT_MAX_SECT	127
+
+/* Read/write NSEC sectors starting from SECTOR in DRIVE disk from/into
+   ADDR, which may be anywhere in memory, with the 64-bit flat address
+   of EDD 3.0. Return the same as biosdisk.  */
+static int
+biosdisk_flat (int read, int drive, sector_t sector, int nsec,
+	       unsigned long addr)
+{
+  struct disk_address_packet
+  {
+    unsigned char length;
+    unsigned char reserved;
+    unsigned short blocks;
+    unsigned long buffer;
+    unsigned long long block;
+    unsigned long long flat_buffer;
+  } __attribute__ ((packed)) dap;
+
+  dap.length = sizeof (dap);
+  dap.reserved = 0;
+  dap.blocks = nsec;
+  /* FFFF:FFFF means that the address is in FLAT_BUFFER.  */
+  dap.buffer = 0xFFFFFFFF;
+  dap.block = sector;
+  dap.flat_buffer = addr;
+
+  return biosdisk_int13_extensions ((read + 0x42) << 8, drive, &dap);
+}
+
+/* Where a BIOS which doesn't know about flat addresses would put the
+   data instead: at FFFF:FFFF, with the A20 line on.  */
+#define FLAT_PROBE_MISPLACED	RAW_ADDR (0x10FFEF)
+
+/* Whether each hard disk takes flat addresses: 0 if it hasn't been
+   asked yet, 1 if it does, and -1 if not.  */
+static char flat_address[MAX_HD_NUM];
+static char flat_probe_buf[SECTOR_SIZE];
+static char flat_probe_saved[SECTOR_SIZE];
+
+/* Return non-zero if DRIVE, whose BIOS says it has EDD 3.0, really
+   reads to a flat address.  Many say so but don't, so read the first
+   sector both ways and compare, keeping what the data would overwrite
+   if it went to FFFF:FFFF.  */
+static int
+probe_flat_address (int drive, struct geometry *geometry)
+{
+  int i, ok;
+
+  if (flat_address[drive & 0x7F])
+    return flat_address[drive & 0x7F] > 0;
+
+  if (biosdisk (BIOSDISK_READ, drive, geometry, 0, 1, SCRATCHSEG))
+    return 0;
+
+  /* Make every byte differ from what is to be read.  */
+  for (i = 0; i < SECTOR_SIZE; i++)
+    flat_probe_buf[i] = ~((char *) SCRATCHADDR)[i];
+
+  grub_memmove (flat_probe_saved, (char *) FLAT_PROBE_MISPLACED, SECTOR_SIZE);
+  ok = (! biosdisk_flat (BIOSDISK_READ, drive, 0, 1,
+			 (unsigned long) flat_probe_buf)
+	&& ! grub_memcmp (flat_probe_buf, (char *) SCRATCHADDR, SECTOR_SIZE));
+  grub_memmove ((char *) FLAT_PROBE_MISPLACED, flat_probe_saved, SECTOR_SIZE);
+
+  flat_address[drive & 0x7F] = ok ? 1 : -1;
+  return ok;
+}
+
+/* Read NSEC sectors starting from SECTOR in DRIVE disk with GEOMETRY
+   into BUF, which may be anywhere in memory. If the BIOS takes flat
+   addresses, read straight into BUF, FLAT_MAX_SECT sectors at a time.
+   Otherwise, since the BIOS can only reach the conventional memory,
+   bounce the data through the whole raw device buffer at a time,
+   instead of one track at a time as rawread does. Return the same as
+   biosdisk.  */
+int
+biosdisk_read (int drive, struct geometry *geometry,
+	       sector_t sector, int nsec, char *buf)
+{
+  int max_sect = BUFFERLEN / geometry->sector_size;
+
+  if (drive == memdisk_drive)
+    return memdisk_rw (BIOSDISK_READ, sector, nsec, buf);
+  if (drive == loop_drive)
+    return loop_rw (BIOSDISK_READ, sector, nsec, buf);
+
+  while (nsec > 0 && (geometry->flags & BIOSDISK_FLAG_FLAT_ADDRESS))
+    {
+      int num = nsec;
+
+      if (num > FLAT_MAX_SECT)
+	num = FLAT_MAX_SECT;
+
+      /* Should it fail after all, go on the slow way.  */
+      if (biosdisk_flat (BIOSDISK_READ, drive, sector, num,
+			 (unsigned long) buf))
+	{
+	  geometry->flags &= ~BIOSDISK_FLAG_FLAT_ADDRESS;
+	  flat_address[drive & 0x7F] = -1;
+	  break;
+	}
+
+      buf += num * geometry->sector_size;
+      sector += num;
+      nsec -= num;
+    }
+
+  while (nsec > 0)
+    {
+      int err, num = nsec;
+
+      if (num > max_sect)
+	num = max_sect;
+
+      /* A CHS request cannot cross a track boundary.  */
+      if (! (geometry->flags & BIOSDISK_FLAG_LBA_EXTENSION)
+	  && num > (geometry->sectors
+		    - (unsigned long) sector % geometry->sectors))
+	num = geometry->sectors - (unsigned long) sector % geometry->sectors;
+
+      err = biosdisk (BIOSDISK_READ, drive, geometry, sector, num, BUFFERSEG);
+      if (err)
+	return err;
+
+      grub_memmove (buf, (char *) BUFFERADDR, num * geometry->sector_size);
+      buf += num * geometry->sector_size;
+      sector += num;
+      nsec -= num;
+    }
+
+  return 0;
+}
+
+/* Write NSEC sectors from BUF to SECTOR in DRIVE disk with GEOMETRY,
+   bouncing them through the raw device buffer like biosdisk_read, so
+   that a run of sectors takes a call per buffer instead of one per
+   sector. The caller must forget what the buffer held. Return the
+   same as biosdisk.  */
+int
+biosdisk_write (int drive, struct geometry *geometry,
+		sector_t sector, int nsec, char *buf)
+{
+  int max_sect = BUFFERLEN / geometry->sector_size;
+
+  if (drive == memdisk_drive)
+    return memdisk_rw (BIOSDISK_WRITE, sector, nsec, buf);
+  if (drive == loop_drive)
+    return loop_rw (BIOSDISK_WRITE, sector, nsec, buf);
+
+  while (nsec > 0)
+    {
+      int err, num = nsec;
+
+      if (num > max_sect)
+	num = max_sect;
+
+      /* A CHS request cannot cross a track boundary.  */
+      if (! (geometry->flags & BIOSDISK_FLAG_LBA_EXTENSION)
+	  && num > (geometry->sectors
+		    - (unsigned long) sector % geometry->sectors))
+	num = geometry->sectors - (unsigned long) sector % geometry->sectors;
+
+      grub_memmove ((char *) BUFFERADDR, buf, num * geometry->sector_size);
+      err = biosdisk (BIOSDISK_WRITE, drive, geometry, sector, num,
+		      BUFFERSEG);
+      if (err)
+	return err;
+
+      buf += num * geometry->sector_size;
+      sector += num;
+      nsec -= num;
+    }
+
+  return 0;
+}
+#endif /* ! STAGE1_5 */
+
 /* Check bootable CD-ROM emulation status.  */
 static int
 get_cdinfo (int drive, struct geometry *geometry)
@@ -185,6 +377,13 @@ get_diskinfo (int drive, struct geometry *geometry)
 {
   int err;
 
+#ifndef STAGE1_5
+  if (drive == memdisk_drive)
+    return memdisk_get_diskinfo (geometry);
+  if (drive == loop_drive)
+    return loop_get_diskinfo (geometry);
+#endif
+
   /* Clear the flags.  */
   geometry->flags = 0;
   
@@ -192,7 +391,7 @@ get_diskinfo (int drive, struct geometry *geometry)
     {
       /* hard disk or CD-ROM */
       int version;
-      unsigned long total_sectors = 0;
+      sector_t total_sectors = 0;
       
       version = check_int13_extensions (drive);
 
@@ -254,11 +453,8 @@ get_diskinfo (int drive, struct geometry *geometry)
 		 so I omit the check for now. - okuji  */
 	      /* if (drp.flags & (1 << 1)) */
 	       
-	      /* FIXME: when the 2TB limit becomes critical, we must
-		 change the type of TOTAL_SECTORS to unsigned long
-		 long.  */
 	      if (drp.total_sectors)
-		total_sectors = drp.total_sectors & ~0L;
+		total_sectors = drp.total_sectors;
 	      else
 		/* Some buggy BIOSes doesn't return the total sectors
 		   correctly but returns zero. So if it is zero, compute
@@ -284,6 +480,14 @@ get_diskinfo (int drive, struct geometry *geometry)
 	}
       geometry->total_sectors = total_sectors;
       geometry->sector_size = SECTOR_SIZE;
+
+#ifndef STAGE1_5
+      /* EDD 3.0 or later.  */
+      if (version >= 0x30
+	  && (geometry->flags & BIOSDISK_FLAG_LBA_EXTENSION)
+	  && probe_flat_address (drive, geometry))
+	geometry->flags |= BIOSDISK_FLAG_FLAT_ADDRESS;
+#endif
     }
   else
     {
@@ -32,6 +32,27 @@ entry_func entry_addr;
 #ifndef PLATFORM_EFI
 static struct mod_list mll[99];
 static int linux_mem_size;
+
+/* The most ELF segments read with one grub_readv.  */
+#define ELF_READV_MAX	16
+
+/* Read the *COUNT segments in SEGS, and zero the rest of each, as big
+   as MEMSIZ says it is in memory.  Return non-zero if it went well.  */
+static int
+load_segments (struct grub_iovec *segs, unsigned *memsiz, int *count)
+{
+  int i;
+
+  if (! grub_readv (segs, *count))
+    return 0;
+
+  for (i = 0; i < *count; i++)
+    if (memsiz[i] > (unsigned) segs[i].len)
+      memset (segs[i].buf + segs[i].len, 0, memsiz[i] - segs[i].len);
+
+  *count = 0;
+  return 1;
+}
 #endif
 
 /*
@@ -284,6 +305,15 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
       text_len = filemax - data_len - get_sector_size(current_drive);
 
       linux_data_tmp_addr = (char *) LINUX_BZIMAGE_ADDR + text_len;
+#if ! defined(GRUB_UTIL) && ! defined(SUPPORT_NETBOOT)
+      /* The real mode part is put together after the kernel and moved
+	 into place at boot, for something might still use the memory
+	 where it goes.  Above the disk cache, nothing of GRUB does; but
+	 network cards keep their buffers there.  */
+      if (linux_data_real_addr
+	  >= (char *) DISK_CACHE_BUF + DISK_CACHE_BUFLEN)
+	linux_data_tmp_addr = linux_data_real_addr;
+#endif
       
       if (! big_linux
 	  && text_len > linux_data_real_addr - (char *) LINUX_ZIMAGE_ADDR)
@@ -464,7 +494,9 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 	  /* offset into file */
 	  grub_seek (data_len + get_sector_size(current_drive));
       
-	  cur_addr = (int) linux_data_tmp_addr + LINUX_SETUP_MOVE_SIZE;
+	  cur_addr = (int) LINUX_BZIMAGE_ADDR + text_len;
+	  if (linux_data_tmp_addr != linux_data_real_addr)
+	    cur_addr += LINUX_SETUP_MOVE_SIZE;
 	  grub_read ((char *) LINUX_BZIMAGE_ADDR, text_len);
       
 	  if (errnum == ERR_NONE)
@@ -552,7 +584,8 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
       else if (!errnum)
 	errnum = ERR_EXEC_FORMAT;
 
-      if (!errnum && pu.aout->a_syms
+      if (!errnum && ! (load_flags & KERNEL_LOAD_NO_SYMBOLS)
+	  && pu.aout->a_syms
 	  && pu.aout->a_syms < (filemax - filepos))
 	{
 	  int symtab_err, orig_addr = cur_addr;
@@ -611,73 +644,109 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
     /* ELF executable */
     {
       unsigned loaded = 0, memaddr, memsiz, filesiz;
-      Elf32_Phdr *phdr;
+      Elf32_Phdr *phdr = 0;
+      /* The segment loaded last, by its offset in the file and its
+	 index, or -1.  */
+      unsigned last_offset = 0;
+      int last = -1, next;
+      /* The segments to read, all at once, and how big each is in
+	 memory.  */
+      struct grub_iovec segs[ELF_READV_MAX];
+      unsigned segs_memsiz[ELF_READV_MAX];
+      int nsegs = 0;
 
       /* reset this to zero for now */
       cur_addr = 0;
 
-      /* scan for program segments */
-      for (i = 0; i < pu.elf->e_phnum; i++)
+      /* Load the program segments in the order they are in the file,
+	 rather than in the order of their headers, so that a compressed
+	 kernel is decompressed in a single pass, without seeking back
+	 to the start.  */
+      for (;;)
 	{
-	  phdr = (Elf32_Phdr *)
-	    (pu.elf->e_phoff + ((int) buffer)
-	     + (pu.elf->e_phentsize * i));
-	  if (phdr->p_type == PT_LOAD)
+	  next = -1;
+	  for (i = 0; i < pu.elf->e_phnum; i++)
 	    {
-	      /* offset into file */
-	      grub_seek (phdr->p_offset);
-	      filesiz = phdr->p_filesz;
-	      
-	      if (type == KERNEL_TYPE_FREEBSD || type == KERNEL_TYPE_NETBSD)
-		memaddr = RAW_ADDR (phdr->p_paddr & 0xFFFFFF);
-	      else
-		memaddr = RAW_ADDR (phdr->p_paddr);
-	      
-	      memsiz = phdr->p_memsz;
-	      if (memaddr < RAW_ADDR (0x100000))
-		errnum = ERR_BELOW_1MB;
-
-	      /* If the memory range contains the entry address, get the
-		 physical address here.  */
-	      if (type == KERNEL_TYPE_MULTIBOOT
-		  && (unsigned) entry_addr >= phdr->p_vaddr
-		  && (unsigned) entry_addr < phdr->p_vaddr + memsiz)
-		real_entry_addr = (entry_func) ((unsigned) entry_addr
-						+ memaddr - phdr->p_vaddr);
-		
-	      /* make sure we only load what we're supposed to! */
-	      if (filesiz > memsiz)
-		filesiz = memsiz;
-	      /* mark memory as used */
-	      if (cur_addr < memaddr + memsiz)
-		cur_addr = memaddr + memsiz;
-	      verbose_printf (", <0x%x:0x%x:0x%x>", memaddr, filesiz,
-		      memsiz - filesiz);
-	      /* increment number of segments */
-	      loaded++;
-
-	      /* load the segment */
-	      if (memcheck (memaddr, memsiz)
-		  && grub_read ((char *) memaddr, filesiz) == filesiz)
+	      Elf32_Phdr *p = (Elf32_Phdr *)
+		(pu.elf->e_phoff + ((int) buffer)
+		 + (pu.elf->e_phentsize * i));
+
+	      if (p->p_type != PT_LOAD)
+		continue;
+	      if (last >= 0
+		  && (p->p_offset < last_offset
+		      || (p->p_offset == last_offset && i <= last)))
+		continue;
+	      if (next < 0 || p->p_offset < phdr->p_offset)
 		{
-		  if (memsiz > filesiz)
-		    memset ((char *) (memaddr + filesiz), 0, memsiz - filesiz);
+		  next = i;
+		  phdr = p;
 		}
-	      else
-		break;
 	    }
+
+	  if (next < 0)
+	    break;
+	  last = next;
+	  last_offset = phdr->p_offset;
+
+	  filesiz = phdr->p_filesz;
+	      
+	  if (type == KERNEL_TYPE_FREEBSD || type == KERNEL_TYPE_NETBSD)
+	    memaddr = RAW_ADDR (phdr->p_paddr & 0xFFFFFF);
+	  else
+	    memaddr = RAW_ADDR (phdr->p_paddr);
+	      
+	  memsiz = phdr->p_memsz;
+	  if (memaddr < RAW_ADDR (0x100000))
+	    errnum = ERR_BELOW_1MB;
+
+	  /* If the memory range contains the entry address, get the
+	     physical address here.  */
+	  if (type == KERNEL_TYPE_MULTIBOOT
+	      && (unsigned) entry_addr >= phdr->p_vaddr
+	      && (unsigned) entry_addr < phdr->p_vaddr + memsiz)
+	    real_entry_addr = (entry_func) ((unsigned) entry_addr
+					    + memaddr - phdr->p_vaddr);
+		
+	  /* make sure we only load what we're supposed to! */
+	  if (filesiz > memsiz)
+	    filesiz = memsiz;
+	  /* mark memory as used */
+	  if (cur_addr < memaddr + memsiz)
+	    cur_addr = memaddr + memsiz;
+	  verbose_printf (", <0x%x:0x%x:0x%x>", memaddr, filesiz,
+			  memsiz - filesiz);
+	  /* increment number of segments */
+	  loaded++;
+
+	  /* load the segment, with the others */
+	  if (! memcheck (memaddr, memsiz)
+	      || (nsegs == ELF_READV_MAX
+		  && ! load_segments (segs, segs_memsiz, &nsegs)))
+	    break;
+
+	  segs[nsegs].pos = phdr->p_offset;
+	  segs[nsegs].len = filesiz;
+	  segs[nsegs].buf = (char *) memaddr;
+	  segs_memsiz[nsegs++] = memsiz;
 	}
 
+      if (! errnum)
+	load_segments (segs, segs_memsiz, &nsegs);
+
       if (! errnum)
 	{
 	  if (! loaded)
 	    errnum = ERR_EXEC_FORMAT;
-	  else
+	  else if (! (load_flags & KERNEL_LOAD_NO_SYMBOLS))
 	    {
 	      /* Load ELF symbols.  */
 	      Elf32_Shdr *shdr = NULL;
 	      int tab_size, sec_size;
 	      int symtab_err = 0;
+	      /* Where the file was read from to the end of the section
+		 header table, and where that went, if it was.  */
+	      unsigned span_start = 0, span_end = 0, span_addr = 0;
 
 	      mbi.syms.e.num = pu.elf->e_shnum;
 	      mbi.syms.e.size = pu.elf->e_shentsize;
@@ -688,51 +757,119 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 		cur_addr = (cur_addr + 0xFFF) & 0xFFFFF000;
 	      
 	      tab_size = pu.elf->e_shentsize * pu.elf->e_shnum;
-	      
-	      grub_seek (pu.elf->e_shoff);
-	      if (grub_read ((char *) RAW_ADDR (cur_addr), tab_size)
-		  == tab_size)
+
+	      /* The section header table is usually at the end of the
+		 file, after the sections it tells about.  Seeking back
+		 to them from it would decompress a compressed kernel
+		 all over again, so read everything from where the
+		 segments ended up to the end of the table instead, and
+		 take the sections from where they land.  The start is
+		 put at the same offset in a page as in the file, to keep
+		 the sections aligned.  */
+	      if (pu.elf->e_shoff >= (unsigned) filepos)
+		{
+		  int span;
+
+		  span_start = filepos;
+		  span_end = pu.elf->e_shoff + tab_size;
+		  span_addr = (((cur_addr + 0xFFF) & 0xFFFFF000)
+			       + (span_start & 0xFFF));
+		  span = span_end - span_start;
+
+		  if (memcheck (span_addr, span)
+		      && grub_read ((char *) RAW_ADDR (span_addr), span) == span)
+		    {
+		      mbi.syms.e.addr = span_addr + pu.elf->e_shoff - span_start;
+		      cur_addr = span_addr + span;
+		    }
+		  else
+		    symtab_err = 1;
+		}
+	      else
+		{
+		  grub_seek (pu.elf->e_shoff);
+		  if (grub_read ((char *) RAW_ADDR (cur_addr), tab_size)
+		      == tab_size)
+		    {
+		      mbi.syms.e.addr = cur_addr;
+		      cur_addr += tab_size;
+		    }
+		  else
+		    symtab_err = 1;
+		}
+
+	      if (! symtab_err)
 		{
-		  mbi.syms.e.addr = cur_addr;
 		  shdr = (Elf32_Shdr *) mbi.syms.e.addr;
-		  cur_addr += tab_size;
 		  
 		  verbose_printf (", shtab=0x%x", cur_addr);
-  		  
-		  for (i = 0; i < mbi.syms.e.num; i++)
+
+		  /* Take the sections in the order they are in the file,
+		     rather than in the order of their headers, so that
+		     those which have to be read apart are read going
+		     forward.  A section is done once it has an address,
+		     as the loaded ones have already, and the empty ones
+		     are of no use.  */
+		  for (;;)
 		    {
-		      /* This section is a loaded section,
-			 so we don't care.  */
-		      if (shdr[i].sh_addr != 0)
-			continue;
-		      
-		      /* This section is empty, so we don't care.  */
-		      if (shdr[i].sh_size == 0)
-			continue;
-		      
+		      unsigned addr;
+
+		      next = -1;
+		      for (i = 0; i < mbi.syms.e.num; i++)
+			if (shdr[i].sh_addr == 0 && shdr[i].sh_size != 0
+			    && (next < 0
+				|| shdr[i].sh_offset < shdr[next].sh_offset))
+			  next = i;
+
+		      if (next < 0)
+			break;
+		      i = next;
+
+		      sec_size = shdr[i].sh_size;
+
+		      /* Read already, and aligned as it should be.  */
+		      addr = span_addr + shdr[i].sh_offset - span_start;
+		      if (span_addr
+			  && shdr[i].sh_offset >= span_start
+			  && shdr[i].sh_offset + sec_size <= span_end
+			  && (shdr[i].sh_addralign <= 1
+			      || addr % shdr[i].sh_addralign == 0))
+			{
+			  shdr[i].sh_addr = addr;
+			  continue;
+			}
+
 		      /* Align the section to a sh_addralign bits boundary.  */
 		      cur_addr = ((cur_addr + shdr[i].sh_addralign) & 
 				  - (int) shdr[i].sh_addralign);
 		      
-		      grub_seek (shdr[i].sh_offset);
-		      
-		      sec_size = shdr[i].sh_size;
-
-		      if (! (memcheck (cur_addr, sec_size)
-			     && (grub_read ((char *) RAW_ADDR (cur_addr),
-					    sec_size)
-				 == sec_size)))
+		      if (! memcheck (cur_addr, sec_size))
 			{
 			  symtab_err = 1;
 			  break;
 			}
+
+		      /* Read already, but not aligned.  */
+		      if (span_addr
+			  && shdr[i].sh_offset >= span_start
+			  && shdr[i].sh_offset + sec_size <= span_end)
+			memmove ((char *) RAW_ADDR (cur_addr),
+				 (char *) RAW_ADDR (addr), sec_size);
+		      else
+			{
+			  grub_seek (shdr[i].sh_offset);
+			  if (grub_read ((char *) RAW_ADDR (cur_addr), sec_size)
+			      != sec_size)
+			    {
+			      symtab_err = 1;
+			      break;
+			    }
+			}
 		      
 		      shdr[i].sh_addr = cur_addr;
 		      cur_addr += sec_size;
 		    }
 		}
-	      else 
-		symtab_err = 1;
 	      
 	      if (mbi.syms.e.addr < RAW_ADDR(0x10000))
 		symtab_err = 1;
@@ -792,6 +929,15 @@ load_module (char *module, char *arg)
   if (!grub_open (module))
     return 0;
 
+  /* The modules after this one may have been prefetched where it is
+     to go.  */
+  if (prefetch_clobber (cur_addr, filemax))
+    {
+      grub_close ();
+      if (! grub_open (module))
+	return 0;
+    }
+
   len = grub_read ((char *) cur_addr, -1);
   if (! len)
     {
@@ -819,65 +965,156 @@ load_module (char *module, char *arg)
 }
 #endif
 
+#ifndef PLATFORM_EFI
+/* Read the images in INITRD, a list of files, to ADDR, each one after
+   the first on a 4-byte boundary, then the archive its options make,
+   and return how many bytes they take in all.  */
+static int
+read_initrd (char *initrd, char *addr)
+{
+  char *image;
+  int len = 0, size;
+
+  for (image = initrd; *image; image = skip_to (0, image))
+    {
+      if (initrd_cpio_option (image))
+	continue;
+
+      grub_memset (addr + len, 0, ((len + 3) & ~3) - len);
+      len = (len + 3) & ~3;
+
+      if (! grub_open (image))
+	return len;
+
+      len += grub_read (addr + len, -1);
+      grub_close ();
+      if (errnum)
+	return len;
+    }
+
+  grub_memset (addr + len, 0, ((len + 3) & ~3) - len);
+  size = initrd_cpio_build (initrd, addr + ((len + 3) & ~3));
+  if (size > 0)
+    len = ((len + 3) & ~3) + size;
+
+  return len;
+}
+#endif
+
 int
 load_initrd (char *initrd)
 {
 #ifdef PLATFORM_EFI
+  int ret;
+
 #ifndef NO_DECOMPRESSION
   no_decompression = 1;
 #endif
-  return grub_load_initrd (initrd);
+  ret = grub_load_initrd (initrd);
+#ifndef NO_DECOMPRESSION
+  no_decompression = 0;
+#endif
+  return ret;
 #else
-  int len, next_addr;
-  char *singleimage, *pos;
-  unsigned long moveto;
+  int len, size, direct = 1;
+  char *image;
+  unsigned long top, moveto;
   unsigned long max_addr;
   struct linux_kernel_header *lh
-    = (struct linux_kernel_header *) (cur_addr - LINUX_SETUP_MOVE_SIZE);
+    = (struct linux_kernel_header *) linux_data_tmp_addr;
   
 #ifndef NO_DECOMPRESSION
   no_decompression = 1;
 #endif
+
+  /* The images are concatenated in memory, each one after the first on
+     a 4-byte boundary as cpio archives are.  Find out how big they are
+     in all first, so that each can be read straight to where it goes;
+     if the size of one isn't known before it is read, as over HTTP
+     without a length, they are all read after the kernel and moved up
+     afterwards.  */
   len = 0;
-  next_addr = cur_addr;
+  for (image = initrd; *image; image = skip_to (0, image))
+    {
+      if (initrd_cpio_option (image))
+	continue;
 
-  /* loop over all initrd images and concatenate them in memory */
-  singleimage = strtok_r(initrd," \t",&pos);
-  while (singleimage) {
-    if (! grub_open (singleimage))
-      continue;
+      if (! grub_open (image))
+	goto fail;
+      size = filemax;
+      grub_close ();
 
-    len += grub_read ((char *) next_addr, -1);
-    grub_close ();
+      if (size < 0)
+	direct = 0;
+      len = ((len + 3) & ~3) + size;
+    }
 
-    next_addr = cur_addr + len;
-    singleimage = strtok_r(NULL," \t",&pos);
-  }
+  size = initrd_cpio_size (initrd);
+  if (size < 0)
+    goto fail;
+  if (size)
+    len = ((len + 3) & ~3) + size;
+
+  if (! direct)
+    {
+      len = read_initrd (initrd, (char *) cur_addr);
+      if (errnum)
+	goto fail;
+    }
 
   if (!len)
     goto fail;
 
   if (linux_mem_size)
-    moveto = linux_mem_size;
+    top = linux_mem_size;
   else
-    moveto = (mbi.mem_upper + 0x400) << 10;
+    top = (mbi.mem_upper + 0x400) << 10;
   
-  moveto = (moveto - len) & 0xfffff000;
-#if 0
-  max_addr = (lh->header == LINUX_MAGIC_SIGNATURE && lh->version >= 0x0203
-	      ? lh->initrd_addr_max : LINUX_INITRD_MAX_ADDRESS);
-#else
-  max_addr = LINUX_INITRD_MAX_ADDRESS;
-#endif
-  if (moveto + len >= max_addr)
-    moveto = (max_addr - len) & 0xfffff000;
+  moveto = (top - len) & 0xfffff000;
+  /* INITRD_ADDR_MAX is the highest address the initrd may use.  */
+  if (lh->header == LINUX_MAGIC_SIGNATURE && lh->version >= 0x0203)
+    max_addr = lh->initrd_addr_max;
+  else
+    max_addr = LINUX_INITRD_MAX_ADDRESS - 1;
+  if (moveto + len - 1 >= max_addr)
+    moveto = (max_addr + 1 - len) & 0xfffff000;
   
   /* XXX: Linux 2.3.xx has a bug in the memory range check, so avoid
      the last page.
      XXX: Linux 2.2.xx has a bug in the memory range check, which is
      worse than that of Linux 2.3.xx, so avoid the last 64kb. *sigh*  */
   moveto -= 0x10000;
-  memmove ((void *) RAW_ADDR (moveto), (void *) cur_addr, len);
+
+  /* Below the end of the kernel, or past the top of the memory if it
+     is bigger than that, there is no room for it.  */
+  if (RAW_ADDR (moveto) < (unsigned long) cur_addr || moveto >= top)
+    {
+      errnum = ERR_WONT_FIT;
+      goto fail;
+    }
+
+  /* Read the images to where they go, unless that is over files still
+     in the prefetch buffer, which the space after the kernel is below.  */
+  if (direct)
+    {
+      char *addr = (char *) RAW_ADDR (moveto);
+
+      if (RAW_ADDR (moveto) < prefetch_end ())
+	{
+	  direct = 0;
+	  addr = (char *) cur_addr;
+	}
+
+      if (read_initrd (initrd, addr) != len)
+	{
+	  if (! errnum)
+	    errnum = ERR_READ;
+	  goto fail;
+	}
+    }
+
+  if (! direct)
+    memmove ((void *) RAW_ADDR (moveto), (void *) cur_addr, len);
 
   verbose_printf ("   [Linux-initrd @ 0x%x, 0x%x bytes]\n", moveto, len);
 
@@ -885,7 +1122,6 @@ load_initrd (char *initrd)
   lh->ramdisk_image = RAW_ADDR (moveto);
   lh->ramdisk_size = len;
 
-
  fail:
   
 #ifndef NO_DECOMPRESSION
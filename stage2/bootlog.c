@@ -0,0 +1,102 @@
+/* bootlog.c - the messages of verbose and debug mode, kept in memory */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <shared.h>
+#include <bootlog.h>
+
+static struct bootlog_table bootlog_store;
+static struct bootlog_table *bootlog = &bootlog_store;
+
+/* Whether what grub_vsprintf prints is going into the log, and whether
+   it goes to the console as well.  */
+int bootlog_capture;
+int bootlog_console = 1;
+
+/* Put LEN bytes of STR into the log, over the oldest ones.  */
+void
+bootlog_write (const char *str, int len)
+{
+  while (len-- > 0)
+    bootlog->data[bootlog->written++ % BOOTLOG_SIZE] = *str++;
+}
+
+/* Print FORMAT with ARGS into the log, and on the console unless it
+   has been told to keep quiet.  */
+void
+bootlog_vprintf (const char *format, va_list args)
+{
+  bootlog_capture = 1;
+  grub_vsprintf (0, format, args);
+  bootlog_capture = 0;
+}
+
+void
+bootlog_printf (const char *format, ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  bootlog_vprintf (format, args);
+  va_end (args);
+}
+
+/* Move the log to DEST, which holds a struct bootlog_table, and go on
+   writing there.  Return DEST.  */
+struct bootlog_table *
+bootlog_move (void *dest)
+{
+  struct bootlog_table *table = dest;
+
+  bootlog->signature = BOOTLOG_SIGNATURE;
+  bootlog->version = BOOTLOG_VERSION;
+  bootlog->size = BOOTLOG_SIZE;
+
+  *table = *bootlog;
+  bootlog = table;
+  return table;
+}
+
+/* Print what the log still holds, the oldest first.  */
+void
+bootlog_print (void)
+{
+  unsigned int start = 0, end = bootlog->written;
+
+  if (! end)
+    {
+      grub_printf ("Nothing has been logged.\n");
+      return;
+    }
+
+  if (end > BOOTLOG_SIZE)
+    {
+      start = end - BOOTLOG_SIZE;
+      grub_printf ("[%u bytes before are lost]\n", start);
+    }
+
+  /* The ring wraps once at most.  */
+  if (start % BOOTLOG_SIZE + (end - start) > BOOTLOG_SIZE)
+    {
+      grub_putmem (bootlog->data + start % BOOTLOG_SIZE,
+		   BOOTLOG_SIZE - start % BOOTLOG_SIZE);
+      start += BOOTLOG_SIZE - start % BOOTLOG_SIZE;
+    }
+  grub_putmem (bootlog->data + start % BOOTLOG_SIZE, end - start);
+}
@@ -0,0 +1,52 @@
+/* bootlog.h - the messages of verbose and debug mode, kept in memory */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef GRUB_BOOTLOG_HEADER
+#define GRUB_BOOTLOG_HEADER	1
+
+/* The messages go into a ring, which on EFI is handed to the OS as a
+   configuration table, with this layout.  WRITTEN counts every byte
+   put into the ring; the byte N of them is at N modulo SIZE in DATA,
+   as long as it is one of the last SIZE.  */
+
+#define BOOTLOG_SIGNATURE	0x474c4247	/* "GBLG" */
+#define BOOTLOG_VERSION		1
+
+/* Elsewhere the ring is in the bss of Stage 2, and smaller.  */
+#ifdef PLATFORM_EFI
+# define BOOTLOG_SIZE		0x4000
+#else
+# define BOOTLOG_SIZE		0x1000
+#endif
+
+struct bootlog_table
+{
+  unsigned int signature;
+  unsigned int version;
+  unsigned int size;
+  unsigned int written;
+  char data[BOOTLOG_SIZE];
+} __attribute__ ((packed));
+
+struct bootlog_table *bootlog_move (void *dest);
+void bootlog_print (void);
+
+#endif /* ! GRUB_BOOTLOG_HEADER */
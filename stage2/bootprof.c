@@ -0,0 +1,391 @@
+/* bootprof.c - a trace of where the time goes while booting */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <shared.h>
+#include <bootprof.h>
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+# include <grub/efi/efi.h>
+#endif
+
+static struct bootprof_table bootprof_store;
+static struct bootprof_table *bootprof = &bootprof_store;
+
+/* The event which reads are put down to, or -1.  */
+static int bootprof_file = -1;
+static int bootprof_depth;
+
+#if ! defined(__x86_64__)
+/* Whether the processor has a TSC: 0 if not, 1 if it has, and -1 if it
+   hasn't been asked yet.  Before the Pentium, it hadn't.  */
+static int bootprof_tsc = -1;
+
+static int
+bootprof_has_tsc (void)
+{
+  unsigned long before, after;
+  unsigned int a, b, c, d;
+
+  /* Without CPUID, which is there if the ID flag can be toggled,
+     there is no TSC either.  */
+  asm volatile ("pushfl\n\t"
+		"popl %0\n\t"
+		"movl %0, %1\n\t"
+		"xorl $0x200000, %1\n\t"
+		"pushl %1\n\t"
+		"popfl\n\t"
+		"pushfl\n\t"
+		"popl %1\n\t"
+		"pushl %0\n\t"
+		"popfl"
+		: "=&r" (before), "=&r" (after));
+  if (! ((before ^ after) & 0x200000))
+    return 0;
+
+  asm volatile ("pushl %%ebx\n\t"
+		"cpuid\n\t"
+		"movl %%ebx, %1\n\t"
+		"popl %%ebx"
+		: "=a" (a), "=S" (b), "=c" (c), "=d" (d)
+		: "0" (1));
+  return (d >> 4) & 1;
+}
+#endif
+
+/* Return the TSC, or 0 if there is none.  */
+unsigned long long
+bootprof_now (void)
+{
+  unsigned int lo, hi;
+
+#if ! defined(__x86_64__)
+  if (bootprof_tsc < 0)
+    bootprof_tsc = bootprof_has_tsc ();
+  if (! bootprof_tsc)
+    return 0;
+#endif
+
+  asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((unsigned long long) hi << 32) | lo;
+}
+
+/* Start a new event called NAME at the current time, and return it,
+   or 0 if the trace is full.  Keep the end of NAME, up to a space, if
+   it is too long.  */
+static struct bootprof_event *
+bootprof_add (const char *name, int flags)
+{
+  struct bootprof_event *ev;
+  const char *end;
+  int i;
+
+  if (bootprof->count == BOOTPROF_MAX_EVENTS)
+    {
+      bootprof->dropped++;
+      return 0;
+    }
+
+  ev = &bootprof->events[bootprof->count++];
+  for (end = name; *end && *end != ' ' && *end != '\t'; end++)
+    ;
+  if (end - name > BOOTPROF_NAME_LEN - 1)
+    name = end - (BOOTPROF_NAME_LEN - 1);
+  for (i = 0; name < end; i++)
+    ev->name[i] = *name++;
+  ev->name[i] = 0;
+
+  ev->start = bootprof_now ();
+  ev->read = ev->raw = 0;
+  ev->bytes = 0;
+  ev->flags = flags;
+  ev->blksize = ev->windowsize = 0;
+  ev->packets = ev->retransmits = ev->timeouts = 0;
+  ev->transfer = 0;
+  return ev;
+}
+
+/* Note that the boot got to NAME.  */
+void
+bootprof_mark (const char *name)
+{
+  bootprof_add (name, 0);
+}
+
+/* Note that FILENAME is being opened, and put the reads which follow
+   down to it.  */
+void
+bootprof_open (const char *filename)
+{
+  struct bootprof_event *ev;
+
+  /* The decompressors open nothing, but be safe.  */
+  if (bootprof_depth)
+    return;
+
+  ev = bootprof_add (filename, BOOTPROF_FILE);
+  bootprof_file = ev ? ev - bootprof->events : -1;
+}
+
+/* Called around grub_read, which calls itself for compressed files;
+   the inner calls are the reads of the compressed data.  */
+unsigned long long
+bootprof_read_begin (void)
+{
+  bootprof_depth++;
+  return bootprof_now ();
+}
+
+void
+bootprof_read_end (unsigned long long start, int len)
+{
+  unsigned long long time = bootprof_now () - start;
+  struct bootprof_event *ev;
+
+  bootprof_depth--;
+  if (bootprof_file < 0)
+    return;
+
+  ev = &bootprof->events[bootprof_file];
+  if (bootprof_depth)
+    ev->raw += time;
+  else
+    {
+      ev->read += time;
+      if (len > 0)
+	ev->bytes += len;
+    }
+}
+
+struct tftp_stat tftp_stat;
+
+/* Start counting a transfer of NAME, or of the same file again if NAME
+   is 0.  */
+void
+tftp_stat_begin (const char *name)
+{
+  int i;
+
+  if (name)
+    {
+      for (i = 0; i < (int) sizeof (tftp_stat.name) - 1 && name[i]
+	     && name[i] != ' ' && name[i] != '\t'; i++)
+	tftp_stat.name[i] = name[i];
+      tftp_stat.name[i] = 0;
+    }
+
+  tftp_stat.blksize = tftp_stat.windowsize = 0;
+  tftp_stat.packets = tftp_stat.retransmits = tftp_stat.timeouts = 0;
+  tftp_stat.bytes = 0;
+  tftp_stat.cycles = 0;
+  tftp_stat.start = bootprof_now ();
+}
+
+/* The transfer is complete: put it down to the file opened last, and
+   tell about it in verbose mode.  */
+void
+tftp_stat_end (void)
+{
+  tftp_stat.cycles = bootprof_now () - tftp_stat.start;
+
+  if (bootprof_file >= 0)
+    {
+      struct bootprof_event *ev = &bootprof->events[bootprof_file];
+
+      ev->flags |= BOOTPROF_TFTP;
+      ev->blksize = tftp_stat.blksize;
+      ev->windowsize = tftp_stat.windowsize;
+      ev->packets = tftp_stat.packets;
+      ev->retransmits = tftp_stat.retransmits;
+      ev->timeouts = tftp_stat.timeouts;
+      ev->transfer = tftp_stat.cycles;
+    }
+
+  if (grub_verbose)
+    {
+      unsigned long long per_ms = bootprof_cycles_per_ms ();
+
+      bootlog_printf ("TFTP %s: %lu bytes", tftp_stat.name, tftp_stat.bytes);
+      if (per_ms && tftp_stat.cycles)
+	bootlog_printf (" in %llu ms, %llu KB/s",
+			tftp_stat.cycles / per_ms,
+			tftp_stat.bytes * per_ms / tftp_stat.cycles);
+      if (tftp_stat.blksize)
+	bootlog_printf (", blksize %d", tftp_stat.blksize);
+      if (tftp_stat.windowsize)
+	bootlog_printf (", windowsize %d", tftp_stat.windowsize);
+      if (tftp_stat.packets)
+	bootlog_printf (", %lu packets", tftp_stat.packets);
+      bootlog_printf (", %lu retransmits, %lu timeouts\n",
+		      tftp_stat.retransmits, tftp_stat.timeouts);
+    }
+}
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+static void
+bootprof_cpuid (unsigned int leaf, unsigned int *a, unsigned int *b,
+		unsigned int *c, unsigned int *d)
+{
+# if defined(__x86_64__)
+  asm volatile ("cpuid"
+		: "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+		: "0" (leaf), "2" (0));
+# else
+  asm volatile ("pushl %%ebx\n\t"
+		"cpuid\n\t"
+		"movl %%ebx, %1\n\t"
+		"popl %%ebx"
+		: "=a" (*a), "=S" (*b), "=c" (*c), "=d" (*d)
+		: "0" (leaf), "2" (0));
+# endif
+}
+
+/* Return how many TSC cycles make a millisecond as CPUID leaf 0x15
+   tells, or 0 if it doesn't, as on all but the recent Intel
+   processors.  */
+static unsigned long long
+bootprof_cpuid_per_ms (void)
+{
+  unsigned int a, b, c, d;
+
+  bootprof_cpuid (0, &a, &b, &c, &d);
+  if (a < 0x15)
+    return 0;
+
+  /* The TSC runs at B/A times the crystal clock, of C Hz.  */
+  bootprof_cpuid (0x15, &a, &b, &c, &d);
+  if (! a || ! b || ! c)
+    return 0;
+
+  return (unsigned long long) c * b / a / 1000;
+}
+#endif
+
+/* Return how many TSC cycles make a millisecond, measuring it the
+   first time.  */
+unsigned long long
+bootprof_cycles_per_ms (void)
+{
+  unsigned long long start;
+
+  if (bootprof->cycles_per_ms)
+    return bootprof->cycles_per_ms;
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  bootprof->cycles_per_ms = bootprof_cpuid_per_ms ();
+  if (bootprof->cycles_per_ms || ! bootprof_now ())
+    return bootprof->cycles_per_ms;
+
+  start = bootprof_now ();
+  grub_efi_stall (1000);
+  bootprof->cycles_per_ms = bootprof_now () - start;
+#else
+  {
+    /* The clock ticks 18.2 times a second; measure one tick.  */
+    int tick = currticks ();
+
+    while (currticks () == tick)
+      ;
+    tick = currticks ();
+    start = bootprof_now ();
+    while (currticks () == tick)
+      ;
+    bootprof->cycles_per_ms = (bootprof_now () - start) * 182 / 10000;
+  }
+#endif
+
+  return bootprof->cycles_per_ms;
+}
+
+/* Move the trace to DEST, which holds a struct bootprof_table, and go
+   on recording there.  Return DEST.  */
+struct bootprof_table *
+bootprof_move (void *dest)
+{
+  struct bootprof_table *table = dest;
+
+  bootprof->signature = BOOTPROF_SIGNATURE;
+  bootprof->version = BOOTPROF_VERSION;
+  bootprof_cycles_per_ms ();
+
+  *table = *bootprof;
+  bootprof = table;
+  return table;
+}
+
+static void
+print_ms (unsigned long long cycles, unsigned long long per_ms)
+{
+  unsigned long long tenths = cycles * 10 / per_ms;
+
+  grub_printf ("%llu.%llu", tenths / 10, tenths % 10);
+}
+
+/* Print the trace, each time since the first event.  */
+void
+bootprof_print (void)
+{
+  unsigned long long per_ms = bootprof_cycles_per_ms ();
+  unsigned long long base;
+  unsigned int i;
+
+  if (! bootprof->count || ! per_ms)
+    {
+      grub_printf ("Nothing has been recorded.\n");
+      return;
+    }
+
+  base = bootprof->events[0].start;
+  grub_printf ("%llu cycles/ms, %llu ms from reset to the first event\n",
+	       per_ms, base / per_ms);
+
+  for (i = 0; i < bootprof->count; i++)
+    {
+      struct bootprof_event *ev = &bootprof->events[i];
+
+      grub_printf ("  ");
+      print_ms (ev->start - base, per_ms);
+      grub_printf (" ms  %s", ev->name);
+      if (ev->flags & BOOTPROF_FILE)
+	{
+	  grub_printf (": %u bytes in ", ev->bytes);
+	  print_ms (ev->read, per_ms);
+	  grub_printf (" ms");
+	  if (ev->raw)
+	    {
+	      grub_printf (", decompressing ");
+	      print_ms (ev->read - ev->raw, per_ms);
+	      grub_printf (" ms");
+	    }
+	}
+      if (ev->flags & BOOTPROF_TFTP)
+	{
+	  grub_printf ("\n      TFTP ");
+	  print_ms (ev->transfer, per_ms);
+	  grub_printf (" ms, blksize %u, windowsize %u, %u packets,"
+		       " %u retransmits, %u timeouts",
+		       ev->blksize, ev->windowsize, ev->packets,
+		       ev->retransmits, ev->timeouts);
+	}
+      grub_printf ("\n");
+    }
+
+  if (bootprof->dropped)
+    grub_printf ("%u more events did not fit.\n", bootprof->dropped);
+}
@@ -0,0 +1,108 @@
+/* bootprof.h - a trace of where the time goes while booting */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef GRUB_BOOTPROF_HEADER
+#define GRUB_BOOTPROF_HEADER	1
+
+/* The trace is a list of named points in time, in TSC cycles since the
+   processor was reset.  On EFI it is handed to the OS as a
+   configuration table, with this layout, so nothing in it may move.  */
+
+#define BOOTPROF_SIGNATURE	0x46504247	/* "GBPF" */
+#define BOOTPROF_VERSION	2
+
+/* Elsewhere the table stays in Stage 2, whose bss has no room for as
+   many events.  */
+#ifdef PLATFORM_EFI
+# define BOOTPROF_MAX_EVENTS	128
+#else
+# define BOOTPROF_MAX_EVENTS	32
+#endif
+#define BOOTPROF_NAME_LEN	24
+
+/* The event is a file opened with grub_open.  */
+#define BOOTPROF_FILE		1
+/* The file came over TFTP, and the TFTP fields are set.  */
+#define BOOTPROF_TFTP		2
+
+/* READ is how long grub_read took for the file, and RAW how much of
+   that went into reading it as it is on the disk, if it had to be
+   decompressed.  The TFTP fields are those of struct tftp_stat, for
+   the last transfer of the file.  */
+struct bootprof_event
+{
+  char name[BOOTPROF_NAME_LEN];
+  unsigned long long start;
+  unsigned long long read;
+  unsigned long long raw;
+  unsigned int bytes;
+  unsigned int flags;
+  unsigned short blksize;
+  unsigned short windowsize;
+  unsigned int packets;
+  unsigned int retransmits;
+  unsigned int timeouts;
+  unsigned long long transfer;
+} __attribute__ ((packed));
+
+struct bootprof_table
+{
+  unsigned int signature;
+  unsigned int version;
+  unsigned int count;
+  unsigned int dropped;
+  unsigned long long cycles_per_ms;
+  struct bootprof_event events[BOOTPROF_MAX_EVENTS];
+} __attribute__ ((packed));
+
+unsigned long long bootprof_now (void);
+void bootprof_mark (const char *name);
+void bootprof_open (const char *filename);
+unsigned long long bootprof_read_begin (void);
+void bootprof_read_end (unsigned long long start, int len);
+unsigned long long bootprof_cycles_per_ms (void);
+struct bootprof_table *bootprof_move (void *dest);
+void bootprof_print (void);
+
+/* What a TFTP transfer took, on the netboot and the EFI PXE paths
+   alike.  BLKSIZE and WINDOWSIZE are what the server agreed to, or 0
+   if the firmware doesn't tell.  RETRANSMITS counts the blocks which
+   came again or out of order and the requests sent again, and
+   TIMEOUTS the waits for the server which ran out.  CYCLES is the time
+   from the request to the last block.  */
+struct tftp_stat
+{
+  char name[64];
+  int blksize;
+  int windowsize;
+  unsigned long packets;
+  unsigned long retransmits;
+  unsigned long timeouts;
+  unsigned long bytes;
+  unsigned long long start;
+  unsigned long long cycles;
+};
+
+extern struct tftp_stat tftp_stat;
+
+void tftp_stat_begin (const char *name);
+void tftp_stat_end (void);
+
+#endif /* ! GRUB_BOOTPROF_HEADER */
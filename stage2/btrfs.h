@@ -0,0 +1,263 @@
+/* btrfs.h - the on-disk format of the Btrfs file system */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2009  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Everything on disk is little endian, as the processor is.  Only
+   what a read-only driver needs is spelled out.  */
+
+typedef unsigned char btrfs_u8;
+typedef unsigned short btrfs_u16;
+typedef unsigned int btrfs_u32;
+typedef unsigned long long btrfs_u64;
+
+#define BTRFS_SUPER_OFFSET	0x10000
+#define BTRFS_MAGIC		"_BHRfS_M"
+#define BTRFS_MAGIC_LEN		8
+
+/* the objectids of the trees, and of the items which matter here */
+#define BTRFS_ROOT_TREE_OBJECTID	1ULL
+#define BTRFS_CHUNK_TREE_OBJECTID	3ULL
+#define BTRFS_FS_TREE_OBJECTID		5ULL
+#define BTRFS_ROOT_TREE_DIR_OBJECTID	6ULL
+#define BTRFS_FIRST_FREE_OBJECTID	256ULL
+#define BTRFS_FIRST_CHUNK_TREE_OBJECTID	256ULL
+
+/* item types */
+#define BTRFS_INODE_ITEM_KEY		1
+#define BTRFS_INODE_REF_KEY		12
+#define BTRFS_DIR_ITEM_KEY		84
+#define BTRFS_DIR_INDEX_KEY		96
+#define BTRFS_EXTENT_DATA_KEY		108
+#define BTRFS_ROOT_ITEM_KEY		132
+#define BTRFS_CHUNK_ITEM_KEY		228
+
+/* chunk profiles */
+#define BTRFS_BLOCK_GROUP_RAID0		(1 << 3)
+#define BTRFS_BLOCK_GROUP_RAID1		(1 << 4)
+#define BTRFS_BLOCK_GROUP_DUP		(1 << 5)
+#define BTRFS_BLOCK_GROUP_RAID10	(1 << 6)
+#define BTRFS_BLOCK_GROUP_RAID5		(1 << 7)
+#define BTRFS_BLOCK_GROUP_RAID6		(1 << 8)
+#define BTRFS_BLOCK_GROUP_STRIPED	(BTRFS_BLOCK_GROUP_RAID0	\
+					 | BTRFS_BLOCK_GROUP_RAID10	\
+					 | BTRFS_BLOCK_GROUP_RAID5	\
+					 | BTRFS_BLOCK_GROUP_RAID6)
+
+/* file extents */
+#define BTRFS_FILE_EXTENT_INLINE	0
+#define BTRFS_FILE_EXTENT_REG		1
+#define BTRFS_FILE_EXTENT_PREALLOC	2
+
+#define BTRFS_COMPRESS_NONE		0
+#define BTRFS_COMPRESS_ZLIB		1
+#define BTRFS_COMPRESS_LZO		2
+#define BTRFS_COMPRESS_ZSTD		3
+
+/* no extent of compressed data is bigger than this, either way */
+#define BTRFS_MAX_COMPRESSED		0x20000
+
+#define BTRFS_MAX_LEVEL			8
+
+struct btrfs_key
+{
+  btrfs_u64 objectid;
+  btrfs_u8 type;
+  btrfs_u64 offset;
+} __attribute__ ((packed));
+
+struct btrfs_dev_item
+{
+  btrfs_u64 devid;
+  btrfs_u64 total_bytes;
+  btrfs_u64 bytes_used;
+  btrfs_u32 io_align;
+  btrfs_u32 io_width;
+  btrfs_u32 sector_size;
+  btrfs_u64 type;
+  btrfs_u64 generation;
+  btrfs_u64 start_offset;
+  btrfs_u32 dev_group;
+  btrfs_u8 seek_speed;
+  btrfs_u8 bandwidth;
+  btrfs_u8 uuid[16];
+  btrfs_u8 fsid[16];
+} __attribute__ ((packed));
+
+#define BTRFS_SYSTEM_CHUNK_ARRAY_SIZE	2048
+
+struct btrfs_super_block
+{
+  btrfs_u8 csum[32];
+  btrfs_u8 fsid[16];
+  btrfs_u64 bytenr;
+  btrfs_u64 flags;
+  char magic[BTRFS_MAGIC_LEN];
+  btrfs_u64 generation;
+  btrfs_u64 root;
+  btrfs_u64 chunk_root;
+  btrfs_u64 log_root;
+  btrfs_u64 log_root_transid;
+  btrfs_u64 total_bytes;
+  btrfs_u64 bytes_used;
+  btrfs_u64 root_dir_objectid;
+  btrfs_u64 num_devices;
+  btrfs_u32 sectorsize;
+  btrfs_u32 nodesize;
+  btrfs_u32 leafsize;
+  btrfs_u32 stripesize;
+  btrfs_u32 sys_chunk_array_size;
+  btrfs_u64 chunk_root_generation;
+  btrfs_u64 compat_flags;
+  btrfs_u64 compat_ro_flags;
+  btrfs_u64 incompat_flags;
+  btrfs_u16 csum_type;
+  btrfs_u8 root_level;
+  btrfs_u8 chunk_root_level;
+  btrfs_u8 log_root_level;
+  struct btrfs_dev_item dev_item;
+  char label[256];
+  btrfs_u64 cache_generation;
+  btrfs_u64 uuid_tree_generation;
+  btrfs_u8 metadata_uuid[16];
+  btrfs_u64 reserved[28];
+  btrfs_u8 sys_chunk_array[BTRFS_SYSTEM_CHUNK_ARRAY_SIZE];
+} __attribute__ ((packed));
+
+/* Every tree block, node or leaf, starts with this.  */
+struct btrfs_header
+{
+  btrfs_u8 csum[32];
+  btrfs_u8 fsid[16];
+  btrfs_u64 bytenr;
+  btrfs_u64 flags;
+  btrfs_u8 chunk_tree_uuid[16];
+  btrfs_u64 generation;
+  btrfs_u64 owner;
+  btrfs_u32 nritems;
+  btrfs_u8 level;
+} __attribute__ ((packed));
+
+/* The items of a leaf follow its header, and their data is found at
+   OFFSET from the end of the header.  */
+struct btrfs_item
+{
+  struct btrfs_key key;
+  btrfs_u32 offset;
+  btrfs_u32 size;
+} __attribute__ ((packed));
+
+/* and those of a node point at the blocks one level down */
+struct btrfs_key_ptr
+{
+  struct btrfs_key key;
+  btrfs_u64 blockptr;
+  btrfs_u64 generation;
+} __attribute__ ((packed));
+
+struct btrfs_stripe
+{
+  btrfs_u64 devid;
+  btrfs_u64 offset;
+  btrfs_u8 dev_uuid[16];
+} __attribute__ ((packed));
+
+/* followed by NUM_STRIPES stripes */
+struct btrfs_chunk
+{
+  btrfs_u64 length;
+  btrfs_u64 owner;
+  btrfs_u64 stripe_len;
+  btrfs_u64 type;
+  btrfs_u32 io_align;
+  btrfs_u32 io_width;
+  btrfs_u32 sector_size;
+  btrfs_u16 num_stripes;
+  btrfs_u16 sub_stripes;
+} __attribute__ ((packed));
+
+struct btrfs_timespec
+{
+  btrfs_u64 sec;
+  btrfs_u32 nsec;
+} __attribute__ ((packed));
+
+struct btrfs_inode_item
+{
+  btrfs_u64 generation;
+  btrfs_u64 transid;
+  btrfs_u64 size;
+  btrfs_u64 nbytes;
+  btrfs_u64 block_group;
+  btrfs_u32 nlink;
+  btrfs_u32 uid;
+  btrfs_u32 gid;
+  btrfs_u32 mode;
+  btrfs_u64 rdev;
+  btrfs_u64 flags;
+  btrfs_u64 sequence;
+  btrfs_u64 reserved[4];
+  struct btrfs_timespec atime;
+  struct btrfs_timespec ctime;
+  struct btrfs_timespec mtime;
+  struct btrfs_timespec otime;
+} __attribute__ ((packed));
+
+struct btrfs_root_item
+{
+  struct btrfs_inode_item inode;
+  btrfs_u64 generation;
+  btrfs_u64 root_dirid;
+  btrfs_u64 bytenr;
+  btrfs_u64 byte_limit;
+  btrfs_u64 bytes_used;
+  btrfs_u64 last_snapshot;
+  btrfs_u64 flags;
+  btrfs_u32 refs;
+  struct btrfs_key drop_progress;
+  btrfs_u8 drop_level;
+  btrfs_u8 level;
+} __attribute__ ((packed));
+
+/* followed by the name, NAME_LEN bytes, and DATA_LEN more */
+struct btrfs_dir_item
+{
+  struct btrfs_key location;
+  btrfs_u64 transid;
+  btrfs_u16 data_len;
+  btrfs_u16 name_len;
+  btrfs_u8 type;
+} __attribute__ ((packed));
+
+/* An inline extent has its data right after TYPE, in place of the
+   rest.  */
+struct btrfs_file_extent_item
+{
+  btrfs_u64 generation;
+  btrfs_u64 ram_bytes;
+  btrfs_u8 compression;
+  btrfs_u8 encryption;
+  btrfs_u16 other_encoding;
+  btrfs_u8 type;
+  btrfs_u64 disk_bytenr;
+  btrfs_u64 disk_num_bytes;
+  btrfs_u64 offset;
+  btrfs_u64 num_bytes;
+} __attribute__ ((packed));
+
+#define BTRFS_FILE_EXTENT_INLINE_DATA	21	/* offset of inline data */
@@ -27,6 +27,8 @@
 #include <shared.h>
 #include <filesys.h>
 #include <term.h>
+#include <bootlog.h>
+#include <bootprof.h>
 
 #ifdef SUPPORT_NETBOOT
 # define GRUB	1
@@ -49,6 +51,10 @@
 # include <md5.h>
 #endif
 
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+# include <grub/efi/efi.h>
+#endif
+
 /* The type of kernel loaded.  */
 kernel_t kernel_type;
 /* The boot device.  */
@@ -80,6 +86,8 @@ int grub_timeout = -1;
 int show_menu = 1;
 /* The BIOS drive map.  */
 static unsigned short bios_drive_map[DRIVE_MAP_SIZE + 1];
+/* The kilobytes of the read cache of the int13 handler, or 0.  */
+static int int13_cache_kb;
 
 /* Prototypes for allowing straightfoward calling of builtins functions
    inside other functions.  */
@@ -189,20 +197,19 @@ static struct {
 /* Collect contiguous blocks into one entry as many as possible,
    and print the blocklist notation on the screen.  */
 static void
-blocklist_read_helper (int sector, int offset, int length)
+blocklist_add_sector (int sector, int offset, int length, int sector_size)
 {
   int *start_sector = &blocklist_func_context.start_sector;
   int *num_sectors = &blocklist_func_context.num_sectors;
   int *num_entries = &blocklist_func_context.num_entries;
   int *last_length = &blocklist_func_context.last_length;
-  int sector_size = get_sector_size(current_drive);
 
   if (*num_sectors > 0)
   {
     if (*start_sector + *num_sectors == sector
       && offset == 0 && *last_length == sector_size)
     {
-      *num_sectors++;
+      (*num_sectors)++;
       *last_length = length;
       return;
     }
@@ -210,16 +217,16 @@ blocklist_read_helper (int sector, int offset, int length)
     {
       if (*last_length == sector_size)
         grub_printf ("%s%d+%d", *num_entries ? "," : "",
-          *start_sector - part_start, *num_sectors);
+          (int) (*start_sector - part_start), *num_sectors);
       else if (*num_sectors > 1)
         grub_printf ("%s%d+%d,%d[0-%d]", *num_entries ? "," : "",
-          *start_sector - part_start, *num_sectors-1,
-          *start_sector + *num_sectors-1 - part_start, 
+          (int) (*start_sector - part_start), *num_sectors-1,
+          (int) (*start_sector + *num_sectors-1 - part_start),
           *last_length);
       else
         grub_printf ("%s%d[0-%d]", *num_entries ? "," : "",
-          *start_sector - part_start, *last_length);
-      *num_entries++;
+          (int) (*start_sector - part_start), *last_length);
+      (*num_entries)++;
       *num_sectors = 0;
     }
   }
@@ -227,8 +234,8 @@ blocklist_read_helper (int sector, int offset, int length)
   if (offset > 0)
   {
     grub_printf("%s%d[%d-%d]", *num_entries ? "," : "",
-          sector-part_start, offset, offset+length);
-    *num_entries++;
+          (int) (sector - part_start), offset, offset+length);
+    (*num_entries)++;
   }
   else
   {
@@ -238,6 +245,51 @@ blocklist_read_helper (int sector, int offset, int length)
   }
 }
 
+/* Add LENGTH bytes from OFFSET in SECTOR, which may span many sectors
+   as DISK_READ_MAP_ONLY tells them, a sector at a time.  The whole
+   sectors which carry on the run being collected are only counted.  */
+static void
+blocklist_read_helper (int sector, int offset, int length)
+{
+  int *start_sector = &blocklist_func_context.start_sector;
+  int *num_sectors = &blocklist_func_context.num_sectors;
+  int *last_length = &blocklist_func_context.last_length;
+  int sector_bits = get_sector_bits (current_drive);
+  int sector_size = 1 << sector_bits;
+
+  /* A hole is on no sector.  */
+  if (sector < 0)
+    return;
+
+  sector += offset >> sector_bits;
+  offset &= sector_size - 1;
+
+  while (length > 0)
+    {
+      int n = sector_size - offset;
+
+      if (n > length)
+	n = length;
+
+      if (n == sector_size && *num_sectors > 0
+	  && *start_sector + *num_sectors == sector
+	  && *last_length == sector_size)
+	{
+	  int count = length >> sector_bits;
+
+	  *num_sectors += count;
+	  sector += count;
+	  length -= count << sector_bits;
+	  continue;
+	}
+
+      blocklist_add_sector (sector, offset, n, sector_size);
+      sector++;
+      offset = 0;
+      length -= n;
+    }
+}
+
 /* blocklist */
 static int
 blocklist_func (char *arg, int flags)
@@ -247,9 +299,19 @@ blocklist_func (char *arg, int flags)
   int *start_sector = &blocklist_func_context.start_sector;
   int *num_sectors = &blocklist_func_context.num_sectors;
   int *num_entries = &blocklist_func_context.num_entries;
+  int opened;
 
-  /* Open the file.  */
-  if (! grub_open (arg))
+  *num_sectors = *num_entries = 0;
+
+  /* Open the file, whose blocks are wanted as they are on the disk.  */
+#ifndef NO_DECOMPRESSION
+  no_decompression = 1;
+#endif
+  opened = grub_open (arg);
+#ifndef NO_DECOMPRESSION
+  no_decompression = 0;
+#endif
+  if (! opened)
     return 1;
 
   /* Print the device name.  */
@@ -265,8 +327,10 @@ blocklist_func (char *arg, int flags)
   
   grub_printf (")");
 
-  /* Read in the whole file to DUMMY.  */
+  /* Let the file system tell where the whole file is, but read
+     nothing of it into DUMMY.  */
   disk_read_hook = blocklist_read_helper;
+  disk_read_map_only = 1;
   if (! grub_read (dummy, -1))
     goto fail;
 
@@ -274,11 +338,12 @@ blocklist_func (char *arg, int flags)
    * full sector, since it doesn't matter if we read too much. */
   if (*num_sectors > 0)
     grub_printf ("%s%d+%d", *num_entries ? "," : "",
-		 *start_sector - part_start, *num_sectors);
+		 (int) (*start_sector - part_start), *num_sectors);
 
   grub_printf ("\n");
   
  fail:
+  disk_read_map_only = 0;
   disk_read_hook = 0;
   grub_close ();
   return errnum;
@@ -320,6 +385,11 @@ boot_func (char *arg, int flags)
   /* Shut down the networking.  */
   cleanup_net ();
 #endif
+
+#if ! defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  /* The kernel starts the other processors its own way.  */
+  grub_mp_fini ();
+#endif
   
   switch (kernel_type)
     {
@@ -345,8 +415,12 @@ boot_func (char *arg, int flags)
       /* Chainloader */
       
       /* Check if we should set the int13 handler.  */
-      if (bios_drive_map[0] != 0)
+      if (bios_drive_map[0] != 0 || int13_cache_kb)
 	{
+#if ! defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+	  unsigned long area;
+	  unsigned short disks = 0;
+#endif
 	  int i;
 	  
 	  /* Search for SAVED_DRIVE.  */
@@ -362,8 +436,20 @@ boot_func (char *arg, int flags)
 		}
 	    }
 	  
+	  /* The disks must be asked about before the handler is there.  */
+#if ! defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+	  if (int13_cache_kb)
+	    disks = int13_cache_disks ();
+#endif
+
 	  /* Set the handler. This is somewhat dangerous.  */
-	  set_int13_handler (bios_drive_map);
+#if ! defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+	  area = set_int13_handler (bios_drive_map, int13_cache_kb);
+	  if (int13_cache_kb)
+	    int13_cache_fill (area, int13_cache_kb, disks);
+#else
+	  set_int13_handler (bios_drive_map, int13_cache_kb);
+#endif
 	}
       
       gateA20 (0);
@@ -448,24 +534,81 @@ static struct builtin builtin_bootp =
 };
 #endif /* SUPPORT_NETBOOT */
 
+
+/* bootlog */
+static int
+bootlog_func (char *arg, int flags)
+{
+  if (grub_memcmp (arg, "--quiet", 7) == 0)
+    bootlog_console = 0;
+  else if (grub_memcmp (arg, "--console", 9) == 0)
+    bootlog_console = 1;
+  else if (*arg)
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+  else
+    bootlog_print ();
+
+  return 0;
+}
+
+static struct builtin builtin_bootlog =
+{
+  "bootlog",
+  bootlog_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "bootlog [--quiet | --console]",
+  "Show the messages of the verbose and the debug mode so far. If"
+  " --quiet is given, only keep them in memory from now on, and hand"
+  " them to the OS on EFI; if --console is given, show them as well,"
+  " as they are by default."
+};
+
+
+/* bootprof */
+static int
+bootprof_func (char *arg, int flags)
+{
+  bootprof_print ();
+  return 0;
+}
+
+static struct builtin builtin_bootprof =
+{
+  "bootprof",
+  bootprof_func,
+  BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+  "bootprof",
+  "Show when the boot got to each command and file so far, and how long"
+  " the files took to read and to decompress."
+};
+
 
 /* cat */
+/* How much of the file cat reads at a time.  */
+#define CAT_CHUNK	0x10000
+
 static int
 cat_func (char *arg, int flags)
 {
-  char c;
+  /* Where the kernels are loaded, which cmp takes as well.  */
+  char *buf = (char *) RAW_ADDR (0x100000);
+  int len, i;
 
   if (! grub_open (arg))
     return 1;
 
-  while (grub_read (&c, 1))
+  while ((len = grub_read (buf, CAT_CHUNK)) > 0)
     {
       /* Because running "cat" with a binary file can confuse the terminal,
 	 print only some characters as they are.  */
-      if (grub_isspace (c) || (c >= ' ' && c <= '~'))
-	grub_putchar (c);
-      else
-	grub_putchar ('?');
+      for (i = 0; i < len; i++)
+	if (! grub_isspace (buf[i]) && (buf[i] < ' ' || buf[i] > '~'))
+	  buf[i] = '?';
+
+      grub_putmem (buf, len);
     }
   
   grub_close ();
@@ -560,6 +703,34 @@ static struct builtin builtin_chainloader =
 };
 
 
+/* How much of each file cmp reads at a time.  On EFI, the pieces are
+   in pages of the firmware, as the scratch memory is too small.  */
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+# define CMP_CHUNK	0x400000
+#else
+# define CMP_CHUNK	0x100000
+#endif
+
+/* Read LEN bytes from POS in FILE into BUF.  Only one file can be open
+   at a time, so FILE is opened again for each piece; a compressed file
+   is decompressed up to POS each time.  */
+static int
+cmp_read (char *file, int pos, char *buf, int len)
+{
+  int ret;
+
+  if (! grub_open (file))
+    return 0;
+
+  grub_seek (pos);
+  ret = grub_read (buf, len) == len;
+  grub_close ();
+
+  if (! ret && ! errnum)
+    errnum = ERR_FILELENGTH;
+  return ret;
+}
+
 /* This function could be used to debug new filesystem code. Put a file
    in the new filesystem and the same file in a well-tested filesystem.
    Then, run "cmp" with the files. If no output is obtained, probably
@@ -572,7 +743,7 @@ cmp_func (char *arg, int flags)
   char *file1, *file2;
   /* The addresses.  */
   char *addr1, *addr2;
-  int i;
+  int pos, len, i;
   /* The size of the file.  */
   int size;
 
@@ -589,53 +760,67 @@ cmp_func (char *arg, int flags)
   nul_terminate (file1);
   nul_terminate (file2);
 
-  /* Read the whole data from FILE1.  */
-  addr1 = (char *) RAW_ADDR (0x100000);
+  /* Get the sizes.  */
   if (! grub_open (file1))
     return 1;
-  
-  /* Get the size.  */
   size = filemax;
-  if (grub_read (addr1, -1) != size)
-    {
-      grub_close ();
-      return 1;
-    }
-  
   grub_close ();
 
-  /* Read the whole data from FILE2.  */
-  addr2 = addr1 + size;
   if (! grub_open (file2))
     return 1;
+  grub_close ();
 
   /* Check if the size of FILE2 is equal to the one of FILE2.  */
   if (size != filemax)
     {
       grub_printf ("Differ in size: 0x%x [%s], 0x%x [%s]\n",
 		   size, file1, filemax, file2);
-      grub_close ();
       return 0;
     }
-  
-  if (! grub_read (addr2, -1))
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  addr1 = grub_efi_allocate_pages (0, 2 * (CMP_CHUNK >> 12));
+  if (! addr1)
     {
-      grub_close ();
+      errnum = ERR_WONT_FIT;
       return 1;
     }
-  
-  grub_close ();
+#else
+  addr1 = (char *) RAW_ADDR (0x100000);
+#endif
+  addr2 = addr1 + CMP_CHUNK;
 
-  /* Now compare ADDR1 with ADDR2.  */
-  for (i = 0; i < size; i++)
+  /* Compare a piece of FILE1 with the same of FILE2 at a time, a word
+     at a time up to each difference.  */
+  for (pos = 0; pos < size; pos += len)
     {
-      if (addr1[i] != addr2[i])
-	grub_printf ("Differ at the offset %d: 0x%x [%s], 0x%x [%s]\n",
-		     i, (unsigned) addr1[i], file1,
-		     (unsigned) addr2[i], file2);
+      len = size - pos;
+      if (len > CMP_CHUNK)
+	len = CMP_CHUNK;
+
+      if (! cmp_read (file1, pos, addr1, len)
+	  || ! cmp_read (file2, pos, addr2, len))
+	break;
+
+      for (i = 0; i < len; i++)
+	{
+	  while (i + (int) sizeof (unsigned long) <= len
+		 && (*(unsigned long *) (addr1 + i)
+		     == *(unsigned long *) (addr2 + i)))
+	    i += sizeof (unsigned long);
+
+	  if (i < len && addr1[i] != addr2[i])
+	    grub_printf ("Differ at the offset %d: 0x%x [%s], 0x%x [%s]\n",
+			 pos + i, (unsigned) (unsigned char) addr1[i], file1,
+			 (unsigned) (unsigned char) addr2[i], file2);
+	}
     }
-  
-  return 0;
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  grub_efi_free_pages ((grub_addr_t) addr1, 2 * (CMP_CHUNK >> 12));
+#endif
+
+  return errnum != 0;
 }
 
 static struct builtin builtin_cmp =
@@ -778,6 +963,77 @@ static struct builtin builtin_color =
   " But only the first eight names can be used for BG. You can prefix"
   " \"blink-\" to FG if you want a blinking foreground color."
 };
+
+#ifdef GRUB_UTIL
+/* compilemenu FROM TO */
+static int
+compilemenu_func (char *arg, int flags)
+{
+  char *from, *to;
+  unsigned long header[2];
+  char line[MAX_CMDLINE];
+  FILE *fp;
+  int i;
+
+  from = arg;
+  to = skip_to (0, arg);
+  if (! *from || ! *to)
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+
+  nul_terminate (from);
+  nul_terminate (to);
+
+  if (! grub_open (from))
+    return 1;
+
+  fp = fopen (to, "w");
+  if (! fp)
+    {
+      grub_close ();
+      errnum = ERR_WRITE;
+      return 1;
+    }
+
+  header[0] = filemax;
+  header[1] = filemtime;
+  fputs (COMPILED_MENU_MAGIC, fp);
+  for (i = 0; i < 8; i++)
+    fputc ((header[i / 4] >> ((i % 4) * 8)) & 0xff, fp);
+
+  while (get_line_from_config (line, NEW_HEAPSIZE, 1))
+    {
+      fputs (line, fp);
+      fputc (0, fp);
+    }
+  fputc (0, fp);
+
+  grub_close ();
+  if (ferror (fp) | fclose (fp))
+    {
+      errnum = ERR_WRITE;
+      return 1;
+    }
+
+  return errnum != ERR_NONE;
+}
+
+static struct builtin builtin_compilemenu =
+  {
+    "compilemenu",
+    compilemenu_func,
+    BUILTIN_CMDLINE,
+    "compilemenu FROM TO",
+    "Compile the config file FROM to the file TO, which is read instead"
+    " of FROM for as long as FROM keeps its size and modification time,"
+    " or only its size over the network. FROM must be a GRUB file and TO"
+    " must be an OS file, named as FROM with \".compiled\" added to be"
+    " found."
+  };
+#endif /* GRUB_UTIL */
+
 
 /* configfile */
 static int
@@ -819,6 +1075,43 @@ static struct builtin builtin_configfile =
   "Load FILE as the configuration file."
 };
 
+
+#ifndef NO_DECOMPRESSION
+/* crccheck [on|off] */
+static int
+crccheck_func (char *arg, int flags)
+{
+  /* If ARG is empty, toggle the flag.  */
+  if (! *arg)
+    gzip_check_crc = ! gzip_check_crc;
+  else if (grub_memcmp (arg, "on", 2) == 0)
+    gzip_check_crc = 1;
+  else if (grub_memcmp (arg, "off", 3) == 0)
+    gzip_check_crc = 0;
+  else
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+
+  grub_printf (" CRC checking of gzip files is now %s\n",
+	       gzip_check_crc ? "on" : "off");
+  return 0;
+}
+
+static struct builtin builtin_crccheck =
+{
+  "crccheck",
+  crccheck_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "crccheck [FLAG]",
+  "Toggle checking the CRC of gzip compressed files as they are read"
+  " with no argument. If FLAG is given and its value is `on', turn on"
+  " the checking. If FLAG is `off', turn it off. A file which fails"
+  " is reported as corrupt once its end is read."
+};
+#endif /* ! NO_DECOMPRESSION */
+
 
 /* debug */
 static int
@@ -954,6 +1247,10 @@ device_func (char *arg, int flags)
 
   assign_device_name (current_drive, device);
 
+  /* The drive numbers may refer to other disks now.  */
+  buf_drive = -1;
+  disk_cache_invalidate (-1);
+
   return 0;
 }
 
@@ -979,6 +1276,31 @@ static struct builtin builtin_efimap =
 };
 #endif /* PLATFORM_EFI */
 
+#if defined(PLATFORM_EFI) && defined(EFI_CALL_TRACE)
+/* efitrace */
+static int
+efitrace_func (char *arg, int flags)
+{
+  if (grub_memcmp (arg, "--reset", 7) == 0)
+    grub_efi_trace_reset ();
+  else
+    grub_efi_trace_print ();
+
+  return 0;
+}
+
+static struct builtin builtin_efitrace =
+{
+  "efitrace",
+  efitrace_func,
+  BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+  "efitrace [--reset]",
+  "Show how many times each firmware service was called, how long the"
+  " calls took, and how many calls took each length of time. If the"
+  " option `--reset' is given, forget the calls so far instead."
+};
+#endif /* PLATFORM_EFI && EFI_CALL_TRACE */
+
 
 #ifdef SUPPORT_NETBOOT
 /* dhcp */
@@ -999,6 +1321,57 @@ static struct builtin builtin_dhcp =
 };
 #endif /* SUPPORT_NETBOOT */
 
+
+/* diskcache */
+static int
+diskcache_func (char *arg, int flags)
+{
+  if (grub_memcmp (arg, "--flush", 7) == 0)
+    {
+      disk_cache_invalidate (-1);
+      disk_cache_hits = disk_cache_misses = 0;
+      arg = skip_to (0, arg);
+    }
+
+  if (*arg)
+    {
+      int size;
+
+      if (! safe_parse_maxint (&arg, &size))
+	return 1;
+
+      if (size < 0 || size > DISK_CACHE_MAX)
+	{
+	  errnum = ERR_BAD_ARGUMENT;
+	  return 1;
+	}
+
+      /* Entries beyond the new size must not be found later.  */
+      disk_cache_invalidate (-1);
+      disk_cache_size = size;
+    }
+
+  if (flags & BUILTIN_CMDLINE)
+    grub_printf (" Disk cache: %d of %d blocks of %d bytes, "
+		 "%lu hits, %lu misses\n",
+		 disk_cache_size, DISK_CACHE_MAX, DISK_CACHE_BLOCKLEN,
+		 disk_cache_hits, disk_cache_misses);
+
+  return 0;
+}
+
+static struct builtin builtin_diskcache =
+{
+  "diskcache",
+  diskcache_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "diskcache [--flush] [BLOCKS]",
+  "Show the statistics of the disk cache, or set the number of blocks"
+  " it may use to BLOCKS. A size of 0 disables the cache. If you"
+  " specify the option `--flush', the cached blocks and the statistics"
+  " are discarded first."
+};
+
 static int terminal_func (char *arg, int flags);
 
 #ifdef SUPPORT_GRAPHICS
@@ -1050,6 +1423,63 @@ static struct builtin builtin_splashimage =
   "Load FILE as the background image when in graphics mode."
 };
 
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+/* graphicsmode */
+static int
+graphicsmode_func (char *arg, int flags)
+{
+  int policy, width = 0, height = 0, budget = 0;
+  char *p = arg;
+
+  if (grub_memcmp (arg, "native", 6) == 0)
+    policy = GRAPHICS_MODE_NATIVE;
+  else if (grub_memcmp (arg, "fast", 4) == 0)
+    {
+      policy = GRAPHICS_MODE_FAST;
+      p = skip_to (0, arg);
+      if (*p && (! safe_parse_maxint (&p, &budget) || budget <= 0))
+	{
+	  errnum = ERR_BAD_ARGUMENT;
+	  return 1;
+	}
+    }
+  else
+    {
+      policy = GRAPHICS_MODE_SIZE;
+      if (! safe_parse_maxint (&p, &width) || *p++ != 'x'
+	  || ! safe_parse_maxint (&p, &height) || ! width || ! height)
+	{
+	  errnum = ERR_BAD_ARGUMENT;
+	  return 1;
+	}
+    }
+
+  if (flags == BUILTIN_CMDLINE && graphics_inited)
+    {
+      graphics_end ();
+      graphics_set_mode_policy (policy, width, height, budget);
+      graphics_init ();
+      graphics_cls ();
+    }
+  else
+    graphics_set_mode_policy (policy, width, height, budget);
+
+  return 0;
+}
+
+static struct builtin builtin_graphicsmode =
+{
+  "graphicsmode",
+  graphicsmode_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "graphicsmode native | fast [MS] | WIDTHxHEIGHT",
+  "Choose how the graphics mode is picked: the best the firmware"
+  " offers, the largest that can redraw the screen within MS"
+  " milliseconds (50 by default), or the one of WIDTH by HEIGHT pixels."
+  " The mode picked is remembered for the next boot."
+};
+#endif /* PLATFORM_EFI && ! GRUB_UTIL */
+
 
 /* foreground */
 static int
@@ -1285,7 +1715,7 @@ static struct builtin builtin_dump =
   };
 #endif /* GRUB_UTIL */
 
-#ifndef PLATFORM_EFI
+#if ! defined(PLATFORM_EFI) && ! defined(NO_SETUP_COMMANDS)
 
 static char embed_info[32];
 /* embed */
@@ -1406,7 +1836,7 @@ embed_func (char *arg, int flags)
     return 1;
   
   grub_printf (" %d sectors are embedded.\n", size);
-  grub_sprintf (embed_info, "%d+%d", sector - part_start, size);
+  grub_sprintf (embed_info, "%d+%d", (int) (sector - part_start), size);
   return 0;
 }
 
@@ -1420,7 +1850,7 @@ static struct builtin builtin_embed =
   " is a drive, or in the \"bootloader\" area if DEVICE is a FFS partition."
   " Print the number of sectors which STAGE1_5 occupies if successful."
 };
-#endif /* ! PLATFORM_EFI */
+#endif /* ! PLATFORM_EFI && ! NO_SETUP_COMMANDS */
 
 
 /* fallback */
@@ -1511,7 +1941,8 @@ find_func (char *arg, int flags)
   for (drive = 0x80; drive < (0x80 + MAX_HD_NUM); drive++)
     {
       unsigned long part = 0xFFFFFF;
-      unsigned long start, len, offset, ext_offset, gpt_offset;
+      unsigned long offset, ext_offset, gpt_offset;
+      sector_t start, len;
       int type, entry, gpt_count, gpt_size;
       int sector_size = get_sector_size(drive);
       char buf[sector_size];
@@ -1526,6 +1957,7 @@ find_func (char *arg, int flags)
 	      && ! IS_PC_SLICE_TYPE_BSD (type)
 	      && ! IS_PC_SLICE_TYPE_EXTENDED (type))
 	    {
+	      probe_ahead (drive, part);
 	      current_partition = part;
 	      if (open_device ())
 		{
@@ -1600,6 +2032,7 @@ findiso_func (char *arg, int flags)
       if (drive == 0x88)
 	  drive = 0x100;
 
+      probe_ahead (drive, part);
       current_drive = drive;
       current_partition = part;
 
@@ -1731,14 +2164,16 @@ geometry_func (char *arg, int flags)
 #ifdef GRUB_UTIL
   msg = device_map[current_drive];
 #else
-  if (geom.flags & BIOSDISK_FLAG_LBA_EXTENSION)
+  if (geom.flags & BIOSDISK_FLAG_FLAT_ADDRESS)
+    msg = "LBA, flat addressing";
+  else if (geom.flags & BIOSDISK_FLAG_LBA_EXTENSION)
     msg = "LBA";
   else
     msg = "CHS";
 #endif
 
   grub_printf ("drive 0x%x: C/H/S = %d/%d/%d, "
-	       "The number of sectors = %d, %s\n",
+	       "The number of sectors = %llu, %s\n",
 	       current_drive,
 	       geom.cylinders, geom.heads, geom.sectors,
 	       geom.total_sectors, msg);
@@ -1958,12 +2393,41 @@ static struct builtin builtin_hide =
 };
 
 
+#ifdef SUPPORT_NETBOOT
+/* httpserver */
+static int
+httpserver_func (char *arg, int flags)
+{
+  if (! *arg || ! http_server (arg))
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+
+  print_network_configuration ();
+  return 0;
+}
+
+static struct builtin builtin_httpserver =
+{
+  "httpserver",
+  httpserver_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "httpserver IPADDR[:PORT] | off",
+  "Fetch the files of the network drive from the HTTP server at IPADDR,"
+  " on PORT or 80, instead of the TFTP server. If the argument is `off',"
+  " use the TFTP server again."
+};
+#endif /* SUPPORT_NETBOOT */
+
+
 #ifdef SUPPORT_NETBOOT
 /* ifconfig */
 static int
 ifconfig_func (char *arg, int flags)
 {
   char *svr = 0, *ip = 0, *gw = 0, *sm = 0;
+  int vlan = -1;
   
   if (! eth_probe ())
     {
@@ -1982,6 +2446,16 @@ ifconfig_func (char *arg, int flags)
 	gw = arg + sizeof ("--gateway=") - 1;
       else if (! grub_memcmp ("--mask=", arg, sizeof("--mask=") - 1))
 	sm = arg + sizeof ("--mask=") - 1;
+      else if (! grub_memcmp ("--vlan=", arg, sizeof ("--vlan=") - 1))
+	{
+	  char *p = arg + sizeof ("--vlan=") - 1;
+
+	  if (! safe_parse_maxint (&p, &vlan) || vlan < 0 || vlan > 4094)
+	    {
+	      errnum = ERR_BAD_ARGUMENT;
+	      return 1;
+	    }
+	}
       else
 	{
 	  errnum = ERR_BAD_ARGUMENT;
@@ -1996,6 +2470,9 @@ ifconfig_func (char *arg, int flags)
       errnum = ERR_BAD_ARGUMENT;
       return 1;
     }
+
+  if (vlan >= 0)
+    vlan_id = vlan;
   
   print_network_configuration ();
   return 0;
@@ -2006,9 +2483,11 @@ static struct builtin builtin_ifconfig =
   "ifconfig",
   ifconfig_func,
   BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
-  "ifconfig [--address=IP] [--gateway=IP] [--mask=MASK] [--server=IP]",
+  "ifconfig [--address=IP] [--gateway=IP] [--mask=MASK] [--server=IP]"
+  " [--vlan=ID]",
   "Configure the IP address, the netmask, the gateway and the server"
-  " address or print current network configuration."
+  " address or print current network configuration. With --vlan, send"
+  " and take 802.1Q frames of the VLAN ID, or untagged ones if ID is 0."
 };
 #endif /* SUPPORT_NETBOOT */
 
@@ -2038,7 +2517,7 @@ static struct builtin builtin_impsprobe =
   "impsprobe",
   "Probe the Intel Multiprocessor Specification 1.1 or 1.4"
   " configuration table and boot the various CPUs which are found into"
-  " a tight loop."
+  " a tight loop, where they wait for work until a kernel is booted."
 };
 #endif /* ! PLATFORM_EFI */
 
@@ -2068,12 +2547,17 @@ static struct builtin builtin_initrd =
   "initrd",
   initrd_func,
   BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
-  "initrd FILE [ARG ...]",
+  "initrd FILE [FILE ...]",
   "Load an initial ramdisk FILE for a Linux format boot image and set the"
-  " appropriate parameters in the Linux setup area in memory."
+  " appropriate parameters in the Linux setup area in memory. Several"
+  " FILEs are loaded one after another as a single ramdisk. Among them,"
+  " --cpio=PATH=FILE puts FILE as PATH into a cpio archive made in"
+  " memory and loaded last, and --cpio-line=PATH=TEXT a line of TEXT."
 };
 
 #ifndef PLATFORM_EFI
+
+#ifndef NO_SETUP_COMMANDS
 
 /* install */
 static struct {
@@ -2109,6 +2593,41 @@ install_savesect_helper(int sector, int offset, int length)
 
 /* Write SECTOR to INSTALLLIST, and update INSTALLADDR and  INSTALLSECT.  */
 /* Formerly disk_read_blocklist_func with local scope inside install_func */
+static void install_blocklist_helper (int sector, int offset, int length);
+
+#ifdef GRUB_UTIL
+/* The sectors of Stage 2 as the host tells them, which reading it is
+   checked against with --verify-blocklists.  */
+#define HOST_SECTORS_MAX	0x2000
+
+static int host_sectors[HOST_SECTORS_MAX];
+static int host_sectors_count, host_sectors_pos;
+
+static void
+host_record_helper (int sector, int offset, int length)
+{
+  if (host_sectors_count == HOST_SECTORS_MAX)
+    {
+      errnum = ERR_WONT_FIT;
+      return;
+    }
+
+  host_sectors[host_sectors_count++] = sector;
+}
+
+static void
+host_check_helper (int sector, int offset, int length)
+{
+  if (host_sectors_pos >= host_sectors_count
+      || host_sectors[host_sectors_pos] != sector)
+    host_sectors_pos = -1;
+  else if (host_sectors_pos >= 0)
+    host_sectors_pos++;
+
+  install_blocklist_helper (sector, offset, length);
+}
+#endif /* GRUB_UTIL */
+
 static void
 install_blocklist_helper (int sector, int offset, int length)
 {
@@ -2392,6 +2911,33 @@ install_func (char *arg, int flags)
   grub_seek (SECTOR_SIZE);
 
   disk_read_hook = install_blocklist_helper;
+#ifdef GRUB_UTIL
+  /* If Stage 2 is known under the OS, the host can tell where it is,
+     which saves reading all of it through the file system.  */
+  host_sectors_count = host_sectors_pos = 0;
+  if (stage2_os_file
+      && get_file_sectors (device_map, src_drive, src_partition,
+			   src_part_start, stage2_os_file, SECTOR_SIZE,
+			   (verify_blocklists
+			    ? host_record_helper : install_blocklist_helper)))
+    {
+      if (errnum)
+	goto fail;
+
+      if (verify_blocklists)
+	{
+	  disk_read_hook = host_check_helper;
+	  if (! grub_read (dummy, -1))
+	    goto fail;
+
+	  if (host_sectors_pos != host_sectors_count)
+	    grub_printf ("Warning: the host tells other sectors for %s than"
+			 " its file system, whose are used.\n",
+			 stage2_os_file);
+	}
+    }
+  else
+#endif /* GRUB_UTIL */
   if (! grub_read (dummy, -1))
     goto fail;
   
@@ -2592,13 +3138,25 @@ install_func (char *arg, int flags)
       if (! open_partition ())
 	goto fail;
 
-      if (! devwrite (stage2_first_sector - src_part_start, 1,
-		      *stage2_first_buffer))
-	goto fail;
+      /* The two are usually next to each other, on the disk as in
+	 memory, and then go with one write.  */
+      if (stage2_second_sector == stage2_first_sector + 1
+	  && stage2_second_buffer == *stage2_first_buffer + SECTOR_SIZE)
+	{
+	  if (! devwrite (stage2_first_sector - src_part_start, 2,
+			  *stage2_first_buffer))
+	    goto fail;
+	}
+      else
+	{
+	  if (! devwrite (stage2_first_sector - src_part_start, 1,
+			  *stage2_first_buffer))
+	    goto fail;
 
-      if (! devwrite (stage2_second_sector - src_part_start, 1,
-		      stage2_second_buffer))
-	goto fail;
+	  if (! devwrite (stage2_second_sector - src_part_start, 1,
+			  stage2_second_buffer))
+	    goto fail;
+	}
     }
   
   /* Write the modified sector of Stage 1 to the disk.  */
@@ -2643,6 +3201,7 @@ static struct builtin builtin_install =
   " for LBA mode. If the option `--stage2' is specified, rewrite the Stage"
   " 2 via your OS's filesystem instead of the raw device."
 };
+#endif /* ! NO_SETUP_COMMANDS */
 
 
 /* ioprobe */
@@ -2663,30 +3222,89 @@ ioprobe_func (char *arg, int flags)
   if (errnum)
     return 1;
 
-  /* Clean out IO_MAP.  */
-  grub_memset ((char *) io_map, 0, IO_MAP_SIZE * sizeof (unsigned short));
+  /* Clean out IO_MAP.  */
+  grub_memset ((char *) io_map, 0, IO_MAP_SIZE * sizeof (unsigned short));
+
+  /* Track the int13 handler.  */
+  track_int13 (current_drive);
+  
+  /* Print out the result.  */
+  for (port = io_map; *port != 0; port++)
+    grub_printf (" 0x%x", (unsigned int) *port);
+
+  return 0;
+  
+#endif /* ! GRUB_UTIL */
+}
+
+static struct builtin builtin_ioprobe =
+{
+  "ioprobe",
+  ioprobe_func,
+  BUILTIN_CMDLINE,
+  "ioprobe DRIVE",
+  "Probe I/O ports used for the drive DRIVE."
+};
+#endif /* ! PLATFORM_EFI */
+
+
+/* iostat */
+static void
+iostat_print (const char *name, struct iostat *st, unsigned long long per_ms)
+{
+  grub_printf (" %s: %lu reads, %llu bytes; %lu disk reads, %llu bytes;"
+	       " %lu cache hits; %llu bytes copied",
+	       name, st->rawreads, st->bytes, st->disk_reads, st->disk_bytes,
+	       st->cache_hits, st->moved);
+  if (per_ms)
+    {
+      unsigned long long tenths = st->cycles * 10 / per_ms;
+
+      grub_printf ("; %llu.%llu ms", tenths / 10, tenths % 10);
+    }
+  grub_printf ("\n");
+}
+
+static int
+iostat_func (char *arg, int flags)
+{
+  unsigned long long per_ms;
+  int i;
+
+  if (grub_memcmp (arg, "--reset", 7) == 0)
+    {
+      iostat_reset ();
+      return 0;
+    }
+
+  per_ms = bootprof_cycles_per_ms ();
+  iostat_print ("total", &iostat_total, per_ms);
+
+  for (i = 0; i <= NUM_FSYS; i++)
+    if (iostat_fsys[i].rawreads)
+      iostat_print (i < NUM_FSYS ? fsys_table[i].name : "no filesystem",
+		    &iostat_fsys[i], per_ms);
+
+  for (i = 0; i < iostat_file_count; i++)
+    iostat_print (iostat_files[i].name, &iostat_files[i].stat, per_ms);
 
-  /* Track the int13 handler.  */
-  track_int13 (current_drive);
-  
-  /* Print out the result.  */
-  for (port = io_map; *port != 0; port++)
-    grub_printf (" 0x%x", (unsigned int) *port);
+  if (iostat_files_dropped)
+    grub_printf (" %d more files were not counted.\n", iostat_files_dropped);
 
   return 0;
-  
-#endif /* ! GRUB_UTIL */
 }
 
-static struct builtin builtin_ioprobe =
+static struct builtin builtin_iostat =
 {
-  "ioprobe",
-  ioprobe_func,
-  BUILTIN_CMDLINE,
-  "ioprobe DRIVE",
-  "Probe I/O ports used for the drive DRIVE."
+  "iostat",
+  iostat_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "iostat [--reset]",
+  "Show how many reads of the disks were made, how many bytes they read"
+  " and copied and how long they took, in all, for each filesystem, and"
+  " for each file opened. If the option `--reset' is given, start"
+  " counting afresh instead."
 };
-#endif /* ! PLATFORM_EFI */
 
 
 /* kernel */
@@ -2735,6 +3353,11 @@ kernel_func (char *arg, int flags)
 	 has no effect.  */
       else if (grub_memcmp (arg, "--no-mem-option", 15) == 0)
 	load_flags |= KERNEL_LOAD_NO_MEM_OPTION;
+      /* If the `--no-symbols' is specified, don't load the symbol table
+	 of a Multiboot or BSD kernel, which saves reading the rest of
+	 the file.  */
+      else if (grub_memcmp (arg, "--no-symbols", 12) == 0)
+	load_flags |= KERNEL_LOAD_NO_SYMBOLS;
       else
 	break;
 
@@ -2755,6 +3378,9 @@ kernel_func (char *arg, int flags)
   /* Copy the command-line to MB_CMDLINE.  */
   grub_memmove (mb_cmdline, arg, len + 1);
   kernel_type = load_image (arg, mb_cmdline, suggested_type, load_flags);
+  /* A kernel which doesn't match the manifest is not to be booted.  */
+  if (errnum == ERR_VERIFY)
+    kernel_type = KERNEL_TYPE_NONE;
   if (kernel_type == KERNEL_TYPE_NONE)
     return 1;
 
@@ -2767,14 +3393,15 @@ static struct builtin builtin_kernel =
   "kernel",
   kernel_func,
   BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
-  "kernel [--no-mem-option] [--type=TYPE] FILE [ARG ...]",
+  "kernel [--no-mem-option] [--no-symbols] [--type=TYPE] FILE [ARG ...]",
   "Attempt to load the primary boot image from FILE. The rest of the"
   " line is passed verbatim as the \"kernel command line\".  Any modules"
   " must be reloaded after using this command. The option --type is used"
   " to suggest what type of kernel to be loaded. TYPE must be either of"
   " \"netbsd\", \"freebsd\", \"openbsd\", \"linux\", \"biglinux\" and"
   " \"multiboot\". The option --no-mem-option tells GRUB not to pass a"
-  " Linux's mem option automatically."
+  " Linux's mem option automatically. The option --no-symbols tells GRUB"
+  " not to load the symbol table of the kernel."
 };
 
 
@@ -2799,6 +3426,55 @@ static struct builtin builtin_lock =
   "lock",
   "Break a command execution unless the user is authenticated."
 };
+
+#ifndef GRUB_UTIL
+/* loopback */
+static int
+loopback_func (char *arg, int flags)
+{
+  char *drive_arg = skip_to (0, arg);
+  int drive = -1;
+
+  if (! *arg)
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+
+  if (*drive_arg)
+    {
+      if (! set_device (drive_arg))
+	return 1;
+      if (! (current_drive & 0x80) || current_partition != 0xFFFFFF)
+	{
+	  errnum = ERR_DEV_VALUES;
+	  return 1;
+	}
+      drive = current_drive;
+    }
+
+  drive = loop_setup (arg, drive);
+  if (drive < 0)
+    return 1;
+
+  if (flags & BUILTIN_CMDLINE)
+    grub_printf (" Mapped as (hd%d), in %d pieces\n", drive - 0x80,
+		 loop_extent_count ());
+  return 0;
+}
+
+static struct builtin builtin_loopback =
+{
+  "loopback",
+  loopback_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "loopback FILE [DRIVE]",
+  "Make the disk or CD image FILE the hard disk DRIVE, or the first one"
+  " there is not. Only where FILE is on its disk is looked up; its data"
+  " is read from there when the new drive is read. FILE cannot be"
+  " compressed, nor on the network."
+};
+#endif /* ! GRUB_UTIL */
   
 
 /* makeactive */
@@ -2832,6 +3508,23 @@ map_func (char *arg, int flags)
   char *from_drive;
   unsigned long to, from;
   int i;
+
+  /* The read cache of the int13 handler.  */
+  if (grub_memcmp (arg, "--cache=", sizeof ("--cache=") - 1) == 0)
+    {
+      char *p = arg + sizeof ("--cache=") - 1;
+      int kb;
+
+      if (! safe_parse_maxint (&p, &kb) || kb < 0)
+	return 1;
+      if (kb > INT13_CACHE_MAX / 2)
+	kb = INT13_CACHE_MAX / 2;
+      int13_cache_kb = kb;
+
+      arg = skip_to (0, arg);
+      if (! *arg)
+	return 0;
+    }
   
   to_drive = arg;
   from_drive = skip_to (0, arg);
@@ -2880,10 +3573,13 @@ static struct builtin builtin_map =
   "map",
   map_func,
   BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
-  "map TO_DRIVE FROM_DRIVE",
+  "map [--cache=KB] [TO_DRIVE FROM_DRIVE]",
   "Map the drive FROM_DRIVE to the drive TO_DRIVE. This is necessary"
   " when you chain-load some operating systems, such as DOS, if such an"
-  " OS resides at a non-first drive."
+  " OS resides at a non-first drive. If --cache is given, the handler"
+  " keeps up to KB kilobytes of the sectors read from the hard disks,"
+  " starting with what GRUB has read, so that the chain-loaded OS need"
+  " not read them again. 0 turns the cache off."
 };
 #endif /* ! PLATFORM_EFI */
 
@@ -2946,6 +3642,54 @@ static struct builtin builtin_md5crypt =
 };
 #endif /* USE_MD5_PASSWORDS */
 
+#ifndef GRUB_UTIL
+/* memdisk */
+static int
+memdisk_func (char *arg, int flags)
+{
+  char *drive_arg = skip_to (0, arg);
+  int drive = -1;
+
+  if (! *arg)
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+
+  if (*drive_arg)
+    {
+      if (! set_device (drive_arg))
+	return 1;
+      if (! (current_drive & 0x80) || current_partition != 0xFFFFFF)
+	{
+	  errnum = ERR_DEV_VALUES;
+	  return 1;
+	}
+      drive = current_drive;
+    }
+
+  drive = memdisk_load (arg, drive);
+  if (drive < 0)
+    return 1;
+
+  if (flags & BUILTIN_CMDLINE)
+    grub_printf (" Loaded as (hd%d)\n", drive - 0x80);
+  return 0;
+}
+
+static struct builtin builtin_memdisk =
+{
+  "memdisk",
+  memdisk_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "memdisk FILE [DRIVE]",
+  "Load the disk or CD image FILE into memory, with a single read, and"
+  " make it the hard disk DRIVE, or the first one there is not. The image"
+  " stays in memory until the next memdisk command. On BIOS, it cannot be"
+  " compressed, and the booted OS does not see it."
+};
+#endif /* ! GRUB_UTIL */
+
 #ifndef PLATFORM_EFI
 
 /* module */
@@ -3026,6 +3770,90 @@ static struct builtin builtin_modulenounzip =
 };
 #endif /* !PLATFORM_EFI */
 
+
+#ifdef PLATFORM_EFI
+/* mtftp */
+static int
+mtftp_func (char *arg, int flags)
+{
+  if (! efi_tftp_mcast (arg))
+    {
+      if (errnum != ERR_WONT_FIT)
+	errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+
+  return 0;
+}
+
+static struct builtin builtin_mtftp =
+{
+  "mtftp",
+  mtftp_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "mtftp [--listen=SECS] [FILE ADDR CPORT SPORT]",
+  "Fetch FILE from the network drive over multicast TFTP, through the"
+  " group ADDR with the client port CPORT and the server port SPORT, so"
+  " that the machines which boot it at the same time share one transfer."
+  " Listen for SECS seconds, 2 by default, for a transfer that is already"
+  " running before asking the server to start one. If the multicast"
+  " transfer fails, FILE is fetched over unicast TFTP. Without arguments,"
+  " list the files which are fetched over multicast TFTP."
+};
+#endif /* PLATFORM_EFI */
+
+
+#ifdef NET_CACHE
+/* netcache */
+static int
+netcache_func (char *arg, int flags)
+{
+  if (grub_memcmp (arg, "--flush", 7) == 0)
+    {
+      net_cache_flush ();
+      net_cache_hits = net_cache_misses = 0;
+      arg = skip_to (0, arg);
+    }
+
+  if (*arg)
+    {
+      int size;
+
+      if (! safe_parse_maxint (&arg, &size))
+	return 1;
+
+      if (size < 0 || size > 0x400000)
+	{
+	  errnum = ERR_BAD_ARGUMENT;
+	  return 1;
+	}
+
+      /* The files kept already may not fit any more.  */
+      net_cache_flush ();
+      net_cache_budget = (unsigned long) size << 10;
+    }
+
+  if (flags & BUILTIN_CMDLINE)
+    grub_printf (" Network cache: %luK of %luK, %lu hits, %lu misses\n",
+		 net_cache_used >> 10, net_cache_budget >> 10,
+		 net_cache_hits, net_cache_misses);
+
+  return 0;
+}
+
+static struct builtin builtin_netcache =
+{
+  "netcache",
+  netcache_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "netcache [--flush] [KBYTES]",
+  "Show the statistics of the cache of the files read from the network"
+  " drive, or set the memory it may use to KBYTES. A size of 0 disables"
+  " the cache. If you specify the option `--flush', the cached files and"
+  " the statistics are discarded first."
+};
+#endif /* NET_CACHE */
+
 
 /* pager [on|off] */
 static int
@@ -3058,6 +3886,7 @@ static struct builtin builtin_pager =
   " is `on', turn on the mode. If FLAG is `off', turn off the mode."
 };
 
+#ifndef NO_SETUP_COMMANDS
 
 /* partnew PART TYPE START LEN */
 static int
@@ -3137,7 +3966,7 @@ partnew_func (char *arg, int flags)
     return 1;
 
   /* Check if the new partition will fit in the disk.  */
-  if (new_start + new_len > buf_geom.total_sectors)
+  if ((sector_t) new_start + new_len > buf_geom.total_sectors)
     {
       errnum = ERR_GEOM;
       return 1;
@@ -3186,7 +4015,8 @@ parttype_func (char *arg, int flags)
 {
   int new_type;
   unsigned long part = 0xFFFFFF;
-  unsigned long start, len, offset, ext_offset, gpt_offset;
+  unsigned long offset, ext_offset, gpt_offset;
+  sector_t start, len;
   int entry, type, gpt_count, gpt_size;
 
   /* Get the drive and the partition.  */
@@ -3237,7 +4067,10 @@ parttype_func (char *arg, int flags)
 
       if (part == current_partition)
 	{
-	  /* Found.  */
+	  /* Found.  The table may have come from the partition cache,
+	     so read it for real.  */
+	  if (! rawread (current_drive, offset, 0, sector_size, mbr))
+	    return 1;
 
 	  /* Set the type to NEW_TYPE.  */
 	  PC_SLICE_TYPE (mbr, entry) = new_type;
@@ -3264,6 +4097,7 @@ static struct builtin builtin_parttype =
   "parttype PART TYPE",
   "Change the type of the partition PART to TYPE."
 };
+#endif /* ! NO_SETUP_COMMANDS */
 
 
 /* password */
@@ -3801,6 +4635,75 @@ static struct builtin builtin_savedefault =
 };
 
 
+/* search */
+static int
+search_func (char *arg, int flags)
+{
+  unsigned long drive, partition;
+  int by_label;
+  char *key;
+
+  if (! *arg)
+    {
+      fsid_print ();
+      return 0;
+    }
+
+  if (grub_memcmp (arg, "--uuid=", 7) == 0)
+    {
+      by_label = 0;
+      key = arg + 7;
+    }
+  else if (grub_memcmp (arg, "--label=", 8) == 0)
+    {
+      by_label = 1;
+      key = arg + 8;
+    }
+  else
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+  nul_terminate (key);
+
+  if (! fsid_search (key, by_label, &drive, &partition))
+    {
+      errnum = ERR_FILE_NOT_FOUND;
+      return 1;
+    }
+
+  /* Make it the root device, as root does.  */
+  current_drive = drive;
+  current_partition = partition;
+  if (! open_device () && errnum != ERR_FSYS_MOUNT)
+    return 1;
+
+  errnum = ERR_NONE;
+  saved_drive = current_drive;
+  saved_partition = current_partition;
+  bootdev = set_bootdev (0);
+  if (errnum)
+    return 1;
+
+  if (flags & BUILTIN_CMDLINE)
+    print_root_device ();
+
+  return 0;
+}
+
+static struct builtin builtin_search =
+{
+  "search",
+  search_func,
+  BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+  "search [--uuid=UUID | --label=LABEL]",
+  "Set the root device to the partition whose file system has the UUID"
+  " UUID or the label LABEL. The disks are gone through the first time"
+  " only, reading the superblocks. Without an option, list the file"
+  " systems found."
+};
+
+
 #ifdef SUPPORT_SERIAL
 /* serial */
 static int
@@ -4198,6 +5101,7 @@ static struct builtin builtin_setkey =
   " mappings."
 };
 
+#ifndef NO_SETUP_COMMANDS
 
 /* setup */
 static int
@@ -4507,6 +5411,7 @@ static struct builtin builtin_setup =
   " partition where GRUB images reside, specify the option `--stage2'"
   " to tell GRUB the file name under your OS."
 };
+#endif /* ! NO_SETUP_COMMANDS */
 #endif /* ! PLATFORM_EFI */
 
 
@@ -4743,7 +5648,9 @@ terminfo_func (char *arg, int flags)
 	  {"--cursor-address=", term.cursor_address},
 	  {"--clear-screen=", term.clear_screen},
 	  {"--enter-standout-mode=", term.enter_standout_mode},
-	  {"--exit-standout-mode=", term.exit_standout_mode}
+	  {"--exit-standout-mode=", term.exit_standout_mode},
+	  {"--insert-character=", term.insert_character},
+	  {"--delete-character=", term.delete_character}
 	};
 
       grub_memset (&term, 0, sizeof (term));
@@ -4799,6 +5706,10 @@ terminfo_func (char *arg, int flags)
 		   ti_escape_string (term.enter_standout_mode));
       grub_printf ("exit_standout_mode=%s\n",
 		   ti_escape_string (term.exit_standout_mode));
+      grub_printf ("insert_character=%s\n",
+		   ti_escape_string (term.insert_character));
+      grub_printf ("delete_character=%s\n",
+		   ti_escape_string (term.delete_character));
     }
 
   return 0;
@@ -4810,7 +5721,8 @@ static struct builtin builtin_terminfo =
   terminfo_func,
   BUILTIN_MENU | BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
   "terminfo [--name=NAME --cursor-address=SEQ [--clear-screen=SEQ]"
-  " [--enter-standout-mode=SEQ] [--exit-standout-mode=SEQ]]",
+  " [--enter-standout-mode=SEQ] [--exit-standout-mode=SEQ]"
+  " [--insert-character=SEQ] [--delete-character=SEQ]]",
   
   "Define the capabilities of your terminal. Use this command to"
   " define escape sequences, if it is not vt100-compatible."
@@ -5026,6 +5938,19 @@ tftpserver_func (char *arg, int flags)
       return 1;
     }
 
+  /* The rest are tried in turn when the first doesn't answer.  */
+  for (arg = skip_to (0, arg); *arg; arg = skip_to (0, arg))
+    {
+      in_addr addr;
+
+      if (! inet_aton (arg, &addr))
+	{
+	  errnum = ERR_BAD_ARGUMENT;
+	  return 1;
+	}
+      tftp_server_add (addr);
+    }
+
   print_network_configuration ();
   return 0;
 }
@@ -5035,8 +5960,9 @@ static struct builtin builtin_tftpserver =
   "tftpserver",
   tftpserver_func,
   BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
-  "tftpserver IPADDR",
-  "Override the TFTP server address."
+  "tftpserver IPADDR [IPADDR...]",
+  "Override the TFTP server address. The other addresses are of servers"
+  " to try in turn when one doesn't answer."
 };
 #endif /* SUPPORT_NETBOOT */
 
@@ -5250,6 +6176,163 @@ static struct builtin builtin_vbeprobe =
 #endif /* ! PLATFORM_EFI */
 
 
+/* verify */
+static int
+verify_hex (int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c = grub_tolower (c);
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* Parse LINE of a manifest, as sha256sum prints it, into ENTRY.  The
+   file name may have a device, which is left out, but must be
+   absolute.  */
+static int
+verify_parse (char *line, struct verify_entry *entry)
+{
+  int i, hi, lo;
+
+  for (i = 0; i < 32; i++)
+    {
+      hi = verify_hex (line[2 * i]);
+      lo = hi < 0 ? -1 : verify_hex (line[2 * i + 1]);
+      if (lo < 0)
+	return 0;
+      entry->digest[i] = (hi << 4) | lo;
+    }
+
+  line += 64;
+  if (! grub_isspace (*line))
+    return 0;
+  while (grub_isspace (*line))
+    line++;
+
+  /* The mark of a file read in binary mode.  */
+  if (*line == '*')
+    line++;
+  if (*line == '(')
+    {
+      while (*line && *line != ')')
+	line++;
+      if (*line)
+	line++;
+    }
+  if (*line != '/')
+    return 0;
+
+  for (i = 0; line[i] && ! grub_isspace (line[i]); i++)
+    {
+      if (i == VERIFY_NAME_LEN - 1)
+	return 0;
+      entry->name[i] = line[i];
+    }
+  entry->name[i] = 0;
+  entry->state = VERIFY_UNCHECKED;
+  entry->reread = 0;
+  return 1;
+}
+
+static int
+verify_func (char *arg, int flags)
+{
+  static char line[256];
+  int len, more, i;
+  char c, *p;
+
+  if (grub_memcmp (arg, "--off", 5) == 0)
+    {
+      verify_count = 0;
+      return 0;
+    }
+
+  if (! *arg)
+    {
+      if (! verify_count)
+	grub_printf (" No manifest has been given.\n");
+
+      for (i = 0; i < verify_count; i++)
+	{
+	  struct verify_entry *entry = verify_list + i;
+
+	  grub_printf (" %s: %s", entry->name,
+		       entry->state == VERIFY_OK ? "ok"
+		       : entry->state == VERIFY_FAILED ? "FAILED" : "not read");
+	  if (entry->reread)
+	    grub_printf (", %lu bytes read again", entry->reread);
+	  grub_printf ("\n");
+	}
+      return 0;
+    }
+
+  /* The manifest itself is not checked.  */
+  verify_count = 0;
+  if (! grub_open (arg))
+    return 1;
+
+  len = 0;
+  do
+    {
+      more = grub_read_byte (&c);
+      if (more && c != '\n')
+	{
+	  if (len < (int) sizeof (line) - 1)
+	    line[len] = c;
+	  len++;
+	  continue;
+	}
+
+      if (len >= (int) sizeof (line))
+	{
+	  errnum = ERR_BAD_ARGUMENT;
+	  break;
+	}
+      line[len] = 0;
+      len = 0;
+
+      for (p = line; grub_isspace (*p); p++)
+	;
+      if (! *p || *p == '#')
+	continue;
+
+      if (verify_count == VERIFY_FILES)
+	errnum = ERR_WONT_FIT;
+      else if (! verify_parse (p, verify_list + verify_count))
+	errnum = ERR_BAD_ARGUMENT;
+      else
+	verify_count++;
+    }
+  while (more && ! errnum);
+
+  grub_close ();
+  if (errnum)
+    {
+      verify_count = 0;
+      return 1;
+    }
+
+  grub_printf (" %d files are checked as they are read\n", verify_count);
+  return 0;
+}
+
+static struct builtin builtin_verify =
+{
+  "verify",
+  verify_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "verify [--off | MANIFEST]",
+  "Check the files listed in MANIFEST, in the format of sha256sum,"
+  " against their SHA-256 as they are read, so that for instance"
+  " `kernel' or `initrd' fails on a file which does not match. The"
+  " hash is computed as the file comes from the disk, with no second"
+  " pass over it. With no argument, show how the listed files fared."
+  " If the option `--off' is given, stop checking."
+};
+
+
 /* version */
 static int
 version_func (char *arg, int flags)
@@ -5269,7 +6352,8 @@ static struct builtin builtin_version =
 };
 
 
-/* The table of builtin commands. Sorted in dictionary order.  */
+/* The table of builtin commands. Sorted in dictionary order, which
+   find_command relies on to search it by halves.  */
 struct builtin *builtin_table[] =
 {
 #ifdef SUPPORT_GRAPHICS
@@ -5280,12 +6364,20 @@ struct builtin *builtin_table[] =
 #ifdef SUPPORT_NETBOOT
   &builtin_bootp,
 #endif /* SUPPORT_NETBOOT */
+  &builtin_bootlog,
+  &builtin_bootprof,
   &builtin_cat,
   &builtin_chainloader,
   &builtin_clear,
   &builtin_cmp,
   &builtin_color,
+#ifdef GRUB_UTIL
+  &builtin_compilemenu,
+#endif /* GRUB_UTIL */
   &builtin_configfile,
+#ifndef NO_DECOMPRESSION
+  &builtin_crccheck,
+#endif /* ! NO_DECOMPRESSION */
   &builtin_debug,
   &builtin_default,
 #if defined(GRUB_UTIL) || defined(PLATFORM_EFI)
@@ -5294,6 +6386,7 @@ struct builtin *builtin_table[] =
 #ifdef SUPPORT_NETBOOT
   &builtin_dhcp,
 #endif /* SUPPORT_NETBOOT */
+  &builtin_diskcache,
 #ifndef PLATFORM_EFI
   &builtin_displayapm,
 #endif
@@ -5304,7 +6397,10 @@ struct builtin *builtin_table[] =
 #ifdef PLATFORM_EFI
   &builtin_efimap,
 #endif
-#ifndef PLATFORM_EFI
+#if defined(PLATFORM_EFI) && defined(EFI_CALL_TRACE)
+  &builtin_efitrace,
+#endif
+#if ! defined(PLATFORM_EFI) && ! defined(NO_SETUP_COMMANDS)
   &builtin_embed,
 #endif
   &builtin_fallback,
@@ -5315,11 +6411,15 @@ struct builtin *builtin_table[] =
 #endif
   &builtin_fstest,
   &builtin_geometry,
+#if defined(SUPPORT_GRAPHICS) && defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  &builtin_graphicsmode,
+#endif
   &builtin_halt,
   &builtin_help,
   &builtin_hiddenmenu,
   &builtin_hide,
 #ifdef SUPPORT_NETBOOT
+  &builtin_httpserver,
   &builtin_ifconfig,
 #endif /* SUPPORT_NETBOOT */
 #ifndef PLATFORM_EFI
@@ -5327,11 +6427,17 @@ struct builtin *builtin_table[] =
 #endif
   &builtin_initrd,
 #ifndef PLATFORM_EFI
+#ifndef NO_SETUP_COMMANDS
   &builtin_install,
+#endif
   &builtin_ioprobe,
 #endif
+  &builtin_iostat,
   &builtin_kernel,
   &builtin_lock,
+#ifndef GRUB_UTIL
+  &builtin_loopback,
+#endif
   &builtin_makeactive,
 #ifndef PLATFORM_EFI
   &builtin_map,
@@ -5339,13 +6445,24 @@ struct builtin *builtin_table[] =
 #ifdef USE_MD5_PASSWORDS
   &builtin_md5crypt,
 #endif /* USE_MD5_PASSWORDS */
+#ifndef GRUB_UTIL
+  &builtin_memdisk,
+#endif
 #ifndef PLATFORM_EFI
   &builtin_module,
   &builtin_modulenounzip,
 #endif
+#ifdef PLATFORM_EFI
+  &builtin_mtftp,
+#endif /* PLATFORM_EFI */
+#ifdef NET_CACHE
+  &builtin_netcache,
+#endif /* NET_CACHE */
   &builtin_pager,
+#ifndef NO_SETUP_COMMANDS
   &builtin_partnew,
   &builtin_parttype,
+#endif
   &builtin_password,
   &builtin_pause,
 #if defined(GRUB_UTIL) || defined(PLATFORM_EFI)
@@ -5359,12 +6476,15 @@ struct builtin *builtin_table[] =
   &builtin_root,
   &builtin_rootnoverify,
   &builtin_savedefault,
+  &builtin_search,
 #ifdef SUPPORT_SERIAL
   &builtin_serial,
 #endif /* SUPPORT_SERIAL */
 #ifndef PLATFORM_EFI
   &builtin_setkey,
+#ifndef NO_SETUP_COMMANDS
   &builtin_setup,
+#endif
 #endif
   &builtin_silent,
 #ifdef SUPPORT_GRAPHICS
@@ -5391,6 +6511,7 @@ struct builtin *builtin_table[] =
   &builtin_vbeprobe,
 #endif
   &builtin_verbose,
+  &builtin_verify,
   &builtin_version,
   0
 };
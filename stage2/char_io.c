@@ -47,7 +47,12 @@ struct term_entry term_table[] =
       console_setcolor,
       console_setcursor,
       0, 
+      0,
+#ifdef PLATFORM_EFI
+      console_putstr
+#else
       0
+#endif
     },
 #ifdef SUPPORT_SERIAL
     {
@@ -66,7 +71,10 @@ struct term_entry term_table[] =
       0,
       0,
       0, 
-      0
+      0,
+      serial_putstr,
+      serial_insertchars,
+      serial_deletechars
     },
 #endif /* SUPPORT_SERIAL */
 #ifdef SUPPORT_HERCULES
@@ -85,6 +93,7 @@ struct term_entry term_table[] =
       hercules_setcolor,
       hercules_setcursor,
       0,
+      0,
       0
     },      
 #endif /* SUPPORT_HERCULES */
@@ -93,8 +102,13 @@ struct term_entry term_table[] =
       TERM_NEED_INIT, /* flags */
       30, /* number of lines */
       graphics_putchar, /* putchar */
+#ifdef PLATFORM_EFI
+      graphics_checkkey, /* checkkey */
+      graphics_getkey, /* getkey */
+#else
       console_checkkey, /* checkkey */
       console_getkey, /* getkey */
+#endif
       console_keystatus, /* keystatus */
       graphics_getxy, /* getxy */
       graphics_gotoxy, /* gotoxy */
@@ -103,11 +117,16 @@ struct term_entry term_table[] =
       graphics_setcolor, /* setcolor */
       graphics_setcursor, /* nocursor */
       graphics_init, /* initialize */
-      graphics_end /* shutdown */
+      graphics_end, /* shutdown */
+#ifdef PLATFORM_EFI
+      graphics_putstr /* putstr */
+#else
+      0 /* putstr */
+#endif
     },
 #endif /* SUPPORT_GRAPHICS */
     /* This must be the last entry.  */
-    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
   };
 
 /* This must be console.  */
@@ -172,18 +191,66 @@ convert_to_ascii (char *buf, int c, unsigned int num)
   return ptr;
 }
 
+/* Put LEN characters of STR.  Runs without newlines or tabs, which
+   grub_putchar has to see for paging and tab stops, go to the terminal
+   in one piece if it takes them so.  */
+void
+grub_putmem (const char *str, int len)
+{
+  while (len > 0)
+    {
+      int n = 0;
+
+#ifndef STAGE1_5
+      if (current_term->putstr)
+	while (n < len && str[n] != '\n' && str[n] != '\t')
+	  n++;
+
+      if (n)
+	current_term->putstr (str, n);
+      else
+#endif /* ! STAGE1_5 */
+	{
+	  grub_putchar (*str);
+	  n = 1;
+	}
+
+      str += n;
+      len -= n;
+    }
+}
+
 void
 grub_putstr (const char *str)
 {
-  while (*str)
-    grub_putchar (*str++);
+  int len = 0;
+
+  while (str[len])
+    len++;
+
+  grub_putmem (str, len);
+}
+
+/* Put what grub_vsprintf prints into the boot log while bootlog_printf
+   asks for it, and return whether it goes on the console as well.  */
+static int
+to_console (const char *s, int len)
+{
+#ifndef STAGE1_5
+  if (bootlog_capture)
+    {
+      bootlog_write (s, len);
+      return bootlog_console;
+    }
+#endif /* ! STAGE1_5 */
+  return 1;
 }
 
 static void write_char(char **str, char c, int *count)
 {
     if (str && *str)
         *(*str)++ = c;
-    else
+    else if (to_console(&c, 1))
         putchar(c);
     (*count)++;
 }
@@ -191,8 +258,18 @@ static void write_char(char **str, char c, int *count)
 static void write_str(char **str, char *s, int *count)
 {
     if (s) {
-        while (*s)
-            write_char(str, *s++, count);
+        if (str && *str) {
+            while (*s)
+                write_char(str, *s++, count);
+        } else {
+            int len = 0;
+
+            while (s[len])
+                len++;
+            if (to_console(s, len))
+                grub_putmem(s, len);
+            *count += len;
+        }
     } else {
         write_str(str, "(nil)", count);
     }
@@ -275,6 +352,16 @@ grub_vsprintf (char *str, const char *fmt, va_list args)
                 buf[pos++] = c;
                 buf[pos] = '\0';
                 continue;
+            } else if (!str) {
+                /* the text up to the next conversion goes out at once */
+                const char *run = fmt - 1;
+
+                while (*fmt && *fmt != '%')
+                    fmt++;
+                if (to_console(run, fmt - run))
+                    grub_putmem(run, fmt - run);
+                count += fmt - run;
+                continue;
             } else {
                 write_char(&str, c, &count);
                 continue;
@@ -603,6 +690,9 @@ real_get_cmdline (char *prompt, char *cmdline, int maxlen,
       int i;
       int start;
       int pos = xpos;
+      /* What goes on the screen, sent at once.  */
+      char out[CMDLINE_WIDTH + 1];
+      int n = 0;
       
       if (full)
 	{
@@ -664,9 +754,9 @@ real_get_cmdline (char *prompt, char *cmdline, int maxlen,
       for (i = start; i < start + len && i < llen; i++)
 	{
 	  if (! echo_char)
-	    grub_putchar (buf[i]);
+	    out[n++] = buf[i];
 	  else
-	    grub_putchar (echo_char);
+	    out[n++] = echo_char;
 
 	  pos++;
 	}
@@ -674,7 +764,7 @@ real_get_cmdline (char *prompt, char *cmdline, int maxlen,
       /* Fill up the rest of the line with spaces.  */
       for (; i < start + len; i++)
 	{
-	  grub_putchar (' ');
+	  out[n++] = ' ';
 	  pos++;
 	}
       
@@ -683,12 +773,14 @@ real_get_cmdline (char *prompt, char *cmdline, int maxlen,
       if (pos == CMDLINE_WIDTH)
 	{
 	  if (start + len < llen)
-	    grub_putchar ('>');
+	    out[n++] = '>';
 	  else
-	    grub_putchar (' ');
+	    out[n++] = ' ';
 	  
 	  pos++;
 	}
+
+      grub_putmem (out, n);
       
       /* Back to XPOS.  */
       if (current_term->flags & TERM_DUMB)
@@ -729,6 +821,14 @@ real_get_cmdline (char *prompt, char *cmdline, int maxlen,
 	  lpos += l;
 	  if (xpos + l >= CMDLINE_WIDTH)
 	    cl_refresh (1, 0);
+	  /* Rather than the whole rest of the line, only send STR, if
+	     the terminal can make room for it and nothing is pushed
+	     off the line.  */
+	  else if (llen - lpos > l
+		   && xpos + l + llen - lpos < CMDLINE_WIDTH
+		   && current_term->insertchars
+		   && current_term->insertchars (l))
+	    cl_refresh (0, l);
 	  else if (xpos + l + llen - lpos > CMDLINE_WIDTH)
 	    cl_refresh (0, CMDLINE_WIDTH - xpos);
 	  else
@@ -741,6 +841,14 @@ real_get_cmdline (char *prompt, char *cmdline, int maxlen,
     {
       grub_memmove (buf + lpos, buf + lpos + count, llen - count + 1);
       llen -= count;
+
+      /* Likewise, let the terminal move the rest of the line, if it
+	 all shows.  */
+      if (llen - lpos > count
+	  && xpos + llen + count - lpos < CMDLINE_WIDTH
+	  && current_term->deletechars
+	  && current_term->deletechars (count))
+	return;
       
       if (xpos + llen + count - lpos > CMDLINE_WIDTH)
 	cl_refresh (0, CMDLINE_WIDTH - xpos);
@@ -1133,10 +1241,25 @@ grub_isspace (int c)
   return 0;
 }
 
+/* A machine word, which may be read out of any buffer.  The memory
+   functions move as many of these as they can, and bytes for the
+   rest.  */
+typedef unsigned long __attribute__ ((may_alias)) grub_word_t;
+
 #if !defined(STAGE1_5) || defined(FSYS_ISO9660)
 int
 grub_memcmp (const char *s1, const char *s2, int n)
 {
+  /* Skip the words which are the same; the first difference is found
+     byte by byte.  */
+  while (n >= (int) sizeof (grub_word_t)
+	 && *(const grub_word_t *) s1 == *(const grub_word_t *) s2)
+    {
+      s1 += sizeof (grub_word_t);
+      s2 += sizeof (grub_word_t);
+      n -= sizeof (grub_word_t);
+    }
+
   while (n)
     {
       if (*s1 < *s2)
@@ -1596,48 +1719,79 @@ memcheck (int addr, int len)
 #endif
 }
 
+#ifdef __x86_64__
+# define MOVS_WORD	"movsq"
+# define STOS_WORD	"stosq"
+#else
+# define MOVS_WORD	"movsl"
+# define STOS_WORD	"stosl"
+#endif
+
+/* Copy LEN bytes from FROM up to TO, a word at a time and then the
+   bytes left over.  */
+static inline void
+copy_forward (void *to, const void *from, int len)
+{
+  long d0, d1, d2;
+
+  asm volatile ("cld\n\t"
+		"rep\n\t"
+		MOVS_WORD "\n\t"
+		"mov %4, %0\n\t"
+		"rep\n\t"
+		"movsb"
+		: "=&c" (d0), "=&S" (d1), "=&D" (d2)
+		: "0" ((unsigned long) len / sizeof (grub_word_t)),
+		  "g" ((unsigned long) len % sizeof (grub_word_t)),
+		  "1" (from), "2" (to)
+		: "memory");
+}
+
+/* The same from the end down, for a TO which overlaps the end of FROM.
+   The bytes left over are at the end, so they go first.  */
+static inline void
+copy_backward (void *to, const void *from, int len)
+{
+  long d0, d1, d2;
+
+  asm volatile ("std\n\t"
+		"rep\n\t"
+		"movsb\n\t"
+		"sub %7, %1\n\t"
+		"sub %7, %2\n\t"
+		"mov %4, %0\n\t"
+		"rep\n\t"
+		MOVS_WORD "\n\t"
+		"cld"
+		: "=&c" (d0), "=&S" (d1), "=&D" (d2)
+		: "0" ((unsigned long) len % sizeof (grub_word_t)),
+		  "g" ((unsigned long) len / sizeof (grub_word_t)),
+		  "1" (len - 1 + (const char *) from),
+		  "2" (len - 1 + (char *) to),
+		  "i" (sizeof (grub_word_t) - 1)
+		: "memory");
+}
+
 void
 grub_memcpy(void *dest, const void *src, int len)
 {
-  int i;
-  register char *d = (char*)dest, *s = (char*)src;
-
-  for (i = 0; i < len; i++)
-    d[i] = s[i];
+  if (len > 0)
+    copy_forward (dest, src, len);
 }
 
 void *
 grub_memmove (void *to, const void *from, int len)
 {
-  if (memcheck ((unsigned long) to, len))
-     {
-       /* This assembly code is stolen from
-	  linux-2.2.2/include/asm-i386/string.h. This is not very fast
-	  but compact.  */
-       int d0, d1, d2;
-
-       if (to < from)
-	 {
-	   asm volatile ("cld\n\t"
-			 "rep\n\t"
-			 "movsb"
-			 : "=&c" (d0), "=&S" (d1), "=&D" (d2)
-			 : "0" (len),"1" (from),"2" (to)
-			 : "memory");
-	 }
-       else
-	 {
-	   asm volatile ("std\n\t"
-			 "rep\n\t"
-			 "movsb\n\t"
-			 "cld"
-			 : "=&c" (d0), "=&S" (d1), "=&D" (d2)
-			 : "0" (len),
-			 "1" (len - 1 + (const char *) from),
-			 "2" (len - 1 + (char *) to)
-			 : "memory");
-	 }
-     }
+  if (memcheck ((unsigned long) to, len) && len > 0)
+    {
+      /* Only a copy onto the end of itself has to go backwards, which
+	 is the slow direction.  */
+      if ((char *) to <= (const char *) from
+	  || (char *) to >= (const char *) from + len)
+	copy_forward (to, from, len);
+      else
+	copy_backward (to, from, len);
+    }
 
    return errnum ? NULL : to;
 }
@@ -1645,12 +1799,25 @@ grub_memmove (void *to, const void *from, int len)
 void *
 grub_memset (void *start, int c, int len)
 {
-  char *p = start;
+  long d0, d1;
 
-  if (memcheck ((unsigned long) start, len))
+  if (memcheck ((unsigned long) start, len) && len > 0)
     {
-      while (len -- > 0)
-	*p ++ = c;
+      /* C in every byte of a word.  */
+      grub_word_t pattern = (unsigned char) c * (~0UL / 0xff);
+
+      asm volatile ("cld\n\t"
+		    "rep\n\t"
+		    STOS_WORD "\n\t"
+		    "mov %4, %0\n\t"
+		    "rep\n\t"
+		    "stosb"
+		    : "=&c" (d0), "=&D" (d1)
+		    : "a" (pattern),
+		      "0" ((unsigned long) len / sizeof (grub_word_t)),
+		      "g" ((unsigned long) len % sizeof (grub_word_t)),
+		      "1" (start)
+		    : "memory");
     }
 
   return errnum ? NULL : start;
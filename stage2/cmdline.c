@@ -19,6 +19,7 @@
  */
 
 #include <shared.h>
+#include <bootprof.h>
 
 #ifdef SUPPORT_DISKLESS
 # define GRUB	1
@@ -66,9 +67,10 @@ print_cmdline_message (int type)
 struct builtin *
 find_command (char *command)
 {
+  static int num_builtins;
   char *ptr;
   char c;
-  struct builtin **builtin;
+  int lo, hi;
 
   /* Find the first space and terminate the command name.  */
   ptr = command;
@@ -78,19 +80,29 @@ find_command (char *command)
   c = *ptr;
   *ptr = 0;
 
-  /* Seek out the builtin whose command name is COMMAND.  */
-  for (builtin = builtin_table; *builtin != 0; builtin++)
+  if (! num_builtins)
+    while (builtin_table[num_builtins])
+      num_builtins++;
+
+  /* Seek out the builtin whose command name is COMMAND.  BUILTIN_TABLE
+     is sorted by name, so halve it until it is found.  */
+  lo = 0;
+  hi = num_builtins;
+  while (lo < hi)
     {
-      int ret = grub_strcmp (command, (*builtin)->name);
+      int mid = (lo + hi) / 2;
+      int ret = grub_strcmp (command, builtin_table[mid]->name);
 
       if (ret == 0)
 	{
 	  /* Find the builtin for COMMAND.  */
 	  *ptr = c;
-	  return *builtin;
+	  return builtin_table[mid];
 	}
       else if (ret < 0)
-	break;
+	hi = mid;
+      else
+	lo = mid + 1;
     }
 
   /* Cannot find COMMAND.  */
@@ -174,6 +186,7 @@ enter_cmdline (char *heap, int forever)
       
       /* Run BUILTIN->FUNC.  */
       arg = skip_to (1, heap);
+      bootprof_mark (builtin->name);
       (builtin->func) (arg, BUILTIN_CMDLINE);
 
       /* Finish the line count.  */
@@ -257,6 +270,7 @@ run_script (char *script, char *heap)
 
       /* Run BUILTIN->FUNC.  */
       arg = skip_to (1, heap);
+      bootprof_mark (builtin->name);
       (builtin->func) (arg, BUILTIN_SCRIPT);
     }
 }
@@ -86,6 +86,7 @@ char *err_list[] =
   [ERR_SYMLINK_LOOP] = "Too many symbolic links",
   [ERR_UNALIGNED] = "File is not sector aligned",
   [ERR_UNRECOGNIZED] = "Unrecognized command",
+  [ERR_VERIFY] = "File does not match its checksum in the manifest",
   [ERR_WONT_FIT] = "Selected item cannot fit into memory",
   [ERR_WRITE] = "Disk write error",
 };
@@ -101,33 +102,109 @@ static struct AddrRangeDesc fakemap[3] =
 
 /* A big problem is that the memory areas aren't guaranteed to be:
    (1) contiguous, (2) sorted in ascending order, or (3) non-overlapping.
-   Thus this kludge.  */
+   So the usable RAM in the map is put in MMAP_RAM once, sorted and
+   with the areas which overlap or touch merged, and looked up there.
+   MMAP_RAM_COUNT is -1 if it didn't fit, and then the map is scanned
+   every time, as it has always been.  */
+#define MMAP_RAM_MAX	32
+
+static struct
+{
+  unsigned long long start, end;
+}
+mmap_ram[MMAP_RAM_MAX];
+static int mmap_ram_count;
+
+static void
+mmap_ram_add (unsigned long long start, unsigned long long end)
+{
+  int lo, hi, i;
+
+  if (mmap_ram_count < 0)
+    return;
+
+  /* The areas from LO up to HI overlap or touch the new one.  */
+  for (lo = 0; lo < mmap_ram_count && mmap_ram[lo].end < start; lo++)
+    ;
+  for (hi = lo; hi < mmap_ram_count && mmap_ram[hi].start <= end; hi++)
+    {
+      if (mmap_ram[hi].start < start)
+	start = mmap_ram[hi].start;
+      if (mmap_ram[hi].end > end)
+	end = mmap_ram[hi].end;
+    }
+
+  if (lo == hi)
+    {
+      if (mmap_ram_count == MMAP_RAM_MAX)
+	{
+	  mmap_ram_count = -1;
+	  return;
+	}
+
+      for (i = mmap_ram_count; i > lo; i--)
+	mmap_ram[i] = mmap_ram[i - 1];
+      mmap_ram_count++;
+    }
+  else
+    {
+      for (i = hi; i < mmap_ram_count; i++)
+	mmap_ram[i - (hi - lo - 1)] = mmap_ram[i];
+      mmap_ram_count -= hi - lo - 1;
+    }
+
+  mmap_ram[lo].start = start;
+  mmap_ram[lo].end = end;
+}
+
 static unsigned long
 mmap_avail_at (unsigned long bottom)
 {
   unsigned long long top;
   unsigned long addr;
   int cont;
-  
-  top = bottom;
-  do
+
+  if (mmap_ram_count >= 0)
     {
-      for (cont = 0, addr = mbi.mmap_addr;
-	   addr < mbi.mmap_addr + mbi.mmap_length;
-	   addr += *((unsigned int *) addr) + 4)
+      int lo = 0, hi = mmap_ram_count;
+
+      /* Find the last area which starts at BOTTOM or below.  */
+      while (lo < hi)
 	{
-	  struct AddrRangeDesc *desc = (struct AddrRangeDesc *) addr;
-	  
-	  if (desc->Type == MB_ARD_MEMORY
-	      && desc->BaseAddr <= top
-	      && desc->BaseAddr + desc->Length > top)
+	  int mid = (lo + hi) / 2;
+
+	  if (mmap_ram[mid].start <= bottom)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+
+      top = bottom;
+      if (lo && mmap_ram[lo - 1].end > bottom)
+	top = mmap_ram[lo - 1].end;
+    }
+  else
+    {
+      top = bottom;
+      do
+	{
+	  for (cont = 0, addr = mbi.mmap_addr;
+	       addr < mbi.mmap_addr + mbi.mmap_length;
+	       addr += *((unsigned int *) addr) + 4)
 	    {
-	      top = desc->BaseAddr + desc->Length;
-	      cont++;
+	      struct AddrRangeDesc *desc = (struct AddrRangeDesc *) addr;
+
+	      if (desc->Type == MB_ARD_MEMORY
+		  && desc->BaseAddr <= top
+		  && desc->BaseAddr + desc->Length > top)
+		{
+		  top = desc->BaseAddr + desc->Length;
+		  cont++;
+		}
 	    }
 	}
+      while (cont);
     }
-  while (cont);
 
   /* For now, GRUB assumes 32bits addresses, so...  */
   if (top > 0xFFFFFFFF)
@@ -143,7 +220,9 @@ init_bios_info (void)
 {
 #ifndef STAGE1_5
   unsigned long cont, memtmp, addr;
+# ifndef PLATFORM_EFI
   int drive;
+# endif
 #endif
 
   /*
@@ -194,28 +273,32 @@ init_bios_info (void)
   if (mbi.mmap_length)
     {
       unsigned long long max_addr;
-      
-      /*
-       *  This is to get the lower memory, and upper memory (up to the
-       *  first memory hole), into the "mbi.mem_{lower,upper}"
-       *  elements.  This is for OS's that don't care about the memory
-       *  map, but might care about total RAM available.
-       */
-      mbi.mem_lower = mmap_avail_at (0) >> 10;
-      mbi.mem_upper = mmap_avail_at (0x100000) >> 10;
 
       /* Find the maximum available address. Ignore any memory holes.  */
+      mmap_ram_count = 0;
       for (max_addr = 0, addr = mbi.mmap_addr;
 	   addr < mbi.mmap_addr + mbi.mmap_length;
 	   addr += *((unsigned int *) addr) + 4)
 	{
 	  struct AddrRangeDesc *desc = (struct AddrRangeDesc *) addr;
 	  
-	  if (desc->Type == MB_ARD_MEMORY && desc->Length > 0
-	      && desc->BaseAddr + desc->Length > max_addr)
-	    max_addr = desc->BaseAddr + desc->Length;
+	  if (desc->Type == MB_ARD_MEMORY && desc->Length > 0)
+	    {
+	      mmap_ram_add (desc->BaseAddr, desc->BaseAddr + desc->Length);
+	      if (desc->BaseAddr + desc->Length > max_addr)
+		max_addr = desc->BaseAddr + desc->Length;
+	    }
 	}
 
+      /*
+       *  This is to get the lower memory, and upper memory (up to the
+       *  first memory hole), into the "mbi.mem_{lower,upper}"
+       *  elements.  This is for OS's that don't care about the memory
+       *  map, but might care about total RAM available.
+       */
+      mbi.mem_lower = mmap_avail_at (0) >> 10;
+      mbi.mem_upper = mmap_avail_at (0x100000) >> 10;
+
       extended_memory = (max_addr - 0x100000) >> 10;
     }
   else if ((memtmp = get_eisamemsize ()) != -1)
@@ -253,6 +336,10 @@ init_bios_info (void)
   mbi.drives_length = 0;
   mbi.drives_addr = addr;
 
+#ifndef PLATFORM_EFI
+  /* On EFI no Multiboot kernel can be booted, and the disks are
+     enumerated only when they are first used, so don't probe them.  */
+
   /* For now, GRUB doesn't probe floppies, since it is trivial to map
      floppy drives to BIOS drives.  */
   for (drive = 0x80; drive < 0x88; drive++)
@@ -291,6 +378,7 @@ init_bios_info (void)
       info->size = addr - (unsigned long) info;
       mbi.drives_length += info->size;
     }
+#endif /* ! PLATFORM_EFI */
 
   /* Get the ROM configuration table by INT 15, AH=C0h.  */
   mbi.config_table = get_rom_config_table ();
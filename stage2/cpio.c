@@ -0,0 +1,329 @@
+/* cpio.c - a cpio archive made in memory, to follow an initrd */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Among the files given to the initrd command, an option
+   `--cpio=PATH=FILE' puts FILE into the archive as PATH, and
+   `--cpio-line=PATH=TEXT' a line of TEXT, so that a few small files of
+   a host can follow an initrd shared by all of them.  All that is given
+   for the same PATH goes into it, in order, and the directories above
+   it are made as well.  The kernel unpacks the archive over the ones
+   before it.  */
+
+#include <shared.h>
+
+#define CPIO_FILE	"--cpio="
+#define CPIO_LINE	"--cpio-line="
+
+/* The most paths, files and directories, an archive can have.  */
+#define CPIO_MAX	64
+
+/* The size of a header of the "new ASCII" format, without the name.  */
+#define CPIO_HEADER_LEN	110
+
+#define CPIO_ALIGN(n)	(((n) + 3) & ~3)
+
+struct cpio_entry
+{
+  char *path;
+  int len;
+  int size;
+  int dir;
+};
+
+static struct cpio_entry cpio_entries[CPIO_MAX];
+static int cpio_count;
+
+/* Return the length of the option at ARG, or 0 if it is none.  */
+static int
+cpio_option_len (char *arg)
+{
+  if (! grub_memcmp (arg, CPIO_FILE, sizeof (CPIO_FILE) - 1))
+    return sizeof (CPIO_FILE) - 1;
+  if (! grub_memcmp (arg, CPIO_LINE, sizeof (CPIO_LINE) - 1))
+    return sizeof (CPIO_LINE) - 1;
+  return 0;
+}
+
+/* Whether the option at ARG puts a file in, rather than a line.  */
+static int
+cpio_is_file (char *arg)
+{
+  return ! grub_memcmp (arg, CPIO_FILE, sizeof (CPIO_FILE) - 1);
+}
+
+/* Whether ARG, a word of the list given to the initrd command, puts
+   something into the archive rather than naming an image.  */
+int
+initrd_cpio_option (char *arg)
+{
+  return cpio_option_len (arg) != 0;
+}
+
+/* Split the option at ARG into its PATH, without the leading slashes,
+   and the VALUE after it.  Return the length of PATH, or 0 with ERRNUM
+   set if there is none.  */
+static int
+cpio_split (char *arg, char **path, char **value)
+{
+  char *p = arg + cpio_option_len (arg);
+
+  while (*p == '/')
+    p++;
+  *path = p;
+  while (*p && *p != '=' && *p != ' ' && *p != '\t')
+    p++;
+
+  if (*p != '=' || p == *path || p[-1] == '/')
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 0;
+    }
+
+  *value = p + 1;
+  return p - *path;
+}
+
+/* Find PATH, of LEN bytes, among the entries, adding it if it isn't
+   there.  Return it, or 0 with ERRNUM set.  */
+static struct cpio_entry *
+cpio_entry (char *path, int len, int dir)
+{
+  struct cpio_entry *e;
+  int i;
+
+  for (i = 0; i < cpio_count; i++)
+    {
+      e = &cpio_entries[i];
+      if (e->len == len && ! grub_memcmp (e->path, path, len))
+	{
+	  if (e->dir != dir)
+	    {
+	      errnum = ERR_BAD_ARGUMENT;
+	      return 0;
+	    }
+	  return e;
+	}
+    }
+
+  if (cpio_count == CPIO_MAX)
+    {
+      errnum = ERR_WONT_FIT;
+      return 0;
+    }
+
+  e = &cpio_entries[cpio_count++];
+  e->path = path;
+  e->len = len;
+  e->size = 0;
+  e->dir = dir;
+  return e;
+}
+
+/* Return the length of the value at VALUE, which goes up to a space.  */
+static int
+cpio_value_len (char *value)
+{
+  char *p = value;
+
+  while (*p && *p != ' ' && *p != '\t')
+    p++;
+  return p - value;
+}
+
+/* Make the entries for the options in INITRD, with the size of each,
+   the directories above a file before it.  Return the size of the
+   archive, which is 0 if there are no options, or -1 with ERRNUM
+   set.  */
+static int
+cpio_scan (char *initrd)
+{
+  char *arg, *path, *value;
+  struct cpio_entry *e;
+  int i, len, size;
+
+  cpio_count = 0;
+  for (arg = initrd; *arg; arg = skip_to (0, arg))
+    {
+      if (! initrd_cpio_option (arg))
+	continue;
+
+      len = cpio_split (arg, &path, &value);
+      if (! len)
+	return -1;
+
+      for (i = 0; i < len; i++)
+	if (path[i] == '/' && ! cpio_entry (path, i, 1))
+	  return -1;
+
+      e = cpio_entry (path, len, 0);
+      if (! e)
+	return -1;
+
+      if (cpio_is_file (arg))
+	{
+	  if (! grub_open (value))
+	    return -1;
+	  size = filemax;
+	  grub_close ();
+	  if (size < 0)
+	    {
+	      errnum = ERR_FILELENGTH;
+	      return -1;
+	    }
+	}
+      else
+	size = cpio_value_len (value) + 1;
+
+      e->size += size;
+    }
+
+  if (! cpio_count)
+    return 0;
+
+  size = 0;
+  for (i = 0; i < cpio_count; i++)
+    size += (CPIO_ALIGN (CPIO_HEADER_LEN + cpio_entries[i].len + 1)
+	     + CPIO_ALIGN (cpio_entries[i].size));
+  size += CPIO_ALIGN (CPIO_HEADER_LEN + sizeof ("TRAILER!!!"));
+
+  return size;
+}
+
+/* Write a header at P for NAME, of LEN bytes, with the fields given,
+   and return where its data goes.  P is on a 4-byte boundary.  */
+static char *
+cpio_header (char *p, int ino, int mode, int nlink, int size,
+	     char *name, int len)
+{
+  unsigned long fields[13];
+  int i, j;
+
+  grub_memset ((char *) fields, 0, sizeof (fields));
+  fields[0] = ino;
+  fields[1] = mode;
+  fields[4] = nlink;
+  fields[6] = size;
+  fields[11] = len + 1;
+
+  grub_memmove (p, "070701", 6);
+  p += 6;
+  for (i = 0; i < 13; i++)
+    for (j = 28; j >= 0; j -= 4)
+      *p++ = "0123456789ABCDEF"[(fields[i] >> j) & 0xf];
+
+  grub_memmove (p, name, len);
+  grub_memset (p + len, 0, CPIO_ALIGN (CPIO_HEADER_LEN + len + 1)
+	       - CPIO_HEADER_LEN - len);
+  return p + CPIO_ALIGN (CPIO_HEADER_LEN + len + 1) - CPIO_HEADER_LEN;
+}
+
+/* Return the size of the archive the options in INITRD make, 0 if
+   there are none, or -1 with ERRNUM set.  */
+int
+initrd_cpio_size (char *initrd)
+{
+  return cpio_scan (initrd);
+}
+
+/* Make the archive of the options in INITRD at ADDR, on a 4-byte
+   boundary, reading the files it takes in.  Return its size, 0 if
+   there are no options, or -1 with ERRNUM set.  */
+int
+initrd_cpio_build (char *initrd, char *addr)
+{
+  char *p = addr, *arg, *path, *value;
+  struct cpio_entry *e;
+  int i, len, size, done;
+
+  size = cpio_scan (initrd);
+  if (size <= 0)
+    return size;
+
+  for (i = 0; i < cpio_count; i++)
+    {
+      e = &cpio_entries[i];
+      if (e->dir)
+	{
+	  p = cpio_header (p, i + 1, 040755, 2, 0, e->path, e->len);
+	  continue;
+	}
+
+      p = cpio_header (p, i + 1, 0100644, 1, e->size, e->path, e->len);
+
+      /* What was given for the path, in the order it was given, which
+	 must still be as big as it was found to be.  */
+      done = 0;
+      for (arg = initrd; *arg; arg = skip_to (0, arg))
+	{
+	  if (! initrd_cpio_option (arg))
+	    continue;
+
+	  len = cpio_split (arg, &path, &value);
+	  if (len != e->len || grub_memcmp (path, e->path, len))
+	    continue;
+
+	  if (cpio_is_file (arg))
+	    {
+	      if (! grub_open (value))
+		return -1;
+	      if (filemax > e->size - done)
+		{
+		  grub_close ();
+		  errnum = ERR_FILELENGTH;
+		  return -1;
+		}
+	      len = grub_read (p, filemax);
+	      grub_close ();
+	      if (errnum)
+		return -1;
+	    }
+	  else
+	    {
+	      len = cpio_value_len (value);
+	      if (len + 1 > e->size - done)
+		{
+		  errnum = ERR_FILELENGTH;
+		  return -1;
+		}
+	      grub_memmove (p, value, len);
+	      p[len++] = '\n';
+	    }
+	  p += len;
+	  done += len;
+	}
+
+      if (done != e->size)
+	{
+	  errnum = ERR_FILELENGTH;
+	  return -1;
+	}
+      grub_memset (p, 0, CPIO_ALIGN (e->size) - e->size);
+      p += CPIO_ALIGN (e->size) - e->size;
+    }
+
+  p = cpio_header (p, 0, 0, 1, 0, "TRAILER!!!", sizeof ("TRAILER!!!") - 1);
+
+  if (p - addr != size)
+    {
+      errnum = ERR_FILELENGTH;
+      return -1;
+    }
+  return size;
+}
@@ -22,6 +22,9 @@
 #include <shared.h>
 #include <filesys.h>
 #include <gpt.h>
+#ifndef STAGE1_5
+# include <bootprof.h>
+#endif
 
 #ifdef SUPPORT_NETBOOT
 # define GRUB	1
@@ -41,6 +44,8 @@ void (*disk_read_hook) (int, int, int) = NULL;
 void (*disk_read_func) (int, int, int) = NULL;
 
 #ifndef STAGE1_5
+int disk_read_map_only;
+
 int print_possibilities;
 
 static int do_completion;
@@ -52,10 +57,15 @@ static char *unique_string;
 int fsmax;
 struct fsys_entry fsys_table[NUM_FSYS + 1] =
 {
-  /* TFTP should come first because others don't handle net device.  */
+  /* TFTP should come first because others don't handle net device.
+     HTTP comes before it, because it only mounts when an HTTP server is
+     set.  */
 # ifdef PLATFORM_EFI
   {"efitftp", efi_tftp_mount, efi_tftp_read, efi_tftp_dir, efi_tftp_close, 0},
 # endif
+# ifdef FSYS_HTTP
+  {"http", http_mount, http_read, http_dir, http_close, 0},
+# endif
 # ifdef FSYS_TFTP
   {"tftp", tftp_mount, tftp_read, tftp_dir, tftp_close, 0},
 # endif
@@ -80,6 +90,9 @@ struct fsys_entry fsys_table[NUM_FSYS + 1] =
 # ifdef FSYS_XFS
   {"xfs", xfs_mount, xfs_read, xfs_dir, 0, 0},
 # endif
+# ifdef FSYS_BTRFS
+  {"btrfs", btrfs_mount, btrfs_read, btrfs_dir, 0, 0},
+# endif
 # ifdef FSYS_UFS2
   {"ufs2", ufs2_mount, ufs2_read, ufs2_dir, 0, ufs2_embed},
 # endif
@@ -97,6 +110,79 @@ struct fsys_entry fsys_table[NUM_FSYS + 1] =
   {0, 0, 0, 0, 0, 0}
 };
 
+#ifndef STAGE1_5
+/* Where the file systems that have a magic number keep it, given as
+   arguments to devread, so that attempt_mount needs to call only the
+   mount functions of those whose magic is there.  A file system may be
+   listed more than once, and one not listed is always tried.  The reads
+   all fall into a few blocks at the start of the partition, which the
+   disk cache then holds for the mount function.  */
+struct fsys_magic
+{
+  int (*mount_func) (void);
+  int sector;
+  int offset;
+  char *magic;
+  int len;
+};
+
+static struct fsys_magic fsys_magics[] =
+{
+# ifdef FSYS_EXT2FS
+  /* s_magic, 0xEF53, in the superblock 1K in.  This is in bytes,
+     as the others are, so that it holds whatever the sector size.  */
+  {ext2fs_mount, 0, 0x400 + 56, "\x53\xef", 2},
+# endif
+# ifdef FSYS_REISERFS
+  /* s_magic in the superblock at 64K, or at 8K in old versions, which
+     had it 20 bytes in before journaling.  */
+  {reiserfs_mount, 0, 0x10000 + 52, "ReIsEr", 6},
+  {reiserfs_mount, 0, 0x2000 + 52, "ReIsEr", 6},
+  {reiserfs_mount, 0, 0x2000 + 20, "ReIsEr", 6},
+# endif
+# ifdef FSYS_JFS
+  {jfs_mount, 0, 0x8000, "JFS1", 4},
+# endif
+# ifdef FSYS_XFS
+  {xfs_mount, 0, 0, "XFSB", 4},
+# endif
+# ifdef FSYS_BTRFS
+  /* the magic in the superblock at 64K */
+  {btrfs_mount, 0, 0x10000 + 0x40, "_BHRfS_M", 8},
+# endif
+  {0, 0, 0, 0, 0}
+};
+
+/* Return non-zero if the file system whose mount function is MOUNT_FUNC
+   may be in the current partition, as far as its magic number tells.  */
+static int
+fsys_may_mount (int (*mount_func) (void))
+{
+  struct fsys_magic *m;
+  int saved_errnum = errnum;
+  int listed = 0;
+  char buf[8];
+
+  if (current_drive == NETWORK_DRIVE)
+    return 1;
+
+  for (m = fsys_magics; m->mount_func; m++)
+    {
+      if (m->mount_func != mount_func)
+	continue;
+
+      listed = 1;
+      if (devread (m->sector, m->offset, m->len, buf)
+	  && ! grub_memcmp (buf, m->magic, m->len))
+	return 1;
+
+      errnum = saved_errnum;
+    }
+
+  return ! listed;
+}
+#endif /* ! STAGE1_5 */
+
 
 /* These have the same format as "boot_drive" and "install_partition", but
    are meant to be working values. */
@@ -124,19 +210,24 @@ static int block_file = 0;
 #endif /* NO_BLOCK_FILES */
 
 /* these are the translated numbers for the open partition */
-unsigned long part_start;
-unsigned long part_length;
+sector_t part_start;
+sector_t part_length;
 
 int current_slice;
 
 /* disk buffer parameters */
 int buf_drive = -1;
-int buf_track;
+sector_t buf_track;
 struct geometry buf_geom;
 
 /* filesystem common variables */
 int filepos;
 int filemax;
+#ifndef STAGE1_5
+/* The modification time of the open file, if its file system tells it,
+   or zero.  */
+unsigned long filemtime;
+#endif
 
 static inline unsigned int
 grub_log2 (unsigned int word)
@@ -147,1513 +238,3963 @@ grub_log2 (unsigned int word)
   return word;
 }
 
-int
-rawread (int drive, int sector, int byte_offset, int byte_len, char *buf)
+/* Load the geometry of DRIVE into BUF_GEOM, with what the sectors are
+   converted with worked out once for all the reads from it, and forget
+   the track buffer.  Return nonzero with ERRNUM set if there is no
+   such drive.  */
+static int
+buf_geom_load (int drive)
 {
-  int slen, sectors_per_vtrack;
-  int sector_size_bits = grub_log2 (buf_geom.sector_size);
-
-  if (byte_len <= 0)
-    return 1;
-
-  while (byte_len > 0 && !errnum)
+  if (get_diskinfo (drive, &buf_geom))
     {
-      int soff, num_sect, track, size = byte_len;
-      char *bufaddr;
-
-      /*
-       *  Check track buffer.  If it isn't valid or it is from the
-       *  wrong disk, then reset the disk geometry.
-       */
-      if (buf_drive != drive)
-	{
-	  if (get_diskinfo (drive, &buf_geom))
-	    {
-	      errnum = ERR_NO_DISK;
-	      return 0;
-	    }
-	  buf_drive = drive;
-	  buf_track = -1;
-	  sector_size_bits = grub_log2 (buf_geom.sector_size);
-	}
-
-      /* Make sure that SECTOR is valid.  */
-      if (sector < 0 || sector >= buf_geom.total_sectors)
-	{
-	  errnum = ERR_GEOM;
-	  return 0;
-	}
-      
-      slen = ((byte_offset + byte_len + buf_geom.sector_size - 1)
-	      >> sector_size_bits);
-      
-      /* Eliminate a buffer overflow.  */
-      if ((buf_geom.sectors << sector_size_bits) > BUFFERLEN)
-	sectors_per_vtrack = (BUFFERLEN >> sector_size_bits);
-      else
-	sectors_per_vtrack = buf_geom.sectors;
-      
-      /* Get the first sector of track.  */
-      soff = sector % sectors_per_vtrack;
-      track = sector - soff;
-      num_sect = sectors_per_vtrack - soff;
-      bufaddr = ((char *) BUFFERADDR
-		 + (soff << sector_size_bits) + byte_offset);
-
-      if (track != buf_track)
-	{
-	  int bios_err, read_start = track, read_len = sectors_per_vtrack;
+      errnum = ERR_NO_DISK;
+      return 1;
+    }
 
-	  /*
-	   *  If there's more than one read in this entire loop, then
-	   *  only make the earlier reads for the portion needed.  This
-	   *  saves filling the buffer with data that won't be used!
-	   */
-	  if (slen > num_sect)
-	    {
-	      read_start = sector;
-	      read_len = num_sect;
-	      bufaddr = (char *) BUFFERADDR + byte_offset;
-	    }
+  buf_geom.sector_bits = grub_log2 (buf_geom.sector_size);
+  buf_geom.sector_mask = buf_geom.sector_size - 1;
 
-	  bios_err = biosdisk (BIOSDISK_READ, drive, &buf_geom,
-			       read_start, read_len, BUFFERSEG);
-	  if (bios_err)
-	    {
-	      buf_track = -1;
+  /* With linear addressing there are no tracks to keep to, and the
+     track buffer is only to be kept from overflowing.  */
+  if ((buf_geom.flags & BIOSDISK_FLAG_LBA_EXTENSION)
+      || (buf_geom.sectors << buf_geom.sector_bits) > BUFFERLEN)
+    buf_geom.vtrack_sectors = BUFFERLEN >> buf_geom.sector_bits;
+  else
+    buf_geom.vtrack_sectors = buf_geom.sectors;
 
-	      if (bios_err == BIOSDISK_ERROR_GEOMETRY)
-		errnum = ERR_GEOM;
-	      else
-		{
-		  /*
-		   *  If there was an error, try to load only the
-		   *  required sector(s) rather than failing completely.
-		   */
-		  if (slen > num_sect
-		      || biosdisk (BIOSDISK_READ, drive, &buf_geom,
-				   sector, slen, BUFFERSEG))
-		    errnum = ERR_READ;
+  buf_drive = drive;
+  buf_track = -1;
+  return 0;
+}
 
-		  bufaddr = (char *) BUFFERADDR + byte_offset;
-		}
-	    }
-	  else
-	    buf_track = track;
+/* The sector size of the current drive, as a power of two.  RAWREAD
+   keeps the geometry of the drive it read last in BUF_GEOM, which is
+   nearly always the current one, so the firmware is seldom asked.  */
+static int
+current_sector_bits (void)
+{
+  if ((unsigned long) buf_drive == current_drive)
+    return buf_geom.sector_bits;
 
-	  if ((buf_track == 0 || sector == 0)
-	      && (PC_SLICE_TYPE (BUFFERADDR, 0) == PC_SLICE_TYPE_EZD
-		  || PC_SLICE_TYPE (BUFFERADDR, 1) == PC_SLICE_TYPE_EZD
-		  || PC_SLICE_TYPE (BUFFERADDR, 2) == PC_SLICE_TYPE_EZD
-		  || PC_SLICE_TYPE (BUFFERADDR, 3) == PC_SLICE_TYPE_EZD))
-	    {
-	      /* This is a EZD disk map sector 0 to sector 1 */
-	      if (buf_track == 0 || slen >= 2)
-		{
-		  /* We already read the sector 1, copy it to sector 0 */
-		  memmove ((char *) BUFFERADDR, 
-			   (char *) BUFFERADDR + buf_geom.sector_size,
-			   buf_geom.sector_size);
-		}
-	      else
-		{
-		  if (biosdisk (BIOSDISK_READ, drive, &buf_geom,
-				1, 1, BUFFERSEG))
-		    errnum = ERR_READ;
-		}
-	    }
-	}
-	  
-      if (size > ((num_sect << sector_size_bits) - byte_offset))
-	size = (num_sect << sector_size_bits) - byte_offset;
+  return get_sector_bits (current_drive);
+}
 
-      /*
-       *  Instrumentation to tell which sectors were read and used.
-       */
-      if (disk_read_func)
-	{
-	  int sector_num = sector;
-	  int length = buf_geom.sector_size - byte_offset;
-	  if (length > size)
-	    length = size;
-	  (*disk_read_func) (sector_num++, byte_offset, length);
-	  length = size - length;
-	  if (length > 0)
-	    {
-	      while (length > buf_geom.sector_size)
-		{
-		  (*disk_read_func) (sector_num++, 0, buf_geom.sector_size);
-		  length -= buf_geom.sector_size;
-		}
-	      (*disk_read_func) (sector_num, 0, length);
-	    }
-	}
+#ifndef STAGE1_5
+/* The dentry cache.  The entries belong to the filesystem in
+   DENTRY_CACHE_FSYS on DENTRY_CACHE_DRIVE and DENTRY_CACHE_PARTITION,
+   and the cache is emptied when another one is used.  */
+struct dentry_cache_entry
+{
+  unsigned long dir;
+  char name[DENTRY_NAME_LEN];
+  /* Whether NAME exists in DIR, and what the filesystem found for it.  */
+  int found;
+  unsigned long data[DENTRY_DATA_LEN];
+  /* The value of DENTRY_CACHE_CLOCK when this entry was used last, or
+     zero if it is unused.  */
+  unsigned long stamp;
+};
 
-      grub_memmove (buf, bufaddr, size);
+static struct dentry_cache_entry dentry_cache[DENTRY_CACHE_MAX];
+static unsigned long dentry_cache_clock;
+static unsigned long dentry_cache_drive = GRUB_INVALID_DRIVE;
+static unsigned long dentry_cache_partition;
+static int dentry_cache_fsys = NUM_FSYS;
 
-      buf += size;
-      byte_len -= size;
-      sector += num_sect;
-      byte_offset = 0;
-    }
+void
+dentry_cache_invalidate (void)
+{
+  int i;
 
-  return (!errnum);
+  for (i = 0; i < DENTRY_CACHE_MAX; i++)
+    dentry_cache[i].stamp = 0;
+  dentry_cache_drive = GRUB_INVALID_DRIVE;
 }
 
-
-int
-devread (int sector, int byte_offset, int byte_len, char *buf)
+/* Return the entry for NAME in DIR, or zero.  */
+static struct dentry_cache_entry *
+dentry_cache_find (unsigned long dir, const char *name)
 {
-  /*
-   *  Check partition boundaries
-   */
-  if (sector < 0
-      || ((sector + ((byte_offset + byte_len - 1) >> get_sector_bits(current_drive)))
-	  >= part_length))
+  int i;
+
+  if (current_drive != dentry_cache_drive
+      || current_partition != dentry_cache_partition
+      || fsys_type != dentry_cache_fsys)
     {
-      errnum = ERR_OUTSIDE_PART;
+      dentry_cache_invalidate ();
+      dentry_cache_drive = current_drive;
+      dentry_cache_partition = current_partition;
+      dentry_cache_fsys = fsys_type;
       return 0;
     }
 
-  /*
-   *  Get the read to the beginning of a partition.
-   */
-  sector += byte_offset >> get_sector_bits(current_drive);
-  byte_offset &= get_sector_size(current_drive) - 1;
-
-#if !defined(STAGE1_5)
-  if (disk_read_hook && debug)
-    printf ("<%d, %d, %d>", sector, byte_offset, byte_len);
-#endif /* !STAGE1_5 */
+  for (i = 0; i < DENTRY_CACHE_MAX; i++)
+    if (dentry_cache[i].stamp && dentry_cache[i].dir == dir
+	&& ! grub_strcmp (dentry_cache[i].name, name))
+      return dentry_cache + i;
 
-  /*
-   *  Call RAWREAD, which is very similar, but:
-   *
-   *    --  It takes an extra parameter, the drive number.
-   *    --  It requires that "sector" is relative to the beginning
-   *            of the disk.
-   *    --  It doesn't handle offsets of more than 511 bytes into the
-   *            sector.
-   */
-  return rawread (current_drive, part_start + sector, byte_offset,
-		  byte_len, buf);
+  return 0;
 }
 
-#ifndef STAGE1_5
+/* Look NAME up in DIR.  Return 1 and fill in DATA if it was found there,
+   -1 if it is known not to exist, and 0 if it is not in the cache.  */
 int
-rawwrite (int drive, int sector, char *buf)
+dentry_cache_lookup (unsigned long dir, const char *name,
+		     unsigned long *data)
 {
-  if (sector == 0)
-    {
-      if (biosdisk (BIOSDISK_READ, drive, &buf_geom, 0, 1, SCRATCHSEG))
-	{
-	  errnum = ERR_WRITE;
-	  return 0;
-	}
+  struct dentry_cache_entry *entry = dentry_cache_find (dir, name);
+  int i;
 
-      if (PC_SLICE_TYPE (SCRATCHADDR, 0) == PC_SLICE_TYPE_EZD
-	  || PC_SLICE_TYPE (SCRATCHADDR, 1) == PC_SLICE_TYPE_EZD
-	  || PC_SLICE_TYPE (SCRATCHADDR, 2) == PC_SLICE_TYPE_EZD
-	  || PC_SLICE_TYPE (SCRATCHADDR, 3) == PC_SLICE_TYPE_EZD)
-	sector = 1;
-    }
-  
-  memmove ((char *) SCRATCHADDR, buf, get_sector_size(drive));
-  if (biosdisk (BIOSDISK_WRITE, drive, &buf_geom,
-		sector, 1, SCRATCHSEG))
-    {
-      errnum = ERR_WRITE;
-      return 0;
-    }
+  if (! entry)
+    return 0;
 
-  if (sector - sector % buf_geom.sectors == buf_track)
-    /* Clear the cache.  */
-    buf_track = -1;
+  entry->stamp = ++dentry_cache_clock;
+  if (! entry->found)
+    return -1;
 
+  for (i = 0; i < DENTRY_DATA_LEN; i++)
+    data[i] = entry->data[i];
   return 1;
 }
 
-int
-devwrite (int sector, int sector_count, char *buf)
+/* Remember that NAME was found in DIR and is described by DATA, or that
+   it doesn't exist if DATA is zero.  */
+void
+dentry_cache_add (unsigned long dir, const char *name, unsigned long *data)
 {
-#if defined(GRUB_UTIL) && defined(__linux__)
-  if (current_partition != 0xFFFFFF
-      && is_disk_device (device_map, current_drive))
+  struct dentry_cache_entry *entry;
+  int i, len = grub_strlen (name);
+
+  if (len >= DENTRY_NAME_LEN)
+    return;
+
+  entry = dentry_cache_find (dir, name);
+  if (! entry)
     {
-      /* If the grub shell is running under Linux and the user wants to
-	 embed a Stage 1.5 into a partition instead of a MBR, use system
-	 calls directly instead of biosdisk, because of the bug in
-	 Linux. *sigh*  */
-      int ret;
-      ret = write_to_partition (device_map, current_drive, current_partition,
-				sector, sector_count, buf);
-      if (ret != -1)
-	return ret;
+      entry = dentry_cache;
+      for (i = 1; i < DENTRY_CACHE_MAX; i++)
+	if (dentry_cache[i].stamp < entry->stamp)
+	  entry = dentry_cache + i;
     }
-#endif /* GRUB_UTIL && __linux__ */
-    int i;
-
-    for (i = 0; i < sector_count; i++)
-      {
-	if (! rawwrite (current_drive, part_start + sector + i,
-			buf + (i << get_sector_bits(current_drive))))
-	    return 0;
 
-      }
-    return 1;
+  /* Not grub_strcpy, which fails if ERRNUM is already set.  */
+  entry->dir = dir;
+  for (i = 0; i <= len; i++)
+    entry->name[i] = name[i];
+  entry->found = (data != 0);
+  for (i = 0; i < DENTRY_DATA_LEN; i++)
+    entry->data[i] = data ? data[i] : 0;
+  entry->stamp = ++dentry_cache_clock;
 }
 
-static int
-sane_partition (void)
+/* The partition tables of the last few drives, as next_partition
+   found them.  Each entry of PARTS holds what one call of it returned,
+   in order, so that iterating over the partitions again, or opening
+   one, needs no reading of the tables.  A drive with more partitions
+   than PARTS holds is not kept.  */
+#define PART_CACHE_DRIVES	4
+#define PART_CACHE_PARTS	32
+
+struct part_cache_entry
 {
-  /* network drive */
-  if (current_drive == NETWORK_DRIVE)
-    return 1;
-  
-  if (!(current_partition & 0xFF000000uL)
-      && ((current_drive & 0xFFFFFF7F) < MAX_HD_NUM
-	  || current_drive == cdrom_drive)
-      && (current_partition & 0xFF) == 0xFF
-      && ((current_partition & 0xFF00) == 0xFF00
-	  || (current_partition & 0xFF00) < 0x800)
-      && ((current_partition >> 16) == 0xFF
-	  || (current_drive & 0x80)))
-    return 1;
+  unsigned long partition;
+  int type;
+  sector_t start;
+  sector_t len;
+  unsigned long offset;
+  int entry;
+  unsigned long ext_offset;
+  unsigned long gpt_offset;
+  int gpt_count;
+  int gpt_size;
+};
 
-  errnum = ERR_DEV_VALUES;
-  return 0;
+struct part_cache
+{
+  /* The drive, or -1 if dropped.  An unused entry is all zeros, and
+     the floppy drive 0 is never kept.  */
+  int drive;
+  int count;
+  /* Whether the partition after the last one in PARTS is no more.  */
+  int complete;
+  unsigned long stamp;
+  struct part_cache_entry parts[PART_CACHE_PARTS];
+};
+
+static struct part_cache part_cache[PART_CACHE_DRIVES];
+static unsigned long part_cache_clock;
+
+static void
+part_cache_invalidate (int drive)
+{
+  int i;
+
+  for (i = 0; i < PART_CACHE_DRIVES; i++)
+    if (drive == -1 || part_cache[i].drive == drive)
+      {
+	part_cache[i].drive = -1;
+	part_cache[i].stamp = 0;
+      }
+}
+
+struct iostat iostat_total;
+struct iostat iostat_fsys[NUM_FSYS + 1];
+struct iostat_file iostat_files[IOSTAT_FILES];
+int iostat_file_count;
+int iostat_files_dropped;
+
+/* The entry in IOSTAT_FILES of the file opened last, or -1.  */
+static int iostat_file = -1;
+
+/* Add N to FIELD of the statistics which the current read counts in.  */
+#define iostat_add(field, n)					\
+  do								\
+    {								\
+      iostat_total.field += (n);				\
+      iostat_fsys[fsys_type].field += (n);			\
+      if (iostat_file >= 0)					\
+	iostat_files[iostat_file].stat.field += (n);		\
+    }								\
+  while (0)
+
+void
+iostat_reset (void)
+{
+  grub_memset (&iostat_total, 0, sizeof (iostat_total));
+  grub_memset (iostat_fsys, 0, sizeof (iostat_fsys));
+  iostat_file_count = iostat_files_dropped = 0;
+  iostat_file = -1;
 }
-#endif /* ! STAGE1_5 */
 
+/* Start counting the reads for FILENAME, which is being opened.  */
 static void
-attempt_mount (void)
+iostat_open (const char *filename)
 {
-#ifndef STAGE1_5
-  for (fsys_type = 0; fsys_type < NUM_FSYS; fsys_type++)
-    if ((fsys_table[fsys_type].mount_func) ())
-      break;
+  struct iostat_file *f;
+  int i;
 
-  if (fsys_type == NUM_FSYS && errnum == ERR_NONE)
-    errnum = ERR_FSYS_MOUNT;
-#else
-  fsys_type = 0;
-  if ((*(fsys_table[fsys_type].mount_func)) () != 1)
+  if (iostat_file_count == IOSTAT_FILES)
     {
-      fsys_type = NUM_FSYS;
-      errnum = ERR_FSYS_MOUNT;
+      iostat_files_dropped++;
+      iostat_file = -1;
+      return;
     }
-#endif
+
+  iostat_file = iostat_file_count++;
+  f = &iostat_files[iostat_file];
+  for (i = 0; i < IOSTAT_NAME_LEN - 1 && filename[i]
+	 && ! isspace (filename[i]); i++)
+    f->name[i] = filename[i];
+  f->name[i] = 0;
+  grub_memset (&f->stat, 0, sizeof (f->stat));
 }
+#endif /* ! STAGE1_5 */
 
+/* Read NSEC sectors from SECTOR in DRIVE, whose geometry is in BUF_GEOM,
+   into the track buffer.  */
+static int
+read_track (int drive, sector_t sector, int nsec)
+{
+#ifndef STAGE1_5
+  iostat_add (disk_reads, 1);
+  iostat_add (disk_bytes, (unsigned long long) nsec * buf_geom.sector_size);
+#endif
+  return biosdisk (BIOSDISK_READ, drive, &buf_geom, sector, nsec, BUFFERSEG);
+}
 
 #ifndef STAGE1_5
-/* Turn on the active flag for the partition SAVED_PARTITION in the
-   drive SAVED_DRIVE. If an error occurs, return zero, otherwise return
-   non-zero.  */
-int
-make_saved_active (void)
+/* The disk cache.  Each entry describes one block of DISK_CACHE_BLOCKLEN
+   bytes in DISK_CACHE_BUF, and the least recently used one is replaced
+   when a block which is not cached yet is read.  */
+struct disk_cache_entry
 {
-  char mbr[512];
+  /* The drive, or -1 if unused, and the first sector of the block.  */
+  int drive;
+  sector_t sector;
+  /* The value of DISK_CACHE_CLOCK when this block was used last.  */
+  unsigned long stamp;
+};
 
-  if (saved_drive & 0x80)
-    {
-      /* Hard disk */
-      int part = saved_partition >> 16;
+static struct disk_cache_entry disk_cache[DISK_CACHE_MAX] =
+{
+  [0 ... DISK_CACHE_MAX - 1] = { -1, -1, 0 }
+};
+static unsigned long disk_cache_clock;
 
-      /* If the partition is not a primary partition, the active flag is
-	 meaningless. (XXX: Really?)  */
-      if (part > 3)
-	{
-	  errnum = ERR_DEV_VALUES;
-	  return 0;
-	}
+int disk_cache_size = DISK_CACHE_MAX;
+unsigned long disk_cache_hits;
+unsigned long disk_cache_misses;
+unsigned long disk_cache_generation;
 
-      /* Read the MBR in the scratch space.  */
-      if (! rawread (saved_drive, 0, 0, get_sector_size(saved_drive), mbr))
-	return 0;
+void
+disk_cache_invalidate (int drive)
+{
+  int i;
 
-      /* If the partition is an extended partition, setting the active
-	 flag violates the specification by IBM.  */
-      if (IS_PC_SLICE_TYPE_EXTENDED (PC_SLICE_TYPE (mbr, part)))
-	{
-	  errnum = ERR_DEV_VALUES;
-	  return 0;
-	}
+  disk_cache_generation++;
 
-      /* Check if the active flag is disabled.  */
-      if (PC_SLICE_FLAG (mbr, part) != PC_SLICE_FLAG_BOOTABLE)
-	{
-	  int i;
+  for (i = 0; i < DISK_CACHE_MAX; i++)
+    if (drive == -1 || disk_cache[i].drive == drive)
+      {
+	disk_cache[i].drive = -1;
+	disk_cache[i].stamp = 0;
+      }
 
-	  /* Clear all the active flags in this table.  */
-	  for (i = 0; i < 4; i++)
-	    PC_SLICE_FLAG (mbr, i) = 0;
+  /* The directories and the partitions may have changed as well.  */
+  if (drive == -1 || (unsigned long) drive == dentry_cache_drive)
+    dentry_cache_invalidate ();
+  part_cache_invalidate (drive);
+}
 
-	  /* Set the flag.  */
-	  PC_SLICE_FLAG (mbr, part) = PC_SLICE_FLAG_BOOTABLE;
+/* Fill the least recently used entry with the block starting at
+   SECTOR in DRIVE, whose data is at DATA, unless it is cached already.  */
+static void
+disk_cache_put (int drive, sector_t sector, char *data)
+{
+  struct disk_cache_entry *victim = 0;
+  int i;
 
-	  /* Write back the MBR.  */
-	  if (! rawwrite (saved_drive, 0, mbr))
-	    return 0;
-	}
-    }
-  else
+  for (i = 0; i < disk_cache_size; i++)
     {
-      /* If the drive is not a hard disk drive, you shouldn't call this
-	 function. (XXX: Should I just ignore this error?)  */
-      errnum = ERR_DEV_VALUES;
-      return 0;
+      struct disk_cache_entry *e = disk_cache + i;
+
+      if (e->drive == drive && e->sector == sector)
+	return;
+
+      if (! victim || e->stamp < victim->stamp)
+	victim = e;
     }
 
-  return 1;
+  grub_memmove ((char *) DISK_CACHE_BUF
+		+ (victim - disk_cache) * DISK_CACHE_BLOCKLEN,
+		data, DISK_CACHE_BLOCKLEN);
+  iostat_add (moved, DISK_CACHE_BLOCKLEN);
+  victim->drive = drive;
+  victim->sector = sector;
+  victim->stamp = ++disk_cache_clock;
 }
 
-/* Hide/Unhide CURRENT_PARTITION.  */
-int
-set_partition_hidden_flag (int hidden)
+/* Return the address of the cached data of the block starting at
+   SECTOR in DRIVE, reading it from the disk if necessary.  The geometry
+   of DRIVE must be in BUF_GEOM.  If the block cannot be cached, return
+   zero and let the caller read it by itself.  When it is read, up to
+   AHEAD blocks after it are read and cached along with it.  */
+static char *
+disk_cache_get (int drive, sector_t sector, int sector_size_bits,
+		int ahead)
 {
-  unsigned long part = 0xFFFFFF;
-  unsigned long start, len, offset, ext_offset, gpt_offset;
-  int entry, type, gpt_count, gpt_size;
-  char mbr[512];
-  
-  /* The drive must be a hard disk.  */
-  if (! (current_drive & 0x80))
+  struct disk_cache_entry *victim = 0;
+  int i, nsec = DISK_CACHE_BLOCKLEN >> sector_size_bits;
+  char *data;
+
+  for (i = 0; i < disk_cache_size; i++)
     {
-      errnum = ERR_BAD_ARGUMENT;
-      return 1;
+      struct disk_cache_entry *e = disk_cache + i;
+
+      if (e->drive == drive && e->sector == sector)
+	{
+	  e->stamp = ++disk_cache_clock;
+	  disk_cache_hits++;
+	  iostat_add (cache_hits, 1);
+	  return (char *) DISK_CACHE_BUF + i * DISK_CACHE_BLOCKLEN;
+	}
+
+      if (! victim || e->stamp < victim->stamp)
+	victim = e;
     }
-  
-  /* The partition must be a PC slice.  */
-  if ((current_partition >> 16) == 0xFF
-      || (current_partition & 0xFFFF) != 0xFFFF)
+
+  /* Don't bother with a partial block at the end of the disk.  */
+  if (! victim || sector + nsec > buf_geom.total_sectors)
+    return 0;
+
+  disk_cache_misses++;
+
+  /* A stream must not push everything else out of the cache, and
+     what is read ahead must fit in the track buffer and the disk.  */
+  if (ahead > disk_cache_size / 4)
+    ahead = disk_cache_size / 4;
+  if (ahead > BUFFERLEN / DISK_CACHE_BLOCKLEN - 1)
+    ahead = BUFFERLEN / DISK_CACHE_BLOCKLEN - 1;
+  while (ahead > 0 && sector + (ahead + 1) * nsec > buf_geom.total_sectors)
+    ahead--;
+  if (sector == 0)
+    ahead = 0;
+
+  /* The block goes through the track buffer, so that the BIOS can
+     always reach the memory.  */
+  buf_track = -1;
+  if (read_track (drive, sector, (ahead + 1) * nsec))
     {
-      errnum = ERR_BAD_ARGUMENT;
-      return 1;
+      /* Perhaps it was only the blocks after it.  */
+      if (! ahead || read_track (drive, sector, nsec))
+	return 0;
+      ahead = 0;
     }
-  
-  /* Look for the partition.  */
-  while (next_partition (current_drive, 0xFFFFFF, &part, &type,           
-			 &start, &len, &offset, &entry,
-			 &ext_offset, &gpt_offset, &gpt_count, &gpt_size, mbr))
-    {
-	  /* The partition may not be a GPT partition.  */
-	  if (gpt_offset != 0)
-	    {
-		errnum = ERR_BAD_ARGUMENT;
-		return 1;
-	    }
 
-      if (part == current_partition)
-	{
-	  /* Found.  */
-	  if (hidden)
-	    PC_SLICE_TYPE (mbr, entry) |= PC_SLICE_TYPE_HIDDEN_FLAG;
-	  else
-	    PC_SLICE_TYPE (mbr, entry) &= ~PC_SLICE_TYPE_HIDDEN_FLAG;       
-	  
-	  /* Write back the MBR to the disk.  */
-	  buf_track = -1;
-	  if (! rawwrite (current_drive, offset, mbr))
-	    return 1;
-	  
-	  /* Succeed.  */
-	  return 0;
-	}
+  /* This is a EZD disk map sector 0 to sector 1, as rawread does.  */
+  if (sector == 0
+      && (PC_SLICE_TYPE (BUFFERADDR, 0) == PC_SLICE_TYPE_EZD
+	  || PC_SLICE_TYPE (BUFFERADDR, 1) == PC_SLICE_TYPE_EZD
+	  || PC_SLICE_TYPE (BUFFERADDR, 2) == PC_SLICE_TYPE_EZD
+	  || PC_SLICE_TYPE (BUFFERADDR, 3) == PC_SLICE_TYPE_EZD))
+    {
+      if (nsec < 2)
+	return 0;
+      memmove ((char *) BUFFERADDR,
+	       (char *) BUFFERADDR + buf_geom.sector_size,
+	       buf_geom.sector_size);
     }
-  
-  return 1;
-}
 
+  data = ((char *) DISK_CACHE_BUF
+	  + (victim - disk_cache) * DISK_CACHE_BLOCKLEN);
+  grub_memmove (data, (char *) BUFFERADDR, DISK_CACHE_BLOCKLEN);
+  iostat_add (moved, DISK_CACHE_BLOCKLEN);
+  victim->drive = drive;
+  victim->sector = sector;
+  victim->stamp = ++disk_cache_clock;
 
-static void
-check_and_print_mount (void)
-{
-  attempt_mount ();
-  if (errnum == ERR_FSYS_MOUNT)
-    errnum = ERR_NONE;
-  if (!errnum)
-    print_fsys_type ();
-  print_error ();
+  for (i = 1; i <= ahead; i++)
+    disk_cache_put (drive, sector + i * nsec,
+		    (char *) BUFFERADDR + i * DISK_CACHE_BLOCKLEN);
+
+  return data;
 }
-#endif /* STAGE1_5 */
 
+# if ! defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+/* The hard disks of 512-byte sectors, which are not a memdisk or a
+   loopback, a bit for each from 0x80 on.  This asks the BIOS, so it
+   must be done before int13_handler is set up.  */
+unsigned short
+int13_cache_disks (void)
+{
+  struct geometry geom;
+  unsigned short disks = 0;
+  int drive;
+
+  for (drive = 0x80; drive < 0x90; drive++)
+    if (drive != memdisk_drive && drive != loop_drive
+	&& ! get_diskinfo (drive, &geom)
+	&& geom.sector_size == SECTOR_SIZE
+	&& ! (geom.flags & BIOSDISK_FLAG_CDROM))
+      disks |= 1 << (drive - 0x80);
+
+  return disks;
+}
 
-/* Get the information on next partition on the drive DRIVE.
-   The caller must not modify the contents of the arguments when
-   iterating this function. The partition representation in GRUB will
-   be stored in *PARTITION. Likewise, the partition type in *TYPE, the
-   start sector in *START, the length in *LEN, the offset of the
-   partition table in *OFFSET, the entry number in the table in *ENTRY,
-   the offset of the extended partition in *EXT_OFFSET.
-   BUF is used to store a MBR, the boot sector of a partition, or
-   a BSD label sector, and it must be at least 512 bytes length.
-   When calling this function first, *PARTITION must be initialized to
-   0xFFFFFF. The return value is zero if fails, otherwise non-zero.  */
-int
-next_partition (unsigned long drive, unsigned long dest,
-		unsigned long *partition, int *type,
-		unsigned long *start, unsigned long *len,
-		unsigned long *offset, int *entry,
-               unsigned long *ext_offset,
-               unsigned long *gpt_offset, int *gpt_count,
-               int *gpt_size, char *buf)
+/* Set up the read cache of int13_handler at AREA, of CACHE_KB
+   kilobytes, for DISKS, and give it the blocks of those disks in the
+   disk cache, the most recently used first, so that what was booted
+   need not read again what GRUB read for it.  */
+void
+int13_cache_fill (unsigned long area, int cache_kb, unsigned short disks)
 {
-  /* Forward declarations.  */
-  auto int next_bsd_partition (void);
-  auto int next_pc_slice (void);
-  auto int next_gpt_slice(void);
+  unsigned short *header = (unsigned short *) (area + 0x400);
+  unsigned long *tag;
+  char *data = (char *) header + INT13_CACHE_TAGS;
+  int slots = cache_kb * 2, filled = 0;
+  unsigned long last = ~0UL;
+  int i, j;
 
-  /* Get next BSD partition in current PC slice.  */
-  int next_bsd_partition (void)
-    {
-      int i;
-      int bsd_part_no = (*partition & 0xFF00) >> 8;
+  if (slots > INT13_CACHE_MAX)
+    slots = INT13_CACHE_MAX;
 
-      /* If this is the first time...  */
-      if (bsd_part_no == 0xFF)
-	{
-	  /* Check if the BSD label is within current PC slice.  */
-	  if (*len < BSD_LABEL_SECTOR + 1)
-	    {
-	      errnum = ERR_BAD_PART_TABLE;
-	      return 0;
-	    }
+  grub_memset ((char *) header, 0, INT13_CACHE_TAGS);
+  header[0] = slots;
+  header[2] = disks;
 
-	  /* Read the BSD label.  */
-	  if (! rawread (drive, *start + BSD_LABEL_SECTOR,
-			 0, get_sector_size(drive), buf))
-	    return 0;
+  /* The handler may have been put over the disk cache.  */
+  if (area < DISK_CACHE_BUF + DISK_CACHE_BUFLEN)
+    return;
 
-	  /* Check if it is valid.  */
-	  if (! BSD_LABEL_CHECK_MAG (buf))
-	    {
-	      errnum = ERR_BAD_PART_TABLE;
-	      return 0;
-	    }
-	  
-	  bsd_part_no = -1;
-	}
+  while (filled < slots)
+    {
+      struct disk_cache_entry *e = 0;
 
-      /* Search next valid BSD partition.  */
-      for (i = bsd_part_no + 1; i < BSD_LABEL_NPARTS (buf); i++)
+      for (i = 0; i < DISK_CACHE_MAX; i++)
+	if (disk_cache[i].drive >= 0x80 && disk_cache[i].drive < 0x90
+	    && (disks & (1 << (disk_cache[i].drive - 0x80)))
+	    && disk_cache[i].stamp < last
+	    && (! e || disk_cache[i].stamp > e->stamp))
+	  e = disk_cache + i;
+
+      if (! e)
+	break;
+      last = e->stamp;
+
+      for (j = 0; j < DISK_CACHE_BLOCKLEN / SECTOR_SIZE && filled < slots; j++)
 	{
-	  if (BSD_PART_TYPE (buf, i))
-	    {
-	      /* Note that *TYPE and *PARTITION were set
-		 for current PC slice.  */
-	      *type = (BSD_PART_TYPE (buf, i) << 8) | (*type & 0xFF);
-	      *start = BSD_PART_START (buf, i);
-	      *len = BSD_PART_LENGTH (buf, i);
-	      *partition = (*partition & 0xFF00FF) | (i << 8);
+	  if (e->sector + j > 0xffffffffULL)
+	    break;
 
-#ifndef STAGE1_5
-	      /* XXX */
-	      if ((drive & 0x80) && BSD_LABEL_DTYPE (buf) == DTYPE_SCSI)
-		bsd_evil_hack = 4;
-#endif /* ! STAGE1_5 */
-	      
-	      return 1;
-	    }
+	  tag = (unsigned long *) ((char *) header + 8 + filled * 8);
+	  tag[0] = e->sector + j;
+	  tag[1] = e->drive | 0x100;
+	  grub_memmove (data + filled * SECTOR_SIZE,
+			(char *) DISK_CACHE_BUF
+			+ (e - disk_cache) * DISK_CACHE_BLOCKLEN
+			+ j * SECTOR_SIZE, SECTOR_SIZE);
+	  filled++;
 	}
+    }
 
-      errnum = ERR_NO_PART;
-      return 0;
-    }
-
-  /* Get next PC slice. Be careful of that this function may return
-     an empty PC slice (i.e. a partition whose type is zero) as well.  */
-  int next_pc_slice (void)
-    {
-      int pc_slice_no = (*partition & 0xFF0000) >> 16;
-
-      /* If this is the first time...  */
-      if (pc_slice_no == 0xFF)
-	{
-	  *offset = 0;
-	  *ext_offset = 0;
-	  *entry = -1;
-	  pc_slice_no = -1;
-	}
-
-      /* Read the MBR or the boot sector of the extended partition.  */
-      if (! rawread (drive, *offset, 0, get_sector_size(drive), buf))
-	return 0;
-
-      /* Check if it is valid.  */
-      if (! PC_MBR_CHECK_SIG (buf))
-	{
-	  errnum = ERR_BAD_PART_TABLE;
-	  return 0;
-	}
-
-      /* If this is a GPT partition table, read it as such.  */
-      if (*entry == -1 && *offset == 0 &&
-	  (PC_SLICE_TYPE (buf, 0) == PC_SLICE_TYPE_GPT ||
-	   PC_SLICE_TYPE (buf, 0) == PC_SLICE_TYPE_NONE))
-       {
-         struct grub_gpt_header *hdr = (struct grub_gpt_header *) buf;
-
-         /* Read in the GPT Partition table header.  */
-         if (! rawread (drive, 1, 0, get_sector_size(drive), buf))
-           return 0;
-
-         if (hdr->magic == GPT_HEADER_MAGIC && hdr->version == 0x10000)
-           {
-             /* Let gpt_offset point to the first entry in the GPT
-                partition table.  This can also be used by callers of
-                next_partition to determine if a entry comes from a
-                GPT partition table or not.  */
-             *gpt_offset = hdr->partitions;
-             *gpt_count = hdr->maxpart;
-             *gpt_size =  hdr->partentry_size;
-             
-             return next_gpt_slice();
-           }
-         else
-           {
-             /* This is not a valid header for a GPT partition table.
-                Re-read the MBR or the boot sector of the extended
-                partition.  */
-             if (! rawread (drive, *offset, 0, get_sector_size(drive), buf))
-               return 0;
-           }
-       }
-
-      /* Not a GPT partition.  */
-      *gpt_offset = 0;
+  header[1] = filled % slots;
+}
+# endif
 
-      /* Increase the entry number.  */
-      (*entry)++;
+/* Sequential reads.  The last few places read are remembered, and a
+   read that carries on from where one of them ended makes a stream of
+   it.  Once a stream is STREAM_TRIGGER reads long, rawread reads ahead
+   of it: in the background where the firmware can, and otherwise by
+   filling several disk cache blocks with one read.  The amount to read
+   ahead doubles with each further read, up to READAHEAD_LEN.  */
+#define STREAM_MAX	4
+#define STREAM_TRIGGER	2
+#define STREAM_WINDOW	(2 * DISK_CACHE_BLOCKLEN)
+
+struct stream
+{
+  int drive;
+  /* The last sector read.  */
+  sector_t last;
+  /* The number of reads in a row, and how many bytes to read ahead.  */
+  int count;
+  int window;
+  unsigned long stamp;
+};
 
-      /* If this is out of current partition table...  */
-      if (*entry == PC_SLICE_MAX)
-	{
-	  int i;
+static struct stream streams[STREAM_MAX] =
+{
+  [0 ... STREAM_MAX - 1] = { -1, 0, 0, 0, 0 }
+};
+static unsigned long stream_clock;
 
-	  /* Search the first extended partition in current table.  */
-	  for (i = 0; i < PC_SLICE_MAX; i++)
-	    {
-	      if (IS_PC_SLICE_TYPE_EXTENDED (PC_SLICE_TYPE (buf, i)))
-		{
-		  /* Found. Set the new offset and the entry number,
-		     and restart this function.  */
-		  *offset = *ext_offset + PC_SLICE_START (buf, i);
-		  if (! *ext_offset)
-		    *ext_offset = *offset;
-		  *entry = -1;
-		  return next_pc_slice ();
-		}
-	    }
+/* Find the stream a read of BYTE_LEN bytes from BYTE_OFFSET in SECTOR
+   of DRIVE carries on, or start a new one with it.  */
+static struct stream *
+stream_note (int drive, sector_t sector, int byte_offset, int byte_len,
+	     int sector_size_bits)
+{
+  sector_t first = sector + (byte_offset >> sector_size_bits);
+  struct stream *s, *victim = streams;
 
-	  errnum = ERR_NO_PART;
-	  return 0;
-	}
-      
-      *type = PC_SLICE_TYPE (buf, *entry);
-      *start = *offset + PC_SLICE_START (buf, *entry);
-      *len = PC_SLICE_LENGTH (buf, *entry);
+  for (s = streams; s < streams + STREAM_MAX; s++)
+    {
+      if (s->drive == drive && (first == s->last || first == s->last + 1))
+	break;
 
-      /* The calculation of a PC slice number is complicated, because of
-	 the rather odd definition of extended partitions. Even worse,
-	 there is no guarantee that this is consistent with every
-	 operating systems. Uggh.  */
-      if (pc_slice_no < PC_SLICE_MAX
-	  || (! IS_PC_SLICE_TYPE_EXTENDED (*type)
-	      && *type != PC_SLICE_TYPE_NONE))
-	pc_slice_no++;
-      
-      *partition = (pc_slice_no << 16) | 0xFFFF;
-      return 1;
+      if (s->stamp < victim->stamp)
+	victim = s;
     }
 
-  /* Get the next GPT slice.  */
-  int next_gpt_slice (void)
+  if (s == streams + STREAM_MAX)
     {
-      struct grub_gpt_partentry *gptentry = (struct grub_gpt_partentry *) buf;
-      /* Make GPT partitions show up as PC slices.  */
-      int pc_slice_no = (*partition & 0xFF0000) >> 16;
+      s = victim;
+      s->drive = drive;
+      s->count = 0;
+      s->window = STREAM_WINDOW;
+    }
+  else if (s->count < STREAM_TRIGGER)
+    s->count++;
+  else if (s->window < READAHEAD_LEN)
+    s->window <<= 1;
 
-      /* If this is the first time...  */
-      if (pc_slice_no == 0xFF)
-       {
-         pc_slice_no = -1;
-         *entry = -1;
-       }
+  s->last = sector + ((byte_offset + byte_len - 1) >> sector_size_bits);
+  s->stamp = ++stream_clock;
 
-      do {
-       (*entry)++;
+  return s;
+}
+#endif /* ! STAGE1_5 */
 
-       if (*entry >= *gpt_count)
-         {
-           errnum = ERR_NO_PART;
-           return 0;
-         }
-       /* Read in the GPT Partition table entry.  */
-       if (! rawread (drive, (*gpt_offset) + GPT_ENTRY_SECTOR (drive, *gpt_size, *entry), GPT_ENTRY_INDEX (drive, *gpt_size, *entry), *gpt_size, buf))
-         return 0;
-      } while (! (gptentry->type1 && gptentry->type2));
+static int
+read_sectors (int drive, sector_t sector, int byte_offset, int byte_len,
+	      char *buf)
+{
+  int slen, sectors_per_vtrack;
+  int sector_size_bits = buf_geom.sector_bits;
+#ifndef STAGE1_5
+  /* Small reads, such as the ones for filesystem metadata, go through
+     the disk cache, while larger ones bypass it so that they don't
+     flush it.  */
+  int use_cache = (disk_cache_size > 0
+		   && byte_offset + byte_len <= DISK_CACHE_BLOCKLEN);
+  struct stream *stream = 0;
+  int ahead = 0;
+#endif
 
-      pc_slice_no++;
-      *start = gptentry->start;
-      *len = gptentry->end - gptentry->start + 1;
-      *type = PC_SLICE_TYPE_EXT2FS;
-      *entry = pc_slice_no;
-      *partition = (*entry << 16) | 0xFFFF;
+  if (byte_len <= 0)
+    return 1;
 
+#ifndef STAGE1_5
+  if (disk_read_map_only && disk_read_func)
+    {
+      (*disk_read_func) (sector, byte_offset, byte_len);
       return 1;
     }
-
-  /* Start the body of this function.  */
-  
-#ifndef STAGE1_5
-  if (current_drive == NETWORK_DRIVE)
-    return 0;
 #endif
 
-  if (*partition != 0xFFFFFF && *gpt_offset != 0)
-    return next_gpt_slice ();
-
-  /* If previous partition is a BSD partition or a PC slice which
-     contains BSD partitions...  */
-  if ((*partition != 0xFFFFFF && IS_PC_SLICE_TYPE_BSD (*type & 0xff))
-      || ! (drive & 0x80))
+#if ! defined(STAGE1_5) && ! defined(GRUB_UTIL)
+  /* An image in memory needs neither the track buffer nor the cache,
+     but the file systems look at the geometry in BUF_GEOM.  */
+  if (drive == memdisk_drive)
     {
-      if (*type == PC_SLICE_TYPE_NONE)
-	*type = PC_SLICE_TYPE_FREEBSD;
-      
-      /* Get next BSD partition, if any.  */
-      if (next_bsd_partition ())
-	return 1;
-
-      /* If the destination partition is a BSD partition and current
-	 BSD partition has any error, abort the operation.  */
-      if ((dest & 0xFF00) != 0xFF00
-	  && ((dest & 0xFF0000) == 0xFF0000
-	      || (dest & 0xFF0000) == (*partition & 0xFF0000)))
+      if (buf_drive != drive && buf_geom_load (drive))
 	return 0;
-
-      /* Ignore the error.  */
-      errnum = ERR_NONE;
+      iostat_add (moved, byte_len);
+      return memdisk_read (sector, byte_offset, byte_len, buf);
     }
-	  
-  return next_pc_slice ();
-}
 
-#ifndef STAGE1_5
-static unsigned long cur_part_offset;
-static unsigned long cur_part_addr;
+  /* A file on another drive is read from there, a piece at a time.  */
+  if (drive == loop_drive)
+    return loop_read (sector, byte_offset, byte_len, buf);
 #endif
 
-/* Open a partition.  */
-int
-real_open_partition (int flags)
-{
-  unsigned long dest_partition = current_partition;
-  unsigned long part_offset;
-  unsigned long ext_offset;
-  unsigned long gpt_offset;
-  int gpt_count;
-  int gpt_size;
-  int entry;
-  char buf[4096];
-  int bsd_part, pc_slice;
-
-  /* For simplicity.  */
-  auto int next (void);
-  int next (void)
+#ifndef STAGE1_5
+  /* Without the geometry, the sectors cannot be told apart, so a new
+     drive starts no stream until its next read.  */
+  if (buf_drive == drive)
     {
-      int ret = next_partition (current_drive, dest_partition,
-				&current_partition, &current_slice,
-				&part_start, &part_length,
-                               &part_offset, &entry, &ext_offset,
-                               &gpt_offset, &gpt_count, &gpt_size, buf);
-      bsd_part = (current_partition >> 8) & 0xFF;
-      pc_slice = current_partition >> 16;
-      return ret;
+      stream = stream_note (drive, sector, byte_offset, byte_len,
+			    sector_size_bits);
+      if (stream->count >= STREAM_TRIGGER)
+	ahead = stream->window / DISK_CACHE_BLOCKLEN - 1;
     }
-  
+#endif
+
+  while (byte_len > 0 && !errnum)
+    {
+      int soff, num_sect, size = byte_len;
+      sector_t track;
+      char *bufaddr;
 #ifndef STAGE1_5
-  /* network drive */
-  if (current_drive == NETWORK_DRIVE)
-    return 1;
-  
-  if (! sane_partition ())
-    return 0;
+      char *cached;
+      int block_sects;
 #endif
 
-  bsd_evil_hack = 0;
-  current_slice = 0;
-  part_start = 0;
+      /*
+       *  Check track buffer.  If it isn't valid or it is from the
+       *  wrong disk, then reset the disk geometry.
+       */
+      if (buf_drive != drive)
+	{
+	  if (buf_geom_load (drive))
+	    return 0;
+	  sector_size_bits = buf_geom.sector_bits;
 
-  /* Make sure that buf_geom is valid. */
-  if (buf_drive != current_drive)
-    {
-      if (get_diskinfo (current_drive, &buf_geom))
+#ifndef STAGE1_5
+	  /* The user may have exchanged the media, or, in the grub
+	     shell, remapped the drive.  */
+# ifdef GRUB_UTIL
+	  disk_cache_invalidate (drive);
+# else
+	  if (! (drive & 0x80) || drive == cdrom_drive)
+	    disk_cache_invalidate (drive);
+# endif
+#endif /* ! STAGE1_5 */
+	}
+
+      /* Make sure that SECTOR is valid.  */
+      if (sector >= buf_geom.total_sectors)
 	{
-	  errnum = ERR_NO_DISK;
+	  errnum = ERR_GEOM;
 	  return 0;
 	}
-      buf_drive = current_drive;
-      buf_track = -1;
-    }
-  part_length = buf_geom.total_sectors;
 
-  /* If this is the whole disk, return here.  */
-  if (! flags && current_partition == 0xFFFFFF)
-    return 1;
+#ifndef STAGE1_5
+      /*
+       *  Read whole sectors directly into BUF, instead of copying them
+       *  from the track buffer one track at a time.  The sector 0 is
+       *  left to the track buffer because of the EZD mapping, and so
+       *  are the reads failing here, so that they are retried in
+       *  smaller pieces.
+       */
+      if (! use_cache && byte_offset == 0 && sector != 0
+	  && byte_len >= (2 << sector_size_bits))
+	{
+	  int nsec = byte_len >> sector_size_bits;
 
-  if (flags)
-    dest_partition = 0xFFFFFF;
+	  if (nsec > buf_geom.total_sectors - sector)
+	    nsec = buf_geom.total_sectors - sector;
 
-  /* Initialize CURRENT_PARTITION for next_partition.  */
-  current_partition = 0xFFFFFF;
-  
-  while (next ())
-    {
-#ifndef STAGE1_5
-    loop_start:
-      
-      cur_part_offset = part_offset;
-      cur_part_addr = BOOT_PART_TABLE + (entry << 4);
-#endif /* ! STAGE1_5 */
+	  /* grub_memmove would have checked this for the track buffer.  */
+	  if (! memcheck ((unsigned long) buf, nsec << sector_size_bits))
+	    return 0;
 
-      /* If this is a valid partition...  */
-      if (current_slice)
+	  buf_track = -1;
+	  iostat_add (disk_reads, 1);
+	  iostat_add (disk_bytes,
+		      (unsigned long long) nsec << sector_size_bits);
+	  if (! biosdisk_read (drive, &buf_geom, sector, nsec, buf))
+	    {
+	      if (disk_read_func)
+		{
+		  int i;
+
+		  for (i = 0; i < nsec; i++)
+		    (*disk_read_func) (sector + i, 0, buf_geom.sector_size);
+		}
+
+	      buf += nsec << sector_size_bits;
+	      byte_len -= nsec << sector_size_bits;
+	      sector += nsec;
+	      continue;
+	    }
+	}
+#else /* STAGE1_5 */
+      /*
+       *  Stage 2 is loaded into low memory, where the BIOS can put a
+       *  run of sectors itself, as many as an extended read takes at a
+       *  time, instead of a track buffer full at a time which is then
+       *  copied.  What fails here is left to the track buffer.
+       */
+      if (byte_offset == 0 && sector != 0
+	  && byte_len >= (2 << sector_size_bits)
+	  && (buf_geom.flags & BIOSDISK_FLAG_LBA_EXTENSION)
+	  && ! ((unsigned long) buf & 0xf)
+	  && (unsigned long) buf + byte_len <= 0xa0000)
+	{
+	  int nsec = byte_len >> sector_size_bits;
+
+	  if (nsec > (0xfe00 >> sector_size_bits))
+	    nsec = 0xfe00 >> sector_size_bits;
+	  if (nsec > buf_geom.total_sectors - sector)
+	    nsec = buf_geom.total_sectors - sector;
+
+	  if (! biosdisk (BIOSDISK_READ, drive, &buf_geom, sector, nsec,
+			  (unsigned long) buf >> 4))
+	    {
+	      if (disk_read_func)
+		{
+		  int i;
+
+		  for (i = 0; i < nsec; i++)
+		    (*disk_read_func) (sector + i, 0, buf_geom.sector_size);
+		}
+
+	      buf += nsec << sector_size_bits;
+	      byte_len -= nsec << sector_size_bits;
+	      sector += nsec;
+	      continue;
+	    }
+	}
+#endif /* STAGE1_5 */
+
+      slen = ((byte_offset + byte_len + buf_geom.sector_mask)
+	      >> sector_size_bits);
+      sectors_per_vtrack = buf_geom.vtrack_sectors;
+      
+      if (buf_geom.flags & BIOSDISK_FLAG_LBA_EXTENSION)
+	{
+	  /* With linear addressing there are no tracks to keep to, so
+	     the track buffer holds the sectors from BUF_TRACK on, and a
+	     read that misses it refills it from SECTOR.  */
+	  if (sector >= buf_track
+	      && sector - buf_track < (sector_t) sectors_per_vtrack)
+	    track = buf_track;
+	  else
+	    track = sector;
+	  soff = sector - track;
+	}
+      else
 	{
+	  /* Get the first sector of track.  A disk addressed by C/H/S
+	     is far too small for the sector not to fit in a long.  */
+	  soff = (unsigned long) sector % sectors_per_vtrack;
+	  track = sector - soff;
+	}
+      num_sect = sectors_per_vtrack - soff;
+      bufaddr = ((char *) BUFFERADDR
+		 + (soff << sector_size_bits) + byte_offset);
+
 #ifndef STAGE1_5
-	  /* Display partition information.  */
-	  if (flags && ! IS_PC_SLICE_TYPE_EXTENDED (current_slice))
+      block_sects = DISK_CACHE_BLOCKLEN >> sector_size_bits;
+      if (use_cache && buf_geom.sector_size <= DISK_CACHE_BLOCKLEN
+	  && (cached = disk_cache_get (drive, sector & ~(sector_t) (block_sects - 1),
+				       sector_size_bits, ahead)))
+	{
+	  soff = sector & (block_sects - 1);
+	  num_sect = block_sects - soff;
+	  bufaddr = cached + (soff << sector_size_bits) + byte_offset;
+	}
+      else
+#endif /* ! STAGE1_5 */
+      if (track != buf_track)
+	{
+	  int bios_err, read_len = sectors_per_vtrack;
+	  sector_t read_start = track;
+
+	  /*
+	   *  If there's more than one read in this entire loop, then
+	   *  only make the earlier reads for the portion needed.  This
+	   *  saves filling the buffer with data that won't be used!
+	   */
+	  if (slen > num_sect)
 	    {
-	      if (! do_completion)
+	      read_start = sector;
+	      read_len = num_sect;
+	      bufaddr = (char *) BUFFERADDR + byte_offset;
+	    }
+
+	  /* The last track of a disk addressed linearly may be short.  */
+	  if (read_len > buf_geom.total_sectors - read_start)
+	    read_len = buf_geom.total_sectors - read_start;
+
+	  bios_err = read_track (drive, read_start, read_len);
+	  if (bios_err)
+	    {
+	      buf_track = -1;
+
+	      if (bios_err == BIOSDISK_ERROR_GEOMETRY)
+		errnum = ERR_GEOM;
+	      else
 		{
-		  if (current_drive & 0x80)
-		    grub_printf ("   Partition num: %d, ",
-				 current_partition >> 16);
+		  /*
+		   *  If there was an error, try to load only the
+		   *  required sector(s) rather than failing completely.
+		   */
+		  if (slen > num_sect || read_track (drive, sector, slen))
+		    errnum = ERR_READ;
 
-		  if (! IS_PC_SLICE_TYPE_BSD (current_slice))
-		    check_and_print_mount ();
-		  else
-		    {
-		      int got_part = 0;
-		      int saved_slice = current_slice;
-		      
-		      while (next ())
-			{
-			  if (bsd_part == 0xFF)
-			    break;
-			  
-			  if (! got_part)
-			    {
-			      grub_printf ("[BSD sub-partitions immediately follow]\n");
-			      got_part = 1;
-			    }
-			  
-			  grub_printf ("     BSD Partition num: \'%c\', ",
-				       bsd_part + 'a');
-			  check_and_print_mount ();
-			}
+		  bufaddr = (char *) BUFFERADDR + byte_offset;
+		}
+	    }
+	  else
+	    buf_track = track;
 
-		      if (! got_part)
-			grub_printf (" No BSD sub-partition found, partition type 0x%x\n",
-				     saved_slice);
-		      
-		      if (errnum)
-			{
-			  errnum = ERR_NONE;
-			  break;
-			}
-		      
-		      goto loop_start;
-		    }
+	  if ((buf_track == 0 || sector == 0)
+	      && (PC_SLICE_TYPE (BUFFERADDR, 0) == PC_SLICE_TYPE_EZD
+		  || PC_SLICE_TYPE (BUFFERADDR, 1) == PC_SLICE_TYPE_EZD
+		  || PC_SLICE_TYPE (BUFFERADDR, 2) == PC_SLICE_TYPE_EZD
+		  || PC_SLICE_TYPE (BUFFERADDR, 3) == PC_SLICE_TYPE_EZD))
+	    {
+	      /* This is a EZD disk map sector 0 to sector 1 */
+	      if (buf_track == 0 || slen >= 2)
+		{
+		  /* We already read the sector 1, copy it to sector 0 */
+		  memmove ((char *) BUFFERADDR, 
+			   (char *) BUFFERADDR + buf_geom.sector_size,
+			   buf_geom.sector_size);
 		}
 	      else
 		{
-		  if (bsd_part != 0xFF)
-		    {
-		      char str[16];
-		      
-		      if (! (current_drive & 0x80)
-			  || (dest_partition >> 16) == pc_slice)
-			grub_sprintf (str, "%c)", bsd_part + 'a');
-		      else
-			grub_sprintf (str, "%d,%c)",
-				      pc_slice, bsd_part + 'a');
-		      print_a_completion (str);
-		    }
-		  else if (! IS_PC_SLICE_TYPE_BSD (current_slice))
-		    {
-		      char str[8];
-		      
-		      grub_sprintf (str, "%d)", pc_slice);
-		      print_a_completion (str);
-		    }
+		  if (read_track (drive, 1, 1))
+		    errnum = ERR_READ;
 		}
 	    }
-	  
-	  errnum = ERR_NONE;
-#endif /* ! STAGE1_5 */
-	  
-	  /* Check if this is the destination partition.  */
-	  if (! flags
-	      && (dest_partition == current_partition
-		  || ((dest_partition >> 16) == 0xFF
-		      && ((dest_partition >> 8) & 0xFF) == bsd_part)))
-	    return 1;
 	}
-    }
+	  
+      if (size > ((num_sect << sector_size_bits) - byte_offset))
+	size = (num_sect << sector_size_bits) - byte_offset;
 
-#ifndef STAGE1_5
-  if (flags)
-    {
-      if (! (current_drive & 0x80))
+      /*
+       *  Instrumentation to tell which sectors were read and used.
+       */
+      if (disk_read_func)
 	{
-	  current_partition = 0xFFFFFF;
-	  check_and_print_mount ();
+	  int sector_num = sector;
+	  int length = buf_geom.sector_size - byte_offset;
+	  if (length > size)
+	    length = size;
+	  (*disk_read_func) (sector_num++, byte_offset, length);
+	  length = size - length;
+	  if (length > 0)
+	    {
+	      while (length > buf_geom.sector_size)
+		{
+		  (*disk_read_func) (sector_num++, 0, buf_geom.sector_size);
+		  length -= buf_geom.sector_size;
+		}
+	      (*disk_read_func) (sector_num, 0, length);
+	    }
 	}
-      
-      errnum = ERR_NONE;
-      return 1;
+
+      grub_memmove (buf, bufaddr, size);
+#ifndef STAGE1_5
+      iostat_add (moved, size);
+#endif
+
+      buf += size;
+      byte_len -= size;
+      sector += num_sect;
+      byte_offset = 0;
     }
-#endif /* ! STAGE1_5 */
-  
-  return 0;
-}
 
+#if ! defined(STAGE1_5) && defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  if (stream && stream->count >= STREAM_TRIGGER && ! errnum)
+    biosdisk_readahead (drive, stream->last + 1,
+			stream->window >> sector_size_bits);
+#endif
 
-int
-open_partition (void)
-{
-  return real_open_partition (0);
+  return (!errnum);
 }
 
-#if !defined(PLATFORM_EFI) && !defined(GRUB_UTIL)
-int get_sector_size (int drive)
-{
-  return SECTOR_SIZE;
-}
-int get_sector_bits (int drive)
+int
+rawread (int drive, sector_t sector, int byte_offset, int byte_len,
+	 char *buf)
 {
-  return SECTOR_BITS;
+#ifndef STAGE1_5
+  unsigned long long start = bootprof_now ();
+  int ret = read_sectors (drive, sector, byte_offset, byte_len, buf);
+
+  iostat_add (rawreads, 1);
+  if (byte_len > 0)
+    iostat_add (bytes, byte_len);
+  iostat_add (cycles, bootprof_now () - start);
+  return ret;
+#else
+  return read_sectors (drive, sector, byte_offset, byte_len, buf);
+#endif
 }
-#endif /* !defined(PLATFORM_EFI) && !defined(GRUB_UTIL) */
 
 
-#ifndef STAGE1_5
-/* XX used for device completion in 'set_device' and 'print_completions' */
-static int incomplete, disk_choice;
-static enum
+int
+devread (int sector, int byte_offset, int byte_len, char *buf)
 {
-  PART_UNSPECIFIED = 0,
-  PART_DISK,
-  PART_CHOSEN,
-}
-part_choice;
-#endif /* ! STAGE1_5 */
+  int bits = current_sector_bits ();
 
-char *
-set_device (char *device)
-{
-#ifdef STAGE1_5
-    /* In Stage 1.5, the first 4 bytes of FILENAME has a device number.  */
-  unsigned long dev = *((unsigned long *) device);
-  int drive = (dev >> 24) & 0xFF;
-  int partition = dev & 0xFFFFFF;
+  /*
+   *  Check partition boundaries
+   */
+  if (sector < 0
+      || ((sector + ((byte_offset + byte_len - 1) >> bits))
+	  >= part_length))
+    {
+      errnum = ERR_OUTSIDE_PART;
+      return 0;
+    }
 
-  /* If DRIVE is disabled, use SAVED_DRIVE instead.  */
-  if (drive == GRUB_INVALID_DRIVE)
-    current_drive = saved_drive;
-  else
-    current_drive = drive;
+  /*
+   *  Get the read to the beginning of a partition.
+   */
+  sector += byte_offset >> bits;
+  byte_offset &= (1 << bits) - 1;
 
-  /* The `partition' part must always have a valid number.  */
-  current_partition = partition;
-  
-  return device + sizeof (unsigned long);
-  
-#else /* ! STAGE1_5 */
-  
-  int result = 0;
+#if !defined(STAGE1_5)
+  if (disk_read_hook && debug)
+    printf ("<%d, %d, %d>", sector, byte_offset, byte_len);
+#endif /* !STAGE1_5 */
 
-  incomplete = 0;
-  disk_choice = 1;
-  part_choice = PART_UNSPECIFIED;
-  current_drive = saved_drive;
-  current_partition = 0xFFFFFF;
+  /*
+   *  Call RAWREAD, which is very similar, but:
+   *
+   *    --  It takes an extra parameter, the drive number.
+   *    --  It requires that "sector" is relative to the beginning
+   *            of the disk.
+   *    --  It doesn't handle offsets of more than a sector into the
+   *            sector.
+   */
+  return rawread (current_drive, part_start + sector, byte_offset,
+		  byte_len, buf);
+}
 
-  if (*device == '(' && !*(device + 1))
-    /* user has given '(' only, let disk_choice handle what disks we have */
-    return device + 1;
+/* Read LEN bytes of the current file from FILEPOS on into BUF, for a
+   file system whose blocks are 1 << BLOCK_BITS bytes, and return how
+   many were read.  MAP is asked for the run of blocks from a logical
+   block on: it shortens *RUN, the number of blocks wanted, to how many
+   follow each other on the disk, and returns the sector the first one
+   starts at, zero if they are a hole, or -1 at the end of the file or
+   on an error.  Each run is read with one devread, holes are filled
+   with zeros, and the run after the last one read is asked for ahead
+   of time.  */
+int
+fsys_read_extents (char *buf, int len, int block_bits,
+		   int (*map) (int block, int *run))
+{
+  int block, offset, run, sector, size, ret = 0;
 
-  if (*device == '(' && *(++device))
+  while (len > 0)
     {
-      if (*device != ',' && *device != ')')
+      block = filepos >> block_bits;
+      offset = filepos & ((1 << block_bits) - 1);
+      run = ((offset + len - 1) >> block_bits) + 1;
+      sector = map (block, &run);
+      if (sector < 0)
+	break;
+
+      size = (run << block_bits) - offset;
+      if (size > len)
+	size = len;
+
+      if (sector == 0)
 	{
-	  char ch = *device;
-#if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
-	  if (*device == 'f' || *device == 'h'
-	      || (*device == 'n' && network_ready)
-	      || (*device == 'c' && cdrom_drive != GRUB_INVALID_DRIVE))
-#else
-	  if (*device == 'f' || *device == 'h'
-	      || (*device == 'c' && cdrom_drive != GRUB_INVALID_DRIVE))
-#endif /* SUPPORT_NETBOOT */
+#ifndef STAGE1_5
+	  if (disk_read_map_only)
 	    {
-	      /* user has given '([fhn]', check for resp. add 'd' and
-		 let disk_choice handle what disks we have */
-	      if (!*(device + 1))
-		{
-		  device++;
-		  *device++ = 'd';
-		  *device = '\0';
-		  return device;
-		}
-	      else if (*(device + 1) == 'd' && !*(device + 2))
-		return device + 2;
+	      if (disk_read_hook)
+		(*disk_read_hook) (-1, 0, size);
 	    }
-
-	  if ((*device == 'f'
-	       || *device == 'h'
-#if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
-	       || (*device == 'n' && network_ready)
-#endif
-	       || (*device == 'c' && cdrom_drive != GRUB_INVALID_DRIVE))
-	      && (device += 2, (*(device - 1) != 'd')))
-	    errnum = ERR_NUMBER_PARSING;
-
-#if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
-	  if (ch == 'n' && network_ready)
-	    current_drive = NETWORK_DRIVE;
 	  else
-#endif /* SUPPORT_NETBOOT */
-	    {
-	      if (ch == 'c' && cdrom_drive != GRUB_INVALID_DRIVE)
-		current_drive = cdrom_drive;
-	      else
-		{
-		  safe_parse_maxint (&device, (int *) &current_drive);
-		  
-		  disk_choice = 0;
-		  if (ch == 'h')
-		    current_drive += 0x80;
-		}
-	    }
+#endif
+	    memset (buf, 0, size);
+	}
+      else
+	{
+	  disk_read_func = disk_read_hook;
+	  devread (sector, offset, size, buf);
+	  disk_read_func = NULL;
+	  if (errnum)
+	    break;
 	}
 
-      if (errnum)
-	return 0;
+      buf += size;
+      len -= size;
+      filepos += size;
+      ret += size;
+    }
 
-      if (*device == ')')
+#ifndef STAGE1_5
+  /* Whoever reads this far into a file is likely to read on, so let
+     the disk fetch the next run of it meanwhile.  */
+  if (ret && ! errnum && filepos < filemax && ! disk_read_map_only
+      && readahead_possible ())
+    {
+      block = filepos >> block_bits;
+      offset = filepos & ((1 << block_bits) - 1);
+      size = filemax - filepos;
+      if (size > READAHEAD_LEN)
+	size = READAHEAD_LEN;
+      run = ((offset + size - 1) >> block_bits) + 1;
+      sector = map (block, &run);
+      if (sector > 0)
 	{
-	  part_choice = PART_CHOSEN;
-	  result = 1;
+	  if (size > (run << block_bits) - offset)
+	    size = (run << block_bits) - offset;
+	  devreadahead (sector, offset, size);
 	}
-      else if (*device == ',')
-	{
-	  /* Either an absolute PC or BSD partition. */
-	  disk_choice = 0;
-	  part_choice ++;
-	  device++;
-
-	  if (*device >= '0' && *device <= '9')
-	    {
-	      part_choice ++;
-	      current_partition = 0;
 
-	      if (!(current_drive & 0x80)
-		  || !safe_parse_maxint (&device, (int *) &current_partition)
-		  || current_partition > 254)
-		{
-		  errnum = ERR_DEV_FORMAT;
-		  return 0;
-		}
+      /* It was only a hint, so whatever went wrong did not happen.  */
+      errnum = ERR_NONE;
+    }
+#endif /* ! STAGE1_5 */
 
-	      current_partition = (current_partition << 16) + 0xFFFF;
+  return errnum ? 0 : ret;
+}
 
-	      if (*device == ',')
-		device++;
-	      
-	      if (*device >= 'a' && *device <= 'h')
-		{
-		  current_partition = (((*(device++) - 'a') << 8)
-				       | (current_partition & 0xFF00FF));
-		}
-	    }
-	  else if (*device >= 'a' && *device <= 'h')
-	    {
-	      part_choice ++;
-	      current_partition = ((*(device++) - 'a') << 8) | 0xFF00FF;
-	    }
+#ifndef STAGE1_5
+void
+disk_read_report (sector_t sector, int byte_offset, int byte_len,
+		  int sector_bits)
+{
+  int sector_size = 1 << sector_bits;
+  int length;
 
-	  if (*device == ')')
-	    {
-	      if (part_choice == PART_DISK)
-		{
-		  current_partition = saved_partition;
-		  part_choice ++;
-		}
+  sector += byte_offset >> sector_bits;
+  byte_offset &= sector_size - 1;
 
-	      result = 1;
-	    }
-	}
-    }
+  length = sector_size - byte_offset;
+  if (length > byte_len)
+    length = byte_len;
+  (*disk_read_func) (sector++, byte_offset, length);
 
-  if (! sane_partition ())
-    return 0;
-  
-  if (result)
-    return device + 1;
-  else
+  for (byte_len -= length; byte_len > 0; byte_len -= length)
     {
-      if (!*device)
-	incomplete = 1;
-      errnum = ERR_DEV_FORMAT;
+      length = byte_len < sector_size ? byte_len : sector_size;
+      (*disk_read_func) (sector++, 0, length);
     }
+}
 
+/* Return non-zero if the current drive can read ahead in the
+   background, so that file systems need not work out what to ask
+   devreadahead for when it would be of no use.  */
+int
+readahead_possible (void)
+{
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  return biosdisk_readahead (current_drive, 0, 0);
+#else
   return 0;
-  
-#endif /* ! STAGE1_5 */
+#endif
 }
 
-/*
- *  This performs a "mount" on the current device, both drive and partition
- *  number.
- */
-
-int
-open_device (void)
+/* Tell the disk that BYTE_LEN bytes from BYTE_OFFSET in SECTOR of the
+   current partition are likely to be read soon, like devread.  This is
+   only a hint, so nothing is checked or reported.  */
+void
+devreadahead (int sector, int byte_offset, int byte_len)
 {
-  if (open_partition ())
-    attempt_mount ();
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  int bits = current_sector_bits ();
+  int nsec;
 
-  if (errnum != ERR_NONE)
-    return 0;
+  if (sector < 0 || byte_offset < 0 || byte_len <= 0)
+    return;
 
-  return 1;
-}
+  sector += byte_offset >> bits;
+  byte_offset &= (1 << bits) - 1;
+  if (sector >= part_length)
+    return;
 
+  nsec = (byte_offset + byte_len + (1 << bits) - 1) >> bits;
+  if (nsec > part_length - sector)
+    nsec = part_length - sector;
+
+  biosdisk_readahead (current_drive, part_start + sector, nsec);
+#endif
+}
 
-#ifndef STAGE1_5
 int
-set_bootdev (int hdbias)
+rawwrite (int drive, sector_t sector, char *buf)
 {
-  int i, j;
-
-  /* Copy the boot partition information to 0x7be-0x7fd for chain-loading.  */
-  if ((saved_drive & 0x80) && cur_part_addr)
+  if (sector == 0)
     {
-      if (rawread (saved_drive, cur_part_offset,
-		   0, get_sector_size(saved_drive), (char *) SCRATCHADDR))
+      if (biosdisk (BIOSDISK_READ, drive, &buf_geom, 0, 1, SCRATCHSEG))
 	{
-	  char *dst, *src;
-      
-	  /* Need only the partition table.
-	     XXX: We cannot use grub_memmove because BOOT_PART_TABLE
-	     (0x07be) is less than 0x1000.  */
-	  dst = (char *) BOOT_PART_TABLE;
-	  src = (char *) SCRATCHADDR + BOOTSEC_PART_OFFSET;
-	  while (dst < (char *) BOOT_PART_TABLE + BOOTSEC_PART_LENGTH)
-	    *dst++ = *src++;
-	  
-	  /* Set the active flag of the booted partition.  */
-	  for (i = 0; i < 4; i++)
-	    PC_SLICE_FLAG (BOOT_PART_TABLE, i) = 0;
-	  
-	  *((unsigned char *) cur_part_addr) = PC_SLICE_FLAG_BOOTABLE;
-	  boot_part_addr = cur_part_addr;
+	  errnum = ERR_WRITE;
+	  return 0;
 	}
-      else
-	return 0;
+
+      if (PC_SLICE_TYPE (SCRATCHADDR, 0) == PC_SLICE_TYPE_EZD
+	  || PC_SLICE_TYPE (SCRATCHADDR, 1) == PC_SLICE_TYPE_EZD
+	  || PC_SLICE_TYPE (SCRATCHADDR, 2) == PC_SLICE_TYPE_EZD
+	  || PC_SLICE_TYPE (SCRATCHADDR, 3) == PC_SLICE_TYPE_EZD)
+	sector = 1;
     }
   
-  /*
-   *  Set BSD boot device.
-   */
-  i = (saved_partition >> 16) + 2;
-  if (saved_partition == 0xFFFFFF)
-    i = 1;
-  else if ((saved_partition >> 16) == 0xFF)
-    i = 0;
+  memmove ((char *) SCRATCHADDR, buf, get_sector_size(drive));
+  if (biosdisk (BIOSDISK_WRITE, drive, &buf_geom,
+		sector, 1, SCRATCHSEG))
+    {
+      errnum = ERR_WRITE;
+      return 0;
+    }
 
-  /* FIXME: extremely evil hack!!! */
-  j = 2;
-  if (saved_drive & 0x80)
-    j = bsd_evil_hack;
+  /* Clear the cache.  The track buffer may hold SECTOR whichever way
+     it was filled, and writes are rare enough not to work it out.  */
+  buf_track = -1;
+  disk_cache_invalidate (drive);
 
-  return MAKEBOOTDEV (j, (i >> 4), (i & 0xF),
-		      ((saved_drive - hdbias) & 0x7F),
-		      ((saved_partition >> 8) & 0xFF));
+  return 1;
 }
-#endif /* STAGE1_5 */
 
-
-static char *
-setup_part (char *filename)
+int
+devwrite (int sector, int sector_count, char *buf)
 {
-#ifdef STAGE1_5
-
-  if (! (filename = set_device (filename)))
-    {
-      current_drive = GRUB_INVALID_DRIVE;
-      return 0;
-    }
-  
-# ifndef NO_BLOCK_FILES
-  if (*filename != '/')
-    open_partition ();
-  else
-# endif /* ! NO_BLOCK_FILES */
-    open_device ();
-  
-#else /* ! STAGE1_5 */
-  
-  if (*filename == '(')
+#if defined(GRUB_UTIL) && defined(__linux__)
+  if (current_partition != 0xFFFFFF
+      && is_disk_device (device_map, current_drive))
     {
-      if ((filename = set_device (filename)) == 0)
+      /* If the grub shell is running under Linux and the user wants to
+	 embed a Stage 1.5 into a partition instead of a MBR, use system
+	 calls directly instead of biosdisk, because of the bug in
+	 Linux. *sigh*  */
+      int ret;
+      ret = write_to_partition (device_map, current_drive, current_partition,
+				sector, sector_count, buf);
+      if (ret != -1)
 	{
-	  current_drive = GRUB_INVALID_DRIVE;
-	  return 0;
+	  disk_cache_invalidate (current_drive);
+	  return ret;
 	}
-# ifndef NO_BLOCK_FILES
-      if (*filename != '/')
-	open_partition ();
-      else
-# endif /* ! NO_BLOCK_FILES */
-	open_device ();
     }
-  else if (saved_drive != current_drive
-	   || saved_partition != current_partition
-	   || (*filename == '/' && fsys_type == NUM_FSYS)
-	   || buf_drive == -1)
+#endif /* GRUB_UTIL && __linux__ */
+  sector_t start = part_start + sector;
+
+  if (sector_count <= 0)
+    return 1;
+
+  /* The sector 0 may be mapped by EZD, which only rawwrite knows.  */
+  if (start == 0)
     {
-      current_drive = saved_drive;
-      current_partition = saved_partition;
-      /* allow for the error case of "no filesystem" after the partition
-         is found.  This makes block files work fine on no filesystem */
-# ifndef NO_BLOCK_FILES
-      if (*filename != '/')
-	open_partition ();
-      else
-# endif /* ! NO_BLOCK_FILES */
-	open_device ();
+      if (! rawwrite (current_drive, 0, buf))
+	return 0;
+
+      start++;
+      buf += 1 << current_sector_bits ();
+      if (! --sector_count)
+	return 1;
     }
-  
-#endif /* ! STAGE1_5 */
-  
-  if (errnum && (*filename == '/' || errnum != ERR_FSYS_MOUNT))
-    return 0;
-  else
-    errnum = 0;
 
-#ifndef STAGE1_5
-  if (!sane_partition ())
-    return 0;
-#endif
+  /* Write the rest with as few calls as the disk takes.  */
+  buf_track = -1;
+  if (biosdisk_write (current_drive, &buf_geom, start, sector_count, buf))
+    {
+      errnum = ERR_WRITE;
+      return 0;
+    }
 
-  return filename;
+  disk_cache_invalidate (current_drive);
+  return 1;
 }
 
+static int
+sane_partition (void)
+{
+  /* network drive */
+  if (current_drive == NETWORK_DRIVE)
+    return 1;
+  
+  if (!(current_partition & 0xFF000000uL)
+      && ((current_drive & 0xFFFFFF7F) < MAX_HD_NUM
+	  || current_drive == cdrom_drive)
+      && (current_partition & 0xFF) == 0xFF
+      && ((current_partition & 0xFF00) == 0xFF00
+	  || (current_partition & 0xFF00) < 0x800)
+      && ((current_partition >> 16) == 0xFF
+	  || (current_drive & 0x80)))
+    return 1;
 
-#ifndef STAGE1_5
-char *
-get_fsys_type (void)
+  errnum = ERR_DEV_VALUES;
+  return 0;
+}
+
+/* The mount cache.  Going from one partition to another and back, as
+   `find' does, or an entry whose files are on two of them, would have
+   every file system probed for each again, and the one found read its
+   superblock again, since FSYS_BUF holds only one.  So what a partition
+   was found to have is kept, and for the file systems listed here, the
+   part of FSYS_BUF where they keep what their mount function read as
+   well.  Putting it back and calling the remount function, which does
+   no I/O, mounts the partition again.  Any other file system found is
+   the only one whose mount function is called.  Whatever changes the
+   disks empties the cache, by way of DISK_CACHE_GENERATION.  Since each
+   entry takes over 1KB of the bss, below the protected mode stack, only
+   a few partitions are kept.  */
+#define MOUNT_CACHE_MAX		8
+#define MOUNT_STATE_MAX		1024
+
+struct fsys_state
 {
-    return fsys_table[fsys_type].name;
+  int (*mount_func) (void);
+  int (*remount_func) (void);
+  int offset;
+  int len;
+};
+
+static struct fsys_state fsys_states[] =
+{
+# ifdef FSYS_FAT
+  /* FAT_SUPER */
+  {fat_mount, fat_remount, 32256, 512},
+# endif
+# ifdef FSYS_EXT2FS
+  /* SUPERBLOCK */
+  {ext2fs_mount, ext2fs_remount, 0, 1024},
+# endif
+  {0, 0, 0, 0}
+};
+
+struct mount_cache_entry
+{
+  unsigned long drive;
+  unsigned long partition;
+  sector_t start;
+  sector_t length;
+  unsigned long generation;
+  /* The file system found, or NUM_FSYS if there was none.  */
+  int fsys;
+  /* The value of MOUNT_CACHE_CLOCK when this entry was used last, or
+     zero if it is unused.  */
+  unsigned long stamp;
+  char state[MOUNT_STATE_MAX];
+};
+
+static struct mount_cache_entry mount_cache[MOUNT_CACHE_MAX];
+static unsigned long mount_cache_clock;
+
+/* Whether the current drive is one whose media stays.  A floppy or a
+   CD-ROM can be changed without anything telling.  */
+static int
+mount_cache_usable (void)
+{
+  return ((current_drive & 0x80) && current_drive != NETWORK_DRIVE
+	  && current_drive != cdrom_drive);
 }
 
-/*
- *  This prints the filesystem type or gives relevant information.
- */
+/* Return how the file system whose mount function is MOUNT_FUNC may be
+   mounted again, or zero if it can't be.  */
+static struct fsys_state *
+fsys_state (int (*mount_func) (void))
+{
+  struct fsys_state *s;
 
-void
-print_fsys_type (void)
+  for (s = fsys_states; s->mount_func; s++)
+    if (s->mount_func == mount_func)
+      return s;
+
+  return 0;
+}
+
+/* Return the entry for the current partition, or zero.  */
+static struct mount_cache_entry *
+mount_cache_find (void)
 {
-  if (! do_completion)
+  int i;
+
+  if (! mount_cache_usable ())
+    return 0;
+
+  for (i = 0; i < MOUNT_CACHE_MAX; i++)
     {
-      printf (" Filesystem type ");
-      
-      if (fsys_type != NUM_FSYS)
-	printf ("is %s, ", fsys_table[fsys_type].name);
-      else
-	printf ("unknown, ");
-      
-      if (current_partition == 0xFFFFFF)
-	printf ("using whole disk\n");
-      else
-	printf ("partition type 0x%x\n", current_slice & 0xFF);
+      struct mount_cache_entry *entry = &mount_cache[i];
+
+      if (entry->stamp && entry->drive == current_drive
+	  && entry->partition == current_partition
+	  && entry->start == part_start && entry->length == part_length
+	  && entry->generation == disk_cache_generation)
+	return entry;
     }
+
+  return 0;
 }
-#endif /* STAGE1_5 */
 
-#ifndef STAGE1_5
-/* If DO_COMPLETION is true, just print NAME. Otherwise save the unique
-   part into UNIQUE_STRING.  */
-void
-print_a_completion (char *name)
+/* Remember what attempt_mount found in the current partition.  */
+static void
+mount_cache_add (void)
 {
-  /* If NAME is "." or "..", do not count it.  */
-  if (grub_strcmp (name, ".") == 0 || grub_strcmp (name, "..") == 0)
+  struct mount_cache_entry *entry;
+  struct fsys_state *s = 0;
+  int i;
+
+  if (! mount_cache_usable ())
     return;
-  
-  if (do_completion)
+
+  entry = mount_cache_find ();
+  if (! entry)
     {
-      char *buf = unique_string;
-      
-      if (! unique)
-	while ((*buf++ = *name++))
-	  ;
-      else
-	{
-	  while (*buf && (*buf == *name))
-	    {
-	      buf++;
-	      name++;
-	    }
-	  /* mismatch, strip it.  */
-	  *buf = '\0';
-	}
+      entry = &mount_cache[0];
+      for (i = 1; i < MOUNT_CACHE_MAX; i++)
+	if (mount_cache[i].stamp < entry->stamp)
+	  entry = &mount_cache[i];
     }
-  else
-    grub_printf (" %s", name);
-  
-  unique++;
-}
 
-/*
- *  This lists the possible completions of a device string, filename, or
- *  any sane combination of the two.
- */
+  entry->drive = current_drive;
+  entry->partition = current_partition;
+  entry->start = part_start;
+  entry->length = part_length;
+  entry->generation = disk_cache_generation;
+  entry->fsys = fsys_type;
+  entry->stamp = ++mount_cache_clock;
+
+  if (fsys_type != NUM_FSYS)
+    s = fsys_state (fsys_table[fsys_type].mount_func);
+  if (s)
+    grub_memmove (entry->state, (char *) FSYS_BUF + s->offset, s->len);
+}
 
-int
-print_completions (int is_filename, int is_completion)
+/* Mount the current partition as it was before, if it is in the
+   cache.  Return nonzero if it is, with FSYS_TYPE set, and ERRNUM if
+   it has no file system.  */
+static int
+mount_cache_mount (void)
 {
-  char *buf = (char *) COMPLETION_BUF;
-  char *ptr = buf;
+  struct mount_cache_entry *entry = mount_cache_find ();
+  struct fsys_state *s;
 
-  unique_string = (char *) UNIQUE_BUF;
-  *unique_string = 0;
-  unique = 0;
-  do_completion = is_completion;
+  if (! entry)
+    return 0;
 
-  if (! is_filename)
+  entry->stamp = ++mount_cache_clock;
+  fsys_type = entry->fsys;
+  if (fsys_type == NUM_FSYS)
     {
-      /* Print the completions of builtin commands.  */
-      struct builtin **builtin;
+      errnum = ERR_FSYS_MOUNT;
+      return 1;
+    }
 
-      if (! is_completion)
-	grub_printf (" Possible commands are:");
-      
-      for (builtin = builtin_table; (*builtin); builtin++)
-	{
-	  /* If *BUILTIN cannot be run in the command-line, skip it.  */
-	  if (! ((*builtin)->flags & BUILTIN_CMDLINE))
-	    continue;
+  s = fsys_state (fsys_table[fsys_type].mount_func);
+  if (s)
+    {
+      grub_memmove ((char *) FSYS_BUF + s->offset, entry->state, s->len);
+      if ((s->remount_func) ())
+	return 1;
+    }
+  else if ((fsys_table[fsys_type].mount_func) ())
+    return 1;
 
-	  if (substring (buf, (*builtin)->name) <= 0)
-	    print_a_completion ((*builtin)->name);
-	}
+  /* Probe them all after all.  */
+  entry->stamp = 0;
+  if (errnum == ERR_FSYS_MOUNT)
+    errnum = ERR_NONE;
+  return 0;
+}
+#endif /* ! STAGE1_5 */
 
-      if (is_completion && *unique_string)
-	{
-	  if (unique == 1)
-	    {
-	      char *u = unique_string + grub_strlen (unique_string);
+static void
+attempt_mount (void)
+{
+#ifndef STAGE1_5
+  if (mount_cache_mount ())
+    return;
 
-	      *u++ = ' ';
-	      *u = 0;
-	    }
-	  
-	  grub_strcpy (buf, unique_string);
-	}
+  for (fsys_type = 0; fsys_type < NUM_FSYS; fsys_type++)
+    if (fsys_may_mount (fsys_table[fsys_type].mount_func)
+	&& (fsys_table[fsys_type].mount_func) ())
+      break;
 
-      if (! is_completion)
-	grub_putchar ('\n');
-      
-      print_error ();
-      do_completion = 0;
-      if (errnum)
-	return -1;
-      else
-	return unique - 1;
-    }
+  if (fsys_type == NUM_FSYS && errnum == ERR_NONE)
+    errnum = ERR_FSYS_MOUNT;
 
-  if (*buf == '/' || (ptr = set_device (buf)) || incomplete)
+  /* Not what a read of the disk failing did.  */
+  if (errnum == ERR_NONE || errnum == ERR_FSYS_MOUNT)
+    mount_cache_add ();
+#else
+  fsys_type = 0;
+  if ((*(fsys_table[fsys_type].mount_func)) () != 1)
     {
-      errnum = 0;
-
-      if (*buf == '(' && (incomplete || ! *ptr))
-	{
-	  if (! part_choice)
-	    {
-	      /* disk completions */
-	      int disk_no, i, j;
-	      struct geometry geom;
+      fsys_type = NUM_FSYS;
+      errnum = ERR_FSYS_MOUNT;
+    }
+#endif
+}
 
-	      if (! is_completion)
-		grub_printf (" Possible disks are: ");
 
-	      if (!ptr
-		  || *(ptr-1) != 'd'
-#if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
-		  || *(ptr-2) != 'n'
-#endif /* SUPPORT_NETBOOT */
-		  || *(ptr-2) != 'c')
-		{
-		  for (i = (ptr && (*(ptr-1) == 'd' && *(ptr-2) == 'h') ? 1:0);
-		       i < (ptr && (*(ptr-1) == 'd' && *(ptr-2) == 'f') ? 1:2);
-		       i++)
-		    {
-		      for (j = 0; j < MAX_HD_NUM; j++)
-			{
-			  disk_no = (i * 0x80) + j;
-			  if ((disk_choice || disk_no == current_drive)
-			      && ! get_diskinfo (disk_no, &geom))
-			    {
-			      char dev_name[8];
+#ifndef STAGE1_5
+/* Turn on the active flag for the partition SAVED_PARTITION in the
+   drive SAVED_DRIVE. If an error occurs, return zero, otherwise return
+   non-zero.  */
+int
+make_saved_active (void)
+{
+  char mbr[512];
 
-			      grub_sprintf (dev_name, "%cd%d", i ? 'h':'f', j);
-			      print_a_completion (dev_name);
-			    }
-			}
-		    }
-		}
+  if (saved_drive & 0x80)
+    {
+      /* Hard disk */
+      int part = saved_partition >> 16;
 
-	      if (cdrom_drive != GRUB_INVALID_DRIVE
-		  && (disk_choice || cdrom_drive == current_drive)
-		  && (!ptr
-		      || *(ptr-1) == '('
-		      || (*(ptr-1) == 'd' && *(ptr-2) == 'c')))
-		print_a_completion ("cd");
+      /* If the partition is not a primary partition, the active flag is
+	 meaningless. (XXX: Really?)  */
+      if (part > 3)
+	{
+	  errnum = ERR_DEV_VALUES;
+	  return 0;
+	}
 
-# if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
-	      if (network_ready
-		  && (disk_choice || NETWORK_DRIVE == current_drive)
-		  && (!ptr
-		      || *(ptr-1) == '('
-		      || (*(ptr-1) == 'd' && *(ptr-2) == 'n')))
-		print_a_completion ("nd");
-# endif /* SUPPORT_NETBOOT */
+      /* Read the MBR in the scratch space.  */
+      if (! rawread (saved_drive, 0, 0, get_sector_size(saved_drive), mbr))
+	return 0;
 
-	      if (is_completion && *unique_string)
-		{
-		  ptr = buf;
-		  while (*ptr != '(')
-		    ptr--;
-		  ptr++;
-		  grub_strcpy (ptr, unique_string);
-		  if (unique == 1)
-		    {
-		      ptr += grub_strlen (ptr);
-		      if (*unique_string == 'h')
-			{
-			  *ptr++ = ',';
-			  *ptr = 0;
-			}
-		      else
-			{
-			  *ptr++ = ')';
-			  *ptr = 0;
-			}
-		    }
-		}
+      /* If the partition is an extended partition, setting the active
+	 flag violates the specification by IBM.  */
+      if (IS_PC_SLICE_TYPE_EXTENDED (PC_SLICE_TYPE (mbr, part)))
+	{
+	  errnum = ERR_DEV_VALUES;
+	  return 0;
+	}
 
-	      if (! is_completion)
-		grub_putchar ('\n');
-	    }
-	  else
+      /* Check if the active flag is disabled.  */
+      if (PC_SLICE_FLAG (mbr, part) != PC_SLICE_FLAG_BOOTABLE)
+	{
+	  int i;
+
+	  /* Clear all the active flags in this table.  */
+	  for (i = 0; i < 4; i++)
+	    PC_SLICE_FLAG (mbr, i) = 0;
+
+	  /* Set the flag.  */
+	  PC_SLICE_FLAG (mbr, part) = PC_SLICE_FLAG_BOOTABLE;
+
+	  /* Write back the MBR.  */
+	  if (! rawwrite (saved_drive, 0, mbr))
+	    return 0;
+	}
+    }
+  else
+    {
+      /* If the drive is not a hard disk drive, you shouldn't call this
+	 function. (XXX: Should I just ignore this error?)  */
+      errnum = ERR_DEV_VALUES;
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Hide/Unhide CURRENT_PARTITION.  */
+int
+set_partition_hidden_flag (int hidden)
+{
+  unsigned long part = 0xFFFFFF;
+  unsigned long offset, ext_offset, gpt_offset;
+  sector_t start, len;
+  int entry, type, gpt_count, gpt_size;
+  char mbr[512];
+  
+  /* The drive must be a hard disk.  */
+  if (! (current_drive & 0x80))
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+  
+  /* The partition must be a PC slice.  */
+  if ((current_partition >> 16) == 0xFF
+      || (current_partition & 0xFFFF) != 0xFFFF)
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+  
+  /* Look for the partition.  */
+  while (next_partition (current_drive, 0xFFFFFF, &part, &type,           
+			 &start, &len, &offset, &entry,
+			 &ext_offset, &gpt_offset, &gpt_count, &gpt_size, mbr))
+    {
+	  /* The partition may not be a GPT partition.  */
+	  if (gpt_offset != 0)
 	    {
-	      /* partition completions */
-	      if (part_choice == PART_CHOSEN
-		  && open_partition ()
-		  && ! IS_PC_SLICE_TYPE_BSD (current_slice))
-		{
-		  unique = 1;
-		  ptr = buf + grub_strlen (buf);
-		  if (*(ptr - 1) != ')')
-		    {
-		      *ptr++ = ')';
-		      *ptr = 0;
-		    }
-		}
-	      else
-		{
-		  if (! is_completion)
-		    grub_printf (" Possible partitions are:\n");
-		  real_open_partition (1);
-		  
-		  if (is_completion && *unique_string)
-		    {
-		      ptr = buf;
-		      while (*ptr++ != ',')
-			;
-		      grub_strcpy (ptr, unique_string);
-		    }
-		}
+		errnum = ERR_BAD_ARGUMENT;
+		return 1;
 	    }
-	}
-      else if (ptr && *ptr == '/')
+
+      if (part == current_partition)
 	{
-	  /* filename completions */
-	  if (! is_completion)
-	    grub_printf (" Possible files are:");
+	  /* Found.  The table may have come from the partition cache,
+	     so read it for real.  */
+	  if (! rawread (current_drive, offset, 0, sizeof (mbr), mbr))
+	    return 1;
+
+	  if (hidden)
+	    PC_SLICE_TYPE (mbr, entry) |= PC_SLICE_TYPE_HIDDEN_FLAG;
+	  else
+	    PC_SLICE_TYPE (mbr, entry) &= ~PC_SLICE_TYPE_HIDDEN_FLAG;       
 	  
-	  dir (buf);
+	  /* Write back the MBR to the disk.  */
+	  buf_track = -1;
+	  if (! rawwrite (current_drive, offset, mbr))
+	    return 1;
 	  
-	  if (is_completion && *unique_string)
-	    {
-	      ptr += grub_strlen (ptr);
-	      while (*ptr != '/')
-		ptr--;
-	      ptr++;
-	      
-	      grub_strcpy (ptr, unique_string);
-	      
-	      if (unique == 1)
-		{
-		  ptr += grub_strlen (unique_string);
+	  /* Succeed.  */
+	  return 0;
+	}
+    }
+  
+  return 1;
+}
 
-		  /* Check if the file UNIQUE_STRING is a directory.  */
-		  *ptr = '/';
-		  *(ptr + 1) = 0;
-		  
-		  dir (buf);
-		  
-		  /* Restore the original unique value.  */
-		  unique = 1;
-		  
-		  if (errnum)
-		    {
-		      /* Regular file */
-		      errnum = 0;
-		      *ptr = ' ';
-		      *(ptr + 1) = 0;
-		    }
-		}
-	    }
-	  
-	  if (! is_completion)
-	    grub_putchar ('\n');
+
+static void
+check_and_print_mount (void)
+{
+  attempt_mount ();
+  if (errnum == ERR_FSYS_MOUNT)
+    errnum = ERR_NONE;
+  if (!errnum)
+    print_fsys_type ();
+  print_error ();
+}
+#endif /* STAGE1_5 */
+
+
+/* Get the information on next partition on the drive DRIVE.
+   The caller must not modify the contents of the arguments when
+   iterating this function. The partition representation in GRUB will
+   be stored in *PARTITION. Likewise, the partition type in *TYPE, the
+   start sector in *START, the length in *LEN, the offset of the
+   partition table in *OFFSET, the entry number in the table in *ENTRY,
+   the offset of the extended partition in *EXT_OFFSET.
+   BUF is used to store a MBR, the boot sector of a partition, or
+   a BSD label sector, and it must be at least 512 bytes length.
+   When calling this function first, *PARTITION must be initialized to
+   0xFFFFFF. The return value is zero if fails, otherwise non-zero.  */
+#ifndef STAGE1_5
+/* This reads the tables, and next_partition below remembers what it
+   found.  */
+static int
+read_next_partition (unsigned long drive, unsigned long dest,
+#else
+int
+next_partition (unsigned long drive, unsigned long dest,
+#endif
+		unsigned long *partition, int *type,
+		sector_t *start, sector_t *len,
+		unsigned long *offset, int *entry,
+               unsigned long *ext_offset,
+               unsigned long *gpt_offset, int *gpt_count,
+               int *gpt_size, char *buf)
+{
+  /* Forward declarations.  */
+  auto int next_bsd_partition (void);
+  auto int next_pc_slice (void);
+  auto int next_gpt_slice(void);
+
+  /* Get next BSD partition in current PC slice.  */
+  int next_bsd_partition (void)
+    {
+      int i;
+      int bsd_part_no = (*partition & 0xFF00) >> 8;
+
+      /* If this is the first time...  */
+      if (bsd_part_no == 0xFF)
+	{
+	  /* Check if the BSD label is within current PC slice.  */
+	  if (*len < BSD_LABEL_SECTOR + 1)
+	    {
+	      errnum = ERR_BAD_PART_TABLE;
+	      return 0;
+	    }
+
+	  /* Read the BSD label.  */
+	  if (! rawread (drive, *start + BSD_LABEL_SECTOR,
+			 0, get_sector_size(drive), buf))
+	    return 0;
+
+	  /* Check if it is valid.  */
+	  if (! BSD_LABEL_CHECK_MAG (buf))
+	    {
+	      errnum = ERR_BAD_PART_TABLE;
+	      return 0;
+	    }
+	  
+	  bsd_part_no = -1;
+	}
+
+      /* Search next valid BSD partition.  */
+      for (i = bsd_part_no + 1; i < BSD_LABEL_NPARTS (buf); i++)
+	{
+	  if (BSD_PART_TYPE (buf, i))
+	    {
+	      /* Note that *TYPE and *PARTITION were set
+		 for current PC slice.  */
+	      *type = (BSD_PART_TYPE (buf, i) << 8) | (*type & 0xFF);
+	      *start = BSD_PART_START (buf, i);
+	      *len = BSD_PART_LENGTH (buf, i);
+	      *partition = (*partition & 0xFF00FF) | (i << 8);
+
+#ifndef STAGE1_5
+	      /* XXX */
+	      if ((drive & 0x80) && BSD_LABEL_DTYPE (buf) == DTYPE_SCSI)
+		bsd_evil_hack = 4;
+#endif /* ! STAGE1_5 */
+	      
+	      return 1;
+	    }
+	}
+
+      errnum = ERR_NO_PART;
+      return 0;
+    }
+
+  /* Get next PC slice. Be careful of that this function may return
+     an empty PC slice (i.e. a partition whose type is zero) as well.  */
+  int next_pc_slice (void)
+    {
+      int pc_slice_no = (*partition & 0xFF0000) >> 16;
+
+      /* If this is the first time...  */
+      if (pc_slice_no == 0xFF)
+	{
+	  *offset = 0;
+	  *ext_offset = 0;
+	  *entry = -1;
+	  pc_slice_no = -1;
+	}
+
+      /* Read the MBR or the boot sector of the extended partition.  */
+      if (! rawread (drive, *offset, 0, get_sector_size(drive), buf))
+	return 0;
+
+      /* Check if it is valid.  */
+      if (! PC_MBR_CHECK_SIG (buf))
+	{
+	  errnum = ERR_BAD_PART_TABLE;
+	  return 0;
+	}
+
+      /* If this is a GPT partition table, read it as such.  */
+      if (*entry == -1 && *offset == 0 &&
+	  (PC_SLICE_TYPE (buf, 0) == PC_SLICE_TYPE_GPT ||
+	   PC_SLICE_TYPE (buf, 0) == PC_SLICE_TYPE_NONE))
+       {
+         struct grub_gpt_header *hdr = (struct grub_gpt_header *) buf;
+
+         /* Read in the GPT Partition table header.  */
+         if (! rawread (drive, 1, 0, get_sector_size(drive), buf))
+           return 0;
+
+         if (hdr->magic == GPT_HEADER_MAGIC && hdr->version == 0x10000)
+           {
+             /* Let gpt_offset point to the first entry in the GPT
+                partition table.  This can also be used by callers of
+                next_partition to determine if a entry comes from a
+                GPT partition table or not.  */
+             *gpt_offset = hdr->partitions;
+             *gpt_count = hdr->maxpart;
+             *gpt_size =  hdr->partentry_size;
+             
+             return next_gpt_slice();
+           }
+         else
+           {
+             /* This is not a valid header for a GPT partition table.
+                Re-read the MBR or the boot sector of the extended
+                partition.  */
+             if (! rawread (drive, *offset, 0, get_sector_size(drive), buf))
+               return 0;
+           }
+       }
+
+      /* Not a GPT partition.  */
+      *gpt_offset = 0;
+
+      /* Increase the entry number.  */
+      (*entry)++;
+
+      /* If this is out of current partition table...  */
+      if (*entry == PC_SLICE_MAX)
+	{
+	  int i;
+
+	  /* Search the first extended partition in current table.  */
+	  for (i = 0; i < PC_SLICE_MAX; i++)
+	    {
+	      if (IS_PC_SLICE_TYPE_EXTENDED (PC_SLICE_TYPE (buf, i)))
+		{
+		  /* Found. Set the new offset and the entry number,
+		     and restart this function.  */
+		  *offset = *ext_offset + PC_SLICE_START (buf, i);
+		  if (! *ext_offset)
+		    *ext_offset = *offset;
+		  *entry = -1;
+		  return next_pc_slice ();
+		}
+	    }
+
+	  errnum = ERR_NO_PART;
+	  return 0;
+	}
+      
+      *type = PC_SLICE_TYPE (buf, *entry);
+      *start = *offset + PC_SLICE_START (buf, *entry);
+      *len = PC_SLICE_LENGTH (buf, *entry);
+
+      /* The calculation of a PC slice number is complicated, because of
+	 the rather odd definition of extended partitions. Even worse,
+	 there is no guarantee that this is consistent with every
+	 operating systems. Uggh.  */
+      if (pc_slice_no < PC_SLICE_MAX
+	  || (! IS_PC_SLICE_TYPE_EXTENDED (*type)
+	      && *type != PC_SLICE_TYPE_NONE))
+	pc_slice_no++;
+      
+      *partition = (pc_slice_no << 16) | 0xFFFF;
+      return 1;
+    }
+
+  /* Get the next GPT slice.  */
+  int next_gpt_slice (void)
+    {
+      struct grub_gpt_partentry *gptentry = (struct grub_gpt_partentry *) buf;
+      /* Make GPT partitions show up as PC slices.  */
+      int pc_slice_no = (*partition & 0xFF0000) >> 16;
+
+      /* If this is the first time...  */
+      if (pc_slice_no == 0xFF)
+       {
+         pc_slice_no = -1;
+         *entry = -1;
+       }
+
+      do {
+       (*entry)++;
+
+       if (*entry >= *gpt_count)
+         {
+           errnum = ERR_NO_PART;
+           return 0;
+         }
+       /* Read in the GPT Partition table entry.  */
+       if (! rawread (drive, (*gpt_offset) + GPT_ENTRY_SECTOR (drive, *gpt_size, *entry), GPT_ENTRY_INDEX (drive, *gpt_size, *entry), *gpt_size, buf))
+         return 0;
+      } while (! (gptentry->type1 && gptentry->type2));
+
+      pc_slice_no++;
+      *start = gptentry->start;
+      *len = gptentry->end - gptentry->start + 1;
+      *type = PC_SLICE_TYPE_EXT2FS;
+      *entry = pc_slice_no;
+      *partition = (*entry << 16) | 0xFFFF;
+
+      return 1;
+    }
+
+  /* Start the body of this function.  */
+  
+#ifndef STAGE1_5
+  if (current_drive == NETWORK_DRIVE)
+    return 0;
+#endif
+
+  if (*partition != 0xFFFFFF && *gpt_offset != 0)
+    return next_gpt_slice ();
+
+  /* If previous partition is a BSD partition or a PC slice which
+     contains BSD partitions...  */
+  if ((*partition != 0xFFFFFF && IS_PC_SLICE_TYPE_BSD (*type & 0xff))
+      || ! (drive & 0x80))
+    {
+      if (*type == PC_SLICE_TYPE_NONE)
+	*type = PC_SLICE_TYPE_FREEBSD;
+      
+      /* Get next BSD partition, if any.  */
+      if (next_bsd_partition ())
+	return 1;
+
+      /* If the destination partition is a BSD partition and current
+	 BSD partition has any error, abort the operation.  */
+      if ((dest & 0xFF00) != 0xFF00
+	  && ((dest & 0xFF0000) == 0xFF0000
+	      || (dest & 0xFF0000) == (*partition & 0xFF0000)))
+	return 0;
+
+      /* Ignore the error.  */
+      errnum = ERR_NONE;
+    }
+	  
+  return next_pc_slice ();
+}
+
+#ifndef STAGE1_5
+/* Return the index in C of the partition after the one described by
+   the arguments, or -1 if that one is not there.  */
+static int
+part_cache_next (struct part_cache *c, unsigned long partition,
+		 unsigned long offset, int entry, unsigned long gpt_offset)
+{
+  int i;
+
+  if (partition == 0xFFFFFF)
+    return 0;
+
+  for (i = 0; i < c->count; i++)
+    if (c->parts[i].partition == partition && c->parts[i].offset == offset
+	&& c->parts[i].entry == entry && c->parts[i].gpt_offset == gpt_offset)
+      return i + 1;
+
+  return -1;
+}
+
+int
+next_partition (unsigned long drive, unsigned long dest,
+		unsigned long *partition, int *type,
+		sector_t *start, sector_t *len,
+		unsigned long *offset, int *entry,
+		unsigned long *ext_offset,
+		unsigned long *gpt_offset, int *gpt_count,
+		int *gpt_size, char *buf)
+{
+  struct part_cache *c = 0, *victim = part_cache;
+  struct part_cache_entry *p;
+  int i, next = -1, ret;
+
+  if (current_drive == NETWORK_DRIVE)
+    return 0;
+
+  /* Removable media may be exchanged behind our back, which only
+     rawread notices.  */
+  if (! (drive & 0x80) || drive == cdrom_drive)
+    return read_next_partition (drive, dest, partition, type, start, len,
+				offset, entry, ext_offset, gpt_offset,
+				gpt_count, gpt_size, buf);
+
+  for (i = 0; i < PART_CACHE_DRIVES; i++)
+    {
+      if (part_cache[i].drive == (int) drive)
+	c = part_cache + i;
+      if (part_cache[i].stamp < victim->stamp)
+	victim = part_cache + i;
+    }
+
+  if (c)
+    {
+      next = part_cache_next (c, *partition, *offset, *entry,
+			      *partition == 0xFFFFFF ? 0 : *gpt_offset);
+      c->stamp = ++part_cache_clock;
+
+      if (next >= 0 && next < c->count)
+	{
+	  p = c->parts + next;
+	  *partition = p->partition;
+	  *type = p->type;
+	  *start = p->start;
+	  *len = p->len;
+	  *offset = p->offset;
+	  *entry = p->entry;
+	  *ext_offset = p->ext_offset;
+	  *gpt_offset = p->gpt_offset;
+	  *gpt_count = p->gpt_count;
+	  *gpt_size = p->gpt_size;
+	  return 1;
+	}
+
+      if (next >= 0 && c->complete)
+	{
+	  errnum = ERR_NO_PART;
+	  return 0;
+	}
+    }
+
+  /* Start remembering when the partitions are read from the first.  */
+  if (! c && *partition == 0xFFFFFF)
+    {
+      c = victim;
+      c->drive = drive;
+      c->count = 0;
+      c->complete = 0;
+      c->stamp = ++part_cache_clock;
+      next = 0;
+    }
+
+  ret = read_next_partition (drive, dest, partition, type, start, len,
+			     offset, entry, ext_offset, gpt_offset,
+			     gpt_count, gpt_size, buf);
+
+  /* Only what follows the last one remembered can be added.  */
+  if (! c || next != c->count)
+    return ret;
+
+  if (! ret)
+    {
+      if (errnum == ERR_NO_PART)
+	c->complete = 1;
+      else
+	c->drive = -1;
+      return ret;
+    }
+
+  /* BSD labels are read only when asked for, and then depending on
+     DEST, so they are left out.  */
+  if (c->count == PART_CACHE_PARTS || IS_PC_SLICE_TYPE_BSD (*type & 0xff)
+      || (*partition & 0xFF00) != 0xFF00)
+    {
+      c->drive = -1;
+      return ret;
+    }
+
+  p = c->parts + c->count++;
+  p->partition = *partition;
+  p->type = *type;
+  p->start = *start;
+  p->len = *len;
+  p->offset = *offset;
+  p->entry = *entry;
+  p->ext_offset = *ext_offset;
+  p->gpt_offset = *gpt_offset;
+  p->gpt_count = *gpt_count;
+  p->gpt_size = *gpt_size;
+
+  return ret;
+}
+
+/* How much of the start of a partition the file systems look at to
+   recognize it, up to the ReiserFS superblock at 64K.  */
+#define PROBE_LEN	0x11000
+/* How many partitions to read the starts of ahead.  */
+#define PROBE_AHEAD	4
+
+/* Have the disks read the start of PARTITION on DRIVE and of the few
+   partitions after it, on this drive and the next ones, in the
+   background.  If PARTITION is 0xFFFFFF, do that for whole drives
+   instead.  Commands like find, which try to mount one partition after
+   another, then find most of the superblocks read already, and the
+   disks have been working on them all at once.  */
+void
+probe_ahead (unsigned long drive, unsigned long partition)
+{
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  int saved_errnum = errnum;
+  int first = (partition != 0xFFFFFF);
+  int hints = 0;
+  char buf[4096];
+
+  for (; drive < 0x80 + MAX_HD_NUM && hints < PROBE_AHEAD; drive++)
+    {
+      unsigned long part = 0xFFFFFF;
+      unsigned long offset, ext_offset, gpt_offset;
+      sector_t start, len;
+      int type, entry, gpt_count, gpt_size;
+      int nsec;
+
+      if (! biosdisk_readahead (drive, 0, 0))
+	continue;
+
+      nsec = PROBE_LEN >> get_sector_bits (drive);
+      if (partition == 0xFFFFFF)
+	{
+	  biosdisk_readahead (drive, 0, nsec);
+	  hints++;
+	  continue;
+	}
+
+      while (hints < PROBE_AHEAD
+	     && next_partition (drive, 0xFFFFFF, &part, &type,
+				&start, &len, &offset, &entry, &ext_offset,
+				&gpt_offset, &gpt_count, &gpt_size, buf))
+	{
+	  /* On the first drive, start from PARTITION.  */
+	  if (first && part != partition)
+	    continue;
+	  first = 0;
+
+	  if (type == PC_SLICE_TYPE_NONE
+	      || IS_PC_SLICE_TYPE_BSD (type)
+	      || IS_PC_SLICE_TYPE_EXTENDED (type))
+	    continue;
+
+	  biosdisk_readahead (drive, start, len < (sector_t) nsec
+			      ? (int) len : nsec);
+	  hints++;
+	}
+
+      first = 0;
+    }
+
+  errnum = saved_errnum;
+#endif
+}
+#endif /* ! STAGE1_5 */
+
+#ifndef STAGE1_5
+static unsigned long cur_part_offset;
+static unsigned long cur_part_addr;
+#endif
+
+/* Open a partition.  */
+int
+real_open_partition (int flags)
+{
+  unsigned long dest_partition = current_partition;
+  unsigned long part_offset;
+  unsigned long ext_offset;
+  unsigned long gpt_offset;
+  int gpt_count;
+  int gpt_size;
+  int entry;
+  char buf[4096];
+  int bsd_part, pc_slice;
+
+  /* For simplicity.  */
+  auto int next (void);
+  int next (void)
+    {
+      int ret = next_partition (current_drive, dest_partition,
+				&current_partition, &current_slice,
+				&part_start, &part_length,
+                               &part_offset, &entry, &ext_offset,
+                               &gpt_offset, &gpt_count, &gpt_size, buf);
+      bsd_part = (current_partition >> 8) & 0xFF;
+      pc_slice = current_partition >> 16;
+      return ret;
+    }
+  
+#ifndef STAGE1_5
+  /* network drive */
+  if (current_drive == NETWORK_DRIVE)
+    return 1;
+  
+  if (! sane_partition ())
+    return 0;
+#endif
+
+  bsd_evil_hack = 0;
+  current_slice = 0;
+  part_start = 0;
+
+  /* Make sure that buf_geom is valid. */
+  if (buf_drive != current_drive && buf_geom_load (current_drive))
+    return 0;
+  part_length = buf_geom.total_sectors;
+
+  /* If this is the whole disk, return here.  */
+  if (! flags && current_partition == 0xFFFFFF)
+    return 1;
+
+  if (flags)
+    dest_partition = 0xFFFFFF;
+
+  /* Initialize CURRENT_PARTITION for next_partition.  */
+  current_partition = 0xFFFFFF;
+  
+  while (next ())
+    {
+#ifndef STAGE1_5
+    loop_start:
+      
+      cur_part_offset = part_offset;
+      cur_part_addr = BOOT_PART_TABLE + (entry << 4);
+#endif /* ! STAGE1_5 */
+
+      /* If this is a valid partition...  */
+      if (current_slice)
+	{
+#ifndef STAGE1_5
+	  /* Display partition information.  */
+	  if (flags && ! IS_PC_SLICE_TYPE_EXTENDED (current_slice))
+	    {
+	      if (! do_completion)
+		{
+		  if (current_drive & 0x80)
+		    grub_printf ("   Partition num: %d, ",
+				 current_partition >> 16);
+
+		  if (! IS_PC_SLICE_TYPE_BSD (current_slice))
+		    check_and_print_mount ();
+		  else
+		    {
+		      int got_part = 0;
+		      int saved_slice = current_slice;
+		      
+		      while (next ())
+			{
+			  if (bsd_part == 0xFF)
+			    break;
+			  
+			  if (! got_part)
+			    {
+			      grub_printf ("[BSD sub-partitions immediately follow]\n");
+			      got_part = 1;
+			    }
+			  
+			  grub_printf ("     BSD Partition num: \'%c\', ",
+				       bsd_part + 'a');
+			  check_and_print_mount ();
+			}
+
+		      if (! got_part)
+			grub_printf (" No BSD sub-partition found, partition type 0x%x\n",
+				     saved_slice);
+		      
+		      if (errnum)
+			{
+			  errnum = ERR_NONE;
+			  break;
+			}
+		      
+		      goto loop_start;
+		    }
+		}
+	      else
+		{
+		  if (bsd_part != 0xFF)
+		    {
+		      char str[16];
+		      
+		      if (! (current_drive & 0x80)
+			  || (dest_partition >> 16) == pc_slice)
+			grub_sprintf (str, "%c)", bsd_part + 'a');
+		      else
+			grub_sprintf (str, "%d,%c)",
+				      pc_slice, bsd_part + 'a');
+		      print_a_completion (str);
+		    }
+		  else if (! IS_PC_SLICE_TYPE_BSD (current_slice))
+		    {
+		      char str[8];
+		      
+		      grub_sprintf (str, "%d)", pc_slice);
+		      print_a_completion (str);
+		    }
+		}
+	    }
+	  
+	  errnum = ERR_NONE;
+#endif /* ! STAGE1_5 */
+	  
+	  /* Check if this is the destination partition.  */
+	  if (! flags
+	      && (dest_partition == current_partition
+		  || ((dest_partition >> 16) == 0xFF
+		      && ((dest_partition >> 8) & 0xFF) == bsd_part)))
+	    return 1;
+	}
+    }
+
+#ifndef STAGE1_5
+  if (flags)
+    {
+      if (! (current_drive & 0x80))
+	{
+	  current_partition = 0xFFFFFF;
+	  check_and_print_mount ();
+	}
+      
+      errnum = ERR_NONE;
+      return 1;
+    }
+#endif /* ! STAGE1_5 */
+  
+  return 0;
+}
+
+
+int
+open_partition (void)
+{
+  return real_open_partition (0);
+}
+
+#if !defined(PLATFORM_EFI) && !defined(GRUB_UTIL)
+int get_sector_size (int drive)
+{
+  return SECTOR_SIZE;
+}
+int get_sector_bits (int drive)
+{
+  return SECTOR_BITS;
+}
+#endif /* !defined(PLATFORM_EFI) && !defined(GRUB_UTIL) */
+
+
+#ifndef STAGE1_5
+/* XX used for device completion in 'set_device' and 'print_completions' */
+static int incomplete, disk_choice;
+static enum
+{
+  PART_UNSPECIFIED = 0,
+  PART_DISK,
+  PART_CHOSEN,
+}
+part_choice;
+#endif /* ! STAGE1_5 */
+
+char *
+set_device (char *device)
+{
+#ifdef STAGE1_5
+    /* In Stage 1.5, the first 4 bytes of FILENAME has a device number.  */
+  unsigned long dev = *((unsigned long *) device);
+  int drive = (dev >> 24) & 0xFF;
+  int partition = dev & 0xFFFFFF;
+
+  /* If DRIVE is disabled, use SAVED_DRIVE instead.  */
+  if (drive == GRUB_INVALID_DRIVE)
+    current_drive = saved_drive;
+  else
+    current_drive = drive;
+
+  /* The `partition' part must always have a valid number.  */
+  current_partition = partition;
+  
+  return device + sizeof (unsigned long);
+  
+#else /* ! STAGE1_5 */
+  
+  int result = 0;
+
+  incomplete = 0;
+  disk_choice = 1;
+  part_choice = PART_UNSPECIFIED;
+  current_drive = saved_drive;
+  current_partition = 0xFFFFFF;
+
+  if (*device == '(' && !*(device + 1))
+    /* user has given '(' only, let disk_choice handle what disks we have */
+    return device + 1;
+
+  if (*device == '(' && *(++device))
+    {
+      if (*device != ',' && *device != ')')
+	{
+	  char ch = *device;
+#if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
+	  if (*device == 'f' || *device == 'h'
+	      || (*device == 'n' && network_ready)
+	      || (*device == 'c' && cdrom_drive != GRUB_INVALID_DRIVE))
+#else
+	  if (*device == 'f' || *device == 'h'
+	      || (*device == 'c' && cdrom_drive != GRUB_INVALID_DRIVE))
+#endif /* SUPPORT_NETBOOT */
+	    {
+	      /* user has given '([fhn]', check for resp. add 'd' and
+		 let disk_choice handle what disks we have */
+	      if (!*(device + 1))
+		{
+		  device++;
+		  *device++ = 'd';
+		  *device = '\0';
+		  return device;
+		}
+	      else if (*(device + 1) == 'd' && !*(device + 2))
+		return device + 2;
+	    }
+
+	  if ((*device == 'f'
+	       || *device == 'h'
+#if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
+	       || (*device == 'n' && network_ready)
+#endif
+	       || (*device == 'c' && cdrom_drive != GRUB_INVALID_DRIVE))
+	      && (device += 2, (*(device - 1) != 'd')))
+	    errnum = ERR_NUMBER_PARSING;
+
+#if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
+	  if (ch == 'n' && network_ready)
+	    current_drive = NETWORK_DRIVE;
+	  else
+#endif /* SUPPORT_NETBOOT */
+	    {
+	      if (ch == 'c' && cdrom_drive != GRUB_INVALID_DRIVE)
+		current_drive = cdrom_drive;
+	      else
+		{
+		  safe_parse_maxint (&device, (int *) &current_drive);
+		  
+		  disk_choice = 0;
+		  if (ch == 'h')
+		    current_drive += 0x80;
+		}
+	    }
+	}
+
+      if (errnum)
+	return 0;
+
+      if (*device == ')')
+	{
+	  part_choice = PART_CHOSEN;
+	  result = 1;
+	}
+      else if (*device == ',')
+	{
+	  /* Either an absolute PC or BSD partition. */
+	  disk_choice = 0;
+	  part_choice ++;
+	  device++;
+
+	  if (*device >= '0' && *device <= '9')
+	    {
+	      part_choice ++;
+	      current_partition = 0;
+
+	      if (!(current_drive & 0x80)
+		  || !safe_parse_maxint (&device, (int *) &current_partition)
+		  || current_partition > 254)
+		{
+		  errnum = ERR_DEV_FORMAT;
+		  return 0;
+		}
+
+	      current_partition = (current_partition << 16) + 0xFFFF;
+
+	      if (*device == ',')
+		device++;
+	      
+	      if (*device >= 'a' && *device <= 'h')
+		{
+		  current_partition = (((*(device++) - 'a') << 8)
+				       | (current_partition & 0xFF00FF));
+		}
+	    }
+	  else if (*device >= 'a' && *device <= 'h')
+	    {
+	      part_choice ++;
+	      current_partition = ((*(device++) - 'a') << 8) | 0xFF00FF;
+	    }
+
+	  if (*device == ')')
+	    {
+	      if (part_choice == PART_DISK)
+		{
+		  current_partition = saved_partition;
+		  part_choice ++;
+		}
+
+	      result = 1;
+	    }
+	}
+    }
+
+  if (! sane_partition ())
+    return 0;
+  
+  if (result)
+    return device + 1;
+  else
+    {
+      if (!*device)
+	incomplete = 1;
+      errnum = ERR_DEV_FORMAT;
+    }
+
+  return 0;
+  
+#endif /* ! STAGE1_5 */
+}
+
+/*
+ *  This performs a "mount" on the current device, both drive and partition
+ *  number.
+ */
+
+int
+open_device (void)
+{
+  if (open_partition ())
+    attempt_mount ();
+
+  if (errnum != ERR_NONE)
+    return 0;
+
+  return 1;
+}
+
+
+#ifndef STAGE1_5
+int
+set_bootdev (int hdbias)
+{
+  int i, j;
+
+  /* Copy the boot partition information to 0x7be-0x7fd for chain-loading.  */
+  if ((saved_drive & 0x80) && cur_part_addr)
+    {
+      if (rawread (saved_drive, cur_part_offset,
+		   0, get_sector_size(saved_drive), (char *) SCRATCHADDR))
+	{
+	  char *dst, *src;
+      
+	  /* Need only the partition table.
+	     XXX: We cannot use grub_memmove because BOOT_PART_TABLE
+	     (0x07be) is less than 0x1000.  */
+	  dst = (char *) BOOT_PART_TABLE;
+	  src = (char *) SCRATCHADDR + BOOTSEC_PART_OFFSET;
+	  while (dst < (char *) BOOT_PART_TABLE + BOOTSEC_PART_LENGTH)
+	    *dst++ = *src++;
+	  
+	  /* Set the active flag of the booted partition.  */
+	  for (i = 0; i < 4; i++)
+	    PC_SLICE_FLAG (BOOT_PART_TABLE, i) = 0;
+	  
+	  *((unsigned char *) cur_part_addr) = PC_SLICE_FLAG_BOOTABLE;
+	  boot_part_addr = cur_part_addr;
+	}
+      else
+	return 0;
+    }
+  
+  /*
+   *  Set BSD boot device.
+   */
+  i = (saved_partition >> 16) + 2;
+  if (saved_partition == 0xFFFFFF)
+    i = 1;
+  else if ((saved_partition >> 16) == 0xFF)
+    i = 0;
+
+  /* FIXME: extremely evil hack!!! */
+  j = 2;
+  if (saved_drive & 0x80)
+    j = bsd_evil_hack;
+
+  return MAKEBOOTDEV (j, (i >> 4), (i & 0xF),
+		      ((saved_drive - hdbias) & 0x7F),
+		      ((saved_partition >> 8) & 0xFF));
+}
+#endif /* STAGE1_5 */
+
+
+static char *
+setup_part (char *filename)
+{
+#ifdef STAGE1_5
+
+  if (! (filename = set_device (filename)))
+    {
+      current_drive = GRUB_INVALID_DRIVE;
+      return 0;
+    }
+  
+# ifndef NO_BLOCK_FILES
+  if (*filename != '/')
+    open_partition ();
+  else
+# endif /* ! NO_BLOCK_FILES */
+    open_device ();
+  
+#else /* ! STAGE1_5 */
+  
+  if (*filename == '(')
+    {
+      if ((filename = set_device (filename)) == 0)
+	{
+	  current_drive = GRUB_INVALID_DRIVE;
+	  return 0;
+	}
+# ifndef NO_BLOCK_FILES
+      if (*filename != '/')
+	open_partition ();
+      else
+# endif /* ! NO_BLOCK_FILES */
+	open_device ();
+    }
+  else if (saved_drive != current_drive
+	   || saved_partition != current_partition
+	   || (*filename == '/' && fsys_type == NUM_FSYS)
+	   || buf_drive == -1)
+    {
+      current_drive = saved_drive;
+      current_partition = saved_partition;
+      /* allow for the error case of "no filesystem" after the partition
+         is found.  This makes block files work fine on no filesystem */
+# ifndef NO_BLOCK_FILES
+      if (*filename != '/')
+	open_partition ();
+      else
+# endif /* ! NO_BLOCK_FILES */
+	open_device ();
+    }
+  
+#endif /* ! STAGE1_5 */
+  
+  if (errnum && (*filename == '/' || errnum != ERR_FSYS_MOUNT))
+    return 0;
+  else
+    errnum = 0;
+
+#ifndef STAGE1_5
+  if (!sane_partition ())
+    return 0;
+#endif
+
+  return filename;
+}
+
+
+#ifndef STAGE1_5
+char *
+get_fsys_type (void)
+{
+    return fsys_table[fsys_type].name;
+}
+
+/*
+ *  This prints the filesystem type or gives relevant information.
+ */
+
+void
+print_fsys_type (void)
+{
+  if (! do_completion)
+    {
+      printf (" Filesystem type ");
+      
+      if (fsys_type != NUM_FSYS)
+	printf ("is %s, ", fsys_table[fsys_type].name);
+      else
+	printf ("unknown, ");
+      
+      if (current_partition == 0xFFFFFF)
+	printf ("using whole disk\n");
+      else
+	printf ("partition type 0x%x\n", current_slice & 0xFF);
+    }
+}
+#endif /* STAGE1_5 */
+
+#ifndef STAGE1_5
+/* The names in the directory completed last, sorted, so that pressing
+   TAB again there reads nothing from the disk: the names which start
+   with a prefix follow each other, and a binary search finds them.
+   It is small, since it is in the bss of Stage 2 below FSYS_BUF, but
+   big enough for the directories a kernel is looked for in.  */
+#define CCACHE_NAMES	256
+#define CCACHE_POOL	0x1000
+#define CCACHE_DIRLEN	256
+
+static struct
+{
+  /* The text of the directory up to its last slash, as typed, and the
+     root device and the disks it was read with.  */
+  char dir[CCACHE_DIRLEN];
+  unsigned long root_drive;
+  unsigned long root_partition;
+  unsigned long generation;
+  int valid;
+  /* Whether the file system finds names regardless of case.  */
+  int fold;
+  /* Whether a name did not fit.  */
+  int full;
+  int count;
+  int used;
+  /* Where each name starts in POOL, in order.  */
+  unsigned short names[CCACHE_NAMES];
+  char pool[CCACHE_POOL];
+} ccache;
+
+/* Whether print_a_completion is to put the names into CCACHE.  */
+static int ccache_filling;
+
+#define CCACHE_NAME(i)	(ccache.pool + ccache.names[i])
+
+/* Compare at most LEN bytes of S1 and S2, as the file system would.  */
+static int
+ccache_compare (const char *s1, const char *s2, int len)
+{
+  for (; len > 0; len--)
+    {
+      int c1 = (unsigned char) *s1++, c2 = (unsigned char) *s2++;
+
+      if (ccache.fold)
+	{
+	  c1 = tolower (c1);
+	  c2 = tolower (c2);
+	}
+      if (c1 != c2 || ! c1)
+	return c1 - c2;
+    }
+
+  return 0;
+}
+
+/* Return the index of the first name in CCACHE which is not below S.  */
+static int
+ccache_search (const char *s)
+{
+  int lo = 0, hi = ccache.count;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) >> 1;
+
+      if (ccache_compare (CCACHE_NAME (mid), s, MAXINT) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+/* Put NAME in its place in CCACHE.  */
+static void
+ccache_add (const char *name)
+{
+  int len = grub_strlen (name) + 1;
+  int i;
+
+  if (ccache.count == CCACHE_NAMES || ccache.used + len > CCACHE_POOL)
+    {
+      ccache.full = 1;
+      return;
+    }
+
+  i = ccache_search (name);
+  grub_memmove ((char *) (ccache.names + i + 1), (char *) (ccache.names + i),
+		(ccache.count - i) * sizeof (ccache.names[0]));
+  ccache.names[i] = ccache.used;
+  grub_memmove (ccache.pool + ccache.used, (char *) name, len);
+  ccache.used += len;
+  ccache.count++;
+}
+
+/* Whether what is read from DRIVE stays valid until its cache is
+   invalidated.  The removable disks may be exchanged behind our back,
+   and the grub shell reads the other drives afresh on each TAB, too.  */
+static int
+ccache_keeps (unsigned long drive)
+{
+#ifdef GRUB_UTIL
+  return 0;
+#else
+  return (drive & 0x80) && drive != cdrom_drive;
+#endif
+}
+
+/* Read the whole directory in the first LEN bytes of BUF, which end in
+   a slash, into CCACHE.  Return zero, with ERRNUM clear, if it cannot
+   be kept there.  */
+static int
+ccache_fill (char *buf, int len)
+{
+  char saved = buf[len];
+  char *path;
+  int ret;
+
+  ccache.valid = 0;
+  if (len >= CCACHE_DIRLEN)
+    return 0;
+
+#ifndef NO_DECOMPRESSION
+  compressed_file = 0;
+#endif /* NO_DECOMPRESSION */
+
+  buf[len] = 0;
+  path = setup_part (buf);
+  if (! path || *path != '/' || fsys_type == NUM_FSYS || errnum
+      || ! ccache_keeps (current_drive)
+#if FSYS_UEFI_NUM
+      /* It prints the names itself.  */
+      || fsys_table[fsys_type].dir_func == uefi_dir
+#endif
+      )
+    {
+      buf[len] = saved;
+      errnum = 0;
+      return 0;
+    }
+
+#ifdef FSYS_FAT
+  ccache.fold = fsys_table[fsys_type].dir_func == fat_dir;
+#else
+  ccache.fold = 0;
+#endif
+  ccache.count = ccache.used = ccache.full = 0;
+
+  ccache_filling = 1;
+  print_possibilities = 1;
+  ret = (*(fsys_table[fsys_type].dir_func)) (path);
+  ccache_filling = 0;
+  buf[len] = saved;
+
+  if (! ret || ccache.full)
+    {
+      errnum = 0;
+      return 0;
+    }
+
+  grub_memmove (ccache.dir, buf, len);
+  ccache.dir[len] = 0;
+  ccache.root_drive = saved_drive;
+  ccache.root_partition = saved_partition;
+  ccache.generation = disk_cache_generation;
+  ccache.valid = 1;
+  return 1;
+}
+
+/* Give print_a_completion the names in the directory of the filename
+   BUF which start with what BUF has after its last slash, as dir does,
+   but from CCACHE, reading the directory into it first if it is not
+   the one there.  Return zero if it cannot be kept there, for dir to be
+   asked instead.  */
+static int
+ccache_complete (char *buf)
+{
+  char *base = buf + grub_strlen (buf);
+  int len, i, found = 0;
+
+  while (base > buf && base[-1] != '/')
+    base--;
+  len = base - buf;
+
+  if (! (ccache.valid && len < CCACHE_DIRLEN
+	 && ccache.generation == disk_cache_generation
+	 && ccache.root_drive == saved_drive
+	 && ccache.root_partition == saved_partition
+	 && ! grub_memcmp (ccache.dir, buf, len) && ! ccache.dir[len])
+      && ! ccache_fill (buf, len))
+    return 0;
+
+  for (i = ccache_search (base);
+       i < ccache.count
+	 && ! ccache_compare (CCACHE_NAME (i), base, grub_strlen (base));
+       i++, found++)
+    print_a_completion (CCACHE_NAME (i));
+
+  if (! found)
+    errnum = ERR_FILE_NOT_FOUND;
+  return 1;
+}
+
+/* If DO_COMPLETION is true, just print NAME. Otherwise save the unique
+   part into UNIQUE_STRING.  */
+void
+print_a_completion (char *name)
+{
+  /* If NAME is "." or "..", do not count it.  */
+  if (grub_strcmp (name, ".") == 0 || grub_strcmp (name, "..") == 0)
+    return;
+
+  if (ccache_filling)
+    {
+      ccache_add (name);
+      return;
+    }
+  
+  if (do_completion)
+    {
+      char *buf = unique_string;
+      
+      if (! unique)
+	while ((*buf++ = *name++))
+	  ;
+      else
+	{
+	  while (*buf && (*buf == *name))
+	    {
+	      buf++;
+	      name++;
+	    }
+	  /* mismatch, strip it.  */
+	  *buf = '\0';
+	}
+    }
+  else
+    grub_printf (" %s", name);
+  
+  unique++;
+}
+
+/*
+ *  This lists the possible completions of a device string, filename, or
+ *  any sane combination of the two.
+ */
+
+int
+print_completions (int is_filename, int is_completion)
+{
+  char *buf = (char *) COMPLETION_BUF;
+  char *ptr = buf;
+
+  unique_string = (char *) UNIQUE_BUF;
+  *unique_string = 0;
+  unique = 0;
+  do_completion = is_completion;
+
+  if (! is_filename)
+    {
+      /* Print the completions of builtin commands.  */
+      struct builtin **builtin;
+
+      if (! is_completion)
+	grub_printf (" Possible commands are:");
+      
+      for (builtin = builtin_table; (*builtin); builtin++)
+	{
+	  /* If *BUILTIN cannot be run in the command-line, skip it.  */
+	  if (! ((*builtin)->flags & BUILTIN_CMDLINE))
+	    continue;
+
+	  if (substring (buf, (*builtin)->name) <= 0)
+	    print_a_completion ((*builtin)->name);
+	}
+
+      if (is_completion && *unique_string)
+	{
+	  if (unique == 1)
+	    {
+	      char *u = unique_string + grub_strlen (unique_string);
+
+	      *u++ = ' ';
+	      *u = 0;
+	    }
+	  
+	  grub_strcpy (buf, unique_string);
+	}
+
+      if (! is_completion)
+	grub_putchar ('\n');
+      
+      print_error ();
+      do_completion = 0;
+      if (errnum)
+	return -1;
+      else
+	return unique - 1;
+    }
+
+  if (*buf == '/' || (ptr = set_device (buf)) || incomplete)
+    {
+      errnum = 0;
+
+      if (*buf == '(' && (incomplete || ! *ptr))
+	{
+	  if (! part_choice)
+	    {
+	      /* disk completions */
+	      int disk_no, i, j;
+	      struct geometry geom;
+
+	      if (! is_completion)
+		grub_printf (" Possible disks are: ");
+
+	      if (!ptr
+		  || *(ptr-1) != 'd'
+#if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
+		  || *(ptr-2) != 'n'
+#endif /* SUPPORT_NETBOOT */
+		  || *(ptr-2) != 'c')
+		{
+		  for (i = (ptr && (*(ptr-1) == 'd' && *(ptr-2) == 'h') ? 1:0);
+		       i < (ptr && (*(ptr-1) == 'd' && *(ptr-2) == 'f') ? 1:2);
+		       i++)
+		    {
+		      for (j = 0; j < MAX_HD_NUM; j++)
+			{
+			  disk_no = (i * 0x80) + j;
+			  if ((disk_choice || disk_no == current_drive)
+			      && ! get_diskinfo (disk_no, &geom))
+			    {
+			      char dev_name[8];
+
+			      grub_sprintf (dev_name, "%cd%d", i ? 'h':'f', j);
+			      print_a_completion (dev_name);
+			    }
+			}
+		    }
+		}
+
+	      if (cdrom_drive != GRUB_INVALID_DRIVE
+		  && (disk_choice || cdrom_drive == current_drive)
+		  && (!ptr
+		      || *(ptr-1) == '('
+		      || (*(ptr-1) == 'd' && *(ptr-2) == 'c')))
+		print_a_completion ("cd");
+
+# if defined(SUPPORT_NETBOOT) || defined(PLATFORM_EFI)
+	      if (network_ready
+		  && (disk_choice || NETWORK_DRIVE == current_drive)
+		  && (!ptr
+		      || *(ptr-1) == '('
+		      || (*(ptr-1) == 'd' && *(ptr-2) == 'n')))
+		print_a_completion ("nd");
+# endif /* SUPPORT_NETBOOT */
+
+	      if (is_completion && *unique_string)
+		{
+		  ptr = buf;
+		  while (*ptr != '(')
+		    ptr--;
+		  ptr++;
+		  grub_strcpy (ptr, unique_string);
+		  if (unique == 1)
+		    {
+		      ptr += grub_strlen (ptr);
+		      if (*unique_string == 'h')
+			{
+			  *ptr++ = ',';
+			  *ptr = 0;
+			}
+		      else
+			{
+			  *ptr++ = ')';
+			  *ptr = 0;
+			}
+		    }
+		}
+
+	      if (! is_completion)
+		grub_putchar ('\n');
+	    }
+	  else
+	    {
+	      /* partition completions */
+	      if (part_choice == PART_CHOSEN
+		  && open_partition ()
+		  && ! IS_PC_SLICE_TYPE_BSD (current_slice))
+		{
+		  unique = 1;
+		  ptr = buf + grub_strlen (buf);
+		  if (*(ptr - 1) != ')')
+		    {
+		      *ptr++ = ')';
+		      *ptr = 0;
+		    }
+		}
+	      else
+		{
+		  if (! is_completion)
+		    grub_printf (" Possible partitions are:\n");
+		  real_open_partition (1);
+		  
+		  if (is_completion && *unique_string)
+		    {
+		      ptr = buf;
+		      while (*ptr++ != ',')
+			;
+		      grub_strcpy (ptr, unique_string);
+		    }
+		}
+	    }
+	}
+      else if (ptr && *ptr == '/')
+	{
+	  /* filename completions */
+	  if (! is_completion)
+	    grub_printf (" Possible files are:");
+	  
+	  if (! ccache_complete (buf))
+	    dir (buf);
+	  
+	  if (is_completion && *unique_string)
+	    {
+	      ptr += grub_strlen (ptr);
+	      while (*ptr != '/')
+		ptr--;
+	      ptr++;
+	      
+	      grub_strcpy (ptr, unique_string);
+	      
+	      if (unique == 1)
+		{
+		  ptr += grub_strlen (unique_string);
+
+		  /* Check if the file UNIQUE_STRING is a directory.  */
+		  *ptr = '/';
+		  *(ptr + 1) = 0;
+		  
+		  /* This reads the directory in for the next TAB.  */
+		  if (! ccache_complete (buf))
+		    dir (buf);
+		  
+		  /* Restore the original unique value.  */
+		  unique = 1;
+		  
+		  if (errnum)
+		    {
+		      /* Regular file */
+		      errnum = 0;
+		      *ptr = ' ';
+		      *(ptr + 1) = 0;
+		    }
+		}
+	    }
+	  
+	  if (! is_completion)
+	    grub_putchar ('\n');
+	}
+      else
+	errnum = ERR_BAD_FILENAME;
+    }
+
+  print_error ();
+  do_completion = 0;
+  if (errnum)
+    return -1;
+  else
+    return unique - 1;
+}
+#endif /* STAGE1_5 */
+
+
+#ifndef STAGE1_5
+/* The file being read is hashed as its bytes come from the disk, so
+   that checking it against the manifest costs no second pass over it.
+   Bytes read again, as the decompressors do, are hashed only once;
+   those skipped over are hashed when the file is closed, by reading
+   what is left of it from the first of them.  */
+struct verify_entry verify_list[VERIFY_FILES];
+int verify_count;
+
+/* The entry of the open file, or -1, how much of the file has been
+   hashed, and its size and FSMAX as it is on the disk, or -1 if none
+   of it has been read yet.  USED tells whether anything was read once
+   GRUB_OPEN had returned, rather than only by the decompressors looking
+   at its header.  */
+static int verify_file = -1;
+static int verify_pos, verify_size, verify_fsmax;
+static int verify_opening, verify_used;
+static struct sha256_ctx verify_ctx;
+
+static int read_file (char *buf, int len);
+
+/* Start hashing FILENAME, which is being opened, if it is in the
+   manifest.  The device, if any, doesn't matter.  */
+static void
+verify_open (const char *filename)
+{
+  int i, len;
+
+  verify_file = -1;
+  if (*filename == '(')
+    {
+      while (*filename && *filename != ')')
+	filename++;
+      if (*filename)
+	filename++;
+    }
+
+  for (len = 0; filename[len] && ! isspace (filename[len]); len++)
+    ;
+
+  for (i = 0; i < verify_count; i++)
+    if (! grub_memcmp (verify_list[i].name, filename, len)
+	&& ! verify_list[i].name[len])
+      {
+	verify_file = i;
+	verify_pos = 0;
+	verify_size = verify_fsmax = -1;
+	verify_used = 0;
+	sha256_init_ctx (&verify_ctx);
+	break;
+      }
+}
+
+/* LEN bytes from POS of the file as it is on the disk have been read
+   into BUF; hash those which carry on from what has been hashed.  Once
+   the end is reached, compare the hash with the manifest.  Return zero
+   if it doesn't match.  */
+static int
+verify_update (int pos, char *buf, int len)
+{
+  struct verify_entry *entry = verify_list + verify_file;
+  unsigned int digest[8];
+
+  verify_size = filemax;
+  verify_fsmax = fsmax;
+  if (pos > verify_pos || pos + len <= verify_pos)
+    return 1;
+
+  sha256_process_bytes (buf + verify_pos - pos, pos + len - verify_pos,
+			&verify_ctx);
+  verify_pos = pos + len;
+  if (verify_pos < filemax)
+    return 1;
+
+  verify_file = -1;
+  sha256_finish_ctx (&verify_ctx, digest);
+  if (grub_memcmp ((char *) digest, (char *) entry->digest, 32) != 0)
+    {
+      entry->state = VERIFY_FAILED;
+      errnum = ERR_VERIFY;
+      return 0;
+    }
+
+  entry->state = VERIFY_OK;
+  return 1;
+}
+
+/* The file is being closed.  If it was read, hash what is left of it
+   past the bytes hashed so far, reading it as it is on the disk.  */
+static void
+verify_close (void)
+{
+  static char buf[4096];
+  int pos = filepos, max = filemax, fs = fsmax;
+# ifndef NO_DECOMPRESSION
+  int compressed = compressed_file;
+# endif
+
+  if (verify_file < 0)
+    return;
+
+  if (! verify_used || verify_size < 0 || errnum)
+    {
+      verify_file = -1;
+      return;
+    }
+
+  verify_list[verify_file].reread += verify_size - verify_pos;
+  filepos = verify_pos;
+  filemax = verify_size;
+  fsmax = verify_fsmax;
+# ifndef NO_DECOMPRESSION
+  compressed_file = 0;
+# endif
+
+  while (verify_file >= 0 && read_file (buf, sizeof (buf)) > 0)
+    ;
+
+  filepos = pos;
+  filemax = max;
+  fsmax = fs;
+# ifndef NO_DECOMPRESSION
+  compressed_file = compressed;
+# endif
+  verify_file = -1;
+}
+#endif /* ! STAGE1_5 */
+
+
+#ifndef STAGE1_5
+/* The files of the default entry which are prefetched during the menu
+   countdown.  NAME is the file as the entry names it, with the root
+   device of the entry if it has one.  When the file has been opened,
+   DRIVE, PARTITION and PATH identify it for GRUB_OPEN, and DONE bytes
+   of its SIZE are in DATA.  */
+#define PREFETCH_MAX		8
+#define PREFETCH_NAME_LEN	128
+
+#define PREFETCH_WAITING	0
+#define PREFETCH_FETCHING	1
+#define PREFETCH_DONE		2
+#define PREFETCH_FAILED		3
+
+/* How much of a file PREFETCH_POLL reads at a time, so that it doesn't
+   keep the menu from seeing a key press for long.  The EFI TFTP client
+   fetches a whole file at once anyway, so it may as well go straight
+   into the buffer.  */
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+# define PREFETCH_CHUNK		MAXINT
+#else
+# define PREFETCH_CHUNK		0x10000
+#endif
+
+struct prefetch_file
+{
+  char name[PREFETCH_NAME_LEN];
+  int state;
+  unsigned long drive, partition;
+  char *path;
+  char *data;
+  int size, done;
+};
+
+static struct prefetch_file prefetch_files[PREFETCH_MAX];
+static int prefetch_count;
+/* The file that PREFETCH_POLL has open, or -1.  */
+static int prefetch_current = -1;
+/* The file that GRUB_OPEN has found in memory, or -1.  */
+static int prefetch_hit = -1;
+/* Whether GRUB_OPEN is called by PREFETCH_POLL.  */
+static int prefetching;
+
+void
+prefetch_add (char *device, char *filename)
+{
+  struct prefetch_file *file;
+  char name[PREFETCH_NAME_LEN];
+  int i, len = 0;
+
+  if (device && *filename != '(')
+    while (*device && ! isspace (*device) && len < PREFETCH_NAME_LEN)
+      name[len++] = *device++;
+
+  while (*filename && ! isspace (*filename) && len < PREFETCH_NAME_LEN)
+    name[len++] = *filename++;
+
+  if (len == PREFETCH_NAME_LEN || prefetch_count == PREFETCH_MAX)
+    return;
+
+  name[len] = 0;
+  for (i = 0; i < prefetch_count; i++)
+    if (! grub_strcmp (prefetch_files[i].name, name))
+      return;
+
+  file = prefetch_files + prefetch_count++;
+  /* Not grub_strcpy, which fails if ERRNUM is already set.  */
+  for (i = 0; i <= len; i++)
+    file->name[i] = name[i];
+
+  file->state = PREFETCH_WAITING;
+  file->data = 0;
+}
+
+/* Give up the file that PREFETCH_POLL has open.  */
+static void
+prefetch_fail (struct prefetch_file *file)
+{
+  if (file == prefetch_files + prefetch_current)
+    {
+      /* Nothing of it is kept, so there is nothing to check.  */
+      verify_file = -1;
+      grub_close ();
+      prefetch_current = -1;
+    }
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  if (file->data)
+    grub_free (file->data);
+#endif
+  file->data = 0;
+  file->state = PREFETCH_FAILED;
+  errnum = ERR_NONE;
+}
+
+/* Open the file FILE, and find room for it.  */
+static void
+prefetch_open (struct prefetch_file *file)
+{
+#if ! defined(PLATFORM_EFI) || defined(GRUB_UTIL)
+  char *addr = (char *) PREFETCH_BUF;
+  int i;
+#endif
+  unsigned long drive = saved_drive, partition = saved_partition;
+  int ret;
+
+  /* Disks are fast enough without this, so don't even open them.  */
+  if (*file->name == '(' ? (! set_device (file->name)
+			    || current_drive != NETWORK_DRIVE)
+      : boot_drive != NETWORK_DRIVE)
+    {
+      prefetch_fail (file);
+      return;
+    }
+
+  /* The entry starts from the boot device, as RUN_SCRIPT does.  */
+  saved_drive = boot_drive;
+  saved_partition = install_partition;
+  prefetching = 1;
+#ifndef NO_DECOMPRESSION
+  /* Keep the file as it is, for GUNZIP_TEST_HEADER to see later.  */
+  ret = no_decompression;
+  no_decompression = 1;
+  if (! grub_open (file->name))
+    errnum = ERR_FILE_NOT_FOUND;
+  no_decompression = ret;
+#else
+  if (! grub_open (file->name))
+    errnum = ERR_FILE_NOT_FOUND;
+#endif
+  prefetching = 0;
+  saved_drive = drive;
+  saved_partition = partition;
+
+  if (errnum)
+    {
+      prefetch_fail (file);
+      return;
+    }
+
+  prefetch_current = file - prefetch_files;
+  file->drive = current_drive;
+  file->partition = current_partition;
+  file->path = file->name;
+  if (*file->path == '(')
+    file->path = grub_strchr (file->path, ')') + 1;
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  file->data = grub_malloc (filemax);
+#else
+  /* After the files before it.  */
+  for (i = 0; i < prefetch_count; i++)
+    if (prefetch_files[i].data
+	&& prefetch_files[i].data + prefetch_files[i].size > addr)
+      addr = (char *) (((unsigned long) prefetch_files[i].data
+			+ prefetch_files[i].size + 0xFFF) & ~0xFFF);
+
+  if (memcheck ((unsigned long) addr, filemax))
+    file->data = addr;
+#endif
+
+  if (! file->data)
+    {
+      prefetch_fail (file);
+      return;
+    }
+
+  file->size = filemax;
+  file->done = 0;
+  file->state = PREFETCH_FETCHING;
+}
+
+int
+prefetch_poll (void)
+{
+  struct prefetch_file *file;
+  int len;
+
+  if (prefetch_current < 0)
+    {
+      for (file = prefetch_files; file < prefetch_files + prefetch_count;
+	   file++)
+	if (file->state == PREFETCH_WAITING)
+	  break;
+
+      if (file == prefetch_files + prefetch_count)
+	return 0;
+
+      prefetch_open (file);
+      return 1;
+    }
+
+  file = prefetch_files + prefetch_current;
+  len = file->size - file->done;
+  if (len > PREFETCH_CHUNK)
+    len = PREFETCH_CHUNK;
+
+  filepos = file->done;
+  if (grub_read (file->data + file->done, len) != len || errnum)
+    {
+      prefetch_fail (file);
+      return 1;
+    }
+
+  file->done += len;
+  if (file->done == file->size)
+    {
+      grub_close ();
+      prefetch_current = -1;
+      file->state = PREFETCH_DONE;
+    }
+
+  return 1;
+}
+
+#ifdef FSYS_TFTP
+/* Fetch the files still waiting which come over GRUB's own TFTP all at
+   once, each over a session of its own.  Each is opened first, for its
+   size and its place, and closed again.  Those which don't come whole
+   are left waiting, to be read as usual.  */
+static void
+prefetch_together (void)
+{
+  struct tftp_fetch fetch[TFTP_FETCH_MAX];
+  struct prefetch_file *files[TFTP_FETCH_MAX];
+  struct prefetch_file *file;
+  int i, count = 0, other = 0;
+
+  /* What is being read already is read to the end first.  */
+  while (prefetch_current >= 0 && prefetch_poll ())
+    ;
+
+  for (file = prefetch_files;
+       file < prefetch_files + prefetch_count && count < TFTP_FETCH_MAX;
+       file++)
+    {
+      if (file->state != PREFETCH_WAITING)
+	continue;
+
+      prefetch_open (file);
+      if (file->state != PREFETCH_FETCHING)
+	continue;
+
+      /* Another file system reads it as usual, right away.  */
+      if (fsys_table[fsys_type].read_func != tftp_read)
+	{
+	  other = 1;
+	  break;
+	}
+
+      verify_file = -1;
+      grub_close ();
+      prefetch_current = -1;
+
+      fetch[count].name = file->path;
+      fetch[count].addr = file->data;
+      fetch[count].size = file->size;
+      files[count++] = file;
+    }
+
+  if (count < 2 || other)
+    {
+      /* One alone is no faster this way.  */
+      for (i = 0; i < count; i++)
+	{
+	  prefetch_fail (files[i]);
+	  files[i]->state = PREFETCH_WAITING;
+	}
+      return;
+    }
+
+  tftp_fetch (fetch, count);
+
+  for (i = 0; i < count; i++)
+    if (fetch[i].ok)
+      {
+	files[i]->done = files[i]->size;
+	files[i]->state = PREFETCH_DONE;
+      }
+    else
+      {
+	prefetch_fail (files[i]);
+	files[i]->state = PREFETCH_WAITING;
+      }
+}
+#endif /* FSYS_TFTP */
+
+void
+prefetch_finish (void)
+{
+#ifdef FSYS_TFTP
+  prefetch_together ();
+#endif
+  while (prefetch_poll ())
+    ;
+}
+
+/* Return the size of FILENAME as it is on the disk, or -1 if it can't
+   be opened, with ERRNUM set to ERR_FILE_NOT_FOUND if it isn't there.
+   It is opened as PREFETCH_POLL opens the files, so that the prefetched
+   ones are kept, and nothing is decompressed.  Files on the network,
+   which would be fetched to be opened, and any while PREFETCH_POLL has
+   one open, are not looked at.  */
+int
+prefetch_check (char *filename)
+{
+  unsigned long drive = current_drive, partition = current_partition;
+  int ret, size = -1;
+
+  errnum = ERR_NONE;
+  if (prefetch_current >= 0)
+    return -1;
+
+  if (*filename == '(')
+    {
+      if (! set_device (filename))
+	{
+	  errnum = ERR_NONE;
+	  return -1;
+	}
+      ret = current_drive == NETWORK_DRIVE;
+      current_drive = drive;
+      current_partition = partition;
+    }
+  else
+    ret = saved_drive == NETWORK_DRIVE;
+  if (ret)
+    return -1;
+
+  prefetching = 1;
+#ifndef NO_DECOMPRESSION
+  ret = no_decompression;
+  no_decompression = 1;
+#endif
+  if (grub_open (filename))
+    {
+      size = filemax;
+      grub_close ();
+    }
+#ifndef NO_DECOMPRESSION
+  no_decompression = ret;
+#endif
+  prefetching = 0;
+
+  return size;
+}
+
+void
+prefetch_stop (void)
+{
+  if (prefetch_current >= 0)
+    prefetch_fail (prefetch_files + prefetch_current);
+}
+
+/* Return the address where the prefetched files end in PREFETCH_BUF,
+   or 0 if none is there.  */
+unsigned long
+prefetch_end (void)
+{
+  unsigned long end = 0;
+#if ! defined(PLATFORM_EFI) || defined(GRUB_UTIL)
+  int i;
+
+  for (i = 0; i < prefetch_count; i++)
+    if (prefetch_files[i].data
+	&& (unsigned long) prefetch_files[i].data + prefetch_files[i].size > end)
+      end = (unsigned long) prefetch_files[i].data + prefetch_files[i].size;
+#endif
+
+  return end;
+}
+
+/* Forget the prefetched files which LEN bytes loaded at ADDR would
+   overwrite before they are read.  The file open now is read as it is
+   loaded, so it is only in the way if ADDR is above it, or if it is
+   decompressed, since the output outgrows the input.  Return nonzero
+   if that file was forgotten too, and has to be opened again.  */
+int
+prefetch_clobber (unsigned long addr, unsigned long len)
+{
+  int ret = 0;
+#if ! defined(PLATFORM_EFI) || defined(GRUB_UTIL)
+  int i;
+
+  for (i = 0; i < prefetch_count; i++)
+    {
+      struct prefetch_file *file = prefetch_files + i;
+      unsigned long start = (unsigned long) file->data;
+
+      if (! file->data || addr >= start + file->size || addr + len <= start)
+	continue;
+
+      if (i == prefetch_hit)
+	{
+# ifndef NO_DECOMPRESSION
+	  if (! compressed_file && addr <= start)
+	    continue;
+# else
+	  if (addr <= start)
+	    continue;
+# endif
+	  ret = 1;
+	}
+
+      prefetch_fail (file);
+    }
+#endif
+
+  return ret;
+}
+
+/* Forget all the prefetched files.  */
+static void
+prefetch_release (void)
+{
+  int i;
+
+  for (i = 0; i < prefetch_count; i++)
+    if (prefetch_files[i].data)
+      prefetch_fail (prefetch_files + i);
+
+  prefetch_count = 0;
+}
+
+/* Return the prefetched file that FILENAME, whose device has been set up
+   already, is, or -1.  */
+static int
+prefetch_find (char *filename)
+{
+  int i;
+
+  for (i = 0; i < prefetch_count; i++)
+    {
+      struct prefetch_file *file = prefetch_files + i;
+      int len;
+
+      if (file->state != PREFETCH_DONE
+	  || file->drive != current_drive
+	  || file->partition != current_partition)
+	continue;
+
+      len = grub_strlen (file->path);
+      if (! grub_memcmp (file->path, filename, len)
+	  && (! filename[len] || isspace (filename[len])))
+	return i;
+    }
+
+  return -1;
+}
+#endif /* ! STAGE1_5 */
+
+
+#if ! defined(STAGE1_5) && ! defined(NO_DECOMPRESSION) \
+    && defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+# define UNZIP_CACHE	1
+
+/* The contents of compressed files read through to the end, so that
+   opening one again, say for the splash image or a configfile, skips
+   decompressing it.  A file is known by its device, its name and its
+   compressed size, for there is no modification time to go by.  Only
+   smallish files are kept, so a big initrd never pushes the others
+   out.  */
+#define UNZIP_CACHE_MAX		8
+#define UNZIP_CACHE_FILE_MAX	0x200000
+#define UNZIP_CACHE_NAME_LEN	128
+
+struct unzip_cache_entry
+{
+  char name[UNZIP_CACHE_NAME_LEN];
+  unsigned long drive, partition;
+  int raw_size;
+  char *data;
+  int size, done;
+  unsigned long last_used;
+};
+
+static struct unzip_cache_entry unzip_cache[UNZIP_CACHE_MAX];
+static unsigned long unzip_cache_clock;
+/* The entry which GRUB_READ reads from, and the one which it fills in
+   as the file is decompressed, or -1.  */
+static int unzip_cache_hit = -1;
+static int unzip_cache_fill = -1;
+
+/* Copy FILENAME, up to any blank, into NAME.  Return zero if it is too
+   long to be kept.  */
+static int
+unzip_cache_name (char *name, char *filename)
+{
+  int len;
+
+  for (len = 0; filename[len] && ! isspace (filename[len]); len++)
+    {
+      if (len == UNZIP_CACHE_NAME_LEN - 1)
+	return 0;
+      name[len] = filename[len];
+    }
+
+  name[len] = 0;
+  return 1;
+}
+
+/* Open FILENAME, which the file system has opened already, out of the
+   cache if it is there.  Otherwise, see if it is compressed, and if so,
+   get an entry ready to keep it.  */
+static int
+unzip_cache_open (char *filename)
+{
+  struct unzip_cache_entry *entry;
+  char name[UNZIP_CACHE_NAME_LEN];
+  int raw_size = filemax;
+  int i;
+
+  unzip_cache_hit = unzip_cache_fill = -1;
+  /* A file to be checked has to be read from the disk.  */
+  if (no_decompression || verify_file >= 0
+      || ! unzip_cache_name (name, filename))
+    return gunzip_test_header ();
+
+  for (i = 0; i < UNZIP_CACHE_MAX; i++)
+    {
+      entry = unzip_cache + i;
+      if (entry->data && entry->done == entry->size
+	  && entry->drive == current_drive
+	  && entry->partition == current_partition
+	  && entry->raw_size == raw_size
+	  && ! grub_strcmp (entry->name, name))
+	{
+	  entry->last_used = ++unzip_cache_clock;
+	  unzip_cache_hit = i;
+	  filemax = entry->size;
+	  return 1;
+	}
+    }
+
+  if (! gunzip_test_header ())
+    return 0;
+  if (! compressed_file || filemax > UNZIP_CACHE_FILE_MAX)
+    return 1;
+
+  /* the entry used least lately, if none is free */
+  entry = unzip_cache;
+  for (i = 0; i < UNZIP_CACHE_MAX && unzip_cache[i].data; i++)
+    if (unzip_cache[i].last_used < entry->last_used)
+      entry = unzip_cache + i;
+  if (i < UNZIP_CACHE_MAX)
+    entry = unzip_cache + i;
+
+  if (entry->data)
+    grub_free (entry->data);
+
+  entry->data = grub_malloc (filemax ? filemax : 1);
+  if (! entry->data)
+    return 1;
+
+  /* Not grub_strcpy, which fails if ERRNUM is already set.  */
+  for (i = 0; (entry->name[i] = name[i]); i++)
+    ;
+  entry->drive = current_drive;
+  entry->partition = current_partition;
+  entry->raw_size = raw_size;
+  entry->size = filemax;
+  entry->done = 0;
+  entry->last_used = ++unzip_cache_clock;
+  unzip_cache_fill = entry - unzip_cache;
+  return 1;
+}
+
+/* LEN bytes from POS of the file being decompressed have been read into
+   BUF, so keep those that carry on from what is kept already.  */
+static void
+unzip_cache_add (int pos, char *buf, int len)
+{
+  struct unzip_cache_entry *entry = unzip_cache + unzip_cache_fill;
+
+  if (pos > entry->done || pos + len <= entry->done)
+    return;
+
+  grub_memcpy (entry->data + entry->done, buf + entry->done - pos,
+	       pos + len - entry->done);
+  entry->done = pos + len;
+  if (entry->done == entry->size)
+    unzip_cache_fill = -1;
+}
+#endif /* UNZIP_CACHE */
+
+
+#ifdef NET_CACHE
+/* The files of the network drive read through to the end, whatever the
+   command that read them, so that the config file, a kernel or an
+   initrd opened again, as when the menu comes back after a failed boot
+   or a file is looked at with cat before it is booted, doesn't cost
+   another download.  A file is known by the file system, the server
+   and its name.  The oldest files are forgotten when a new one wouldn't
+   fit in the budget.  */
+#define NET_CACHE_MAX		16
+#define NET_CACHE_NAME_LEN	128
+#define NET_CACHE_BUDGET	0x4000000
+
+struct net_cache_entry
+{
+  char name[NET_CACHE_NAME_LEN];
+  int fsys;
+  unsigned long long server;
+  char *data;
+  int size, done;
+  unsigned long last_used;
+};
+
+unsigned long net_cache_budget = NET_CACHE_BUDGET;
+unsigned long net_cache_used;
+unsigned long net_cache_hits;
+unsigned long net_cache_misses;
+
+static struct net_cache_entry net_cache[NET_CACHE_MAX];
+static unsigned long net_cache_clock;
+/* The entry which READ_RAW reads from, and the one which it fills in
+   as the file is fetched, or -1.  */
+static int net_cache_hit = -1;
+static int net_cache_fill = -1;
+
+/* The server which the network file system fetches from, as a number
+   which changes with it.  */
+static unsigned long long
+net_cache_server (void)
+{
+  int (*read_func) (char *buf, int len) = fsys_table[fsys_type].read_func;
+
+  if (read_func == efi_tftp_read)
+    return efi_tftp_server_id ();
+# ifdef FSYS_HTTP
+  if (read_func == http_read)
+    return http_server_id ();
+# endif
+# ifdef FSYS_TFTP
+  if (read_func == tftp_read)
+    return tftp_server_id ();
+# endif
+  return 0;
+}
+
+static void
+net_cache_drop (struct net_cache_entry *entry)
+{
+  if (! entry->data)
+    return;
+
+  grub_free (entry->data);
+  entry->data = 0;
+  net_cache_used -= entry->size;
+}
+
+int
+net_cache_flush (void)
+{
+  int i, count = 0;
+
+  net_cache_fill = -1;
+  for (i = 0; i < NET_CACHE_MAX; i++)
+    if (net_cache[i].data)
+      {
+	net_cache_drop (net_cache + i);
+	count++;
+      }
+
+  return count;
+}
+
+/* Give up the entry being filled in, unless the whole file is there.  */
+static void
+net_cache_end (void)
+{
+  if (net_cache_fill >= 0
+      && net_cache[net_cache_fill].done != net_cache[net_cache_fill].size)
+    net_cache_drop (net_cache + net_cache_fill);
+
+  net_cache_fill = -1;
+}
+
+/* Copy FILENAME, up to any blank, into NAME.  Return zero if it is too
+   long to be kept.  */
+static int
+net_cache_name (char *name, char *filename)
+{
+  int len;
+
+  for (len = 0; filename[len] && ! isspace (filename[len]); len++)
+    {
+      if (len == NET_CACHE_NAME_LEN - 1)
+	return 0;
+      name[len] = filename[len];
+    }
+
+  name[len] = 0;
+  return 1;
+}
+
+/* Find FILENAME, on the device set up already, and set NET_CACHE_HIT to
+   it.  Return zero if it isn't kept.  */
+static int
+net_cache_find (char *filename)
+{
+  char name[NET_CACHE_NAME_LEN];
+  unsigned long long server;
+  int i;
+
+  if (current_drive != NETWORK_DRIVE || ! net_cache_name (name, filename))
+    return 0;
+
+  server = net_cache_server ();
+  for (i = 0; i < NET_CACHE_MAX; i++)
+    {
+      struct net_cache_entry *entry = net_cache + i;
+
+      if (entry->data && entry->done == entry->size
+	  && entry->fsys == fsys_type && entry->server == server
+	  && ! grub_strcmp (entry->name, name))
+	{
+	  entry->last_used = ++net_cache_clock;
+	  net_cache_hit = i;
+	  net_cache_hits++;
+	  return 1;
 	}
-      else
-	errnum = ERR_BAD_FILENAME;
     }
 
-  print_error ();
-  do_completion = 0;
-  if (errnum)
-    return -1;
-  else
-    return unique - 1;
+  return 0;
 }
-#endif /* STAGE1_5 */
+
+/* FILENAME has been opened on the network drive, so get an entry ready
+   to keep it as it is read, making room for it if need be.  */
+static void
+net_cache_start (char *filename)
+{
+  struct net_cache_entry *entry;
+  char name[NET_CACHE_NAME_LEN];
+  int i;
+
+  if (current_drive != NETWORK_DRIVE || prefetching)
+    return;
+
+  net_cache_misses++;
+  if (filemax <= 0 || (unsigned long) filemax > net_cache_budget
+      || ! net_cache_name (name, filename))
+    return;
+
+  /* Forget the files used least lately until there are a free entry
+     and room for this one.  */
+  for (;;)
+    {
+      struct net_cache_entry *oldest = 0;
+
+      entry = 0;
+      for (i = 0; i < NET_CACHE_MAX; i++)
+	if (! net_cache[i].data)
+	  entry = net_cache + i;
+	else if (! oldest || net_cache[i].last_used < oldest->last_used)
+	  oldest = net_cache + i;
+
+      if (entry && net_cache_used + filemax <= net_cache_budget)
+	break;
+
+      net_cache_drop (oldest);
+    }
+
+  entry->data = grub_malloc (filemax);
+  if (! entry->data)
+    return;
+
+  /* Not grub_strcpy, which fails if ERRNUM is already set.  */
+  for (i = 0; (entry->name[i] = name[i]); i++)
+    ;
+  entry->fsys = fsys_type;
+  entry->server = net_cache_server ();
+  entry->size = filemax;
+  entry->done = 0;
+  entry->last_used = ++net_cache_clock;
+  net_cache_used += filemax;
+  net_cache_fill = entry - net_cache;
+}
+
+/* LEN bytes from POS of the file being fetched have been read into
+   BUF, so keep those that carry on from what is kept already.  */
+static void
+net_cache_add (int pos, char *buf, int len)
+{
+  struct net_cache_entry *entry = net_cache + net_cache_fill;
+
+  if (pos > entry->done || pos + len <= entry->done)
+    return;
+
+  grub_memcpy (entry->data + entry->done, buf + entry->done - pos,
+	       pos + len - entry->done);
+  entry->done = pos + len;
+  if (entry->done == entry->size)
+    net_cache_fill = -1;
+}
+#endif /* NET_CACHE */
 
 
 /*
  *  This is the generic file open function.
  */
 
-int
-grub_open (char *filename)
+#ifndef STAGE1_5
+/* What grub_read_byte has read ahead, and the file position just past
+   it.  */
+static char read_byte_buf[512];
+static int read_byte_len, read_byte_next, read_byte_end;
+#endif
+
+static int
+open_file (char *filename)
 {
 #ifndef NO_DECOMPRESSION
   compressed_file = 0;
@@ -1663,9 +4204,53 @@ grub_open (char *filename)
      set it to zero before returning if opening a file! */
   filepos = 0;
 
+#ifndef STAGE1_5
+  read_byte_len = read_byte_next = 0;
+  filemtime = 0;
+  prefetch_hit = -1;
+  if (! prefetching)
+    prefetch_stop ();
+#endif
+#ifdef UNZIP_CACHE
+  unzip_cache_hit = unzip_cache_fill = -1;
+#endif
+#ifdef NET_CACHE
+  net_cache_hit = -1;
+  net_cache_end ();
+#endif
+
   if (!(filename = setup_part (filename)))
     return 0;
 
+#ifndef STAGE1_5
+  bootprof_open (filename);
+  iostat_open (filename);
+  verify_open (filename);
+
+  if (prefetch_count && ! prefetching)
+    {
+      prefetch_hit = prefetch_find (filename);
+      if (prefetch_hit >= 0)
+	{
+	  filemax = prefetch_files[prefetch_hit].size;
+	  fsmax = MAXINT;
+# ifndef NO_BLOCK_FILES
+	  block_file = 0;
+# endif
+# ifdef UNZIP_CACHE
+	  return unzip_cache_open (filename);
+# elif ! defined(NO_DECOMPRESSION)
+	  return gunzip_test_header ();
+# else
+	  return 1;
+# endif
+	}
+
+      /* Another file may get loaded over the prefetched ones.  */
+      prefetch_release ();
+    }
+#endif /* ! STAGE1_5 */
+
 #ifndef NO_BLOCK_FILES
   block_file = 0;
 #endif /* NO_BLOCK_FILES */
@@ -1730,7 +4315,9 @@ grub_open (char *filename)
 	  BLK_CUR_BLKLIST = BLK_BLKLIST_START;
 	  BLK_CUR_BLKNUM = 0;
 
-#ifndef NO_DECOMPRESSION
+#ifdef UNZIP_CACHE
+	  return unzip_cache_open (filename);
+#elif ! defined(NO_DECOMPRESSION)
 	  return gunzip_test_header ();
 #else /* NO_DECOMPRESSION */
 	  return 1;
@@ -1749,9 +4336,28 @@ grub_open (char *filename)
   print_possibilities = 0;
 # endif
 
+#ifdef NET_CACHE
+  if (! errnum && net_cache_find (filename))
+    {
+      filemax = net_cache[net_cache_hit].size;
+# ifdef UNZIP_CACHE
+      return unzip_cache_open (filename);
+# elif ! defined(NO_DECOMPRESSION)
+      return gunzip_test_header ();
+# else
+      return 1;
+# endif
+    }
+#endif /* NET_CACHE */
+
   if (!errnum && (*(fsys_table[fsys_type].dir_func)) (filename))
     {
-#ifndef NO_DECOMPRESSION
+#ifdef NET_CACHE
+      net_cache_start (filename);
+#endif
+#ifdef UNZIP_CACHE
+      return unzip_cache_open (filename);
+#elif ! defined(NO_DECOMPRESSION)
       return gunzip_test_header ();
 #else /* NO_DECOMPRESSION */
       return 1;
@@ -1761,9 +4367,26 @@ grub_open (char *filename)
   return 0;
 }
 
-
 int
-grub_read (char *buf, int len)
+grub_open (char *filename)
+{
+#ifndef STAGE1_5
+  int ret;
+
+  verify_opening = 1;
+  ret = open_file (filename);
+  verify_opening = 0;
+  return ret;
+#else
+  return open_file (filename);
+#endif
+}
+
+
+static int read_raw (char *buf, int len);
+
+static int
+read_file (char *buf, int len)
 {
   /* Make sure "filepos" is a sane value */
   if ((filepos < 0) || (filepos > filemax))
@@ -1782,16 +4405,94 @@ grub_read (char *buf, int len)
       return 0;
     }
 
+#ifdef UNZIP_CACHE
+  if (unzip_cache_hit >= 0)
+    {
+      grub_memmove (buf, unzip_cache[unzip_cache_hit].data + filepos, len);
+      if (errnum)
+	return 0;
+
+      filepos += len;
+      return len;
+    }
+
+  if (compressed_file && unzip_cache_fill >= 0)
+    {
+      int pos = filepos, ret;
+
+      if (compressed_file == COMPRESSED_XZ)
+	ret = unxz_read (buf, len);
+      else if (compressed_file == COMPRESSED_ZSTD)
+	ret = unzstd_read (buf, len);
+      else
+	ret = gunzip_read (buf, len);
+
+      if (ret > 0)
+	unzip_cache_add (pos, buf, ret);
+      return ret;
+    }
+#endif /* UNZIP_CACHE */
+
 #ifndef NO_DECOMPRESSION
+  if (compressed_file == COMPRESSED_XZ)
+    return unxz_read (buf, len);
+  if (compressed_file == COMPRESSED_ZSTD)
+    return unzstd_read (buf, len);
   if (compressed_file)
     return gunzip_read (buf, len);
 #endif /* NO_DECOMPRESSION */
 
+#ifndef STAGE1_5
+  /* Nothing is read when only the place of the file is asked for; it
+     is hashed when it is closed.  */
+  if (verify_file >= 0 && ! disk_read_map_only)
+    {
+      int pos = filepos;
+      int ret = read_raw (buf, len);
+
+      if (ret > 0 && ! verify_update (pos, buf, ret))
+	return 0;
+      return ret;
+    }
+#endif /* ! STAGE1_5 */
+
+  return read_raw (buf, len);
+}
+
+/* Read LEN bytes of the file as it is on the disk.  */
+static int
+read_raw (char *buf, int len)
+{
+#ifndef STAGE1_5
+  if (prefetch_hit >= 0)
+    {
+      grub_memmove (buf, prefetch_files[prefetch_hit].data + filepos, len);
+      if (errnum)
+	return 0;
+
+      filepos += len;
+      return len;
+    }
+#endif /* ! STAGE1_5 */
+
+#ifdef NET_CACHE
+  if (net_cache_hit >= 0)
+    {
+      grub_memmove (buf, net_cache[net_cache_hit].data + filepos, len);
+      if (errnum)
+	return 0;
+
+      filepos += len;
+      return len;
+    }
+#endif /* NET_CACHE */
+
 #ifndef NO_BLOCK_FILES
   if (block_file)
     {
       int size, off, ret = 0;
       int sector_size = get_sector_size(current_drive);
+      int sector_bits = get_sector_bits(current_drive);
 
       while (len && !errnum)
 	{
@@ -1803,23 +4504,25 @@ grub_read (char *buf, int len)
 	      BLK_CUR_BLKNUM = 0;
 	    }
 
-	  /* run BLK_CUR_FILEPOS up to filepos */
+	  /* run BLK_CUR_FILEPOS up to filepos, skipping the blocks it is
+	     not in as a whole */
 	  while (filepos > BLK_CUR_FILEPOS)
 	    {
-	      if ((filepos - (BLK_CUR_FILEPOS & ~(sector_size - 1)))
-		  >= sector_size)
-		{
-		  BLK_CUR_FILEPOS += sector_size;
-		  BLK_CUR_BLKNUM++;
+	      int base = BLK_CUR_FILEPOS & ~(sector_size - 1);
+	      int end = base + ((BLK_BLKLENGTH (BLK_CUR_BLKLIST)
+				 - BLK_CUR_BLKNUM) << sector_bits);
 
-		  if (BLK_CUR_BLKNUM >= BLK_BLKLENGTH (BLK_CUR_BLKLIST))
-		    {
-		      BLK_CUR_BLKLIST += BLK_BLKLIST_INC_VAL;
-		      BLK_CUR_BLKNUM = 0;
-		    }
+	      if (filepos >= end)
+		{
+		  BLK_CUR_FILEPOS = end;
+		  BLK_CUR_BLKLIST += BLK_BLKLIST_INC_VAL;
+		  BLK_CUR_BLKNUM = 0;
 		}
 	      else
-		BLK_CUR_FILEPOS = filepos;
+		{
+		  BLK_CUR_BLKNUM += (filepos - base) >> sector_bits;
+		  BLK_CUR_FILEPOS = filepos;
+		}
 	    }
 
 	  off = filepos & (sector_size - 1);
@@ -1855,9 +4558,50 @@ grub_read (char *buf, int len)
       return 0;
     }
 
+#ifdef NET_CACHE
+  if (net_cache_fill >= 0)
+    {
+      int pos = filepos;
+      int ret = (*(fsys_table[fsys_type].read_func)) (buf, len);
+
+      if (ret > 0 && ! errnum)
+	net_cache_add (pos, buf, ret);
+      return ret;
+    }
+#endif /* NET_CACHE */
+
   return (*(fsys_table[fsys_type].read_func)) (buf, len);
 }
 
+#ifndef STAGE1_5
+static int readv_mappable (void);
+static int read_whole (char *buf);
+#endif /* ! STAGE1_5 */
+
+int
+grub_read (char *buf, int len)
+{
+#ifndef STAGE1_5
+  unsigned long long start;
+  int ret;
+
+  /* Not when the caller watches the reads itself, as blocklist does.  */
+  if (len < 0 && ! disk_read_hook && ! disk_read_map_only
+      && filemax <= fsmax && readv_mappable ())
+    return read_whole (buf);
+
+  start = bootprof_read_begin ();
+  ret = read_file (buf, len);
+
+  bootprof_read_end (start, ret);
+  if (ret > 0 && ! verify_opening)
+    verify_used = 1;
+  return ret;
+#else
+  return read_file (buf, len);
+#endif
+}
+
 #ifndef STAGE1_5
 /* Reposition a file offset.  */
 int
@@ -1870,6 +4614,238 @@ grub_seek (int offset)
   return offset;
 }
 
+/* Read the next byte of the open file into BYTE, going to the file
+   system only once for every sizeof (read_byte_buf) bytes.  Return 1,
+   or 0 at the end of the file.  Reads with grub_read in between would
+   skip what has been read ahead, but a grub_seek starts afresh.  */
+int
+grub_read_byte (char *byte)
+{
+  if (read_byte_next >= read_byte_len || filepos != read_byte_end)
+    {
+      read_byte_next = 0;
+      read_byte_len = grub_read (read_byte_buf, sizeof (read_byte_buf));
+      read_byte_end = filepos;
+      if (read_byte_len <= 0)
+	{
+	  read_byte_len = 0;
+	  return 0;
+	}
+    }
+
+  *byte = read_byte_buf[read_byte_next++];
+  return 1;
+}
+
+/* Return the position in the open file of the byte which
+   grub_read_byte would give next.  */
+int
+grub_read_byte_offset (void)
+{
+  if (filepos != read_byte_end)
+    return filepos;
+
+  return read_byte_end - read_byte_len + read_byte_next;
+}
+
+/* The places on the disk of the pieces given to grub_readv, as the file
+   system tells them with DISK_READ_MAP_ONLY set: LEN bytes at the byte
+   DISK of the drive go to BUF.  */
+#define READV_PIECES	256
+
+struct readv_piece
+{
+  unsigned long long disk;
+  int len;
+  char *buf;
+};
+
+static struct readv_piece readv_pieces[READV_PIECES];
+static int readv_count;
+static int readv_bits;
+/* Where the next bytes the file system tells of go, and whether there
+   was no room for them.  */
+static char *readv_dest;
+static int readv_full;
+
+static void
+readv_map_helper (int sector, int offset, int length)
+{
+  struct readv_piece *last = readv_count ? &readv_pieces[readv_count - 1] : 0;
+  unsigned long long disk;
+
+  if (errnum || length <= 0)
+    return;
+
+  /* A hole is zeros, and nothing to read.  */
+  if (sector < 0)
+    {
+      grub_memset (readv_dest, 0, length);
+      readv_dest += length;
+      return;
+    }
+
+  disk = ((unsigned long long) (unsigned int) sector << readv_bits) + offset;
+  if (last && last->disk + last->len == disk
+      && last->buf + last->len == readv_dest)
+    last->len += length;
+  else if (readv_count == READV_PIECES)
+    readv_full = 1;
+  else
+    {
+      last = &readv_pieces[readv_count++];
+      last->disk = disk;
+      last->len = length;
+      last->buf = readv_dest;
+    }
+
+  readv_dest += length;
+}
+
+/* Whether the open file is read from a disk as it is, so that the
+   file system can tell where its pieces are.  */
+static int
+readv_mappable (void)
+{
+#ifndef NO_DECOMPRESSION
+  if (compressed_file)
+    return 0;
+#endif
+#ifdef NET_CACHE
+  if (net_cache_hit >= 0 || net_cache_fill >= 0)
+    return 0;
+#endif
+#ifndef GRUB_UTIL
+  if (current_drive == memdisk_drive || current_drive == loop_drive)
+    return 0;
+#endif
+  return (verify_file < 0 && prefetch_hit < 0 && fsys_type != NUM_FSYS
+	  && current_drive != NETWORK_DRIVE);
+}
+
+int
+grub_readv (struct grub_iovec *iov, int count)
+{
+  unsigned long long start = bootprof_read_begin ();
+  struct readv_piece *p, *q;
+  int i, len, done = 0;
+
+  readv_count = 0;
+  readv_bits = get_sector_bits (current_drive);
+
+  /* Ask where each piece is, and read the ones the file system can't
+     tell of as grub_read would.  */
+  for (i = 0; i < count && ! errnum; i++)
+    {
+      int first = readv_count, mapped = 0;
+
+      len = iov[i].len;
+      if (iov[i].pos < 0 || iov[i].pos > filemax
+	  || len < 0 || len > filemax - iov[i].pos)
+	{
+	  errnum = ERR_FILELENGTH;
+	  break;
+	}
+
+      if (readv_mappable ())
+	{
+	  filepos = iov[i].pos;
+	  readv_dest = iov[i].buf;
+	  readv_full = 0;
+	  disk_read_hook = readv_map_helper;
+	  disk_read_map_only = 1;
+	  mapped = read_file (iov[i].buf, len);
+	  disk_read_map_only = 0;
+	  disk_read_hook = 0;
+
+	  if (errnum || readv_full || mapped != len
+	      || readv_dest != iov[i].buf + len)
+	    {
+	      readv_count = first;
+	      mapped = 0;
+	      if (errnum != ERR_FILELENGTH)
+		errnum = ERR_NONE;
+	    }
+	}
+
+      if (! mapped && len && ! errnum)
+	{
+	  filepos = iov[i].pos;
+	  if (read_file (iov[i].buf, len) != len && ! errnum)
+	    errnum = ERR_FILELENGTH;
+	}
+      done += len;
+    }
+
+  /* Read the pieces in the order they are on the disk, those which
+     follow each other both there and in memory with one read.  */
+  for (i = 1; i < readv_count; i++)
+    {
+      struct readv_piece t = readv_pieces[i];
+      int j;
+
+      for (j = i; j > 0 && readv_pieces[j - 1].disk > t.disk; j--)
+	readv_pieces[j] = readv_pieces[j - 1];
+      readv_pieces[j] = t;
+    }
+
+  for (p = readv_pieces; p < readv_pieces + readv_count && ! errnum; p = q)
+    {
+      len = p->len;
+      for (q = p + 1; q < readv_pieces + readv_count; q++)
+	if (q->disk != p->disk + len || q->buf != p->buf + len)
+	  break;
+	else
+	  len += q->len;
+
+      rawread (current_drive, p->disk >> readv_bits,
+	       p->disk & ((1 << readv_bits) - 1), len, p->buf);
+    }
+
+  if (count)
+    filepos = iov[count - 1].pos + iov[count - 1].len;
+
+  bootprof_read_end (start, errnum ? 0 : done);
+  if (errnum)
+    return 0;
+
+  if (done && ! verify_opening)
+    verify_used = 1;
+  return 1;
+}
+
+/* Read as much of the rest of the file at a time to BUF with grub_readv,
+   which has room to map it in as many pieces as a file of 4K blocks
+   scattered all over the disk would make.  */
+#define READ_WHOLE_CHUNK	(READV_PIECES << 12)
+
+/* Read the rest of the open file into BUF, as loaders do with a LEN of
+   -1.  The file system tells where each chunk of it is before anything
+   is read, and the pieces are read in the order they are on the disk,
+   as few reads as follow each other there.  A chunk it can't map is
+   read as usual.  Return how many bytes were read.  */
+static int
+read_whole (char *buf)
+{
+  struct grub_iovec chunk;
+  int ret = 0;
+
+  while (filepos < filemax)
+    {
+      chunk.pos = filepos;
+      chunk.len = filemax - filepos;
+      if (chunk.len > READ_WHOLE_CHUNK)
+	chunk.len = READ_WHOLE_CHUNK;
+      chunk.buf = buf + ret;
+
+      if (! grub_readv (&chunk, 1))
+	return 0;
+      ret += chunk.len;
+    }
+
+  return ret;
+}
+
 int
 dir (char *dirname)
 {
@@ -1899,10 +4875,25 @@ dir (char *dirname)
 void 
 grub_close (void)
 {
+#ifndef STAGE1_5
+  verify_close ();
+#endif /* ! STAGE1_5 */
+
 #ifndef NO_BLOCK_FILES
   if (block_file)
     return;
 #endif /* NO_BLOCK_FILES */
+
+#ifndef STAGE1_5
+  if (prefetch_hit >= 0)
+    return;
+#endif /* ! STAGE1_5 */
+
+#ifdef NET_CACHE
+  if (net_cache_hit >= 0)
+    return;
+  net_cache_end ();
+#endif /* NET_CACHE */
   
   if (fsys_table[fsys_type].close_func != 0)
     (*(fsys_table[fsys_type].close_func)) ();
@@ -53,6 +53,7 @@ void uefi_close (void);
 #ifdef FSYS_FAT
 #define FSYS_FAT_NUM 1
 int fat_mount (void);
+int fat_remount (void);
 int fat_read (char *buf, int len);
 int fat_dir (char *dirname);
 #else
@@ -62,6 +63,7 @@ int fat_dir (char *dirname);
 #ifdef FSYS_EXT2FS
 #define FSYS_EXT2FS_NUM 1
 int ext2fs_mount (void);
+int ext2fs_remount (void);
 int ext2fs_read (char *buf, int len);
 int ext2fs_dir (char *dirname);
 #else
@@ -115,22 +117,58 @@ int xfs_dir (char *dirname);
 #define FSYS_XFS_NUM 0
 #endif
 
+#ifdef FSYS_BTRFS
+#define FSYS_BTRFS_NUM 1
+int btrfs_mount (void);
+int btrfs_read (char *buf, int len);
+int btrfs_dir (char *dirname);
+#else
+#define FSYS_BTRFS_NUM 0
+#endif
+
 #ifdef FSYS_TFTP
 #define FSYS_TFTP_NUM 1
 int tftp_mount (void);
 int tftp_read (char *buf, int len);
 int tftp_dir (char *dirname);
 void tftp_close (void);
+unsigned long long tftp_server_id (void);
+
+/* A whole file for tftp_fetch: NAME, of SIZE bytes, to be put at
+   ADDR.  OK is set if all of it came.  */
+struct tftp_fetch
+{
+  char *name;
+  char *addr;
+  int size;
+  int ok;
+};
+
+#define TFTP_FETCH_MAX	4
+int tftp_fetch (struct tftp_fetch *files, int count);
 #else
 #define FSYS_TFTP_NUM 0
 #endif
 
+#ifdef FSYS_HTTP
+#define FSYS_HTTP_NUM 1
+int http_mount (void);
+int http_read (char *buf, int len);
+int http_dir (char *dirname);
+void http_close (void);
+unsigned long long http_server_id (void);
+#else
+#define FSYS_HTTP_NUM 0
+#endif
+
 #ifdef PLATFORM_EFI
 #define FSYS_EFI_TFTP_NUM 1
 int efi_tftp_mount (void);
 int efi_tftp_read (char *buf, int len);
 int efi_tftp_dir (char *dirname);
 void efi_tftp_close (void);
+int efi_tftp_mcast (char *arg);
+unsigned long long efi_tftp_server_id (void);
 #else
 #define FSYS_EFI_TFTP_NUM 0
 #endif
@@ -150,7 +188,7 @@ int iso9660_dir (char *dirname);
   (FSYS_FFS_NUM + FSYS_FAT_NUM + FSYS_EXT2FS_NUM + FSYS_MINIX_NUM	\
    + FSYS_REISERFS_NUM + FSYS_VSTAFS_NUM + FSYS_JFS_NUM + FSYS_XFS_NUM	\
    + FSYS_TFTP_NUM + FSYS_EFI_TFTP_NUM + FSYS_ISO9660_NUM + FSYS_UFS2_NUM \
-   + FSYS_UEFI_NUM)
+   + FSYS_UEFI_NUM + FSYS_HTTP_NUM + FSYS_BTRFS_NUM)
 #endif
 
 /* defines for the block filesystem info area */
@@ -185,3 +223,73 @@ extern int print_possibilities;
 
 extern int fsmax;
 extern struct fsys_entry fsys_table[NUM_FSYS + 1];
+
+#ifndef STAGE1_5
+/* The dentry cache, which remembers what the dir_func of the current
+   filesystem found for a name in a directory, including names that
+   don't exist.  DIR and DATA are whatever the filesystem uses to
+   identify the directory and the entry.  */
+#define DENTRY_CACHE_MAX	32
+#define DENTRY_NAME_LEN		64
+#define DENTRY_DATA_LEN		3
+
+int dentry_cache_lookup (unsigned long dir, const char *name,
+			 unsigned long *data);
+void dentry_cache_add (unsigned long dir, const char *name,
+		       unsigned long *data);
+void dentry_cache_invalidate (void);
+
+/* What the reads of the disks cost, in all, for each filesystem, with
+   the last entry for the reads made with none mounted, and for each
+   file opened, up to IOSTAT_FILES of them.  */
+struct iostat
+{
+  unsigned long rawreads;		/* calls of rawread */
+  unsigned long disk_reads;		/* reads from the disk */
+  unsigned long cache_hits;		/* blocks found in the disk cache */
+  unsigned long long bytes;		/* asked of rawread */
+  unsigned long long disk_bytes;	/* read from the disk */
+  unsigned long long moved;		/* copied between buffers */
+  unsigned long long cycles;		/* TSC cycles spent in rawread */
+};
+
+#define IOSTAT_FILES		16
+#define IOSTAT_NAME_LEN		32
+
+struct iostat_file
+{
+  char name[IOSTAT_NAME_LEN];
+  struct iostat stat;
+};
+
+extern struct iostat iostat_total;
+extern struct iostat iostat_fsys[NUM_FSYS + 1];
+extern struct iostat_file iostat_files[IOSTAT_FILES];
+extern int iostat_file_count;
+extern int iostat_files_dropped;
+
+void iostat_reset (void);
+
+/* The files listed in the manifest given to the verify command, each
+   with its SHA-256, which is computed as the file is read.  REREAD is
+   how much of a file had to be read again when it was closed, because
+   it had been read with gaps or not to the end.  The list is in the
+   bss of Stage 2, so it is kept short.  */
+#define VERIFY_FILES		16
+#define VERIFY_NAME_LEN		128
+
+#define VERIFY_UNCHECKED	0
+#define VERIFY_OK		1
+#define VERIFY_FAILED		2
+
+struct verify_entry
+{
+  char name[VERIFY_NAME_LEN];
+  unsigned char digest[32];
+  int state;
+  unsigned long reread;
+};
+
+extern struct verify_entry verify_list[VERIFY_FILES];
+extern int verify_count;
+#endif /* ! STAGE1_5 */
@@ -0,0 +1,334 @@
+/* fsid.c - an index of the UUIDs and labels of the file systems */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* The search command finds a partition by the UUID or the label of its
+   file system.  All the disks are gone through once, reading no more
+   than the few bytes of each superblock that tell these, and what they
+   tell is kept until something changes the disks, so that the lookups
+   after the first are made in memory.  No file system is mounted, and
+   no file is opened.  */
+
+#include <shared.h>
+#include <filesys.h>
+
+/* The most file systems the index can have.  A machine seldom has more,
+   and each takes over 100 bytes of the bss, below the protected mode
+   stack.  */
+#define FSID_MAX	24
+
+/* Long enough for a UUID as text, with its dashes.  */
+#define FSID_UUID_LEN	40
+#define FSID_LABEL_LEN	64
+
+/* How a UUID is kept on the disk.  */
+#define FSID_DCE	0	/* 16 bytes, shown as 8-4-4-4-12 */
+#define FSID_SERIAL	1	/* a 32-bit serial number, as XXXX-XXXX */
+#define FSID_DATE	2	/* the 16 digits of a date, as ISO 9660 has */
+
+/* Where a file system has its magic number, its UUID and its label,
+   in bytes from the start of the partition.  */
+struct fsid_type
+{
+  char *name;
+  int magic_offset;
+  char *magic;
+  int magic_len;
+  int uuid_offset;
+  int uuid_len;
+  int uuid_kind;
+  int label_offset;
+  int label_len;
+};
+
+static struct fsid_type fsid_types[] =
+{
+  /* the superblock 1K in */
+  {"ext2fs", 0x400 + 56, "\x53\xef", 2, 0x400 + 104, 16, FSID_DCE,
+   0x400 + 120, 16},
+  /* the boot sector, which has the volume ID and the label later if the
+     FAT is of 32 bits */
+  {"fat", 82, "FAT32   ", 8, 67, 4, FSID_SERIAL, 71, 11},
+  {"fat", 54, "FAT1", 4, 39, 4, FSID_SERIAL, 43, 11},
+  {"xfs", 0, "XFSB", 4, 32, 16, FSID_DCE, 108, 12},
+  /* the superblock at 64K */
+  {"reiserfs", 0x10000 + 52, "ReIsEr", 6, 0x10000 + 84, 16, FSID_DCE,
+   0x10000 + 100, 16},
+  {"btrfs", 0x10000 + 0x40, "_BHRfS_M", 8, 0x10000 + 0x20, 16, FSID_DCE,
+   0x10000 + 0x12b, FSID_LABEL_LEN - 1},
+  /* the primary volume descriptor at 32K, whose creation date is taken
+     for a UUID */
+  {"iso9660", 0x8000 + 1, "CD001", 5, 0x8000 + 813, 16, FSID_DATE,
+   0x8000 + 40, 32},
+  {0, 0, 0, 0, 0, 0, 0, 0, 0}
+};
+
+struct fsid_entry
+{
+  unsigned long drive;
+  unsigned long partition;
+  struct fsid_type *type;
+  char uuid[FSID_UUID_LEN];
+  char label[FSID_LABEL_LEN];
+};
+
+static struct fsid_entry fsid_index[FSID_MAX];
+static int fsid_count;
+/* Whether the index has been made, and the disks it was made of.  */
+static int fsid_valid;
+static unsigned long fsid_generation;
+
+/* Read LEN bytes from OFFSET in the partition of DRIVE which starts at
+   START and has LENGTH sectors into BUF.  Return nonzero if it could.  */
+static int
+fsid_read (unsigned long drive, sector_t start, sector_t length,
+	   int offset, int len, char *buf)
+{
+  int bits = get_sector_bits (drive);
+  sector_t sector = start + (offset >> bits);
+
+  if (((offset + len - 1) >> bits) >= length)
+    return 0;
+
+  if (! rawread (drive, sector, offset & ((1 << bits) - 1), len, buf))
+    {
+      errnum = ERR_NONE;
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Put the UUID in RAW, as TYPE has it, into UUID as text.  */
+static void
+fsid_uuid_text (struct fsid_type *type, unsigned char *raw, char *uuid)
+{
+  char *p = uuid;
+  int i;
+
+  switch (type->uuid_kind)
+    {
+    case FSID_DCE:
+      for (i = 0; i < 16; i++)
+	{
+	  if (i == 4 || i == 6 || i == 8 || i == 10)
+	    *p++ = '-';
+	  *p++ = "0123456789abcdef"[raw[i] >> 4];
+	  *p++ = "0123456789abcdef"[raw[i] & 0xf];
+	}
+      break;
+
+    case FSID_SERIAL:
+      for (i = 3; i >= 0; i--)
+	{
+	  if (i == 1)
+	    *p++ = '-';
+	  *p++ = "0123456789ABCDEF"[raw[i] >> 4];
+	  *p++ = "0123456789ABCDEF"[raw[i] & 0xf];
+	}
+      break;
+
+    case FSID_DATE:
+      /* YYYY-MM-DD-HH-MM-SS-CC from YYYYMMDDHHMMSSCC */
+      for (i = 0; i < 16; i++)
+	{
+	  if (raw[i] < '0' || raw[i] > '9')
+	    {
+	      p = uuid;
+	      break;
+	    }
+	  if (i >= 4 && ! (i & 1))
+	    *p++ = '-';
+	  *p++ = raw[i];
+	}
+      break;
+    }
+
+  *p = 0;
+}
+
+/* Put the label in RAW, of LEN bytes, into LABEL without the padding.
+   A FAT without one says so in it.  */
+static void
+fsid_label_text (unsigned char *raw, int len, char *label)
+{
+  while (len > 0 && (raw[len - 1] == ' ' || raw[len - 1] == 0))
+    len--;
+
+  if (len == 7 && ! grub_memcmp ((char *) raw, "NO NAME", 7))
+    len = 0;
+
+  grub_memmove (label, (char *) raw, len);
+  label[len] = 0;
+}
+
+/* Add the file system in the partition PARTITION of DRIVE, which starts
+   at START and has LENGTH sectors, to the index if it has one that is
+   known here.  */
+static void
+fsid_probe (unsigned long drive, unsigned long partition,
+	    sector_t start, sector_t length)
+{
+  unsigned char raw[FSID_LABEL_LEN];
+  struct fsid_type *type;
+  struct fsid_entry *entry;
+
+  if (fsid_count == FSID_MAX)
+    return;
+
+  for (type = fsid_types; type->name; type++)
+    if (fsid_read (drive, start, length, type->magic_offset,
+		   type->magic_len, (char *) raw)
+	&& ! grub_memcmp ((char *) raw, type->magic, type->magic_len))
+      break;
+
+  if (! type->name)
+    return;
+
+  entry = &fsid_index[fsid_count];
+  entry->drive = drive;
+  entry->partition = partition;
+  entry->type = type;
+  entry->uuid[0] = entry->label[0] = 0;
+
+  if (fsid_read (drive, start, length, type->uuid_offset, type->uuid_len,
+		 (char *) raw))
+    fsid_uuid_text (type, raw, entry->uuid);
+  if (fsid_read (drive, start, length, type->label_offset, type->label_len,
+		 (char *) raw))
+    fsid_label_text (raw, type->label_len, entry->label);
+
+  fsid_count++;
+}
+
+/* Go through the partitions of DRIVE, and the whole of it.  */
+static void
+fsid_scan_drive (unsigned long drive)
+{
+  unsigned long part = 0xFFFFFF;
+  unsigned long offset, ext_offset, gpt_offset;
+  sector_t start, len;
+  int type, entry, gpt_count, gpt_size;
+  struct geometry geom;
+
+  if (get_diskinfo (drive, &geom))
+    return;
+
+  {
+    char buf[1 << get_sector_bits (drive)];
+
+    /* A disk without partitions, such as a CD-ROM.  */
+    probe_ahead (drive, 0xFFFFFF);
+    fsid_probe (drive, 0xFFFFFF, 0, geom.total_sectors);
+
+    while (next_partition (drive, 0xFFFFFF, &part, &type,
+			   &start, &len, &offset, &entry,
+			   &ext_offset, &gpt_offset,
+			   &gpt_count, &gpt_size, buf))
+      {
+	if (type == PC_SLICE_TYPE_NONE
+	    || IS_PC_SLICE_TYPE_BSD (type)
+	    || IS_PC_SLICE_TYPE_EXTENDED (type))
+	  continue;
+
+	probe_ahead (drive, part);
+	fsid_probe (drive, part, start, len);
+      }
+  }
+
+  errnum = ERR_NONE;
+}
+
+/* Make the index, unless it is made of the disks as they are.  */
+static void
+fsid_scan (void)
+{
+  unsigned long drive;
+  int saved_errnum = errnum;
+
+  if (fsid_valid && fsid_generation == disk_cache_generation)
+    return;
+
+  fsid_count = 0;
+  for (drive = 0x80; drive < 0x80 + MAX_HD_NUM; drive++)
+    fsid_scan_drive (drive);
+  if (cdrom_drive != GRUB_INVALID_DRIVE
+      && cdrom_drive >= 0x80 + MAX_HD_NUM)
+    fsid_scan_drive (cdrom_drive);
+
+  fsid_valid = 1;
+  fsid_generation = disk_cache_generation;
+  errnum = saved_errnum;
+}
+
+/* Whether the strings A and B are the same, ignoring the case.  */
+static int
+fsid_equal (const char *a, const char *b)
+{
+  while (*a && tolower (*a) == tolower (*b))
+    a++, b++;
+
+  return ! *a && ! *b;
+}
+
+/* Find the file system whose label is KEY if BY_LABEL is set, or whose
+   UUID is KEY otherwise, and put where it is in DRIVE and PARTITION.
+   Return nonzero if there is one.  */
+int
+fsid_search (const char *key, int by_label,
+	     unsigned long *drive, unsigned long *partition)
+{
+  int i;
+
+  fsid_scan ();
+  for (i = 0; i < fsid_count; i++)
+    if (fsid_equal (by_label ? fsid_index[i].label : fsid_index[i].uuid,
+		    key))
+      {
+	*drive = fsid_index[i].drive;
+	*partition = fsid_index[i].partition;
+	return 1;
+      }
+
+  return 0;
+}
+
+/* Print the index.  */
+void
+fsid_print (void)
+{
+  int i;
+
+  fsid_scan ();
+  for (i = 0; i < fsid_count; i++)
+    {
+      struct fsid_entry *entry = &fsid_index[i];
+
+      if (entry->drive == cdrom_drive)
+	grub_printf (" (cd");
+      else
+	grub_printf (" (hd%d", entry->drive - 0x80);
+      if ((entry->partition & 0xFF0000) != 0xFF0000)
+	grub_printf (",%d", entry->partition >> 16);
+      if ((entry->partition & 0x00FF00) != 0x00FF00)
+	grub_printf (",%c", ((entry->partition >> 8) & 0xFF) + 'a');
+      grub_printf (")  %s  UUID=%s  LABEL=%s\n", entry->type->name,
+		   entry->uuid, entry->label);
+    }
+}
@@ -0,0 +1,1725 @@
+/* fsys_btrfs.c - an implementation for the Btrfs file system */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2009  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Read-only access to the default subvolume of a Btrfs file system,
+ * and to the subvolumes below it.
+ *
+ * Every tree block is found by its logical address, which the chunks
+ * map onto the device.  The map is read once at mount time, from the
+ * system chunks the superblock carries and then from the chunk tree,
+ * and kept sorted, so that each block after that costs one binary
+ * search and one read.  Only the chunks which have a copy of their
+ * own on this device can be mapped, which rules out the striped
+ * profiles; single, DUP and the mirrored ones are all fine.
+ *
+ * Files are read through fsys_read_extents, their extents being
+ * looked up in the file system tree as it asks for them.  Inline
+ * extents are copied out of the leaf.  Compressed extents are decoded
+ * whole into a buffer of the EFI pool, which holds on to the last one,
+ * with zlib, LZO or zstd; there is no room for that elsewhere.
+ */
+
+#ifdef FSYS_BTRFS
+
+#include "shared.h"
+#include "filesys.h"
+#include "btrfs.h"
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+# define BTRFS_POOL	1
+#endif
+
+#define MAX_LINK_COUNT	8
+#define PATH_MAX	1024
+
+#define S_IFMT		00170000
+#define S_IFLNK		0120000
+#define S_IFREG		0100000
+#define S_IFDIR		0040000
+#define S_ISLNK(m)	(((m) & S_IFMT) == S_IFLNK)
+#define S_ISREG(m)	(((m) & S_IFMT) == S_IFREG)
+#define S_ISDIR(m)	(((m) & S_IFMT) == S_IFDIR)
+
+/* One chunk, as far as this device goes.  */
+struct btrfs_chunk_map
+{
+  btrfs_u64 logical;
+  btrfs_u64 length;
+  btrfs_u64 physical;
+};
+
+/* A tree to look things up in.  */
+struct btrfs_root
+{
+  btrfs_u64 id;
+  btrfs_u64 bytenr;
+  int level;
+};
+
+/* What a file extent says about the bytes it covers.  */
+#define EXTENT_HOLE		0
+#define EXTENT_REGULAR		1
+#define EXTENT_INLINE		2
+#define EXTENT_COMPRESSED	3
+
+struct btrfs_info
+{
+  int sector_bits;		/* of the drive */
+  int block_bits;		/* of the sectorsize of the file system */
+  int nodesize;
+  btrfs_u64 devid;		/* of this device */
+
+  struct btrfs_root tree_root;	/* the tree of trees */
+  struct btrfs_root top;	/* the default subvolume */
+  struct btrfs_root fs;		/* the subvolume of the file */
+  btrfs_u64 ino;		/* the file */
+
+  /* the tree block in the node buffer, if any */
+  char *node;
+  btrfs_u64 node_bytenr;
+  int node_valid;
+
+  /* the chunk map, sorted by logical address */
+  struct btrfs_chunk_map *chunks;
+  int nchunks;
+  int max_chunks;
+
+  /* the item found last, and the way down to it */
+  struct
+  {
+    btrfs_u64 bytenr;
+    int slot;
+    int nritems;
+  } path[BTRFS_MAX_LEVEL];
+
+  /* the extent found last */
+  btrfs_u64 ext_start;
+  btrfs_u64 ext_end;
+  btrfs_u64 ext_disk;		/* where EXT_START is, or the whole extent */
+  btrfs_u64 ext_disk_len;
+  btrfs_u64 ext_offset;		/* of EXT_START in what it decompresses to */
+  btrfs_u64 ext_ram;		/* and how big that is */
+  int ext_kind;
+  int ext_compression;
+  int ext_valid;
+};
+
+static struct btrfs_info btrfs;
+
+/* Unless the tree blocks are bigger than NODE_BUFLEN, FSYS_BUF holds
+   the one read last, and the chunk map after it.  */
+#define NODE_BUFLEN	0x4000
+#define node_buf	((char *) FSYS_BUF)
+#define chunk_buf	((struct btrfs_chunk_map *) (FSYS_BUF + NODE_BUFLEN))
+#define CHUNK_BUF_MAX	\
+  ((int) ((FSYS_BUFLEN - NODE_BUFLEN) / sizeof (struct btrfs_chunk_map)))
+
+#ifdef BTRFS_POOL
+/* On EFI the pool has room for the biggest tree blocks and for the
+   chunks of a file system of any size.  */
+#define NODE_POOL_LEN	0x10000
+#define CHUNK_POOL_MAX	8192
+
+static char *node_pool;
+static struct btrfs_chunk_map *chunk_pool;
+#endif
+
+#define HEADER(node)	((struct btrfs_header *) (node))
+#define LEAF_ITEM(node, i)						\
+  ((struct btrfs_item *) ((node) + sizeof (struct btrfs_header)) + (i))
+#define KEY_PTR(node, i)						\
+  ((struct btrfs_key_ptr *) ((node) + sizeof (struct btrfs_header)) + (i))
+
+static int
+key_cmp (struct btrfs_key *a, struct btrfs_key *b)
+{
+  if (a->objectid != b->objectid)
+    return a->objectid < b->objectid ? -1 : 1;
+  if (a->type != b->type)
+    return a->type < b->type ? -1 : 1;
+  if (a->offset != b->offset)
+    return a->offset < b->offset ? -1 : 1;
+  return 0;
+}
+
+static void
+key_set (struct btrfs_key *key, btrfs_u64 objectid, int type,
+	 btrfs_u64 offset)
+{
+  key->objectid = objectid;
+  key->type = type;
+  key->offset = offset;
+}
+
+/* The CRC-32C which names are hashed with, without the inversions.  */
+static btrfs_u32
+crc32c (btrfs_u32 crc, const char *buf, int len)
+{
+  int k;
+
+  while (len--)
+    {
+      crc ^= (unsigned char) *buf++;
+      for (k = 0; k < 8; k++)
+	crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    }
+
+  return crc;
+}
+
+#define name_hash(name, len)	crc32c (~1, (name), (len))
+
+
+/*
+ *  The chunk map.
+ */
+
+/* Add the chunk at LOGICAL which CHUNK describes.  Chunks which are
+   already there, or which cannot be read from this device, are left
+   out.  */
+static void
+chunk_add (btrfs_u64 logical, struct btrfs_chunk *chunk)
+{
+  struct btrfs_stripe *stripe = (struct btrfs_stripe *) (chunk + 1);
+  struct btrfs_chunk_map *map = btrfs.chunks;
+  int i, lo = 0, hi = btrfs.nchunks;
+
+  if ((chunk->type & BTRFS_BLOCK_GROUP_STRIPED) && chunk->num_stripes > 1)
+    return;
+
+  for (i = 0; i < chunk->num_stripes; i++)
+    if (stripe[i].devid == btrfs.devid)
+      break;
+  if (i == chunk->num_stripes || btrfs.nchunks == btrfs.max_chunks)
+    return;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+
+      if (map[mid].logical < logical)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (lo < btrfs.nchunks && map[lo].logical == logical)
+    return;
+
+  grub_memmove ((char *) (map + lo + 1), (char *) (map + lo),
+		(btrfs.nchunks - lo) * sizeof (*map));
+  map[lo].logical = logical;
+  map[lo].length = chunk->length;
+  map[lo].physical = stripe[i].offset;
+  btrfs.nchunks++;
+}
+
+/* Find where LOGICAL is on the device.  Set *PHYSICAL to that, and
+   *LEN to how much follows it in the same chunk.  */
+static int
+chunk_map (btrfs_u64 logical, btrfs_u64 *physical, btrfs_u64 *len)
+{
+  struct btrfs_chunk_map *map = btrfs.chunks;
+  int lo = 0, hi = btrfs.nchunks;
+
+  /* the last chunk which does not start after it */
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+
+      if (map[mid].logical <= logical)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (! lo || logical - map[lo - 1].logical >= map[lo - 1].length)
+    {
+      errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+
+  map += lo - 1;
+  *physical = map->physical + (logical - map->logical);
+  *len = map->length - (logical - map->logical);
+  return 1;
+}
+
+/* Read LEN bytes at LOGICAL into BUF.  */
+static int
+logical_read (btrfs_u64 logical, int len, char *buf)
+{
+  btrfs_u64 physical, avail, sector;
+
+  if (! chunk_map (logical, &physical, &avail))
+    return 0;
+
+  sector = physical >> btrfs.sector_bits;
+  if (avail < len || sector > MAXINT)
+    {
+      errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+
+  return devread (sector, physical & ((1 << btrfs.sector_bits) - 1),
+		  len, buf);
+}
+
+
+/*
+ *  Trees.
+ */
+
+/* Read the tree block at BYTENR, which should be at LEVEL, into the
+   node buffer.  */
+static int
+node_read (btrfs_u64 bytenr, int level)
+{
+  struct btrfs_header *h = HEADER (btrfs.node);
+  int room = btrfs.nodesize - sizeof (struct btrfs_header);
+
+  if (! btrfs.node_valid || btrfs.node_bytenr != bytenr)
+    {
+      btrfs.node_valid = 0;
+      if (! logical_read (bytenr, btrfs.nodesize, btrfs.node))
+	return 0;
+      btrfs.node_bytenr = bytenr;
+      btrfs.node_valid = 1;
+    }
+
+  if (h->bytenr != bytenr || h->level != level
+      || h->nritems > room / (level ? sizeof (struct btrfs_key_ptr)
+			      : sizeof (struct btrfs_item)))
+    {
+      btrfs.node_valid = 0;
+      errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Find the last item of ROOT which is not after KEY, and remember the
+   way down to it.  Return 1 if there is one, and 0 if there is none,
+   in which case the next item is the first one.  */
+static int
+tree_search (struct btrfs_root *root, struct btrfs_key *key)
+{
+  btrfs_u64 bytenr = root->bytenr;
+  int level = root->level;
+  int lo, hi, mid, n;
+
+  if (level >= BTRFS_MAX_LEVEL)
+    {
+      errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+
+  for (;;)
+    {
+      if (! node_read (bytenr, level))
+	return 0;
+
+      n = HEADER (btrfs.node)->nritems;
+      lo = 0;
+      hi = n;
+      while (lo < hi)
+	{
+	  mid = (lo + hi) / 2;
+	  if (key_cmp (level ? &KEY_PTR (btrfs.node, mid)->key
+		       : &LEAF_ITEM (btrfs.node, mid)->key, key) <= 0)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+
+      btrfs.path[level].bytenr = bytenr;
+      btrfs.path[level].slot = lo - 1;
+      btrfs.path[level].nritems = n;
+
+      if (! level)
+	return lo > 0;
+
+      /* nothing below is before KEY, so go to the first of it */
+      if (! lo)
+	{
+	  if (! n)
+	    {
+	      errnum = ERR_FSYS_CORRUPT;
+	      return 0;
+	    }
+	  btrfs.path[level].slot = 0;
+	}
+
+      bytenr = KEY_PTR (btrfs.node, btrfs.path[level].slot)->blockptr;
+      level--;
+    }
+}
+
+/* Go on to the item after the one found last, in ROOT.  Return zero
+   if there is none.  */
+static int
+tree_next (struct btrfs_root *root)
+{
+  int level;
+
+  if (btrfs.path[0].slot + 1 < btrfs.path[0].nritems)
+    {
+      btrfs.path[0].slot++;
+      return 1;
+    }
+
+  for (level = 1; level <= root->level; level++)
+    if (btrfs.path[level].slot + 1 < btrfs.path[level].nritems)
+      break;
+
+  if (level > root->level)
+    return 0;
+
+  btrfs.path[level].slot++;
+  for (; level > 0; level--)
+    {
+      btrfs_u64 bytenr;
+
+      if (! node_read (btrfs.path[level].bytenr, level))
+	return 0;
+
+      bytenr = KEY_PTR (btrfs.node, btrfs.path[level].slot)->blockptr;
+      if (! node_read (bytenr, level - 1))
+	return 0;
+
+      btrfs.path[level - 1].bytenr = bytenr;
+      btrfs.path[level - 1].slot = 0;
+      btrfs.path[level - 1].nritems = HEADER (btrfs.node)->nritems;
+    }
+
+  return btrfs.path[0].nritems != 0;
+}
+
+/* Return the item found last, with the leaf it is in read back into
+   the node buffer if need be, and point *DATA at what it holds.  */
+static struct btrfs_item *
+path_item (char **data)
+{
+  struct btrfs_item *item;
+  int room = btrfs.nodesize - sizeof (struct btrfs_header);
+
+  if (btrfs.path[0].slot < 0 || btrfs.path[0].slot >= btrfs.path[0].nritems
+      || ! node_read (btrfs.path[0].bytenr, 0))
+    {
+      if (! errnum)
+	errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+
+  item = LEAF_ITEM (btrfs.node, btrfs.path[0].slot);
+  if (item->offset > room || item->size > room - item->offset)
+    {
+      errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+
+  *data = btrfs.node + sizeof (struct btrfs_header) + item->offset;
+  return item;
+}
+
+/* Look KEY up in ROOT, and return its item if it is there.  */
+static struct btrfs_item *
+item_find (struct btrfs_root *root, struct btrfs_key *key, char **data)
+{
+  struct btrfs_item *item;
+
+  if (! tree_search (root, key) || ! (item = path_item (data))
+      || key_cmp (&item->key, key))
+    return 0;
+
+  return item;
+}
+
+/* Find the subvolume ID in the tree of trees.  */
+static int
+root_find (btrfs_u64 id, struct btrfs_root *root)
+{
+  struct btrfs_key key;
+  struct btrfs_item *item;
+  struct btrfs_root_item *ri;
+
+  /* the item of a snapshot has the generation it was taken at as its
+     offset, so take the last one */
+  key_set (&key, id, BTRFS_ROOT_ITEM_KEY, ~0ULL);
+  if (! tree_search (&btrfs.tree_root, &key)
+      || ! (item = path_item ((char **) &ri))
+      || item->key.objectid != id || item->key.type != BTRFS_ROOT_ITEM_KEY
+      || item->size < sizeof (*ri))
+    {
+      if (! errnum)
+	errnum = ERR_FILE_NOT_FOUND;
+      return 0;
+    }
+
+  root->id = id;
+  root->bytenr = ri->bytenr;
+  root->level = ri->level;
+  return 1;
+}
+
+/* Read the chunk tree into the chunk map.  */
+static int
+chunk_tree_read (btrfs_u64 bytenr, int level)
+{
+  struct btrfs_root root;
+  struct btrfs_key key;
+  struct btrfs_item *item;
+  char *data;
+
+  root.id = BTRFS_CHUNK_TREE_OBJECTID;
+  root.bytenr = bytenr;
+  root.level = level;
+
+  /* the device items come first */
+  key_set (&key, BTRFS_FIRST_CHUNK_TREE_OBJECTID, BTRFS_CHUNK_ITEM_KEY, 0);
+  if (! tree_search (&root, &key) && (errnum || ! tree_next (&root)))
+    return ! errnum;
+
+  do
+    {
+      if (! (item = path_item (&data)))
+	return 0;
+
+      if (item->key.objectid > BTRFS_FIRST_CHUNK_TREE_OBJECTID)
+	break;
+
+      if (item->key.type == BTRFS_CHUNK_ITEM_KEY)
+	{
+	  struct btrfs_chunk *chunk = (struct btrfs_chunk *) data;
+
+	  if (item->size < sizeof (*chunk)
+	      || (item->size < sizeof (*chunk)
+		  + chunk->num_stripes * sizeof (struct btrfs_stripe)))
+	    {
+	      errnum = ERR_FSYS_CORRUPT;
+	      return 0;
+	    }
+
+	  /* the node buffer is not touched while adding it */
+	  chunk_add (item->key.offset, chunk);
+	}
+    }
+  while (tree_next (&root));
+
+  return ! errnum;
+}
+
+/* Find which subvolume is the default one.  */
+static int
+default_find (void)
+{
+  struct btrfs_key key;
+  struct btrfs_item *item;
+  struct btrfs_dir_item *di;
+  btrfs_u64 id = BTRFS_FS_TREE_OBJECTID;
+
+  key_set (&key, BTRFS_ROOT_TREE_DIR_OBJECTID, BTRFS_DIR_ITEM_KEY,
+	   name_hash ("default", 7));
+  item = item_find (&btrfs.tree_root, &key, (char **) &di);
+  if (item && item->size >= sizeof (*di)
+      && di->location.type == BTRFS_ROOT_ITEM_KEY)
+    id = di->location.objectid;
+  errnum = ERR_NONE;
+
+  return root_find (id, &btrfs.top);
+}
+
+
+int
+btrfs_mount (void)
+{
+  struct btrfs_super_block *sb = (struct btrfs_super_block *) FSYS_BUF;
+  unsigned int size, pos, len;
+
+  btrfs.sector_bits = get_sector_bits (current_drive);
+  if (part_length <= ((BTRFS_SUPER_OFFSET + sizeof (*sb))
+		      >> btrfs.sector_bits)
+      || ! devread (0, BTRFS_SUPER_OFFSET, sizeof (*sb), (char *) sb)
+      || grub_memcmp (sb->magic, BTRFS_MAGIC, BTRFS_MAGIC_LEN))
+    return 0;
+
+  /* blocks must be made of whole sectors, and no bigger than 64K */
+  if (sb->sectorsize < (1 << btrfs.sector_bits)
+      || sb->sectorsize > 0x10000 || (sb->sectorsize & (sb->sectorsize - 1))
+      || sb->nodesize < sb->sectorsize || sb->nodesize > 0x10000
+      || (sb->nodesize & (sb->nodesize - 1))
+      || sb->sys_chunk_array_size > BTRFS_SYSTEM_CHUNK_ARRAY_SIZE
+      || sb->root_level >= BTRFS_MAX_LEVEL
+      || sb->chunk_root_level >= BTRFS_MAX_LEVEL)
+    return 0;
+
+  btrfs.nodesize = sb->nodesize;
+  for (btrfs.block_bits = 9; (1 << btrfs.block_bits) < sb->sectorsize;
+       btrfs.block_bits++)
+    ;
+  btrfs.devid = sb->dev_item.devid;
+  btrfs.tree_root.id = BTRFS_ROOT_TREE_OBJECTID;
+  btrfs.tree_root.bytenr = sb->root;
+  btrfs.tree_root.level = sb->root_level;
+
+  btrfs.node = node_buf;
+  btrfs.chunks = chunk_buf;
+  btrfs.max_chunks = CHUNK_BUF_MAX;
+#ifdef BTRFS_POOL
+  if (! node_pool)
+    node_pool = grub_malloc (NODE_POOL_LEN);
+  if (! chunk_pool)
+    chunk_pool = grub_malloc (CHUNK_POOL_MAX * sizeof (*chunk_pool));
+  if (node_pool && chunk_pool)
+    {
+      btrfs.node = node_pool;
+      btrfs.chunks = chunk_pool;
+      btrfs.max_chunks = CHUNK_POOL_MAX;
+    }
+#endif
+  if (btrfs.nodesize > NODE_BUFLEN && btrfs.node == node_buf)
+    return 0;
+
+  btrfs.node_valid = 0;
+  btrfs.ext_valid = 0;
+  btrfs.nchunks = 0;
+
+  /* the system chunks, which the chunk tree is in, are listed in the
+     superblock, which the node buffer does not overlap the map of */
+  size = sb->sys_chunk_array_size;
+  for (pos = 0; pos + sizeof (struct btrfs_key) + sizeof (struct btrfs_chunk)
+	 <= size; pos += len)
+    {
+      struct btrfs_key *key = (struct btrfs_key *) (sb->sys_chunk_array + pos);
+      struct btrfs_chunk *chunk = (struct btrfs_chunk *) (key + 1);
+
+      len = (sizeof (*key) + sizeof (*chunk)
+	     + chunk->num_stripes * sizeof (struct btrfs_stripe));
+      if (key->type != BTRFS_CHUNK_ITEM_KEY || pos + len > size)
+	return 0;
+
+      chunk_add (key->offset, chunk);
+    }
+
+  if (! chunk_tree_read (sb->chunk_root, sb->chunk_root_level)
+      || ! default_find ())
+    {
+      errnum = ERR_NONE;
+      return 0;
+    }
+
+  btrfs.fs = btrfs.top;
+  return 1;
+}
+
+
+/*
+ *  Compressed extents.
+ */
+
+#ifdef BTRFS_POOL
+
+/* The zlib format, decoded the way puff does it.  */
+
+#define MAXBITS		15
+#define MAXLCODES	286
+#define MAXDCODES	30
+#define FIXLCODES	288
+
+static struct
+{
+  unsigned char *out;
+  int outlen;
+  int outcnt;
+  unsigned char *in;
+  int inlen;
+  int incnt;
+  unsigned int bitbuf;
+  int bitcnt;
+  int err;			/* whether the input ran out */
+} zs;
+
+struct zhuff
+{
+  short count[MAXBITS + 1];
+  short symbol[FIXLCODES];
+};
+
+static int
+zbits (int need)
+{
+  unsigned int val = zs.bitbuf;
+
+  while (zs.bitcnt < need)
+    {
+      if (zs.incnt == zs.inlen)
+	{
+	  zs.err = 1;
+	  return 0;
+	}
+      val |= (unsigned int) zs.in[zs.incnt++] << zs.bitcnt;
+      zs.bitcnt += 8;
+    }
+
+  zs.bitbuf = val >> need;
+  zs.bitcnt -= need;
+  return val & ((1U << need) - 1);
+}
+
+static int
+zstored (void)
+{
+  unsigned int len;
+
+  zs.bitbuf = 0;
+  zs.bitcnt = 0;
+
+  if (zs.incnt + 4 > zs.inlen)
+    return -1;
+  len = zs.in[zs.incnt] | (zs.in[zs.incnt + 1] << 8);
+  if (zs.in[zs.incnt + 2] != (~len & 0xff)
+      || zs.in[zs.incnt + 3] != ((~len >> 8) & 0xff))
+    return -1;
+  zs.incnt += 4;
+
+  if (len > zs.inlen - zs.incnt || len > zs.outlen - zs.outcnt)
+    return -1;
+
+  grub_memmove ((char *) zs.out + zs.outcnt, (char *) zs.in + zs.incnt, len);
+  zs.incnt += len;
+  zs.outcnt += len;
+  return 0;
+}
+
+static int
+zdecode (struct zhuff *h)
+{
+  int code = 0, first = 0, index = 0, len, count;
+
+  for (len = 1; len <= MAXBITS; len++)
+    {
+      code |= zbits (1);
+      count = h->count[len];
+      if (code - count < first)
+	return h->symbol[index + (code - first)];
+      index += count;
+      first += count;
+      first <<= 1;
+      code <<= 1;
+    }
+
+  return -1;
+}
+
+/* Build H out of the N code lengths in LENGTH.  Return zero if the
+   code is complete, more if it is not, and less if it is too much.  */
+static int
+zconstruct (struct zhuff *h, short *length, int n)
+{
+  short offs[MAXBITS + 1];
+  int symbol, len, left;
+
+  for (len = 0; len <= MAXBITS; len++)
+    h->count[len] = 0;
+  for (symbol = 0; symbol < n; symbol++)
+    h->count[length[symbol]]++;
+  if (h->count[0] == n)
+    return 0;
+
+  left = 1;
+  for (len = 1; len <= MAXBITS; len++)
+    {
+      left <<= 1;
+      left -= h->count[len];
+      if (left < 0)
+	return left;
+    }
+
+  offs[1] = 0;
+  for (len = 1; len < MAXBITS; len++)
+    offs[len + 1] = offs[len] + h->count[len];
+  for (symbol = 0; symbol < n; symbol++)
+    if (length[symbol])
+      h->symbol[offs[length[symbol]]++] = symbol;
+
+  return left;
+}
+
+static const short zlbase[29] =
+  { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short zlext[29] =
+  { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short zdbase[30] =
+  { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577 };
+static const short zdext[30] =
+  { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static int
+zcodes (struct zhuff *lencode, struct zhuff *distcode)
+{
+  int symbol, len, dist;
+
+  do
+    {
+      symbol = zdecode (lencode);
+      if (symbol < 0 || zs.err)
+	return -1;
+
+      if (symbol < 256)
+	{
+	  if (zs.outcnt == zs.outlen)
+	    return -1;
+	  zs.out[zs.outcnt++] = symbol;
+	}
+      else if (symbol > 256)
+	{
+	  symbol -= 257;
+	  if (symbol >= 29)
+	    return -1;
+	  len = zlbase[symbol] + zbits (zlext[symbol]);
+
+	  symbol = zdecode (distcode);
+	  if (symbol < 0 || symbol >= 30)
+	    return -1;
+	  dist = zdbase[symbol] + zbits (zdext[symbol]);
+
+	  if (zs.err || dist > zs.outcnt || len > zs.outlen - zs.outcnt)
+	    return -1;
+	  while (len--)
+	    {
+	      zs.out[zs.outcnt] = zs.out[zs.outcnt - dist];
+	      zs.outcnt++;
+	    }
+	}
+    }
+  while (symbol != 256);
+
+  return 0;
+}
+
+static int
+zfixed (void)
+{
+  static struct zhuff lencode, distcode;
+  static int built;
+  short lengths[FIXLCODES];
+  int symbol;
+
+  if (! built)
+    {
+      for (symbol = 0; symbol < 144; symbol++)
+	lengths[symbol] = 8;
+      for (; symbol < 256; symbol++)
+	lengths[symbol] = 9;
+      for (; symbol < 280; symbol++)
+	lengths[symbol] = 7;
+      for (; symbol < FIXLCODES; symbol++)
+	lengths[symbol] = 8;
+      zconstruct (&lencode, lengths, FIXLCODES);
+
+      for (symbol = 0; symbol < MAXDCODES; symbol++)
+	lengths[symbol] = 5;
+      zconstruct (&distcode, lengths, MAXDCODES);
+      built = 1;
+    }
+
+  return zcodes (&lencode, &distcode);
+}
+
+static int
+zdynamic (void)
+{
+  static const short order[19] =
+    { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  static struct zhuff lencode, distcode;
+  short lengths[MAXLCODES + MAXDCODES];
+  int nlen, ndist, ncode, index, symbol, len, err;
+
+  nlen = zbits (5) + 257;
+  ndist = zbits (5) + 1;
+  ncode = zbits (4) + 4;
+  if (nlen > MAXLCODES || ndist > MAXDCODES)
+    return -1;
+
+  for (index = 0; index < ncode; index++)
+    lengths[order[index]] = zbits (3);
+  for (; index < 19; index++)
+    lengths[order[index]] = 0;
+  if (zs.err || zconstruct (&lencode, lengths, 19))
+    return -1;
+
+  index = 0;
+  while (index < nlen + ndist)
+    {
+      symbol = zdecode (&lencode);
+      if (symbol < 0 || zs.err)
+	return -1;
+
+      if (symbol < 16)
+	lengths[index++] = symbol;
+      else
+	{
+	  len = 0;
+	  if (symbol == 16)
+	    {
+	      if (! index)
+		return -1;
+	      len = lengths[index - 1];
+	      symbol = 3 + zbits (2);
+	    }
+	  else if (symbol == 17)
+	    symbol = 3 + zbits (3);
+	  else
+	    symbol = 11 + zbits (7);
+
+	  if (index + symbol > nlen + ndist)
+	    return -1;
+	  while (symbol--)
+	    lengths[index++] = len;
+	}
+    }
+
+  if (! lengths[256])
+    return -1;
+
+  /* only a code of one symbol may be incomplete */
+  err = zconstruct (&lencode, lengths, nlen);
+  if (err && (err < 0 || nlen != lencode.count[0] + lencode.count[1]))
+    return -1;
+  err = zconstruct (&distcode, lengths + nlen, ndist);
+  if (err && (err < 0 || ndist != distcode.count[0] + distcode.count[1]))
+    return -1;
+
+  return zcodes (&lencode, &distcode);
+}
+
+/* Decode the zlib stream at SRC, LEN bytes long, into DEST, which
+   holds SIZE bytes.  Return the bytes it makes, or -1.  */
+static int
+btrfs_inflate (unsigned char *src, int len, unsigned char *dest, int size)
+{
+  int last, type, err;
+
+  /* deflate, and no preset dictionary */
+  if (len < 2 || (src[0] & 0x0f) != 8 || (src[1] & 0x20)
+      || ((src[0] << 8) | src[1]) % 31)
+    return -1;
+
+  zs.in = src + 2;
+  zs.inlen = len - 2;
+  zs.incnt = 0;
+  zs.out = dest;
+  zs.outlen = size;
+  zs.outcnt = 0;
+  zs.bitbuf = 0;
+  zs.bitcnt = 0;
+  zs.err = 0;
+
+  do
+    {
+      last = zbits (1);
+      type = zbits (2);
+      if (type == 0)
+	err = zstored ();
+      else if (type == 1)
+	err = zfixed ();
+      else if (type == 2)
+	err = zdynamic ();
+      else
+	err = -1;
+
+      if (err || zs.err)
+	return -1;
+    }
+  while (! last);
+
+  return zs.outcnt;
+}
+
+
+/* LZO1X, in the segments Btrfs cuts it into.  */
+
+/* Add up the length which follows a zero in the stream at *IPP.  */
+static int
+lzo_len (unsigned char **ipp, unsigned char *ip_end, int base)
+{
+  unsigned char *ip = *ipp;
+
+  while (ip < ip_end && ! *ip)
+    {
+      ip++;
+      base += 255;
+      if (base > BTRFS_MAX_COMPRESSED)
+	return -1;
+    }
+  if (ip == ip_end)
+    return -1;
+
+  base += *ip++;
+  *ipp = ip;
+  return base;
+}
+
+/* Decode the LZO1X block at SRC, LEN bytes long, into DEST, which
+   holds SIZE bytes.  Return the bytes it makes, or -1.  */
+static int
+lzo1x_decode (unsigned char *src, int len, unsigned char *dest, int size)
+{
+  unsigned char *ip = src, *ip_end = src + len;
+  unsigned char *op = dest, *op_end = dest + size;
+  int t, next, state = 0, dist;
+
+#define NEED_IP(n)	if (ip_end - ip < (n)) return -1
+#define NEED_OP(n)	if (op_end - op < (n)) return -1
+
+  NEED_IP (1);
+  if (*ip > 17)
+    {
+      t = *ip++ - 17;
+      if (t < 4)
+	{
+	  next = t;
+	  goto match_next;
+	}
+      goto literal_run;
+    }
+
+  for (;;)
+    {
+      NEED_IP (1);
+      t = *ip++;
+      if (t < 16)
+	{
+	  if (! state)
+	    {
+	      if (! t && (t = lzo_len (&ip, ip_end, 15)) < 0)
+		return -1;
+	      t += 3;
+	    literal_run:
+	      NEED_IP (t);
+	      NEED_OP (t);
+	      grub_memmove ((char *) op, (char *) ip, t);
+	      op += t;
+	      ip += t;
+	      state = 4;
+	      continue;
+	    }
+
+	  NEED_IP (1);
+	  next = t & 3;
+	  if (state != 4)
+	    {
+	      dist = 1 + (t >> 2) + (*ip++ << 2);
+	      t = 2;
+	    }
+	  else
+	    {
+	      dist = 1 + 0x800 + (t >> 2) + (*ip++ << 2);
+	      t = 3;
+	    }
+	}
+      else if (t >= 64)
+	{
+	  NEED_IP (1);
+	  next = t & 3;
+	  dist = 1 + ((t >> 2) & 7) + (*ip++ << 3);
+	  t = (t >> 5) + 1;
+	}
+      else if (t >= 32)
+	{
+	  t = (t & 31) + 2;
+	  if (t == 2 && (t = lzo_len (&ip, ip_end, 33)) < 0)
+	    return -1;
+	  NEED_IP (2);
+	  next = ip[0] | (ip[1] << 8);
+	  ip += 2;
+	  dist = 1 + (next >> 2);
+	  next &= 3;
+	}
+      else
+	{
+	  dist = (t & 8) << 11;
+	  t = (t & 7) + 2;
+	  if (t == 2 && (t = lzo_len (&ip, ip_end, 9)) < 0)
+	    return -1;
+	  NEED_IP (2);
+	  next = ip[0] | (ip[1] << 8);
+	  ip += 2;
+	  dist += next >> 2;
+	  next &= 3;
+
+	  /* the end of the stream */
+	  if (! dist)
+	    return t == 3 ? op - dest : -1;
+	  dist += 0x4000;
+	}
+
+      if (dist > op - dest)
+	return -1;
+      NEED_OP (t);
+      while (t--)
+	{
+	  *op = op[-dist];
+	  op++;
+	}
+
+    match_next:
+      state = next;
+      NEED_IP (next);
+      NEED_OP (next);
+      while (next--)
+	*op++ = *ip++;
+    }
+
+#undef NEED_IP
+#undef NEED_OP
+}
+
+static btrfs_u32
+lzo_le32 (unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((btrfs_u32) p[3] << 24);
+}
+
+/* The whole is the length of it all, and then segments, each of its
+   length and a block which makes a sector at most.  The length of a
+   segment is never split between two sectors.  */
+static int
+btrfs_unlzo (unsigned char *src, int len, unsigned char *dest, int size)
+{
+  int sectorsize = 1 << btrfs.block_bits;
+  int total, pos = 4, out = 0, seg, n;
+
+  if (len < 4)
+    return -1;
+  total = lzo_le32 (src);
+  if (total < 4 || total > len)
+    return -1;
+
+  while (out < size)
+    {
+      if (sectorsize - pos % sectorsize < 4)
+	pos += sectorsize - pos % sectorsize;
+      if (pos + 4 > total)
+	break;
+
+      seg = lzo_le32 (src + pos);
+      pos += 4;
+      if (seg < 0 || seg > total - pos)
+	return -1;
+
+      n = lzo1x_decode (src + pos, seg, dest + out, size - out);
+      if (n < 0)
+	return -1;
+      out += n;
+      pos += seg;
+    }
+
+  return out;
+}
+
+
+/* The extent decoded last, and the room to read one into.  */
+static char *zbuf;
+static char *zin;
+static btrfs_u64 zbuf_disk;
+static int zbuf_valid;
+
+/* Decode the compressed extent found last, the data of which is at
+   SRC if it is inline, into ZBUF.  */
+static int
+extent_decode (char *src)
+{
+  int len, size, n;
+
+  if (! src && zbuf_valid && zbuf_disk == btrfs.ext_disk)
+    return 1;
+  zbuf_valid = 0;
+
+  if (btrfs.ext_disk_len > BTRFS_MAX_COMPRESSED
+      || btrfs.ext_ram > BTRFS_MAX_COMPRESSED)
+    {
+      errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+  len = btrfs.ext_disk_len;
+  size = btrfs.ext_ram;
+
+  if (! zbuf)
+    zbuf = grub_malloc (BTRFS_MAX_COMPRESSED);
+  if (! zin)
+    zin = grub_malloc (BTRFS_MAX_COMPRESSED);
+  if (! zbuf || ! zin)
+    {
+      errnum = ERR_WONT_FIT;
+      return 0;
+    }
+
+  if (! src)
+    {
+      if (! logical_read (btrfs.ext_disk, len, zin))
+	return 0;
+      src = zin;
+    }
+
+  switch (btrfs.ext_compression)
+    {
+    case BTRFS_COMPRESS_ZLIB:
+      n = btrfs_inflate ((unsigned char *) src, len,
+			 (unsigned char *) zbuf, size);
+      break;
+    case BTRFS_COMPRESS_LZO:
+      n = btrfs_unlzo ((unsigned char *) src, len,
+		       (unsigned char *) zbuf, size);
+      break;
+#ifndef NO_DECOMPRESSION
+    case BTRFS_COMPRESS_ZSTD:
+      n = unzstd_buffer (src, len, zbuf, size);
+      break;
+#endif
+    default:
+      n = -1;
+      break;
+    }
+
+  if (n < 0)
+    {
+      errnum = ERR_BAD_GZIP_DATA;
+      return 0;
+    }
+
+  /* what is not there reads as zeros */
+  grub_memset (zbuf + n, 0, size - n);
+
+  if (src == zin)
+    {
+      zbuf_disk = btrfs.ext_disk;
+      zbuf_valid = 1;
+    }
+
+  return 1;
+}
+#endif /* BTRFS_POOL */
+
+
+/*
+ *  Files.
+ */
+
+/* Find the extent of the file which covers POS, and leave the leaf it
+   is in in the node buffer.  Where there is no extent, the hole goes on
+   to the next one, or to the end of the file.  */
+static int
+extent_find (btrfs_u64 pos)
+{
+  struct btrfs_file_extent_item *fe;
+  struct btrfs_item *item;
+  struct btrfs_key key;
+  btrfs_u64 end;
+
+  if (btrfs.ext_valid && btrfs.ext_start <= pos && pos < btrfs.ext_end
+      && btrfs.ext_kind != EXTENT_INLINE)
+    return 1;
+  btrfs.ext_valid = 0;
+
+  key_set (&key, btrfs.ino, BTRFS_EXTENT_DATA_KEY, pos);
+  if (tree_search (&btrfs.fs, &key))
+    {
+      if (! (item = path_item ((char **) &fe)))
+	return 0;
+
+      if (item->key.objectid == btrfs.ino
+	  && item->key.type == BTRFS_EXTENT_DATA_KEY)
+	{
+	  if (item->size < BTRFS_FILE_EXTENT_INLINE_DATA
+	      || (fe->type != BTRFS_FILE_EXTENT_INLINE
+		  && item->size < sizeof (*fe)))
+	    {
+	      errnum = ERR_FSYS_CORRUPT;
+	      return 0;
+	    }
+
+	  btrfs.ext_start = item->key.offset;
+	  btrfs.ext_compression = fe->compression;
+	  btrfs.ext_offset = 0;
+	  btrfs.ext_ram = fe->ram_bytes;
+
+	  if (fe->type == BTRFS_FILE_EXTENT_INLINE)
+	    {
+	      end = btrfs.ext_start + fe->ram_bytes;
+	      btrfs.ext_kind = EXTENT_INLINE;
+	      btrfs.ext_disk_len = item->size - BTRFS_FILE_EXTENT_INLINE_DATA;
+	    }
+	  else
+	    {
+	      end = btrfs.ext_start + fe->num_bytes;
+	      if (! fe->disk_bytenr || fe->type == BTRFS_FILE_EXTENT_PREALLOC)
+		btrfs.ext_kind = EXTENT_HOLE;
+	      else if (fe->compression)
+		{
+		  btrfs.ext_kind = EXTENT_COMPRESSED;
+		  btrfs.ext_disk = fe->disk_bytenr;
+		  btrfs.ext_disk_len = fe->disk_num_bytes;
+		  btrfs.ext_offset = fe->offset;
+		}
+	      else
+		{
+		  btrfs.ext_kind = EXTENT_REGULAR;
+		  btrfs.ext_disk = fe->disk_bytenr + fe->offset;
+		}
+	    }
+
+	  if (pos < end)
+	    {
+	      btrfs.ext_end = end;
+	      btrfs.ext_valid = 1;
+	      return 1;
+	    }
+	}
+    }
+  else if (errnum)
+    return 0;
+
+  /* a hole, up to the next extent */
+  btrfs.ext_kind = EXTENT_HOLE;
+  btrfs.ext_start = pos;
+  btrfs.ext_end = (filemax > pos ? filemax : pos + 1);
+  if (tree_next (&btrfs.fs))
+    {
+      if (! (item = path_item ((char **) &fe)))
+	return 0;
+      if (item->key.objectid == btrfs.ino
+	  && item->key.type == BTRFS_EXTENT_DATA_KEY
+	  && item->key.offset > pos && item->key.offset < btrfs.ext_end)
+	btrfs.ext_end = item->key.offset;
+    }
+  else if (errnum)
+    return 0;
+
+  btrfs.ext_valid = 1;
+  return 1;
+}
+
+/* Map the run from BLOCK on for fsys_read_extents, as far as it goes
+   in the same extent.  Inline and compressed extents are not read that
+   way.  */
+static int
+btrfs_extent_map (int block, int *run)
+{
+  btrfs_u64 pos = (btrfs_u64) block << btrfs.block_bits;
+  btrfs_u64 physical, len, sector;
+  int n;
+
+  if (! extent_find (pos)
+      || (btrfs.ext_kind != EXTENT_HOLE && btrfs.ext_kind != EXTENT_REGULAR))
+    return -1;
+
+  len = btrfs.ext_end - pos;
+  if (btrfs.ext_kind == EXTENT_REGULAR)
+    {
+      if (! chunk_map (btrfs.ext_disk + (pos - btrfs.ext_start),
+		       &physical, &len))
+	return -1;
+      if (len > btrfs.ext_end - pos)
+	len = btrfs.ext_end - pos;
+    }
+
+  n = (len + (1 << btrfs.block_bits) - 1) >> btrfs.block_bits;
+  if (n < *run)
+    *run = n;
+
+  if (btrfs.ext_kind == EXTENT_HOLE)
+    return 0;
+
+  sector = physical >> btrfs.sector_bits;
+  if (sector > MAXINT)
+    {
+      errnum = ERR_OUTSIDE_PART;
+      return -1;
+    }
+
+  return sector;
+}
+
+/* Copy what the inline or compressed extent found last holds, from
+   FILEPOS on, into BUF.  */
+static int
+extent_copy (char *buf, int len)
+{
+  btrfs_u64 from = filepos - btrfs.ext_start;
+  char *data = 0;
+  int avail;
+
+  if (btrfs.ext_end - filepos < len)
+    len = btrfs.ext_end - filepos;
+
+  if (btrfs.ext_kind == EXTENT_INLINE)
+    {
+      if (! path_item (&data))
+	return 0;
+      data += BTRFS_FILE_EXTENT_INLINE_DATA;
+
+      if (! btrfs.ext_compression)
+	{
+	  avail = from < btrfs.ext_disk_len ? btrfs.ext_disk_len - from : 0;
+	  if (avail > len)
+	    avail = len;
+	  grub_memmove (buf, data + from, avail);
+	  grub_memset (buf + avail, 0, len - avail);
+	  filepos += len;
+	  return len;
+	}
+    }
+
+#ifdef BTRFS_POOL
+  if (! extent_decode (data))
+    return 0;
+
+  from += btrfs.ext_offset;
+  avail = from < btrfs.ext_ram ? btrfs.ext_ram - from : 0;
+  if (avail > len)
+    avail = len;
+  grub_memmove (buf, zbuf + from, avail);
+  grub_memset (buf + avail, 0, len - avail);
+  filepos += len;
+  return len;
+#else
+  errnum = ERR_BAD_GZIP_DATA;
+  return 0;
+#endif
+}
+
+int
+btrfs_read (char *buf, int len)
+{
+  int ret = 0, n;
+
+  while (len > 0 && ! errnum)
+    {
+      if (! extent_find (filepos))
+	break;
+
+      if (btrfs.ext_kind == EXTENT_HOLE || btrfs.ext_kind == EXTENT_REGULAR)
+	n = fsys_read_extents (buf, len, btrfs.block_bits, btrfs_extent_map);
+      else
+	n = extent_copy (buf, len);
+
+      if (! n)
+	break;
+
+      buf += n;
+      len -= n;
+      ret += n;
+    }
+
+  return errnum ? 0 : ret;
+}
+
+
+/*
+ *  Directories.
+ */
+
+/* Read the mode and size of the inode INO of the current subvolume.  */
+static int
+inode_read (btrfs_u64 ino, int *mode, btrfs_u64 *size)
+{
+  struct btrfs_inode_item *inode;
+  struct btrfs_item *item;
+  struct btrfs_key key;
+
+  key_set (&key, ino, BTRFS_INODE_ITEM_KEY, 0);
+  item = item_find (&btrfs.fs, &key, (char **) &inode);
+  if (! item || item->size < sizeof (*inode))
+    {
+      if (! errnum)
+	errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+
+  *mode = inode->mode;
+  *size = inode->size;
+  return 1;
+}
+
+/* Look up NAME, which is LEN bytes long, in the directory DIR, and set
+   *LOCATION to what it names.  */
+static int
+dir_lookup (btrfs_u64 dir, char *name, int len, struct btrfs_key *location)
+{
+  struct btrfs_dir_item *di;
+  struct btrfs_item *item;
+  struct btrfs_key key;
+  char *data;
+  int pos, n;
+
+  /* names with the same hash share an item */
+  key_set (&key, dir, BTRFS_DIR_ITEM_KEY, name_hash (name, len));
+  item = item_find (&btrfs.fs, &key, &data);
+  if (! item)
+    return 0;
+
+  for (pos = 0; pos + (int) sizeof (*di) <= item->size; pos += n)
+    {
+      di = (struct btrfs_dir_item *) (data + pos);
+      n = sizeof (*di) + di->name_len + di->data_len;
+      if (n > item->size - pos)
+	break;
+
+      if (di->name_len == len && ! grub_memcmp ((char *) (di + 1), name, len))
+	{
+	  *location = di->location;
+	  return 1;
+	}
+    }
+
+  return 0;
+}
+
+#ifndef STAGE1_5
+/* Print the names in the directory DIR which start with NAME, in the
+   order they were made in.  */
+static void
+dir_complete (btrfs_u64 dir, char *name)
+{
+  char entry[256];
+  struct btrfs_dir_item *di;
+  struct btrfs_item *item;
+  struct btrfs_key key;
+  char *data;
+
+  /* the first index is 2, so the item found is before the directory */
+  key_set (&key, dir, BTRFS_DIR_INDEX_KEY, 0);
+  if (tree_search (&btrfs.fs, &key) && errnum)
+    return;
+
+  while (tree_next (&btrfs.fs))
+    {
+      if (! (item = path_item (&data)))
+	return;
+      if (item->key.objectid != dir || item->key.type != BTRFS_DIR_INDEX_KEY)
+	break;
+
+      di = (struct btrfs_dir_item *) data;
+      if (item->size < sizeof (*di)
+	  || item->size < sizeof (*di) + di->name_len
+	  || di->name_len >= sizeof (entry))
+	continue;
+
+      grub_memmove (entry, (char *) (di + 1), di->name_len);
+      entry[di->name_len] = 0;
+      if (substring (name, entry) <= 0)
+	{
+	  if (print_possibilities > 0)
+	    print_possibilities = -print_possibilities;
+	  print_a_completion (entry);
+	}
+    }
+}
+#endif /* ! STAGE1_5 */
+
+int
+btrfs_dir (char *dirname)
+{
+  btrfs_u64 ino, parent_ino, size;
+  struct btrfs_root parent;
+  struct btrfs_key location;
+  int mode, n, link_count = 0;
+  char linkbuf[PATH_MAX];	/* buffer for following symbolic links */
+  char *rest, ch;
+#ifndef STAGE1_5
+  unsigned long dcache[DENTRY_DATA_LEN];
+  int use_dcache;
+#endif
+
+  btrfs.fs = btrfs.top;
+  btrfs.ext_valid = 0;
+  parent = btrfs.fs;
+  parent_ino = ino = BTRFS_FIRST_FREE_OBJECTID;
+
+  for (;;)
+    {
+      if (! inode_read (ino, &mode, &size))
+	return 0;
+
+      if (S_ISLNK (mode))
+	{
+	  if (++link_count > MAX_LINK_COUNT)
+	    {
+	      errnum = ERR_SYMLINK_LOOP;
+	      return 0;
+	    }
+	  if (size >= sizeof (linkbuf) - 1)
+	    {
+	      errnum = ERR_FILELENGTH;
+	      return 0;
+	    }
+
+	  btrfs.ino = ino;
+	  btrfs.ext_valid = 0;
+	  filepos = 0;
+	  filemax = size;
+	  n = btrfs_read (linkbuf, filemax);
+	  if (n != filemax)
+	    {
+	      if (! errnum)
+		errnum = ERR_FSYS_CORRUPT;
+	      return 0;
+	    }
+
+	  if (linkbuf[0] == '/')
+	    {
+	      btrfs.fs = btrfs.top;
+	      ino = BTRFS_FIRST_FREE_OBJECTID;
+	    }
+	  else
+	    {
+	      btrfs.fs = parent;
+	      ino = parent_ino;
+	    }
+	  while (n < sizeof (linkbuf) - 1 && (linkbuf[n++] = *dirname++))
+	    ;
+	  linkbuf[n] = 0;
+	  dirname = linkbuf;
+	  continue;
+	}
+
+      if (! *dirname || isspace (*dirname))
+	{
+	  if (! S_ISREG (mode))
+	    {
+	      errnum = ERR_BAD_FILETYPE;
+	      return 0;
+	    }
+	  if (size > MAXINT)
+	    {
+	      errnum = ERR_FILELENGTH;
+	      return 0;
+	    }
+
+	  btrfs.ino = ino;
+	  btrfs.ext_valid = 0;
+	  filepos = 0;
+	  filemax = size;
+	  return 1;
+	}
+
+      if (! S_ISDIR (mode))
+	{
+	  errnum = ERR_BAD_FILETYPE;
+	  return 0;
+	}
+
+      while (*dirname == '/')
+	dirname++;
+
+      for (rest = dirname; (ch = *rest) && ! isspace (ch) && ch != '/'; rest++)
+	;
+      *rest = 0;
+
+#ifndef STAGE1_5
+      if (print_possibilities && ch != '/')
+	{
+	  dir_complete (ino, dirname);
+	  *rest = ch;
+	  if (print_possibilities < 0)
+	    return 1;
+	  if (! errnum)
+	    errnum = ERR_FILE_NOT_FOUND;
+	  return 0;
+	}
+
+      /* inode numbers are only unique within a subvolume, so only
+	 those of the default one are cached */
+      use_dcache = (btrfs.fs.id == btrfs.top.id
+		    && (unsigned long) ino == ino);
+      if (use_dcache)
+	switch (dentry_cache_lookup (ino, dirname, dcache))
+	  {
+	  case 1:
+	    location.objectid = dcache[0] | ((btrfs_u64) dcache[1] << 16 << 16);
+	    location.type = dcache[2];
+	    goto found;
+	  case -1:
+	    errnum = ERR_FILE_NOT_FOUND;
+	    *rest = ch;
+	    return 0;
+	  }
+#endif
+
+      if (! dir_lookup (ino, dirname, rest - dirname, &location))
+	{
+	  if (! errnum)
+	    {
+	      errnum = ERR_FILE_NOT_FOUND;
+#ifndef STAGE1_5
+	      if (use_dcache)
+		dentry_cache_add (ino, dirname, 0);
+#endif
+	    }
+	  *rest = ch;
+	  return 0;
+	}
+
+#ifndef STAGE1_5
+      if (use_dcache)
+	{
+	  dcache[0] = location.objectid;
+	  dcache[1] = location.objectid >> 16 >> 16;
+	  dcache[2] = location.type;
+	  dentry_cache_add (ino, dirname, dcache);
+	}
+
+    found:
+#endif
+      parent = btrfs.fs;
+      parent_ino = ino;
+
+      if (location.type == BTRFS_ROOT_ITEM_KEY)
+	{
+	  /* a subvolume, which starts at its own root directory */
+	  if (! root_find (location.objectid, &btrfs.fs))
+	    {
+	      *rest = ch;
+	      return 0;
+	    }
+	  ino = BTRFS_FIRST_FREE_OBJECTID;
+	}
+      else if (location.type == BTRFS_INODE_ITEM_KEY)
+	ino = location.objectid;
+      else
+	{
+	  errnum = ERR_FSYS_CORRUPT;
+	  *rest = ch;
+	  return 0;
+	}
+
+      *(dirname = rest) = ch;
+    }
+}
+
+#endif /* FSYS_BTRFS */
@@ -22,8 +22,6 @@
 #include "shared.h"
 #include "filesys.h"
 
-static int mapblock1, mapblock2;
-
 /* sizes are always in bytes, BLOCK values are always in DEV_BSIZE (sectors) */
 #define DEV_BSIZE get_sector_size(current_drive)
 
@@ -249,6 +247,11 @@ struct ext2_inode
 #define EXT4_HAS_INCOMPAT_FEATURE(sb,mask)			\
 	( sb->s_feature_incompat & mask )
 
+#define EXT3_FEATURE_COMPAT_DIR_INDEX	0x0020
+
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	/* Unsigned dirhash in use */
+
+#define EXT2_INDEX_FL		0x00001000 /* hash-indexed directory */
 #define EXT4_EXTENTS_FL		0x00080000 /* Inode uses extents */
 #define EXT4_HUGE_FILE_FL	0x00040000 /* Set to each huge file */
 
@@ -308,7 +311,48 @@ struct ext4_extent_header
     __u32  eh_generation;  /* generation of the tree */
   };
 
+/* fs/ext3/namei.c */
+/* The hash index of a directory.  Its root follows the "." and ".."
+ * entries in the first block, other index nodes fill a block behind an
+ * empty entry.  The first entry of each node stores the count and the
+ * limit in place of its hash.
+ */
+struct dx_root_info
+  {
+    __u32 reserved_zero;
+    __u8  hash_version;
+    __u8  info_length; /* 8 */
+    __u8  indirect_levels;
+    __u8  unused_flags;
+  };
+
+struct dx_entry
+  {
+    __u32 hash;
+    __u32 block;
+  };
+
+struct dx_countlimit
+  {
+    __u16 limit;
+    __u16 count;
+  };
+
+#define DX_ROOT_INFO_OFFSET	24	/* after "." and ".." */
+#define DX_NODE_OFFSET		8	/* after the empty entry */
+#define DX_MAX_LEVELS		3
+
+/* include/linux/ext3_fs.h */
+#define DX_HASH_LEGACY		0
+#define DX_HASH_HALF_MD4	1
+#define DX_HASH_TEA		2
+#define DX_HASH_LEGACY_UNSIGNED	3
+#define DX_HASH_HALF_MD4_UNSIGNED	4
+#define DX_HASH_TEA_UNSIGNED		5
+
 #define EXT4_EXT_MAGIC      (0xf30a)
+#define EXT_INIT_MAX_LEN    (1UL << 15)
+#define EXT4_MAX_EXTENT_DEPTH 5
 #define EXT_FIRST_EXTENT(__hdr__) \
     ((struct ext4_extent *) (((char *) (__hdr__)) +     \
                  sizeof(struct ext4_extent_header)))
@@ -355,6 +399,12 @@ struct ext4_extent_header
     ((unsigned long)INODE + sizeof(struct ext2_inode))
 #define DATABLOCK2 \
     ((unsigned long)DATABLOCK1 + EXT2_BLOCK_SIZE(SUPERBLOCK))
+/* the indirect block cache, slot 0 being DATABLOCK1 and the others
+   filling the rest of FSYS_BUF */
+#define INDBLOCK(n) \
+    ((n) ? (unsigned long)DATABLOCK2 + (n) * EXT2_BLOCK_SIZE(SUPERBLOCK) \
+     : (unsigned long)DATABLOCK1)
+#define INDBLOCK_MAX 8
 
 /* linux/ext2_fs.h */
 #define EXT2_ADDR_PER_BLOCK(s)          (EXT2_BLOCK_SIZE(s) / sizeof (__u32))
@@ -402,6 +452,93 @@ ffz (unsigned int word)
   return word;
 }
 
+/* The fs block held by each slot of the indirect block cache, or -1,
+   and when it was last used.  Slot 0 is shared with the extent code and
+   so is forgotten whenever an inode is loaded, the others stay valid
+   until the next mount.  */
+static int indblock_num[INDBLOCK_MAX];
+static int indblock_stamp[INDBLOCK_MAX];
+static int indblock_clock, indblock_slots;
+
+/* How far to shift a file system block number to make a sector number
+   of it.  This is worked out once at mount time, as a block may take
+   up any number of sectors, including the one of a 4K sector disk.  */
+static int block_sector_shift;
+
+#ifndef STAGE1_5
+/* The first block of the inode table of each group, or zero where the
+   descriptor has not been read yet.  A descriptor block is read the
+   first time one of its groups is needed, and all of the groups in it
+   are filled in then, so that later lookups need no read at all.  The
+   table belongs to the file system whose uuid ITABLE_UUID is, and is
+   kept across mounts until a disk cache invalidation.  On EFI a table
+   of any size comes from the pool; otherwise ITABLE_MAX groups are
+   cached and the rest are looked up as before.  */
+#define ITABLE_MAX 1024
+static __u32 itable_buf[ITABLE_MAX];
+static __u32 *itable;
+static int itable_groups;
+static unsigned long itable_drive = GRUB_INVALID_DRIVE;
+static unsigned long itable_partition;
+static unsigned long itable_generation;
+static __u8 itable_uuid[16];
+
+/* Keep the inode table cache if it belongs to the file system in
+   SUPERBLOCK, and empty it otherwise.  */
+static void
+itable_check (void)
+{
+  int groups = SUPERBLOCK->s_inodes_count / SUPERBLOCK->s_inodes_per_group;
+
+  if (itable && itable_drive == current_drive
+      && itable_partition == current_partition
+      && itable_generation == disk_cache_generation
+      && itable_groups == groups
+      && ! memcmp ((char *) itable_uuid, (char *) SUPERBLOCK->s_uuid, 16))
+    return;
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  if (itable && itable != itable_buf)
+    grub_free (itable);
+  itable = groups > ITABLE_MAX ? grub_malloc (groups * sizeof (__u32)) : 0;
+  if (! itable)
+#endif
+    itable = itable_buf;
+
+  itable_groups = groups;
+  if (itable == itable_buf && itable_groups > ITABLE_MAX)
+    itable_groups = ITABLE_MAX;
+  memset ((char *) itable, 0, itable_groups * sizeof (__u32));
+
+  itable_drive = current_drive;
+  itable_partition = current_partition;
+  itable_generation = disk_cache_generation;
+  memmove ((char *) itable_uuid, (char *) SUPERBLOCK->s_uuid, 16);
+}
+#endif /* ! STAGE1_5 */
+
+/* Set up what is worked out from the superblock in SUPERBLOCK.  */
+static void
+ext2fs_mounted (void)
+{
+  int i;
+
+  block_sector_shift = (EXT2_BLOCK_SIZE_BITS (SUPERBLOCK)
+			- get_sector_bits (current_drive));
+
+  /* as many slots as fit in FSYS_BUF */
+  indblock_slots = (((unsigned long) FSYS_BUF + FSYS_BUFLEN - DATABLOCK2)
+		    >> EXT2_BLOCK_SIZE_BITS (SUPERBLOCK));
+  if (indblock_slots > INDBLOCK_MAX)
+    indblock_slots = INDBLOCK_MAX;
+  for (i = 0; i < INDBLOCK_MAX; i++)
+    indblock_num[i] = -1;
+#ifndef STAGE1_5
+  if (SUPERBLOCK->s_inodes_per_group)
+    itable_check ();
+#endif
+}
+
 /* check filesystem types and read superblock into memory buffer */
 int
 ext2fs_mount (void)
@@ -416,12 +553,31 @@ ext2fs_mount (void)
       || part_length < (SBLOCK + (sizeof (struct ext2_super_block) / DEV_BSIZE))
       || !devread (SBLOCK, SBOFF, sizeof (struct ext2_super_block),
 		   (char *) SUPERBLOCK)
-      || SUPERBLOCK->s_magic != EXT2_SUPER_MAGIC)
+      || SUPERBLOCK->s_magic != EXT2_SUPER_MAGIC
+      /* A block must be made of whole sectors.  */
+      || (EXT2_BLOCK_SIZE_BITS (SUPERBLOCK)
+	  < get_sector_bits (current_drive)))
       retval = 0;
+  else
+    ext2fs_mounted ();
 
   return retval;
 }
 
+#ifndef STAGE1_5
+/* The superblock of the current partition, which it was mounted with
+   before, has been put back in SUPERBLOCK; go on from there.  */
+int
+ext2fs_remount (void)
+{
+  if (SUPERBLOCK->s_magic != EXT2_SUPER_MAGIC)
+    return 0;
+
+  ext2fs_mounted ();
+  return 1;
+}
+#endif
+
 /* Takes a file system block number and reads it into BUFFER. */
 static int
 ext2_rdfsb (int fsblock, int buffer)
@@ -429,10 +585,38 @@ ext2_rdfsb (int fsblock, int buffer)
 #ifdef E2DEBUG
   printf ("fsblock %d buffer %d\n", fsblock, buffer);
 #endif /* E2DEBUG */
-  return devread (fsblock * (EXT2_BLOCK_SIZE (SUPERBLOCK) / DEV_BSIZE), 0,
+  return devread (fsblock << block_sector_shift, 0,
 		  EXT2_BLOCK_SIZE (SUPERBLOCK), (char *) (unsigned long) buffer);
 }
 
+/* Returns the indirect block FSBLOCK, from the cache if it is there.  */
+static __u32 *
+ext2_indirect_block (int fsblock)
+{
+  int i, slot = 0;
+
+  for (i = 0; i < indblock_slots; i++)
+    {
+      if (indblock_num[i] == fsblock)
+	{
+	  indblock_stamp[i] = ++indblock_clock;
+	  return (__u32 *) INDBLOCK (i);
+	}
+      if (indblock_num[i] == -1 || indblock_stamp[i] < indblock_stamp[slot])
+	slot = i;
+    }
+
+  indblock_num[slot] = -1;
+  if (!ext2_rdfsb (fsblock, INDBLOCK (slot)))
+    {
+      errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+  indblock_num[slot] = fsblock;
+  indblock_stamp[slot] = ++indblock_clock;
+  return (__u32 *) INDBLOCK (slot);
+}
+
 /* from
   ext2/inode.c:ext2_bmap()
 */
@@ -441,6 +625,10 @@ ext2_rdfsb (int fsblock, int buffer)
 static int
 ext2fs_block_map (int logical_block)
 {
+  __u32 *ind;
+  int map;
+  int bits;
+  int level;
 
 #ifdef E2DEBUG
   unsigned char *i;
@@ -473,71 +661,40 @@ ext2fs_block_map (int logical_block)
     }
   /* else */
   logical_block -= EXT2_NDIR_BLOCKS;
+  bits = EXT2_ADDR_PER_BLOCK_BITS (SUPERBLOCK);
   /* try the indirect block */
-  if (logical_block < EXT2_ADDR_PER_BLOCK (SUPERBLOCK))
+  if (logical_block < (1 << bits))
     {
-      if (mapblock1 != 1
-	  && !ext2_rdfsb (INODE->i_block[EXT2_IND_BLOCK], DATABLOCK1))
-	{
-	  errnum = ERR_FSYS_CORRUPT;
-	  return -1;
-	}
-      mapblock1 = 1;
-      return ((__u32 *) DATABLOCK1)[logical_block];
+      level = 1;
+      map = INODE->i_block[EXT2_IND_BLOCK];
     }
-  /* else */
-  logical_block -= EXT2_ADDR_PER_BLOCK (SUPERBLOCK);
-  /* now try the double indirect block */
-  if (logical_block < (1 << (EXT2_ADDR_PER_BLOCK_BITS (SUPERBLOCK) * 2)))
+  else
     {
-      int bnum;
-      if (mapblock1 != 2
-	  && !ext2_rdfsb (INODE->i_block[EXT2_DIND_BLOCK], DATABLOCK1))
+      logical_block -= (1 << bits);
+      /* now try the double indirect block */
+      if (logical_block < (1 << (bits * 2)))
 	{
-	  errnum = ERR_FSYS_CORRUPT;
-	  return -1;
+	  level = 2;
+	  map = INODE->i_block[EXT2_DIND_BLOCK];
 	}
-      mapblock1 = 2;
-      if ((bnum = (((__u32 *) DATABLOCK1)
-		   [logical_block >> EXT2_ADDR_PER_BLOCK_BITS (SUPERBLOCK)]))
-	  != mapblock2
-	  && !ext2_rdfsb (bnum, DATABLOCK2))
+      else
 	{
-	  errnum = ERR_FSYS_CORRUPT;
-	  return -1;
+	  logical_block -= (1 << (bits * 2));
+	  level = 3;
+	  map = INODE->i_block[EXT2_TIND_BLOCK];
 	}
-      mapblock2 = bnum;
-      return ((__u32 *) DATABLOCK2)
-	[logical_block & (EXT2_ADDR_PER_BLOCK (SUPERBLOCK) - 1)];
-    }
-  /* else */
-  mapblock2 = -1;
-  logical_block -= (1 << (EXT2_ADDR_PER_BLOCK_BITS (SUPERBLOCK) * 2));
-  if (mapblock1 != 3
-      && !ext2_rdfsb (INODE->i_block[EXT2_TIND_BLOCK], DATABLOCK1))
-    {
-      errnum = ERR_FSYS_CORRUPT;
-      return -1;
-    }
-  mapblock1 = 3;
-  if (!ext2_rdfsb (((__u32 *) DATABLOCK1)
-		   [logical_block >> (EXT2_ADDR_PER_BLOCK_BITS (SUPERBLOCK)
-				      * 2)],
-		   DATABLOCK2))
-    {
-      errnum = ERR_FSYS_CORRUPT;
-      return -1;
     }
-  if (!ext2_rdfsb (((__u32 *) DATABLOCK2)
-		   [(logical_block >> EXT2_ADDR_PER_BLOCK_BITS (SUPERBLOCK))
-		    & (EXT2_ADDR_PER_BLOCK (SUPERBLOCK) - 1)],
-		   DATABLOCK2))
+
+  while (level--)
     {
-      errnum = ERR_FSYS_CORRUPT;
-      return -1;
+      /* a hole */
+      if (! map)
+	return 0;
+      if (! (ind = ext2_indirect_block (map)))
+	return -1;
+      map = ind[(logical_block >> (bits * level)) & ((1 << bits) - 1)];
     }
-  return ((__u32 *) DATABLOCK2)
-    [logical_block & (EXT2_ADDR_PER_BLOCK (SUPERBLOCK) - 1)];
+  return map;
 }
 
 /* extent binary search index
@@ -582,17 +739,40 @@ ext4_ext_binsearch(struct ext4_extent_header* eh, int logical_block)
   return (struct ext4_extent*)(l - 1);
 }
 
-/* Maps extents enabled logical block into physical block via an inode.
+/* The extent last found by ext4fs_block_map, so that sequential reads
+ * don't search the tree again, or the run of blocks that reads as zeros,
+ * a hole or an uninitialized extent, with an EXT4_EXT_START of 0; and the
+ * index entries followed to reach it: for each level of the tree, the range of logical blocks
+ * [first, end) it covers and the tree block it points to.  EXT4_NODE is
+ * the tree block in DATABLOCK1.  All of them are reset by ext2fs_dir
+ * whenever it loads an inode.
+ */
+static __u32 ext4_ext_block, ext4_ext_len, ext4_ext_start;
+static struct
+  {
+    __u32 first;
+    __u32 end;
+    __u32 node;
+  }
+ext4_path[EXT4_MAX_EXTENT_DEPTH];
+static int ext4_path_len;
+static int ext4_node;
+
+/* Maps extents enabled logical block into physical block via an inode,
+ * or to 0 if it is in a hole or an uninitialized extent, which read as
+ * zeros.  If RUN is not NULL, the number of blocks from LOGICAL_BLOCK to
+ * the end of the extent, which are contiguous on disk, or to the end of
+ * the hole, is stored in it.
  * EXT4_HUGE_FILE_FL should be checked before calling this.
  */
 static int
-ext4fs_block_map (int logical_block)
+ext4fs_block_map (int logical_block, int *run)
 {
   struct ext4_extent_header *eh;
-  struct ext4_extent *ex, *extent;
-  struct ext4_extent_idx *ei, *index;
-  int depth;
-  int i;
+  struct ext4_extent *ex;
+  struct ext4_extent_idx *ei;
+  __u32 end = ~0;
+  int level;
 
 #ifdef E2DEBUG
   unsigned char *i;
@@ -613,59 +793,179 @@ ext4fs_block_map (int logical_block)
     }
   printf ("logical block %d\n", logical_block);
 #endif /* E2DEBUG */
-  eh = (struct ext4_extent_header*)INODE->i_block;
-  if (eh->eh_magic != EXT4_EXT_MAGIC)
-  {
-          errnum = ERR_FSYS_CORRUPT;
-          return -1;
-  }
-  while((depth = eh->eh_depth) != 0)
-  	{ /* extent index */
-	  if (eh->eh_magic != EXT4_EXT_MAGIC)
-	  {
-	          errnum = ERR_FSYS_CORRUPT;
-		  return -1;
-	  }
-	  ei = ext4_ext_binsearch_idx(eh, logical_block);
-	  if (ei->ei_leaf_hi)
+
+  /* still in the extent found last? */
+  if ((__u32) logical_block - ext4_ext_block < ext4_ext_len)
+    goto found;
+
+  /* skip the levels whose cached index entry covers LOGICAL_BLOCK */
+  for (level = 0; level < ext4_path_len; level++)
+    if ((__u32) logical_block < ext4_path[level].first
+	|| (__u32) logical_block >= ext4_path[level].end)
+      break;
+  ext4_path_len = level;
+
+  if (level == 0)
+    eh = (struct ext4_extent_header*)INODE->i_block;
+  else
+    {
+      end = ext4_path[level - 1].end;
+      if (ext4_node != ext4_path[level - 1].node)
+	{
+	  ext4_node = -1;
+	  if (!ext2_rdfsb(ext4_path[level - 1].node, DATABLOCK1))
+	    {
+	      errnum = ERR_FSYS_CORRUPT;
+	      return -1;
+	    }
+	  ext4_node = ext4_path[level - 1].node;
+	}
+      eh = (struct ext4_extent_header*)DATABLOCK1;
+    }
+
+  while (1)
+    {
+      if (eh->eh_magic != EXT4_EXT_MAGIC)
+	{
+	  errnum = ERR_FSYS_CORRUPT;
+	  return -1;
+	}
+      if (eh->eh_depth == 0)
+	break;
+
+      /* extent index */
+      if (level >= EXT4_MAX_EXTENT_DEPTH)
+	{
+	  errnum = ERR_FSYS_CORRUPT;
+	  return -1;
+	}
+      ei = ext4_ext_binsearch_idx(eh, logical_block);
+      if (ei->ei_leaf_hi)
 	{/* 64bit physical block number not supported */
 	  errnum = ERR_FILELENGTH;
 	  return -1;
 	}
-	  if (!ext2_rdfsb(ei->ei_leaf_lo, DATABLOCK1))
+      ext4_path[level].first = ei->ei_block;
+      if (ei < EXT_LAST_INDEX(eh))
+	end = ei[1].ei_block;
+      ext4_path[level].end = end;
+      ext4_path[level].node = ei->ei_leaf_lo;
+      ext4_path_len = ++level;
+
+      ext4_node = -1;
+      if (!ext2_rdfsb(ei->ei_leaf_lo, DATABLOCK1))
 	{
 	  errnum = ERR_FSYS_CORRUPT;
 	  return -1;
 	}
-	  eh = (struct ext4_extent_header*)DATABLOCK1;
-  	}
+      ext4_node = ei->ei_leaf_lo;
+      eh = (struct ext4_extent_header*)DATABLOCK1;
+    }
 
   /* depth==0, we come to the leaf */
-  ex = ext4_ext_binsearch(eh, logical_block);
-  if (ex->ee_start_hi)
+  ex = eh->eh_entries ? ext4_ext_binsearch(eh, logical_block) : 0;
+  /* lengths above EXT_INIT_MAX_LEN mark uninitialized extents */
+  if (ex && (__u32) logical_block >= ex->ee_block
+      && ((__u32) logical_block - ex->ee_block
+	  < (ex->ee_len > EXT_INIT_MAX_LEN
+	     ? ex->ee_len - EXT_INIT_MAX_LEN : ex->ee_len)))
+    {
+      if (ex->ee_start_hi)
 	{/* 64bit physical block number not supported */
 	  errnum = ERR_FILELENGTH;
 	  return -1;
 	}
-  if ((ex->ee_block + ex->ee_len) < logical_block)
+      ext4_ext_block = ex->ee_block;
+      if (ex->ee_len > EXT_INIT_MAX_LEN)
+	{
+	  ext4_ext_len = ex->ee_len - EXT_INIT_MAX_LEN;
+	  ext4_ext_start = 0;
+	}
+      else
+	{
+	  ext4_ext_len = ex->ee_len;
+	  ext4_ext_start = ex->ee_start_lo;
+	}
+    }
+  else
+    {
+      /* a hole, up to the next extent, or the end of what this leaf
+	 covers */
+      if (ex && (__u32) logical_block < ex->ee_block)
+	end = ex->ee_block;
+      else if (ex && ex < EXT_LAST_EXTENT(eh))
+	end = ex[1].ee_block;
+      if (end <= (__u32) logical_block)
 	{
 	  errnum = ERR_FSYS_CORRUPT;
 	  return -1;
 	}
-  return ex->ee_start_lo + logical_block - ex->ee_block;
+      ext4_ext_block = logical_block;
+      ext4_ext_len = end - logical_block;
+      ext4_ext_start = 0;
+    }
+
+ found:
+  if (run)
+	{
+	  __u32 n = ext4_ext_block + ext4_ext_len - logical_block;
+
+	  *run = n > MAXINT ? MAXINT : n;
+	}
+  if (! ext4_ext_start)
+    return 0;
+  return ext4_ext_start + logical_block - ext4_ext_block;
+}
+
+/* Maps LOGICAL_BLOCK into a physical block like ext2fs_block_map, and
+   stores in *RUN the number of blocks, at most *RUN, that follow it
+   contiguously on disk, or, if it is 0, that read as zeros with it, so
+   that a hole is filled all at once, without reading anything.  */
+static int
+ext2fs_block_run (int logical_block, int *run)
+{
+  int map;
+  int n = 1;
+
+  if (EXT4_HAS_INCOMPAT_FEATURE(SUPERBLOCK,EXT4_FEATURE_INCOMPAT_EXTENTS)
+      && INODE->i_flags & EXT4_EXTENTS_FL)
+    {
+      map = ext4fs_block_map (logical_block, &n);
+      if (map >= 0 && n < *run)
+	*run = n;
+    }
+  else
+    {
+      map = ext2fs_block_map (logical_block);
+      if (map >= 0)
+	while (n < *run
+	       && ext2fs_block_map (logical_block + n) == (map ? map + n : 0))
+	  n++;
+      *run = n;
+    }
 
+  if (map < 0)
+    *run = 1;
+
+  return map;
+}
+
+/* Maps the run from LOGICAL_BLOCK on for fsys_read_extents.  */
+static int
+ext2fs_extent_map (int logical_block, int *run)
+{
+  int map = ext2fs_block_run (logical_block, run);
+
+#ifdef E2DEBUG
+  printf ("map=%d run=%d\n", map, *run);
+#endif /* E2DEBUG */
+  return map > 0 ? map << block_sector_shift : map;
 }
 
 /* preconditions: all preconds of ext2fs_block_map */
 int
 ext2fs_read (char *buf, int len)
 {
-  int logical_block;
-  int offset;
-  int map;
-  int ret = 0;
-  int size = 0;
-
 #ifdef E2DEBUG
   static char hexdigit[] = "0123456789abcdef";
   unsigned char *i;
@@ -685,52 +985,61 @@ ext2fs_read (char *buf, int len)
 	}
     }
 #endif /* E2DEBUG */
-  while (len > 0)
-    {
-      /* find the (logical) block component of our location */
-      logical_block = filepos >> EXT2_BLOCK_SIZE_BITS (SUPERBLOCK);
-      offset = filepos & (EXT2_BLOCK_SIZE (SUPERBLOCK) - 1);
-      /* map extents enabled logical block number to physical fs on-disk block number */
-      if (EXT4_HAS_INCOMPAT_FEATURE(SUPERBLOCK,EXT4_FEATURE_INCOMPAT_EXTENTS)
-                    && INODE->i_flags & EXT4_EXTENTS_FL)
-          map = ext4fs_block_map (logical_block);
-      else
-      map = ext2fs_block_map (logical_block);
-#ifdef E2DEBUG
-      printf ("map=%d\n", map);
-#endif /* E2DEBUG */
-      if (map < 0)
-	break;
 
-      size = EXT2_BLOCK_SIZE (SUPERBLOCK);
-      size -= offset;
-      if (size > len)
-	size = len;
+  return fsys_read_extents (buf, len, EXT2_BLOCK_SIZE_BITS (SUPERBLOCK),
+			    ext2fs_extent_map);
+}
+
 
-      if (map == 0) {
-        memset ((char *) buf, 0, size);
-      } else {
-        disk_read_func = disk_read_hook;
+/* Returns the first block of the inode table of GROUP, or zero.  The
+   descriptors are SUPERBLOCK->s_desc_size bytes long on a 64bit file
+   system, and 32 bytes otherwise.  */
+static int
+ext2_inode_table (int group)
+{
+  int per_block = EXT2_DESC_PER_BLOCK (SUPERBLOCK);
+  int group_desc = group >> log2 (per_block);
+  int first = group_desc << log2 (per_block);
+  int is_64bit = EXT4_HAS_INCOMPAT_FEATURE (SUPERBLOCK,
+					    EXT4_FEATURE_INCOMPAT_64BIT);
+  struct ext4_group_desc *gdp;
+#ifndef STAGE1_5
+  int i;
 
-        devread (map * (EXT2_BLOCK_SIZE (SUPERBLOCK) / DEV_BSIZE),
-	         offset, size, buf);
+  if (group < itable_groups && itable[group])
+    return itable[group];
+#endif
 
-        disk_read_func = NULL;
-      }
+  if (!ext2_rdfsb (WHICH_SUPER + group_desc + SUPERBLOCK->s_first_data_block,
+		   (unsigned long) GROUP_DESC))
+    return 0;
 
-      buf += size;
-      len -= size;
-      filepos += size;
-      ret += size;
+#ifndef STAGE1_5
+  /* keep the whole block, leaving out the tables out of reach */
+  for (i = 0; i < per_block && first + i < itable_groups; i++)
+    {
+      gdp = (struct ext4_group_desc *) ((__u8 *) GROUP_DESC
+					+ i * EXT2_DESC_SIZE (SUPERBLOCK));
+      if (! (is_64bit && gdp->bg_inode_table_hi)
+	  && gdp->bg_inode_table <= MAXINT)
+	itable[first + i] = gdp->bg_inode_table;
     }
+#endif
 
-  if (errnum)
-    ret = 0;
+  gdp = (struct ext4_group_desc *) ((__u8 *) GROUP_DESC
+				    + (group - first)
+				    * EXT2_DESC_SIZE (SUPERBLOCK));
+  if ((is_64bit && gdp->bg_inode_table_hi)
+      || gdp->bg_inode_table > MAXINT || ! gdp->bg_inode_table)
+    {
+      /* an inode table past what a block number here can hold */
+      errnum = ERR_FILELENGTH;
+      return 0;
+    }
 
-  return ret;
+  return gdp->bg_inode_table;
 }
 
-
 /* Based on:
    def_blk_fops points to
    blkdev_open, which calls (I think):
@@ -758,10 +1067,311 @@ static inline
 int ext2_is_fast_symlink (void)
 {
   int ea_blocks;
-  ea_blocks = INODE->i_file_acl ? EXT2_BLOCK_SIZE (SUPERBLOCK) / DEV_BSIZE : 0;
+  /* I_BLOCKS counts 512-byte units, whatever the disk's sectors are.  */
+  ea_blocks = INODE->i_file_acl ? EXT2_BLOCK_SIZE (SUPERBLOCK) >> 9 : 0;
   return INODE->i_blocks == ea_blocks;
 }
 
+#ifndef STAGE1_5
+/* fs/ext3/hash.c */
+#define DELTA 0x9E3779B9
+
+static void
+TEA_transform (__u32 buf[4], __u32 const in[])
+{
+  __u32 sum = 0;
+  __u32 b0 = buf[0], b1 = buf[1];
+  __u32 a = in[0], b = in[1], c = in[2], d = in[3];
+  int n = 16;
+
+  do
+    {
+      sum += DELTA;
+      b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+      b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+  while (--n);
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+/* F, G and H are basic MD4 functions: selection, majority, parity */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s)	\
+  (a += f (b, c, d) + x, a = (a << s) | (a >> (32 - s)))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+/* Basic cut-down MD4 transform.  */
+static void
+half_md4_transform (__u32 buf[4], __u32 const in[])
+{
+  __u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  /* Round 1 */
+  ROUND (F, a, b, c, d, in[0] + K1,  3);
+  ROUND (F, d, a, b, c, in[1] + K1,  7);
+  ROUND (F, c, d, a, b, in[2] + K1, 11);
+  ROUND (F, b, c, d, a, in[3] + K1, 19);
+  ROUND (F, a, b, c, d, in[4] + K1,  3);
+  ROUND (F, d, a, b, c, in[5] + K1,  7);
+  ROUND (F, c, d, a, b, in[6] + K1, 11);
+  ROUND (F, b, c, d, a, in[7] + K1, 19);
+
+  /* Round 2 */
+  ROUND (G, a, b, c, d, in[1] + K2,  3);
+  ROUND (G, d, a, b, c, in[3] + K2,  5);
+  ROUND (G, c, d, a, b, in[5] + K2,  9);
+  ROUND (G, b, c, d, a, in[7] + K2, 13);
+  ROUND (G, a, b, c, d, in[0] + K2,  3);
+  ROUND (G, d, a, b, c, in[2] + K2,  5);
+  ROUND (G, c, d, a, b, in[4] + K2,  9);
+  ROUND (G, b, c, d, a, in[6] + K2, 13);
+
+  /* Round 3 */
+  ROUND (H, a, b, c, d, in[3] + K3,  3);
+  ROUND (H, d, a, b, c, in[7] + K3,  9);
+  ROUND (H, c, d, a, b, in[2] + K3, 11);
+  ROUND (H, b, c, d, a, in[6] + K3, 15);
+  ROUND (H, a, b, c, d, in[1] + K3,  3);
+  ROUND (H, d, a, b, c, in[5] + K3,  9);
+  ROUND (H, c, d, a, b, in[0] + K3, 11);
+  ROUND (H, b, c, d, a, in[4] + K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+#undef ROUND
+#undef F
+#undef G
+#undef H
+#undef K1
+#undef K2
+#undef K3
+
+/* The old legacy hash */
+static __u32
+dx_hack_hash (const char *name, int len, int unsigned_flag)
+{
+  __u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+  int c;
+
+  while (len--)
+    {
+      if (unsigned_flag)
+	c = (unsigned char) *name++;
+      else
+	c = (signed char) *name++;
+      hash = hash1 + (hash0 ^ (c * 7152373));
+
+      if (hash & 0x80000000)
+	hash -= 0x7fffffff;
+      hash1 = hash0;
+      hash0 = hash;
+    }
+  return hash0 << 1;
+}
+
+static void
+str2hashbuf (const char *msg, int len, __u32 *buf, int num,
+	     int unsigned_flag)
+{
+  __u32 pad, val;
+  int i, c;
+
+  pad = (__u32) len | ((__u32) len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if (len > num * 4)
+    len = num * 4;
+  for (i = 0; i < len; i++)
+    {
+      if (unsigned_flag)
+	c = (unsigned char) msg[i];
+      else
+	c = (signed char) msg[i];
+      val = c + (val << 8);
+      if ((i % 4) == 3)
+	{
+	  *buf++ = val;
+	  val = pad;
+	  num--;
+	}
+    }
+  if (--num >= 0)
+    *buf++ = val;
+  while (--num >= 0)
+    *buf++ = pad;
+}
+
+/* Returns the hash of the directory entry name NAME of LEN bytes, as
+   computed with the HASH_VERSION function, or 0 if it is unknown.  */
+static __u32
+ext2_dirhash (const char *name, int len, int hash_version)
+{
+  __u32 hash;
+  __u32 in[8], buf[4];
+  int unsigned_flag = 0;
+  int i;
+
+  /* Initialize the default seed for the hash checksum functions */
+  buf[0] = 0x67452301;
+  buf[1] = 0xefcdab89;
+  buf[2] = 0x98badcfe;
+  buf[3] = 0x10325476;
+
+  /* Check to see if the seed is all zero's */
+  for (i = 0; i < 4; i++)
+    if (SUPERBLOCK->s_hash_seed[i])
+      break;
+  if (i < 4)
+    for (i = 0; i < 4; i++)
+      buf[i] = SUPERBLOCK->s_hash_seed[i];
+
+  switch (hash_version)
+    {
+    case DX_HASH_LEGACY_UNSIGNED:
+      unsigned_flag = 1;
+      /* fall through */
+    case DX_HASH_LEGACY:
+      hash = dx_hack_hash (name, len, unsigned_flag);
+      break;
+    case DX_HASH_HALF_MD4_UNSIGNED:
+      unsigned_flag = 1;
+      /* fall through */
+    case DX_HASH_HALF_MD4:
+      for (; len > 0; len -= 32, name += 32)
+	{
+	  str2hashbuf (name, len, in, 8, unsigned_flag);
+	  half_md4_transform (buf, in);
+	}
+      hash = buf[1];
+      break;
+    case DX_HASH_TEA_UNSIGNED:
+      unsigned_flag = 1;
+      /* fall through */
+    case DX_HASH_TEA:
+      for (; len > 0; len -= 16, name += 16)
+	{
+	  str2hashbuf (name, len, in, 4, unsigned_flag);
+	  TEA_transform (buf, in);
+	}
+      hash = buf[0];
+      break;
+    default:
+      return 0;
+    }
+
+  /* the end of file marker is reserved */
+  hash &= ~1;
+  if (hash == 0xfffffffe)
+    hash = 0xfffffffc;
+  return hash;
+}
+
+/* Reads the logical block BLK of the directory in INODE into DATABLOCK2.  */
+static int
+ext2_read_dir_block (int blk)
+{
+  int run = 1;
+  int map;
+
+  map = ext2fs_block_run (blk, &run);
+  if (map <= 0 || !ext2_rdfsb (map, DATABLOCK2))
+    {
+      errnum = ERR_FSYS_CORRUPT;
+      return 0;
+    }
+  return 1;
+}
+
+/* Looks NAME up in the hash index of the directory in INODE, and returns
+ * the logical block of the directory that holds the entry for it if there
+ * is one, or -1 if the index can't be used.  *MORE is set if names with
+ * the same hash continue in another block.
+ * kind of from dx_probe in ext3/namei.c
+ */
+static int
+ext2_dx_lookup (char *name, int *more)
+{
+  struct dx_root_info *info;
+  struct dx_countlimit *cl;
+  struct dx_entry *entries, *p, *q, *m;
+  __u32 hash, next_hash = 0;
+  int hash_version;
+  int levels;
+  int blk;
+
+  if (!(SUPERBLOCK->s_feature_compat & EXT3_FEATURE_COMPAT_DIR_INDEX)
+      || !(INODE->i_flags & EXT2_INDEX_FL)
+      || !ext2_read_dir_block (0))
+    {
+      errnum = ERR_NONE;
+      return -1;
+    }
+
+  info = (struct dx_root_info *) (DATABLOCK2 + DX_ROOT_INFO_OFFSET);
+  hash_version = info->hash_version;
+  if (hash_version <= DX_HASH_TEA
+      && (SUPERBLOCK->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+    hash_version += DX_HASH_LEGACY_UNSIGNED;
+  levels = info->indirect_levels;
+  if (info->reserved_zero || info->unused_flags & 1
+      || hash_version > DX_HASH_TEA_UNSIGNED || levels >= DX_MAX_LEVELS)
+    return -1;
+
+  hash = ext2_dirhash (name, strlen (name), hash_version);
+  entries = (struct dx_entry *) (DATABLOCK2 + DX_ROOT_INFO_OFFSET
+				 + info->info_length);
+
+  while (1)
+    {
+      cl = (struct dx_countlimit *) entries;
+      if (!cl->count || cl->count > cl->limit
+	  || ((char *) (entries + cl->limit)
+	      > (char *) DATABLOCK2 + EXT2_BLOCK_SIZE (SUPERBLOCK)))
+	return -1;
+
+      /* the last entry whose hash is not above HASH */
+      p = entries + 1;
+      q = entries + cl->count - 1;
+      while (p <= q)
+	{
+	  m = p + (q - p) / 2;
+	  if (m->hash > hash)
+	    q = m - 1;
+	  else
+	    p = m + 1;
+	}
+      if (p < entries + cl->count)
+	next_hash = p->hash;
+      blk = p[-1].block & 0x0fffffff;
+
+      if (!levels--)
+	break;
+      if (!ext2_read_dir_block (blk))
+	{
+	  errnum = ERR_NONE;
+	  return -1;
+	}
+      entries = (struct dx_entry *) (DATABLOCK2 + DX_NODE_OFFSET);
+    }
+
+  /* a set low bit marks a continuation of the same hash */
+  *more = (next_hash & ~1) == hash;
+  return blk;
+}
+#endif /* ! STAGE1_5 */
+
 /* preconditions: ext2fs_mount already executed, therefore supblk in buffer
  *   known as SUPERBLOCK
  * returns: 0 if error, nonzero iff we were able to find the file successfully
@@ -775,11 +1385,8 @@ ext2fs_dir (char *dirname)
   int current_ino = EXT2_ROOT_INO;	/* start at the root */
   int updir_ino = current_ino;	/* the parent of the current directory */
   int group_id;			/* which group the inode is in */
-  int group_desc;		/* fs pointer to that group */
-  int desc;			/* index within that group */
   int ino_blk;			/* fs pointer of the inode's information */
   int str_chk = 0;		/* used to hold the results of a string compare */
-  struct ext4_group_desc *ext4_gdp;
   struct ext2_inode *raw_inode;	/* inode info corresponding to current_ino */
 
   char linkbuf[PATH_MAX];	/* buffer for following symbolic links */
@@ -790,6 +1397,12 @@ ext2fs_dir (char *dirname)
 
   int off;			/* offset within block of directory entry (off mod blocksize) */
   int loc;			/* location within a directory */
+  int dir_end;			/* location where the search ends */
+#ifndef STAGE1_5
+  int dx_more;			/* the hash index says to look further */
+  int use_dcache;		/* the dentry cache can answer the lookup */
+  unsigned long dcache[DENTRY_DATA_LEN];
+#endif
   int blk;			/* which data blk within dir entry (off div blocksize) */
   long map;			/* fs pointer of a particular block from dir entry */
   struct ext2_dir_entry *dp;	/* pointer to directory entry */
@@ -812,30 +1425,16 @@ ext2fs_dir (char *dirname)
 
       /* look up an inode */
       group_id = (current_ino - 1) / (SUPERBLOCK->s_inodes_per_group);
-      group_desc = group_id >> log2 (EXT2_DESC_PER_BLOCK (SUPERBLOCK));
-      desc = group_id & (EXT2_DESC_PER_BLOCK (SUPERBLOCK) - 1);
 #ifdef E2DEBUG
       printf ("ipg=%d, dpb=%d\n", SUPERBLOCK->s_inodes_per_group,
 	      EXT2_DESC_PER_BLOCK (SUPERBLOCK));
-      printf ("group_id=%d group_desc=%d desc=%d\n", group_id, group_desc, desc);
+      printf ("group_id=%d\n", group_id);
 #endif /* E2DEBUG */
-      if (!ext2_rdfsb (
-			(WHICH_SUPER + group_desc + SUPERBLOCK->s_first_data_block),
-			(unsigned long) GROUP_DESC))
-	{
-	  return 0;
-	}
-	  ext4_gdp = (struct ext4_group_desc *)( (__u8*)GROUP_DESC +
-			  		desc * EXT2_DESC_SIZE(SUPERBLOCK));
-	  if (EXT4_HAS_INCOMPAT_FEATURE(SUPERBLOCK, EXT4_FEATURE_INCOMPAT_64BIT)
-		&& (! ext4_gdp->bg_inode_table_hi))
-	{/* 64bit itable not supported */
-	  errnum = ERR_FILELENGTH;
-	  return -1;
-	}
-      ino_blk = ext4_gdp->bg_inode_table +
-	(((current_ino - 1) % (SUPERBLOCK->s_inodes_per_group))
-	 >> log2 (EXT2_INODES_PER_BLOCK (SUPERBLOCK)));
+      ino_blk = ext2_inode_table (group_id);
+      if (! ino_blk)
+	return 0;
+      ino_blk += (((current_ino - 1) % (SUPERBLOCK->s_inodes_per_group))
+		  >> log2 (EXT2_INODES_PER_BLOCK (SUPERBLOCK)));
 #ifdef E2DEBUG
       printf ("inode table fsblock=%d\n", ino_blk);
 #endif /* E2DEBUG */
@@ -845,7 +1444,9 @@ ext2fs_dir (char *dirname)
 	}
 
       /* reset indirect blocks! */
-      mapblock2 = mapblock1 = -1;
+      indblock_num[0] = -1;
+      ext4_ext_len = ext4_path_len = 0;
+      ext4_node = -1;
 
       raw_inode = (struct ext2_inode *)((char *)INODE +
 	((current_ino - 1) & (EXT2_INODES_PER_BLOCK (SUPERBLOCK) - 1)) *
@@ -969,6 +1570,9 @@ ext2fs_dir (char *dirname)
 	    }
 
 	  filemax = (INODE->i_size);
+#ifndef STAGE1_5
+	  filemtime = INODE->i_mtime;
+#endif
 	  return 1;
 	}
 
@@ -994,6 +1598,34 @@ ext2fs_dir (char *dirname)
       /* invariant: rest points to slash after the next filename component */
       *rest = 0;
       loc = 0;
+      dir_end = INODE->i_size;
+
+#ifndef STAGE1_5
+      /* completion needs to see every name */
+      use_dcache = !(print_possibilities && ch != '/');
+      if (use_dcache)
+	switch (dentry_cache_lookup (current_ino, dirname, dcache))
+	  {
+	  case 1:
+	    current_ino = dcache[0];
+	    *(dirname = rest) = ch;
+	    continue;
+	  case -1:
+	    errnum = ERR_FILE_NOT_FOUND;
+	    *rest = ch;
+	    return 0;
+	  }
+
+      /* if the directory has a hash index, only the block it points to
+	 needs to be searched */
+      dx_more = 0;
+      if (!print_possibilities && *dirname
+	  && (blk = ext2_dx_lookup (dirname, &dx_more)) >= 0)
+	{
+	  loc = blk << EXT2_BLOCK_SIZE_BITS (SUPERBLOCK);
+	  dir_end = loc + EXT2_BLOCK_SIZE (SUPERBLOCK);
+	}
+#endif /* ! STAGE1_5 */
 
       do
 	{
@@ -1002,9 +1634,20 @@ ext2fs_dir (char *dirname)
 	  printf ("dirname=%s, rest=%s, loc=%d\n", dirname, rest, loc);
 #endif /* E2DEBUG */
 
+#ifndef STAGE1_5
+	  /* entries whose names hash the same may be in later blocks, so
+	     search the whole directory */
+	  if (loc >= dir_end && dx_more)
+	    {
+	      dx_more = 0;
+	      loc = 0;
+	      dir_end = INODE->i_size;
+	    }
+#endif /* ! STAGE1_5 */
+
 	  /* if our location/byte offset into the directory exceeds the size,
 	     give up */
-	  if (loc >= INODE->i_size)
+	  if (loc >= dir_end)
 	    {
 	      if (print_possibilities < 0)
 		{
@@ -1015,6 +1658,10 @@ ext2fs_dir (char *dirname)
 	      else
 		{
 		  errnum = ERR_FILE_NOT_FOUND;
+#ifndef STAGE1_5
+		  if (use_dcache)
+		    dentry_cache_add (current_ino, dirname, 0);
+#endif
 		  *rest = ch;
 		}
 	      return (print_possibilities < 0);
@@ -1030,13 +1677,12 @@ ext2fs_dir (char *dirname)
 	  /* map extents enabled logical block number to physical fs on-disk block number */
 	  if (EXT4_HAS_INCOMPAT_FEATURE(SUPERBLOCK,EXT4_FEATURE_INCOMPAT_EXTENTS)
                         && INODE->i_flags & EXT4_EXTENTS_FL)
-              map = ext4fs_block_map (blk);
+              map = ext4fs_block_map (blk, 0);
 	  else
 	  map = ext2fs_block_map (blk);
 #ifdef E2DEBUG
 	  printf ("fs block=%d\n", map);
 #endif /* E2DEBUG */
-	  mapblock2 = -1;
 	  if (map < 0)
 	  {
 	      *rest = ch;
@@ -1085,6 +1731,13 @@ ext2fs_dir (char *dirname)
       while (!dp->inode || (str_chk || (print_possibilities && ch != '/')));
 
       current_ino = dp->inode;
+#ifndef STAGE1_5
+      if (use_dcache)
+	{
+	  dcache[0] = current_ino;
+	  dentry_cache_add (updir_ino, dirname, dcache);
+	}
+#endif
       *(dirname = rest) = ch;
     }
   /* never get here */
@@ -42,8 +42,17 @@ struct fat_superblock
   
   int cached_fat;
   int file_cluster;
-  int current_cluster_num;
-  int current_cluster;
+  int num_runs;
+  int chain_end;
+};
+
+/* A run of consecutive clusters of the current file, starting at the
+   LOGICAL'th cluster of the file.  */
+struct fat_run
+{
+  int logical;
+  int cluster;
+  int length;
 };
 
 /* pointer(s) into filesystem info buffer for DOS stuff */
@@ -51,8 +60,57 @@ struct fat_superblock
  		    ( FSYS_BUF + 32256) )/* 512 bytes long */
 #define FAT_BUF   ( FSYS_BUF + 28160 )	/* 4 sector FAT buffer */
 #define NAME_BUF  ( FSYS_BUF + 27136 )	/* Filename buffer (833 bytes) */
+#define FAT_RUNS  ( (struct fat_run *) FSYS_BUF )	/* 27136 bytes */
 
 #define FAT_CACHE_SIZE 4096
+#define FAT_RUN_MAX    ((int) (27136 / sizeof (struct fat_run)))
+
+#ifndef STAGE1_5
+/* The names of the directory looked in last, as fat_dir decoded them,
+   lowercased, each with the short entry it is for; a file with a long
+   name is there under both of its names.  The directory was read up to
+   SCANNED, or to its end if COMPLETE is set, so that another name in it
+   is looked up here, and what was not read yet is read only once.
+   Past what it has room for, the directory is read as it was without
+   it, which a boot directory with its kernels and initrds never is.  */
+#define FAT_DCACHE_MAX		128
+#define FAT_DCACHE_POOL		0x800
+
+struct fat_dcache_entry
+{
+  char dirent[FAT_DIRENTRY_LENGTH];
+  unsigned short name;
+};
+
+static struct
+{
+  unsigned long drive;
+  unsigned long partition;
+  unsigned long generation;
+  int dir;
+  int valid;
+  int scanned;
+  int complete;
+  int full;
+  int count;
+  int used;
+  struct fat_dcache_entry entries[FAT_DCACHE_MAX];
+  char pool[FAT_DCACHE_POOL];
+} fat_dcache;
+
+/* The lowercase of each character, for comparing the names, which
+   FAT keeps in the case they were given.  */
+static unsigned char fat_lower[256];
+
+static void
+fat_lower_init (void)
+{
+  int i;
+
+  for (i = 0; i < 256; i++)
+    fat_lower[i] = tolower (i);
+}
+#endif /* ! STAGE1_5 */
 
 static __inline__ unsigned int
 grub_log2 (unsigned int word)
@@ -196,17 +254,170 @@ fat_mount (void)
     return 0;
 
   FAT_SUPER->cached_fat = - 2 * FAT_CACHE_SIZE;
+#ifndef STAGE1_5
+  fat_lower_init ();
+#endif
   return 1;
 }
 
+#ifndef STAGE1_5
+/* FAT_SUPER has been put back as the current partition was mounted
+   with before, but the FAT buffer holds something else by now.  */
+int
+fat_remount (void)
+{
+  FAT_SUPER->cached_fat = - 2 * FAT_CACHE_SIZE;
+  fat_lower_init ();
+  return 1;
+}
+#endif
+
+/* Return the cluster which follows CLUSTER in the FAT, or -1 if an
+   error occurs.  */
+static int
+fat_next_cluster (int cluster)
+{
+  int sector_size = get_sector_size (current_drive);
+  int fat_entry = cluster * FAT_SUPER->fat_size;
+  int cached_pos = fat_entry - FAT_SUPER->cached_fat;
+  int next_cluster;
+
+  if (cached_pos < 0 ||
+      (cached_pos + FAT_SUPER->fat_size) > 2*FAT_CACHE_SIZE)
+    {
+      FAT_SUPER->cached_fat = (fat_entry & ~(2*sector_size - 1));
+      cached_pos = (fat_entry - FAT_SUPER->cached_fat);
+      if (!devread (FAT_SUPER->fat_offset
+		    + FAT_SUPER->cached_fat / (2*sector_size),
+		    0, FAT_CACHE_SIZE, (char*) FAT_BUF))
+	return -1;
+    }
+  next_cluster = * (unsigned long *) (FAT_BUF + (cached_pos >> 1));
+  if (FAT_SUPER->fat_size == 3)
+    {
+      if (cached_pos & 1)
+	next_cluster >>= 4;
+      next_cluster &= 0xFFF;
+    }
+  else if (FAT_SUPER->fat_size == 4)
+    next_cluster &= 0xFFFF;
+
+  return next_cluster;
+}
+
+/* Return the run in FAT_RUNS which holds the LOGICAL_CLUST'th cluster
+   of the current file, following the cluster chain as far as needed to
+   find it.  Return zero if the chain ends before it or if an error
+   occurs.  */
+static struct fat_run *
+fat_find_run (int logical_clust)
+{
+  struct fat_run *runs = FAT_RUNS;
+  struct fat_run *last;
+  int lo, hi;
+
+  /* The start of the map may have been dropped to make room.  */
+  if (FAT_SUPER->num_runs && logical_clust < runs[0].logical)
+    FAT_SUPER->num_runs = 0;
+
+  if (! FAT_SUPER->num_runs)
+    {
+      runs[0].logical = 0;
+      runs[0].cluster = FAT_SUPER->file_cluster;
+      runs[0].length = 1;
+      FAT_SUPER->num_runs = 1;
+      FAT_SUPER->chain_end = 0;
+    }
+
+  last = runs + FAT_SUPER->num_runs - 1;
+  while (logical_clust >= last->logical + last->length)
+    {
+      int next_cluster;
+
+      if (FAT_SUPER->chain_end)
+	return 0;
+
+      next_cluster = fat_next_cluster (last->cluster + last->length - 1);
+      if (next_cluster < 0)
+	return 0;
+      if (next_cluster >= FAT_SUPER->clust_eof_marker)
+	{
+	  FAT_SUPER->chain_end = 1;
+	  return 0;
+	}
+      if (next_cluster < 2 || next_cluster >= FAT_SUPER->num_clust)
+	{
+	  grub_printf("next_cluster: %d FAT_SUPER->num_clust: %d\n",
+	    next_cluster, FAT_SUPER->num_clust);
+	  errnum = ERR_FSYS_CORRUPT;
+	  return 0;
+	}
+
+      if (next_cluster == last->cluster + last->length)
+	{
+	  last->length++;
+	  continue;
+	}
+
+      if (FAT_SUPER->num_runs == FAT_RUN_MAX)
+	{
+	  /* Forget the first half of the map.  */
+	  int i, half = FAT_RUN_MAX / 2;
+
+	  for (i = 0; i < FAT_RUN_MAX - half; i++)
+	    {
+	      runs[i].logical = runs[i + half].logical;
+	      runs[i].cluster = runs[i + half].cluster;
+	      runs[i].length = runs[i + half].length;
+	    }
+	  FAT_SUPER->num_runs -= half;
+	  last -= half;
+	}
+
+      last[1].logical = last->logical + last->length;
+      last[1].cluster = next_cluster;
+      last[1].length = 1;
+      last++;
+      FAT_SUPER->num_runs++;
+    }
+
+  /* Binary search for the run.  */
+  lo = 0;
+  hi = last - runs;
+  while (lo < hi)
+    {
+      int mid = (lo + hi + 1) >> 1;
+
+      if (runs[mid].logical <= logical_clust)
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+
+  return runs + lo;
+}
+
+/* Maps the run from LOGICAL_CLUST on for fsys_read_extents.  */
+static int
+fat_extent_map (int logical_clust, int *num_clust)
+{
+  struct fat_run *run = fat_find_run (logical_clust);
+
+  if (! run)
+    return -1;
+
+  if (*num_clust > run->length - (logical_clust - run->logical))
+    *num_clust = run->length - (logical_clust - run->logical);
+
+  return FAT_SUPER->data_offset +
+    ((run->cluster + logical_clust - run->logical - 2)
+     << (FAT_SUPER->clustsize_bits - FAT_SUPER->sectsize_bits));
+}
+
 int
 fat_read (char *buf, int len)
 {
-  int logical_clust;
-  int offset;
-  int ret = 0;
   int size;
-  int sector_size = get_sector_size(current_drive);
   
   if (FAT_SUPER->file_cluster < 0)
     {
@@ -220,82 +431,92 @@ fat_read (char *buf, int len)
       return size;
     }
   
-  logical_clust = filepos >> FAT_SUPER->clustsize_bits;
-  offset = (filepos & ((1 << FAT_SUPER->clustsize_bits) - 1));
-  if (logical_clust < FAT_SUPER->current_cluster_num)
+  return fsys_read_extents (buf, len, FAT_SUPER->clustsize_bits,
+			    fat_extent_map);
+}
+
+#ifndef STAGE1_5
+/* Compare S1, which is in lowercase already, with S2 as subcasestring
+   does.  */
+static int
+fat_casecmp (const char *s1, const char *s2)
+{
+  while (*s1 == fat_lower[(unsigned char) *s2])
     {
-      FAT_SUPER->current_cluster_num = 0;
-      FAT_SUPER->current_cluster = FAT_SUPER->file_cluster;
+      if (! *(s1++))
+	return 0;
+      s2++;
     }
-  
-  while (len > 0)
+
+  return *s1 ? 1 : -1;
+}
+
+/* Start the names over for DIR, unless they are of it already.  */
+static void
+fat_dcache_check (int dir)
+{
+  if (fat_dcache.valid && fat_dcache.dir == dir
+      && fat_dcache.drive == current_drive
+      && fat_dcache.partition == current_partition
+      && fat_dcache.generation == disk_cache_generation)
+    return;
+
+  fat_dcache.drive = current_drive;
+  fat_dcache.partition = current_partition;
+  fat_dcache.generation = disk_cache_generation;
+  fat_dcache.dir = dir;
+  fat_dcache.valid = 1;
+  fat_dcache.scanned = 0;
+  fat_dcache.complete = 0;
+  fat_dcache.full = 0;
+  fat_dcache.count = 0;
+  fat_dcache.used = 0;
+}
+
+/* Put NAME down as the name of DIRENT.  Return 0 once there is no room
+   left, after which the names are only a part of the directory.  */
+static int
+fat_dcache_add (const char *name, const char *dirent)
+{
+  struct fat_dcache_entry *entry;
+  int i, len = grub_strlen (name) + 1;
+
+  if (fat_dcache.full || fat_dcache.count == FAT_DCACHE_MAX
+      || fat_dcache.used + len > FAT_DCACHE_POOL)
     {
-      int sector;
-      while (logical_clust > FAT_SUPER->current_cluster_num)
-	{
-	  /* calculate next cluster */
-	  int fat_entry = 
-	    FAT_SUPER->current_cluster * FAT_SUPER->fat_size;
-	  int next_cluster;
-	  int cached_pos = (fat_entry - FAT_SUPER->cached_fat);
-	  
-	  if (cached_pos < 0 || 
-	      (cached_pos + FAT_SUPER->fat_size) > 2*FAT_CACHE_SIZE)
-	    {
-	      FAT_SUPER->cached_fat = (fat_entry & ~(2*sector_size - 1));
-	      cached_pos = (fat_entry - FAT_SUPER->cached_fat);
-	      sector = FAT_SUPER->fat_offset
-		+ FAT_SUPER->cached_fat / (2*sector_size);
-	      if (!devread (sector, 0, FAT_CACHE_SIZE, (char*) FAT_BUF))
-		return 0;
-	    }
-	  next_cluster = * (unsigned long *) (FAT_BUF + (cached_pos >> 1));
-	  if (FAT_SUPER->fat_size == 3)
-	    {
-	      if (cached_pos & 1)
-		next_cluster >>= 4;
-	      next_cluster &= 0xFFF;
-	    }
-	  else if (FAT_SUPER->fat_size == 4)
-	    next_cluster &= 0xFFFF;
-	  
-	  if (next_cluster >= FAT_SUPER->clust_eof_marker)
-	    return ret;
-	  if (next_cluster < 2 || next_cluster >= FAT_SUPER->num_clust)
-	    {
-	      grub_printf("next_cluster: %d FAT_SUPER->num_clust: %d\n",
-		next_cluster, FAT_SUPER->num_clust);
-	      errnum = ERR_FSYS_CORRUPT;
-	      return 0;
-	    }
-	  
-	  FAT_SUPER->current_cluster = next_cluster;
-	  FAT_SUPER->current_cluster_num++;
-	}
-      
-      sector = FAT_SUPER->data_offset +
-	((FAT_SUPER->current_cluster - 2) << (FAT_SUPER->clustsize_bits
- 					      - FAT_SUPER->sectsize_bits));
-      size = (1 << FAT_SUPER->clustsize_bits) - offset;
-      if (size > len)
-	size = len;
-      
-      disk_read_func = disk_read_hook;
-      
-      devread(sector, offset, size, buf);
-      
-      disk_read_func = NULL;
-      
-      len -= size;
-      buf += size;
-      ret += size;
-      filepos += size;
-      logical_clust++;
-      offset = 0;
+      fat_dcache.full = 1;
+      return 0;
     }
-  return errnum ? 0 : ret;
+
+  entry = &fat_dcache.entries[fat_dcache.count++];
+  grub_memmove (entry->dirent, dirent, FAT_DIRENTRY_LENGTH);
+  entry->name = fat_dcache.used;
+  for (i = 0; i < len; i++)
+    fat_dcache.pool[fat_dcache.used++] = fat_lower[(unsigned char) name[i]];
+  return 1;
 }
 
+/* Copy the short entry of NAME into DIRENT, and return 1, if it is one
+   of the names.  */
+static int
+fat_dcache_find (const char *name, char *dirent)
+{
+  int i;
+
+  for (i = 0; i < fat_dcache.count; i++)
+    if (! grub_strcmp (fat_dcache.pool + fat_dcache.entries[i].name, name))
+      {
+	grub_memmove (dirent, fat_dcache.entries[i].dirent,
+		      FAT_DIRENTRY_LENGTH);
+	return 1;
+      }
+
+  return 0;
+}
+#else
+# define fat_casecmp subcasestring
+#endif /* ! STAGE1_5 */
+
 int
 fat_dir (char *dirname)
 {
@@ -304,6 +525,7 @@ fat_dir (char *dirname)
   int attrib = FAT_ATTRIB_DIR;
 #ifndef STAGE1_5
   int do_possibilities = 0;
+  unsigned long dcache[DENTRY_DATA_LEN];
 #endif
   
   /* XXX I18N:
@@ -313,10 +535,14 @@ fat_dir (char *dirname)
   { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
   int slot = -2;
   int alias_checksum = -1;
+  int namelen, match;
+#ifndef STAGE1_5
+  int recording;
+#endif
   
   FAT_SUPER->file_cluster = FAT_SUPER->root_cluster;
   filepos = 0;
-  FAT_SUPER->current_cluster_num = MAXINT;
+  FAT_SUPER->num_runs = 0;
   
   /* main loop to find desired directory entry */
  loop:
@@ -352,10 +578,45 @@ fat_dir (char *dirname)
       *rest = tolower(*rest);
   
   *rest = 0;
+  namelen = rest - dirname;
   
 # ifndef STAGE1_5
+  recording = 0;
   if (print_possibilities && ch != '/')
     do_possibilities = 1;
+  else
+    {
+      switch (dentry_cache_lookup (FAT_SUPER->file_cluster, dirname, dcache))
+	{
+	case 1:
+	  *(dirname = rest) = ch;
+	  attrib = dcache[0];
+	  filemax = dcache[1];
+	  filepos = 0;
+	  FAT_SUPER->file_cluster = dcache[2];
+	  FAT_SUPER->num_runs = 0;
+	  goto loop;
+	case -1:
+	  errnum = ERR_FILE_NOT_FOUND;
+	  *rest = ch;
+	  return 0;
+	}
+
+      /* Look among the names read before, and read on from where
+	 that stopped.  */
+      fat_dcache_check (FAT_SUPER->file_cluster);
+      if (fat_dcache_find (dirname, dir_buf))
+	goto found;
+      if (fat_dcache.complete)
+	{
+	  errnum = ERR_FILE_NOT_FOUND;
+	  dentry_cache_add (FAT_SUPER->file_cluster, dirname, 0);
+	  *rest = ch;
+	  return 0;
+	}
+      filepos = fat_dcache.scanned;
+      recording = ! fat_dcache.full;
+    }
 # endif
   
   while (1)
@@ -366,6 +627,8 @@ fat_dir (char *dirname)
 	  if (!errnum)
 	    {
 # ifndef STAGE1_5
+	      if (recording)
+		fat_dcache.complete = 1;
 	      if (print_possibilities < 0)
 		{
 #if 0
@@ -376,6 +639,10 @@ fat_dir (char *dirname)
 # endif /* STAGE1_5 */
 	      
 	      errnum = ERR_FILE_NOT_FOUND;
+# ifndef STAGE1_5
+	      if (! do_possibilities)
+		dentry_cache_add (FAT_SUPER->file_cluster, dirname, 0);
+# endif /* STAGE1_5 */
 	      *rest = ch;
 	    }
 	  
@@ -405,6 +672,15 @@ fat_dir (char *dirname)
 	      slot = id;
 	      filename[slot * 13] = 0;
 	      alias_checksum = FAT_LONGDIR_ALIASCHECKSUM(dir_buf);
+
+	      /* The name has up to 13 characters in each entry, and
+		 more than in one less; if that can't be the length of
+		 the name looked for, it isn't worth putting together.  */
+# ifndef STAGE1_5
+	      if (! do_possibilities && ! recording)
+# endif
+		if (namelen > slot * 13 || namelen <= (slot - 1) * 13)
+		  alias_checksum = -1;
 	    } 
 	  
 	  if (id != slot || slot == 0
@@ -425,6 +701,7 @@ fat_dir (char *dirname)
       if (!FAT_DIRENTRY_VALID (dir_buf))
 	continue;
       
+      match = 0;
       if (alias_checksum != -1 && slot == 0)
 	{
 	  int i;
@@ -439,10 +716,12 @@ fat_dir (char *dirname)
 # ifndef STAGE1_5
 	      if (do_possibilities)
 		goto print_filename;
+	      if (recording)
+		recording = fat_dcache_add (filename, dir_buf);
 # endif /* STAGE1_5 */
 	      
-	      if (subcasestring (dirname, filename) == 0)
-		break;
+	      /* The short name is put down as well before leaving.  */
+	      match = (fat_casecmp (dirname, filename) == 0);
 	    }
 	}
       
@@ -476,19 +755,32 @@ fat_dir (char *dirname)
 	    }
 	  continue;
 	}
+
+      if (recording)
+	recording = fat_dcache_add (filename, dir_buf);
+      if (recording)
+	fat_dcache.scanned = filepos;
 # endif /* STAGE1_5 */
       
-      if (subcasestring (dirname, filename) == 0)
+      if (match || fat_casecmp (dirname, filename) == 0)
 	break;
     }
   
+# ifndef STAGE1_5
+ found:
+  dcache[0] = FAT_DIRENTRY_ATTRIB (dir_buf);
+  dcache[1] = FAT_DIRENTRY_FILELENGTH (dir_buf);
+  dcache[2] = FAT_DIRENTRY_FIRST_CLUSTER (dir_buf);
+  dentry_cache_add (FAT_SUPER->file_cluster, dirname, dcache);
+# endif /* STAGE1_5 */
+  
   *(dirname = rest) = ch;
   
   attrib = FAT_DIRENTRY_ATTRIB (dir_buf);
   filemax = FAT_DIRENTRY_FILELENGTH (dir_buf);
   filepos = 0;
   FAT_SUPER->file_cluster = FAT_DIRENTRY_FIRST_CLUSTER (dir_buf);
-  FAT_SUPER->current_cluster_num = MAXINT;
+  FAT_SUPER->num_runs = 0;
   
   /* go back to main loop at top of function */
   goto loop;
@@ -65,10 +65,6 @@
 #include "dir.h"
 #include "fs.h"
 
-/* used for filesystem map blocks */
-static int mapblock;
-static int mapblock_offset;
-static int mapblock_bsize;
 
 /* pointer to superblock */
 #define SUPERBLOCK ((struct fs *) ( FSYS_BUF + 8192 ))
@@ -76,106 +72,129 @@ static int mapblock_bsize;
 #define MAPBUF ( FSYS_BUF + 24576 )
 #define MAPBUF_LEN 8192
 
+/* The single indirect block of the current file is cached in
+   MAPBUF_SLOTS windows of MAPBUF_SLOT bytes each, in MAPBUF.  Slot I
+   holds the entries from MAPSLOT_START[I] on of the block at sector
+   MAPSLOT_BLOCK[I], or nothing if that is -1, and was used last at
+   MAPSLOT_USED[I].  */
+#define MAPBUF_SLOTS 4
+#define MAPBUF_SLOT (MAPBUF_LEN / MAPBUF_SLOTS)
+#define MAPSLOT_ENTRIES ((int) (MAPBUF_SLOT / sizeof (int)))
+static int mapslot_block[MAPBUF_SLOTS];
+static int mapslot_start[MAPBUF_SLOTS];
+static unsigned long mapslot_used[MAPBUF_SLOTS];
+static unsigned long mapslot_clock;
+
 
 int
 ffs_mount (void)
 {
-  int retval = 1;
+  int retval = 1, i;
+  int bits = get_sector_bits (current_drive);
 
   if ((((current_drive & 0x80) || (current_slice != 0))
        && ! IS_PC_SLICE_TYPE_BSD_WITH_FS (current_slice, FS_BSDFFS))
-      || part_length < (SBLOCK + (SBSIZE / DEV_BSIZE))
-      || !devread (SBLOCK, 0, SBSIZE, (char *) SUPERBLOCK)
-      || SUPERBLOCK->fs_magic != FS_MAGIC)
+      || part_length < ((SBLOCK * DEV_BSIZE + SBSIZE) >> bits)
+      || !devread (0, SBLOCK * DEV_BSIZE, SBSIZE, (char *) SUPERBLOCK)
+      || SUPERBLOCK->fs_magic != FS_MAGIC
+      /* A block must be made of whole sectors.  */
+      || SUPERBLOCK->fs_fsbtodb < bits - 9)
     retval = 0;
+  else
+    /* FSBTODB counts DEV_BSIZE units, so make it count the sectors of
+       the disk instead, once and for all.  */
+    SUPERBLOCK->fs_fsbtodb -= bits - 9;
+
+  for (i = 0; i < MAPBUF_SLOTS; i++)
+    {
+      mapslot_block[i] = -1;
+      mapslot_used[i] = 0;
+    }
 
-  mapblock = -1;
-  mapblock_offset = -1;
-  
   return retval;
 }
 
 static int
 block_map (int file_block)
 {
-  int bnum, offset, bsize;
+  int bnum, entry, slot, i, bsize;
   
   if (file_block < NDADDR)
     return (INODE->i_db[file_block]);
   
-  /* If the blockmap loaded does not include FILE_BLOCK,
-     load a new blockmap.  */
-  if ((bnum = fsbtodb (SUPERBLOCK, INODE->i_ib[0])) != mapblock
-      || (mapblock_offset <= bnum && bnum <= mapblock_offset + mapblock_bsize))
+  bnum = fsbtodb (SUPERBLOCK, INODE->i_ib[0]);
+  entry = (file_block - NDADDR) % NINDIR (SUPERBLOCK);
+
+  /* Look for the window holding ENTRY, and if there is none, read it
+     into the slot used least lately.  */
+  slot = 0;
+  for (i = 0; i < MAPBUF_SLOTS; i++)
     {
-      if (MAPBUF_LEN < SUPERBLOCK->fs_bsize)
-	{
-	  offset = ((file_block - NDADDR) % NINDIR (SUPERBLOCK));
-	  bsize = MAPBUF_LEN;
-	  
-	  if (offset + MAPBUF_LEN > SUPERBLOCK->fs_bsize)
-	    offset = (SUPERBLOCK->fs_bsize - MAPBUF_LEN) / sizeof (int);
-	}
-      else
+      if (mapslot_block[i] == bnum
+	  && mapslot_start[i] <= entry
+	  && entry < mapslot_start[i] + MAPSLOT_ENTRIES)
 	{
-	  bsize = SUPERBLOCK->fs_bsize;
-	  offset = 0;
+	  slot = i;
+	  goto found;
 	}
-      
-      if (! devread (bnum, offset * sizeof (int), bsize, (char *) MAPBUF))
-	{
-	  mapblock = -1;
-	  mapblock_bsize = -1;
-	  mapblock_offset = -1;
-	  errnum = ERR_FSYS_CORRUPT;
-	  return -1;
-	}
-      
-      mapblock = bnum;
-      mapblock_bsize = bsize;
-      mapblock_offset = offset;
+
+      if (mapslot_used[i] < mapslot_used[slot])
+	slot = i;
     }
-  
-  return (((int *) MAPBUF)[((file_block - NDADDR) % NINDIR (SUPERBLOCK))
-			  - mapblock_offset]);
-}
 
+  mapslot_start[slot] = entry - entry % MAPSLOT_ENTRIES;
+  bsize = SUPERBLOCK->fs_bsize - mapslot_start[slot] * sizeof (int);
+  if (bsize > MAPBUF_SLOT)
+    bsize = MAPBUF_SLOT;
 
-int
-ffs_read (char *buf, int len)
-{
-  int logno, off, size, map, ret = 0;
-  
-  while (len && !errnum)
+  if (! devread (bnum, mapslot_start[slot] * sizeof (int), bsize,
+		 (char *) MAPBUF + slot * MAPBUF_SLOT))
     {
-      off = blkoff (SUPERBLOCK, filepos);
-      logno = lblkno (SUPERBLOCK, filepos);
-      size = blksize (SUPERBLOCK, INODE, logno);
-
-      if ((map = block_map (logno)) < 0)
-	break;
+      mapslot_block[slot] = -1;
+      errnum = ERR_FSYS_CORRUPT;
+      return -1;
+    }
 
-      size -= off;
+  mapslot_block[slot] = bnum;
 
-      if (size > len)
-	size = len;
+ found:
+  mapslot_used[slot] = ++mapslot_clock;
+  return (((int *) (MAPBUF + slot * MAPBUF_SLOT))
+	  [entry - mapslot_start[slot]]);
+}
 
-      disk_read_func = disk_read_hook;
 
-      devread (fsbtodb (SUPERBLOCK, map), off, size, buf);
+/* Maps the run from LOGNO on for fsys_read_extents.  */
+static int
+ffs_extent_map (int logno, int *run)
+{
+  int map, next;
+  int n;
 
-      disk_read_func = NULL;
+  if ((map = block_map (logno)) < 0)
+    return -1;
 
-      buf += size;
-      len -= size;
-      filepos += size;
-      ret += size;
+  /* A hole is a run of its own.  */
+  if (! map)
+    {
+      *run = 1;
+      return 0;
     }
 
-  if (errnum)
-    ret = 0;
+  for (n = 1; n < *run; n++)
+    if ((next = block_map (logno + n)) < 0
+	|| next != map + blkstofrags (SUPERBLOCK, n))
+      break;
+
+  *run = n;
+  return fsbtodb (SUPERBLOCK, map);
+}
 
-  return ret;
+int
+ffs_read (char *buf, int len)
+{
+  return fsys_read_extents (buf, len, SUPERBLOCK->fs_bshift,
+			    ffs_extent_map);
 }
 
 
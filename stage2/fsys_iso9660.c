@@ -86,6 +86,12 @@ iso9660_devread (int sector, int byte_offset, int byte_len, char *buf)
 		: "Ic"((int8_t)(ISO_SECTOR_BITS - sector_size_lg2)),
 		"0"(sector));
 
+  /* Start at the device sector the data is in, so that a read from an
+     ISO sector boundary on a disk with smaller sectors still goes
+     straight into BUF.  */
+  sector += byte_offset >> sector_size_lg2;
+  byte_offset &= (1 << sector_size_lg2) - 1;
+
 #if !defined(STAGE1_5)
   if (disk_read_hook && debug)
     printf ("<%d, %d, %d>", sector, byte_offset, byte_len);
@@ -142,8 +148,16 @@ iso9660_dir (char *dirname)
   unsigned char file_type;
   unsigned int rr_len;
   unsigned char rr_flag;
+  unsigned int dir_extent, dir_size;
+#ifndef STAGE1_5
+  unsigned long dcache[DENTRY_DATA_LEN];
+  int use_dcache;
+  char ch;
+#endif
 
   idr = &PRIMDESC->root_directory_record;
+  dir_extent = idr->extent.l;
+  dir_size = idr->size.l;
   INODE->file_start = 0;
 
   do
@@ -157,8 +171,43 @@ iso9660_dir (char *dirname)
 	   pathlen++)
 	;
 
-      size = idr->size.l;
-      extent = idr->extent.l;
+      size = dir_size;
+      extent = dir_extent;
+
+#ifndef STAGE1_5
+      /* Each directory is looked up by its extent.  Completions need
+	 every name, so they always scan.  */
+      use_dcache = ! (print_possibilities && dirname[pathlen] != '/');
+      if (use_dcache)
+	{
+	  int found;
+
+	  ch = dirname[pathlen];
+	  dirname[pathlen] = 0;
+	  found = dentry_cache_lookup (dir_extent, dirname, dcache);
+	  dirname[pathlen] = ch;
+
+	  if (found < 0)
+	    {
+	      errnum = ERR_FILE_NOT_FOUND;
+	      return 0;
+	    }
+	  if (found > 0)
+	    {
+	      extent = dcache[0];
+	      size = dcache[1];
+	      file_type = dcache[2];
+	      goto found;
+	    }
+	}
+
+      /* The directory may take many sectors, each a round trip on an
+	 emulated CD-ROM, so let the disk fetch them together.  */
+      if (size > ISO_SECTOR_SIZE && readahead_possible ())
+	devreadahead (extent << (ISO_SECTOR_BITS
+				 - grub_log2 (buf_geom.sector_size)),
+		      0, size);
+#endif /* ! STAGE1_5 */
 
       while (size > 0)
 	{
@@ -210,7 +259,7 @@ iso9660_dir (char *dirname)
 		    {
 #ifndef STAGE1_5
 		      if (debug)
-			printf(
+			bootlog_printf(
 			       "Non-supported version (%d) RockRidge chunk "
 			       "`%c%c'\n", rr_ptr.rr->version,
 			       rr_ptr.rr->signature & 0xFF,
@@ -352,24 +401,21 @@ iso9660_dir (char *dirname)
 		       */
 		      if (pathlen == name_len)
 			{
-			  if (dirname[pathlen] == '/')
-			    {
-			      if (file_type != ISO_DIRECTORY)
-				{
-				  errnum = ERR_BAD_FILETYPE;
-				  return 0;
-				}
-			      goto next_dir_level;
-			    }
-			  if (file_type != ISO_REGULAR)
+			  extent = idr->extent.l;
+			  size = idr->size.l;
+#ifndef STAGE1_5
+			  if (use_dcache)
 			    {
-			      errnum = ERR_BAD_FILETYPE;
-			      return 0;
+			      dcache[0] = extent;
+			      dcache[1] = size;
+			      dcache[2] = file_type;
+			      ch = dirname[pathlen];
+			      dirname[pathlen] = 0;
+			      dentry_cache_add (dir_extent, dirname, dcache);
+			      dirname[pathlen] = ch;
 			    }
-			  INODE->file_start = idr->extent.l;
-			  filepos = 0;
-			  filemax = idr->size.l;
-			  return 1;
+#endif
+			  goto found;
 			}
 		    }
 		  else	/* Completion */
@@ -390,9 +436,42 @@ iso9660_dir (char *dirname)
 
       if (dirname[pathlen] == '/' || print_possibilities >= 0)
 	{
+#ifndef STAGE1_5
+	  if (use_dcache)
+	    {
+	      ch = dirname[pathlen];
+	      dirname[pathlen] = 0;
+	      dentry_cache_add (dir_extent, dirname, 0);
+	      dirname[pathlen] = ch;
+	    }
+#endif
 	  errnum = ERR_FILE_NOT_FOUND;
 	  return 0;
 	}
+      goto next_dir_level;
+
+    found:
+      /* EXTENT, SIZE and FILE_TYPE describe the entry named DIRNAME.  */
+      if (dirname[pathlen] == '/')
+	{
+	  if (file_type != ISO_DIRECTORY)
+	    {
+	      errnum = ERR_BAD_FILETYPE;
+	      return 0;
+	    }
+	  dir_extent = extent;
+	  dir_size = size;
+	  goto next_dir_level;
+	}
+      if (file_type != ISO_REGULAR)
+	{
+	  errnum = ERR_BAD_FILETYPE;
+	  return 0;
+	}
+      INODE->file_start = extent;
+      filepos = 0;
+      filemax = size;
+      return 1;
 
     next_dir_level:
       dirname += pathlen;
@@ -405,36 +484,46 @@ iso9660_dir (char *dirname)
 int
 iso9660_read (char *buf, int len)
 {
-  int sector, blkoffset, size, ret;
+  int sector, blkoffset;
 
   if (INODE->file_start == 0)
     return 0;
 
-  ret = 0;
+  if (len <= 0)
+    return 0;
+
+  /* A file is all in one extent, so the whole of it goes with one
+     read, which rawread passes on to the disk in as few requests as
+     it can.  */
   blkoffset = filepos & (ISO_SECTOR_SIZE - 1);
   sector = filepos >> ISO_SECTOR_BITS;
-  while (len > 0)
-    {
-      size = ISO_SECTOR_SIZE - blkoffset;
-      if (size > len)
-        size = len;
 
-      disk_read_func = disk_read_hook;
+  disk_read_func = disk_read_hook;
+  iso9660_devread (INODE->file_start + sector, blkoffset, len, buf);
+  disk_read_func = NULL;
 
-      if (!iso9660_devread(INODE->file_start + sector, blkoffset, size, buf))
-	return 0;
+  if (errnum)
+    return 0;
+
+  filepos += len;
+
+#ifndef STAGE1_5
+  /* Each request to an emulated CD-ROM is a round trip to whatever
+     serves it, so let the disk fetch what follows meanwhile.  */
+  if (filepos < filemax && readahead_possible ())
+    {
+      int bits = ISO_SECTOR_BITS - grub_log2 (buf_geom.sector_size);
+      int size = filemax - filepos;
 
-      disk_read_func = NULL;
+      if (size > READAHEAD_LEN)
+	size = READAHEAD_LEN;
 
-      len -= size;
-      buf += size;
-      ret += size;
-      filepos += size;
-      sector++;
-      blkoffset = 0;
+      devreadahead ((INODE->file_start + (filepos >> ISO_SECTOR_BITS))
+		    << bits, filepos & (ISO_SECTOR_SIZE - 1), size);
     }
+#endif /* ! STAGE1_5 */
 
-  return ret;
+  return len;
 }
 
 #endif /* FSYS_ISO9660 */
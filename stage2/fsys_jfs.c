@@ -42,6 +42,12 @@ struct jfs_info
 	int dttype;
 	xad_t *xad;
 	ldtentry_t *de;
+	/* Where the last jfs_read stopped: the extent it was in, or NULL
+	   if it must start over, the end of the extent before it, and
+	   the file position.  */
+	xad_t *rxad;
+	s64 rendofprev;
+	int rpos;
 };
 
 static struct jfs_info jfs;
@@ -111,6 +117,8 @@ di_read (u32 inum, dinode_t *di)
 	xad_t *xad;
 	pxd_t pxd;
 
+	/* The extent walk below reuses xtpage.  */
+	jfs.rxad = NULL;
 	key = (((inum >> L2INOSPERIAG) << L2INOSPERIAG) + 4096) >> jfs.l2bsize;
 	xd = (inum & (INOSPERIAG - 1)) >> L2INOSPEREXT;
 	ioffset = ((inum & (INOSPERIAG - 1)) & (INOSPEREXT - 1)) << L2DISIZE;
@@ -203,6 +211,66 @@ uni2ansi (UniChar *uni, char *ansi, int len)
 		*ansi++ = (*uni & 0xff80) ? '?' : *(char *)uni;
 }
 
+#ifndef STAGE1_5
+/* Convert the name of DE, which may go on in further slots, into
+   NAMEBUF.  */
+static void
+dentry_name (ldtentry_t *de, char *namebuf)
+{
+	char *ptr;
+	dtslot_t *ds;
+	int namlen = de->namlen;
+
+	if (de->next == -1) {
+		uni2ansi (de->name, namebuf, namlen);
+		namebuf[namlen] = 0;
+	} else {
+		uni2ansi (de->name, namebuf, DTLHDRDATALEN);
+		ptr = namebuf;
+		ptr += DTLHDRDATALEN;
+		namlen -= DTLHDRDATALEN;
+		ds = next_dslot (de->next);
+		while (ds->next != -1) {
+			uni2ansi (ds->name, ptr, DTSLOTDATALEN);
+			ptr += DTSLOTDATALEN;
+			namlen -= DTSLOTDATALEN;
+			ds = next_dslot (ds->next);
+		}
+		uni2ansi (ds->name, ptr, namlen);
+		ptr += namlen;
+		*ptr = 0;
+	}
+}
+#endif
+
+/* Return whether the name of DE is NAME, which is LEN characters long.
+   The name is compared where it lies, a character at a time, as
+   uni2ansi would have converted it.  */
+static int
+dentry_is (ldtentry_t *de, char *name, int len)
+{
+	UniChar *uni = de->name;
+	int left = DTLHDRDATALEN;
+	s8 next = de->next;
+	dtslot_t *ds;
+
+	if (de->namlen != len)
+		return 0;
+
+	for (; len; len--, left--, uni++, name++) {
+		if (!left) {
+			ds = next_dslot (next);
+			next = ds->next;
+			uni = ds->name;
+			left = DTSLOTDATALEN;
+		}
+		if (((*uni & 0xff80) ? '?' : (char)*uni) != *name)
+			return 0;
+	}
+
+	return 1;
+}
+
 int
 jfs_mount (void)
 {
@@ -221,6 +289,7 @@ jfs_mount (void)
 	jfs.bsize = super.s_bsize;
 	jfs.l2bsize = super.s_l2bsize;
 	jfs.bdlog = jfs.l2bsize - sector_bits;
+	jfs.rxad = NULL;
 
 	return 1;
 }
@@ -235,8 +304,15 @@ jfs_read (char *buf, int len)
 
 	startpos = filepos;
 	endpos = filepos + len;
-	endofprev = (1ULL << 62) - 1;
-	xad = first_extent (inode);
+	/* Go on from the extent the last call stopped in, unless FILEPOS
+	   was moved back before it.  */
+	if (jfs.rxad && filepos >= jfs.rpos) {
+		xad = jfs.rxad;
+		endofprev = jfs.rendofprev;
+	} else {
+		endofprev = (1ULL << 62) - 1;
+		xad = first_extent (inode);
+	}
 	do {
 		offset = offsetXAD (xad);
 		xadlen = lengthXAD (xad);
@@ -253,9 +329,12 @@ jfs_read (char *buf, int len)
 			buf += toread;
 			len -= toread;
 			filepos += toread;
-		} else if (offset > endofprev) {
+			if (!len)
+				break;
+		} else if (offset > endofprev
+			   && (filepos >> jfs.l2bsize) < offset) {
 			toread = ((offset << jfs.l2bsize) >= endpos)
-				  ? len : ((offset - endofprev) << jfs.l2bsize);
+				  ? len : ((offset << jfs.l2bsize) - filepos);
 			len -= toread;
 			filepos += toread;
 			for (; toread; toread--) {
@@ -267,20 +346,26 @@ jfs_read (char *buf, int len)
 		xad = next_extent ();
 	} while (len > 0 && xad);
 
+	jfs.rxad = xad;
+	jfs.rendofprev = endofprev;
+	jfs.rpos = filepos;
+
 	return filepos - startpos;
 }
 
 int
 jfs_dir (char *dirname)
 {
-	char *ptr, *rest, ch;
+	char *rest, ch;
 	ldtentry_t *de;
-	dtslot_t *ds;
 	u32 inum, parent_inum;
 	s64 di_size;
 	u32 di_mode;
-	int namlen, cmp, n, link_count;
-	char namebuf[JFS_NAME_MAX + 1], linkbuf[JFS_PATH_MAX];
+	int n, link_count;
+	char linkbuf[JFS_PATH_MAX];
+#ifndef STAGE1_5
+	char namebuf[JFS_NAME_MAX + 1];
+#endif
 
 	parent_inum = inum = ROOT_I;
 	link_count = 0;
@@ -335,37 +420,19 @@ jfs_dir (char *dirname)
 
 		de = first_dentry ();
 		for (;;) {
-			namlen = de->namlen;
-			if (de->next == -1) {
-				uni2ansi (de->name, namebuf, namlen);
-				namebuf[namlen] = 0;
-			} else {
-				uni2ansi (de->name, namebuf, DTLHDRDATALEN);
-				ptr = namebuf;
-				ptr += DTLHDRDATALEN;
-				namlen -= DTLHDRDATALEN;
-				ds = next_dslot (de->next);
-				while (ds->next != -1) {
-					uni2ansi (ds->name, ptr, DTSLOTDATALEN);
-					ptr += DTSLOTDATALEN;
-					namlen -= DTSLOTDATALEN;
-					ds = next_dslot (ds->next);
-				}
-				uni2ansi (ds->name, ptr, namlen);
-				ptr += namlen;
-				*ptr = 0;
-			}
-
-			cmp = (!*dirname) ? -1 : substring (dirname, namebuf);
 #ifndef STAGE1_5
-			if (print_possibilities && ch != '/'
-			    && cmp <= 0) {
-				if (print_possibilities > 0)
-					print_possibilities = -print_possibilities;
-				print_a_completion (namebuf);
+			/* Only completions need the names converted.  */
+			if (print_possibilities && ch != '/') {
+				dentry_name (de, namebuf);
+				if (!*dirname
+				    || substring (dirname, namebuf) <= 0) {
+					if (print_possibilities > 0)
+						print_possibilities = -print_possibilities;
+					print_a_completion (namebuf);
+				}
 			} else
 #endif
-			if (cmp == 0) {
+			if (*dirname && dentry_is (de, dirname, rest - dirname)) {
 				parent_inum = inum;
 				inum = de->inumber;
 		        	*(dirname = rest) = ch;
@@ -165,6 +165,9 @@ minix_mount (void)
       && ! IS_PC_SLICE_TYPE_BSD_WITH_FS (current_slice, FS_OTHER))
     return 0;			/* The partition is not of MINIX type */
   
+  if (get_sector_size (current_drive) != DEV_BSIZE)
+    return 0;			/* The blocks are not whole sectors */
+
   if (part_length < (SBLOCK +
 		     (sizeof (struct minix_super_block) / DEV_BSIZE)))
     return 0;			/* The partition is too short */
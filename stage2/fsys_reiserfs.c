@@ -380,6 +380,102 @@ is_power_of_two (unsigned long word)
   return (word & -word) == word;
 }
 
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+/* The node cache.  GRUB mounts the file system again for each file it
+ * opens, so the nodes in FSYS_BUF hardly ever help the next lookup.
+ * Here the tree nodes read last are kept in pool memory, together
+ * with the journal table, for the ReiserFS on NODE_CACHE_DRIVE and
+ * NODE_CACHE_PARTITION.  All of it is dropped when another one is
+ * mounted, or when the disk cache is invalidated.
+ */
+#define NODE_CACHE_MAX	64
+
+struct node_cache_entry
+{
+  unsigned int block;
+  /* The value of NODE_CACHE_CLOCK when this node was used last, or
+     zero if the entry is unused.  */
+  unsigned long stamp;
+  char *data;
+};
+
+static struct node_cache_entry node_cache[NODE_CACHE_MAX];
+static unsigned long node_cache_clock;
+static unsigned long node_cache_drive = GRUB_INVALID_DRIVE;
+static unsigned long node_cache_partition;
+static unsigned long node_cache_generation;
+
+/* The journal table as journal_init built it, and the journal header
+   it was built from, if JOURNAL_CACHE_VALID.  */
+static __u32 *journal_cache;
+static int journal_cache_valid;
+static struct reiserfs_journal_header journal_cache_header;
+static __u32 journal_cache_first_desc;
+static __u16 journal_cache_transactions;
+
+/* Empty the caches if they belong to another file system.  */
+static void
+node_cache_check (void)
+{
+  int i;
+
+  if (node_cache_drive == current_drive
+      && node_cache_partition == current_partition
+      && node_cache_generation == disk_cache_generation)
+    return;
+
+  for (i = 0; i < NODE_CACHE_MAX; i++)
+    node_cache[i].stamp = 0;
+  journal_cache_valid = 0;
+  node_cache_drive = current_drive;
+  node_cache_partition = current_partition;
+  node_cache_generation = disk_cache_generation;
+}
+
+/* Copy the node BLOCKNR to BUFFER, if it is cached.  */
+static int
+node_cache_lookup (unsigned int blockNr, char *buffer)
+{
+  int i;
+
+  node_cache_check ();
+  for (i = 0; i < NODE_CACHE_MAX; i++)
+    if (node_cache[i].stamp && node_cache[i].block == blockNr)
+      {
+	memcpy (buffer, node_cache[i].data, INFO->blocksize);
+	node_cache[i].stamp = ++node_cache_clock;
+	return 1;
+      }
+
+  return 0;
+}
+
+/* Remember that the node BLOCKNR is in BUFFER, in place of the node
+   used least lately.  */
+static void
+node_cache_add (unsigned int blockNr, char *buffer)
+{
+  struct node_cache_entry *entry = node_cache;
+  int i;
+
+  node_cache_check ();
+  for (i = 1; i < NODE_CACHE_MAX; i++)
+    if (node_cache[i].stamp < entry->stamp)
+      entry = node_cache + i;
+
+  if (! entry->data)
+    {
+      entry->data = grub_malloc (FSYSREISER_MAX_BLOCKSIZE);
+      if (! entry->data)
+	return;
+    }
+
+  memcpy (entry->data, buffer, INFO->blocksize);
+  entry->block = blockNr;
+  entry->stamp = ++node_cache_clock;
+}
+#endif /* PLATFORM_EFI && ! GRUB_UTIL */
+
 static int 
 journal_read (int block, int len, char *buffer) 
 {
@@ -488,6 +584,21 @@ journal_init (void)
   INFO->journal_first_desc = desc_block;
   next_trans_id = header.j_last_flush_trans_id + 1;
 
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  /* Nothing was flushed or logged since the table was built.  */
+  node_cache_check ();
+  if (journal_cache_valid
+      && ! memcmp ((char *) &header, (char *) &journal_cache_header,
+		   sizeof (header)))
+    {
+      memmove ((char *) JOURNAL_START, (char *) journal_cache,
+	       (char *) JOURNAL_END - (char *) JOURNAL_START);
+      INFO->journal_first_desc = journal_cache_first_desc;
+      INFO->journal_transactions = journal_cache_transactions;
+      return 1;
+    }
+#endif
+
 #ifdef REISERDEBUG
   printf ("journal_init: last flushed %d\n", 
 	  header.j_last_flush_trans_id);
@@ -560,9 +671,45 @@ journal_init (void)
 
   INFO->journal_transactions
     = next_trans_id - header.j_last_flush_trans_id - 1;
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  if (! errnum)
+    {
+      if (! journal_cache)
+	journal_cache = grub_malloc ((char *) JOURNAL_END
+				     - (char *) JOURNAL_START);
+      if (journal_cache)
+	{
+	  memmove ((char *) journal_cache, (char *) JOURNAL_START,
+		   (char *) JOURNAL_END - (char *) JOURNAL_START);
+	  journal_cache_header = header;
+	  journal_cache_first_desc = INFO->journal_first_desc;
+	  journal_cache_transactions = INFO->journal_transactions;
+	  journal_cache_valid = 1;
+	}
+    }
+#endif
   return errnum == 0;
 }
 
+/* Read the tree node BLOCKNR into BUFFER, from the pool memory if it
+ * is cached there.
+ */
+static int
+node_read (unsigned int blockNr, char *buffer)
+{
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  if (node_cache_lookup (blockNr, buffer))
+    return 1;
+  if (! block_read (blockNr, 0, INFO->blocksize, buffer))
+    return 0;
+  node_cache_add (blockNr, buffer);
+  return 1;
+#else
+  return block_read (blockNr, 0, INFO->blocksize, buffer);
+#endif
+}
+
 /* check filesystem types and read superblock into memory buffer */
 int
 reiserfs_mount (void)
@@ -644,7 +791,7 @@ reiserfs_mount (void)
 		  0, sizeof (struct reiserfs_super_block), (char *) &super);
     }
 
-  if (! block_read (super.s_root_block, 0, INFO->blocksize, (char*) ROOT))
+  if (! node_read (super.s_root_block, (char*) ROOT))
     return 0;
   
   INFO->tree_depth = BLOCKHEAD (ROOT)->blk_level;
@@ -677,6 +824,9 @@ reiserfs_mount (void)
  *       if there is not enough space in the cache, the top most are
  *       omitted.
  *
+ * Under EFI, the nodes read last are also kept in pool memory by
+ * node_read, so that they outlive the mount.
+ *
  * I have only two methods to find a key in the tree:
  *   search_stat(dir_id, objectid) searches for the stat entry (always
  *       the first entry) of an object.
@@ -709,7 +859,7 @@ read_tree_node (unsigned int blockNr, int depth)
   printf ("  next read_in: block=%d (depth=%d)\n",
 	  blockNr, depth);
 #endif /* REISERDEBUG */
-  if (! block_read (blockNr, 0, INFO->blocksize, cache))
+  if (! node_read (blockNr, cache))
     return 0;
   /* Make sure it has the right node level */
   if (BLOCKHEAD (cache)->blk_level != depth)
@@ -999,6 +1149,7 @@ reiserfs_dir (char *dirname)
   __u32 dir_id, objectid, parent_dir_id = 0, parent_objectid = 0;
 #ifndef STAGE1_5
   int do_possibilities = 0;
+  unsigned long dcache[DENTRY_DATA_LEN];
 #endif /* ! STAGE1_5 */
   char linkbuf[PATH_MAX];	/* buffer for following symbolic links */
   int link_count = 0;
@@ -1126,6 +1277,23 @@ reiserfs_dir (char *dirname)
 # ifndef STAGE1_5
       if (print_possibilities && ch != '/')
 	do_possibilities = 1;
+      else
+	/* object ids are unique, so they identify the directory */
+	switch (dentry_cache_lookup (objectid, dirname, dcache))
+	  {
+	  case 1:
+	    *rest = ch;
+	    dirname = rest;
+	    parent_dir_id = dir_id;
+	    parent_objectid = objectid;
+	    dir_id = dcache[0];
+	    objectid = dcache[1];
+	    continue;
+	  case -1:
+	    errnum = ERR_FILE_NOT_FOUND;
+	    *rest = ch;
+	    return 0;
+	  }
 # endif /* ! STAGE1_5 */
       
       while (1)
@@ -1194,6 +1362,8 @@ reiserfs_dir (char *dirname)
 # ifndef STAGE1_5
       if (print_possibilities < 0)
 	return 1;
+      if (! do_possibilities && ! errnum)
+	dentry_cache_add (objectid, dirname, 0);
 # endif /* ! STAGE1_5 */
       
       errnum = ERR_FILE_NOT_FOUND;
@@ -1202,6 +1372,11 @@ reiserfs_dir (char *dirname)
       
     found:
       
+# ifndef STAGE1_5
+      dcache[0] = de_head->deh_dir_id;
+      dcache[1] = de_head->deh_objectid;
+      dentry_cache_add (objectid, dirname, dcache);
+# endif /* ! STAGE1_5 */
       *rest = ch;
       dirname = rest;
 
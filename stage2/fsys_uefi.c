@@ -30,10 +30,24 @@
 #include <grub/efi/api.h>
 
 static grub_efi_simple_file_system_t *file_system;
-static grub_efi_guid_t fsinfo_guid = GRUB_EFI_DEVICE_PATH_GUID;
+static grub_efi_guid_t file_info_guid = GRUB_EFI_FILE_INFO_GUID;
 grub_efi_file_t *root = NULL;
 grub_efi_file_t *file = NULL;
 
+/* How much uefi_read asks the firmware for at once, when it is asked
+   for less.  Every call into the firmware costs much more than copying
+   what it returned.  */
+#define UEFI_BUFLEN	0x40000
+
+/* The position of the firmware in FILE, so that it isn't set again
+   before each read.  */
+static grub_efi_uint64_t file_position;
+
+/* AHEAD_LEN bytes of FILE from AHEAD_START on, read in advance.  */
+static char *ahead_buf;
+static int ahead_start;
+static int ahead_len;
+
 typedef struct {
   grub_efi_uint64_t size;
   grub_efi_uint64_t filesize;
@@ -45,6 +59,34 @@ typedef struct {
   grub_efi_char16_t filename[];
 } grub_efi_file_info_t;
 
+/* Return the information about F, which the caller must free, or NULL
+   if the firmware can't tell.  */
+static grub_efi_file_info_t *
+uefi_file_info (grub_efi_file_t *f)
+{
+  grub_efi_file_info_t *fileinfo = NULL;
+  grub_efi_uintn_t buffersize = 0;
+  grub_efi_status_t status;
+
+  status = Call_Service_4 (f->get_info, f, &file_info_guid,
+			   &buffersize, fileinfo);
+  if (status != GRUB_EFI_BUFFER_TOO_SMALL)
+    return NULL;
+
+  fileinfo = grub_malloc (buffersize);
+  if (!fileinfo)
+    return NULL;
+
+  status = Call_Service_4 (f->get_info, f, &file_info_guid,
+			   &buffersize, fileinfo);
+  if (status != GRUB_EFI_SUCCESS) {
+    grub_free (fileinfo);
+    return NULL;
+  }
+
+  return fileinfo;
+}
+
 int 
 uefi_mount (void)
 {
@@ -73,17 +115,17 @@ uefi_dir (char *dirname)
 {
   grub_efi_status_t status;
   grub_efi_char16_t *file_name_w = NULL;
-  grub_efi_char16_t *dir_name_w = NULL;
   grub_efi_file_info_t *fileinfo = NULL;
   grub_efi_uintn_t buffersize = 0;  
-  grub_efi_file_t *directory = NULL;
-  int i, dirlen = 0, ret = 0;
+  int i, len, dirlen = 0, ret = 0;
+  grub_efi_uintn_t mark = grub_efi_arena_mark ();
 
-  file_name_w = grub_malloc (2 * strlen(dirname) + 2);
+  len = strlen(dirname);
+  file_name_w = grub_efi_arena_alloc (2 * len + 2);
   if (!file_name_w)
     goto done;
 
-  for (i=0; i<strlen(dirname); i++) {
+  for (i=0; i<len; i++) {
     file_name_w[i] = dirname[i];
     if (file_name_w[i] == '/') {
       file_name_w[i] = '\\';
@@ -99,6 +141,9 @@ uefi_dir (char *dirname)
   if (status != GRUB_EFI_SUCCESS)
     goto done;
 
+  file_position = 0;
+  ahead_len = 0;
+
   if (dirname[i-1] == '/') {
     if (print_possibilities)
       grub_printf("\n");
@@ -130,50 +175,11 @@ uefi_dir (char *dirname)
     }
   } else {
     char *data = NULL;
-    dir_name_w = grub_malloc (2 * dirlen + 2);
-    if (!dir_name_w)
-      goto done;
-
-    for (i=0; i<dirlen; i++)
-      dir_name_w[i] = file_name_w[i];
-
-    dir_name_w[i] = '\0';
-
-    status = Call_Service_5 (root->open, root, &directory, dir_name_w,
-			     GRUB_EFI_FILE_MODE_READ, 0);
-
-    while (1) {
-      int filenamelen;
-      int invalid = 0;
-
-      status = Call_Service_3 (directory->read, directory, &buffersize, fileinfo);
-
-      if (status == GRUB_EFI_BUFFER_TOO_SMALL) {
-	fileinfo = grub_malloc(buffersize);
-	continue;
-      } else if (status) {
-	goto done;
-      } else if (buffersize == 0) {
-	goto done;
-      }
 
-      filenamelen = fileinfo->size - sizeof(*fileinfo);
-
-      if (filenamelen != ((strlen(dirname) - dirlen) * 2))
-	continue;
-
-      for (i=0; i<filenamelen/2; i++) {
-	if (fileinfo->filename[i] != file_name_w[i + dirlen + 1]) {
-	  if (fileinfo->filename[i] > 0xff ||
-	      (grub_tolower(fileinfo->filename[i]) !=
-	       grub_tolower(file_name_w[i + dirlen + 1])))
-	    invalid = 1;
-	}
-      }
-
-      if (!invalid)
-	break;
-    }
+    /* Ask the file itself, rather than look for it in its directory.  */
+    fileinfo = uefi_file_info (file);
+    if (!fileinfo)
+      goto done;
 
     if (fileinfo->filesize < 256 && fileinfo->filesize > 3)
       {
@@ -216,10 +222,7 @@ uefi_dir (char *dirname)
  done:
   if (fileinfo)
     grub_free (fileinfo);
-  if (dir_name_w)
-    grub_free (dir_name_w);
-  if (file_name_w)
-    grub_free (file_name_w);
+  grub_efi_arena_release (mark);
 
   return ret;
 }
@@ -233,33 +236,75 @@ uefi_close (void)
     status = Call_Service_1 (file->close, file);
 
   file = NULL;
+  ahead_len = 0;
 }
 
-int 
-uefi_read (char *addr, int len)
+/* Read up to LEN bytes of FILE at FILEPOS into ADDR, and return how
+   many there were, or -1 if the firmware failed.  */
+static int
+uefi_read_file (char *addr, int len)
 {
   grub_efi_status_t status;
   grub_efi_uintn_t length = len;
 
-  errnum = 0;
-
-  status = Call_Service_2 (file->set_position, file, filepos);
-
-  if (status != GRUB_EFI_SUCCESS)
-    goto out;
+  if (file_position != (grub_efi_uint64_t) filepos) {
+    status = Call_Service_2 (file->set_position, file, filepos);
+    if (status != GRUB_EFI_SUCCESS)
+      goto out;
+    file_position = filepos;
+  }
 
   status = Call_Service_3 (file->read, file, &length, addr);
-  
-  len = length;
-
   if (status == GRUB_EFI_SUCCESS) {
-    filepos += len;
-    return len;
+    file_position += length;
+    return length;
   }
 
  out:
+  /* Where it stopped is anybody's guess.  */
+  file_position = ~0ULL;
   errnum = ERR_FILE_NOT_FOUND;
+  return -1;
+}
+
+/* Small reads are served from a buffer, which is filled UEFI_BUFLEN
+   bytes at a time, and large ones go straight to the firmware.  */
+int 
+uefi_read (char *addr, int len)
+{
+  int n, total = 0;
+
+  errnum = 0;
+
+  if (!ahead_buf)
+    ahead_buf = grub_malloc (UEFI_BUFLEN);
+
+  while (len > 0) {
+    if (filepos >= ahead_start && filepos < ahead_start + ahead_len) {
+      n = ahead_start + ahead_len - filepos;
+      if (n > len)
+	n = len;
+      grub_memmove (addr, ahead_buf + filepos - ahead_start, n);
+    } else if (len >= UEFI_BUFLEN || !ahead_buf) {
+      n = uefi_read_file (addr, len);
+      if (n <= 0)
+	break;
+    } else {
+      ahead_start = filepos;
+      ahead_len = 0;
+      n = uefi_read_file (ahead_buf, UEFI_BUFLEN);
+      if (n <= 0)
+	break;
+      ahead_len = n;
+      continue;
+    }
+
+    addr += n;
+    len -= n;
+    filepos += n;
+    total += n;
+  }
 
-  return 0;
+  return errnum ? 0 : total;
 }
 #endif
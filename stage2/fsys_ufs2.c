@@ -61,10 +61,6 @@
 
 #include "ufs2.h"
 
-/* used for filesystem map blocks */
-static int mapblock;
-static int mapblock_offset;
-static int mapblock_bsize;
 
 static int sblock_try[] = SBLOCKSEARCH;
 static ufs2_daddr_t sblockloc;
@@ -78,11 +74,24 @@ static int type;
 #define MAPBUF ( FSYS_BUF + 24576 )
 #define MAPBUF_LEN 8192
 
+/* The single indirect block of the current file is cached in
+   MAPBUF_SLOTS windows of MAPBUF_SLOT bytes each, in MAPBUF.  Slot I
+   holds the entries from MAPSLOT_START[I] on of the block at sector
+   MAPSLOT_BLOCK[I], or nothing if that is -1, and was used last at
+   MAPSLOT_USED[I].  */
+#define MAPBUF_SLOTS 4
+#define MAPBUF_SLOT (MAPBUF_LEN / MAPBUF_SLOTS)
+#define MAPSLOT_ENTRIES ((int) (MAPBUF_SLOT / sizeof (grub_int64_t)))
+static int mapslot_block[MAPBUF_SLOTS];
+static int mapslot_start[MAPBUF_SLOTS];
+static unsigned long mapslot_used[MAPBUF_SLOTS];
+static unsigned long mapslot_clock;
+
 int
 ufs2_mount (void)
 {
   int retval = 0;
-  int i;
+  int i, bits = get_sector_bits (current_drive);
 
   sblockloc = -1;
   type = 0;
@@ -92,14 +101,19 @@ ufs2_mount (void)
     {
       for (i = 0; sblock_try[i] != -1; ++i)
 	{
-	  if (! (part_length < (sblock_try[i] + (SBLOCKSIZE / DEV_BSIZE))
+	  if (! (part_length < ((sblock_try[i] + SBLOCKSIZE) >> bits)
 		 || ! devread (0, sblock_try[i], SBLOCKSIZE, (char *) SUPERBLOCK)))
 	    {
 	      if (SUPERBLOCK->fs_magic == FS_UFS2_MAGIC /* &&
 							   (SUPERBLOCK->fs_sblockloc == sblockloc ||
-						     (SUPERBLOCK->fs_old_flags & FS_FLAGS_UPDATED) == 0)*/)
+						     (SUPERBLOCK->fs_old_flags & FS_FLAGS_UPDATED) == 0)*/
+		  /* A block must be made of whole sectors.  */
+		  && SUPERBLOCK->fs_fsbtodb >= bits - 9)
 		{
 		  type = 2;
+		  /* FSBTODB counts DEV_BSIZE units, so make it count the
+		     sectors of the disk instead, once and for all.  */
+		  SUPERBLOCK->fs_fsbtodb -= bits - 9;
 		}
 	      else
 		{
@@ -113,94 +127,95 @@ ufs2_mount (void)
 	}
     }
   
-  mapblock = -1;
-  mapblock_offset = -1;
-  
+  for (i = 0; i < MAPBUF_SLOTS; i++)
+    {
+      mapslot_block[i] = -1;
+      mapslot_used[i] = 0;
+    }
+
   return retval;
 }
 
 static grub_int64_t
 block_map (int file_block)
 {
-  int bnum, offset, bsize;
+  int bnum, entry, slot, i, bsize;
   
   if (file_block < NDADDR)
     return (INODE_UFS2->di_db[file_block]);
   
-  /* If the blockmap loaded does not include FILE_BLOCK,
-     load a new blockmap.  */
+  bnum = fsbtodb (SUPERBLOCK, INODE_UFS2->di_ib[0]);
+  entry = (file_block - NDADDR) % NINDIR (SUPERBLOCK);
 
-  if ((bnum = fsbtodb (SUPERBLOCK, INODE_UFS2->di_ib[0])) != mapblock
-      || (mapblock_offset <= bnum && bnum <= mapblock_offset + mapblock_bsize))
+  /* Look for the window holding ENTRY, and if there is none, read it
+     into the slot used least lately.  */
+  slot = 0;
+  for (i = 0; i < MAPBUF_SLOTS; i++)
     {
-      if (MAPBUF_LEN < SUPERBLOCK->fs_bsize)
-	{
-	  offset = ((file_block - NDADDR) % NINDIR (SUPERBLOCK));
-	  bsize = MAPBUF_LEN;
-	  
-	  if (offset + MAPBUF_LEN > SUPERBLOCK->fs_bsize)
-	    offset = (SUPERBLOCK->fs_bsize - MAPBUF_LEN) / sizeof (int);
-	}
-      else
+      if (mapslot_block[i] == bnum
+	  && mapslot_start[i] <= entry
+	  && entry < mapslot_start[i] + MAPSLOT_ENTRIES)
 	{
-	  bsize = SUPERBLOCK->fs_bsize;
-	  offset = 0;
+	  slot = i;
+	  goto found;
 	}
-      
-      if (! devread (bnum, offset * sizeof (int), bsize, (char *) MAPBUF))
-	{
-	  mapblock = -1;
-	  mapblock_bsize = -1;
-	  mapblock_offset = -1;
-	  errnum = ERR_FSYS_CORRUPT;
-	  return -1;
-	}
-      
-      mapblock = bnum;
-      mapblock_bsize = bsize;
-      mapblock_offset = offset;
+
+      if (mapslot_used[i] < mapslot_used[slot])
+	slot = i;
     }
-  
-  return (((grub_int64_t *) MAPBUF)[((file_block - NDADDR) % NINDIR (SUPERBLOCK))
-				    - mapblock_offset]);
-}
 
-int
-ufs2_read (char *buf, int len)
-{
-  int logno, off, size, ret = 0;
-  grub_int64_t map;
+  mapslot_start[slot] = entry - entry % MAPSLOT_ENTRIES;
+  bsize = SUPERBLOCK->fs_bsize - mapslot_start[slot] * sizeof (grub_int64_t);
+  if (bsize > MAPBUF_SLOT)
+    bsize = MAPBUF_SLOT;
 
-  while (len && !errnum)
+  if (! devread (bnum, mapslot_start[slot] * sizeof (grub_int64_t), bsize,
+		 (char *) MAPBUF + slot * MAPBUF_SLOT))
     {
-      off = blkoff (SUPERBLOCK, filepos);
-      logno = lblkno (SUPERBLOCK, filepos);
-      size = blksize (SUPERBLOCK, INODE_UFS2, logno);
-
-      if ((map = block_map (logno)) < 0)
-	break; 
-
-      size -= off;
+      mapslot_block[slot] = -1;
+      errnum = ERR_FSYS_CORRUPT;
+      return -1;
+    }
 
-      if (size > len)
-	size = len;
+  mapslot_block[slot] = bnum;
 
-      disk_read_func = disk_read_hook;
+ found:
+  mapslot_used[slot] = ++mapslot_clock;
+  return (((grub_int64_t *) (MAPBUF + slot * MAPBUF_SLOT))
+	  [entry - mapslot_start[slot]]);
+}
 
-      devread (fsbtodb (SUPERBLOCK, map), off, size, buf);
+/* Maps the run from LOGNO on for fsys_read_extents.  */
+static int
+ufs2_extent_map (int logno, int *run)
+{
+  grub_int64_t map, next;
+  int n;
 
-      disk_read_func = NULL;
+  if ((map = block_map (logno)) < 0)
+    return -1;
 
-      buf += size;
-      len -= size;
-      filepos += size;
-      ret += size;
+  /* A hole is a run of its own.  */
+  if (! map)
+    {
+      *run = 1;
+      return 0;
     }
 
-  if (errnum)
-    ret = 0;
+  for (n = 1; n < *run; n++)
+    if ((next = block_map (logno + n)) < 0
+	|| next != map + blkstofrags (SUPERBLOCK, n))
+      break;
+
+  *run = n;
+  return fsbtodb (SUPERBLOCK, map);
+}
 
-  return ret;
+int
+ufs2_read (char *buf, int len)
+{
+  return fsys_read_extents (buf, len, SUPERBLOCK->fs_bshift,
+			    ufs2_extent_map);
 }
 
 int
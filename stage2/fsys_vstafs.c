@@ -49,6 +49,8 @@ vstafs_mount (void)
   
   if( (((current_drive & 0x80) || (current_slice != 0))
        && current_slice != PC_SLICE_TYPE_VSTAFS)
+      /* The file system counts 512-byte sectors.  */
+      ||  get_sector_size (current_drive) != BLOCK_SIZE
       ||  ! devread (0, 0, BLOCK_SIZE, (char *) FSYS_BUF)
       ||  FIRST_SECTOR->fs_magic != 0xDEADFACE)
     retval = 0;
@@ -56,6 +56,9 @@ struct xfs_info {
 	int blkoff;
 	int fpos;
 	xfs_ino_t rootino;
+#ifndef STAGE1_5
+	int xcount;
+#endif
 };
 
 static struct xfs_info xfs;
@@ -65,6 +68,18 @@ static struct xfs_info xfs;
 #define inode		((xfs_dinode_t *)((char *)FSYS_BUF + 8192))
 #define icore		(inode->di_core)
 
+#ifndef STAGE1_5
+/* The extents of the inode last read, decoded once and sorted by their
+   offset in the file, so that reading a file in many pieces need not
+   walk its block map from the start each time.  They are kept in
+   FSYS_BUF after the largest inode there can be.  XCOUNT is how many
+   there are, or one of these.  */
+#define xcache		((xad_t *)((char *)FSYS_BUF + 8192 + 2048))
+#define XCACHE_MAX	((int) ((FSYS_BUFLEN - 8192 - 2048) / sizeof (xad_t)))
+#define XCACHE_EMPTY	-1	/* not decoded yet */
+#define XCACHE_NONE	-2	/* too many to keep */
+#endif
+
 #define	mask32lo(n)	(((xfs_uint32_t)1 << (n)) - 1)
 
 #define	XFS_INO_MASK(k)		((xfs_uint32_t)((1ULL << (k)) - 1))
@@ -218,6 +233,9 @@ di_read (xfs_ino_t ino)
 	daddr = agb2daddr (agno, agbno);
 
 	devread (daddr, offset*xfs.isize, xfs.isize, (char *)inode);
+#ifndef STAGE1_5
+	xfs.xcount = XCACHE_EMPTY;
+#endif
 
 	xfs.ptr0 = *(xfs_bmbt_ptr_t *)
 		    (inode->di_u.di_c + sizeof(xfs_bmdr_block_t)
@@ -290,25 +308,281 @@ next_extent (void)
 	return &xad;
 }
 
+#ifndef STAGE1_5
+/* Decode the extents of the current inode into XCACHE, unless it is
+   done already, and return non-zero if they are there.  */
+static int
+xcache_fill (void)
+{
+	xad_t *xad;
+	int n = 0;
+
+	if (xfs.xcount != XCACHE_EMPTY)
+		return xfs.xcount >= 0;
+
+	init_extents ();
+	while ((xad = next_extent ())) {
+		if (n == XCACHE_MAX || errnum) {
+			xfs.xcount = XCACHE_NONE;
+			return 0;
+		}
+		xcache[n++] = *xad;
+	}
+
+	xfs.xcount = n;
+	return 1;
+}
+
+/* Return the index in XCACHE of the first extent that ends after the
+   file block BLOCK, or XFS.XCOUNT if there is none.  */
+static int
+xcache_find (xfs_fileoff_t block)
+{
+	int lo = 0, hi = xfs.xcount;
+
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+
+		if (xcache[mid].offset + xcache[mid].len <= block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+#endif /* ! STAGE1_5 */
+
+/* Return the file system block the file block BLOCK of the current
+   inode is in, or 0 if it is in a hole.  */
+static xfs_fsblock_t
+xfs_bmap (xfs_fileoff_t block)
+{
+	xad_t *xad;
+
+#ifndef STAGE1_5
+	if (xcache_fill ()) {
+		int i = xcache_find (block);
+
+		xad = xcache + i;
+		if (i < xfs.xcount && isinxt (block, xad->offset, xad->len))
+			return xad->start + block - xad->offset;
+		return 0;
+	}
+#endif
+
+	init_extents ();
+	while ((xad = next_extent ())) {
+		if (isinxt (block, xad->offset, xad->len))
+			return xad->start + block - xad->offset;
+	}
+	return 0;
+}
+
 /*
  * Name lies - the function reads only first 100 bytes
  */
 static void
 xfs_dabread (void)
 {
-	xad_t *xad;
-	xfs_fileoff_t offset;;
+	xfs_fsblock_t fsb = xfs_bmap (xfs.dablk);
 
-	init_extents ();
-	while ((xad = next_extent ())) {
-		offset = xad->offset;
-		if (isinxt (xfs.dablk, offset, xad->len)) {
-			devread (fsb2daddr (xad->start + xfs.dablk - offset),
-				 0, 100, dirbuf);
-			break;
+	if (fsb)
+		devread (fsb2daddr (fsb), 0, 100, dirbuf);
+}
+
+#ifndef STAGE1_5
+/* Read LEN bytes at the byte POS of the current directory into BUF, a
+   file system block at a time, as the leaf blocks are past what
+   FILEPOS can hold.  Return 0 if they are not all there.  */
+static int
+xfs_dir_read (xfs_uint64_t pos, int len, char *buf)
+{
+	xfs_fsblock_t fsb;
+	int off, n;
+
+	while (len > 0) {
+		off = pos & (xfs.bsize - 1);
+		n = (len < xfs.bsize - off) ? len : xfs.bsize - off;
+		fsb = xfs_bmap (pos >> xfs.blklog);
+		if (!fsb || !devread (fsb2daddr (fsb), off, n, buf))
+			return 0;
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static inline xfs_uint32_t
+rol32 (xfs_uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+/* The hash the leaf entries of NAME, of LEN bytes, are sorted by.  */
+static xfs_dahash_t
+xfs_da_hashname (const unsigned char *name, int len)
+{
+	xfs_dahash_t hash;
+
+	for (hash = 0; len >= 4; len -= 4, name += 4)
+		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7)
+		       ^ name[3] ^ rol32 (hash, 7 * 4);
+
+	switch (len) {
+	case 3:
+		return (name[0] << 14) ^ (name[1] << 7) ^ name[2]
+		       ^ rol32 (hash, 7 * 3);
+	case 2:
+		return (name[0] << 7) ^ name[1] ^ rol32 (hash, 7 * 2);
+	case 1:
+		return name[0] ^ rol32 (hash, 7 * 1);
+	}
+	return hash;
+}
+
+/* Return 1 with its inode in INO if the data entry at ADDRESS is NAME,
+   of LEN bytes, and 0 if it is not.  */
+static int
+xfs_dir_entry_is (xfs_dir2_dataptr_t address, const char *name, int len,
+		  xfs_ino_t *ino)
+{
+	xfs_uint64_t pos = (xfs_uint64_t) address << XFS_DIR2_DATA_ALIGN_LOG;
+	char buf[256];
+
+	if (!xfs_dir_read (pos, 9, buf) || (unsigned char) buf[8] != len
+	    || !xfs_dir_read (pos + 9, len, buf + 9)
+	    || grub_memcmp (buf + 9, name, len))
+		return 0;
+
+	*ino = le64 (*(xfs_ino_t *)buf);
+	return 1;
+}
+
+/* Look for NAME, of LEN bytes and hash HASH, among the COUNT leaf
+   entries at POS in the directory.  Return 1 with its inode in INO if
+   it is there, 0 if it is not, and -1 if the entries of HASH may go
+   on after the last.  */
+static int
+xfs_leaf_lookup (xfs_uint64_t pos, int count, xfs_dahash_t hash,
+		 const char *name, int len, xfs_ino_t *ino)
+{
+	xfs_dir2_leaf_entry_t ent;
+	int lo = 0, hi = count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+
+		if (!xfs_dir_read (pos + mid * sizeof(ent), sizeof(ent),
+				   (char *)&ent))
+			return 0;
+		if (le32 (ent.hashval) < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < count; lo++) {
+		if (!xfs_dir_read (pos + lo * sizeof(ent), sizeof(ent),
+				   (char *)&ent)
+		    || le32 (ent.hashval) != hash)
+			return 0;
+		if (ent.address != XFS_DIR2_NULL_DATAPTR
+		    && xfs_dir_entry_is (le32 (ent.address), name, len, ino))
+			return 1;
+	}
+	return -1;
+}
+
+/* Look NAME, of LEN bytes, up in the current directory by its hash:
+   in the leaf at the end of a single block directory, or in the leaf
+   blocks the node blocks lead to, so that only the entries of the
+   same hash are read.  Return 1 with its inode in INO if it is there,
+   0 if it is not, and -1 if the directory is not one of those.  */
+static int
+xfs_dir_lookup (const char *name, int len, xfs_ino_t *ino)
+{
+	xfs_dahash_t hash = xfs_da_hashname ((const unsigned char *)name, len);
+	union {
+		xfs_dir2_data_hdr_t data;
+		xfs_dir2_block_tail_t tail;
+		xfs_dir2_leaf_hdr_t leaf;
+		struct xfs_da_node_hdr node;
+	} b;
+	struct xfs_da_node_entry ent;
+	xfs_uint64_t pos;
+	int depth, ret, lo, hi, count;
+
+	if (icore.di_format != XFS_DINODE_FMT_EXTENTS
+	    && icore.di_format != XFS_DINODE_FMT_BTREE)
+		return -1;
+
+	if (!xfs_dir_read (0, sizeof(b.data), (char *)&b))
+		return -1;
+	if (b.data.magic == le32 (XFS_DIR2_BLOCK_MAGIC)) {
+		pos = xfs.dirbsize - sizeof(b.tail);
+		if (!xfs_dir_read (pos, sizeof(b.tail), (char *)&b))
+			return -1;
+		count = le32 (b.tail.count);
+		pos -= count * sizeof(xfs_dir2_leaf_entry_t);
+		ret = xfs_leaf_lookup (pos, count, hash, name, len, ino);
+		return ret > 0;
+	}
+
+	pos = XFS_DIR2_LEAF_OFFSET;
+	for (depth = 0; depth <= XFS_DA_NODE_MAXDEPTH; depth++) {
+		if (!xfs_dir_read (pos, sizeof(b.node), (char *)&b))
+			return -1;
+
+		if (b.leaf.info.magic == le16 (XFS_DIR2_LEAF1_MAGIC)
+		    || b.leaf.info.magic == le16 (XFS_DIR2_LEAFN_MAGIC)) {
+			/* The entries of a hash may go on in the next
+			   leaf.  */
+			for (;;) {
+				ret = xfs_leaf_lookup (pos + sizeof(b.leaf),
+						       le16 (b.leaf.count),
+						       hash, name, len, ino);
+				if (ret >= 0 || !b.leaf.info.forw)
+					return ret > 0;
+				pos = (xfs_uint64_t) le32 (b.leaf.info.forw)
+				      << xfs.blklog;
+				if (!xfs_dir_read (pos, sizeof(b.leaf),
+						   (char *)&b))
+					return 0;
+			}
+		}
+
+		if (b.node.info.magic != le16 (XFS_DA_NODE_MAGIC))
+			return -1;
+
+		/* Go down to the first child whose hashes reach HASH.  */
+		count = le16 (b.node.count);
+		if (!count)
+			return 0;
+		lo = 0;
+		hi = count - 1;
+		while (lo < hi) {
+			int mid = (lo + hi) >> 1;
+
+			if (!xfs_dir_read (pos + sizeof(b.node)
+					   + mid * sizeof(ent),
+					   sizeof(ent), (char *)&ent))
+				return 0;
+			if (le32 (ent.hashval) < hash)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
+		if (!xfs_dir_read (pos + sizeof(b.node) + lo * sizeof(ent),
+				   sizeof(ent), (char *)&ent))
+			return 0;
+		pos = (xfs_uint64_t) le32 (ent.before) << xfs.blklog;
 	}
+
+	return -1;
 }
+#endif /* ! STAGE1_5 */
 
 static inline xfs_ino_t
 sf_ino (char *sfe, int namelen)
@@ -478,6 +752,9 @@ xfs_mount (void)
 	xfs.inopblog = super.sb_inopblog;
 	xfs.agblklog = super.sb_agblklog;
 	xfs.agnolog = xfs_highbit32 (le32(super.sb_agcount));
+#ifndef STAGE1_5
+	xfs.xcount = XCACHE_EMPTY;
+#endif
 
 	xfs.btnode_ptr0_off =
 		((xfs.bsize - sizeof(xfs_btree_block_t)) /
@@ -487,6 +764,65 @@ xfs_mount (void)
 	return 1;
 }
 
+#ifndef STAGE1_5
+/* Read LEN bytes at FILEPOS into BUF like xfs_read, going straight to
+   the extent FILEPOS is in with XCACHE.  */
+static int
+xcache_read (char *buf, int len)
+{
+	xad_t *xad;
+	xfs_fileoff_t startofcur, endofcur;
+	int i, toread, startpos = filepos;
+
+	i = xcache_find (filepos >> xfs.blklog);
+	while (len > 0 && i < xfs.xcount && ! errnum) {
+		xad = xcache + i;
+		startofcur = xad->offset << xfs.blklog;
+		endofcur = (xad->offset + xad->len) << xfs.blklog;
+
+		if (filepos < startofcur) {
+			/* A hole reads as zeros.  */
+			toread = (startofcur - filepos < len)
+				  ? (int) (startofcur - filepos) : len;
+			grub_memset (buf, 0, toread);
+		} else {
+			toread = (endofcur - filepos < len)
+				  ? (int) (endofcur - filepos) : len;
+
+			disk_read_func = disk_read_hook;
+			devread (fsb2daddr (xad->start),
+				 filepos - startofcur, toread, buf);
+			disk_read_func = NULL;
+		}
+
+		buf += toread;
+		len -= toread;
+		filepos += toread;
+		if (filepos >= endofcur)
+			i++;
+	}
+
+	/* Let the disk fetch the rest of the extent the read ended in
+	   meanwhile, as the file is likely to be read on.  */
+	if (! len && ! errnum && i < xfs.xcount && filepos < filemax
+	    && readahead_possible ()) {
+		xad = xcache + i;
+		startofcur = xad->offset << xfs.blklog;
+		endofcur = (xad->offset + xad->len) << xfs.blklog;
+		if (filepos >= startofcur) {
+			toread = (endofcur - filepos < READAHEAD_LEN)
+				  ? (int) (endofcur - filepos) : READAHEAD_LEN;
+			if (toread > filemax - filepos)
+				toread = filemax - filepos;
+			devreadahead (fsb2daddr (xad->start),
+				      filepos - startofcur, toread);
+		}
+	}
+
+	return filepos - startpos;
+}
+#endif /* ! STAGE1_5 */
+
 int
 xfs_read (char *buf, int len)
 {
@@ -501,6 +837,11 @@ xfs_read (char *buf, int len)
 		return len;
 	}
 
+#ifndef STAGE1_5
+	if (xcache_fill ())
+		return xcache_read (buf, len);
+#endif
+
 	startpos = filepos;
 	endpos = filepos + len;
 	endofprev = (xfs_fileoff_t)-1;
@@ -521,6 +862,21 @@ xfs_read (char *buf, int len)
 			buf += toread;
 			len -= toread;
 			filepos += toread;
+#ifndef STAGE1_5
+			/* Let the disk fetch the rest of this extent
+			   meanwhile, as the file is likely to be read on.  */
+			if (! len && ! errnum && filepos < endofcur
+			    && filepos < filemax && readahead_possible ()) {
+				toread = endofcur - filepos;
+				if (toread > READAHEAD_LEN)
+					toread = READAHEAD_LEN;
+				if (toread > filemax - filepos)
+					toread = filemax - filepos;
+				devreadahead (fsb2daddr (xad->start),
+					      filepos - (offset << xfs.blklog),
+					      toread);
+			}
+#endif /* ! STAGE1_5 */
 		} else if (offset > endofprev) {
 			toread = ((offset << xfs.blklog) >= endpos)
 				  ? len : ((offset - endofprev) << xfs.blklog);
@@ -537,15 +893,43 @@ xfs_read (char *buf, int len)
 	return filepos - startpos;
 }
 
+/* Go through the entries of the current directory for DIRNAME, which
+   CH follows in the path, or list those it starts if it is being
+   completed.  Return 1 with its inode in INO if it is there.  */
+static int
+xfs_dir_scan (char *dirname, int ch, xfs_ino_t *ino)
+{
+	char *name;
+	int cmp;
+
+	for (name = first_dentry (ino); name; name = next_dentry (ino)) {
+		cmp = (!*dirname) ? -1 : substring (dirname, name);
+#ifndef STAGE1_5
+		if (print_possibilities && ch != '/' && cmp <= 0) {
+			if (print_possibilities > 0)
+				print_possibilities = -print_possibilities;
+			print_a_completion (name);
+		} else
+#endif
+		if (cmp == 0)
+			return 1;
+	}
+	return 0;
+}
+
 int
 xfs_dir (char *dirname)
 {
 	xfs_ino_t ino, parent_ino, new_ino;
 	xfs_fsize_t di_size;
 	int di_mode;
-	int cmp, n, link_count;
+	int found, n, link_count;
 	char linkbuf[xfs.bsize];
-	char *rest, *name, ch;
+	char *rest, ch;
+#ifndef STAGE1_5
+	unsigned long dcache[DENTRY_DATA_LEN];
+	int use_dcache;
+#endif
 
 	parent_ino = ino = xfs.rootino;
 	link_count = 0;
@@ -595,33 +979,63 @@ xfs_dir (char *dirname)
 		for (rest = dirname; (ch = *rest) && !isspace (ch) && ch != '/'; rest++);
 		*rest = 0;
 
-		name = first_dentry (&new_ino);
-		for (;;) {
-			cmp = (!*dirname) ? -1 : substring (dirname, name);
 #ifndef STAGE1_5
-			if (print_possibilities && ch != '/' && cmp <= 0) {
-				if (print_possibilities > 0)
-					print_possibilities = -print_possibilities;
-				print_a_completion (name);
-			} else
-#endif
-			if (cmp == 0) {
+		/* only inode numbers that fit are cached */
+		use_dcache = (!(print_possibilities && ch != '/')
+			      && (unsigned long) ino == ino);
+		if (use_dcache) {
+			switch (dentry_cache_lookup (ino, dirname, dcache)) {
+			case 1:
 				parent_ino = ino;
-				if (new_ino)
-					ino = new_ino;
-		        	*(dirname = rest) = ch;
-				break;
-			}
-			name = next_dentry (&new_ino);
-			if (name == NULL) {
-				if (print_possibilities < 0)
-					return 1;
-
+				ino = dcache[0] | ((xfs_ino_t) dcache[1] << 16 << 16);
+				*(dirname = rest) = ch;
+				continue;
+			case -1:
 				errnum = ERR_FILE_NOT_FOUND;
 				*rest = ch;
 				return 0;
 			}
 		}
+#endif
+
+#ifndef STAGE1_5
+		found = -1;
+		if (!(print_possibilities && ch != '/') && *dirname)
+			found = xfs_dir_lookup (dirname, rest - dirname,
+						&new_ino);
+		if (errnum) {
+			*rest = ch;
+			return 0;
+		}
+		if (found < 0)
+#endif
+		found = xfs_dir_scan (dirname, ch, &new_ino);
+
+		if (found) {
+			parent_ino = ino;
+			if (new_ino)
+				ino = new_ino;
+#ifndef STAGE1_5
+			if (use_dcache) {
+				dcache[0] = ino;
+				dcache[1] = ino >> 16 >> 16;
+				dentry_cache_add (parent_ino, dirname, dcache);
+			}
+#endif
+			*(dirname = rest) = ch;
+			continue;
+		}
+
+		if (print_possibilities < 0)
+			return 1;
+
+		errnum = ERR_FILE_NOT_FOUND;
+#ifndef STAGE1_5
+		if (use_dcache)
+			dentry_cache_add (ino, dirname, 0);
+#endif
+		*rest = ch;
+		return 0;
 	}
 }
 
@@ -36,11 +36,18 @@ unsigned char *font8x16;
 int graphics_inited = 0;
 static char splashimage[64];
 
+/* the four planes of the image, which do not fit below the protected
+ * mode stack with the rest of Stage 2.  They are taken off the top of
+ * the upper memory, as a memory disk is, the first time an image is
+ * read, so that what is loaded there later keeps below them. */
+#define VSHADOW_SIZE (4 * 38400)
+static unsigned char *vshadow;
+
 #define VSHADOW VSHADOW1
-unsigned char VSHADOW1[38400];
-unsigned char VSHADOW2[38400];
-unsigned char VSHADOW4[38400];
-unsigned char VSHADOW8[38400];
+#define VSHADOW1 (vshadow)
+#define VSHADOW2 (vshadow + 38400)
+#define VSHADOW4 (vshadow + 2 * 38400)
+#define VSHADOW8 (vshadow + 3 * 38400)
 
 /* constants to define the viewable area */
 const int x0 = 0;
@@ -52,6 +59,13 @@ const int y1 = 30;
  * scroll and the like */
 unsigned short text[80 * 30];
 
+/* what each cell on the screen shows, as in text, or CELL_UNKNOWN if it
+ * has to be drawn again because the cursor is over it or the mode has
+ * just been set.  The video memory is slow, so only the cells which
+ * differ from text are written to it. */
+#define CELL_UNKNOWN 0xffff
+static unsigned short shown[80 * 30];
+
 /* why do these have to be kept here? */
 int foreground = (63 << 16) | (63 << 8) | (63), background = 0, border = 0;
 
@@ -59,9 +73,6 @@ int foreground = (63 << 16) | (63 << 8) | (63), background = 0, border = 0;
 static int fontx = 0;
 static int fonty = 0;
 
-/* global state so that we don't try to recursively scroll or cursor */
-static int no_scroll = 0;
-
 /* color state */
 static int graphics_standard_color = A_NORMAL;
 static int graphics_normal_color = A_NORMAL;
@@ -73,6 +84,7 @@ static color_state graphics_color_state = COLOR_STATE_STANDARD;
 /* graphics local functions */
 static void graphics_setxy(int col, int row);
 static void graphics_scroll(void);
+static void graphics_draw_cell(int col, int row);
 
 /* FIXME: where do these really belong? */
 static inline void outb(unsigned short port, unsigned char val)
@@ -108,12 +120,18 @@ char *graphics_get_splash(void) {
  * mode.  */
 int graphics_init()
 {
+    int i;
+
     if (!read_image(splashimage)) {
 	current_term = term_table;
         grub_printf("failed to read image\n");
         return 0;
     }
 
+    /* setting the mode has cleared the screen */
+    for (i = 0; i < 80 * 30; i++)
+        shown[i] = CELL_UNKNOWN;
+
     font8x16 = (unsigned char*)graphics_get_font();
 
     graphics_inited = 1;
@@ -188,43 +206,64 @@ void graphics_gotoxy(int x, int y) {
     graphics_cursor(1);
 }
 
-void graphics_cls(void) {
+/* whether any cell of row shows something but the image */
+static int graphics_row_dirty(int row) {
     int i;
-    unsigned char *mem, *s1, *s2, *s4, *s8;
+
+    for (i = 0; i < 80; i++)
+        if (shown[row * 80 + i] != ' ')
+            return 1;
+    return 0;
+}
+
+/* A blank cell is the image alone, so only the rows which show
+ * anything else are copied from the shadow planes, each run of them
+ * with a single copy per plane. */
+void graphics_cls(void) {
+    int i, start, end;
+    unsigned char *mem;
 
     graphics_cursor(0);
     graphics_gotoxy(x0, y0);
 
-    mem = (unsigned char*)VIDEOMEM;
-    s1 = (unsigned char*)VSHADOW1;
-    s2 = (unsigned char*)VSHADOW2;
-    s4 = (unsigned char*)VSHADOW4;
-    s8 = (unsigned char*)VSHADOW8;
-
     for (i = 0; i < 80 * 30; i++)
         text[i] = ' ';
     graphics_cursor(1);
 
     BitMask(0xff);
 
-    /* plano 1 */
-    MapMask(1);
-    grub_memcpy(mem, s1, 38400);
+    for (start = 0; start < 30; start = end) {
+        if (!graphics_row_dirty(start)) {
+            end = start + 1;
+            continue;
+        }
+        for (end = start + 1; end < 30 && graphics_row_dirty(end); end++)
+            ;
+
+        i = start * 16 * 80;
+        mem = (unsigned char*)VIDEOMEM + i;
 
-    /* plano 2 */
-    MapMask(2);
-    grub_memcpy(mem, s2, 38400);
+        /* plano 1 */
+        MapMask(1);
+        grub_memcpy(mem, VSHADOW1 + i, (end - start) * 16 * 80);
 
-    /* plano 3 */
-    MapMask(4);
-    grub_memcpy(mem, s4, 38400);
+        /* plano 2 */
+        MapMask(2);
+        grub_memcpy(mem, VSHADOW2 + i, (end - start) * 16 * 80);
 
-    /* plano 4 */
-    MapMask(8);
-    grub_memcpy(mem, s8, 38400);
+        /* plano 3 */
+        MapMask(4);
+        grub_memcpy(mem, VSHADOW4 + i, (end - start) * 16 * 80);
+
+        /* plano 4 */
+        MapMask(8);
+        grub_memcpy(mem, VSHADOW8 + i, (end - start) * 16 * 80);
+
+        for (i = start * 80; i < end * 80; i++)
+            shown[i] = ' ';
+    }
 
     MapMask(15);
- 
 }
 
 void graphics_setcolorstate (color_state state) {
@@ -272,7 +311,7 @@ static int xpm_open(char *s) {
     prev='\n';
     buf=0;
     do {
-        if (grub_read(&buf, 1) != 1) {
+        if (!grub_read_byte(&buf)) {
             grub_close();
             return 0;
         }
@@ -287,6 +326,31 @@ static int xpm_open(char *s) {
     return 1;
 }
 
+/* Find a place for the planes of the image, if they have none yet. */
+static int vshadow_alloc(void)
+{
+#ifdef GRUB_UTIL
+    static unsigned char buf[VSHADOW_SIZE];
+
+    vshadow = buf;
+#else
+    unsigned long top = (mbi.mem_upper << 10) + 0x100000;
+
+    if (vshadow)
+        return 1;
+
+    if (mbi.mem_upper < (VSHADOW_SIZE >> 10) + 0x1000) {
+        errnum = ERR_WONT_FIT;
+        return 0;
+    }
+
+    top = (top - VSHADOW_SIZE) & ~0xfffUL;
+    mbi.mem_upper = saved_mem_upper = (top - 0x100000) >> 10;
+    vshadow = (unsigned char *) RAW_ADDR (top);
+#endif
+    return 1;
+}
+
 /* Read in the splashscreen image and set the palette up appropriately.
  * Format of splashscreen is an xpm (can be gzipped) with 16 colors and
  * 640x480. */
@@ -296,43 +360,43 @@ int read_image(char *s)
     unsigned char c, base, mask, *s1, *s2, *s4, *s8;
     unsigned i, len, idx, colors, x, y, width, height;
 
-    if (!xpm_open(s))
+    if (!vshadow_alloc() || !xpm_open(s))
         return 0;
 
     saved_videomode = set_videomode(0x12);
 
     /* parse info */
-    while (grub_read(&c, 1)) {
+    while (grub_read_byte((char *) &c)) {
         if (c == '"')
             break;
     }
 
-    while (grub_read(&c, 1) && (c == ' ' || c == '\t'))
+    while (grub_read_byte((char *) &c) && (c == ' ' || c == '\t'))
         ;
 
     i = 0;
     width = c - '0';
-    while (grub_read(&c, 1)) {
+    while (grub_read_byte((char *) &c)) {
         if (c >= '0' && c <= '9')
             width = width * 10 + c - '0';
         else
             break;
     }
-    while (grub_read(&c, 1) && (c == ' ' || c == '\t'))
+    while (grub_read_byte((char *) &c) && (c == ' ' || c == '\t'))
         ;
 
     height = c - '0';
-    while (grub_read(&c, 1)) {
+    while (grub_read_byte((char *) &c)) {
         if (c >= '0' && c <= '9')
             height = height * 10 + c - '0';
         else
             break;
     }
-    while (grub_read(&c, 1) && (c == ' ' || c == '\t'))
+    while (grub_read_byte((char *) &c) && (c == ' ' || c == '\t'))
         ;
 
     colors = c - '0';
-    while (grub_read(&c, 1)) {
+    while (grub_read_byte((char *) &c)) {
         if (c >= '0' && c <= '9')
             colors = colors * 10 + c - '0';
         else
@@ -340,20 +404,22 @@ int read_image(char *s)
     }
 
     base = 0;
-    while (grub_read(&c, 1) && c != '"')
+    while (grub_read_byte((char *) &c) && c != '"')
         ;
 
     /* palette */
     for (i = 0, idx = 1; i < colors; i++) {
         len = 0;
 
-        while (grub_read(&c, 1) && c != '"')
+        while (grub_read_byte((char *) &c) && c != '"')
             ;
-        grub_read(&c, 1);       /* char */
+        grub_read_byte((char *) &c);       /* char */
         base = c;
-        grub_read(buf, 4);      /* \t c # */
+        for (len = 0; len < 4; len++)  /* \t c # */
+            grub_read_byte(&buf[len]);
+        len = 0;
 
-        while (grub_read(&c, 1) && c != '"') {
+        while (grub_read_byte((char *) &c) && c != '"') {
             if (len < sizeof(buf))
                 buf[len++] = c;
         }
@@ -382,7 +448,7 @@ int read_image(char *s)
     /* parse xpm data */
     while (y < height) {
         while (1) {
-            if (!grub_read(&c, 1)) {
+            if (!grub_read_byte((char *) &c)) {
                 grub_close();
                 return 0;
             }
@@ -390,7 +456,7 @@ int read_image(char *s)
                 break;
         }
 
-        while (grub_read(&c, 1) && c != '"') {
+        while (grub_read_byte((char *) &c) && c != '"') {
             for (i = 1; i < 15; i++)
                 if (pal[i] == c) {
                     c = i;
@@ -453,108 +519,95 @@ static void graphics_setxy(int col, int row) {
     }
 }
 
-/* scroll the screen */
+/* scroll the screen.  The image doesn't move with the text, so the
+ * video memory can't simply be copied up a line; the cells are drawn
+ * again, but only those which now show something else. */
 static void graphics_scroll(void) {
     int i, j;
 
-    /* we don't want to scroll recursively... that would be bad */
-    if (no_scroll)
-        return;
-    no_scroll = 1;
-
     /* move everything up a line */
-    for (j = y0 + 1; j < y1; j++) {
-        graphics_gotoxy(x0, j - 1);
-        for (i = x0; i < x1; i++) {
-            graphics_putchar(text[j * 80 + i]);
-        }
-    }
+    for (j = y0 + 1; j < y1; j++)
+        for (i = x0; i < x1; i++)
+            text[(j - 1) * 80 + i] = text[j * 80 + i];
 
     /* last line should be blank */
-    graphics_gotoxy(x0, y1 - 1);
     for (i = x0; i < x1; i++)
-        graphics_putchar(' ');
-    graphics_setxy(x0, y1 - 1);
+        text[(y1 - 1) * 80 + i] = ' ';
 
-    no_scroll = 0;
+    for (j = y0; j < y1; j++)
+        for (i = x0; i < x1; i++)
+            graphics_draw_cell(i, j);
+
+    graphics_setxy(x0, y1 - 1);
 }
 
 
-void graphics_cursor(int set) {
+/* draw the cell at col, row as text has it, unless it shows that already */
+static void graphics_draw_cell(int col, int row) {
     unsigned char *pat, *mem, *ptr, chr[16 << 2];
     int i, ch, invert, offset;
 
-    if (set && no_scroll)
+    if (shown[row * 80 + col] == text[row * 80 + col])
         return;
+    shown[row * 80 + col] = text[row * 80 + col];
 
-    offset = cursorY * 80 + fontx;
-    ch = text[fonty * 80 + fontx] & 0xff;
-    invert = (text[fonty * 80 + fontx] & 0xff00) != 0;
+    offset = (row << 4) * 80 + col;
+    ch = text[row * 80 + col] & 0xff;
+    invert = (text[row * 80 + col] & 0xff00) != 0;
     pat = font8x16 + (ch << 4);
 
     mem = (unsigned char*)VIDEOMEM + offset;
 
-    if (!set) {
-        for (i = 0; i < 16; i++) {
-            unsigned char mask = pat[i];
-
-            if (!invert) {
-                chr[i     ] = ((unsigned char*)VSHADOW1)[offset];
-                chr[16 + i] = ((unsigned char*)VSHADOW2)[offset];
-                chr[32 + i] = ((unsigned char*)VSHADOW4)[offset];
-                chr[48 + i] = ((unsigned char*)VSHADOW8)[offset];
+    for (i = 0; i < 16; i++) {
+        unsigned char mask = pat[i];
+
+        if (!invert) {
+            chr[i     ] = ((unsigned char*)VSHADOW1)[offset];
+            chr[16 + i] = ((unsigned char*)VSHADOW2)[offset];
+            chr[32 + i] = ((unsigned char*)VSHADOW4)[offset];
+            chr[48 + i] = ((unsigned char*)VSHADOW8)[offset];
+
+            /* FIXME: if (shade) */
+            if (1) {
+                if (ch == DISP_VERT || ch == DISP_LL ||
+                    ch == DISP_UR || ch == DISP_LR) {
+                    unsigned char pmask = ~(pat[i] >> 1);
+
+                    chr[i     ] &= pmask;
+                    chr[16 + i] &= pmask;
+                    chr[32 + i] &= pmask;
+                    chr[48 + i] &= pmask;
+                }
+                if (i > 0 && ch != DISP_VERT) {
+                    unsigned char pmask = ~(pat[i - 1] >> 1);
 
-                /* FIXME: if (shade) */
-                if (1) {
-                    if (ch == DISP_VERT || ch == DISP_LL ||
-                        ch == DISP_UR || ch == DISP_LR) {
-                        unsigned char pmask = ~(pat[i] >> 1);
+                    chr[i     ] &= pmask;
+                    chr[16 + i] &= pmask;
+                    chr[32 + i] &= pmask;
+                    chr[48 + i] &= pmask;
+                    if (ch == DISP_HORIZ || ch == DISP_UR || ch == DISP_LR) {
+                        pmask = ~pat[i - 1];
 
                         chr[i     ] &= pmask;
                         chr[16 + i] &= pmask;
                         chr[32 + i] &= pmask;
                         chr[48 + i] &= pmask;
                     }
-                    if (i > 0 && ch != DISP_VERT) {
-                        unsigned char pmask = ~(pat[i - 1] >> 1);
-
-                        chr[i     ] &= pmask;
-                        chr[16 + i] &= pmask;
-                        chr[32 + i] &= pmask;
-                        chr[48 + i] &= pmask;
-                        if (ch == DISP_HORIZ || ch == DISP_UR || ch == DISP_LR) {
-                            pmask = ~pat[i - 1];
-
-                            chr[i     ] &= pmask;
-                            chr[16 + i] &= pmask;
-                            chr[32 + i] &= pmask;
-                            chr[48 + i] &= pmask;
-                        }
-                    }
                 }
-                chr[i     ] |= mask;
-                chr[16 + i] |= mask;
-                chr[32 + i] |= mask;
-                chr[48 + i] |= mask;
-
-                offset += 80;
-            }
-            else {
-                chr[i     ] = ~mask;
-                chr[16 + i] = ~mask;
-                chr[32 + i] = ~mask;
-                chr[48 + i] = ~mask;
             }
+            chr[i     ] |= mask;
+            chr[16 + i] |= mask;
+            chr[32 + i] |= mask;
+            chr[48 + i] |= mask;
+
+            offset += 80;
         }
-    }
-    else {
-        MapMask(15);
-        ptr = mem;
-        for (i = 0; i < 16; i++, ptr += 80) {
-            cursorBuf[i] = pat[i];
-            *ptr = ~pat[i];
+        else {
+            chr[i     ] = ~mask;
+            chr[16 + i] = ~mask;
+            chr[32 + i] = ~mask;
+            chr[48 + i] = ~mask;
         }
-        return;
     }
 
     offset = 0;
@@ -570,4 +623,24 @@ void graphics_cursor(int set) {
     MapMask(15);
 }
 
+void graphics_cursor(int set) {
+    unsigned char *pat, *ptr;
+    int i;
+
+    if (!set) {
+        graphics_draw_cell(fontx, fonty);
+        return;
+    }
+
+    pat = font8x16 + ((text[fonty * 80 + fontx] & 0xff) << 4);
+
+    MapMask(15);
+    ptr = (unsigned char*)VIDEOMEM + cursorY * 80 + fontx;
+    for (i = 0; i < 16; i++, ptr += 80) {
+        cursorBuf[i] = pat[i];
+        *ptr = ~pat[i];
+    }
+    shown[fonty * 80 + fontx] = CELL_UNKNOWN;
+}
+
 #endif /* SUPPORT_GRAPHICS */
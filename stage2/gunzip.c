@@ -132,7 +132,12 @@
 /* so we can disable decompression  */
 int no_decompression = 0;
 
-/* used to tell if "read" should be redirected to "gunzip_read" */
+/* whether to check the CRC in the trailer of gzip files, which costs
+   a little time; see the "crccheck" command */
+int gzip_check_crc = 0;
+
+/* used to tell if "read" should be redirected to "gunzip_read",
+   "unxz_read" or "unzstd_read", see COMPRESSED_GZIP and friends */
 int compressed_file;
 
 /* internal variables only */
@@ -141,17 +146,82 @@ static int gzip_filepos;
 static int gzip_filemax;
 static int gzip_fsmax;
 static int saved_filepos;
-static unsigned int gzip_crc;
+static int check_crc;		/* gzip_check_crc when the file was opened */
+static unsigned int crc;	/* CRC of the member inflated so far */
+static unsigned crc_from;	/* where in the window it goes on from */
+static unsigned window_start;	/* where the next window is inflated from */
+
+/*
+ *  Members.
+ *
+ *  A gzip file may be several gzip files one after the other, as cat
+ *  or some compressors make them, which decompress to what they hold
+ *  one after the other.  Each member starts afresh, with nothing
+ *  before it to refer back to, so where one starts, inflating can
+ *  start too without any window saved.  They are kept for gunzip_read
+ *  to seek to, and on EFI, for gunzip_parallel to inflate several at
+ *  once.
+ *
+ *  Only the size of the last member is in the trailer at the end, and
+ *  the size has to be known when the file is opened, since a loader
+ *  reads up to it.  Where each member has its size in its header, as
+ *  in BGZF, the members are walked from one to the next for it;
+ *  otherwise the whole file is inflated to find them.  What was found
+ *  is kept for a few files, which loaders open more than once.
+ */
+#ifdef PLATFORM_EFI
+# define GZ_MEMBERS		2048
+# define GZ_FOUND		2
+#else
+# define GZ_MEMBERS		64
+# define GZ_FOUND		1
+#endif
 
-/* internal extra variables for use of inflate code */
-static int block_type;
-static int block_len;
-static int last_block;
-static int code_state;
+struct gz_member
+{
+  int in_pos;			/* compressed position of the deflate data */
+  int out_pos;			/* and uncompressed position */
+};
+
+static struct gz_member members[GZ_MEMBERS];
+static int num_members;
+static int cur_member;		/* the member being inflated */
+static int member_start;		/* where it starts, uncompressed */
+static int members_done;	/* whether the last one has been inflated */
+static int finding_members;	/* whether find_members is at work */
+
+/* the size and members found of a file opened lately */
+struct gz_found
+{
+  unsigned long drive;
+  unsigned long partition;
+  unsigned long generation;
+  int csize;			/* compressed size, zero if unused */
+  unsigned char head[10];	/* the first bytes of the file */
+  unsigned char tail[8];	/* and the last */
+  int size;
+  int num_members;
+  struct gz_member members[GZ_MEMBERS];
+};
+
+static struct gz_found gz_found[GZ_FOUND];
+static int gz_found_next;
+
+/* checkpoints taken so far in the current file, and how far apart */
+#define GZ_CHECKPOINTS		8
+#define CHECKPOINT_INTERVAL	0x100000
+static int num_checkpoints;
+static int checkpoint_interval;
 
 
 /* Function prototypes */
 static void initialize_tables (void);
+static int find_members (void);
+static int gz_find_size (unsigned char *head, unsigned char *tail);
+static void reserve_checkpoints (void);
+static void reserve_inbuf (void);
+static void reserve_crc_table (void);
+static void make_crc_table (void);
 
 /*
  *  Linear allocator.
@@ -177,6 +247,9 @@ reset_linalloc (void)
 #else
   linalloc_topaddr = RAW_ADDR ((mbi.mem_upper << 10) + 0x100000);
 #endif
+  reserve_checkpoints ();
+  reserve_inbuf ();
+  reserve_crc_table ();
 }
 
 
@@ -262,6 +335,15 @@ typedef unsigned char uch;
 typedef unsigned short ush;
 typedef unsigned int ulg;
 
+/* The bit buffer is as wide as a register can hold.  Where that is
+   wider than ulg -- the grub shell on a 64-bit host, and x86_64 EFI --
+   NEEDBITS then refills it half as often.  */
+#if defined(GRUB_UTIL) || (defined(PLATFORM_EFI) && defined(__x86_64__))
+typedef unsigned long bitbuf_t;
+#else
+typedef ulg bitbuf_t;
+#endif
+
 /*
  *  Window Size
  *
@@ -274,7 +356,7 @@ typedef unsigned int ulg;
 int
 gunzip_test_header (void)
 {
-  unsigned char buf[10];
+  unsigned char buf[10], head[10];
   
   /* "compressed_file" is already reset to zero by this point */
 
@@ -284,19 +366,24 @@ gunzip_test_header (void)
    *  is a compressed file, and simply mark it as such.
    */
   if (no_decompression
-      || grub_read (buf, 10) != 10
-      || ((*((unsigned short *) buf) != GZIP_HDR_LE)
-	  && (*((unsigned short *) buf) != OLD_GZIP_HDR_LE)))
+      || grub_read (buf, 10) != 10)
     {
       filepos = 0;
       return ! errnum;
     }
 
+  /* if it is not gzipped, it may still be xz or zstd compressed */
+  if ((*((unsigned short *) buf) != GZIP_HDR_LE)
+      && (*((unsigned short *) buf) != OLD_GZIP_HDR_LE))
+    return (unxz_test_header (buf)
+	    && (compressed_file || unzstd_test_header (buf)));
+
   /*
    *  This does consistency checking on the header data.  If a
    *  problem occurs from here on, then we have corrupt or otherwise
    *  bad data, and the error should be reported to the user.
    */
+  grub_memmove ((char *) head, (char *) buf, 10);
   if (buf[2] != DEFLATED
       || (buf[3] & UNSUPP_FLAGS)
       || ((buf[3] & EXTRA_FIELD)
@@ -323,12 +410,18 @@ gunzip_test_header (void)
       return 0;
     }
 
-  gzip_crc = *((unsigned int *) buf);
-  gzip_fsmax = gzip_filemax = *((unsigned int *) (buf + 4));
-
+  num_checkpoints = 0;
+  checkpoint_interval = CHECKPOINT_INTERVAL;
   initialize_tables ();
 
-  compressed_file = 1;
+  check_crc = gzip_check_crc;
+  if (check_crc)
+    make_crc_table ();
+
+  if (! gz_find_size (head, buf))
+    return 0;
+
+  compressed_file = COMPRESSED_GZIP;
   gunzip_swap_values ();
   /*
    *  Now "gzip_*" values refer to the compressed data.
@@ -373,8 +466,60 @@ struct huft
 /* sliding window in uncompressed data */
 static uch slide[WSIZE];
 
-/* current position in slide */
-static unsigned wp;
+/* Everything that inflating a member changes.  The serial decoder,
+   which gunzip_read goes on with from one read to the next, is
+   serial_dec; on EFI, each processor that helps gunzip_parallel has
+   one of its own.  */
+struct gz_dec
+{
+  /* the bit buffer, and the input it is filled from */
+  bitbuf_t bb;			/* bit buffer */
+  unsigned bk;			/* bits in bit buffer */
+  uch *inbuf;
+  int bufloc;
+  int buflen;
+
+  /* The window being inflated into, and the one before it.  For the
+     serial decoder both are slide, except while gunzip_read inflates
+     whole windows straight into the caller's buffer; then the one
+     before is where back references that reach past the start of the
+     current one are found.  */
+  uch *window;
+  uch *prev_window;
+  unsigned wp;			/* current position in window */
+
+  /* the block being inflated */
+  int block_type;
+  int block_len;
+  int last_block;
+  int code_state;
+  unsigned inflate_n, inflate_d;
+  struct huft *tl;		/* literal/length code table */
+  struct huft *td;		/* distance code table */
+  int bl;			/* lookup bits for tl */
+  int bd;			/* lookup bits for td */
+
+  /* The code lengths of the current dynamic block, kept so that its
+     decoding tables can be built again when resuming at a checkpoint. */
+  uch dyn_lengths[286 + 30];
+  unsigned dyn_nl, dyn_nd;
+
+  /* Where its tables are taken from, while they are not taken from
+     the linear allocator; huft_mem is that memory, if it has any of
+     its own.  */
+  struct huft *huft_arena;
+  unsigned huft_arena_left;
+  struct huft *huft_mem;
+
+  uch *part_window;		/* for the end of a member, see gz_run_job */
+};
+
+static struct gz_dec serial_dec =
+{
+  .window = slide,
+  .prev_window = slide
+};
+static struct gz_dec *gz = &serial_dec;
 
 
 /* Tables for deflate from PKZIP's appnote.txt. */
@@ -444,7 +589,49 @@ static int dbits = 6;		/* bits in base distance lookup table */
 #define N_MAX 288		/* maximum number of codes in any set */
 
 
-static unsigned hufts;		/* track memory usage */
+/* The tables of the fixed codes are the same for every block, so they
+   are built once, into FIXED_HUFTS, which they fill exactly.  While
+   the huft_arena of a decoder is set, huft_build takes its tables from
+   there instead of from the linear allocator, which is reset after
+   each block.  A decoder with memory of its own, HUFT_MEM entries,
+   goes back to the start of that instead.  The tables of a dynamic
+   block, whose first levels have at most 9 and 6 bits, take less than
+   half of it.  */
+#define FIXED_HUFTS	(625 + 33)
+#define HUFT_MEM	0x1000
+
+static struct huft fixed_hufts[FIXED_HUFTS];
+
+static struct huft *
+huft_alloc (struct gz_dec *dec, unsigned n)
+{
+  struct huft *q;
+
+  if (! dec->huft_arena)
+    return (struct huft *) linalloc (n * sizeof (struct huft));
+
+  if (n > dec->huft_arena_left)
+    return (struct huft *) NULL;
+
+  q = dec->huft_arena;
+  dec->huft_arena += n;
+  dec->huft_arena_left -= n;
+  return q;
+}
+
+/* Free the tables of the block DEC has just inflated.  */
+static void
+free_hufts (struct gz_dec *dec)
+{
+  if (! dec->huft_mem)
+    {
+      reset_linalloc ();
+      return;
+    }
+
+  dec->huft_arena = dec->huft_mem;
+  dec->huft_arena_left = HUFT_MEM;
+}
 
 
 /* Macros for inflate() bit peeking and grabbing.
@@ -460,26 +647,20 @@ static unsigned hufts;		/* track memory usage */
    variables for speed, and are initialized at the beginning of a
    routine that uses these macros from a global bit buffer and count.
 
-   If we assume that EOB will be the longest code, then we will never
-   ask for bits with NEEDBITS that are beyond the end of the stream.
-   So, NEEDBITS should not read any more bytes than are needed to
-   meet the request.  Then no bytes need to be "returned" to the buffer
-   at the end of the last block.
-
-   However, this assumption is not true for fixed blocks--the EOB code
-   is 7 bits, but the other literal/length codes can be 8 or 9 bits.
-   (The EOB code is shorter than other codes because fixed blocks are
-   generally short.  So, while a block always has an EOB, many other
-   literal/length codes have a significantly lower probability of
-   showing up at all.)  However, by making the first table have a
-   lookup of seven bits, the EOB code will be found in that first
-   lookup, and so will not require that too many bits be pulled from
-   the stream.
+   When NEEDBITS has to read, it fills b as far as whole bytes go
+   rather than just to j bits, so that most codes are decoded without
+   touching the input at all.  This means b may hold up to seven bytes
+   beyond the end of the last block.  That is harmless: they come out
+   of the eight-byte gzip trailer, which nothing else reads through
+   this buffer, and they are thrown away when decompression restarts.
+   Only a stored block has to take its first bytes back out of b.
+
+   While the input buffer holds a whole bit buffer's worth, the bytes
+   are taken straight out of it, without get_byte checking each one.
+   They are still shifted in one at a time, so the byte order of the
+   host does not matter.  The input is that of the decoder DEC.
  */
 
-static ulg bb;			/* bit buffer */
-static unsigned bk;		/* bits in bit buffer */
-
 static ush mask_bits[] =
 {
   0x0000,
@@ -487,37 +668,93 @@ static ush mask_bits[] =
   0x01ff, 0x03ff, 0x07ff, 0x0fff, 0x1fff, 0x3fff, 0x7fff, 0xffff
 };
 
-#define NEEDBITS(n) do {while(k<(n)){b|=((ulg)get_byte())<<k;k+=8;}} while (0)
+#define BITBUF_FILL (8 * sizeof (bitbuf_t) - 8)
+#define NEEDBITS(n) \
+  do \
+    { \
+      if (k < (n)) \
+	{ \
+	  if (dec->bufloc + (int) sizeof (bitbuf_t) <= dec->buflen) \
+	    do \
+	      { \
+		b |= ((bitbuf_t) dec->inbuf[dec->bufloc++]) << k; \
+		k += 8; \
+	      } \
+	    while (k <= BITBUF_FILL); \
+	  else \
+	    do \
+	      { \
+		b |= ((bitbuf_t) get_byte (dec)) << k; \
+		k += 8; \
+	      } \
+	    while (k <= BITBUF_FILL); \
+	} \
+    } \
+  while (0)
 #define DUMPBITS(n) do {b>>=(n);k-=(n);} while (0)
 
-#define INBUFSIZ  0x2000
+/*
+ *  Input is read a big chunk at a time, so that the file system and
+ *  the disk see few large reads rather than many small ones.  The big
+ *  buffer lies below the checkpoints at the top of memory.  A read
+ *  whose buffer reaches down that far makes do with the small one.
+ */
 
-static uch inbuf[INBUFSIZ];
-static int bufloc;
+#define INBUFSIZ	0x2000
+#define BIG_INBUFSIZ	0x10000
+
+/* the caller's buffer for the read in progress, kept clear of */
+static unsigned long read_start, read_end;
+
+static uch small_inbuf[INBUFSIZ];
+static uch *big_inbuf;
+
+static void
+reserve_inbuf (void)
+{
+  big_inbuf = linalloc (BIG_INBUFSIZ);
+}
 
+/* Refill the input buffer of DEC and return its first byte.  Past the
+   end of the file there is nothing to read, so make it zeros.  Only
+   the serial decoder reads the file; the others have all their input
+   in memory from the start.  */
 static int
-get_byte (void)
+fill_inbuf (struct gz_dec *dec)
 {
-  if (filepos == gzip_data_offset || bufloc == INBUFSIZ)
+  int size = INBUFSIZ;
+
+  if (dec != gz)
+    return 0;
+
+  gz->inbuf = small_inbuf;
+  if (read_end <= (unsigned long) big_inbuf
+      || read_start >= (unsigned long) (big_inbuf + BIG_INBUFSIZ))
     {
-      bufloc = 0;
-      grub_read (inbuf, INBUFSIZ);
+      /* up to a multiple of the size, where the next one starts */
+      gz->inbuf = big_inbuf;
+      size = BIG_INBUFSIZ - filepos % BIG_INBUFSIZ;
     }
 
-  return inbuf[bufloc++];
+  gz->bufloc = 0;
+  gz->buflen = grub_read ((char *) gz->inbuf, size);
+  if (gz->buflen <= 0)
+    {
+      gz->buflen = 0;
+      return 0;
+    }
+
+  return gz->inbuf[gz->bufloc++];
 }
 
-/* decompression global pointers */
-static struct huft *tl;		/* literal/length code table */
-static struct huft *td;		/* distance code table */
-static int bl;			/* lookup bits for tl */
-static int bd;			/* lookup bits for td */
+#define get_byte(dec) ((dec)->bufloc < (dec)->buflen \
+		       ? (dec)->inbuf[(dec)->bufloc++] : fill_inbuf (dec))
 
 
 /* more function prototypes */
-static int huft_build (unsigned *, unsigned, unsigned, ush *, ush *,
-		       struct huft **, int *);
-static int inflate_codes_in_window (void);
+static int huft_build (struct gz_dec *, unsigned *, unsigned, unsigned,
+		       ush *, ush *, struct huft **, int *);
+static int inflate_codes_in_window (struct gz_dec *);
 
 
 /* Given a list of code lengths and a maximum table size, make a set of
@@ -527,7 +764,8 @@ static int inflate_codes_in_window (void);
    oversubscribed set of lengths), and three if not enough memory. */
 
 static int
-huft_build (unsigned *b,	/* code lengths in bits (all assumed <= BMAX) */
+huft_build (struct gz_dec *dec,	/* whose memory the tables are made in */
+	    unsigned *b,	/* code lengths in bits (all <= BMAX) */
 	    unsigned n,		/* number of codes (assumed <= N_MAX) */
 	    unsigned s,		/* number of simple-valued codes (0..s-1) */
 	    ush * d,		/* list of base values for non-simple codes */
@@ -653,9 +891,10 @@ huft_build (unsigned *b,	/* code lengths in bits (all assumed <= BMAX) */
 	      z = 1 << j;	/* table entries for j-bit table */
 
 	      /* allocate and link in new table */
-	      q = (struct huft *) linalloc ((z + 1) * sizeof (struct huft));
+	      q = huft_alloc (dec, z + 1);
+	      if (q == (struct huft *) NULL)
+		return 3;		/* not enough memory */
 
-	      hufts += z + 1;	/* track memory usage */
 	      *t = q + 1;	/* link to list for huft_free() */
 	      *(t = &(q->v.t)) = (struct huft *) NULL;
 	      u[h] = ++q;	/* table starts after link */
@@ -717,35 +956,33 @@ huft_build (unsigned *b,	/* code lengths in bits (all assumed <= BMAX) */
  *  Return an error code or zero if it all goes ok.
  */
 
-static unsigned inflate_n, inflate_d;
-
 static int
-inflate_codes_in_window (void)
+inflate_codes_in_window (struct gz_dec *dec)
 {
   register unsigned e;		/* table entry flag/number of extra bits */
   unsigned n, d;		/* length and index for copy */
   unsigned w;			/* current window position */
   struct huft *t;		/* pointer to table entry */
   unsigned ml, md;		/* masks for bl and bd bits */
-  register ulg b;		/* bit buffer */
+  register bitbuf_t b;		/* bit buffer */
   register unsigned k;		/* number of bits in bit buffer */
 
-  /* make local copies of globals */
-  d = inflate_d;
-  n = inflate_n;
-  b = bb;			/* initialize bit buffer */
-  k = bk;
-  w = wp;			/* initialize window position */
+  /* make local copies of the decoder's */
+  d = dec->inflate_d;
+  n = dec->inflate_n;
+  b = dec->bb;			/* initialize bit buffer */
+  k = dec->bk;
+  w = dec->wp;			/* initialize window position */
 
   /* inflate the coded data */
-  ml = mask_bits[bl];		/* precompute masks for speed */
-  md = mask_bits[bd];
+  ml = mask_bits[dec->bl];		/* precompute masks for speed */
+  md = mask_bits[dec->bd];
   for (;;)			/* do until end of block */
     {
-      if (!code_state)
+      if (!dec->code_state)
 	{
-	  NEEDBITS ((unsigned) bl);
-	  if ((e = (t = tl + ((unsigned) b & ml))->e) > 16)
+	  NEEDBITS ((unsigned) dec->bl);
+	  if ((e = (t = dec->tl + ((unsigned) b & ml))->e) > 16)
 	    do
 	      {
 		if (e == 99)
@@ -762,7 +999,7 @@ inflate_codes_in_window (void)
 
 	  if (e == 16)		/* then it's a literal */
 	    {
-	      slide[w++] = (uch) t->v.n;
+	      dec->window[w++] = (uch) t->v.n;
 	      if (w == WSIZE)
 		break;
 	    }
@@ -772,7 +1009,7 @@ inflate_codes_in_window (void)
 	      /* exit if end of block */
 	      if (e == 15)
 		{
-		  block_len = 0;
+		  dec->block_len = 0;
 		  break;
 		}
 
@@ -782,8 +1019,8 @@ inflate_codes_in_window (void)
 	      DUMPBITS (e);
 
 	      /* decode distance of block to copy */
-	      NEEDBITS ((unsigned) bd);
-	      if ((e = (t = td + ((unsigned) b & md))->e) > 16)
+	      NEEDBITS ((unsigned) dec->bd);
+	      if ((e = (t = dec->td + ((unsigned) b & md))->e) > 16)
 		do
 		  {
 		    if (e == 99)
@@ -801,36 +1038,38 @@ inflate_codes_in_window (void)
 	      NEEDBITS (e);
 	      d = w - t->v.n - ((unsigned) b & mask_bits[e]);
 	      DUMPBITS (e);
-	      code_state++;
+	      dec->code_state++;
 	    }
 	}
 
-      if (code_state)
+      if (dec->code_state)
 	{
 	  /* do the copy */
 	  do
 	    {
 	      n -= (e = (e = WSIZE - ((d &= WSIZE - 1) > w ? d : w)) > n ? n
 		    : e);
-	      if (w - d >= e)
-		{
-		  memmove (slide + w, slide + d, e);
-		  w += e;
-		  d += e;
-		}
-	      else
-		/* purposefully use the overlap for extra copies here!! */
-		{
-		  while (e--)
-		    slide[w++] = slide[d++];
-		}
+	      /* Matches are at most 258 bytes, too short for memmove
+		 and its checks to pay off; and purposefully use the
+		 overlap for extra copies here!!  A source at or past W
+		 has wrapped around into the previous window.  */
+	      {
+		register uch *to = dec->window + w;
+		register uch *from = ((d >= w ? dec->prev_window : dec->window)
+				      + d);
+
+		w += e;
+		d += e;
+		while (e--)
+		  *to++ = *from++;
+	      }
 	      if (w == WSIZE)
 		break;
 	    }
 	  while (n);
 
 	  if (!n)
-	    code_state--;
+	    dec->code_state--;
 
 	  /* did we break from the loop too soon? */
 	  if (w == WSIZE)
@@ -838,93 +1077,170 @@ inflate_codes_in_window (void)
 	}
     }
 
-  /* restore the globals from the locals */
-  inflate_d = d;
-  inflate_n = n;
-  wp = w;			/* restore global window pointer */
-  bb = b;			/* restore global bit buffer */
-  bk = k;
+  /* restore the decoder's from the locals */
+  dec->inflate_d = d;
+  dec->inflate_n = n;
+  dec->wp = w;			/* restore window pointer */
+  dec->bb = b;			/* restore bit buffer */
+  dec->bk = k;
 
-  return !block_len;
+  return !dec->block_len;
 }
 
 
 /* get header for an inflated type 0 (stored) block. */
 
 static void
-init_stored_block (void)
+init_stored_block (struct gz_dec *dec)
 {
-  register ulg b;		/* bit buffer */
+  register bitbuf_t b;		/* bit buffer */
   register unsigned k;		/* number of bits in bit buffer */
 
-  /* make local copies of globals */
-  b = bb;			/* initialize bit buffer */
-  k = bk;
+  /* make local copies of the decoder's */
+  b = dec->bb;			/* initialize bit buffer */
+  k = dec->bk;
 
   /* go to byte boundary */
   DUMPBITS (k & 7);
 
   /* get the length and its complement */
   NEEDBITS (16);
-  block_len = ((unsigned) b & 0xffff);
+  dec->block_len = ((unsigned) b & 0xffff);
   DUMPBITS (16);
   NEEDBITS (16);
-  if (block_len != (unsigned) ((~b) & 0xffff))
+  if (dec->block_len != (unsigned) ((~b) & 0xffff))
     errnum = ERR_BAD_GZIP_DATA;
   DUMPBITS (16);
 
-  /* restore global variables */
-  bb = b;
-  bk = k;
+  /* restore the decoder's */
+  dec->bb = b;
+  dec->bk = k;
 }
 
 
-/* get header for an inflated type 1 (fixed Huffman codes) block.  We should
-   either replace this with a custom decoder, or at least precompute the
-   Huffman tables. */
+/* build the decoding tables for a fixed Huffman codes block, the first
+   time one is met, and use them for every other one after. */
+
+static struct huft *fixed_tl;	/* fixed literal/length code table */
+static struct huft *fixed_td;	/* fixed distance code table */
+static int fixed_bl;		/* lookup bits for fixed_tl */
+static int fixed_bd;		/* lookup bits for fixed_td */
 
+/* Build them with DEC, if that is still to be done.  */
 static void
-init_fixed_block ()
+make_fixed_tables (struct gz_dec *dec)
 {
   int i;			/* temporary variable */
   unsigned l[288];		/* length list for huft_build */
+  struct huft *arena = dec->huft_arena;
+  unsigned left = dec->huft_arena_left;
 
-  /* set up literal table */
-  for (i = 0; i < 144; i++)
-    l[i] = 8;
-  for (; i < 256; i++)
-    l[i] = 9;
-  for (; i < 280; i++)
-    l[i] = 7;
-  for (; i < 288; i++)		/* make a complete, but wrong code set */
-    l[i] = 8;
-  bl = 7;
-  if ((i = huft_build (l, 288, 257, cplens, cplext, &tl, &bl)) != 0)
+  if (fixed_tl == (struct huft *) NULL)
     {
-      errnum = ERR_BAD_GZIP_DATA;
-      return;
+      dec->huft_arena = fixed_hufts;
+      dec->huft_arena_left = FIXED_HUFTS;
+
+      /* set up literal table */
+      for (i = 0; i < 144; i++)
+	l[i] = 8;
+      for (; i < 256; i++)
+	l[i] = 9;
+      for (; i < 280; i++)
+	l[i] = 7;
+      for (; i < 288; i++)	/* make a complete, but wrong code set */
+	l[i] = 8;
+      fixed_bl = 7;
+      i = huft_build (dec, l, 288, 257, cplens, cplext, &fixed_tl,
+		      &fixed_bl);
+
+      /* set up distance table */
+      if (i == 0)
+	{
+	  for (i = 0; i < 30; i++)	/* make an incomplete code set */
+	    l[i] = 5;
+	  fixed_bd = 5;
+	  i = huft_build (dec, l, 30, 0, cpdist, cpdext, &fixed_td,
+			  &fixed_bd);
+	}
+
+      dec->huft_arena = arena;
+      dec->huft_arena_left = left;
+      if (i > 1 || fixed_td == (struct huft *) NULL)
+	{
+	  fixed_tl = (struct huft *) NULL;
+	  errnum = ERR_BAD_GZIP_DATA;
+	}
     }
+}
+
+static void
+build_fixed_tables (struct gz_dec *dec)
+{
+  make_fixed_tables (dec);
+  if (errnum)
+    return;
 
-  /* set up distance table */
-  for (i = 0; i < 30; i++)	/* make an incomplete code set */
-    l[i] = 5;
-  bd = 5;
-  if ((i = huft_build (l, 30, 0, cpdist, cpdext, &td, &bd)) > 1)
+  dec->tl = fixed_tl;
+  dec->td = fixed_td;
+  dec->bl = fixed_bl;
+  dec->bd = fixed_bd;
+}
+
+
+/* get header for an inflated type 1 (fixed Huffman codes) block. */
+
+static void
+init_fixed_block (struct gz_dec *dec)
+{
+  build_fixed_tables (dec);
+  if (errnum)
+    return;
+
+  /* indicate we're now working on a block */
+  dec->code_state = 0;
+  dec->block_len++;
+}
+
+
+/* build the decoding tables for literal/length and distance codes out
+   of the NL + ND code lengths in LL. */
+
+static void
+build_dynamic_tables (struct gz_dec *dec, unsigned *ll, unsigned nl,
+		      unsigned nd)
+{
+  int i;
+
+  dec->bl = lbits;
+  if ((i = huft_build (dec, ll, nl, 257, cplens, cplext, &dec->tl,
+		       &dec->bl)) != 0)
     {
+#if 0
+      if (i == 1)
+	printf ("gunzip: incomplete literal tree\n");
+#endif
+
       errnum = ERR_BAD_GZIP_DATA;
       return;
     }
+  dec->bd = dbits;
+  if ((i = huft_build (dec, ll + nl, nd, 0, cpdist, cpdext, &dec->td,
+		       &dec->bd)) != 0)
+    {
+#if 0
+      if (i == 1)
+	printf ("gunzip: incomplete distance tree\n");
+#endif
 
-  /* indicate we're now working on a block */
-  code_state = 0;
-  block_len++;
+      errnum = ERR_BAD_GZIP_DATA;
+    }
 }
 
 
 /* get header for an inflated type 2 (dynamic Huffman codes) block. */
 
 static void
-init_dynamic_block (void)
+init_dynamic_block (struct gz_dec *dec)
 {
   int i;			/* temporary variables */
   unsigned j;
@@ -935,12 +1251,12 @@ init_dynamic_block (void)
   unsigned nl;			/* number of literal/length codes */
   unsigned nd;			/* number of distance codes */
   unsigned ll[286 + 30];	/* literal/length and distance code lengths */
-  register ulg b;		/* bit buffer */
+  register bitbuf_t b;		/* bit buffer */
   register unsigned k;		/* number of bits in bit buffer */
 
   /* make local bit buffer */
-  b = bb;
-  k = bk;
+  b = dec->bb;
+  k = dec->bk;
 
   /* read in table lengths */
   NEEDBITS (5);
@@ -969,8 +1285,9 @@ init_dynamic_block (void)
     ll[bitorder[j]] = 0;
 
   /* build decoding table for trees--single level, 7 bit lookup */
-  bl = 7;
-  if ((i = huft_build (ll, 19, 19, NULL, NULL, &tl, &bl)) != 0)
+  dec->bl = 7;
+  if ((i = huft_build (dec, ll, 19, 19, NULL, NULL, &dec->tl,
+		       &dec->bl)) != 0)
     {
       errnum = ERR_BAD_GZIP_DATA;
       return;
@@ -978,14 +1295,14 @@ init_dynamic_block (void)
 
   /* read in literal and distance code lengths */
   n = nl + nd;
-  m = mask_bits[bl];
+  m = mask_bits[dec->bl];
   i = l = 0;
   while ((unsigned) i < n)
     {
-      NEEDBITS ((unsigned) bl);
-      j = (td = tl + ((unsigned) b & m))->b;
+      NEEDBITS ((unsigned) dec->bl);
+      j = (dec->td = dec->tl + ((unsigned) b & m))->b;
       DUMPBITS (j);
-      j = td->v.n;
+      j = dec->td->v.n;
       if (j < 16)		/* length of code in bits (0..15) */
 	ll[i++] = l = j;	/* save last length in l */
       else if (j == 16)		/* repeat last length 3 to 6 times */
@@ -1033,98 +1350,496 @@ init_dynamic_block (void)
     }
 
   /* free decoding table for trees */
-  reset_linalloc ();
+  free_hufts (dec);
 
-  /* restore the global bit buffer */
-  bb = b;
-  bk = k;
+  /* restore the decoder's bit buffer */
+  dec->bb = b;
+  dec->bk = k;
 
-  /* build the decoding tables for literal/length and distance codes */
-  bl = lbits;
-  if ((i = huft_build (ll, nl, 257, cplens, cplext, &tl, &bl)) != 0)
-    {
-#if 0
-      if (i == 1)
-	printf ("gunzip: incomplete literal tree\n");
-#endif
+  /* remember the code lengths, then build the decoding tables */
+  for (j = 0; j < n; j++)
+    dec->dyn_lengths[j] = ll[j];
+  dec->dyn_nl = nl;
+  dec->dyn_nd = nd;
 
-      errnum = ERR_BAD_GZIP_DATA;
-      return;
-    }
-  bd = dbits;
-  if ((i = huft_build (ll + nl, nd, 0, cpdist, cpdext, &td, &bd)) != 0)
-    {
-#if 0
-      if (i == 1)
-	printf ("gunzip: incomplete distance tree\n");
-#endif
-
-      errnum = ERR_BAD_GZIP_DATA;
-      return;
-    }
+  build_dynamic_tables (dec, ll, nl, nd);
+  if (errnum)
+    return;
 
   /* indicate we're now working on a block */
-  code_state = 0;
-  block_len++;
+  dec->code_state = 0;
+  dec->block_len++;
 }
 
 
 static void
-get_new_block (void)
+get_new_block (struct gz_dec *dec)
 {
-  register ulg b;		/* bit buffer */
+  register bitbuf_t b;		/* bit buffer */
   register unsigned k;		/* number of bits in bit buffer */
 
-  hufts = 0;
-
   /* make local bit buffer */
-  b = bb;
-  k = bk;
+  b = dec->bb;
+  k = dec->bk;
 
   /* read in last block bit */
   NEEDBITS (1);
-  last_block = (int) b & 1;
+  dec->last_block = (int) b & 1;
   DUMPBITS (1);
 
   /* read in block type */
   NEEDBITS (2);
-  block_type = (unsigned) b & 3;
+  dec->block_type = (unsigned) b & 3;
   DUMPBITS (2);
 
-  /* restore the global bit buffer */
-  bb = b;
-  bk = k;
+  /* restore the decoder's bit buffer */
+  dec->bb = b;
+  dec->bk = k;
 
-  if (block_type == INFLATE_STORED)
-    init_stored_block ();
-  if (block_type == INFLATE_FIXED)
-    init_fixed_block ();
-  if (block_type == INFLATE_DYNAMIC)
-    init_dynamic_block ();
+  if (dec->block_type == INFLATE_STORED)
+    init_stored_block (dec);
+  if (dec->block_type == INFLATE_FIXED)
+    init_fixed_block (dec);
+  if (dec->block_type == INFLATE_DYNAMIC)
+    init_dynamic_block (dec);
 }
 
 
+/*
+ *  Checkpoints.
+ *
+ *  Seeking backwards in a compressed file used to mean inflating it
+ *  again from the start, and seeking far forwards meant inflating
+ *  everything in between.  So every CHECKPOINT_INTERVAL bytes of
+ *  output, the whole decompression state -- the bit buffer, the
+ *  position in the compressed data, the block being decoded and the
+ *  window before that point -- is saved, and gunzip_read starts from
+ *  the nearest one instead.  The Huffman tables are not saved, as they
+ *  are built again from the code lengths of the block.
+ *
+ *  The checkpoints live at the top of the decompression memory, below
+ *  which the tables are allocated.  Nothing else keeps out of there,
+ *  so each carries a checksum and is only trusted if it still matches.
+ *  Once all of them are used, every other one is dropped and the
+ *  interval doubles, so they always cover the whole file read so far.
+ */
+
+struct gz_checkpoint
+{
+  ulg sum;			/* checksum of everything below */
+  int saved_filepos;		/* uncompressed position after window */
+  int in_pos;			/* compressed position after bit buffer */
+  bitbuf_t bb;
+  unsigned bk;
+  int block_type;
+  int block_len;
+  int last_block;
+  int code_state;
+  unsigned crc;
+  int member, member_start;	/* the member it is in, and its start */
+  unsigned inflate_n, inflate_d;
+  unsigned nl, nd;		/* code lengths of a dynamic block */
+  uch lengths[286 + 30];
+  uch window[WSIZE];
+};
+
+static struct gz_checkpoint *checkpoints;
+
 static void
-inflate_window (void)
+reserve_checkpoints (void)
 {
-  /* initialize window */
-  wp = 0;
+  linalloc_topaddr -= GZ_CHECKPOINTS * sizeof (struct gz_checkpoint);
+  linalloc_topaddr &= ~3;
+  checkpoints = (struct gz_checkpoint *) linalloc_topaddr;
+}
 
-  /*
-   *  Main decompression loop.
-   */
+static ulg
+checkpoint_sum (struct gz_checkpoint *cp)
+{
+  uch *p = (uch *) cp + sizeof (cp->sum);
+  uch *end = (uch *) (cp + 1);
+  ulg sum = 1;
+
+  while (p < end)
+    sum = sum * 31 + *p++;
+
+  return sum;
+}
+
+/* Called after each whole window, to take a checkpoint if one is due. */
+static void
+take_checkpoint (void)
+{
+  struct gz_checkpoint *cp;
+  int i, j;
+
+  if (saved_filepos % checkpoint_interval
+      || (gz->last_block && ! gz->block_len)
+      || (num_checkpoints
+	  && checkpoints[num_checkpoints - 1].saved_filepos >= saved_filepos))
+    return;
+
+  if (read_end > (unsigned long) checkpoints
+      && read_start < (unsigned long) (checkpoints + GZ_CHECKPOINTS))
+    return;
+
+  if (num_checkpoints == GZ_CHECKPOINTS)
+    {
+      checkpoint_interval <<= 1;
+      for (i = j = 0; i < num_checkpoints; i++)
+	if (! (checkpoints[i].saved_filepos % checkpoint_interval))
+	  {
+	    if (i != j)
+	      grub_memcpy ((char *) (checkpoints + j),
+			   (char *) (checkpoints + i),
+			   sizeof (struct gz_checkpoint));
+	    j++;
+	  }
+      num_checkpoints = j;
+
+      if (saved_filepos % checkpoint_interval)
+	return;
+    }
+
+  cp = checkpoints + num_checkpoints++;
+  cp->saved_filepos = saved_filepos;
+  cp->in_pos = filepos - (gz->buflen - gz->bufloc);
+  cp->bb = gz->bb;
+  cp->bk = gz->bk;
+  cp->block_type = gz->block_type;
+  cp->block_len = gz->block_len;
+  cp->last_block = gz->last_block;
+  cp->code_state = gz->code_state;
+  cp->crc = crc;
+  cp->member = cur_member;
+  cp->member_start = member_start;
+  cp->inflate_n = gz->inflate_n;
+  cp->inflate_d = gz->inflate_d;
+  cp->nl = gz->dyn_nl;
+  cp->nd = gz->dyn_nd;
+  grub_memcpy ((char *) cp->lengths, (char *) gz->dyn_lengths,
+	       sizeof (gz->dyn_lengths));
+  grub_memcpy ((char *) cp->window, (char *) gz->window, WSIZE);
+  cp->sum = checkpoint_sum (cp);
+}
+
+/* Start inflating the member M afresh.  Its start is seldom on a
+   window boundary, so the window is inflated from there on.  */
+static void
+resume_member (int m)
+{
+  int out = members[m].out_pos;
+
+  saved_filepos = out & ~(WSIZE - 1);
+  window_start = out & (WSIZE - 1);
+  filepos = members[m].in_pos;
+  gz->bufloc = gz->buflen = 0;
+  gz->bb = 0;
+  gz->bk = 0;
+  gz->last_block = 0;
+  gz->block_len = 0;
+  gz->code_state = 0;
+  crc = 0;
+  cur_member = m;
+  member_start = out;
+  members_done = 0;
+  gz->window = gz->prev_window = slide;
+
+  reset_linalloc ();
+}
+
+/* Carry on from the last checkpoint whose window holds POS or lies
+   before it, or from the start of the last member before POS, if that
+   is nearer than where decompression is now.  Return non-zero if it
+   did.  */
+static int
+resume_checkpoint (int pos)
+{
+  struct gz_checkpoint *cp = 0;
+  unsigned ll[286 + 30];
+  int i, m = 0, start;
+
+  for (i = 0; i < num_checkpoints; i++)
+    if (checkpoints[i].saved_filepos - WSIZE <= pos)
+      cp = checkpoints + i;
+
+  for (i = 1; i < num_members; i++)
+    if (members[i].out_pos <= pos)
+      m = i;
+
+  if (m && cp && cp->saved_filepos - WSIZE >= members[m].out_pos)
+    m = 0;
+
+  if (! cp && ! m)
+    return 0;
+
+  start = m ? members[m].out_pos : cp->saved_filepos - WSIZE;
+  if (saved_filepos <= pos + WSIZE && start <= saved_filepos - WSIZE)
+    return 0;
+
+  if (m)
+    {
+      resume_member (m);
+      return 1;
+    }
+
+  if (cp->sum != checkpoint_sum (cp))
+    {
+      num_checkpoints = 0;
+      return 0;
+    }
+
+  saved_filepos = cp->saved_filepos;
+  filepos = cp->in_pos;
+  gz->bufloc = gz->buflen = 0;
+  gz->bb = cp->bb;
+  gz->bk = cp->bk;
+  gz->block_type = cp->block_type;
+  gz->block_len = cp->block_len;
+  gz->last_block = cp->last_block;
+  gz->code_state = cp->code_state;
+  crc = cp->crc;
+  cur_member = cp->member;
+  member_start = cp->member_start;
+  members_done = 0;
+  window_start = 0;
+  gz->inflate_n = cp->inflate_n;
+  gz->inflate_d = cp->inflate_d;
+  gz->dyn_nl = cp->nl;
+  gz->dyn_nd = cp->nd;
+  grub_memcpy ((char *) gz->dyn_lengths, (char *) cp->lengths,
+	       sizeof (gz->dyn_lengths));
+  grub_memcpy ((char *) slide, (char *) cp->window, WSIZE);
+  gz->window = gz->prev_window = slide;
+  gz->wp = WSIZE;
+
+  reset_linalloc ();
+  if (gz->block_len && gz->block_type == INFLATE_FIXED)
+    build_fixed_tables (gz);
+  else if (gz->block_len && gz->block_type == INFLATE_DYNAMIC)
+    {
+      for (i = 0; i < gz->dyn_nl + gz->dyn_nd; i++)
+	ll[i] = gz->dyn_lengths[i];
+      build_dynamic_tables (gz, ll, gz->dyn_nl, gz->dyn_nd);
+    }
+
+  return 1;
+}
+
+
+/*
+ *  CRC-32, as in the gzip trailer.
+ *
+ *  This goes eight bytes at a time, with a table for each byte
+ *  position: crc_table[k][n] is the CRC of byte N followed by K zero
+ *  bytes.  The tables take 8K, which are in the scratch memory below
+ *  the input buffer, and are made each time a file to be checked is
+ *  opened, since what else is read there may have overwritten them.
+ */
+
+static ulg (*crc_table)[256];
+
+static void
+reserve_crc_table (void)
+{
+  crc_table = linalloc (8 * sizeof (crc_table[0]));
+}
+
+static void
+make_crc_table (void)
+{
+  ulg c;
+  int n, k;
+
+  for (n = 0; n < 256; n++)
+    {
+      c = n;
+      for (k = 0; k < 8; k++)
+	c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      crc_table[0][n] = c;
+    }
+
+  for (n = 0; n < 256; n++)
+    for (k = 1; k < 8; k++)
+      crc_table[k][n] = ((crc_table[k - 1][n] >> 8)
+			 ^ crc_table[0][crc_table[k - 1][n] & 0xff]);
+}
+
+/* Run the N bytes at S through the CRC so far, C.  */
+static ulg
+updcrc (ulg c, uch *s, int n)
+{
+  ulg one, two;
+
+  c = ~c;
+
+  while (n && ((unsigned long) s & 3))
+    {
+      c = crc_table[0][(c ^ *s++) & 0xff] ^ (c >> 8);
+      n--;
+    }
+
+  while (n >= 8)
+    {
+      one = *((ulg *) s) ^ c;
+      two = *((ulg *) (s + 4));
+      c = (crc_table[7][one & 0xff] ^ crc_table[6][(one >> 8) & 0xff]
+	   ^ crc_table[5][(one >> 16) & 0xff] ^ crc_table[4][one >> 24]
+	   ^ crc_table[3][two & 0xff] ^ crc_table[2][(two >> 8) & 0xff]
+	   ^ crc_table[1][(two >> 16) & 0xff] ^ crc_table[0][two >> 24]);
+      s += 8;
+      n -= 8;
+    }
+
+  while (n--)
+    c = crc_table[0][(c ^ *s++) & 0xff] ^ (c >> 8);
+
+  return ~c;
+}
+
+
+/* Take the next byte of what the bit buffer of DEC holds, which is on
+   a byte boundary, or else of its input.  */
+static int
+gz_byte (struct gz_dec *dec)
+{
+  int c;
 
-  while (wp < WSIZE && !errnum)
+  if (dec->bk >= 8)
     {
-      if (!block_len)
+      c = (int) (dec->bb & 0xff);
+      dec->bb >>= 8;
+      dec->bk -= 8;
+      return c;
+    }
+
+  return get_byte (dec);
+}
+
+/* Read the trailer of the member which DEC has just inflated, its CRC
+   and its size.  */
+static void
+gz_trailer (struct gz_dec *dec, unsigned int *member_crc,
+	    unsigned int *isize)
+{
+  int i;
+
+  /* the trailer starts on a byte boundary */
+  dec->bb >>= dec->bk & 7;
+  dec->bk &= ~7;
+
+  *member_crc = *isize = 0;
+  for (i = 0; i < 32; i += 8)
+    *member_crc |= (unsigned int) gz_byte (dec) << i;
+  for (i = 0; i < 32; i += 8)
+    *isize |= (unsigned int) gz_byte (dec) << i;
+}
+
+/* Skip LEN bytes, or up to a zero byte if LEN is -1.  */
+static void
+gz_skip (int len)
+{
+  if (len < 0)
+    while (gz_byte (gz))
+      ;
+  else
+    while (len--)
+      gz_byte (gz);
+}
+
+/* Where in the compressed data the byte that GZ_BYTE gives next is.  */
+static int
+gz_in_pos (void)
+{
+  return filepos - (gz->buflen - gz->bufloc) - gz->bk / 8;
+}
+
+/* The member being inflated has ended at WP in the window.  Check its
+   trailer, and start the next member if one follows.  Return non-zero
+   if one does.  */
+static int
+next_member (void)
+{
+  unsigned int member_crc, isize;
+  int out = saved_filepos + gz->wp;
+  int flags, i;
+
+  if (members_done)
+    return 0;
+
+  gz_trailer (gz, &member_crc, &isize);
+
+  if (check_crc)
+    {
+      crc = updcrc (crc, gz->window + crc_from, gz->wp - crc_from);
+      if (crc != member_crc || isize != (unsigned int) (out - member_start))
 	{
-	  if (last_block)
-	    break;
+	  errnum = ERR_BAD_GZIP_DATA;
+	  return 0;
+	}
+    }
+  crc = 0;
+  crc_from = gz->wp;
+
+  /* Anything but another member after it, such as the zeros which
+     fill up the last block of some media, is the end.  */
+  if (gz_in_pos () + 10 > filemax
+      || gz_byte (gz) != 0x1f || gz_byte (gz) != 0x8b)
+    {
+      members_done = 1;
+      return 0;
+    }
+
+  flags = 0;
+  if (gz_byte (gz) != DEFLATED || ((flags = gz_byte (gz)) & UNSUPP_FLAGS))
+    {
+      errnum = ERR_BAD_GZIP_HEADER;
+      return 0;
+    }
+
+  /* the time, the extra flags and the system */
+  gz_skip (6);
+  if (flags & EXTRA_FIELD)
+    {
+      i = gz_byte (gz);
+      gz_skip (i | (gz_byte (gz) << 8));
+    }
+  if (flags & ORIG_NAME)
+    gz_skip (-1);
+  if (flags & COMMENT)
+    gz_skip (-1);
+
+  cur_member++;
+  member_start = out;
+  if (cur_member == num_members && num_members < GZ_MEMBERS)
+    {
+      members[num_members].in_pos = gz_in_pos ();
+      members[num_members].out_pos = out;
+      num_members++;
+    }
+
+  gz->last_block = 0;
+  gz->block_len = 0;
+  return 1;
+}
+
+
+/* Inflate with DEC until its window is full, or the deflate data of
+   the member ends.  */
+static void
+inflate_blocks (struct gz_dec *dec)
+{
+  while (dec->wp < WSIZE && !errnum)
+    {
+      if (!dec->block_len)
+	{
+	  if (dec->last_block)
+	    return;
 
-	  get_new_block ();
+	  get_new_block (dec);
 	}
 
-      if (block_type > INFLATE_DYNAMIC)
+      if (dec->block_type > INFLATE_DYNAMIC)
 	errnum = ERR_BAD_GZIP_DATA;
 
       if (errnum)
@@ -1133,21 +1848,46 @@ inflate_window (void)
       /*
        *  Expand stored block here.
        */
-      if (block_type == INFLATE_STORED)
+      if (dec->block_type == INFLATE_STORED)
 	{
-	  int w = wp;
+	  int w = dec->wp;
 
 	  /*
-	   *  This is basically a glorified pass-through
+	   *  This is basically a glorified pass-through.  The bit buffer
+	   *  is on a byte boundary here, and its bytes come first.
 	   */
 
-	  while (block_len && w < WSIZE && !errnum)
+	  while (dec->block_len && w < WSIZE && dec->bk >= 8)
+	    {
+	      dec->window[w++] = (uch) dec->bb;
+	      dec->bb >>= 8;
+	      dec->bk -= 8;
+	      dec->block_len--;
+	    }
+
+	  while (dec->block_len && w < WSIZE && !errnum)
 	    {
-	      slide[w++] = get_byte ();
-	      block_len--;
+	      int n = dec->buflen - dec->bufloc;
+
+	      if (! n)
+		{
+		  dec->window[w++] = get_byte (dec);
+		  dec->block_len--;
+		  continue;
+		}
+
+	      if (n > dec->block_len)
+		n = dec->block_len;
+	      if (n > WSIZE - w)
+		n = WSIZE - w;
+
+	      memmove (dec->window + w, dec->inbuf + dec->bufloc, n);
+	      dec->bufloc += n;
+	      w += n;
+	      dec->block_len -= n;
 	    }
 
-	  wp = w;
+	  dec->wp = w;
 
 	  continue;
 	}
@@ -1156,13 +1896,176 @@ inflate_window (void)
        *  Expand other kind of block.
        */
 
-      if (inflate_codes_in_window ())
-	reset_linalloc ();
+      if (inflate_codes_in_window (dec))
+	free_hufts (dec);
+    }
+}
+
+
+static void
+inflate_window (void)
+{
+  unsigned start = window_start;
+
+  /* initialize window */
+  gz->wp = crc_from = start;
+  window_start = 0;
+
+  /*
+   *  Main decompression loop, which goes on into the next member when
+   *  one ends.
+   */
+
+  do
+    inflate_blocks (gz);
+  while (gz->wp < WSIZE && !errnum && next_member ());
+
+  if (check_crc && ! errnum)
+    {
+      crc = updcrc (crc, gz->window + crc_from, gz->wp - crc_from);
+
+      /* at the end of the data, it is time to compare notes */
+      if (members_done && ! finding_members
+	  && saved_filepos + gz->wp != gzip_filemax)
+	errnum = ERR_BAD_GZIP_DATA;
     }
 
   saved_filepos += WSIZE;
 
-  /* XXX do CRC calculation here! */
+  /* A window inflated from the start of a member has nothing before
+     that to keep.  */
+  if (gz->wp == WSIZE && ! start && ! errnum)
+    take_checkpoint ();
+}
+
+/* Inflate the whole file, to find its members and its size, and go
+   back to its start.  */
+static int
+find_members (void)
+{
+  read_start = read_end = 0;
+  finding_members = 1;
+  while (! members_done && ! errnum)
+    inflate_window ();
+  finding_members = 0;
+  if (errnum)
+    return 0;
+
+  gzip_fsmax = gzip_filemax = saved_filepos - WSIZE + gz->wp;
+  initialize_tables ();
+  return 1;
+}
+
+/* Walk the members of a BGZF file, as bgzip and some other tools make
+   them, from one to the next without inflating any: each has just a
+   "BC" subfield in its extra field, with its whole size less one.
+   Return the size of the file, or -1 if it isn't one.  */
+static int
+bgzf_scan (void)
+{
+  unsigned char buf[18];
+  unsigned int isize, bsize;
+  int pos = 0, out = 0, n = 0;
+
+  while (pos + (int) sizeof (buf) <= filemax)
+    {
+      filepos = pos;
+      if (grub_read (buf, sizeof (buf)) != sizeof (buf))
+	return -1;
+
+      /* anything but another member after one is the end, as in
+	 next_member */
+      if (pos && (buf[0] != 0x1f || buf[1] != 0x8b))
+	break;
+
+      if (buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != DEFLATED
+	  || buf[3] != EXTRA_FIELD || buf[10] != 6 || buf[11] != 0
+	  || buf[12] != 'B' || buf[13] != 'C'
+	  || buf[14] != 2 || buf[15] != 0)
+	return -1;
+
+      bsize = (buf[16] | (buf[17] << 8)) + 1;
+      if (bsize < sizeof (buf) + 8 || bsize > (unsigned) (filemax - pos))
+	return -1;
+
+      filepos = pos + bsize - 4;
+      if (grub_read (buf, 4) != 4)
+	return -1;
+      isize = *((unsigned int *) buf);
+      if (isize > (unsigned) (MAXINT - out))
+	return -1;
+
+      if (n < GZ_MEMBERS)
+	{
+	  members[n].in_pos = pos + sizeof (buf);
+	  members[n].out_pos = out;
+	  n++;
+	}
+
+      out += isize;
+      pos += bsize;
+    }
+
+  if (! n)
+    return -1;
+
+  num_members = n;
+  return out;
+}
+
+/* Find the size of the file, which has to be known before it is read,
+   and where its members start.  HEAD and TAIL are its first 10 bytes
+   and its last 8.  */
+static int
+gz_find_size (unsigned char *head, unsigned char *tail)
+{
+  struct gz_found *f;
+  int i, size;
+
+  for (i = 0; i < GZ_FOUND; i++)
+    {
+      f = &gz_found[i];
+      if (f->csize == filemax && f->drive == current_drive
+	  && f->partition == current_partition
+	  && f->generation == disk_cache_generation
+	  && ! grub_memcmp ((char *) f->head, (char *) head, 10)
+	  && ! grub_memcmp ((char *) f->tail, (char *) tail, 8))
+	{
+	  gzip_fsmax = gzip_filemax = f->size;
+	  num_members = f->num_members;
+	  grub_memmove ((char *) members, (char *) f->members,
+			num_members * sizeof (members[0]));
+	  return 1;
+	}
+    }
+
+  size = bgzf_scan ();
+  if (size >= 0)
+    gzip_fsmax = gzip_filemax = size;
+  else
+    {
+      members[0].in_pos = gzip_data_offset;
+      members[0].out_pos = 0;
+      num_members = 1;
+      initialize_tables ();
+      if (errnum || ! find_members ())
+	return 0;
+    }
+  initialize_tables ();
+
+  f = &gz_found[gz_found_next];
+  gz_found_next = (gz_found_next + 1) % GZ_FOUND;
+  f->drive = current_drive;
+  f->partition = current_partition;
+  f->generation = disk_cache_generation;
+  f->csize = filemax;
+  grub_memmove ((char *) f->head, (char *) head, 10);
+  grub_memmove ((char *) f->tail, (char *) tail, 8);
+  f->size = gzip_filemax;
+  f->num_members = num_members;
+  grub_memmove ((char *) f->members, (char *) members,
+		num_members * sizeof (members[0]));
+  return 1;
 }
 
 
@@ -1171,20 +2074,284 @@ initialize_tables (void)
 {
   saved_filepos = 0;
   filepos = gzip_data_offset;
+  crc = 0;
 
-  /* initialize window, bit buffer */
-  bk = 0;
-  bb = 0;
+  /* initialize window, bit buffer, input buffer */
+  gz->bk = 0;
+  gz->bb = 0;
+  gz->bufloc = gz->buflen = 0;
 
   /* reset partial decompression code */
-  last_block = 0;
-  block_len = 0;
+  gz->last_block = 0;
+  gz->block_len = 0;
+  gz->window = gz->prev_window = slide;
+  crc_from = window_start = 0;
+  cur_member = 0;
+  member_start = 0;
+  members_done = 0;
 
   /* reset memory allocation stuff */
   reset_linalloc ();
 }
 
 
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+/*
+ *  Parallel inflating.
+ *
+ *  Members don't depend on each other, so the ones a read takes in
+ *  whole, and whose extents are known from the members found, can be
+ *  inflated in any order, by any processor.  As with zstd frames in
+ *  unzstd.c, the other processors take them one at a time, inflate
+ *  each straight into its place in the buffer read to and check its
+ *  trailer, CRC and all, while this one reads in the compressed data a
+ *  chunk at a time.  Then it helps them with what is left.
+ */
+
+#define PAR_CHUNK	0x100000	/* compressed bytes read at a time */
+
+struct gz_job
+{
+  uch *src;			/* its deflate data, and what follows */
+  int len;
+  uch *dest;
+  int size;			/* the bytes it inflates to */
+  int ok;
+};
+
+static struct gz_job *par_jobs;
+static struct gz_dec *par_decs;		/* one for each processor */
+static int par_num_decs;
+static volatile int par_ready;		/* the jobs which may be taken */
+static volatile int par_taken;		/* and those taken */
+static volatile int par_done;		/* whether no more will be ready */
+static volatile int par_next_dec;
+
+/* Inflate the member of JOB with DEC.  Whole windows go straight into
+   its place; the part of one at its end goes into a window of DEC's
+   own first, so that a corrupt member can't run over the end of the
+   buffer.  */
+static void
+gz_run_job (struct gz_dec *dec, struct gz_job *job)
+{
+  unsigned int member_crc, isize;
+  int out = 0;
+
+  dec->inbuf = job->src;
+  dec->bufloc = 0;
+  dec->buflen = job->len;
+  dec->bb = 0;
+  dec->bk = 0;
+  dec->last_block = 0;
+  dec->block_len = 0;
+  dec->code_state = 0;
+  free_hufts (dec);
+
+  do
+    {
+      if (job->size - out >= WSIZE)
+	dec->window = job->dest + out;
+      else
+	dec->window = dec->part_window;
+      dec->prev_window = out ? job->dest + out - WSIZE : dec->window;
+      dec->wp = 0;
+
+      inflate_blocks (dec);
+      if (errnum || (int) dec->wp > job->size - out)
+	return;
+
+      if (dec->window == dec->part_window)
+	grub_memmove ((char *) job->dest + out, (char *) dec->window,
+		      dec->wp);
+      out += dec->wp;
+    }
+  while (dec->wp == WSIZE);
+
+  if (out != job->size)
+    return;
+
+  gz_trailer (dec, &member_crc, &isize);
+  if (isize != (unsigned int) out
+      || (check_crc && updcrc (0, job->dest, out) != member_crc))
+    return;
+
+  job->ok = 1;
+}
+
+/* Take jobs until there are no more.  This runs on every processor,
+   so it must touch nothing but the jobs, their buffers and a decoder
+   of its own.  */
+static void
+gunzip_worker (void *arg)
+{
+  int n = __sync_fetch_and_add (&par_next_dec, 1);
+  int done, i;
+
+  if (n >= par_num_decs)
+    return;
+
+  for (;;)
+    {
+      /* see that it is done before seeing what is ready */
+      done = par_done;
+      i = par_taken;
+
+      if (i < par_ready)
+	{
+	  if (__sync_bool_compare_and_swap (&par_taken, i, i + 1))
+	    gz_run_job (par_decs + n, par_jobs + i);
+	}
+      else if (done)
+	break;
+      else
+	asm volatile ("pause");
+    }
+}
+
+/* Inflate the whole members that a read of LEN bytes into DEST takes
+   in, with the help of the other processors, if it starts where one
+   does.  Return the bytes inflated, which is zero if it is not worth
+   it.  */
+static int
+gunzip_parallel (uch *dest, int len)
+{
+  int m, n, i, end, start, clen, avail = 0, total = 0;
+  int mem = HUFT_MEM * sizeof (struct huft) + WSIZE;
+  struct gz_job *job;
+  uch *cbuf = 0;
+
+  for (m = 0; m < num_members; m++)
+    if (members[m].out_pos == gzip_filepos)
+      break;
+
+  /* Up to N, they end within the read.  Where the last member found
+     ends is only known if none were left out.  */
+  for (n = m; n < num_members; n++)
+    {
+      if (n + 1 < num_members)
+	end = members[n + 1].out_pos;
+      else if (num_members < GZ_MEMBERS)
+	end = gzip_filemax;
+      else
+	break;
+
+      if (end - gzip_filepos > len)
+	break;
+    }
+
+  if (n - m < 2)
+    return 0;
+
+  par_num_decs = grub_mp_count () + 1;
+  if (par_num_decs < 2 || ! memcheck ((unsigned long) dest, len))
+    return 0;
+
+  start = members[m].in_pos;
+  clen = (n < num_members ? members[n].in_pos : filemax) - start;
+
+  cbuf = grub_malloc (clen);
+  par_jobs = grub_malloc ((n - m) * sizeof (struct gz_job));
+  par_decs = grub_malloc (par_num_decs * (sizeof (struct gz_dec) + mem));
+  if (! cbuf || ! par_jobs || ! par_decs)
+    goto out;
+
+  for (i = 0; i < par_num_decs; i++)
+    {
+      uch *p = (uch *) (par_decs + par_num_decs) + i * mem;
+
+      par_decs[i].huft_mem = (struct huft *) p;
+      par_decs[i].part_window = p + HUFT_MEM * sizeof (struct huft);
+    }
+
+  for (i = m; i < n; i++)
+    {
+      job = par_jobs + i - m;
+      job->src = cbuf + members[i].in_pos - start;
+      job->len = ((i + 1 < num_members ? members[i + 1].in_pos : filemax)
+		  - members[i].in_pos);
+      job->dest = dest + members[i].out_pos - gzip_filepos;
+      job->size = ((i + 1 < num_members ? members[i + 1].out_pos
+		    : gzip_filemax) - members[i].out_pos);
+      job->ok = 0;
+    }
+
+  /* before any processor may want them */
+  make_fixed_tables (gz);
+  if (errnum)
+    goto out;
+
+  par_ready = par_taken = par_done = par_next_dec = 0;
+  if (! grub_mp_start (gunzip_worker, 0))
+    goto out;
+
+  filepos = start;
+  while (avail < clen)
+    {
+      i = clen - avail;
+      if (i > PAR_CHUNK)
+	i = PAR_CHUNK;
+      if (grub_read ((char *) cbuf + avail, i) != i)
+	break;
+      avail += i;
+
+      /* hand out the members which are in now */
+      while (par_ready < n - m
+	     && par_jobs[par_ready].src + par_jobs[par_ready].len
+		<= cbuf + avail)
+	{
+	  __sync_synchronize ();
+	  par_ready++;
+	}
+    }
+
+  par_done = 1;
+  gunzip_worker (0);
+  grub_mp_wait ();
+
+  for (i = 0; i < par_ready; i++)
+    if (! par_jobs[i].ok)
+      errnum = ERR_BAD_GZIP_DATA;
+  if (par_ready < n - m && ! errnum)
+    errnum = ERR_BAD_GZIP_DATA;
+
+  /* carry on after them, from the start of the next member */
+  if (! errnum)
+    {
+      total = ((n < num_members ? members[n].out_pos : gzip_filemax)
+	       - gzip_filepos);
+      if (n < num_members)
+	resume_member (n);
+      else
+	initialize_tables ();
+    }
+
+ out:
+  if (cbuf)
+    grub_free (cbuf);
+  if (par_jobs)
+    grub_free (par_jobs);
+  if (par_decs)
+    grub_free (par_decs);
+
+  return errnum ? 0 : total;
+}
+#endif /* PLATFORM_EFI && ! GRUB_UTIL */
+
+
+/* Go back to inflating into slide, after whole windows have been
+   inflated into the caller's buffer, which may change once we
+   return.  */
+static void
+window_to_slide (void)
+{
+  if (gz->window != slide)
+    {
+      grub_memcpy (slide, gz->window, WSIZE);
+      gz->window = gz->prev_window = slide;
+    }
+}
+
+
 int
 gunzip_read (char *buf, int len)
 {
@@ -1196,9 +2363,29 @@ gunzip_read (char *buf, int len)
    *  Now "gzip_*" values refer to the uncompressed data.
    */
 
-  /* do we reset decompression to the beginning of the file? */
+  read_start = (unsigned long) buf;
+  read_end = read_start + len;
+
+  /* do we reset decompression to the beginning of the file, or can we
+     start from a checkpoint nearer to where we are going? */
   if (saved_filepos > gzip_filepos + WSIZE)
-    initialize_tables ();
+    {
+      if (! resume_checkpoint (gzip_filepos))
+	initialize_tables ();
+    }
+  else if (gzip_filepos >= saved_filepos + WSIZE)
+    resume_checkpoint (gzip_filepos);
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  {
+    int size = gunzip_parallel ((uch *) buf, len);
+
+    buf += size;
+    len -= size;
+    gzip_filepos += size;
+    ret += size;
+  }
+#endif
 
   /*
    *  This loop operates upon uncompressed data only.  The only
@@ -1211,6 +2398,26 @@ gunzip_read (char *buf, int len)
       register int size;
       register char *srcaddr;
 
+      /*
+       *  When the next window is wanted whole, inflate it straight
+       *  into BUF, which saves copying it out of slide.  Loaders read
+       *  whole images this way, so it covers nearly everything.
+       */
+      if (gzip_filepos == saved_filepos && len >= WSIZE && ! window_start
+	  && memcheck ((unsigned long) buf, WSIZE))
+	{
+	  gz->prev_window = gz->window;
+	  gz->window = (uch *) buf;
+	  inflate_window ();
+
+	  buf += WSIZE;
+	  len -= WSIZE;
+	  gzip_filepos += WSIZE;
+	  ret += WSIZE;
+	  continue;
+	}
+
+      window_to_slide ();
       while (gzip_filepos >= saved_filepos)
 	inflate_window ();
 
@@ -1227,7 +2434,9 @@ gunzip_read (char *buf, int len)
       ret += size;
     }
 
-  compressed_file = 1;
+  window_to_slide ();
+
+  compressed_file = COMPRESSED_GZIP;
   gunzip_swap_values ();
   /*
    *  Now "gzip_*" values refer to the compressed data.
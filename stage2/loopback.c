@@ -0,0 +1,351 @@
+/* loopback.c - a drive made of a file on another drive */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <shared.h>
+#include <filesys.h>
+
+#ifndef GRUB_UTIL
+
+/* The most pieces a file can be in.  The BIOS stage2 keeps the list in
+   its bss, so it takes fewer.  */
+#ifdef PLATFORM_EFI
+# define LOOP_EXTENTS	512
+#else
+# define LOOP_EXTENTS	128
+#endif
+
+/* How much of the file is mapped at a time.  Nothing is read into the
+   buffer, but the file systems may zero the holes in it.  */
+#define LOOP_MAP_CHUNK	0x100000
+
+/* A piece of the file: LEN bytes from POS on are at the byte HOST of
+   the drive, or are a hole if HOST is 0.  */
+struct loop_extent
+{
+  unsigned long pos;
+  unsigned long len;
+  unsigned long long host;
+};
+
+/* The drive the file is seen as, or -1 if there is none.  */
+int loop_drive = -1;
+
+static int loop_host;
+static struct geometry loop_geom;
+static int loop_bits;
+static unsigned long loop_size;
+
+static struct loop_extent loop_extents[LOOP_EXTENTS];
+static int loop_count;
+
+/* Add what DISK_READ_MAP_ONLY tells of the file to the extents.  */
+static void
+loop_map_helper (int sector, int offset, int length)
+{
+  struct loop_extent *last = loop_count ? &loop_extents[loop_count - 1] : 0;
+  unsigned long long host = 0;
+
+  if (errnum || length <= 0)
+    return;
+
+  if (sector >= 0)
+    host = ((unsigned long long) (unsigned int) sector << loop_bits) + offset;
+
+  if (last && (host ? last->host && last->host + last->len == host
+	       : ! last->host))
+    last->len += length;
+  else if (loop_count == LOOP_EXTENTS)
+    errnum = ERR_WONT_FIT;
+  else
+    {
+      last = &loop_extents[loop_count++];
+      last->pos = loop_size;
+      last->len = length;
+      last->host = host;
+    }
+
+  loop_size += length;
+}
+
+/* Forget the file and its drive.  */
+static void
+loop_free (void)
+{
+  if (loop_drive < 0)
+    return;
+
+  disk_cache_invalidate (loop_drive);
+  if (buf_drive == loop_drive)
+    buf_drive = -1;
+  loop_drive = -1;
+  loop_count = 0;
+  loop_size = 0;
+}
+
+/* Map where FILENAME is on its drive, and make it DRIVE, or the first
+   hard disk there is not if DRIVE is -1.  Nothing of the file is read
+   but what its file system needs to find it.  Return the drive, or -1
+   with ERRNUM set.  */
+int
+loop_setup (char *filename, int drive)
+{
+  char *buf = (char *) RAW_ADDR (0x100000);
+  unsigned long size;
+  int len, opened;
+
+  loop_free ();
+
+  if (drive < 0)
+    {
+      struct geometry geom;
+
+      for (drive = 0x80; drive < 0x80 + MAX_HD_NUM; drive++)
+	if (get_diskinfo (drive, &geom))
+	  break;
+
+      if (drive == 0x80 + MAX_HD_NUM)
+	{
+	  errnum = ERR_NO_DISK_SPACE;
+	  return -1;
+	}
+    }
+
+  /* The data must be on the disk as it is to be read.  */
+#ifndef NO_DECOMPRESSION
+  no_decompression = 1;
+#endif
+  opened = grub_open (filename);
+#ifndef NO_DECOMPRESSION
+  no_decompression = 0;
+#endif
+  if (! opened)
+    return -1;
+
+  loop_host = current_drive;
+  if (loop_host == drive || loop_host == NETWORK_DRIVE
+      || get_diskinfo (loop_host, &loop_geom))
+    {
+      grub_close ();
+      errnum = ERR_DEV_VALUES;
+      return -1;
+    }
+  for (loop_bits = 0; (1 << loop_bits) < loop_geom.sector_size; loop_bits++)
+    ;
+
+  size = filemax;
+  if (size < loop_geom.sector_size)
+    {
+      grub_close ();
+      errnum = ERR_FILELENGTH;
+      return -1;
+    }
+
+  disk_read_hook = loop_map_helper;
+  disk_read_map_only = 1;
+  while (filepos < filemax && ! errnum)
+    {
+      unsigned long mapped = loop_size;
+
+      len = grub_read (buf, LOOP_MAP_CHUNK);
+      if (len <= 0)
+	break;
+
+      /* A file system which can't tell where the data is, such as
+	 the network, read it instead.  */
+      if (loop_size - mapped != (unsigned long) len)
+	errnum = ERR_DEV_VALUES;
+    }
+  disk_read_map_only = 0;
+  disk_read_hook = 0;
+  grub_close ();
+
+  if (! errnum && loop_size != size)
+    errnum = ERR_FILELENGTH;
+  if (errnum)
+    {
+      loop_count = 0;
+      loop_size = 0;
+      return -1;
+    }
+
+  loop_drive = drive;
+  disk_cache_invalidate (drive);
+  if (buf_drive == drive)
+    buf_drive = -1;
+
+  return drive;
+}
+
+/* The number of pieces the file is in.  */
+int
+loop_extent_count (void)
+{
+  return loop_count;
+}
+
+/* The file has the sectors of the drive it is on.  */
+int
+loop_get_diskinfo (struct geometry *geometry)
+{
+  unsigned long sectors = loop_size >> loop_bits;
+
+  geometry->total_sectors = sectors;
+  geometry->sector_size = loop_geom.sector_size;
+  geometry->flags = BIOSDISK_FLAG_LBA_EXTENSION;
+  geometry->sectors = 63;
+  if (sectors / 63 < 255)
+    geometry->heads = 1;
+  else
+    geometry->heads = 255;
+  geometry->cylinders = sectors / 63 / geometry->heads;
+  return 0;
+}
+
+/* Return the extent which has the byte POS of the file.  */
+static struct loop_extent *
+loop_find (unsigned long pos)
+{
+  int lo = 0, hi = loop_count - 1;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi + 1) >> 1;
+
+      if (loop_extents[mid].pos <= pos)
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+
+  return &loop_extents[lo];
+}
+
+/* Read NSEC sectors from SECTOR into BUF, or write them from BUF if
+   WRITE is BIOSDISK_WRITE, and return the same as biosdisk.  A hole,
+   or a piece which does not start a sector on the drive, as the tails
+   packed by ReiserFS, cannot be written.  */
+int
+loop_rw (int write, sector_t sector, int nsec, char *buf)
+{
+  unsigned long pos = (unsigned long) sector << loop_bits;
+  unsigned long len = (unsigned long) nsec << loop_bits;
+  struct loop_extent *e;
+
+  if (sector >= (loop_size >> loop_bits)
+      || nsec > (loop_size >> loop_bits) - sector)
+    return BIOSDISK_ERROR_GEOMETRY;
+
+  for (e = loop_find (pos); len > 0; e++)
+    {
+      unsigned long off = pos - e->pos;
+      unsigned long n = e->len - off;
+      unsigned long long host = e->host + off;
+      int err;
+
+      if (n > len)
+	n = len;
+
+      if (! e->host && write != BIOSDISK_WRITE)
+	grub_memset (buf, 0, n);
+      else if (! e->host || (host & (loop_geom.sector_size - 1))
+	       || (n & (loop_geom.sector_size - 1)))
+	return BIOSDISK_ERROR_GEOMETRY;
+      else
+	{
+	  if (write == BIOSDISK_WRITE)
+	    err = biosdisk_write (loop_host, &loop_geom, host >> loop_bits,
+				  n >> loop_bits, buf);
+	  else
+	    err = biosdisk_read (loop_host, &loop_geom, host >> loop_bits,
+				 n >> loop_bits, buf);
+	  if (err)
+	    return err;
+	}
+
+      buf += n;
+      pos += n;
+      len -= n;
+    }
+
+  /* The bounce buffer, and the cache of the drive under the file,
+     don't hold what they did any more.  */
+  if (write == BIOSDISK_WRITE)
+    {
+      buf_track = -1;
+      disk_cache_invalidate (loop_host);
+    }
+
+  return 0;
+}
+
+/* Read BYTE_LEN bytes from BYTE_OFFSET in SECTOR into BUF, as rawread
+   does, with a rawread of the drive under the file for each piece, so
+   that the data goes from the disk straight into BUF.  */
+int
+loop_read (sector_t sector, int byte_offset, int byte_len, char *buf)
+{
+  void (*read_func) (int, int, int) = disk_read_func;
+  unsigned long pos, len = byte_len;
+  struct loop_extent *e;
+  int ret = 1;
+
+  if (byte_offset < 0 || sector >= (loop_size >> loop_bits))
+    {
+      errnum = ERR_GEOM;
+      return 0;
+    }
+
+  pos = ((unsigned long) sector << loop_bits) + byte_offset;
+  if (pos + len > loop_size)
+    {
+      errnum = ERR_GEOM;
+      return 0;
+    }
+
+  /* The sectors of the drive under the file are none of the caller's
+     business.  */
+  disk_read_func = 0;
+  for (e = loop_find (pos); len > 0 && ret; e++)
+    {
+      unsigned long off = pos - e->pos;
+      unsigned long n = e->len - off;
+      unsigned long long host = e->host + off;
+
+      if (n > len)
+	n = len;
+
+      if (! e->host)
+	grub_memset (buf, 0, n);
+      else
+	ret = rawread (loop_host, host >> loop_bits,
+		       host & (loop_geom.sector_size - 1), n, buf);
+
+      buf += n;
+      pos += n;
+      len -= n;
+    }
+  disk_read_func = read_func;
+
+  if (ret && disk_read_func)
+    disk_read_report (sector, byte_offset, byte_len, loop_bits);
+  return ret;
+}
+
+#endif /* ! GRUB_UTIL */
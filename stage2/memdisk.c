@@ -0,0 +1,247 @@
+/* memdisk.c - a drive kept in memory */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2006  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <shared.h>
+#include <filesys.h>
+
+#if defined(PLATFORM_EFI)
+# include <grub/efi/efi.h>
+#endif
+
+#ifndef GRUB_UTIL
+
+/* The sectors of a hard disk, whatever the firmware uses.  */
+#define MEMDISK_SECTOR_BITS	9
+#define MEMDISK_SECTOR_SIZE	(1 << MEMDISK_SECTOR_BITS)
+
+/* The drive the image is seen as, or -1 if there is none.  */
+int memdisk_drive = -1;
+
+static char *memdisk_addr;
+static unsigned long memdisk_sectors;
+
+#ifdef PLATFORM_EFI
+static grub_efi_uintn_t memdisk_pages;
+#else
+/* What the upper memory was before the image was taken off its top.  */
+static unsigned long memdisk_saved_upper;
+#endif
+
+/* Give back the memory of the image, and forget its drive.  */
+static void
+memdisk_free (void)
+{
+  if (memdisk_drive < 0)
+    return;
+
+#ifdef PLATFORM_EFI
+  grub_efi_free_pages ((grub_addr_t) memdisk_addr, memdisk_pages);
+#else
+  /* Nothing can have been put above the image since, but the planes of
+     a splash image may have been taken below it, and those are kept.  */
+  if (saved_mem_upper == ((unsigned long) memdisk_addr - 0x100000) >> 10)
+    mbi.mem_upper = saved_mem_upper = memdisk_saved_upper;
+#endif
+
+  disk_cache_invalidate (memdisk_drive);
+  if (buf_drive == memdisk_drive)
+    buf_drive = -1;
+  memdisk_drive = -1;
+  memdisk_addr = 0;
+  memdisk_sectors = 0;
+}
+
+/* Find a place for SIZE bytes, and return it, or 0 with ERRNUM set.
+   On EFI, the firmware gives pages of its own; otherwise the image is
+   taken off the top of the upper memory, which nothing else is put in
+   once MBI.MEM_UPPER has been lowered below it.  */
+static char *
+memdisk_alloc (unsigned long size)
+{
+#ifdef PLATFORM_EFI
+  char *addr;
+
+  memdisk_pages = (size + 0xfff) >> 12;
+  addr = grub_efi_allocate_pages (0, memdisk_pages);
+  if (! addr)
+    errnum = ERR_WONT_FIT;
+  return addr;
+#else
+  unsigned long top = (mbi.mem_upper << 10) + 0x100000;
+
+  /* Leave the first 16MB for the kernels, which are loaded at 1MB.  */
+  if (size > top || ((top - size) & ~0xfffUL) < 0x1000000)
+    {
+      errnum = ERR_WONT_FIT;
+      return 0;
+    }
+
+  return (char *) RAW_ADDR ((top - size) & ~0xfffUL);
+#endif
+}
+
+/* Load FILENAME into memory with a single read, and make it DRIVE, or
+   the first hard disk there is not if DRIVE is -1.  Return the drive,
+   or -1 with ERRNUM set.  */
+int
+memdisk_load (char *filename, int drive)
+{
+  unsigned long size;
+  char *addr;
+
+  /* The old image goes first, so that its memory and its drive can be
+     had again.  */
+  memdisk_free ();
+
+  if (drive < 0)
+    {
+      struct geometry geom;
+
+      for (drive = 0x80; drive < 0x80 + MAX_HD_NUM; drive++)
+	if (get_diskinfo (drive, &geom))
+	  break;
+
+      if (drive == 0x80 + MAX_HD_NUM)
+	{
+	  errnum = ERR_NO_DISK_SPACE;
+	  return -1;
+	}
+    }
+
+  if (! grub_open (filename))
+    return -1;
+
+#ifndef PLATFORM_EFI
+  /* The decompressors keep their buffers at the top of the upper
+     memory, where the image would go.  */
+  if (compressed_file)
+    {
+      grub_close ();
+      errnum = ERR_BAD_FILETYPE;
+      return -1;
+    }
+#endif
+
+  size = filemax;
+  if (size < MEMDISK_SECTOR_SIZE)
+    {
+      grub_close ();
+      errnum = ERR_FILELENGTH;
+      return -1;
+    }
+
+  addr = memdisk_alloc (size);
+  if (! addr)
+    {
+      grub_close ();
+      return -1;
+    }
+
+  /* One read of the whole file, so that the network file systems can
+     keep their windows full.  */
+  if (grub_read (addr, -1) != (int) size)
+    {
+      grub_close ();
+#ifdef PLATFORM_EFI
+      grub_efi_free_pages ((grub_addr_t) addr, memdisk_pages);
+#endif
+      if (! errnum)
+	errnum = ERR_FILELENGTH;
+      return -1;
+    }
+  grub_close ();
+
+#ifndef PLATFORM_EFI
+  memdisk_saved_upper = mbi.mem_upper;
+  mbi.mem_upper = saved_mem_upper
+    = ((unsigned long) addr - 0x100000) >> 10;
+#endif
+
+  memdisk_addr = addr;
+  memdisk_sectors = size >> MEMDISK_SECTOR_BITS;
+  memdisk_drive = drive;
+
+  /* The drive may have been a real disk, or the old image, before.  */
+  disk_cache_invalidate (drive);
+  if (buf_drive == drive)
+    buf_drive = -1;
+
+  return drive;
+}
+
+/* The image is addressed linearly, with the sectors of a hard disk,
+   which the ISO 9660 file system reads as well as its own.  */
+int
+memdisk_get_diskinfo (struct geometry *geometry)
+{
+  geometry->total_sectors = memdisk_sectors;
+  geometry->sector_size = MEMDISK_SECTOR_SIZE;
+  geometry->flags = BIOSDISK_FLAG_LBA_EXTENSION;
+  geometry->sectors = 63;
+  if (memdisk_sectors / 63 < 255)
+    geometry->heads = 1;
+  else
+    geometry->heads = 255;
+  geometry->cylinders = memdisk_sectors / 63 / geometry->heads;
+  return 0;
+}
+
+/* Read NSEC sectors from SECTOR into BUF, or write them from BUF if
+   WRITE is BIOSDISK_WRITE, and return the same as biosdisk.  */
+int
+memdisk_rw (int write, sector_t sector, int nsec, char *buf)
+{
+  char *disk = memdisk_addr + (sector << MEMDISK_SECTOR_BITS);
+
+  if (sector >= memdisk_sectors || nsec > memdisk_sectors - sector)
+    return BIOSDISK_ERROR_GEOMETRY;
+
+  if (write == BIOSDISK_WRITE)
+    grub_memmove (disk, buf, nsec << MEMDISK_SECTOR_BITS);
+  else
+    grub_memmove (buf, disk, nsec << MEMDISK_SECTOR_BITS);
+  return 0;
+}
+
+/* Copy BYTE_LEN bytes from BYTE_OFFSET in SECTOR into BUF, as rawread
+   does, with neither the track buffer nor the disk cache in the way.  */
+int
+memdisk_read (sector_t sector, int byte_offset, int byte_len, char *buf)
+{
+  unsigned long long end;
+
+  end = (((unsigned long long) sector << MEMDISK_SECTOR_BITS)
+	 + byte_offset + byte_len);
+  if (byte_offset < 0 || sector >= memdisk_sectors
+      || end > (unsigned long long) memdisk_sectors << MEMDISK_SECTOR_BITS)
+    {
+      errnum = ERR_GEOM;
+      return 0;
+    }
+
+  if (disk_read_func)
+    disk_read_report (sector, byte_offset, byte_len, MEMDISK_SECTOR_BITS);
+
+  grub_memmove (buf, (memdisk_addr + (sector << MEMDISK_SECTOR_BITS)
+		      + byte_offset), byte_len);
+  return ! errnum;
+}
+
+#endif /* ! GRUB_UTIL */
@@ -29,11 +29,40 @@
 static char input_buf[8];
 static int npending = 0;
 
+/* An output buffer, so that the hardware gets many characters at a
+   time.  It is written out at a newline, when it is full, and before
+   any input is looked for.  */
+static char output_buf[64];
+static int nqueued = 0;
+
+/* Where the next character goes, and in which attribute.  */
 static int serial_x;
 static int serial_y;
+static int serial_attr;
+
+/* Where the cursor of the terminal really is, and its attribute.  Moves
+   and attribute changes are only sent when a character needs them.  */
+static int remote_x;
+static int remote_y;
+static int remote_attr;
 
 static int keep_track = 1;
 
+/* What the terminal shows, one cell per character, ORed with
+   SERIAL_STANDOUT if it is in reverse video.  This is known from a
+   clear until the screen scrolls; meanwhile, a character which is
+   already there is not sent again, so that redrawing a menu on top
+   of itself only costs the cells which changed.  */
+#define SERIAL_COLS	80
+#define SERIAL_ROWS	24
+#define SERIAL_STANDOUT	0x100
+
+static unsigned short serial_screen[SERIAL_ROWS][SERIAL_COLS];
+static int serial_screen_valid;
+
+/* More than any cursor address costs.  */
+#define SERIAL_NO_WAY	(SERIAL_COLS * 2)
+
 
 /* Hardware-dependent definitions.  */
 
@@ -48,6 +77,9 @@ struct divisor
 /* Store the port number of a serial unit.  */
 static unsigned short serial_hw_port = 0;
 
+/* How many characters the transmitter takes once it is empty.  */
+static int serial_hw_fifo = 1;
+
 /* The table which lists common configurations.  */
 static struct divisor divisor_tab[] =
   {
@@ -90,21 +122,31 @@ serial_hw_fetch (void)
   return -1;
 }
 
-/* Put a chararacter.  */
+/* Write LEN characters from BUF, as many at a time as the FIFO holds,
+   if there is one.  */
 void
-serial_hw_put (int c)
+serial_hw_write (const char *buf, int len)
 {
-  int timeout = 100000;
-
-  /* Wait until the transmitter holding register is empty.  */
-  while ((inb (serial_hw_port + UART_LSR) & UART_EMPTY_TRANSMITTER) == 0)
+  while (len > 0)
     {
-      if (--timeout == 0)
-	/* There is something wrong. But what can I do?  */
-	return;
-    }
+      int timeout = 100000;
+      int n;
 
-  outb (serial_hw_port + UART_TX, c);
+      /* Wait until the transmitter holding register, or the whole FIFO,
+	 is empty.  */
+      while ((inb (serial_hw_port + UART_LSR) & UART_EMPTY_TRANSMITTER) == 0)
+	{
+	  if (--timeout == 0)
+	    /* There is something wrong. But what can I do?  */
+	    return;
+	}
+
+      for (n = 0; n < serial_hw_fifo && n < len; n++)
+	outb (serial_hw_port + UART_TX, buf[n]);
+
+      buf += n;
+      len -= n;
+    }
 }
 
 void
@@ -164,6 +206,10 @@ serial_hw_init (unsigned short port, unsigned int speed,
 
   /* Enable the FIFO.  */
   outb (port + UART_FCR, UART_ENABLE_FIFO);
+  if ((inb (port + UART_IIR) & UART_FIFO_ENABLED) == UART_FIFO_ENABLED)
+    serial_hw_fifo = UART_FIFO_SIZE;
+  else
+    serial_hw_fifo = 1;
 
   /* Turn on DTR, RTS, and OUT2.  */
   outb (port + UART_MCR, UART_ENABLE_MODEM);
@@ -262,11 +308,162 @@ serial_translate_key_sequence (void)
     }
 }
     
+static void
+flush_output_buf (void)
+{
+  if (nqueued)
+    serial_hw_write (output_buf, nqueued);
+  nqueued = 0;
+}
+
+static void
+queue_output (int c)
+{
+  output_buf[nqueued++] = c;
+  if (nqueued == sizeof (output_buf))
+    flush_output_buf ();
+}
+
+static void
+queue_string (const char *s)
+{
+  while (*s)
+    queue_output (*s++);
+}
+
+/* How much it costs to go right from FROM to X on row Y by sending the
+   characters in between again, which only works if they are in the
+   attribute the terminal is in.  */
+static int
+serial_retype_cost (int from, int x, int y)
+{
+  int i;
+
+  for (i = from; i < x; i++)
+    if ((serial_screen[y][i] & SERIAL_STANDOUT) != remote_attr)
+      return SERIAL_NO_WAY;
+
+  return x - from;
+}
+
+/* Go from FROM to X on row Y by backspaces, by retyping, or by a
+   return and retyping, whichever is the cheapest.  Return the cost,
+   and only send anything if EMIT is nonzero.  */
+static int
+serial_move_in_row (int from, int x, int y, int emit)
+{
+  int back = SERIAL_NO_WAY;
+  int forward = SERIAL_NO_WAY;
+  int ret = 1 + serial_retype_cost (0, x, y);
+  int i;
+
+  if (x <= from)
+    back = from - x;
+  else
+    forward = serial_retype_cost (from, x, y);
+
+  if (back <= forward && back <= ret)
+    {
+      if (emit)
+	for (i = 0; i < back; i++)
+	  queue_output ('\b');
+      return back;
+    }
+
+  if (ret < forward)
+    {
+      from = 0;
+      if (emit)
+	queue_output ('\r');
+    }
+
+  if (emit)
+    for (i = from; i < x; i++)
+      queue_output (serial_screen[y][i]);
+
+  return ret < forward ? ret : forward;
+}
+
+/* Move the cursor of the terminal to X, Y.  While the screen is known,
+   going down with newlines and along the row may beat the cursor
+   address of the terminfo.  The bytes are queued directly, so that
+   this works whichever terminal is current.  */
+static void
+serial_move (int x, int y)
+{
+  char *cup;
+
+  if (x == remote_x && y == remote_y)
+    return;
+
+  cup = ti_cursor_address_string (x, y);
+  if (serial_screen_valid && x < SERIAL_COLS
+      && y >= remote_y && y < SERIAL_ROWS
+      && (y - remote_y + serial_move_in_row (remote_x, x, y, 0)
+	  < grub_strlen (cup)))
+    {
+      for (; remote_y < y; remote_y++)
+	queue_output ('\n');
+      serial_move_in_row (remote_x, x, y, 1);
+    }
+  else
+    {
+      queue_string (cup);
+      remote_y = y;
+    }
+
+  remote_x = x;
+}
+
+static void
+serial_sync_attr (void)
+{
+  if (serial_attr == remote_attr)
+    return;
+
+  keep_track = 0;
+  if (serial_attr)
+    ti_enter_standout_mode ();
+  else
+    ti_exit_standout_mode ();
+  keep_track = 1;
+
+  remote_attr = serial_attr;
+}
+
+/* Put C at the cursor, unless the terminal already shows it there.  */
+static void
+serial_put_cell (int c)
+{
+  int cell = (c & 0xff) | serial_attr;
+  int known = (serial_screen_valid
+	       && serial_x < SERIAL_COLS && serial_y < SERIAL_ROWS);
+
+  if (! known || serial_screen[serial_y][serial_x] != cell)
+    {
+      serial_move (serial_x, serial_y);
+      serial_sync_attr ();
+      queue_output (c);
+      remote_x++;
+
+      if (known)
+	serial_screen[serial_y][serial_x] = cell;
+    }
+
+  serial_x++;
+}
+
 static
 int fill_input_buf (int nowait)
 {
   int i;
 
+  /* Whatever asks for input should be on the screen, with the cursor
+     where it is expected.  */
+  if (serial_screen_valid)
+    serial_move (serial_x, serial_y);
+  flush_output_buf ();
+
   for (i = 0; i < 10000 && npending < sizeof (input_buf); i++)
     {
       int c;
@@ -320,77 +517,170 @@ serial_checkkey (void)
 void
 serial_putchar (int c)
 {
+  if (! keep_track)
+    {
+      queue_output (c);
+      return;
+    }
+
+  /* The serial terminal doesn't have VGA fonts.  */
+  switch (c)
+    {
+    case DISP_UL:
+      c = ACS_ULCORNER;
+      break;
+    case DISP_UR:
+      c = ACS_URCORNER;
+      break;
+    case DISP_LL:
+      c = ACS_LLCORNER;
+      break;
+    case DISP_LR:
+      c = ACS_LRCORNER;
+      break;
+    case DISP_HORIZ:
+      c = ACS_HLINE;
+      break;
+    case DISP_VERT:
+      c = ACS_VLINE;
+      break;
+    case DISP_LEFT:
+      c = ACS_LARROW;
+      break;
+    case DISP_RIGHT:
+      c = ACS_RARROW;
+      break;
+    case DISP_UP:
+      c = ACS_UARROW;
+      break;
+    case DISP_DOWN:
+      c = ACS_DARROW;
+      break;
+    default:
+      break;
+    }
+
   /* Keep track of the cursor.  */
-  if (keep_track)
+  switch (c)
     {
-      /* The serial terminal doesn't have VGA fonts.  */
-      switch (c)
+    case '\r':
+      serial_x = 0;
+      break;
+
+    case '\n':
+      if (serial_screen_valid && serial_y + 1 >= SERIAL_ROWS)
 	{
-	case DISP_UL:
-	  c = ACS_ULCORNER;
-	  break;
-	case DISP_UR:
-	  c = ACS_URCORNER;
-	  break;
-	case DISP_LL:
-	  c = ACS_LLCORNER;
-	  break;
-	case DISP_LR:
-	  c = ACS_LRCORNER;
-	  break;
-	case DISP_HORIZ:
-	  c = ACS_HLINE;
-	  break;
-	case DISP_VERT:
-	  c = ACS_VLINE;
-	  break;
-	case DISP_LEFT:
-	  c = ACS_LARROW;
-	  break;
-	case DISP_RIGHT:
-	  c = ACS_RARROW;
-	  break;
-	case DISP_UP:
-	  c = ACS_UARROW;
-	  break;
-	case DISP_DOWN:
-	  c = ACS_DARROW;
-	  break;
-	default:
-	  break;
+	  /* The screen scrolls, and what it shows after that is anyone's
+	     guess.  */
+	  serial_move (serial_x, serial_y);
+	  serial_screen_valid = 0;
 	}
-      
-      switch (c)
+      serial_y++;
+      break;
+
+    case '\b':
+    case 127:
+      if (serial_x > 0)
+	serial_x--;
+      break;
+
+    case '\a':
+      queue_output (c);
+      return;
+
+    default:
+      if (serial_x >= 79)
 	{
-	case '\r':
-	  serial_x = 0;
-	  break;
-	  
-	case '\n':
-	  serial_y++;
-	  break;
-	  
-	case '\b':
-	case 127:
-	  if (serial_x > 0)
-	    serial_x--;
-	  break;
-	  
-	case '\a':
-	  break;
-	  
-	default:
-	  if (serial_x >= 79)
-	    {
-	      serial_putchar ('\r');
-	      serial_putchar ('\n');
-	    }
-	  serial_x++;
-	  break;
+	  serial_putchar ('\r');
+	  serial_putchar ('\n');
 	}
+      serial_put_cell (c);
+      return;
     }
-  
-  serial_hw_put (c);
+
+  /* While the screen is known, moving the cursor can wait until
+     something is drawn.  */
+  if (! serial_screen_valid)
+    {
+      queue_output (c);
+      remote_x = serial_x;
+      remote_y = serial_y;
+    }
+
+  if (c == '\n')
+    flush_output_buf ();
+}
+
+void
+serial_putstr (const char *str, int len)
+{
+  while (len--)
+    serial_putchar (*str++);
+}
+
+/* Insert COUNT blanks at the cursor if COUNT is positive, or delete
+   -COUNT characters there if it is negative, on the terminal and on
+   what it is known to show alike.  */
+static int
+serial_shift_row (int count)
+{
+  unsigned short *row;
+  int n = count < 0 ? -count : count;
+  int attr = serial_attr;
+  int i;
+
+  if (! serial_screen_valid || serial_x >= SERIAL_COLS
+      || serial_y >= SERIAL_ROWS)
+    return 0;
+
+  if (n > SERIAL_COLS - serial_x)
+    n = SERIAL_COLS - serial_x;
+
+  /* The blanks which come in are plain.  */
+  serial_move (serial_x, serial_y);
+  serial_attr = 0;
+  serial_sync_attr ();
+  serial_attr = attr;
+
+  keep_track = 0;
+  for (i = 0; i < n; i++)
+    if (! (count > 0 ? ti_insert_character () : ti_delete_character ()))
+      break;
+  keep_track = 1;
+
+  /* Without the capability, nothing was sent.  */
+  if (i < n)
+    return 0;
+
+  row = serial_screen[serial_y];
+  if (count > 0)
+    {
+      grub_memmove (row + serial_x + n, row + serial_x,
+		    (SERIAL_COLS - serial_x - n) * sizeof (row[0]));
+      for (i = serial_x; i < serial_x + n; i++)
+	row[i] = ' ';
+    }
+  else
+    {
+      grub_memmove (row + serial_x, row + serial_x + n,
+		    (SERIAL_COLS - serial_x - n) * sizeof (row[0]));
+      for (i = SERIAL_COLS - n; i < SERIAL_COLS; i++)
+	row[i] = ' ';
+    }
+
+  return 1;
+}
+
+int
+serial_insertchars (int count)
+{
+  return serial_shift_row (count);
+}
+
+int
+serial_deletechars (int count)
+{
+  return serial_shift_row (-count);
 }
 
 int
@@ -402,33 +692,40 @@ serial_getxy (void)
 void
 serial_gotoxy (int x, int y)
 {
-  keep_track = 0;
-  ti_cursor_address (x, y);
-  keep_track = 1;
-  
   serial_x = x;
   serial_y = y;
+
+  if (! serial_screen_valid)
+    serial_move (x, y);
 }
 
 void
 serial_cls (void)
 {
+  int x, y;
+
   keep_track = 0;
+  if (remote_attr)
+    ti_exit_standout_mode ();
   ti_clear_screen ();
   keep_track = 1;
-  
+
   serial_x = serial_y = 0;
+  remote_x = remote_y = 0;
+  remote_attr = 0;
+
+  for (y = 0; y < SERIAL_ROWS; y++)
+    for (x = 0; x < SERIAL_COLS; x++)
+      serial_screen[y][x] = ' ';
+
+  /* A dumb terminal may not clear at all.  */
+  serial_screen_valid = ! (current_term->flags & TERM_DUMB);
 }
 
 void
 serial_setcolorstate (color_state state)
 {
-  keep_track = 0;
-  if (state == COLOR_STATE_HIGHLIGHT)
-    ti_enter_standout_mode ();
-  else
-    ti_exit_standout_mode ();
-  keep_track = 1;
+  serial_attr = state == COLOR_STATE_HIGHLIGHT ? SERIAL_STANDOUT : 0;
 }
 
 #endif /* SUPPORT_SERIAL */
@@ -41,6 +41,12 @@
 #define UART_DATA_READY		0x01
 #define UART_EMPTY_TRANSMITTER	0x20
 
+/* For IIR bits: both set if the FIFO is there and enabled.  */
+#define UART_FIFO_ENABLED	0xC0
+
+/* The size of the transmit FIFO of a 16550A.  */
+#define UART_FIFO_SIZE		16
+
 /* The type of parity.  */
 #define UART_NO_PARITY		0x00
 #define UART_ODD_PARITY		0x08
@@ -71,8 +77,8 @@
 /* Fetch a key.  */
 int serial_hw_fetch (void);
 
-/* Put a character.  */
-void serial_hw_put (int c);
+/* Write LEN characters from BUF.  */
+void serial_hw_write (const char *buf, int len);
 
 /* Insert a delay.  */
 void serial_hw_delay (void);
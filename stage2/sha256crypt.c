@@ -13,15 +13,8 @@ typedef size_t uintptr_t;
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 
-/* Structure to save state of computation between the single steps.  */
-struct sha256_ctx
-{
-  uint32_t H[8];
-
-  uint32_t total[2];
-  uint32_t buflen;
-  char buffer[128];	/* NB: always correctly aligned for uint32_t.  */
-};
+/* The structure to save the state of computation between the single
+   steps, struct sha256_ctx, is in shared.h.  */
 
 
 #if 1 /* __BYTE_ORDER == __LITTLE_ENDIAN */
@@ -62,7 +55,8 @@ static const uint32_t K[64] =
 /* Process LEN bytes of BUFFER, accumulating context into CTX.
    It is assumed that LEN % 64 == 0.  */
 static void
-sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
+sha256_process_block_c (const void *buffer, size_t len,
+			struct sha256_ctx *ctx)
 {
   const uint32_t *words = buffer;
   size_t nwords = len / sizeof (uint32_t);
@@ -75,13 +69,6 @@ sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
   uint32_t g = ctx->H[6];
   uint32_t h = ctx->H[7];
 
-  /* First increment the byte count.  FIPS 180-2 specifies the possible
-     length of the file up to 2^64 bits.  Here we only compute the
-     number of bytes.  Do a double word increment.  */
-  ctx->total[0] += len;
-  if (ctx->total[0] < len)
-    ++ctx->total[1];
-
   /* Process all bytes in the buffer with 64 bytes in each round of
      the loop.  */
   while (nwords > 0)
@@ -160,9 +147,159 @@ sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
 }
 
 
+/* The SHA extensions of the x86 processors do four rounds in two
+   instructions.  They need SSE, which the firmware of EFI and the OS
+   under the grub shell have turned on, but which is off in the BIOS
+   Stage 2.  */
+#if (defined(PLATFORM_EFI) || defined(GRUB_UTIL)) \
+    && (defined(__i386__) || defined(__x86_64__)) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define SHA_NI	1
+
+typedef int sha_v4si __attribute__ ((vector_size (16)));
+typedef int sha_v4si_u __attribute__ ((vector_size (16), aligned (1),
+				       may_alias));
+typedef long long sha_v2di __attribute__ ((vector_size (16)));
+typedef short sha_v8hi __attribute__ ((vector_size (16)));
+typedef char sha_v16qi __attribute__ ((vector_size (16)));
+
+/* Whether the processor has the SHA extensions, and SSSE3 and SSE4.1
+   which go with them: 0 if not, 1 if it has, and -1 if it hasn't been
+   asked yet.  */
+static int sha_ni = -1;
+
+static int
+sha256_has_sha_ni (void)
+{
+  unsigned int a, b, c, d;
+
+# define CPUID(leaf)							\
+  asm volatile ("movl %%ebx, %1\n\t"					\
+		"cpuid\n\t"						\
+		"xchgl %%ebx, %1"					\
+		: "=a" (a), "=&r" (b), "=c" (c), "=d" (d)		\
+		: "0" (leaf), "2" (0))
+
+  CPUID (0);
+  if (a < 7)
+    return 0;
+
+  CPUID (1);
+  if (! (c & (1 << 9)) || ! (c & (1 << 19)))
+    return 0;
+
+  CPUID (7);
+  return (b >> 29) & 1;
+# undef CPUID
+}
+
+/* Four rounds from T, with the words of the message schedule in MSG.  */
+# define ROUNDS4(t)							\
+  do									\
+    {									\
+      sha_v4si wk = msg + *(const sha_v4si_u *) &K[t];			\
+      state1 = __builtin_ia32_sha256rnds2 (state1, state0, wk);		\
+      wk = __builtin_ia32_pshufd (wk, 0x0e);				\
+      state0 = __builtin_ia32_sha256rnds2 (state0, state1, wk);		\
+    }									\
+  while (0)
+
+/* The same as sha256_process_block_c, in the layout the instructions
+   want: STATE0 holds A, B, E and F, and STATE1 C, D, G and H.  M holds
+   the last 16 words of the message schedule.  */
+__attribute__ ((target ("sha,ssse3,sse4.1")))
+static void
+sha256_process_block_ni (const void *buffer, size_t len,
+			 struct sha256_ctx *ctx)
+{
+  const sha_v4si_u *words = buffer;
+  const sha_v16qi swap = { 3, 2, 1, 0, 7, 6, 5, 4,
+			   11, 10, 9, 8, 15, 14, 13, 12 };
+  sha_v4si state0, state1, save0, save1, tmp, msg;
+  sha_v4si m[4];
+  unsigned int i;
+
+  tmp = __builtin_ia32_pshufd (*(sha_v4si_u *) &ctx->H[0], 0xb1);
+  state1 = __builtin_ia32_pshufd (*(sha_v4si_u *) &ctx->H[4], 0x1b);
+  state0 = (sha_v4si) __builtin_ia32_palignr128 ((sha_v2di) tmp,
+						 (sha_v2di) state1, 64);
+  state1 = (sha_v4si) __builtin_ia32_pblendw128 ((sha_v8hi) state1,
+						 (sha_v8hi) tmp, 0xf0);
+
+  for (; len; len -= 64)
+    {
+      save0 = state0;
+      save1 = state1;
+
+      for (i = 0; i < 16; i++)
+	{
+	  if (i < 4)
+	    m[i] = (sha_v4si) __builtin_ia32_pshufb128 ((sha_v16qi) *words++,
+							swap);
+	  msg = m[i & 3];
+	  ROUNDS4 (i * 4);
+
+	  /* The next four words of the schedule, in two steps.  */
+	  if (i >= 3 && i < 15)
+	    {
+	      tmp = (sha_v4si) __builtin_ia32_palignr128 ((sha_v2di) m[i & 3],
+							  (sha_v2di)
+							  m[(i - 1) & 3], 32);
+	      m[(i + 1) & 3] = __builtin_ia32_sha256msg2 (m[(i + 1) & 3] + tmp,
+							  m[i & 3]);
+	    }
+	  if (i >= 1 && i < 13)
+	    m[(i - 1) & 3] = __builtin_ia32_sha256msg1 (m[(i - 1) & 3],
+							m[i & 3]);
+	}
+
+      state0 += save0;
+      state1 += save1;
+    }
+
+  tmp = __builtin_ia32_pshufd (state0, 0x1b);
+  state1 = __builtin_ia32_pshufd (state1, 0xb1);
+  *(sha_v4si_u *) &ctx->H[0]
+    = (sha_v4si) __builtin_ia32_pblendw128 ((sha_v8hi) tmp,
+					    (sha_v8hi) state1, 0xf0);
+  *(sha_v4si_u *) &ctx->H[4]
+    = (sha_v4si) __builtin_ia32_palignr128 ((sha_v2di) state1,
+					    (sha_v2di) tmp, 64);
+}
+#endif /* SHA_NI */
+
+
+/* Process LEN bytes of BUFFER, accumulating context into CTX, with the
+   fastest code the processor can run.  It is assumed that LEN % 64 == 0.
+   This is what both the crypt routine and the hashing of files spend
+   their time in.  */
+static void
+sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
+{
+  /* First increment the byte count.  FIPS 180-2 specifies the possible
+     length of the file up to 2^64 bits.  Here we only compute the
+     number of bytes.  Do a double word increment.  */
+  ctx->total[0] += len;
+  if (ctx->total[0] < len)
+    ++ctx->total[1];
+
+#ifdef SHA_NI
+  if (sha_ni < 0)
+    sha_ni = sha256_has_sha_ni ();
+  if (sha_ni)
+    {
+      sha256_process_block_ni (buffer, len, ctx);
+      return;
+    }
+#endif
+
+  sha256_process_block_c (buffer, len, ctx);
+}
+
+
 /* Initialize structure containing state of computation.
    (FIPS 180-2:5.3.2)  */
-static void
+void
 sha256_init_ctx (struct sha256_ctx *ctx)
 {
   ctx->H[0] = 0x6a09e667;
@@ -184,7 +321,7 @@ sha256_init_ctx (struct sha256_ctx *ctx)
 
    IMPORTANT: On some systems it is required that RESBUF is correctly
    aligned for a 32 bits value.  */
-static void *
+void *
 sha256_finish_ctx (struct sha256_ctx *ctx, void *resbuf)
 {
   /* Take yet unprocessed bytes into account.  */
@@ -216,8 +353,9 @@ sha256_finish_ctx (struct sha256_ctx *ctx, void *resbuf)
 }
 
 
-static void
-sha256_process_bytes (const void *buffer, size_t len, struct sha256_ctx *ctx)
+void
+sha256_process_bytes (const void *buffer, unsigned long len,
+		      struct sha256_ctx *ctx)
 {
   /* When we already have some bits in our internal buffer concatenate
      both inputs first.  */
@@ -62,15 +62,43 @@ extern void *grub_scratch_mem;
 
 /*
  *  This is the location of the raw device buffer.  It is 28K
- *  in size.
+ *  in size, except on EFI and in the grub shell; see below.
  */
 
-#define BUFFERLEN   0x7000
-#define BUFFERADDR  RAW_ADDR (0x70000)
-#define BUFFERSEG   RAW_SEG (0x7000)
+#if defined(GRUB_UTIL) || defined(PLATFORM_EFI)
+extern unsigned long grub_buffer_addr;
+extern int grub_bufferlen;
+# define BUFFERLEN   grub_bufferlen
+# define BUFFERADDR  grub_buffer_addr
+# define BUFFERSEG   (BUFFERADDR >> 4)
+#else
+# define BUFFERLEN   0x7000
+# define BUFFERADDR  RAW_ADDR (0x70000)
+# define BUFFERSEG   RAW_SEG (0x7000)
+#endif
+
+/*
+ *  This is the disk cache, which keeps recently read disk blocks of
+ *  DISK_CACHE_BLOCKLEN bytes each.  It is 64K in size.
+ */
+
+#define DISK_CACHE_BUF		RAW_ADDR (0x80000)
+#define DISK_CACHE_BUFLEN	0x10000
+#define DISK_CACHE_BLOCKLEN	0x1000
+#define DISK_CACHE_MAX		(DISK_CACHE_BUFLEN / DISK_CACHE_BLOCKLEN)
 
 #define BOOT_PART_TABLE	RAW_ADDR (0x07be)
 
+/*
+ *  This is where the files of the default entry are prefetched from
+ *  the network during the menu countdown.  The Linux loader copies a
+ *  kernel or an initrd from here to lower addresses only, so it never
+ *  overwrites a file that is still to be loaded.  The Multiboot loader
+ *  gives up the files that a module would be loaded over.
+ */
+
+#define PREFETCH_BUF		RAW_ADDR (0x2000000)
+
 /*
  *  BIOS disk defines
  */
@@ -79,16 +107,42 @@ extern void *grub_scratch_mem;
 #define BIOSDISK_ERROR_GEOMETRY		0x100
 #define BIOSDISK_FLAG_LBA_EXTENSION	0x1
 #define BIOSDISK_FLAG_CDROM		0x2
+/* The BIOS takes 64-bit flat addresses in the disk address packet, as
+   EDD 3.0 has it, so it can read anywhere in memory.  */
+#define BIOSDISK_FLAG_FLAT_ADDRESS	0x4
 
 #define MAX_HD_NUM	128
 
 /*
  *  This is the filesystem (not raw device) buffer.
  *  It is 32K in size, do not overrun!
+ *
+ *  On EFI and in the grub shell, it and the raw device buffer are
+ *  allocated when GRUB starts instead, each as large as the memory
+ *  allows up to FSYS_BUFLEN_MAX and BUFFERLEN_MAX, so FSYS_BUFLEN and
+ *  BUFFERLEN are only known at run time.  The caches which the
+ *  filesystems keep in FSYS_BUF grow with it.  If even the sizes of
+ *  the fixed map can't be had, the buffers are where the map has them.
  */
 
-#define FSYS_BUFLEN  0x8000
-#define FSYS_BUF RAW_ADDR (0x68000)
+#if defined(GRUB_UTIL) || defined(PLATFORM_EFI)
+extern unsigned long grub_fsys_buf;
+extern int grub_fsys_buflen;
+# define FSYS_BUFLEN  grub_fsys_buflen
+# define FSYS_BUF     grub_fsys_buf
+#else
+# define FSYS_BUFLEN  0x8000
+# define FSYS_BUF RAW_ADDR (0x68000)
+#endif
+
+/* Where the fixed map has the two buffers, and the sizes there.  */
+#define FSYS_BUF_FIXED		RAW_ADDR (0x68000)
+#define FSYS_BUFLEN_FIXED	0x8000
+#define BUFFERADDR_FIXED	RAW_ADDR (0x70000)
+#define BUFFERLEN_FIXED		0x7000
+
+#define FSYS_BUFLEN_MAX		0x40000
+#define BUFFERLEN_MAX		0x40000
 
 /* Command-line buffer for Multiboot kernels and modules. This area
    includes the area into which Stage 1.5 and Stage 1 are loaded, but
@@ -132,6 +186,11 @@ extern void *grub_scratch_mem;
 /* The size of the drive map.  */
 #define DRIVE_MAP_SIZE		128
 
+/* Where the sectors start in the read cache of int13_handler, and how
+   many it can have.  */
+#define INT13_CACHE_TAGS	0x400
+#define INT13_CACHE_MAX		120
+
 /* The size of the key map.  */
 #define KEY_MAP_SIZE		128
 
@@ -167,6 +226,11 @@ extern void *grub_scratch_mem;
 #define LINUX_SETUP_MOVE_SIZE		0x9800
 #define LINUX_CL_MAGIC			0xA33F
 
+/* The stacks of the application processors which GRUB starts, above
+   the real mode part of Linux and below the extended BIOS data area.  */
+#define AP_STACK_BUF			RAW_ADDR (0x9A000)
+#define AP_STACK_BUFLEN			0x4000
+
 /*
  *  General disk stuff
  */
@@ -259,7 +323,7 @@ extern void *grub_scratch_mem;
 #define PSEUDO_RM_CSEG	0x18
 #define PSEUDO_RM_DSEG	0x20
 #define STACKOFF	(0x2000 - 0x10)
-#define PROTSTACKINIT   (FSYS_BUF - 0x10)
+#define PROTSTACKINIT   (FSYS_BUF_FIXED - 0x10)
 
 
 /*
@@ -565,6 +629,7 @@ typedef enum
   ERR_DEV_NEED_INIT,
   ERR_NO_DISK_SPACE,
   ERR_NUMBER_OVERFLOW,
+  ERR_VERIFY,
 
   MAX_ERR_NUM
 } grub_error_t;
@@ -589,6 +654,17 @@ extern int use_config_file;
 /* If using the preset menu, this variable is set to non-zero,
    otherwise zero.  */
 extern int use_preset_menu;
+/* If quit only ends one session out of many, this variable is set to
+   non-zero, otherwise zero.  */
+extern int use_sessions;
+/* If the sectors of a file which the host tells are checked against
+   reading it, this variable is set to non-zero, otherwise zero.  */
+extern int verify_blocklists;
+/* The latency of a request of the disks, in microseconds, and their
+   bandwidth, in KB/s, which the disks are made to look like, or zero
+   for as fast as they are.  */
+extern unsigned long disk_latency;
+extern unsigned long disk_bandwidth;
 /* If not using curses, this variable is set to zero, otherwise non-zero.  */
 extern int use_curses;
 /* The flag for verbose messages.  */
@@ -638,13 +714,27 @@ extern int use_pager;
 
 #ifndef NO_DECOMPRESSION
 extern int no_decompression;
+extern int gzip_check_crc;
 extern int compressed_file;
+
+/* The values of compressed_file when it is set.  */
+#define COMPRESSED_GZIP	1
+#define COMPRESSED_XZ	2
+#define COMPRESSED_ZSTD	3
 #endif
 
 /* instrumentation variables */
 extern void (*disk_read_hook) (int, int, int);
 extern void (*disk_read_func) (int, int, int);
 
+#ifndef STAGE1_5
+/* If set, the reads of files only tell DISK_READ_FUNC where the data
+   is, without reading it: each read as a whole, with its first
+   sector, its offset and its length, and each hole in the file as the
+   sector -1.  */
+extern int disk_read_map_only;
+#endif
+
 #ifndef STAGE1_5
 /* The flag for debug mode.  */
 extern int debug;
@@ -654,15 +744,25 @@ extern int debug_graphics;
 /* Verbose mode flag. */
 extern int grub_verbose;
 #define verbose_printf(format...) \
-  do { if (grub_verbose) printf(format); } while (0)
+  do { if (grub_verbose) bootlog_printf(format); } while (0)
 #define grub_verbose_printf(format...) \
-  do { if (grub_verbose) grub_printf(format); } while (0)
+  do { if (grub_verbose) bootlog_printf(format); } while (0)
+
+/* The messages of verbose and debug mode are kept in memory, and go to
+   the console too unless BOOTLOG_CONSOLE is cleared.  */
+extern int bootlog_capture;
+extern int bootlog_console;
 
 extern unsigned long current_drive;
 extern unsigned long current_partition;
 
 extern int fsys_type;
 
+/* A sector number on a disk.  Disks may have more sectors than a long
+   can count, so this is wider, while the sector numbers relative to a
+   partition, which DEVREAD takes, are still ints.  */
+typedef unsigned long long sector_t;
+
 /* The information for a disk geometry. The CHS information is only for
    DOS/Partition table compatibility, and the real number of sectors is
    stored in TOTAL_SECTORS.  */
@@ -675,25 +775,34 @@ struct geometry
   /* The number of sectors */
   unsigned long sectors;
   /* The total number of sectors */
-  unsigned long total_sectors;
+  sector_t total_sectors;
   /* Device sector size */
   unsigned long sector_size;
   /* Flags */
   unsigned long flags;
+  /* Set from the above only when the geometry is loaded into BUF_GEOM:
+     the sector size as a power of two and the mask of an offset in a
+     sector, and the sectors the track buffer is filled with a time */
+  int sector_bits;
+  unsigned long sector_mask;
+  int vtrack_sectors;
 };
 
-extern unsigned long part_start;
-extern unsigned long part_length;
+extern sector_t part_start;
+extern sector_t part_length;
 
 extern int current_slice;
 
 extern int buf_drive;
-extern int buf_track;
+extern sector_t buf_track;
 extern struct geometry buf_geom;
 
 /* these are the current file position and maximum file position */
 extern int filepos;
 extern int filemax;
+#ifndef STAGE1_5
+extern unsigned long filemtime;
+#endif
 
 extern int silent_grub;
 
@@ -736,8 +845,10 @@ void grub_reboot (void) __attribute__ ((noreturn));
    APM even if it is available.  */
 void grub_halt (int no_apm) __attribute__ ((noreturn));
 
-/* Copy MAP to the drive map and set up int13_handler.  */
-void set_int13_handler (unsigned short *map);
+/* Copy MAP to the drive map and set up int13_handler, with a read
+   cache of CACHE_KB kilobytes if it is not zero.  Return the linear
+   address of the handler, the cache being a kilobyte after it.  */
+unsigned long set_int13_handler (unsigned short *map, int cache_kb);
 
 /* Set up int15_handler.  */
 void set_int15_handler (void);
@@ -809,6 +920,10 @@ int get_code_end (void);
 int getrtsecs (void);
 int currticks (void);
 
+/* Let the processor rest until a key may have been pressed or a
+   little time has passed, instead of polling for a key all along.  */
+void idle_wait (void);
+
 /* Clear the screen. */
 void cls (void);
 
@@ -842,11 +957,43 @@ keystatus (void);
 /* Low-level disk I/O */
 int get_diskinfo (int drive, struct geometry *geometry);
 int biosdisk (int subfunc, int drive, struct geometry *geometry,
-	      int sector, int nsec, int segment);
+	      sector_t sector, int nsec, int segment);
+/* Like biosdisk with BIOSDISK_READ, but read into BUF, which may be
+   anywhere in memory.  */
+int biosdisk_read (int drive, struct geometry *geometry,
+		   sector_t sector, int nsec, char *buf);
+/* Likewise, write NSEC sectors from BUF with BIOSDISK_WRITE.  */
+int biosdisk_write (int drive, struct geometry *geometry,
+		    sector_t sector, int nsec, char *buf);
+#ifdef PLATFORM_EFI
+/* Start reading NSEC sectors from SECTOR in DRIVE in the background,
+   if the disk can, and return non-zero if it can.  */
+int biosdisk_readahead (int drive, sector_t sector, int nsec);
+#endif
 void stop_floppy (void);
 int get_sector_size (int drive);
 int get_sector_bits (int drive);
 
+#if ! defined(STAGE1_5) && ! defined(GRUB_UTIL)
+/* The drive loaded into memory by the memdisk command, or -1.  */
+extern int memdisk_drive;
+int memdisk_load (char *filename, int drive);
+int memdisk_get_diskinfo (struct geometry *geometry);
+/* Like biosdisk, with BUF in place of the segment.  */
+int memdisk_rw (int write, sector_t sector, int nsec, char *buf);
+/* Like rawread.  */
+int memdisk_read (sector_t sector, int byte_offset, int byte_len,
+		  char *buf);
+
+/* The drive made of a file by the loopback command, or -1.  */
+extern int loop_drive;
+int loop_setup (char *filename, int drive);
+int loop_extent_count (void);
+int loop_get_diskinfo (struct geometry *geometry);
+int loop_rw (int write, sector_t sector, int nsec, char *buf);
+int loop_read (sector_t sector, int byte_offset, int byte_len, char *buf);
+#endif
+
 /* Command-line interface functions. */
 #ifndef STAGE1_5
 
@@ -897,6 +1044,19 @@ void init_builtins (void);
 void init_config (void);
 char *skip_to (int after_equal, char *cmdline);
 struct builtin *find_command (char *command);
+
+/* A config file as the compilemenu command writes it, next to the
+   config file with COMPILED_MENU_SUFFIX added to its name: the magic,
+   the size and the modification time of the config file, four bytes
+   each with the least significant first, and then the lines that
+   get_line_from_config reads from it, each ended by a NUL, up to an
+   empty one.  */
+#define COMPILED_MENU_MAGIC		"GRUBMENU"
+#define COMPILED_MENU_MAGIC_LEN		8
+#define COMPILED_MENU_HEADER_LEN	(COMPILED_MENU_MAGIC_LEN + 8)
+#define COMPILED_MENU_SUFFIX		".compiled"
+
+int get_line_from_config (char *cmdline, int maxlen, int read_from_file);
 void enter_cmdline (char *heap, int forever);
 int run_script (char *script, char *heap);
 
@@ -910,6 +1070,9 @@ void print_cmdline_message (int type);
 
 /* C library replacement functions with identical semantics. */
 int grub_vsprintf (char *str, const char *fmt, va_list args);
+void bootlog_write (const char *str, int len);
+void bootlog_vprintf (const char *format, va_list args);
+void bootlog_printf (const char *format, ...);
 void grub_printf (char *format,...);
 int grub_sprintf (char *buffer, const char *format, ...);
 int grub_tolower (int c);
@@ -969,18 +1132,75 @@ int get_based_digit (int c, int base);
 int safe_parse_maxint (char **str_ptr, int *myint_ptr);
 int memcheck (int start, int len);
 void grub_putstr (const char *str);
+void grub_putmem (const char *str, int len);
 
 #ifndef NO_DECOMPRESSION
 /* Compression support. */
 int gunzip_test_header (void);
 int gunzip_read (char *buf, int len);
+int unxz_test_header (unsigned char *magic);
+int unxz_read (char *buf, int len);
+int unzstd_test_header (unsigned char *magic);
+int unzstd_read (char *buf, int len);
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+int unzstd_buffer (char *src, int len, char *dest, int size);
+#endif
 #endif /* NO_DECOMPRESSION */
 
-int rawread (int drive, int sector, int byte_offset, int byte_len, char *buf);
+int rawread (int drive, sector_t sector, int byte_offset, int byte_len,
+	     char *buf);
 int devread (int sector, int byte_offset, int byte_len, char *buf);
-int rawwrite (int drive, int sector, char *buf);
+int fsys_read_extents (char *buf, int len, int block_bits,
+		       int (*map) (int block, int *run));
+#ifndef STAGE1_5
+/* Tell DISK_READ_FUNC about a read, sector by sector.  */
+void disk_read_report (sector_t sector, int byte_offset, int byte_len,
+		       int sector_bits);
+/* How much a file system should ask devreadahead for at a time.  */
+#define READAHEAD_LEN	0x100000
+int readahead_possible (void);
+void devreadahead (int sector, int byte_offset, int byte_len);
+void probe_ahead (unsigned long drive, unsigned long partition);
+#endif
+int rawwrite (int drive, sector_t sector, char *buf);
 int devwrite (int sector, int sector_len, char *buf);
 
+#ifndef STAGE1_5
+/* The number of blocks the disk cache may use, and its statistics.  */
+extern int disk_cache_size;
+extern unsigned long disk_cache_hits;
+extern unsigned long disk_cache_misses;
+/* Counts the calls of disk_cache_invalidate, so that caches kept
+   elsewhere can tell when what they hold may have gone stale.  */
+extern unsigned long disk_cache_generation;
+
+/* Forget the cached blocks of DRIVE, or of all drives if DRIVE is -1.  */
+void disk_cache_invalidate (int drive);
+
+# if ! defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+/* The hard disks the read cache of int13_handler may be for, a bit
+   for each from 0x80 on, and filling it at AREA, as set_int13_handler
+   returns, from the disk cache.  */
+unsigned short int13_cache_disks (void);
+void int13_cache_fill (unsigned long area, int cache_kb,
+		       unsigned short disks);
+# endif
+
+# if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+/* The files fetched from the network drive in this session, kept whole
+   in up to NET_CACHE_BUDGET bytes, so that opening one again doesn't go
+   to the server.  */
+#  define NET_CACHE	1
+extern unsigned long net_cache_budget;
+extern unsigned long net_cache_used;
+extern unsigned long net_cache_hits;
+extern unsigned long net_cache_misses;
+
+/* Forget all the files, and return how many there were.  */
+int net_cache_flush (void);
+# endif
+#endif
+
 /* Parse a device string and initialize the global parameters. */
 char *set_device (char *device);
 int open_device (void);
@@ -988,7 +1208,7 @@ int real_open_partition (int flags);
 int open_partition (void);
 int next_partition (unsigned long drive, unsigned long dest,
 		    unsigned long *partition, int *type,
-		    unsigned long *start, unsigned long *len,
+		    sector_t *start, sector_t *len,
 		    unsigned long *offset, int *entry,
                    unsigned long *ext_offset,
                    unsigned long *gpt_offset, int *gpt_count,
@@ -1011,9 +1231,49 @@ int grub_read (char *buf, int len);
 /* Reposition a file offset.  */
 int grub_seek (int offset);
 
+#ifndef STAGE1_5
+/* Read the next byte of the file into BYTE, a buffer at a time.  */
+int grub_read_byte (char *byte);
+int grub_read_byte_offset (void);
+
+/* A piece of the open file for grub_readv: LEN bytes from POS on, to
+   be read into BUF.  */
+struct grub_iovec
+{
+  int pos;
+  int len;
+  char *buf;
+};
+
+/* Read the COUNT pieces of the file in IOV, in whatever order the
+   disk reads them best.  Return non-zero if all of them were read as
+   a whole, or 0 with ERRNUM set.  */
+int grub_readv (struct grub_iovec *iov, int count);
+#endif
+
 /* Close a file.  */
 void grub_close (void);
 
+#ifndef STAGE1_5
+/* Prefetch the file FILENAME, on DEVICE if it is not zero, a little at
+   each call of PREFETCH_POLL, so that GRUB_OPEN finds it in memory
+   later.  */
+void prefetch_add (char *device, char *filename);
+int prefetch_poll (void);
+/* Fetch the rest of the files now, or give up the file being fetched.  */
+void prefetch_finish (void);
+void prefetch_stop (void);
+/* The size of FILENAME, looked at without disturbing the prefetching,
+   or -1.  */
+int prefetch_check (char *filename);
+/* Where the prefetched files end in memory, which loaders writing
+   above PREFETCH_BUF must keep below until they have read them.  */
+unsigned long prefetch_end (void);
+/* Forget the prefetched files in the way of LEN bytes loaded at ADDR,
+   and return nonzero if the file open now was one of them.  */
+int prefetch_clobber (unsigned long addr, unsigned long len);
+#endif /* ! STAGE1_5 */
+
 /* List the contents of the directory that was opened with GRUB_OPEN,
    printing all completions. */
 int dir (char *dirname);
@@ -1039,6 +1299,8 @@ void bsd_boot (kernel_t type, int bootdev, char *arg)
 /* Define flags for load_image here.  */
 /* Don't pass a Linux's mem option automatically.  */
 #define KERNEL_LOAD_NO_MEM_OPTION	(1 << 0)
+/* Don't load the symbols of an a.out or ELF kernel.  */
+#define KERNEL_LOAD_NO_SYMBOLS		(1 << 1)
 
 kernel_t load_image (char *kernel, char *arg, kernel_t suggested_type,
 		     unsigned long load_flags);
@@ -1046,19 +1308,74 @@ kernel_t load_image (char *kernel, char *arg, kernel_t suggested_type,
 int load_module (char *module, char *arg);
 int load_initrd (char *initrd);
 
+/* The archive made in memory of the --cpio options to initrd.  */
+int initrd_cpio_option (char *arg);
+int initrd_cpio_size (char *initrd);
+int initrd_cpio_build (char *initrd, char *addr);
+
+/* The index of the UUIDs and labels of the file systems on the disks,
+   for the search command.  */
+int fsid_search (const char *key, int by_label,
+		 unsigned long *drive, unsigned long *partition);
+void fsid_print (void);
+
 int check_password(char *entered, char* expected, password_t type);
 
 char *sha256_crypt (const char *key, const char *salt);
 char *sha512_crypt (const char *key, const char *salt);
+
+/* SHA-256, from sha256crypt.c, for hashing files as they are read.  */
+struct sha256_ctx
+{
+  unsigned int H[8];
+
+  unsigned int total[2];
+  unsigned int buflen;
+  char buffer[128];	/* NB: always correctly aligned for uint32_t.  */
+};
+
+void sha256_init_ctx (struct sha256_ctx *ctx);
+void sha256_process_bytes (const void *buffer, unsigned long len,
+			   struct sha256_ctx *ctx);
+void *sha256_finish_ctx (struct sha256_ctx *ctx, void *resbuf);
 #endif
 
 void init_bios_info (void);
 
+#ifndef GRUB_UTIL
+/* The other processors: through the MP services of the firmware on
+   EFI, or started by GRUB itself from the MP table otherwise.  */
+int grub_mp_count (void);
+int grub_mp_start (void (*func) (void *), void *arg);
+void grub_mp_wait (void);
+# ifndef PLATFORM_EFI
+/* Give the processors back, before a kernel is booted.  */
+void grub_mp_fini (void);
+/* Where an application processor goes from asm.S, to wait for work.  */
+void imps_ap_main (void);
+# endif
+#endif
+
 #ifdef PLATFORM_EFI
+# ifndef GRUB_UTIL
+/* The EFI pool allocator, which <grub/misc.h> declares too.  That can't
+   be included with <gpt.h>, whose types clash with it, but its
+   grub_size_t is the compiler's size_t on ia32 and x86_64 alike.  */
+void *grub_malloc (__SIZE_TYPE__ size);
+void grub_free (void *ptr);
+# endif
+
 void grub_set_config_file (char *path_name);
 int grub_save_saved_default (int new_default);
 extern int check_device (const char *device);
 extern void assign_device_name (int drive, const char *device);
+
+# ifdef EFI_CALL_TRACE
+/* Print how often each firmware service was called and how long the
+   calls took, or forget it.  */
+void grub_efi_trace_print (void);
+void grub_efi_trace_reset (void);
+# endif
 #endif
 int grub_load_linux (char *kernel, char *arg);
 int grub_load_initrd (char *initrd);
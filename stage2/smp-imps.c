@@ -63,7 +63,7 @@
  */
 
 #define IMPS_DEBUG
-#define KERNEL_PRINT(x)         printf x
+#define KERNEL_PRINT(x)         do { if (! imps_quiet) printf x; } while (0)
 #define CMOS_WRITE_BYTE(x, y)	cmos_write_byte(x, y)
 #define CMOS_READ_BYTE(x)	cmos_read_byte(x)
 #define PHYS_TO_VIRTUAL(x)	(x)
@@ -120,6 +120,11 @@ cmos_read_byte (int loc)
 #define		CMOS_RESET_JUMP		0xa
 #define CMOS_BASE_MEMORY		0x15
 
+/* The stack each application processor which is kept for work has,
+   in AP_STACK_BUF, and so the most of them.  */
+#define IMPS_AP_STACK_SIZE		0x1000
+#define IMPS_MAX_APS			(AP_STACK_BUFLEN / IMPS_AP_STACK_SIZE)
+
 
 /*
  *  Static defines here for SMP use.
@@ -277,6 +282,32 @@ static unsigned imps_lapic_addr = ((unsigned) (&lapic_dummy)) - LAPIC_ID;
 static unsigned char imps_cpu_apic_map[IMPS_MAX_CPUS];
 static unsigned char imps_apic_cpu_map[IMPS_MAX_CPUS];
 
+/*
+ *  Nothing is printed while the processors are probed for work.
+ */
+static int imps_quiet = 0;
+
+/*
+ *  The application processors which have been started wait in
+ *  "imps_ap_main" for a job, and are marked in "imps_ap_parked" by
+ *  their APIC id.  "imps_ap_stack" is the top of the stack of the one
+ *  being started, and "imps_ap_alive" is set once it is running.
+ */
+static unsigned char imps_ap_parked[IMPS_MAX_CPUS];
+static int imps_ap_count = 0;
+static int imps_ap_probed = 0;
+unsigned imps_ap_stack;
+static volatile int imps_ap_alive;
+
+/*
+ *  The job the parked processors run: a new one is given by bumping
+ *  "imps_job_gen", and "imps_job_busy" counts those still at it.
+ */
+static void (*volatile imps_job_func) (void *);
+static void *volatile imps_job_arg;
+static volatile unsigned imps_job_gen = 0;
+static volatile int imps_job_busy = 0;
+
 
 /*
  *  MPS checksum function
@@ -298,23 +329,106 @@ get_checksum (unsigned start, int length)
 }
 
 
+/*
+ *  Wait for about "us" microseconds.  A write to the POST code port
+ *  takes about one on any PC, whatever the speed of the processor.
+ */
+
+static void
+imps_delay (int us)
+{
+  while (us-- > 0)
+    {
+      outb (0x80, 0);
+    }
+}
+
+
+/*
+ *  Send the interprocessor interrupt "cmd" to the local APIC "apicid",
+ *  and wait for it to be taken.
+ */
+
+static void
+send_ipi (int apicid, unsigned cmd)
+{
+  int i;
+
+  IMPS_LAPIC_WRITE (LAPIC_ICR_DEST, apicid << 24);
+  IMPS_LAPIC_WRITE (LAPIC_ICR, cmd);
+
+  for (i = 0; i < 1000 && (IMPS_LAPIC_READ (LAPIC_ICR) & LAPIC_ICR_BUSY); i++)
+    {
+      imps_delay (1);
+    }
+}
+
+
+/*
+ *  Where the application processors go from "ap_trampoline", on their
+ *  own stacks, to wait for the jobs given by "grub_mp_start".
+ */
+
+void
+imps_ap_main (void)
+{
+  unsigned seen = imps_job_gen;
+
+  __sync_synchronize ();
+  imps_ap_alive = 1;
+
+  for (;;)
+    {
+      while (imps_job_gen == seen)
+	{
+	  asm volatile ("pause");
+	}
+      seen = imps_job_gen;
+
+      (*imps_job_func) (imps_job_arg);
+      __sync_fetch_and_sub (&imps_job_busy, 1);
+    }
+}
+
+
 /*
  *  Primary function for booting individual CPUs.
  *
- *  This must be modified to perform whatever OS-specific initialization
- *  that is required.
+ *  The CPU is sent an INIT, which the old 82489DX APICs follow through
+ *  the BIOS reset vector, and then the STARTUPs the integrated ones
+ *  want, and goes through "ap_trampoline", copied to the scratch page,
+ *  into "imps_ap_main".  A CPU which is already there is left alone.
  */
 
 static int
 boot_cpu (imps_processor * proc)
 {
-  unsigned bootaddr, accept_status;
+  unsigned bootaddr, accept_status = 0;
   unsigned bios_reset_vector = PHYS_TO_VIRTUAL (BIOS_RESET_VECTOR);
+  extern char ap_trampoline[], ap_trampoline_end[];
+  int apicid = proc->apic_id, i;
 
-  /* %%%%% ESB */
-  extern char patch_code[];
-  bootaddr = 256 * 1024;
-  memmove ((char *) bootaddr, patch_code, 32);
+  if (imps_ap_parked[apicid])
+    {
+      KERNEL_PRINT (("waiting for work\n"));
+      return 1;
+    }
+
+  /* the extended BIOS data area may reach down into AP_STACK_BUF */
+  if (imps_ap_count == IMPS_MAX_APS
+      || (AP_STACK_BUF + (imps_ap_count + 1) * IMPS_AP_STACK_SIZE
+	  > RAW_ADDR (mbi.mem_lower << 10)))
+    {
+      KERNEL_PRINT (("not started, no stack left\n"));
+      return 0;
+    }
+
+  bootaddr = SCRATCHADDR;
+  memmove ((char *) bootaddr, ap_trampoline,
+	   ap_trampoline_end - ap_trampoline);
+  imps_ap_stack = (AP_STACK_BUF
+		   + (imps_ap_count + 1) * IMPS_AP_STACK_SIZE);
+  imps_ap_alive = 0;
 
   /*
    *  Generic CPU startup sequence starts here.
@@ -331,16 +445,27 @@ boot_cpu (imps_processor * proc)
       accept_status = IMPS_LAPIC_READ (LAPIC_ESR);
     }
 
-#if 0
-  /* assert INIT IPI */
-  cfg = IMPS_LAPIC_READ (LAPIC_ICR + 1);
-  cfg &= LAPIC_DEST_MASK;
-  IMPS_LAPIC_WRITE (LAPIC_ICR + 1, cfg);
-  cfg = IMPS_LAPIC_READ (LAPIC_ACR);
-  cfg &=;
-
-  /* %%%%% ESB finish adding startup sequence */
-#endif
+  /* assert and deassert INIT IPI */
+  send_ipi (apicid, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+  send_ipi (apicid, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL);
+  imps_delay (10000);
+
+  /* send the STARTUP IPIs, for all but the 82489DX */
+  if (proc->apic_ver & 0x10)
+    {
+      for (i = 0; i < 2 && !imps_ap_alive; i++)
+	{
+	  send_ipi (apicid, LAPIC_ICR_STARTUP | (bootaddr >> 12));
+	  imps_delay (200);
+	}
+      accept_status = IMPS_LAPIC_READ (LAPIC_ESR) & 0xEF;
+    }
+
+  /* give it a second to get going */
+  for (i = 0; i < 10000 && !imps_ap_alive; i++)
+    {
+      imps_delay (100);
+    }
 
   /* clean up BIOS reset vector */
   CMOS_WRITE_BYTE (CMOS_RESET_CODE, 0);
@@ -350,11 +475,17 @@ boot_cpu (imps_processor * proc)
    *  Generic CPU startup sequence ends here.
    */
 
-  KERNEL_PRINT (("\n"));
+  if (!imps_ap_alive)
+    {
+      KERNEL_PRINT (("not responding (APIC error 0x%x)\n", accept_status));
+      return 0;
+    }
 
-  return 1;
+  imps_ap_parked[apicid] = 1;
+  imps_ap_count++;
+  KERNEL_PRINT (("#%d  Application Processor (AP)\n", imps_num_cpus));
 
-  /* XXXXX add OS-specific initialization here! */
+  return 1;
 }
 
 
@@ -754,3 +885,97 @@ imps_probe (void)
 
   return 0;
 }
+
+
+/*
+ *  The interface the rest of GRUB uses, the same as the one on EFI.
+ *
+ *  Return how many application processors there are to run work on,
+ *  starting them quietly the first time.
+ */
+
+int
+grub_mp_count (void)
+{
+  if (!imps_ap_probed)
+    {
+      imps_ap_probed = 1;
+      imps_quiet = 1;
+      imps_probe ();
+      imps_quiet = 0;
+    }
+
+  return imps_ap_count;
+}
+
+
+/*
+ *  Start "func" ("arg") on every parked application processor, and
+ *  return at once.  Return zero if there is none, or if they are still
+ *  at the last job.
+ */
+
+int
+grub_mp_start (void (*func) (void *), void *arg)
+{
+  if (!grub_mp_count () || imps_job_busy)
+    {
+      return 0;
+    }
+
+  imps_job_func = func;
+  imps_job_arg = arg;
+  imps_job_busy = imps_ap_count;
+  __sync_synchronize ();
+  imps_job_gen++;
+
+  return 1;
+}
+
+
+/*
+ *  Wait until the processors started by "grub_mp_start" are all done.
+ */
+
+void
+grub_mp_wait (void)
+{
+  while (imps_job_busy)
+    {
+      asm volatile ("pause");
+    }
+}
+
+
+/*
+ *  Send the parked processors an INIT, which leaves them waiting for a
+ *  STARTUP as the BIOS did, so that a kernel can start them.
+ */
+
+void
+grub_mp_fini (void)
+{
+  int apicid;
+
+  if (!imps_ap_count)
+    {
+      imps_ap_probed = 0;
+      return;
+    }
+
+  grub_mp_wait ();
+
+  for (apicid = 0; apicid < IMPS_MAX_CPUS; apicid++)
+    {
+      if (imps_ap_parked[apicid])
+	{
+	  send_ipi (apicid,
+		    LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+	  send_ipi (apicid, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL);
+	  imps_ap_parked[apicid] = 0;
+	}
+    }
+
+  imps_ap_count = 0;
+  imps_ap_probed = 0;
+}
@@ -19,11 +19,38 @@
 
 #include <shared.h>
 #include <term.h>
+#include <bootprof.h>
 
 grub_jmp_buf restart_env;
 
 int silent_grub = 0;
 
+/* With no menu to show and no time to wait, cmain reads the config
+   file only up to the entries that booting the default may need, and
+   doesn't start the terminal.  MENU_PARTIAL is whether it stopped
+   before the end, and MENU_READ_ALL makes it read to the end the next
+   time, for the menu to be shown after all.  */
+static int menu_partial;
+static int menu_read_all;
+
+/* Return how many entries booting the default entry at once may need,
+   with its fallbacks, or 0 if the menu may be shown.  */
+static int
+fast_boot_entries (void)
+{
+  int i, n = default_entry + 1;
+
+  if (menu_read_all || show_menu || grub_timeout != 0)
+    return 0;
+
+  if (fallback_entryno >= 0)
+    for (i = 0; i < MAX_FALLBACK_ENTRIES && fallback_entries[i] >= 0; i++)
+      if (fallback_entries[i] >= n)
+	n = fallback_entries[i] + 1;
+
+  return n;
+}
+
 #if defined(PRESET_MENU_STRING) || defined(SUPPORT_DISKLESS)
 
 # if defined(PRESET_MENU_STRING)
@@ -229,14 +256,353 @@ print_border (int y, int size)
     current_term->setcolorstate (COLOR_STATE_STANDARD);
 }
 
+/* Queue the files that the kernel, initrd and module commands in ENTRY
+   load for prefetching.  */
+static void
+prefetch_entry (char *entry)
+{
+  char *device = 0;
+
+  for (; *entry; entry += grub_strlen (entry) + 1)
+    {
+      struct builtin *builtin = find_command (entry);
+      char *arg;
+
+      errnum = ERR_NONE;
+      if (! builtin)
+	continue;
+
+      arg = skip_to (1, entry);
+      if (! grub_strcmp (builtin->name, "root")
+	  || ! grub_strcmp (builtin->name, "rootnoverify"))
+	device = arg;
+      else if (! grub_strcmp (builtin->name, "kernel")
+	       || ! grub_strcmp (builtin->name, "module")
+	       || ! grub_strcmp (builtin->name, "modulenounzip"))
+	{
+	  while (*arg == '-' && arg[1] == '-')
+	    arg = skip_to (0, arg);
+	  if (*arg)
+	    prefetch_add (device, arg);
+	}
+      else if (! grub_strcmp (builtin->name, "initrd"))
+	for (; *arg; arg = skip_to (0, arg))
+	  prefetch_add (device, arg);
+    }
+}
+
+/* When the menu comes from the config file, only the titles are kept
+   in memory, and ENTRY_OFFSETS says where in the file the commands of
+   each entry start.  They are read again when the entry is wanted,
+   from the root the file was opened on, and from the compiled menu if
+   ENTRY_FROM is 2.  For the preset menu, this is zero and
+   CONFIG_ENTRIES holds the commands.  */
+static int *entry_offsets;
+static int entry_from;
+static unsigned long entry_drive;
+static unsigned long entry_partition;
+
+/* The name of the compiled menu of CONFIG_FILE.  */
+static char compiled_file[128 + sizeof (COMPILED_MENU_SUFFIX)];
+
+static unsigned long
+compiled_menu_long (unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+/* Open the menu compiled from CONFIG_FILE if it was compiled from the
+   file as it is now, past its header, and CONFIG_FILE itself if not.
+   A compiled menu goes with a config file of the same size and
+   modification time, or only of the same size over the network, where
+   the size is all there is to go by.  Return 2 for the compiled menu,
+   1 for CONFIG_FILE and 0 if neither can be opened, as READ_FROM_FILE
+   of get_line_from_config wants it.  */
+static int
+open_config_file (void)
+{
+  unsigned char header[COMPILED_MENU_HEADER_LEN];
+  int len = grub_strlen (config_file);
+  int compiled = 0;
+
+  if (len + sizeof (COMPILED_MENU_SUFFIX) <= sizeof (compiled_file))
+    {
+      grub_memmove (compiled_file, config_file, len);
+      grub_memmove (compiled_file + len, COMPILED_MENU_SUFFIX,
+		    sizeof (COMPILED_MENU_SUFFIX));
+      if (grub_open (compiled_file))
+	{
+	  compiled = (grub_read ((char *) header, sizeof (header))
+		      == sizeof (header)
+		      && ! grub_memcmp ((char *) header, COMPILED_MENU_MAGIC,
+					COMPILED_MENU_MAGIC_LEN));
+	  grub_close ();
+	}
+      errnum = ERR_NONE;
+    }
+
+  if (! grub_open (config_file))
+    {
+      errnum = ERR_NONE;
+      return 0;
+    }
+
+  if (! compiled
+      || (compiled_menu_long (header + COMPILED_MENU_MAGIC_LEN)
+	  != (unsigned long) filemax)
+      || (filemtime
+	  ? (compiled_menu_long (header + COMPILED_MENU_MAGIC_LEN + 4)
+	     != filemtime)
+	  : current_drive != NETWORK_DRIVE))
+    return 1;
+
+  grub_close ();
+  if (grub_open (compiled_file)
+      && grub_seek (COMPILED_MENU_HEADER_LEN) == COMPILED_MENU_HEADER_LEN)
+    return 2;
+
+  grub_close ();
+  errnum = ERR_NONE;
+  if (grub_open (config_file))
+    return 1;
+
+  errnum = ERR_NONE;
+  return 0;
+}
+
+/* As many offsets as fit in MENU_BUF.  */
+#define MAX_LAZY_ENTRIES	(MENU_BUFLEN / sizeof (int))
+
+/* Read the commands of entry NUM into BUF, in the same form as in
+   CONFIG_ENTRIES, and return the end of them.  */
+static char *
+load_entry (int num, char *buf)
+{
+  unsigned long drive = saved_drive;
+  unsigned long partition = saved_partition;
+  char *ptr = buf;
+
+  saved_drive = entry_drive;
+  saved_partition = entry_partition;
+
+  if (grub_open (entry_from == 2 ? compiled_file : config_file))
+    {
+      grub_seek (entry_offsets[num]);
+      while (get_line_from_config (ptr, NEW_HEAPSIZE, entry_from))
+	{
+	  struct builtin *builtin = find_command (ptr);
+
+	  if (builtin && (builtin->flags & BUILTIN_TITLE))
+	    break;
+	  /* Unknown commands are not kept, as in cmain.  */
+	  if (builtin)
+	    ptr += grub_strlen (ptr) + 1;
+	}
+
+      grub_close ();
+    }
+
+  errnum = ERR_NONE;
+  saved_drive = drive;
+  saved_partition = partition;
+
+  *ptr++ = 0;
+  return ptr;
+}
+
+/* Return the commands of entry NUM.  If they have to be read from the
+   config file, that is done at *HEAP, which is moved past them.  */
+static char *
+get_config_entry (char *config_entries, int num, char **heap)
+{
+  char *entry;
+
+  if (! entry_offsets)
+    return get_entry (config_entries, num, 1);
+
+  entry = *heap;
+  *heap = load_entry (num, entry);
+  return entry;
+}
+
+/* The entries that booting the default one may go through, first the
+   default and then its fallbacks, with their commands, which are looked
+   at while the countdown runs.  If a file that one of them loads is
+   missing, it is known to fail, and the next fallback is taken instead
+   of loading the ones before the missing file for nothing.  */
+#define CHECK_MAX	(MAX_FALLBACK_ENTRIES + 1)
+#define CHECK_NAME_LEN	256
+/* No kernel is smaller than the sector its header is in.  */
+#define CHECK_KERNEL_MIN	512
+
+static int check_entries[CHECK_MAX];
+static char *check_commands[CHECK_MAX];
+static int check_failed[CHECK_MAX];
+static int check_count;
+/* How many of them have been looked at.  */
+static int check_done;
+
+/* Read the commands of the default entry, NUM, and of its fallbacks at
+   HEAP, to be looked at by CHECK_POLL later.  They are read now, since
+   reading the config file then would make the prefetched files be
+   dropped.  */
+static void
+check_start (char *config_entries, int num, char *heap)
+{
+  int i;
+
+  check_done = 0;
+  check_entries[0] = num;
+  check_count = 1;
+  if (fallback_entryno >= 0)
+    for (i = fallback_entryno;
+	 i < MAX_FALLBACK_ENTRIES && fallback_entries[i] >= 0; i++)
+      check_entries[check_count++] = fallback_entries[i];
+
+  for (i = 0; i < check_count; i++)
+    check_commands[i] = get_config_entry (config_entries, check_entries[i],
+					  &heap);
+}
+
+/* Whether the file that ARG names is missing, or is smaller than MIN
+   bytes.  A block list is not looked at.  */
+static int
+check_file (char *arg, int min)
+{
+  char name[CHECK_NAME_LEN];
+  char *path = name;
+  int len, size;
+
+  for (len = 0; arg[len] && ! isspace (arg[len]); len++)
+    if (len == CHECK_NAME_LEN - 1)
+      return 0;
+  grub_memmove (name, arg, len);
+  name[len] = 0;
+
+  if (*path == '(')
+    while (*path && *path++ != ')')
+      ;
+  if (*path != '/')
+    return 0;
+
+  size = prefetch_check (name);
+  if (size < 0)
+    return errnum == ERR_FILE_NOT_FOUND;
+  return size < min;
+}
+
+/* Whether ENTRY is sure to fail: a file that its kernel, initrd or
+   module commands load is missing, or its kernel is too small to be
+   one.  The root device is followed as far as root and rootnoverify
+   set it; after a command which finds it, or makes a drive, nothing
+   more can be told.  */
+static int
+check_entry (char *entry)
+{
+  unsigned long drive = saved_drive, partition = saved_partition;
+  int failed = 0;
+
+  /* The entry starts from the boot device, as RUN_SCRIPT does.  */
+  saved_drive = boot_drive;
+  saved_partition = install_partition;
+
+  for (; *entry && ! failed; entry += grub_strlen (entry) + 1)
+    {
+      struct builtin *builtin = find_command (entry);
+      char *arg;
+
+      errnum = ERR_NONE;
+      if (! builtin)
+	continue;
+
+      arg = skip_to (1, entry);
+      if (! grub_strcmp (builtin->name, "root")
+	  || ! grub_strcmp (builtin->name, "rootnoverify"))
+	{
+	  if (! *arg || ! set_device (arg))
+	    break;
+	  saved_drive = current_drive;
+	  saved_partition = current_partition;
+	}
+      else if (! grub_strcmp (builtin->name, "search")
+	       || ! grub_strcmp (builtin->name, "findiso")
+	       || ! grub_strcmp (builtin->name, "loopback")
+	       || ! grub_strcmp (builtin->name, "memdisk")
+	       || ! grub_strcmp (builtin->name, "map"))
+	break;
+      else if (! grub_strcmp (builtin->name, "kernel")
+	       || ! grub_strcmp (builtin->name, "module")
+	       || ! grub_strcmp (builtin->name, "modulenounzip"))
+	{
+	  while (*arg == '-' && arg[1] == '-')
+	    arg = skip_to (0, arg);
+	  if (*arg)
+	    failed = check_file (arg, (builtin->name[0] == 'k'
+				       ? CHECK_KERNEL_MIN : 0));
+	}
+      else if (! grub_strcmp (builtin->name, "initrd"))
+	for (; *arg && ! failed; arg = skip_to (0, arg))
+	  if (! initrd_cpio_option (arg))
+	    failed = check_file (arg, 0);
+    }
+
+  errnum = ERR_NONE;
+  saved_drive = drive;
+  saved_partition = partition;
+  return failed;
+}
+
+/* Look at the next of the entries, and return zero if there was none
+   left to.  */
+static int
+check_poll (void)
+{
+  if (check_done == check_count)
+    return 0;
+
+  check_failed[check_done] = check_entry (check_commands[check_done]);
+  check_done++;
+  return 1;
+}
+
+/* Whether entry NUM was found to be sure to fail.  */
+static int
+check_known_failing (int num)
+{
+  int i;
+
+  for (i = 0; i < check_done; i++)
+    if (check_entries[i] == num)
+      return check_failed[i];
+
+  return 0;
+}
+
+/* Return the next fallback entry, and move on to the one after it.  */
+static int
+next_fallback (void)
+{
+  int entryno = fallback_entries[fallback_entryno];
+
+  fallback_entryno++;
+  if (fallback_entryno >= MAX_FALLBACK_ENTRIES
+      || fallback_entries[fallback_entryno] < 0)
+    fallback_entryno = -1;
+
+  return entryno;
+}
+
 static void
 run_menu (char *menu_entries, char *config_entries, int num_entries,
 	  char *heap, int entryno)
 {
   int c, time1, time2 = -1, first_entry = 0;
   char *cur_entry = 0;
+  char *script_heap;
   struct term_entry *prev_term = NULL;
 
+  bootprof_mark ("menu");
+
   if (grub_verbose)
     cls();
 
@@ -261,6 +627,15 @@ restart:
   if (grub_timeout < 0)
     show_menu = 1;
 
+  /* Fetch the default entry while the countdown runs, and look at it
+     and its fallbacks.  */
+  check_count = check_done = 0;
+  if (grub_timeout > 0 && config_entries)
+    {
+      check_start (config_entries, first_entry + entryno, heap);
+      prefetch_entry (check_commands[0]);
+    }
+
   /* If SHOW_MENU is false, don't display the menu until ESC is pressed.  */
   if (! show_menu)
     {
@@ -276,9 +651,15 @@ restart:
 
       while (1)
 	{
+	  /* With nothing to fetch or look at, rest until the next key or
+	     tick.  */
+	  if (! prefetch_poll () && ! check_poll () && grub_timeout > 0)
+	    idle_wait ();
+
 	  /* Check if any key is pressed */
 	  if (checkkey () != -1)
 	    {
+	      prefetch_stop ();
 	      grub_timeout = -1;
 	      show_menu = 1;
 	      getkey ();
@@ -288,6 +669,7 @@ restart:
 	  /* See if a modifier key is held down.  */
 	  if (keystatus () != 0)
 	    {
+	      prefetch_stop ();
 	      grub_timeout = -1;
 	      show_menu = 1;
 	      break;
@@ -300,6 +682,7 @@ restart:
 	    {
 	      if (grub_timeout <= 0)
 		{
+		  prefetch_finish ();
 		  grub_timeout = -1;
 		  goto boot_entry;
 		}
@@ -316,6 +699,13 @@ restart:
 	}
     }
 
+  /* The menu holds only the first entries, so read them all.  */
+  if (show_menu && menu_partial)
+    {
+      menu_read_all = 1;
+      grub_longjmp (restart_env, 0);
+    }
+
   /* Only display the menu if the user wants to see it. */
   if (show_menu)
     {
@@ -366,10 +756,14 @@ restart:
       /* Initialize to NULL just in case...  */
       cur_entry = NULL;
 
+      if (grub_timeout >= 0 && ! prefetch_poll () && ! check_poll ())
+	idle_wait ();
+
       if (grub_timeout >= 0 && (time1 = getrtsecs()) != time2 && time1 != 0xFF)
 	{
 	  if (grub_timeout <= 0)
 	    {
+	      prefetch_finish ();
 	      grub_timeout = -1;
 	      break;
 	    }
@@ -408,6 +802,7 @@ restart:
 
 	  if (grub_timeout >= 0)
 	    {
+	      prefetch_stop ();
 	      if (current_term->flags & TERM_DUMB)
 		grub_putchar ('\r');
 	      else
@@ -649,10 +1044,13 @@ restart:
 
 		  if (config_entries)
 		    {
+		      /* If the entry is read at HEAP, it is copied onto
+			 itself.  */
+		      new_heap = heap;
+		      cur_entry = get_config_entry (config_entries,
+						    first_entry + entryno,
+						    &new_heap);
 		      new_heap = heap;
-		      cur_entry = get_entry (config_entries,
-					     first_entry + entryno,
-					     1);
 		    }
 		  else
 		    {
@@ -731,9 +1129,11 @@ restart:
 		  char * append_line;
 		  char * start;
 
+		  new_heap = heap;
+		  cur_entry = get_config_entry (config_entries,
+						first_entry + entryno,
+						&new_heap);
 		  entry_copy = new_heap = heap;
-		  cur_entry = get_entry (config_entries, first_entry + entryno,
-					 1);
 		  
 		  do
 		    {
@@ -854,23 +1254,33 @@ restart:
       else
 	verbose_printf ("  Booting command-list\n\n");
 
+      /* Don't load what is known to fail if there is something else to
+	 try.  */
+      if (! cur_entry && fallback_entryno >= 0
+	  && check_known_failing (first_entry + entryno))
+	{
+	  verbose_printf ("  A file that '%s' loads is missing\n\n",
+			  get_entry (menu_entries, first_entry + entryno, 0));
+	  first_entry = 0;
+	  entryno = next_fallback ();
+	  continue;
+	}
+
+      script_heap = heap;
       if (! cur_entry)
-	cur_entry = get_entry (config_entries, first_entry + entryno, 1);
+	cur_entry = get_config_entry (config_entries, first_entry + entryno,
+				      &script_heap);
 
       /* Set CURRENT_ENTRYNO for the command "savedefault".  */
       current_entryno = first_entry + entryno;
       
-      if (run_script (cur_entry, heap))
+      if (run_script (cur_entry, script_heap))
 	{
 	  if (fallback_entryno >= 0)
 	    {
 	      cur_entry = NULL;
 	      first_entry = 0;
-	      entryno = fallback_entries[fallback_entryno];
-	      fallback_entryno++;
-	      if (fallback_entryno >= MAX_FALLBACK_ENTRIES
-		  || fallback_entries[fallback_entryno] < 0)
-		fallback_entryno = -1;
+	      entryno = next_fallback ();
 	    }
 	  else
 	    break;
@@ -891,7 +1301,10 @@ restart:
 }
 
 
-static int
+/* Read a line of the open config file into CMDLINE if READ_FROM_FILE
+   is 1, of the open compiled menu if it is 2, and of the preset menu if
+   it is 0.  Return its length, which is zero at the end.  */
+int
 get_line_from_config (char *cmdline, int maxlen, int read_from_file)
 {
   int pos = 0, literal = 0, comment = 0;
@@ -899,9 +1312,22 @@ get_line_from_config (char *cmdline, int maxlen, int read_from_file)
   
   while (1)
     {
+      if (read_from_file == 2)
+	{
+	  /* The line is there as it was read from the config file.  */
+	  if (! grub_read_byte (&c) || ! c)
+	    break;
+
+	  if (pos < maxlen)
+	    cmdline[pos++] = c;
+	  continue;
+	}
+
       if (read_from_file)
 	{
-	  if (! grub_read (&c, 1))
+	  /* This goes to the file system a block at a time, not for
+	     every byte.  */
+	  if (! grub_read_byte (&c))
 	    break;
 	}
       else
@@ -983,9 +1409,12 @@ cmain (void)
       num_entries = 0;
       config_entries = (char *) mbi.drives_addr + mbi.drives_length;
       menu_entries = (char *) MENU_BUF;
+      menu_partial = 0;
       init_config ();
     }
   
+  bootprof_mark ("cmain");
+
   /* Initialize the environment for restarting Stage 2.  */
   grub_setjmp (restart_env);
   
@@ -1019,20 +1448,30 @@ cmain (void)
 		 because close_preset_menu disables the preset menu.  */
 	      is_opened = is_preset = open_preset_menu ();
 	      if (! is_opened)
-		{
-		  is_opened = grub_open (config_file);
-		  errnum = ERR_NONE;
-		}
+		is_opened = open_config_file ();
 
 	      if (! is_opened)
 		break;
 
 	      /* This is necessary, because the menu must be overrided.  */
 	      reset ();
+
+	      /* Keep only the titles of a config file, which can be read
+		 again, right where the commands would have gone.  */
+	      if (is_preset)
+		entry_offsets = 0;
+	      else
+		{
+		  entry_offsets = (int *) MENU_BUF;
+		  entry_from = is_opened;
+		  entry_drive = saved_drive;
+		  entry_partition = saved_partition;
+		  menu_entries = config_entries;
+		}
 	      
 	      cmdline = (char *) CMDLINE_BUF;
 	      while (get_line_from_config (cmdline, NEW_HEAPSIZE,
-					   ! is_preset))
+					   is_preset ? 0 : is_opened))
 		{
 		  struct builtin *builtin;
 		  
@@ -1046,13 +1485,26 @@ cmain (void)
 		  if (builtin->flags & BUILTIN_TITLE)
 		    {
 		      char *ptr;
+
+		      if (entry_offsets
+			  && num_entries + 1 >= MAX_LAZY_ENTRIES)
+			break;
 		      
 		      /* the command "title" is specially treated.  */
 		      if (state > 1)
 			{
+			  /* The entries up to this one are all that
+			     booting at once needs.  */
+			  if (num_entries + 1 == fast_boot_entries ())
+			    {
+			      menu_partial = 1;
+			      break;
+			    }
+
 			  /* The next title is found.  */
 			  num_entries++;
-			  config_entries[config_len++] = 0;
+			  if (! entry_offsets)
+			    config_entries[config_len++] = 0;
 			  prev_menu_len = menu_len;
 			  prev_config_len = config_len;
 			}
@@ -1070,6 +1522,9 @@ cmain (void)
 		      ptr = skip_to (1, cmdline);
 		      while ((menu_entries[menu_len++] = *(ptr++)) != 0)
 			;
+
+		      if (entry_offsets)
+			entry_offsets[num_entries] = grub_read_byte_offset ();
 		    }
 		  else if (! state)
 		    {
@@ -1077,6 +1532,7 @@ cmain (void)
 		      if (builtin->flags & BUILTIN_MENU)
 			{
 			  char *arg = skip_to (1, cmdline);
+			  bootprof_mark (builtin->name);
 			  (builtin->func) (arg, BUILTIN_MENU);
 			  errnum = 0;
 			}
@@ -1090,8 +1546,9 @@ cmain (void)
 		      
 		      state++;
 		      /* Copy config file data to config area.  */
-		      while ((config_entries[config_len++] = *ptr++) != 0)
-			;
+		      if (! entry_offsets)
+			while ((config_entries[config_len++] = *ptr++) != 0)
+			  ;
 		    }
 		}
 	      
@@ -1099,7 +1556,8 @@ cmain (void)
 		{
 		  /* Finish the last entry.  */
 		  num_entries++;
-		  config_entries[config_len++] = 0;
+		  if (! entry_offsets)
+		    config_entries[config_len++] = 0;
 		}
 	      else
 		{
@@ -1108,10 +1566,13 @@ cmain (void)
 		}
 	      
 	      menu_entries[menu_len++] = 0;
-	      config_entries[config_len++] = 0;
-	      grub_memmove (config_entries + config_len, menu_entries,
-			    menu_len);
-	      menu_entries = config_entries + config_len;
+	      if (! entry_offsets)
+		{
+		  config_entries[config_len++] = 0;
+		  grub_memmove (config_entries + config_len, menu_entries,
+				menu_len);
+		  menu_entries = config_entries + config_len;
+		}
 
 	      /* Make sure that all fallback entries are valid.  */
 	      if (fallback_entryno >= 0)
@@ -1158,8 +1619,20 @@ cmain (void)
 	  while (is_preset);
 	}
 
-      /* go ahead and make sure the terminal is setup */
-      if (current_term->startup)
+      if (menu_read_all)
+	{
+	  /* As run_menu would have, once the default was booted or a
+	     key was pressed.  */
+	  menu_read_all = 0;
+	  show_menu = 1;
+	  grub_timeout = -1;
+	}
+
+      /* go ahead and make sure the terminal is setup, unless the
+	 default is booted at once, when run_menu starts it if that
+	 fails.  */
+      if (current_term->startup
+	  && ! (num_entries && fast_boot_entries () && ! grub_verbose))
         (*current_term->startup)();
 
       if (! num_entries)
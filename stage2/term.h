@@ -94,6 +94,15 @@ struct term_entry
   int (*startup) (void);
   /* function to use to shutdown a terminal */
   void (*shutdown) (void);
+  /* Put LEN characters at once, none of which is a newline or a tab,
+     as putchar would one by one.  May be NULL.  */
+  void (*putstr) (const char *str, int len);
+  /* Put COUNT blanks at the cursor, moving the rest of the row right,
+     or take COUNT characters there away, moving the rest left, with
+     the cursor staying where it is.  Return zero if the terminal
+     can't.  May be NULL.  */
+  int (*insertchars) (int count);
+  int (*deletechars) (int count);
 };
 
 /* This lists up available terminals.  */
@@ -118,10 +127,16 @@ void console_cls (void);
 void console_setcolorstate (color_state state);
 void console_setcolor (int normal_color, int highlight_color);
 int console_setcursor (int on);
+#ifdef PLATFORM_EFI
+void console_putstr (const char *str, int len);
+#endif
 #endif
 
 #ifdef SUPPORT_SERIAL
 void serial_putchar (int c);
+void serial_putstr (const char *str, int len);
+int serial_insertchars (int count);
+int serial_deletechars (int count);
 int serial_checkkey (void);
 int serial_getkey (void);
 int serial_getxy (void);
@@ -146,6 +161,17 @@ extern int foreground, background, border, graphics_inited;
 void graphics_set_splash(char *splashfile);
 int set_videomode (int mode);
 void graphics_putchar (int c);
+#ifdef PLATFORM_EFI
+void graphics_putstr (const char *str, int len);
+int graphics_checkkey (void);
+int graphics_getkey (void);
+
+/* How the graphics output mode is chosen.  */
+#define GRAPHICS_MODE_NATIVE	0	/* the best format, then the largest */
+#define GRAPHICS_MODE_FAST	1	/* the largest redrawn fast enough */
+#define GRAPHICS_MODE_SIZE	2	/* the one of the size given */
+void graphics_set_mode_policy (int policy, int width, int height, int budget);
+#endif
 int graphics_getxy(void);
 void graphics_gotoxy(int x, int y);
 void graphics_cls(void);
@@ -30,16 +30,222 @@
 #include "tparm.h"
 #include "serial.h"
 
-/* Current terminal capabilities. Default is "vt100".  */
+/* Current terminal capabilities. Default is "vt100", with the insert
+   and delete of a character of the vt102, which whatever emulates a
+   vt100 today has as well.  */
 struct terminfo term =
   {
     .name                = "vt100",
     .cursor_address      = "\e[%i%p1%d;%p2%dH",
     .clear_screen        = "\e[H\e[J",
     .enter_standout_mode = "\e[7m",
-    .exit_standout_mode  = "\e[m"
+    .exit_standout_mode  = "\e[m",
+    .insert_character    = "\e[@",
+    .delete_character    = "\e[P"
   };
 
+/* The capabilities are compiled when the terminal is set into the
+   pieces of what they send: runs of text, and the parameters in
+   decimal between them.  That is all that %p1, %p2, %i, %d and %% make,
+   which is what nearly every cursor_address there is uses, and the
+   others have no parameters at all, so grub_tparm is seldom needed to
+   work out the same string again on every call.  A capability with
+   anything else in it is left to grub_tparm.  */
+#define TI_PIECES_MAX	8
+
+struct ti_piece
+{
+  /* The text at OFFSET in the compiled capability, of LEN bytes, or the
+     parameter PARAM if LEN is -1.  */
+  unsigned char offset;
+  signed char len;
+  unsigned char param;
+};
+
+struct ti_compiled
+{
+  int valid;
+  int increment;		/* whether %i adds one to the parameters */
+  int num_pieces;
+  struct ti_piece pieces[TI_PIECES_MAX];
+  char text[TERMINFO_LEN];
+};
+
+enum
+{
+  TI_CURSOR_ADDRESS,
+  TI_CLEAR_SCREEN,
+  TI_ENTER_STANDOUT_MODE,
+  TI_EXIT_STANDOUT_MODE,
+  TI_INSERT_CHARACTER,
+  TI_DELETE_CHARACTER,
+  TI_NUM_CAPS
+};
+
+static struct ti_compiled ti_compiled[TI_NUM_CAPS];
+static int ti_compiled_valid;
+
+/* Add the text or the parameter to C, joining text to the text before
+   it.  Return zero if there are too many pieces.  */
+static int
+ti_add_piece (struct ti_compiled *c, int offset, int len, int param)
+{
+  struct ti_piece *p;
+
+  if (len > 0 && c->num_pieces)
+    {
+      p = &c->pieces[c->num_pieces - 1];
+      if (p->len >= 0 && p->offset + p->len == offset)
+	{
+	  p->len += len;
+	  return 1;
+	}
+    }
+
+  if (c->num_pieces == TI_PIECES_MAX)
+    return 0;
+
+  p = &c->pieces[c->num_pieces++];
+  p->offset = offset;
+  p->len = len;
+  p->param = param;
+  return 1;
+}
+
+/* Compile the capability CAP into C.  */
+static void
+ti_compile (const char *cap, struct ti_compiled *c)
+{
+  int pushed = -1, next = 0, param;
+  int explicit = 0, used = 0;
+  int len = 0;
+
+  c->valid = 0;
+  c->increment = 0;
+  c->num_pieces = 0;
+
+  while (*cap)
+    {
+      /* delay timings are skipped, as grub_tparm does */
+      if (cap[0] == '$' && cap[1] == '<')
+	{
+	  while (*cap && *cap != '>')
+	    cap++;
+	  if (*cap)
+	    cap++;
+	  continue;
+	}
+
+      if (*cap != '%' || cap[1] == '%')
+	{
+	  c->text[len] = *cap;
+	  if (! ti_add_piece (c, len++, 1, 0))
+	    return;
+	  cap += (*cap == '%') ? 2 : 1;
+	  continue;
+	}
+
+      switch (cap[1])
+	{
+	case 'i':
+	  /* it only adds to what is pushed after it */
+	  if (pushed >= 0 || used)
+	    return;
+	  c->increment = 1;
+	  cap += 2;
+	  break;
+
+	case 'p':
+	  if ((cap[2] != '1' && cap[2] != '2') || next)
+	    return;
+	  pushed = cap[2] - '1';
+	  explicit = 1;
+	  cap += 3;
+	  break;
+
+	case 'd':
+	  /* without %p, successive parameters as termcap has them,
+	     which grub_tparm does not do with %i */
+	  if (pushed < 0 && (explicit || c->increment))
+	    return;
+	  param = pushed >= 0 ? pushed : next++;
+	  pushed = -1;
+	  used = 1;
+	  if (param > 1 || ! ti_add_piece (c, 0, -1, param))
+	    return;
+	  cap += 2;
+	  break;
+
+	default:
+	  return;
+	}
+    }
+
+  c->valid = 1;
+}
+
+static void
+ti_compile_all (void)
+{
+  ti_compile (term.cursor_address, &ti_compiled[TI_CURSOR_ADDRESS]);
+  ti_compile (term.clear_screen, &ti_compiled[TI_CLEAR_SCREEN]);
+  ti_compile (term.enter_standout_mode,
+	      &ti_compiled[TI_ENTER_STANDOUT_MODE]);
+  ti_compile (term.exit_standout_mode, &ti_compiled[TI_EXIT_STANDOUT_MODE]);
+  ti_compile (term.insert_character, &ti_compiled[TI_INSERT_CHARACTER]);
+  ti_compile (term.delete_character, &ti_compiled[TI_DELETE_CHARACTER]);
+  ti_compiled_valid = 1;
+}
+
+/* Return what the capability CAP, the one numbered INDEX, sends with
+   the parameters P1 and P2.  */
+static char *
+ti_string (int index, const char *cap, int p1, int p2)
+{
+  static char out[TERMINFO_LEN + 2 * 12];
+  struct ti_compiled *c = &ti_compiled[index];
+  struct ti_piece *p;
+  char digits[12], *d;
+  char *o = out;
+  int n, neg;
+
+  if (! ti_compiled_valid)
+    ti_compile_all ();
+
+  if (! c->valid)
+    return grub_tparm (cap, p1, p2);
+
+  for (p = c->pieces; p < c->pieces + c->num_pieces; p++)
+    {
+      if (p->len >= 0)
+	{
+	  grub_memmove (o, c->text + p->offset, p->len);
+	  o += p->len;
+	  continue;
+	}
+
+      n = (p->param ? p2 : p1) + c->increment;
+      neg = n < 0;
+      if (neg)
+	n = -n;
+      d = digits + sizeof (digits);
+      do
+	{
+	  *--d = '0' + n % 10;
+	  n /= 10;
+	}
+      while (n);
+      if (neg)
+	*--d = '-';
+      n = digits + sizeof (digits) - d;
+      grub_memmove (o, d, n);
+      o += n;
+    }
+
+  *o = 0;
+  return out;
+}
+
 /* A number of escape sequences are provided in the string valued
    capabilities for easy encoding of characters there.  Both \E and \e
    map to an ESCAPE character, ^x maps to a control-x for any
@@ -219,28 +425,62 @@ ti_escape_string (const char *in)
 void
 ti_cursor_address (int x, int y)
 {
-  grub_putstr (grub_tparm (term.cursor_address, y, x));
+  grub_putstr (ti_cursor_address_string (x, y));
+}
+
+/* the string which moves the cursor there, for those who want to know
+   how long it is or to send it themselves */
+char *
+ti_cursor_address_string (int x, int y)
+{
+  return ti_string (TI_CURSOR_ADDRESS, term.cursor_address, y, x);
 }
 
 /* clear the screen. */
 void 
 ti_clear_screen (void)
 {
-  grub_putstr (grub_tparm (term.clear_screen));
+  grub_putstr (ti_string (TI_CLEAR_SCREEN, term.clear_screen, 0, 0));
 }
 
 /* enter reverse video */
 void 
 ti_enter_standout_mode (void)
 {
-  grub_putstr (grub_tparm (term.enter_standout_mode));
+  grub_putstr (ti_string (TI_ENTER_STANDOUT_MODE, term.enter_standout_mode,
+			  0, 0));
 }
 
 /* exit reverse video */
 void 
 ti_exit_standout_mode (void)
 {
-  grub_putstr (grub_tparm (term.exit_standout_mode));
+  grub_putstr (ti_string (TI_EXIT_STANDOUT_MODE, term.exit_standout_mode,
+			  0, 0));
+}
+
+/* put a blank at the cursor, moving the rest of the row right; return
+   zero if the terminal can't */
+int
+ti_insert_character (void)
+{
+  if (! term.insert_character[0])
+    return 0;
+
+  grub_putstr (ti_string (TI_INSERT_CHARACTER, term.insert_character, 0, 0));
+  return 1;
+}
+
+/* take the character at the cursor away, moving the rest of the row
+   left; return zero if the terminal can't */
+int
+ti_delete_character (void)
+{
+  if (! term.delete_character[0])
+    return 0;
+
+  grub_putstr (ti_string (TI_DELETE_CHARACTER, term.delete_character, 0, 0));
+  return 1;
 }
 
 /* set the current terminal emulation to use */
@@ -248,6 +488,7 @@ void
 ti_set_term (const struct terminfo *new)
 {
   grub_memmove (&term, new, sizeof (struct terminfo));
+  ti_compile_all ();
 }
 
 /* get the current terminal emulation */
@@ -30,6 +30,8 @@ typedef struct terminfo
   char clear_screen[TERMINFO_LEN];
   char enter_standout_mode[TERMINFO_LEN];
   char exit_standout_mode[TERMINFO_LEN];
+  char insert_character[TERMINFO_LEN];
+  char delete_character[TERMINFO_LEN];
 }
 terminfo;
 
@@ -44,8 +46,11 @@ void ti_set_term (const struct terminfo *new);
 void ti_get_term (struct terminfo *copy);
 
 void ti_cursor_address (int x, int y);
+char *ti_cursor_address_string (int x, int y);
 void ti_clear_screen (void);
 void ti_enter_standout_mode (void);
 void ti_exit_standout_mode (void);
+int ti_insert_character (void);
+int ti_delete_character (void);
 
 #endif /* ! GRUB_TERMCAP_HEADER */
@@ -0,0 +1,1043 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2009  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Decompression of .xz files, the sibling of gunzip.c.  It plugs into
+ * the same "compressed_file" hook in grub_open and grub_read, so any
+ * file that is xz compressed is read transparently as its uncompressed
+ * contents, unless "no_decompression" is set.
+ *
+ * Only what xz and the kernel's scripts actually produce is supported:
+ * a single stream of blocks using the LZMA2 filter alone.  As with gzip,
+ * the integrity checks are skipped, not verified.
+ *
+ * LZMA2 needs the last "dictionary size" bytes of output to decode the
+ * rest, so unlike gunzip.c's 32K window, the dictionary is taken from
+ * the top of upper memory, sized to the smaller of what the stream asks
+ * for and the uncompressed size of the file.  Seeking backwards past
+ * what it still holds starts again from the first block.
+ */
+
+#ifndef NO_DECOMPRESSION
+
+#include "shared.h"
+
+#include "filesys.h"
+
+typedef unsigned char uch;
+typedef unsigned short ush;
+typedef unsigned int ulg;
+
+/* internal variables only */
+static int xz_data_offset;
+static int xz_filepos;
+static int xz_filemax;
+static int xz_fsmax;
+static int xz_check_size;
+static int xz_stream_flags;
+
+/* uncompressed bytes decoded so far */
+static int out_pos;
+
+
+/* internal variable swap function */
+static void
+unxz_swap_values (void)
+{
+  register int itmp;
+
+  /* swap filepos */
+  itmp = filepos;
+  filepos = xz_filepos;
+  xz_filepos = itmp;
+
+  /* swap filemax */
+  itmp = filemax;
+  filemax = xz_filemax;
+  xz_filemax = itmp;
+
+  /* swap fsmax */
+  itmp = fsmax;
+  fsmax = xz_fsmax;
+  xz_fsmax = itmp;
+}
+
+
+/*
+ *  Input.
+ */
+
+#define INBUFSIZ  0x2000
+
+static uch *inbuf;
+static int bufloc;
+static int buflen;
+
+/* Refill the input buffer and return its first byte.  Past the end of
+   the file there is nothing to read, so make it zeros.  */
+static int
+fill_inbuf (void)
+{
+  bufloc = 0;
+  buflen = grub_read ((char *) inbuf, INBUFSIZ);
+  if (buflen <= 0)
+    {
+      buflen = 0;
+      return 0;
+    }
+
+  return inbuf[bufloc++];
+}
+
+#define get_byte() (bufloc < buflen ? inbuf[bufloc++] : fill_inbuf ())
+
+/* the position in the compressed file of the next byte from get_byte */
+#define in_pos() (filepos - (buflen - bufloc))
+
+static void
+seek_input (int pos)
+{
+  filepos = pos;
+  bufloc = buflen = 0;
+}
+
+/* Read a variable-length integer, as used in the headers and the index.
+   Anything that does not fit in an int is refused.  */
+static int
+get_varint (ulg *val)
+{
+  int shift;
+  ulg b;
+
+  *val = 0;
+  for (shift = 0; shift <= 28; shift += 7)
+    {
+      b = get_byte ();
+      if (shift == 28 && (b & 0x78))
+	break;
+
+      *val |= (b & 0x7f) << shift;
+      if (! (b & 0x80))
+	return ! errnum && (b || ! shift);
+    }
+
+  return 0;
+}
+
+static ulg
+get_le32 (uch *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((ulg) p[3] << 24);
+}
+
+
+/*
+ *  Dictionary.
+ *
+ *  A circular buffer of dict_size bytes, a multiple of 4K.  Output is
+ *  written at dict_pos, and decoding stops when it reaches dict_limit.
+ *  dict_full is how much of the buffer may be referred back to, which
+ *  a dictionary reset sets to none; dict_origin is where that happened,
+ *  as the LZMA position bits count from there.
+ */
+
+static uch *dict_buf;
+static ulg dict_size;
+static ulg dict_pos;
+static ulg dict_limit;
+static ulg dict_full;
+static ulg dict_origin;
+
+static void
+dict_reset (void)
+{
+  dict_full = 0;
+  dict_origin = dict_pos;
+}
+
+/* the byte DIST + 1 bytes back */
+static uch
+dict_get (ulg dist)
+{
+  ulg offset = dict_pos - dist - 1;
+
+  if (dist >= dict_pos)
+    offset += dict_size;
+
+  return dict_full ? dict_buf[offset] : 0;
+}
+
+static void
+dict_put (uch byte)
+{
+  dict_buf[dict_pos++] = byte;
+  if (dict_full < dict_size)
+    dict_full++;
+}
+
+/* Copy *LEN bytes from DIST + 1 bytes back, as far as dict_limit lets,
+   and leave in *LEN what remains.  */
+static void
+dict_repeat (ulg *len, ulg dist)
+{
+  ulg back, left;
+
+  if (dist >= dict_full)
+    {
+      errnum = ERR_BAD_GZIP_DATA;
+      return;
+    }
+
+  left = dict_limit - dict_pos;
+  if (left > *len)
+    left = *len;
+  *len -= left;
+
+  back = dict_pos - dist - 1;
+  if (dist >= dict_pos)
+    back += dict_size;
+
+  dict_full += left;
+  if (dict_full > dict_size)
+    dict_full = dict_size;
+
+  while (left--)
+    {
+      dict_buf[dict_pos++] = dict_buf[back++];
+      if (back == dict_size)
+	back = 0;
+    }
+}
+
+
+/*
+ *  Range decoder.
+ */
+
+#define RC_TOP_VALUE		(1 << 24)
+#define RC_BIT_MODEL_TOTAL	(1 << 11)
+#define RC_MOVE_BITS		5
+
+static ulg rc_range;
+static ulg rc_code;
+
+static void
+rc_init (void)
+{
+  int i;
+
+  rc_range = 0xffffffff;
+  rc_code = 0;
+  if (get_byte ())
+    errnum = ERR_BAD_GZIP_DATA;
+  for (i = 0; i < 4; i++)
+    rc_code = (rc_code << 8) | get_byte ();
+}
+
+#define rc_normalize() \
+  do { if (rc_range < RC_TOP_VALUE) \
+	 { rc_range <<= 8; rc_code = (rc_code << 8) | get_byte (); } } while (0)
+
+/* Decode one bit with probability *PROB, and adapt it.  */
+static int
+rc_bit (ush *prob)
+{
+  ulg bound;
+
+  rc_normalize ();
+  bound = (rc_range >> 11) * *prob;
+  if (rc_code < bound)
+    {
+      rc_range = bound;
+      *prob += (RC_BIT_MODEL_TOTAL - *prob) >> RC_MOVE_BITS;
+      return 0;
+    }
+
+  rc_range -= bound;
+  rc_code -= bound;
+  *prob -= *prob >> RC_MOVE_BITS;
+  return 1;
+}
+
+/* Decode a BITS-bit symbol, most significant bit first.  */
+static ulg
+rc_bittree (ush *probs, int bits)
+{
+  ulg symbol = 1;
+
+  do
+    symbol = (symbol << 1) + rc_bit (&probs[symbol]);
+  while (symbol < (1U << bits));
+
+  return symbol - (1U << bits);
+}
+
+/* Decode a BITS-bit symbol, least significant bit first, into *DEST.  */
+static void
+rc_bittree_reverse (ush *probs, ulg *dest, int bits)
+{
+  ulg symbol = 1;
+  int i;
+
+  for (i = 0; i < bits; i++)
+    if (rc_bit (&probs[symbol]))
+      {
+	symbol = (symbol << 1) + 1;
+	*dest += 1 << i;
+      }
+    else
+      symbol <<= 1;
+}
+
+/* Decode BITS bits of equal probability into *DEST.  */
+static void
+rc_direct (ulg *dest, int bits)
+{
+  ulg mask;
+
+  do
+    {
+      rc_normalize ();
+      rc_range >>= 1;
+      rc_code -= rc_range;
+      mask = 0 - (rc_code >> 31);
+      rc_code += rc_range & mask;
+      *dest = (*dest << 1) + (mask + 1);
+    }
+  while (--bits);
+}
+
+
+/*
+ *  LZMA decoder.
+ */
+
+#define STATES			12
+#define LIT_STATES		7
+#define POS_STATES_MAX		(1 << 4)
+#define DIST_STATES		4
+#define DIST_SLOTS		64
+#define DIST_MODEL_START	4
+#define DIST_MODEL_END		14
+#define FULL_DISTANCES		(1 << (DIST_MODEL_END / 2))
+#define ALIGN_BITS		4
+#define LITERAL_CODERS_MAX	(1 << 4)
+#define LITERAL_CODER_SIZE	0x300
+#define MATCH_LEN_MIN		2
+
+#define LEN_LOW_BITS		3
+#define LEN_MID_BITS		3
+#define LEN_HIGH_BITS		8
+#define LEN_LOW_SYMBOLS		(1 << LEN_LOW_BITS)
+#define LEN_MID_SYMBOLS		(1 << LEN_MID_BITS)
+#define LEN_HIGH_SYMBOLS	(1 << LEN_HIGH_BITS)
+
+struct len_probs
+{
+  ush choice;
+  ush choice2;
+  ush low[POS_STATES_MAX][LEN_LOW_SYMBOLS];
+  ush mid[POS_STATES_MAX][LEN_MID_SYMBOLS];
+  ush high[LEN_HIGH_SYMBOLS];
+};
+
+/* The probabilities, all of which a state reset sets back to a half.  */
+struct lzma_probs
+{
+  ush is_match[STATES][POS_STATES_MAX];
+  ush is_rep[STATES];
+  ush is_rep0[STATES];
+  ush is_rep1[STATES];
+  ush is_rep2[STATES];
+  ush is_rep0_long[STATES][POS_STATES_MAX];
+  ush dist_slot[DIST_STATES][DIST_SLOTS];
+  ush dist_special[FULL_DISTANCES - DIST_MODEL_END];
+  ush dist_align[1 << ALIGN_BITS];
+  struct len_probs match_len;
+  struct len_probs rep_len;
+  ush literal[LITERAL_CODERS_MAX][LITERAL_CODER_SIZE];
+};
+
+static struct lzma_probs *probs;
+
+static int lzma_state;
+static ulg rep0, rep1, rep2, rep3;
+static ulg match_len;		/* what is left of the match being copied */
+static int lc, lp_mask, pos_mask;
+
+static void
+lzma_reset (void)
+{
+  ush *p = (ush *) probs;
+  int i;
+
+  for (i = 0; i < sizeof (*probs) / sizeof (ush); i++)
+    p[i] = RC_BIT_MODEL_TOTAL / 2;
+
+  lzma_state = 0;
+  rep0 = rep1 = rep2 = rep3 = 0;
+  match_len = 0;
+}
+
+/* Take lc, lp and pb from the properties byte, then reset the state.  */
+static void
+lzma_props (int props)
+{
+  int lp;
+
+  if (props > (4 * 5 + 4) * 9 + 8)
+    {
+      errnum = ERR_BAD_GZIP_DATA;
+      return;
+    }
+
+  pos_mask = (1 << (props / (9 * 5))) - 1;
+  props %= 9 * 5;
+  lp = props / 9;
+  lc = props % 9;
+  if (lc + lp > 4)
+    {
+      errnum = ERR_BAD_GZIP_DATA;
+      return;
+    }
+  lp_mask = (1 << lp) - 1;
+
+  lzma_reset ();
+}
+
+static void
+lzma_literal (void)
+{
+  ush *p;
+  ulg symbol = 1;
+  ulg match_byte, match_bit, offset;
+  ulg pos = dict_pos - dict_origin;
+
+  p = probs->literal[((pos & lp_mask) << lc) + (dict_get (0) >> (8 - lc))];
+
+  if (lzma_state < LIT_STATES)
+    symbol = rc_bittree (p, 8) + 0x100;
+  else
+    {
+      match_byte = (ulg) dict_get (rep0) << 1;
+      offset = 0x100;
+
+      do
+	{
+	  match_bit = match_byte & offset;
+	  match_byte <<= 1;
+	  if (rc_bit (&p[offset + match_bit + symbol]))
+	    {
+	      symbol = (symbol << 1) + 1;
+	      offset &= match_bit;
+	    }
+	  else
+	    {
+	      symbol <<= 1;
+	      offset &= ~match_bit;
+	    }
+	}
+      while (symbol < 0x100);
+    }
+
+  dict_put ((uch) symbol);
+
+  if (lzma_state < 4)
+    lzma_state = 0;
+  else if (lzma_state < 10)
+    lzma_state -= 3;
+  else
+    lzma_state -= 6;
+}
+
+static ulg
+lzma_len (struct len_probs *l, int pos_state)
+{
+  if (! rc_bit (&l->choice))
+    return MATCH_LEN_MIN + rc_bittree (l->low[pos_state], LEN_LOW_BITS);
+
+  if (! rc_bit (&l->choice2))
+    return (MATCH_LEN_MIN + LEN_LOW_SYMBOLS
+	    + rc_bittree (l->mid[pos_state], LEN_MID_BITS));
+
+  return (MATCH_LEN_MIN + LEN_LOW_SYMBOLS + LEN_MID_SYMBOLS
+	  + rc_bittree (l->high, LEN_HIGH_BITS));
+}
+
+static void
+lzma_match (int pos_state)
+{
+  ulg dist_slot;
+  int limit;
+
+  lzma_state = lzma_state < LIT_STATES ? 7 : 10;
+
+  rep3 = rep2;
+  rep2 = rep1;
+  rep1 = rep0;
+
+  match_len = lzma_len (&probs->match_len, pos_state);
+
+  limit = match_len - MATCH_LEN_MIN;
+  if (limit >= DIST_STATES)
+    limit = DIST_STATES - 1;
+  dist_slot = rc_bittree (probs->dist_slot[limit], 6);
+
+  if (dist_slot < DIST_MODEL_START)
+    rep0 = dist_slot;
+  else
+    {
+      limit = (dist_slot >> 1) - 1;
+      rep0 = 2 + (dist_slot & 1);
+
+      if (dist_slot < DIST_MODEL_END)
+	{
+	  rep0 <<= limit;
+	  rc_bittree_reverse (probs->dist_special + rep0 - dist_slot - 1,
+			      &rep0, limit);
+	}
+      else
+	{
+	  rc_direct (&rep0, limit - ALIGN_BITS);
+	  rep0 <<= ALIGN_BITS;
+	  rc_bittree_reverse (probs->dist_align, &rep0, ALIGN_BITS);
+	}
+    }
+}
+
+static void
+lzma_rep_match (int pos_state)
+{
+  ulg tmp;
+
+  if (! rc_bit (&probs->is_rep0[lzma_state]))
+    {
+      if (! rc_bit (&probs->is_rep0_long[lzma_state][pos_state]))
+	{
+	  lzma_state = lzma_state < LIT_STATES ? 9 : 11;
+	  match_len = 1;
+	  return;
+	}
+    }
+  else
+    {
+      if (! rc_bit (&probs->is_rep1[lzma_state]))
+	tmp = rep1;
+      else
+	{
+	  if (! rc_bit (&probs->is_rep2[lzma_state]))
+	    tmp = rep2;
+	  else
+	    {
+	      tmp = rep3;
+	      rep3 = rep2;
+	    }
+
+	  rep2 = rep1;
+	}
+
+      rep1 = rep0;
+      rep0 = tmp;
+    }
+
+  lzma_state = lzma_state < LIT_STATES ? 8 : 11;
+  match_len = lzma_len (&probs->rep_len, pos_state);
+}
+
+/* Decode until dict_limit is reached.  */
+static void
+lzma_run (void)
+{
+  int pos_state;
+
+  if (match_len)
+    dict_repeat (&match_len, rep0);
+
+  while (dict_pos < dict_limit && ! errnum)
+    {
+      pos_state = (dict_pos - dict_origin) & pos_mask;
+
+      if (! rc_bit (&probs->is_match[lzma_state][pos_state]))
+	lzma_literal ();
+      else
+	{
+	  if (rc_bit (&probs->is_rep[lzma_state]))
+	    lzma_rep_match (pos_state);
+	  else
+	    lzma_match (pos_state);
+
+	  dict_repeat (&match_len, rep0);
+	}
+    }
+}
+
+
+/*
+ *  LZMA2 chunks and xz blocks.
+ */
+
+#define XZ_HEADER_SIZE	12
+#define XZ_FOOTER_SIZE	12
+#define XZ_FILTER_LZMA2	0x21
+
+static int in_block;		/* whether a block header has been read */
+static int block_data_start;	/* where the block's LZMA2 data starts */
+static ulg block_dict_size;	/* dictionary the block needs */
+static int need_dict_reset;
+static int need_props;
+
+static int chunk_lzma;		/* LZMA or uncompressed chunk */
+static ulg chunk_left;		/* uncompressed bytes left in the chunk */
+static int chunk_end;		/* where the chunk's compressed data ends */
+
+/* Read a block header.  */
+static void
+xz_block_header (void)
+{
+  int header_end, flags, props;
+  ulg val, uncompressed = 0;
+
+  val = get_byte ();
+  if (! val)
+    {
+      /* the index, but the file is not over yet */
+      errnum = ERR_BAD_GZIP_DATA;
+      return;
+    }
+
+  header_end = in_pos () - 1 + (val + 1) * 4;
+  flags = get_byte ();
+
+  /* one filter, which must be LZMA2 */
+  if (flags & 0x3f)
+    {
+      errnum = ERR_BAD_GZIP_HEADER;
+      return;
+    }
+
+  if ((flags & 0x40) && ! get_varint (&val))
+    errnum = ERR_BAD_GZIP_HEADER;
+  if ((flags & 0x80) && ! get_varint (&uncompressed))
+    errnum = ERR_BAD_GZIP_HEADER;
+  if (! get_varint (&val) || val != XZ_FILTER_LZMA2
+      || ! get_varint (&val) || val != 1)
+    errnum = ERR_BAD_GZIP_HEADER;
+  props = get_byte ();
+  if (props > 40)
+    errnum = ERR_BAD_GZIP_HEADER;
+
+  /* the rest is padding, then the header's CRC32 */
+  while (in_pos () < header_end - 4 && ! errnum)
+    if (get_byte ())
+      errnum = ERR_BAD_GZIP_HEADER;
+  if (in_pos () != header_end - 4)
+    errnum = ERR_BAD_GZIP_HEADER;
+  if (errnum)
+    return;
+
+  seek_input (header_end);
+
+  if (props == 40)
+    block_dict_size = 0xffffffff;
+  else
+    block_dict_size = (2 | (props & 1)) << (props / 2 + 11);
+
+  if (uncompressed && block_dict_size > uncompressed)
+    block_dict_size = uncompressed;
+
+  block_data_start = header_end;
+  need_dict_reset = 1;
+  need_props = 1;
+  in_block = 1;
+}
+
+/* Skip the padding and the check after the LZMA2 data of a block.  */
+static void
+xz_block_end (void)
+{
+  int pad = (block_data_start - in_pos ()) & 3;
+
+  while (pad--)
+    if (get_byte ())
+      errnum = ERR_BAD_GZIP_DATA;
+
+  seek_input (in_pos () + xz_check_size);
+  in_block = 0;
+}
+
+/* Start on the next LZMA2 chunk.  */
+static void
+xz_next_chunk (void)
+{
+  int control, size;
+
+  if (! in_block)
+    {
+      xz_block_header ();
+      if (! errnum && block_dict_size > dict_size)
+	errnum = ERR_WONT_FIT;
+      return;
+    }
+
+  control = get_byte ();
+  if (! control)
+    {
+      xz_block_end ();
+      return;
+    }
+
+  if (control >= 0xe0 || control == 1)
+    {
+      need_props = 1;
+      need_dict_reset = 0;
+      dict_reset ();
+    }
+  else if (need_dict_reset)
+    {
+      errnum = ERR_BAD_GZIP_DATA;
+      return;
+    }
+
+  if (control >= 0x80)
+    {
+      chunk_left = (control & 0x1f) << 16;
+      chunk_left += get_byte () << 8;
+      chunk_left += get_byte () + 1;
+      size = get_byte () << 8;
+      size += get_byte () + 1;
+
+      if (control >= 0xc0)
+	{
+	  need_props = 0;
+	  lzma_props (get_byte ());
+	}
+      else if (need_props)
+	errnum = ERR_BAD_GZIP_DATA;
+      else if (control >= 0xa0)
+	lzma_reset ();
+
+      chunk_end = in_pos () + size;
+      chunk_lzma = 1;
+      rc_init ();
+    }
+  else if (control > 2)
+    errnum = ERR_BAD_GZIP_DATA;
+  else
+    {
+      chunk_left = get_byte () << 8;
+      chunk_left += get_byte () + 1;
+      chunk_lzma = 0;
+    }
+}
+
+/* Decode up to N more bytes of output into the dictionary.  */
+static void
+xz_fill (ulg n)
+{
+  ulg start, end;
+
+  if (dict_pos == dict_size)
+    dict_pos = 0;
+  start = dict_pos;
+
+  if (n > dict_size - dict_pos)
+    n = dict_size - dict_pos;
+  end = dict_pos + n;
+
+  while (dict_pos < end && ! errnum)
+    {
+      if (! chunk_left)
+	{
+	  xz_next_chunk ();
+	  continue;
+	}
+
+      dict_limit = end;
+      if (dict_limit - dict_pos > chunk_left)
+	dict_limit = dict_pos + chunk_left;
+      n = dict_pos;
+
+      if (chunk_lzma)
+	lzma_run ();
+      else
+	while (dict_pos < dict_limit)
+	  dict_put (get_byte ());
+
+      chunk_left -= dict_pos - n;
+
+      /* a finished LZMA chunk must have used its input exactly */
+      if (chunk_lzma && ! chunk_left)
+	{
+	  rc_normalize ();
+	  if (match_len || rc_code || in_pos () != chunk_end)
+	    errnum = ERR_BAD_GZIP_DATA;
+	}
+    }
+
+  out_pos += dict_pos - start;
+}
+
+
+/* Go back to the first block.  */
+static void
+unxz_restart (void)
+{
+  seek_input (xz_data_offset);
+  out_pos = 0;
+  dict_pos = 0;
+  dict_reset ();
+  in_block = 0;
+  chunk_left = 0;
+}
+
+/* Find the uncompressed size out of the index, which the stream footer
+   at the end of the file points to.  Return it, or -1.  */
+static int
+unxz_read_index (void)
+{
+  uch buf[XZ_FOOTER_SIZE];
+  int end = filemax;
+  int index_start, index_size;
+  ulg count, unpadded, uncompressed;
+  int total = 0, blocks = 0;
+
+  /* skip any stream padding */
+  do
+    {
+      if (end < XZ_HEADER_SIZE + XZ_FOOTER_SIZE)
+	return -1;
+
+      filepos = end - 4;
+      if (grub_read ((char *) buf, 4) != 4)
+	return -1;
+      end -= 4;
+    }
+  while (! get_le32 (buf));
+  end += 4;
+
+  filepos = end - XZ_FOOTER_SIZE;
+  if (grub_read ((char *) buf, XZ_FOOTER_SIZE) != XZ_FOOTER_SIZE
+      || buf[10] != 'Y' || buf[11] != 'Z'
+      || buf[8] != 0 || buf[9] != xz_stream_flags)
+    return -1;
+
+  index_size = (get_le32 (buf + 4) + 1) * 4;
+  index_start = end - XZ_FOOTER_SIZE - index_size;
+  if (index_size <= 0 || index_start < XZ_HEADER_SIZE)
+    return -1;
+
+  seek_input (index_start);
+  if (get_byte () || ! get_varint (&count))
+    return -1;
+
+  while (count--)
+    {
+      if (! get_varint (&unpadded) || ! get_varint (&uncompressed)
+	  || uncompressed > MAXINT - total)
+	return -1;
+
+      total += uncompressed;
+      blocks += (unpadded + 3) & ~3;
+      if (blocks < 0 || blocks > index_start)
+	return -1;
+    }
+
+  /* anything else in the file would be another stream */
+  if (XZ_HEADER_SIZE + blocks != index_start)
+    return -1;
+
+  return total;
+}
+
+/* The input buffer and the probabilities are at the top of upper
+   memory, in the XZ_STATE_SIZE bytes there, and the dictionary is
+   below them.  None of it is kept in Stage 2 itself, which has no room
+   for it below 1MB.  */
+#define XZ_STATE_SIZE \
+  ((INBUFSIZ + sizeof (struct lzma_probs) + 0xfff) & ~0xfff)
+
+static unsigned long
+unxz_top (void)
+{
+  unsigned long top;
+
+#ifdef PLATFORM_EFI
+  top = (mbi.mem_upper << 10) + 0x100000;
+  if (top > GRUB_SCRATCH_MEM_SIZE)
+    top = GRUB_SCRATCH_MEM_SIZE;
+#else
+  top = (mbi.mem_upper << 10) + 0x100000;
+#endif
+
+  return top - XZ_STATE_SIZE;
+}
+
+/* Take the dictionary from below the state.  */
+static int
+unxz_alloc_dict (void)
+{
+  unsigned long top = unxz_top ();
+
+  dict_size = block_dict_size;
+  if (dict_size > xz_fsmax)
+    dict_size = xz_fsmax;
+  dict_size = (dict_size + 0xfff) & ~0xfff;
+  if (! dict_size)
+    dict_size = 0x1000;
+
+  if (dict_size > top - 0x100000)
+    return 0;
+
+  dict_buf = (uch *) RAW_ADDR (top - dict_size);
+  return 1;
+}
+
+
+int
+unxz_test_header (unsigned char *magic)
+{
+  static unsigned char xz_magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0 };
+  static unsigned char check_sizes[16] =
+    { 0, 4, 4, 4, 8, 8, 8, 16, 16, 16, 32, 32, 32, 64, 64, 64 };
+  int size;
+
+  /* "magic" holds the first ten bytes of the file */
+  if (grub_memcmp ((char *) magic, (char *) xz_magic, 6))
+    {
+      filepos = 0;
+      return 1;
+    }
+
+  if (magic[6] || (magic[7] & 0xf0))
+    {
+      errnum = ERR_BAD_GZIP_HEADER;
+      return 0;
+    }
+
+  if (unxz_top () < 0x100000)
+    {
+      errnum = ERR_WONT_FIT;
+      return 0;
+    }
+
+  inbuf = (uch *) RAW_ADDR (unxz_top ());
+  probs = (struct lzma_probs *) (inbuf + INBUFSIZ);
+
+  xz_stream_flags = magic[7];
+  xz_check_size = check_sizes[xz_stream_flags];
+  xz_data_offset = XZ_HEADER_SIZE;
+
+  size = unxz_read_index ();
+  if (size < 0)
+    {
+      if (! errnum)
+	errnum = ERR_BAD_GZIP_HEADER;
+
+      return 0;
+    }
+
+  xz_fsmax = xz_filemax = size;
+
+  /* size the dictionary for the first block */
+  seek_input (xz_data_offset);
+  block_dict_size = 0;
+  if (size)
+    {
+      xz_block_header ();
+      if (errnum)
+	return 0;
+    }
+
+  if (! unxz_alloc_dict ())
+    {
+      errnum = ERR_WONT_FIT;
+      return 0;
+    }
+
+  unxz_restart ();
+
+  compressed_file = COMPRESSED_XZ;
+  unxz_swap_values ();
+  /*
+   *  Now "xz_*" values refer to the compressed data.
+   */
+
+  filepos = 0;
+
+  return 1;
+}
+
+
+int
+unxz_read (char *buf, int len)
+{
+  int ret = 0;
+
+  compressed_file = 0;
+  unxz_swap_values ();
+  /*
+   *  Now "xz_*" values refer to the uncompressed data.
+   */
+
+  /* is the data wanted still in the dictionary? */
+  if (xz_filepos < out_pos - (int) (out_pos < dict_size ? out_pos : dict_size))
+    unxz_restart ();
+
+  while (len > 0 && ! errnum)
+    {
+      int size, back, offset;
+
+      if (xz_filepos >= out_pos)
+	{
+	  xz_fill (xz_filepos - out_pos + len);
+	  continue;
+	}
+
+      back = out_pos - xz_filepos;
+      offset = dict_pos - back;
+      if (offset < 0)
+	offset += dict_size;
+
+      size = back;
+      if (size > len)
+	size = len;
+      if (size > dict_size - offset)
+	size = dict_size - offset;
+
+      grub_memmove (buf, (char *) dict_buf + offset, size);
+
+      buf += size;
+      len -= size;
+      xz_filepos += size;
+      ret += size;
+    }
+
+  compressed_file = COMPRESSED_XZ;
+  unxz_swap_values ();
+  /*
+   *  Now "xz_*" values refer to the compressed data.
+   */
+
+  if (errnum)
+    ret = 0;
+
+  return ret;
+}
+
+#endif /* ! NO_DECOMPRESSION */
@@ -0,0 +1,1840 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2009  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Decompression of Zstandard (.zst) files, as described in RFC 8878.
+ * Like gunzip.c and unxz.c, it sits behind the "compressed_file" hook
+ * in grub_open and grub_read, and "no_decompression" turns it off.
+ *
+ * Any number of frames is supported, skippable ones included, but not
+ * dictionaries.  The content checksums are skipped, not verified.
+ *
+ * Decoding is done a block at a time into a history buffer as big as
+ * the largest window the frames need, but no bigger than the file.
+ * That, and one buffer each for the compressed block and its literals,
+ * are taken from the top of upper memory; a block is at most 128K.
+ * Seeking backwards past what the history still holds starts again
+ * from the first frame.
+ *
+ * On EFI, when a read takes in two frames or more whose sizes are
+ * known, they are decoded by all the processors at once, straight
+ * into the buffer read to, see unzstd_parallel.  That is why the
+ * state of decoding a frame is kept in a struct zstd_dec of its own.
+ */
+
+#ifndef NO_DECOMPRESSION
+
+#include "shared.h"
+
+#include "filesys.h"
+
+typedef unsigned char uch;
+typedef unsigned short ush;
+typedef unsigned int ulg;
+
+/* internal variables only */
+static int zst_filepos;
+static int zst_filemax;
+static int zst_fsmax;
+
+/* uncompressed bytes decoded so far, and from where on the history
+   holds them */
+static int out_pos;
+static int hist_from;
+
+/* the frames in the file, skippable ones left out */
+static int num_frames;
+
+
+/* internal variable swap function */
+static void
+unzstd_swap_values (void)
+{
+  register int itmp;
+
+  /* swap filepos */
+  itmp = filepos;
+  filepos = zst_filepos;
+  zst_filepos = itmp;
+
+  /* swap filemax */
+  itmp = filemax;
+  filemax = zst_filemax;
+  zst_filemax = itmp;
+
+  /* swap fsmax */
+  itmp = fsmax;
+  fsmax = zst_fsmax;
+  zst_fsmax = itmp;
+}
+
+
+/*
+ *  Input.
+ */
+
+#define INBUFSIZ  0x2000
+
+static uch *inbuf;
+static int bufloc;
+static int buflen;
+
+/* Refill the input buffer and return its first byte.  Past the end of
+   the file there is nothing to read, so make it zeros.  */
+static int
+fill_inbuf (void)
+{
+  bufloc = 0;
+  buflen = grub_read ((char *) inbuf, INBUFSIZ);
+  if (buflen <= 0)
+    {
+      buflen = 0;
+      return 0;
+    }
+
+  return inbuf[bufloc++];
+}
+
+#define get_byte() (bufloc < buflen ? inbuf[bufloc++] : fill_inbuf ())
+
+/* the position in the compressed file of the next byte from get_byte */
+#define in_pos() (filepos - (buflen - bufloc))
+
+static void
+seek_input (int pos)
+{
+  filepos = pos;
+  bufloc = buflen = 0;
+}
+
+/* Read N bytes into BUF, and return non-zero if they were all there.  */
+static int
+read_input (uch *buf, int n)
+{
+  int k = buflen - bufloc;
+
+  if (k > n)
+    k = n;
+  grub_memcpy (buf, inbuf + bufloc, k);
+  bufloc += k;
+
+  if (n > k && grub_read ((char *) buf + k, n - k) != n - k)
+    return 0;
+
+  return ! errnum;
+}
+
+/* Read an N-byte little-endian number.  */
+static ulg
+get_le (int n)
+{
+  ulg val = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    val |= (ulg) get_byte () << (8 * i);
+
+  return val;
+}
+
+/* the four bytes at AT in BUF, which holds LEN bytes, as zeros past it */
+static ulg
+load_le32 (uch *buf, int len, int at)
+{
+  ulg val = 0;
+  int i;
+
+  if (at + 4 <= len)
+    return buf[at] | (buf[at + 1] << 8) | (buf[at + 2] << 16)
+      | ((ulg) buf[at + 3] << 24);
+
+  for (i = 0; i < 4 && at + i < len; i++)
+    val |= (ulg) buf[at + i] << (8 * i);
+
+  return val;
+}
+
+static int
+highbit (ulg val)
+{
+  int n = 0;
+
+  while (val >>= 1)
+    n++;
+
+  return n;
+}
+
+
+/*
+ *  Decoder state.
+ */
+
+#define LL_MAX_LOG	9
+#define ML_MAX_LOG	9
+#define OF_MAX_LOG	8
+#define HW_MAX_LOG	6
+
+#define LL_MAX_SYMBOL	35
+#define ML_MAX_SYMBOL	52
+#define OF_MAX_SYMBOL	31
+#define HW_MAX_SYMBOL	12
+
+#define MAX_SYMBOLS	64
+
+#define BLOCK_MAX	0x20000
+#define HUF_MAX_BITS	11
+
+struct fse_entry
+{
+  ush new_state;
+  uch symbol;
+  uch nb_bits;
+};
+
+struct huf_entry
+{
+  uch symbol;
+  uch nb_bits;
+};
+
+/* What is known of a frame from its header.  */
+struct zstd_frame
+{
+  int checksum;			/* whether it ends with a checksum */
+  int size;			/* its content size, or -1 */
+  ulg window;			/* its window size */
+};
+
+/* Everything that decoding the blocks of a frame changes.  */
+struct zstd_dec
+{
+  /* the bit stream being read */
+  uch *bw_buf;
+  int bw_len;
+  int bw_pos;
+
+  /* the Huffman table of the literals */
+  struct huf_entry huf_table[1 << HUF_MAX_BITS];
+  int huf_bits;
+  int huf_valid;		/* whether a block of the frame set it up */
+  struct fse_entry hw_table[1 << HW_MAX_LOG];
+  uch *lit_buf;			/* the literals of a block, once decoded */
+
+  /* the sequences */
+  struct fse_entry ll_table[1 << LL_MAX_LOG];
+  struct fse_entry ml_table[1 << ML_MAX_LOG];
+  struct fse_entry of_table[1 << OF_MAX_LOG];
+  int ll_log, ml_log, of_log;
+  int tables_valid;		/* whether a block set up the FSE tables */
+  ulg rep[3];			/* the repeat offsets */
+
+  /* the output, a circular buffer of hist_size bytes */
+  uch *hist_buf;
+  ulg hist_size;
+  ulg hist_pos;
+
+  int frame_size;		/* the content size, or -1 */
+  int frame_out;		/* the bytes decoded so far */
+  int block_max;
+};
+
+
+/*
+ *  Bit streams.
+ *
+ *  The Huffman and FSE coded data is read backwards, from the last
+ *  byte, whose highest set bit marks where it starts, towards the
+ *  first.  bw_pos counts the bits still to be read, and once it goes
+ *  below zero, the bits read are zeros.
+ */
+
+static int
+bw_init (struct zstd_dec *z, uch *buf, int len)
+{
+  if (len <= 0 || ! buf[len - 1])
+    return 0;
+
+  z->bw_buf = buf;
+  z->bw_len = len;
+  z->bw_pos = (len - 1) * 8 + highbit (buf[len - 1]);
+  return 1;
+}
+
+/* the next N bits, N up to 24, without taking them */
+static ulg
+bw_peek (struct zstd_dec *z, int n)
+{
+  int pos = z->bw_pos - n;
+  int lead = 0;
+
+  if (pos < 0)
+    {
+      lead = -pos;
+      if (lead >= n)
+	return 0;
+      n -= lead;
+      pos = 0;
+    }
+
+  return (((load_le32 (z->bw_buf, z->bw_len, pos >> 3) >> (pos & 7))
+	   & ((1 << n) - 1)) << lead);
+}
+
+static ulg
+bw_bits (struct zstd_dec *z, int n)
+{
+  ulg val;
+
+  if (n > 24)
+    {
+      val = bw_bits (z, n - 24) << 24;
+      return val | bw_bits (z, 24);
+    }
+
+  val = bw_peek (z, n);
+  z->bw_pos -= n;
+  return val;
+}
+
+
+/*
+ *  FSE tables.
+ */
+
+/* Read the normalized counts out of an FSE table description in the
+   LEN bytes at BUF.  *MAX_SYMBOL is the largest symbol allowed, and is
+   set to the largest one there.  Return the bytes used, or -1.  */
+static int
+fse_read_counts (uch *buf, int len, short *norm, int *max_symbol, int *log,
+		 int max_log)
+{
+  int pos, nb, remaining, threshold, max, count, symbol = 0, prev0 = 0;
+  ulg val;
+
+  val = load_le32 (buf, len, 0);
+  nb = (val & 0xf) + 5;
+  if (nb > max_log)
+    return -1;
+
+  *log = nb;
+  pos = 4;
+  remaining = (1 << nb) + 1;
+  threshold = 1 << nb;
+  nb++;
+
+  while (remaining > 1 && symbol <= *max_symbol)
+    {
+      if (prev0)
+	{
+	  int n0 = symbol, repeat;
+
+	  /* each two bits add up to three more zeros, all ones go on */
+	  do
+	    {
+	      repeat = (load_le32 (buf, len, pos >> 3) >> (pos & 7)) & 3;
+	      pos += 2;
+	      n0 += repeat;
+	    }
+	  while (repeat == 3 && pos < len * 8);
+
+	  if (n0 > *max_symbol)
+	    return -1;
+	  while (symbol < n0)
+	    norm[symbol++] = 0;
+	}
+
+      val = load_le32 (buf, len, pos >> 3) >> (pos & 7);
+      max = (2 * threshold - 1) - remaining;
+      if ((val & (threshold - 1)) < max)
+	{
+	  count = val & (threshold - 1);
+	  pos += nb - 1;
+	}
+      else
+	{
+	  count = val & (2 * threshold - 1);
+	  if (count >= threshold)
+	    count -= max;
+	  pos += nb;
+	}
+
+      /* a count of -1 is a probability of less than one */
+      count--;
+      remaining -= count < 0 ? -count : count;
+      if (remaining < 1)
+	return -1;
+
+      norm[symbol++] = count;
+      prev0 = ! count;
+
+      while (remaining < threshold)
+	{
+	  nb--;
+	  threshold >>= 1;
+	}
+    }
+
+  if (remaining != 1 || pos > len * 8)
+    return -1;
+
+  *max_symbol = symbol - 1;
+  return (pos + 7) >> 3;
+}
+
+/* Spread the symbols over a decoding table of 1 << LOG states.  */
+static int
+fse_build (struct fse_entry *table, short *norm, int max_symbol, int log)
+{
+  ush next[MAX_SYMBOLS];
+  int size = 1 << log;
+  int high = size - 1;
+  int step = (size >> 1) + (size >> 3) + 3;
+  int pos = 0;
+  int s, i, n, bits;
+
+  for (s = 0; s <= max_symbol; s++)
+    if (norm[s] == -1)
+      {
+	table[high--].symbol = s;
+	next[s] = 1;
+      }
+    else
+      next[s] = norm[s];
+
+  for (s = 0; s <= max_symbol; s++)
+    for (i = 0; i < norm[s]; i++)
+      {
+	table[pos].symbol = s;
+	do
+	  pos = (pos + step) & (size - 1);
+	while (pos > high);
+      }
+
+  if (pos)
+    return 0;
+
+  for (i = 0; i < size; i++)
+    {
+      n = next[table[i].symbol]++;
+      bits = log - highbit (n);
+      table[i].nb_bits = bits;
+      table[i].new_state = (n << bits) - size;
+    }
+
+  return 1;
+}
+
+/* a table which always decodes SYMBOL */
+static void
+fse_build_rle (struct fse_entry *table, int symbol)
+{
+  table[0].symbol = symbol;
+  table[0].nb_bits = 0;
+  table[0].new_state = 0;
+}
+
+
+/*
+ *  Literals.
+ */
+
+/* Build the Huffman table out of the description in the LEN bytes at
+   BUF.  Return the bytes used, or -1.  */
+static int
+huf_read_table (struct zstd_dec *z, uch *buf, int len)
+{
+  struct fse_entry *hw_table = z->hw_table;
+  uch weights[256];
+  int rank[HUF_MAX_BITS + 2];
+  int header, n = 0, used, i, j, w, sum, rest;
+
+  if (len < 1)
+    return -1;
+
+  header = buf[0];
+  if (header >= 128)
+    {
+      /* four bits each */
+      n = header - 127;
+      used = 1 + (n + 1) / 2;
+      if (used > len)
+	return -1;
+
+      for (i = 0; i < n; i++)
+	weights[i] = (i & 1) ? buf[1 + i / 2] & 0xf : buf[1 + i / 2] >> 4;
+    }
+  else
+    {
+      /* FSE coded, with two states taking turns */
+      short norm[MAX_SYMBOLS];
+      int max_symbol = HW_MAX_SYMBOL, log, k;
+      int s1, s2;
+
+      used = 1 + header;
+      if (used > len)
+	return -1;
+
+      k = fse_read_counts (buf + 1, header, norm, &max_symbol, &log,
+			   HW_MAX_LOG);
+      if (k < 0 || ! fse_build (hw_table, norm, max_symbol, log)
+	  || ! bw_init (z, buf + 1 + k, header - k))
+	return -1;
+
+      s1 = bw_bits (z, log);
+      s2 = bw_bits (z, log);
+      for (;;)
+	{
+	  if (n > 253)
+	    return -1;
+
+	  weights[n++] = hw_table[s1].symbol;
+	  s1 = hw_table[s1].new_state + bw_bits (z, hw_table[s1].nb_bits);
+	  if (z->bw_pos < 0)
+	    {
+	      weights[n++] = hw_table[s2].symbol;
+	      break;
+	    }
+
+	  weights[n++] = hw_table[s2].symbol;
+	  s2 = hw_table[s2].new_state + bw_bits (z, hw_table[s2].nb_bits);
+	  if (z->bw_pos < 0)
+	    {
+	      weights[n++] = hw_table[s1].symbol;
+	      break;
+	    }
+	}
+    }
+
+  /* the weight of the last symbol makes the total a power of two */
+  sum = 0;
+  for (i = 0; i < n; i++)
+    {
+      if (weights[i] > HUF_MAX_BITS)
+	return -1;
+      if (weights[i])
+	sum += 1 << (weights[i] - 1);
+    }
+
+  if (! sum || n > 255)
+    return -1;
+
+  z->huf_bits = highbit (sum) + 1;
+  rest = (1 << z->huf_bits) - sum;
+  if (z->huf_bits > HUF_MAX_BITS || (rest & (rest - 1)))
+    return -1;
+  weights[n++] = highbit (rest) + 1;
+
+  /* where the entries of each weight start, the lowest weights first */
+  for (w = 1; w <= z->huf_bits + 1; w++)
+    rank[w] = 0;
+  for (i = 0; i < n; i++)
+    if (weights[i])
+      rank[weights[i]]++;
+  for (sum = 0, w = 1; w <= z->huf_bits; w++)
+    {
+      j = rank[w] << (w - 1);
+      rank[w] = sum;
+      sum += j;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      w = weights[i];
+      if (! w)
+	continue;
+
+      for (j = 0; j < (1 << (w - 1)); j++)
+	{
+	  z->huf_table[rank[w] + j].symbol = i;
+	  z->huf_table[rank[w] + j].nb_bits = z->huf_bits + 1 - w;
+	}
+      rank[w] += 1 << (w - 1);
+    }
+
+  z->huf_valid = 1;
+  return used;
+}
+
+/* Decode COUNT literals out of one Huffman coded stream.  */
+static int
+huf_decode_stream (struct zstd_dec *z, uch *src, int len, uch *dest,
+		   int count)
+{
+  struct huf_entry *e;
+
+  if (! bw_init (z, src, len))
+    return 0;
+
+  while (count--)
+    {
+      e = z->huf_table + bw_peek (z, z->huf_bits);
+      *dest++ = e->symbol;
+      z->bw_pos -= e->nb_bits;
+    }
+
+  return z->bw_pos == 0;
+}
+
+
+/*
+ *  History.
+ *
+ *  A circular buffer of hist_size bytes holding the latest output.
+ *  When a frame is decoded straight into a buffer as big as it, the
+ *  buffer never goes round.
+ */
+
+static void
+hist_copy (struct zstd_dec *z, uch *src, ulg n)
+{
+  ulg k;
+
+  while (n)
+    {
+      k = z->hist_size - z->hist_pos;
+      if (k > n)
+	k = n;
+
+      grub_memcpy (z->hist_buf + z->hist_pos, src, k);
+      z->hist_pos += k;
+      if (z->hist_pos == z->hist_size)
+	z->hist_pos = 0;
+      src += k;
+      n -= k;
+    }
+}
+
+static void
+hist_match (struct zstd_dec *z, ulg offset, ulg len)
+{
+  uch *hist_buf = z->hist_buf;
+  ulg hist_size = z->hist_size;
+  ulg hist_pos = z->hist_pos;
+  ulg from = hist_pos - offset;
+  uch *d, *s;
+
+  if (offset > hist_pos)
+    from += hist_size;
+
+  if (from + len <= hist_size && hist_pos + len <= hist_size)
+    {
+      d = hist_buf + hist_pos;
+      s = hist_buf + from;
+      hist_pos += len;
+      if (hist_pos == hist_size)
+	hist_pos = 0;
+      z->hist_pos = hist_pos;
+
+      while (len--)
+	*d++ = *s++;
+      return;
+    }
+
+  while (len--)
+    {
+      hist_buf[hist_pos++] = hist_buf[from++];
+      if (hist_pos == hist_size)
+	hist_pos = 0;
+      if (from == hist_size)
+	from = 0;
+    }
+  z->hist_pos = hist_pos;
+}
+
+
+/*
+ *  Frames and blocks.
+ */
+
+#define ZSTD_MAGIC		0xfd2fb528
+#define SKIPPABLE_MAGIC		0x184d2a50
+#define SKIPPABLE_MASK		0xfffffff0
+
+#define FRAME_HEADER_MAX	14	/* after the magic number */
+
+static struct zstd_dec *zst;	/* the frame being read */
+static struct zstd_frame frame;	/* and its header */
+static int in_frame;		/* whether a frame header has been read */
+static uch *blk_buf;		/* the compressed block */
+
+static int did_sizes[4] = { 0, 1, 2, 4 };
+static int fcs_sizes[4] = { 0, 2, 4, 8 };
+
+/* the length of the frame header which starts with the descriptor FHD,
+   not counting the magic number */
+static int
+zstd_header_len (int fhd)
+{
+  int single = (fhd >> 5) & 1;
+
+  return (1 + ! single + did_sizes[fhd & 3] + fcs_sizes[fhd >> 6]
+	  + (single && ! (fhd >> 6)));
+}
+
+/* Parse the frame header at BUF into F.  Return zero if it is not one
+   that can be decoded.  */
+static int
+zstd_parse_header (uch *buf, struct zstd_frame *f)
+{
+  int fhd = buf[0];
+  int fcs_flag = fhd >> 6;
+  int single = (fhd >> 5) & 1;
+  int pos = 1, exponent;
+  ulg lo, hi = 0;
+
+  /* no reserved bit */
+  if (fhd & 0x08)
+    return 0;
+
+  f->checksum = (fhd >> 2) & 1;
+
+  f->window = 0;
+  if (! single)
+    {
+      exponent = 10 + (buf[pos] >> 3);
+      if (exponent > 30)
+	f->window = 0xffffffff;
+      else
+	f->window = ((1U << exponent)
+		     + ((1U << exponent) >> 3) * (buf[pos] & 7));
+      pos++;
+    }
+
+  /* and no dictionary */
+  if ((fhd & 3) && load_le32 (buf + pos, did_sizes[fhd & 3], 0))
+    return 0;
+  pos += did_sizes[fhd & 3];
+
+  switch (fcs_flag)
+    {
+    case 0:
+      lo = single ? buf[pos] : (ulg) -1;
+      break;
+    case 1:
+      lo = (buf[pos] | (buf[pos + 1] << 8)) + 256;
+      break;
+    case 2:
+      lo = load_le32 (buf + pos, 4, 0);
+      break;
+    default:
+      lo = load_le32 (buf + pos, 4, 0);
+      hi = load_le32 (buf + pos + 4, 4, 0);
+      break;
+    }
+
+  if (lo == (ulg) -1 && ! fcs_flag)
+    f->size = -1;
+  else if (hi || lo > MAXINT)
+    return 0;
+  else
+    f->size = lo;
+
+  if (single)
+    f->window = f->size;
+
+  return 1;
+}
+
+/* Get Z ready for the blocks of the frame F.  */
+static void
+zstd_start_frame (struct zstd_dec *z, struct zstd_frame *f)
+{
+  z->frame_size = f->size;
+  z->frame_out = 0;
+  z->block_max = f->window < BLOCK_MAX ? f->window : BLOCK_MAX;
+  z->rep[0] = 1;
+  z->rep[1] = 4;
+  z->rep[2] = 8;
+  z->huf_valid = 0;
+  z->tables_valid = 0;
+}
+
+/* Read the header of the next frame, skipping any skippable ones.
+   Return zero at the end of the file, or on error.  */
+static int
+zstd_frame_header (void)
+{
+  uch buf[FRAME_HEADER_MAX];
+  ulg magic, lo;
+  int len, i;
+
+  for (;;)
+    {
+      if (in_pos () >= filemax)
+	return 0;
+
+      magic = get_le (4);
+      if (magic == ZSTD_MAGIC)
+	break;
+
+      /* a file read by blocklist ends with the rest of its last
+	 sector, so take zeros after the first frame as the end */
+      if (! magic && in_pos () > 4)
+	return 0;
+
+      if ((magic & SKIPPABLE_MASK) != SKIPPABLE_MAGIC)
+	{
+	  errnum = ERR_BAD_GZIP_HEADER;
+	  return 0;
+	}
+
+      lo = get_le (4);
+      if (lo > filemax - in_pos ())
+	{
+	  errnum = ERR_BAD_GZIP_HEADER;
+	  return 0;
+	}
+      seek_input (in_pos () + lo);
+    }
+
+  buf[0] = get_byte ();
+  len = zstd_header_len (buf[0]);
+  for (i = 1; i < len; i++)
+    buf[i] = get_byte ();
+
+  if (! zstd_parse_header (buf, &frame))
+    {
+      errnum = ERR_BAD_GZIP_HEADER;
+      return 0;
+    }
+
+  zstd_start_frame (zst, &frame);
+  in_frame = 1;
+  return ! errnum;
+}
+
+
+/* Decode the literals section of the block at BLK, which holds LEN
+   bytes.  Point *LITS at them and set *COUNT, and return the bytes
+   used, or -1.  */
+static int
+zstd_literals (struct zstd_dec *z, uch *blk, int len, uch **lits,
+	       int *count)
+{
+  uch *lit_buf = z->lit_buf;
+  int type = blk[0] & 3;
+  int format = (blk[0] >> 2) & 3;
+  int header, regen, size, streams, bits, used, i, seg;
+  ulg val;
+
+  if (type < 2)
+    {
+      /* raw or RLE */
+      switch (format)
+	{
+	case 0:
+	case 2:
+	  header = 1;
+	  regen = blk[0] >> 3;
+	  break;
+	case 1:
+	  header = 2;
+	  regen = (blk[0] >> 4) + (blk[1] << 4);
+	  break;
+	default:
+	  header = 3;
+	  regen = ((blk[0] >> 4) + (blk[1] << 4)
+		   + (blk[2] << 12));
+	  break;
+	}
+
+      if (regen > BLOCK_MAX || header + (type ? 1 : regen) > len)
+	return -1;
+
+      *count = regen;
+      if (! type)
+	{
+	  *lits = blk + header;
+	  return header + regen;
+	}
+
+      for (i = 0; i < regen; i++)
+	lit_buf[i] = blk[header];
+      *lits = lit_buf;
+      return header + 1;
+    }
+
+  /* Huffman coded, with a new tree or the last one */
+  streams = format ? 4 : 1;
+  header = format < 2 ? 3 : format + 2;
+  bits = format < 2 ? 10 : format == 2 ? 14 : 18;
+  if (header > len)
+    return -1;
+
+  val = load_le32 (blk, len, 0) >> 4;
+  regen = val & ((1 << bits) - 1);
+  size = (val >> bits) & ((1 << bits) - 1);
+  if (header == 5)
+    size = (load_le32 (blk, len, 2) >> 6) & ((1 << 18) - 1);
+  if (regen > BLOCK_MAX || header + size > len)
+    return -1;
+
+  used = header;
+  if (type == 2)
+    {
+      i = huf_read_table (z, blk + used, size);
+      if (i < 0)
+	return -1;
+      used += i;
+      size -= i;
+    }
+  else if (! z->huf_valid)
+    return -1;
+
+  if (streams == 1)
+    {
+      if (! huf_decode_stream (z, blk + used, size, lit_buf, regen))
+	return -1;
+    }
+  else
+    {
+      int sizes[4];
+
+      if (size < 6)
+	return -1;
+
+      sizes[0] = blk[used] | (blk[used + 1] << 8);
+      sizes[1] = blk[used + 2] | (blk[used + 3] << 8);
+      sizes[2] = blk[used + 4] | (blk[used + 5] << 8);
+      sizes[3] = size - 6 - sizes[0] - sizes[1] - sizes[2];
+      seg = (regen + 3) / 4;
+      if (sizes[3] <= 0 || regen < seg * 3)
+	return -1;
+
+      used += 6;
+      for (i = 0; i < 4; i++)
+	{
+	  if (! huf_decode_stream (z, blk + used, sizes[i],
+				   lit_buf + seg * i,
+				   i < 3 ? seg : regen - seg * 3))
+	    return -1;
+	  used += sizes[i];
+	}
+      size = 0;
+    }
+
+  *lits = lit_buf;
+  *count = regen;
+  return used + size;
+}
+
+
+/*
+ *  Sequences.
+ */
+
+static ulg ll_base[LL_MAX_SYMBOL + 1] =
+{
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+  8192, 16384, 32768, 65536
+};
+static uch ll_extra[LL_MAX_SYMBOL + 1] =
+{
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+  13, 14, 15, 16
+};
+static ulg ml_base[ML_MAX_SYMBOL + 1] =
+{
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+  19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+  35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+  4099, 8195, 16387, 32771, 65539
+};
+static uch ml_extra[ML_MAX_SYMBOL + 1] =
+{
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+  12, 13, 14, 15, 16
+};
+
+/* the predefined distributions */
+static short ll_default[LL_MAX_SYMBOL + 1] =
+{
+  4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+  -1, -1, -1, -1
+};
+static short ml_default[ML_MAX_SYMBOL + 1] =
+{
+  1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+  -1, -1, -1, -1, -1
+};
+static short of_default[29] =
+{
+  1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+/* Set up one of the three tables according to MODE, reading from the
+   LEN bytes at BUF.  Return the bytes used, or -1.  */
+static int
+zstd_seq_table (int mode, uch *buf, int len, struct fse_entry *table,
+		int *log, int max_log, int max_symbol, short *preset,
+		int preset_symbols, int preset_log)
+{
+  short norm[MAX_SYMBOLS];
+  int used;
+
+  switch (mode)
+    {
+    case 0:
+      *log = preset_log;
+      return fse_build (table, preset, preset_symbols - 1, preset_log) ? 0 : -1;
+
+    case 1:
+      if (len < 1 || buf[0] > max_symbol)
+	return -1;
+      fse_build_rle (table, buf[0]);
+      *log = 0;
+      return 1;
+
+    case 2:
+      used = fse_read_counts (buf, len, norm, &max_symbol, log, max_log);
+      if (used < 0 || ! fse_build (table, norm, max_symbol, *log))
+	return -1;
+      return used;
+
+    default:
+      /* the table of the last block, checked for by the caller */
+      return 0;
+    }
+}
+
+/* Decode the sequences section in the LEN bytes at BUF, and carry out
+   the sequences on the COUNT literals at LITS, which may make no more
+   than ROOM bytes.  Return the bytes they make, or -1.  */
+static int
+zstd_sequences (struct zstd_dec *z, uch *buf, int len, uch *lits, int count,
+		int room)
+{
+  struct fse_entry *ll_table = z->ll_table;
+  struct fse_entry *ml_table = z->ml_table;
+  struct fse_entry *of_table = z->of_table;
+  ulg *rep = z->rep;
+  int nb_seq, used, modes, k;
+  ulg ll_state, ml_state, of_state;
+  ulg lit_len, match_len, offset, value;
+  int produced = 0;
+  struct fse_entry *e;
+
+  if (len < 1)
+    return -1;
+
+  nb_seq = buf[0];
+  used = 1;
+  if (nb_seq >= 128)
+    {
+      if (len < 2)
+	return -1;
+      if (nb_seq < 255)
+	nb_seq = ((nb_seq - 128) << 8) + buf[used++];
+      else
+	{
+	  if (len < 3)
+	    return -1;
+	  nb_seq = buf[1] + (buf[2] << 8) + 0x7f00;
+	  used = 3;
+	}
+    }
+
+  if (nb_seq)
+    {
+      if (used >= len)
+	return -1;
+
+      modes = buf[used++];
+      if ((modes & 3)
+	  || (! z->tables_valid && ((modes & 0x0c) == 0x0c
+				 || (modes & 0x30) == 0x30
+				 || (modes & 0xc0) == 0xc0)))
+	return -1;
+
+      k = zstd_seq_table (modes >> 6, buf + used, len - used, ll_table,
+			  &z->ll_log, LL_MAX_LOG, LL_MAX_SYMBOL, ll_default,
+			  LL_MAX_SYMBOL + 1, 6);
+      if (k < 0)
+	return -1;
+      used += k;
+      k = zstd_seq_table ((modes >> 4) & 3, buf + used, len - used, of_table,
+			  &z->of_log, OF_MAX_LOG, OF_MAX_SYMBOL, of_default,
+			  29, 5);
+      if (k < 0)
+	return -1;
+      used += k;
+      k = zstd_seq_table ((modes >> 2) & 3, buf + used, len - used, ml_table,
+			  &z->ml_log, ML_MAX_LOG, ML_MAX_SYMBOL, ml_default,
+			  ML_MAX_SYMBOL + 1, 6);
+      if (k < 0)
+	return -1;
+      used += k;
+
+      /* only once all three are there may the next block repeat them */
+      z->tables_valid = 1;
+
+      if (! bw_init (z, buf + used, len - used))
+	return -1;
+
+      ll_state = bw_bits (z, z->ll_log);
+      of_state = bw_bits (z, z->of_log);
+      ml_state = bw_bits (z, z->ml_log);
+
+      while (nb_seq--)
+	{
+	  int ll_code = ll_table[ll_state].symbol;
+	  int ml_code = ml_table[ml_state].symbol;
+	  int of_code = of_table[of_state].symbol;
+
+	  value = (1U << of_code) + bw_bits (z, of_code);
+	  match_len = ml_base[ml_code] + bw_bits (z, ml_extra[ml_code]);
+	  lit_len = ll_base[ll_code] + bw_bits (z, ll_extra[ll_code]);
+
+	  if (value > 3)
+	    {
+	      offset = value - 3;
+	      rep[2] = rep[1];
+	      rep[1] = rep[0];
+	      rep[0] = offset;
+	    }
+	  else
+	    {
+	      /* a repeat offset, of which there is one more to pick
+		 from when the sequence has no literals */
+	      value -= lit_len ? 1 : 0;
+	      if (! value)
+		offset = rep[0];
+	      else
+		{
+		  offset = value == 3 ? rep[0] - 1 : rep[value];
+		  if (! offset)
+		    return -1;
+		  if (value != 1)
+		    rep[2] = rep[1];
+		  rep[1] = rep[0];
+		  rep[0] = offset;
+		}
+	    }
+
+	  if (nb_seq)
+	    {
+	      e = ll_table + ll_state;
+	      ll_state = e->new_state + bw_bits (z, e->nb_bits);
+	      e = ml_table + ml_state;
+	      ml_state = e->new_state + bw_bits (z, e->nb_bits);
+	      e = of_table + of_state;
+	      of_state = e->new_state + bw_bits (z, e->nb_bits);
+	    }
+
+	  if (lit_len > count
+	      || produced + lit_len + match_len > room
+	      || offset > z->frame_out + produced + lit_len
+	      || offset > z->hist_size)
+	    return -1;
+
+	  hist_copy (z, lits, lit_len);
+	  lits += lit_len;
+	  count -= lit_len;
+	  hist_match (z, offset, match_len);
+	  produced += lit_len + match_len;
+	}
+
+      if (z->bw_pos > 0)
+	return -1;
+    }
+
+  /* and what literals are left */
+  if (produced + count > room)
+    return -1;
+
+  hist_copy (z, lits, count);
+  return produced + count;
+}
+
+
+/* Decode the content of a block of TYPE and SIZE, at DATA, and return
+   the bytes it makes, or -1.  */
+static int
+zstd_block_data (struct zstd_dec *z, int type, int size, uch *data)
+{
+  int room = z->block_max;
+  int produced = -1;
+
+  /* not past the end of the frame either, whose buffer may be no
+     bigger */
+  if (z->frame_size >= 0 && room > z->frame_size - z->frame_out)
+    room = z->frame_size - z->frame_out;
+
+  if (size > z->block_max || (type < 2 && size > room))
+    return -1;
+
+  switch (type)
+    {
+    case 0:
+      /* raw */
+      hist_copy (z, data, size);
+      produced = size;
+      break;
+
+    case 1:
+      /* RLE */
+      for (produced = 0; produced < size; produced++)
+	{
+	  z->hist_buf[z->hist_pos++] = data[0];
+	  if (z->hist_pos == z->hist_size)
+	    z->hist_pos = 0;
+	}
+      break;
+
+    case 2:
+      {
+	uch *lits;
+	int count, used;
+
+	used = zstd_literals (z, data, size, &lits, &count);
+	if (used >= 0)
+	  produced = zstd_sequences (z, data + used, size - used, lits, count,
+				     room);
+      }
+      break;
+    }
+
+  if (produced >= 0)
+    z->frame_out += produced;
+
+  return produced;
+}
+
+/* Decode the next block, reading the next frame header first if it is
+   time to.  */
+static void
+zstd_block (void)
+{
+  ulg header;
+  int last, type, size, produced;
+
+  if (! in_frame)
+    {
+      if (! zstd_frame_header () && ! errnum)
+	errnum = ERR_BAD_GZIP_DATA;
+      return;
+    }
+
+  header = get_le (3);
+  last = header & 1;
+  type = (header >> 1) & 3;
+  size = header >> 3;
+
+  if (type == 3 || size > zst->block_max
+      || ! read_input (blk_buf, type == 1 ? 1 : size))
+    {
+      errnum = ERR_BAD_GZIP_DATA;
+      return;
+    }
+
+  produced = zstd_block_data (zst, type, size, blk_buf);
+  if (produced < 0)
+    {
+      errnum = ERR_BAD_GZIP_DATA;
+      return;
+    }
+
+  out_pos += produced;
+
+  if (last)
+    {
+      if (zst->frame_size >= 0 && zst->frame_out != zst->frame_size)
+	errnum = ERR_BAD_GZIP_DATA;
+      if (frame.checksum)
+	seek_input (in_pos () + 4);
+      in_frame = 0;
+    }
+}
+
+
+/* Go back to the first frame.  */
+static void
+unzstd_restart (void)
+{
+  seek_input (0);
+  out_pos = 0;
+  hist_from = 0;
+  zst->hist_pos = 0;
+  in_frame = 0;
+}
+
+/* Walk through the frames, to find how big the file is and how much
+   history it needs.  Return the size, or -1 if some frame does not say,
+   which leaves decoding it all to find out.  */
+static int
+unzstd_scan (ulg *window)
+{
+  ulg header;
+  int total = 0, size, type, last;
+
+  seek_input (0);
+  *window = 0;
+  num_frames = 0;
+
+  while (zstd_frame_header ())
+    {
+      ulg need = frame.window;
+
+      if (frame.size >= 0 && need > frame.size)
+	need = frame.size;
+      if (need > *window)
+	*window = need;
+
+      if (total >= 0)
+	{
+	  if (frame.size < 0)
+	    total = -1;
+	  else if (frame.size > MAXINT - total)
+	    {
+	      errnum = ERR_BAD_GZIP_HEADER;
+	      return -1;
+	    }
+	  else
+	    total += frame.size;
+	}
+      num_frames++;
+
+      do
+	{
+	  if (in_pos () + 3 > filemax)
+	    {
+	      errnum = ERR_BAD_GZIP_HEADER;
+	      return -1;
+	    }
+
+	  header = get_le (3);
+	  last = header & 1;
+	  type = (header >> 1) & 3;
+	  size = header >> 3;
+	  if (type == 3 || in_pos () + (type == 1 ? 1 : size) > filemax)
+	    {
+	      errnum = ERR_BAD_GZIP_HEADER;
+	      return -1;
+	    }
+	  seek_input (in_pos () + (type == 1 ? 1 : size));
+	}
+      while (! last);
+
+      if (frame.checksum)
+	seek_input (in_pos () + 4);
+      in_frame = 0;
+    }
+
+  return total;
+}
+
+/* As in unxz.c, the input buffer and the decoder take the
+   ZSTD_STATE_SIZE bytes at the top of upper memory, and the other
+   buffers are below them.  */
+#define ZSTD_STATE_SIZE \
+  ((INBUFSIZ + sizeof (struct zstd_dec) + 0xfff) & ~0xfff)
+
+static unsigned long
+unzstd_top (void)
+{
+  unsigned long top;
+
+#ifdef PLATFORM_EFI
+  top = (mbi.mem_upper << 10) + 0x100000;
+  if (top > GRUB_SCRATCH_MEM_SIZE)
+    top = GRUB_SCRATCH_MEM_SIZE;
+#else
+  top = (mbi.mem_upper << 10) + 0x100000;
+#endif
+
+  return top - ZSTD_STATE_SIZE;
+}
+
+/* Take the buffers from below the state.  */
+static int
+unzstd_alloc (ulg window, int size)
+{
+  unsigned long top = unzstd_top ();
+
+  zst->hist_size = window;
+  if (size >= 0 && zst->hist_size > size)
+    zst->hist_size = size;
+  zst->hist_size = (zst->hist_size + 0xfff) & ~0xfff;
+  if (! zst->hist_size)
+    zst->hist_size = 0x1000;
+
+  /* a little to spare after the block, for reading four bytes at once */
+  if (top < 0x100000 + 2 * (BLOCK_MAX + 0x1000) + zst->hist_size)
+    return 0;
+
+  zst->hist_buf = (uch *) RAW_ADDR (top - zst->hist_size);
+  zst->lit_buf = zst->hist_buf - (BLOCK_MAX + 0x1000);
+  blk_buf = zst->lit_buf - (BLOCK_MAX + 0x1000);
+  return 1;
+}
+
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+/*
+ *  Parallel decoding.
+ *
+ *  Frames don't depend on each other, so the ones a read takes in
+ *  whole can be decoded in any order, by any processor, once their
+ *  sizes are known.  The other processors take them one at a time,
+ *  and decode each straight into its place in the buffer read to,
+ *  while this one reads in the compressed data a chunk at a time.
+ *  Then it helps them with what is left.  gunzip_parallel does the
+ *  same with gzip members; xz blocks are decoded on this processor
+ *  alone.
+ */
+
+#define PAR_CHUNK	0x100000	/* compressed bytes read at a time */
+
+struct zstd_job
+{
+  struct zstd_frame frame;
+  uch *src;			/* its blocks, or 0 for a skippable frame */
+  int len;
+  uch *dest;
+  int ok;
+};
+
+static struct zstd_job *par_jobs;
+static struct zstd_dec *par_decs;	/* one for each processor */
+static int par_num_decs;
+static volatile int par_ready;		/* the jobs which may be taken */
+static volatile int par_taken;		/* and those taken */
+static volatile int par_done;		/* whether no more will be ready */
+static volatile int par_next_dec;
+
+/* Find where the frame at BUF, of which LEN bytes have been read, ends,
+   and fill in JOB.  Return its length, 0 if some of it is still to be
+   read, or -1 if it is not a frame to be decoded in parallel.  */
+static int
+zstd_frame_extent (uch *buf, int len, struct zstd_job *job)
+{
+  ulg magic, header;
+  int pos, size, type, last;
+
+  if (len < 8)
+    return 0;
+
+  magic = load_le32 (buf, len, 0);
+  if ((magic & SKIPPABLE_MASK) == SKIPPABLE_MAGIC)
+    {
+      header = load_le32 (buf, len, 4);
+      job->src = 0;
+      if (header > MAXINT - 8)
+	return -1;
+      return 8 + header <= len ? 8 + header : 0;
+    }
+
+  if (magic != ZSTD_MAGIC)
+    return -1;
+
+  pos = 4 + zstd_header_len (buf[4]);
+  if (pos > len)
+    return 0;
+  if (! zstd_parse_header (buf + 4, &job->frame) || job->frame.size < 0)
+    return -1;
+
+  job->src = buf + pos;
+  do
+    {
+      if (pos + 3 > len)
+	return 0;
+
+      header = load_le32 (buf, len, pos) & 0xffffff;
+      last = header & 1;
+      type = (header >> 1) & 3;
+      size = header >> 3;
+      if (type == 3)
+	return -1;
+
+      pos += 3 + (type == 1 ? 1 : size);
+      if (pos > len)
+	return 0;
+    }
+  while (! last);
+
+  job->len = buf + pos - job->src;
+  if (job->frame.checksum)
+    pos += 4;
+
+  return pos <= len ? pos : 0;
+}
+
+/* Decode the frame of JOB with Z.  */
+static void
+zstd_run_job (struct zstd_dec *z, struct zstd_job *job)
+{
+  uch *src = job->src;
+  ulg header;
+  int last = 0, type, size;
+
+  zstd_start_frame (z, &job->frame);
+  z->hist_buf = job->dest;
+  z->hist_size = job->frame.size;
+  z->hist_pos = 0;
+
+  /* zstd_frame_extent has made sure that the blocks are all there */
+  while (! last)
+    {
+      header = src[0] | (src[1] << 8) | (src[2] << 16);
+      last = header & 1;
+      type = (header >> 1) & 3;
+      size = header >> 3;
+      src += 3;
+
+      if (zstd_block_data (z, type, size, src) < 0)
+	return;
+      src += type == 1 ? 1 : size;
+    }
+
+  job->ok = z->frame_out == z->frame_size;
+}
+
+/* Take jobs until there are no more.  This runs on every processor,
+   so it must touch nothing but the jobs, their buffers and a decoder
+   of its own.  */
+static void
+unzstd_worker (void *arg)
+{
+  int n = __sync_fetch_and_add (&par_next_dec, 1);
+  int done, i;
+
+  if (n >= par_num_decs)
+    return;
+
+  for (;;)
+    {
+      /* see that it is done before seeing what is ready */
+      done = par_done;
+      i = par_taken;
+
+      if (i < par_ready)
+	{
+	  if (__sync_bool_compare_and_swap (&par_taken, i, i + 1))
+	    zstd_run_job (par_decs + n, par_jobs + i);
+	}
+      else if (done)
+	break;
+      else
+	asm volatile ("pause");
+    }
+}
+
+/* Decode the whole frames that a read of LEN bytes into DEST takes in,
+   with the help of the other processors.  Return the bytes decoded,
+   which is zero if it is not worth it.  */
+static int
+unzstd_parallel (uch *dest, int len)
+{
+  int start = in_pos ();
+  int clen = filemax - start;
+  int avail = 0, parsed = 0, total = 0, stop = 0, n, i;
+  struct zstd_job *job;
+  uch *cbuf;
+
+  if (num_frames < 2 || len <= BLOCK_MAX || clen <= 0)
+    return 0;
+
+  par_num_decs = grub_mp_count () + 1;
+  if (par_num_decs < 2 || ! memcheck ((unsigned long) dest, len))
+    return 0;
+
+  cbuf = grub_malloc (clen);
+  par_jobs = grub_malloc (num_frames * sizeof (struct zstd_job));
+  par_decs = grub_malloc (par_num_decs
+			  * (sizeof (struct zstd_dec) + BLOCK_MAX));
+  if (! cbuf || ! par_jobs || ! par_decs)
+    goto out;
+
+  for (i = 0; i < par_num_decs; i++)
+    par_decs[i].lit_buf = ((uch *) (par_decs + par_num_decs)
+			   + i * BLOCK_MAX);
+
+  par_ready = par_taken = par_done = par_next_dec = 0;
+  if (! grub_mp_start (unzstd_worker, 0))
+    goto out;
+
+  while (! stop)
+    {
+      n = clen - avail;
+      if (n > PAR_CHUNK)
+	n = PAR_CHUNK;
+      if (! read_input (cbuf + avail, n))
+	break;
+      avail += n;
+
+      /* hand out the frames which are in now */
+      while (par_ready < num_frames)
+	{
+	  job = par_jobs + par_ready;
+	  i = zstd_frame_extent (cbuf + parsed, avail - parsed, job);
+	  if (i < 0 || (! i && avail == clen)
+	      || (i && job->src && job->frame.size > len - total))
+	    {
+	      stop = 1;
+	      break;
+	    }
+	  if (! i)
+	    break;
+
+	  parsed += i;
+	  if (! job->src)
+	    continue;
+
+	  job->dest = dest + total;
+	  job->ok = 0;
+	  total += job->frame.size;
+	  __sync_synchronize ();
+	  par_ready++;
+	}
+
+      if (par_ready == num_frames || avail == clen)
+	stop = 1;
+    }
+
+  par_done = 1;
+  unzstd_worker (0);
+  grub_mp_wait ();
+
+  for (i = 0; i < par_ready; i++)
+    if (! par_jobs[i].ok)
+      errnum = ERR_BAD_GZIP_DATA;
+
+  /* carry on after them, with no history from before */
+  seek_input (start + parsed);
+  out_pos += total;
+  hist_from = out_pos;
+  zst->hist_pos = 0;
+
+ out:
+  if (cbuf)
+    grub_free (cbuf);
+  if (par_jobs)
+    grub_free (par_jobs);
+  if (par_decs)
+    grub_free (par_decs);
+
+  return errnum ? 0 : total;
+}
+
+/* Decode the frame at SRC, which is no longer than LEN bytes, into
+   DEST, which holds SIZE bytes, for file systems which keep extents
+   compressed with zstd.  Return the bytes it makes, or -1.  */
+int
+unzstd_buffer (char *src, int len, char *dest, int size)
+{
+  uch *buf = (uch *) src;
+  struct zstd_frame f;
+  struct zstd_dec *z;
+  ulg header;
+  int pos, last = 0, type, n, ret = -1;
+
+  if (len < 5 || load_le32 (buf, len, 0) != ZSTD_MAGIC)
+    return -1;
+
+  pos = 4 + zstd_header_len (buf[4]);
+  if (pos > len || ! zstd_parse_header (buf + 4, &f) || f.size > size)
+    return -1;
+
+  z = grub_malloc (sizeof (struct zstd_dec) + BLOCK_MAX);
+  if (! z)
+    return -1;
+  z->lit_buf = (uch *) (z + 1);
+
+  /* a frame which does not say how big it is still must fit */
+  zstd_start_frame (z, &f);
+  if (f.size < 0)
+    z->frame_size = size;
+  z->hist_buf = (uch *) dest;
+  z->hist_size = size;
+  z->hist_pos = 0;
+
+  while (! last)
+    {
+      if (pos + 3 > len)
+	goto out;
+
+      header = load_le32 (buf, len, pos) & 0xffffff;
+      last = header & 1;
+      type = (header >> 1) & 3;
+      n = header >> 3;
+      pos += 3;
+      if (type == 3 || (type == 1 ? 1 : n) > len - pos
+	  || zstd_block_data (z, type, n, buf + pos) < 0)
+	goto out;
+      pos += type == 1 ? 1 : n;
+    }
+
+  if (f.size < 0 || z->frame_out == f.size)
+    ret = z->frame_out;
+
+ out:
+  grub_free (z);
+  return ret;
+}
+#endif /* PLATFORM_EFI && ! GRUB_UTIL */
+
+
+int
+unzstd_test_header (unsigned char *magic)
+{
+  ulg window;
+  int size;
+
+  /* "magic" holds the first ten bytes of the file */
+  if (((magic[0] | (magic[1] << 8) | (magic[2] << 16)
+	| ((ulg) magic[3] << 24)) & SKIPPABLE_MASK) != SKIPPABLE_MAGIC
+      && (magic[0] != 0x28 || magic[1] != 0xb5
+	  || magic[2] != 0x2f || magic[3] != 0xfd))
+    {
+      filepos = 0;
+      return 1;
+    }
+
+  if (unzstd_top () < 0x100000)
+    {
+      errnum = ERR_WONT_FIT;
+      return 0;
+    }
+
+  inbuf = (uch *) RAW_ADDR (unzstd_top ());
+  zst = (struct zstd_dec *) (inbuf + INBUFSIZ);
+
+  size = unzstd_scan (&window);
+  if (errnum)
+    return 0;
+
+  if (! unzstd_alloc (window, size))
+    {
+      errnum = ERR_WONT_FIT;
+      return 0;
+    }
+
+  /* no size given, so decode it all to find out */
+  if (size < 0)
+    {
+      unzstd_restart ();
+      while (in_frame || zstd_frame_header ())
+	{
+	  zstd_block ();
+	  if (errnum)
+	    return 0;
+	}
+      if (errnum)
+	return 0;
+      size = out_pos;
+
+      /* and now that it is known, keep no more history than that */
+      unzstd_alloc (window, size);
+    }
+
+  unzstd_restart ();
+
+  zst_fsmax = zst_filemax = size;
+  compressed_file = COMPRESSED_ZSTD;
+  unzstd_swap_values ();
+  /*
+   *  Now "zst_*" values refer to the compressed data.
+   */
+
+  filepos = 0;
+
+  return 1;
+}
+
+
+int
+unzstd_read (char *buf, int len)
+{
+  int ret = 0;
+
+  compressed_file = 0;
+  unzstd_swap_values ();
+  /*
+   *  Now "zst_*" values refer to the uncompressed data.
+   */
+
+  /* is the data wanted still in the history? */
+  if (zst_filepos < out_pos - (int) (out_pos < zst->hist_size
+				     ? out_pos : zst->hist_size)
+      || zst_filepos < hist_from)
+    unzstd_restart ();
+
+#if defined(PLATFORM_EFI) && ! defined(GRUB_UTIL)
+  if (zst_filepos == out_pos && ! in_frame)
+    {
+      int size = unzstd_parallel ((uch *) buf, len);
+
+      buf += size;
+      len -= size;
+      zst_filepos += size;
+      ret += size;
+    }
+#endif
+
+  while (len > 0 && ! errnum)
+    {
+      int size, back, offset;
+
+      if (zst_filepos >= out_pos)
+	{
+	  zstd_block ();
+	  continue;
+	}
+
+      back = out_pos - zst_filepos;
+      offset = zst->hist_pos - back;
+      if (offset < 0)
+	offset += zst->hist_size;
+
+      size = back;
+      if (size > len)
+	size = len;
+      if (size > zst->hist_size - offset)
+	size = zst->hist_size - offset;
+
+      grub_memmove (buf, (char *) zst->hist_buf + offset, size);
+
+      buf += size;
+      len -= size;
+      zst_filepos += size;
+      ret += size;
+    }
+
+  compressed_file = COMPRESSED_ZSTD;
+  unzstd_swap_values ();
+  /*
+   *  Now "zst_*" values refer to the compressed data.
+   */
+
+  if (errnum)
+    ret = 0;
+
+  return ret;
+}
+
+#endif /* ! NO_DECOMPRESSION */
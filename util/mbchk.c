@@ -21,19 +21,60 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef HAVE_LIBPTHREAD
+# include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
 #include <multiboot.h>
 
+/* The header has to be in the first 8K of the file.  */
+#define MULTIBOOT_SEARCH	8192
+
 static int quiet = 0;
-static char *optstring = "hvq";
+static int machine = 0;
+static int jobs = 0;
+static char *optstring = "hvqmj:";
 static struct option longopts[] =
 {
   {"help", no_argument, 0, 'h'},
   {"version", no_argument, 0, 'v'},
   {"quiet", no_argument, 0, 'q'},
+  {"machine", no_argument, 0, 'm'},
+  {"jobs", required_argument, 0, 'j'},
   {0}
 };
 
+/* The header as it is in the file, whose fields are 32 bits whatever
+   the size of a long is here.  */
+struct header
+{
+  unsigned int magic;
+  unsigned int flags;
+  unsigned int checksum;
+  unsigned int header_addr;
+  unsigned int load_addr;
+  unsigned int load_end_addr;
+  unsigned int bss_end_addr;
+  unsigned int entry_addr;
+};
+
+/* What the checks found in a file.  They stop at the first failure,
+   which MESSAGE tells.  */
+struct result
+{
+  const char *filename;
+  int offset;			/* where the header is, or -1 */
+  int flags_checked;		/* whether FLAGS passed its checks */
+  unsigned int flags;
+  char message[160];		/* the failure, or empty */
+};
+
 static void
 usage (int status)
 {
@@ -44,6 +85,10 @@ usage (int status)
 	    "Check if the format of FILE complies with the Multiboot Specification.\n"
 	    "\n"
 	    "-q, --quiet                suppress all normal output\n"
+	    "-m, --machine              print a line of tab-separated fields\n"
+	    "                           for every FILE\n"
+	    "-j, --jobs=N               check N files at a time\n"
+	    "                           [default=the number of processors]\n"
 	    "-h, --help                 display this help and exit\n"
 	    "-v, --version              output version information and exit.\n"
 	    "\n"
@@ -52,139 +97,276 @@ usage (int status)
   exit (status);
 }
 
+/* Check the first LEN bytes of the file, at BUF, and put what was
+   found in RES.  Return non-zero if all the checks passed.  */
 static int
-check_multiboot (const char *filename, FILE *fp)
+check_multiboot (const char *buf, int len, struct result *res)
 {
-  multiboot_header_t *mbh = 0;
+  struct header mbh;
   int i;
-  char buf[8192];
-
-  if (fread (buf, 1, 8192, fp) < 0)
-    {
-      fprintf (stderr, "%s: Read error.\n", filename);
-      return 0;
-    }
 
-  for (i = 0; i < 8192 - sizeof (multiboot_header_t); i++)
+  for (i = 0; i + (int) sizeof (mbh) <= len; i++)
     {
-      unsigned long magic = *((unsigned long *) (buf + i));
+      unsigned int magic;
 
+      memcpy (&magic, buf + i, sizeof (magic));
       if (magic == MULTIBOOT_HEADER_MAGIC)
 	{
-	  mbh = (multiboot_header_t *) (buf + i);
+	  memcpy (&mbh, buf + i, sizeof (mbh));
+	  res->offset = i;
 	  break;
 	}
     }
 
-  if (! mbh)
+  if (res->offset < 0)
     {
-      fprintf (stderr, "%s: No Multiboot header.\n", filename);
+      sprintf (res->message, "No Multiboot header.");
       return 0;
     }
 
-  if (! quiet)
-    printf ("%s: The Multiboot header is found at the offset %d.\n",
-	    filename, i);
-
   /* Check for the checksum.  */
-  if (mbh->magic + mbh->flags + mbh->checksum != 0)
+  if (mbh.magic + mbh.flags + mbh.checksum != 0)
     {
-      fprintf (stderr,
-	       "%s: Bad checksum (0x%lx).\n",
-	       filename, mbh->checksum);
+      sprintf (res->message, "Bad checksum (0x%x).", mbh.checksum);
       return 0;
     }
 
   /* Reserved flags must be zero.  */
-  if (mbh->flags & ~0x00010003)
+  if (mbh.flags & ~0x00010003)
     {
-      fprintf (stderr,
-	       "%s: Non-zero is found in reserved flags (0x%lx).\n",
-	       filename, mbh->flags);
+      sprintf (res->message,
+	       "Non-zero is found in reserved flags (0x%x).", mbh.flags);
       return 0;
     }
 
-  if (! quiet)
-    {
-      printf ("%s: Page alignment is turned %s.\n",
-	      filename, (mbh->flags & 0x1)? "on" : "off");
-      printf ("%s: Memory information is turned %s.\n",
-	      filename, (mbh->flags & 0x2)? "on" : "off");
-      printf ("%s: Address fields is turned %s.\n",
-	      filename, (mbh->flags & 0x10000)? "on" : "off");
-    }
+  res->flags_checked = 1;
+  res->flags = mbh.flags;
 
   /* Check for the address fields.  */
-  if (mbh->flags & 0x10000)
+  if (mbh.flags & 0x10000)
     {
-      if (mbh->header_addr < mbh->load_addr)
+      if (mbh.header_addr < mbh.load_addr)
 	{
-	  fprintf (stderr,
-		   "%s: header_addr is less than "
-		   "load_addr (0x%lx > 0x%lx).\n",
-		   filename, mbh->header_addr, mbh->load_addr);
+	  sprintf (res->message,
+		   "header_addr is less than "
+		   "load_addr (0x%x > 0x%x).",
+		   mbh.header_addr, mbh.load_addr);
 	  return 0;
 	}
 
-      if (mbh->load_end_addr && mbh->load_addr >= mbh->load_end_addr)
+      if (mbh.load_end_addr && mbh.load_addr >= mbh.load_end_addr)
 	{
-	  fprintf (stderr,
-		   "%s: load_addr is not less than load_end_addr"
-		   " (0x%lx >= 0x%lx).\n",
-		   filename, mbh->load_addr, mbh->load_end_addr);
+	  sprintf (res->message,
+		   "load_addr is not less than load_end_addr"
+		   " (0x%x >= 0x%x).",
+		   mbh.load_addr, mbh.load_end_addr);
 	  return 0;
 	}
 
-      if (mbh->bss_end_addr && mbh->load_end_addr > mbh->bss_end_addr)
+      if (mbh.bss_end_addr && mbh.load_end_addr > mbh.bss_end_addr)
 	{
-	  fprintf (stderr,
-		   "%s: load_end_addr is greater than bss_end_addr"
-		   " (0x%lx > 0x%lx).\n",
-		   filename, mbh->load_end_addr, mbh->bss_end_addr);
+	  sprintf (res->message,
+		   "load_end_addr is greater than bss_end_addr"
+		   " (0x%x > 0x%x).",
+		   mbh.load_end_addr, mbh.bss_end_addr);
 	  return 0;
 	}
 
-      if (mbh->load_addr > mbh->entry_addr)
+      if (mbh.load_addr > mbh.entry_addr)
 	{
-	  fprintf (stderr,
-		   "%s: load_addr is greater than entry_addr"
-		   " (0x%lx > 0x%lx).\n",
-		   filename, mbh->load_addr, mbh->entry_addr);
+	  sprintf (res->message,
+		   "load_addr is greater than entry_addr"
+		   " (0x%x > 0x%x).",
+		   mbh.load_addr, mbh.entry_addr);
 	  return 0;
 	}
 
       /* FIXME: It is better to check if the entry address is within the
 	 file, especially when the load end address is zero.  */
-      if (mbh->load_end_addr && mbh->load_end_addr <= mbh->entry_addr)
+      if (mbh.load_end_addr && mbh.load_end_addr <= mbh.entry_addr)
 	{
-	  fprintf (stderr,
-		   "%s: load_end_addr is not greater than entry_addr"
-		   " (0x%lx <= 0x%lx).\n",
-		   filename, mbh->load_end_addr, mbh->entry_addr);
+	  sprintf (res->message,
+		   "load_end_addr is not greater than entry_addr"
+		   " (0x%x <= 0x%x).",
+		   mbh.load_end_addr, mbh.entry_addr);
 	  return 0;
 	}
 
       /* This is a GRUB-specific limitation.  */
-      if (mbh->load_addr < 0x100000)
+      if (mbh.load_addr < 0x100000)
 	{
-	  fprintf (stderr,
-		   "%s: Cannot be loaded at less than 1MB by GRUB"
-		   " (0x%lx).\n",
-		   filename, mbh->load_addr);
+	  sprintf (res->message,
+		   "Cannot be loaded at less than 1MB by GRUB"
+		   " (0x%x).",
+		   mbh.load_addr);
 	  return 0;
 	}
     }
 
+  return 1;
+}
+
+/* Check the file open as FD.  Only the first 8K of it is looked at,
+   which is mapped if the file is a regular one, and read otherwise.  */
+static void
+check_fd (int fd, struct result *res)
+{
+  struct stat st;
+  char buf[MULTIBOOT_SEARCH];
+  char *map;
+  int len, n;
+
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0)
+    {
+      len = st.st_size < MULTIBOOT_SEARCH ? st.st_size : MULTIBOOT_SEARCH;
+      map = mmap (0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+	{
+	  check_multiboot (map, len, res);
+	  munmap (map, len);
+	  return;
+	}
+    }
+
+  for (len = 0; len < MULTIBOOT_SEARCH; len += n)
+    {
+      n = read (fd, buf + len, MULTIBOOT_SEARCH - len);
+      if (n < 0)
+	{
+	  sprintf (res->message, "Read error.");
+	  return;
+	}
+      if (n == 0)
+	break;
+    }
+
+  check_multiboot (buf, len, res);
+}
+
+static void
+check_file (struct result *res)
+{
+  int fd;
+
+  fd = open (res->filename, O_RDONLY);
+  if (fd < 0)
+    {
+      sprintf (res->message, "No such file.");
+      return;
+    }
+
+  check_fd (fd, res);
+  close (fd);
+}
+
+static struct result *results;
+static int num_results;
+static int next_result;
+
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t result_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+check_thread (void *arg)
+{
+  while (1)
+    {
+      int i;
+
+      pthread_mutex_lock (&result_lock);
+      i = next_result++;
+      pthread_mutex_unlock (&result_lock);
+
+      if (i >= num_results)
+	return 0;
+
+      check_file (&results[i]);
+    }
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/* Check all the files, JOBS of them at a time where threads are to be
+   had.  Most of the time goes into opening and reading them, so even
+   one processor is kept busier with a few.  */
+static void
+check_files (void)
+{
+  int i;
+#ifdef HAVE_LIBPTHREAD
+  pthread_t *threads;
+  int num_threads = 0;
+
+  if (jobs <= 0)
+    jobs = sysconf (_SC_NPROCESSORS_ONLN);
+  if (jobs > num_results)
+    jobs = num_results;
+
+  threads = malloc (jobs * sizeof (*threads));
+  for (i = 0; threads && jobs > 1 && i < jobs; i++)
+    {
+      if (pthread_create (&threads[num_threads], 0, check_thread, 0) != 0)
+	break;
+      num_threads++;
+    }
+
+  for (i = 0; i < num_threads; i++)
+    pthread_join (threads[i], 0);
+  free (threads);
+#endif /* HAVE_LIBPTHREAD */
+
+  /* Whatever no thread took, if there were none.  */
+  for (i = next_result; i < num_results; i++)
+    check_file (&results[i]);
+}
+
+/* Print what was found in a file, as mbchk always has, the failure on
+   the standard error.  Return non-zero if all the checks passed.  */
+static int
+print_result (struct result *res)
+{
+  if (! quiet && res->offset >= 0)
+    printf ("%s: The Multiboot header is found at the offset %d.\n",
+	    res->filename, res->offset);
+
+  if (! quiet && res->flags_checked)
+    {
+      printf ("%s: Page alignment is turned %s.\n",
+	      res->filename, (res->flags & 0x1)? "on" : "off");
+      printf ("%s: Memory information is turned %s.\n",
+	      res->filename, (res->flags & 0x2)? "on" : "off");
+      printf ("%s: Address fields is turned %s.\n",
+	      res->filename, (res->flags & 0x10000)? "on" : "off");
+    }
+
+  if (res->message[0])
+    {
+      fflush (stdout);
+      fprintf (stderr, "%s: %s\n", res->filename, res->message);
+      return 0;
+    }
+
   if (! quiet)
-    printf ("%s: All checks passed.\n", filename);
+    printf ("%s: All checks passed.\n", res->filename);
 
   return 1;
 }
 
+/* Print the file name, ``ok'' or ``failed'', the offset of the header
+   or -1, its flags, and the failure, separated by tabs.  */
+static int
+print_result_machine (struct result *res)
+{
+  printf ("%s\t%s\t%d\t0x%x\t%s\n", res->filename,
+	  res->message[0] ? "failed" : "ok", res->offset,
+	  res->flags_checked ? res->flags : 0, res->message);
+
+  return ! res->message[0];
+}
+
 int
 main (int argc, char *argv[])
 {
-  int c;
+  int c, i, status = 0;
 
   do
     {
@@ -207,6 +389,16 @@ main (int argc, char *argv[])
 	  quiet = 1;
 	  break;
 
+	case 'm':
+	  machine = 1;
+	  break;
+
+	case 'j':
+	  jobs = atoi (optarg);
+	  if (jobs <= 0)
+	    usage (1);
+	  break;
+
 	default:
 	  usage (1);
 	  break;
@@ -214,31 +406,43 @@ main (int argc, char *argv[])
     }
   while (c != EOF);
 
+  num_results = optind < argc ? argc - optind : 1;
+  results = calloc (num_results, sizeof (*results));
+  if (! results)
+    {
+      fprintf (stderr, "Out of memory.\n");
+      exit (1);
+    }
+
   if (optind < argc)
     {
-      while (optind < argc)
+      for (i = 0; i < num_results; i++)
 	{
-	  FILE *fp;
-
-	  fp = fopen (argv[optind], "r");
-	  if (! fp)
-	    {
-	      fprintf (stderr, "%s: No such file.\n", argv[optind]);
-	      exit (1);
-	    }
-
-	  if (! check_multiboot (argv[optind], fp))
-	    exit (1);
-
-	  fclose (fp);
-	  optind++;
+	  results[i].filename = argv[optind + i];
+	  results[i].offset = -1;
 	}
+      check_files ();
     }
   else
     {
-      if (! check_multiboot ("<stdin>", stdin))
-	exit (1);
+      results[0].filename = "<stdin>";
+      results[0].offset = -1;
+      check_fd (0, &results[0]);
     }
 
-  return 0;
+  /* Stop at the first failure, as the files were checked one by one
+     before, unless every one is to be told about.  */
+  for (i = 0; i < num_results; i++)
+    if (machine)
+      {
+	if (! print_result_machine (&results[i]))
+	  status = 1;
+      }
+    else if (! print_result (&results[i]))
+      {
+	status = 1;
+	break;
+      }
+
+  return status;
 }